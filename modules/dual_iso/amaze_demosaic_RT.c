@@ -32,22 +32,42 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
 
 #include "amaze-port.c"
 
-void amaze_demosaic_RT(
-    float** rawData,    /* holds preprocessed pixel values, rawData[i][j] corresponds to the ith row and jth column */
-    float** red,        /* the interpolated red plane */
-    float** green,      /* the interpolated green plane */
-    float** blue,       /* the interpolated blue plane */
-    int winx, int winy, /* crop window for demosaicing */
-    int winw, int winh
-)
+/* shared by all the threads working on one image */
+struct amaze_tiles
 {
-    printf ("AMaZE interpolation ...\n");
-
-    clock_t	t1,t2;
-    t1 = clock();
+    float** rawData;
+    float** red;
+    float** green;
+    float** blue;
+    int winx, winy;
+    int winw, winh;
+    int tiles_x;        /* tiles in one row */
+    int num_tiles;
+    int next_tile;      /* the next tile to be processed, incremented atomically */
+};
+
+/* one thread, taking tiles until there are none left
+ * each tile writes only its own interior (tiles overlap by their 16-pixel borders, which are only read),
+ * so the result doesn't depend on which thread processes which tile */
+static void* amaze_demosaic_worker(void* arg)
+{
+	struct amaze_tiles* tiles = arg;
+	float** rawData = tiles->rawData;
+	float** red = tiles->red;
+	float** green = tiles->green;
+	float** blue = tiles->blue;
+	int winx = tiles->winx, winy = tiles->winy;
+	int winw = tiles->winw, winh = tiles->winh;
 
 #define HCLIP(x) x //is this still necessary???
 	//min(clip_pt,x)
@@ -166,7 +186,8 @@ void amaze_demosaic_RT(
 
 #define CLF 1
 	// assign working space
-	buffer = (char *) calloc(22*sizeof(float)*TS*TS + sizeof(char)*TS*TSH+23*CLF*64 + 63, 1);
+	size_t buffer_size = 22*sizeof(float)*TS*TS + sizeof(char)*TS*TSH+23*CLF*64 + 63;
+	buffer = (char *) calloc(buffer_size, 1);
 	char 	*data;
 	data = (char*)( ( (uintptr_t)buffer + (uintptr_t)63) / 64 * 64);
 
@@ -214,8 +235,10 @@ void amaze_demosaic_RT(
 // Issue 1676
 // use collapse(2) to collapse the 2 loops to one large loop, so there is better scaling
 //~ #pragma omp for schedule(dynamic) collapse(2) nowait
-	for (top=winy-16; top < winy+height; top += TS-32)
-		for (left=winx-16; left < winx+width; left += TS-32) {
+	int tile;
+	while ((tile = __sync_fetch_and_add(&tiles->next_tile, 1)) < tiles->num_tiles) {
+			top = winy-16 + (tile / tiles->tiles_x) * (TS-32);
+			left = winx-16 + (tile % tiles->tiles_x) * (TS-32);
 			memset(nyquist, 0, sizeof(char)*TS*TSH);
 			memset(rbint, 0, sizeof(float)*TS*TSH);
 			//location of tile bottom edge
@@ -227,6 +250,11 @@ void amaze_demosaic_RT(
 			//tile height (=TS except for bottom edge of image)
 			int cc1 = right - left;
 
+			// tiles on the window edges read a few values they don't write (near rrmax/ccmax);
+			// start them from a clean buffer, so they don't pick up whatever tile this thread did before
+			if (top < winy || left < winx || bottom > winy+height || right > winx+width)
+				memset(buffer, 0, buffer_size);
+
 			//tile vars
 			//counters for pixel location in the image
 			int row, col;
@@ -1402,11 +1430,62 @@ void amaze_demosaic_RT(
 	free(buffer);
 }
 
-	// done
+	return 0;
+}
 
-#undef TS
+/* also used by cr2hdr for its default number of threads */
+int amaze_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
 
-t2 = clock() - t1;
-printf("Amaze took %.2f s\n", (double)t2 / CLOCKS_PER_SEC);
+void amaze_demosaic_RT(
+    float** rawData,    /* holds preprocessed pixel values, rawData[i][j] corresponds to the ith row and jth column */
+    float** red,        /* the interpolated red plane */
+    float** green,      /* the interpolated green plane */
+    float** blue,       /* the interpolated blue plane */
+    int winx, int winy, /* crop window for demosaicing */
+    int winw, int winh,
+    int threads         /* 0 = one per CPU core */
+)
+{
+    struct timeval t1, t2;
+    gettimeofday(&t1, 0);
 
+    /* same tiles as the original single-threaded loop: TS x TS, starting 16 pixels outside the window, TS-32 apart */
+    struct amaze_tiles tiles = {
+        .rawData = rawData, .red = red, .green = green, .blue = blue,
+        .winx = winx, .winy = winy, .winw = winw, .winh = winh,
+        .tiles_x = (winw + 16 + TS-33) / (TS-32),
+    };
+    tiles.num_tiles = tiles.tiles_x * ((winh + 16 + TS-33) / (TS-32));
+
+    if (threads <= 0)
+        threads = amaze_cpu_count();
+    threads = COERCE(threads, 1, tiles.num_tiles);
+
+    printf ("AMaZE interpolation (%d thread%s)...\n", threads, threads > 1 ? "s" : "");
+
+    /* the calling thread is one of the workers */
+    pthread_t* workers = malloc(threads * sizeof(workers[0]));
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], 0, amaze_demosaic_worker, &tiles) == 0)
+        started++;
+
+    amaze_demosaic_worker(&tiles);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], 0);
+    free(workers);
+
+    gettimeofday(&t2, 0);
+    printf("Amaze took %.2f s\n", (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) * 1e-6);
 }
+
+#undef TS
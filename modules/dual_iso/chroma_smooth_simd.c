@@ -0,0 +1,336 @@
+/*
+ * SIMD version of chroma_smooth.c, bit exact.
+ *
+ * The scalar filter converts the same RG/GB cells to EV for every window they are part of
+ * (up to 25 times for 5x5). Here, R and B minus the green estimate of every cell are computed
+ * once into two planes, then the medians of 4 (SSE2) or 8 (AVX2) neighbouring cells go through
+ * one run of the sorting network from ../mlv_rec/raw_proc/opt_med_simd.h.
+ * Both steps are split into bands of rows, one per thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "../mlv_rec/raw_proc/opt_med_simd.h"
+#include "chroma_smooth_simd.h"
+
+#define EV_RESOLUTION 65536
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+
+#define MAX_THREADS 64
+
+#ifdef OPT_MED_X86
+
+struct cs_frame
+{
+    int avx2;
+    int w, h;
+    int cw;                 /* cells per plane row */
+    uint32_t * inp;
+    uint32_t * out;
+    int* raw2ev;
+    int* ev2raw;
+
+    int n;                  /* window size */
+    int off[25];            /* plane offsets of the window cells, in the order of the scalar filter */
+
+    int cx0, cx1;           /* output cells */
+    int cy0, cy1;
+    int pcx0, pcx1;         /* plane cells needed by them */
+    int pcy0, pcy1;
+
+    int32_t* dr;            /* R minus the green estimate of the cell, in EV */
+    int32_t* db;            /* B minus the green estimate */
+};
+
+struct cs_band
+{
+    struct cs_frame* f;
+    int phase;              /* 0 = planes, 1 = output */
+    int y0, y1;             /* cell rows */
+};
+
+static void planes_row(struct cs_frame* f, int cy)
+{
+    int w = f->w;
+    int* raw2ev = f->raw2ev;
+    uint32_t * inp = f->inp;
+
+    for (int cx = f->pcx0; cx < f->pcx1; cx++)
+    {
+        /* flat index: on odd widths, the last cells read the start of the next row, like the scalar filter does */
+        int p = 2*cx + 2*cy * w;
+        int r  = inp[p];
+        int g1 = inp[p + 1];
+        int g2 = inp[p + w];
+        int b  = inp[p + w + 1];
+
+        int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
+        f->dr[cx + cy * f->cw] = raw2ev[r] - ge;
+        f->db[cx + cy * f->cw] = raw2ev[b] - ge;
+    }
+}
+
+/* medians of the cells [cx, cx1) of row 'cy' */
+static void medians_scalar(struct cs_frame* f, int cy, int cx, int32_t* dr, int32_t* db)
+{
+    for ( ; cx < f->cx1; cx++)
+    {
+        int c = cx + cy * f->cw;
+        int med_r[25];
+        int med_b[25];
+        for (int k = 0; k < f->n; k++)
+        {
+            med_r[k] = f->dr[c + f->off[k]];
+            med_b[k] = f->db[c + f->off[k]];
+        }
+        dr[cx] = opt_med_scalar(med_r, f->n);
+        db[cx] = opt_med_scalar(med_b, f->n);
+    }
+}
+
+/* these return the first cell they did not process */
+OPT_MED_KERNEL OPT_MED_TARGET_SSE2 int sse2_medians(struct cs_frame* f, int cy, int32_t* dr, int32_t* db, const int n)
+{
+    int cx;
+    for (cx = f->cx0; cx + 4 <= f->cx1; cx += 4)
+    {
+        int c = cx + cy * f->cw;
+        __m128i med_r[25];
+        __m128i med_b[25];
+        for (int k = 0; k < n; k++)
+        {
+            med_r[k] = _mm_loadu_si128((const __m128i*)&f->dr[c + f->off[k]]);
+            med_b[k] = _mm_loadu_si128((const __m128i*)&f->db[c + f->off[k]]);
+        }
+        _mm_storeu_si128((__m128i*)&dr[cx], opt_med_sse2(med_r, n));
+        _mm_storeu_si128((__m128i*)&db[cx], opt_med_sse2(med_b, n));
+    }
+    return cx;
+}
+
+OPT_MED_KERNEL OPT_MED_TARGET_AVX2 int avx2_medians(struct cs_frame* f, int cy, int32_t* dr, int32_t* db, const int n)
+{
+    int cx;
+    for (cx = f->cx0; cx + 8 <= f->cx1; cx += 8)
+    {
+        int c = cx + cy * f->cw;
+        __m256i med_r[25];
+        __m256i med_b[25];
+        for (int k = 0; k < n; k++)
+        {
+            med_r[k] = _mm256_loadu_si256((const __m256i*)&f->dr[c + f->off[k]]);
+            med_b[k] = _mm256_loadu_si256((const __m256i*)&f->db[c + f->off[k]]);
+        }
+        _mm256_storeu_si256((__m256i*)&dr[cx], opt_med_avx2(med_r, n));
+        _mm256_storeu_si256((__m256i*)&db[cx], opt_med_avx2(med_b, n));
+    }
+    return cx;
+}
+
+/* one instance per window size, so the networks are unrolled */
+static OPT_MED_TARGET_SSE2 int medians_sse2(struct cs_frame* f, int cy, int32_t* dr, int32_t* db)
+{
+    switch (f->n)
+    {
+        case 5:  return sse2_medians(f, cy, dr, db, 5);
+        case 9:  return sse2_medians(f, cy, dr, db, 9);
+        case 25: return sse2_medians(f, cy, dr, db, 25);
+    }
+    return f->cx0;
+}
+
+static OPT_MED_TARGET_AVX2 int medians_avx2(struct cs_frame* f, int cy, int32_t* dr, int32_t* db)
+{
+    switch (f->n)
+    {
+        case 5:  return avx2_medians(f, cy, dr, db, 5);
+        case 9:  return avx2_medians(f, cy, dr, db, 9);
+        case 25: return avx2_medians(f, cy, dr, db, 25);
+    }
+    return f->cx0;
+}
+
+/* same decisions as chroma_smooth.c */
+static void output_row(struct cs_frame* f, int cy, int32_t* dr, int32_t* db)
+{
+    int w = f->w;
+    int* raw2ev = f->raw2ev;
+    int* ev2raw = f->ev2raw;
+    uint32_t * inp = f->inp;
+    uint32_t * out = f->out;
+    int y = 2*cy;
+
+    for (int cx = f->cx0; cx < f->cx1; cx++)
+    {
+        int x = 2*cx;
+        int g1 = inp[x+1 +     y * w];
+        int g2 = inp[x   + (y+1) * w];
+        int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
+
+        /* looks ugly in darkness */
+        if (ge < 2*EV_RESOLUTION) continue;
+
+        if (ge + dr[cx] <= EV_RESOLUTION) continue;
+        if (ge + db[cx] <= EV_RESOLUTION) continue;
+
+        out[x   +     y * w] = ev2raw[COERCE(ge + dr[cx], 0, 14*EV_RESOLUTION-1)];
+        out[x+1 + (y+1) * w] = ev2raw[COERCE(ge + db[cx], 0, 14*EV_RESOLUTION-1)];
+    }
+}
+
+static void* chroma_smooth_band(void* arg)
+{
+    struct cs_band* band = arg;
+    struct cs_frame* f = band->f;
+
+    if (band->phase == 0)
+    {
+        for (int cy = band->y0; cy < band->y1; cy++)
+            planes_row(f, cy);
+        return 0;
+    }
+
+    int32_t* dr = malloc(2 * f->cw * sizeof(dr[0]));
+    if (!dr)
+        return (void*)1;
+    int32_t* db = dr + f->cw;
+
+    for (int cy = band->y0; cy < band->y1; cy++)
+    {
+        int cx = f->avx2 ? medians_avx2(f, cy, dr, db) : medians_sse2(f, cy, dr, db);
+        medians_scalar(f, cy, cx, dr, db);
+        output_row(f, cy, dr, db);
+    }
+
+    free(dr);
+    return 0;
+}
+
+/* rows [y0, y1) split in 'threads' bands, the calling thread takes the first one */
+static int run_bands(struct cs_frame* f, int phase, int y0, int y1, int threads)
+{
+    struct cs_band bands[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int started[MAX_THREADS];
+    int failed = 0;
+
+    threads = COERCE(threads, 1, MAX(1, y1 - y0));
+
+    for (int t = 0; t < threads; t++)
+    {
+        bands[t].f = f;
+        bands[t].phase = phase;
+        bands[t].y0 = y0 + (y1 - y0) * t / threads;
+        bands[t].y1 = y0 + (y1 - y0) * (t+1) / threads;
+    }
+
+    for (int t = 1; t < threads; t++)
+        started[t] = pthread_create(&tid[t], 0, chroma_smooth_band, &bands[t]) == 0;
+
+    failed |= chroma_smooth_band(&bands[0]) != 0;
+
+    for (int t = 1; t < threads; t++)
+    {
+        void* ret = 0;
+        if (started[t])
+            pthread_join(tid[t], &ret);
+        else
+            ret = chroma_smooth_band(&bands[t]);
+        failed |= ret != 0;
+    }
+
+    return !failed;
+}
+
+static int cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+int chroma_smooth_simd(int method, int w, int h, uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw, int threads)
+{
+    if (method != 2 && method != 3 && method != 5)
+        return 0;
+
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2"))
+        return 0;
+
+    struct cs_frame f = {
+#ifdef CHROMA_SMOOTH_SSE2_ONLY
+        .avx2 = 0,              /* lets the tests cover the SSE2 code on AVX2 machines */
+#else
+        .avx2 = __builtin_cpu_supports("avx2"),
+#endif
+        .w = w, .h = h,
+        .cw = w/2 + 1,
+        .inp = inp, .out = out,
+        .raw2ev = raw2ev, .ev2raw = ev2raw,
+    };
+
+    /* the window of chroma_smooth.c (CHROMA_SMOOTH_MAX_IJ) */
+    int max_ij = method == 5 ? 4 : 2;
+    for (int i = -max_ij; i <= max_ij; i += 2)
+    {
+        for (int j = -max_ij; j <= max_ij; j += 2)
+        {
+            if (method == 2 && ABS(i) + ABS(j) == 4)
+                continue;
+            f.off[f.n++] = i/2 + (j/2) * f.cw;
+        }
+    }
+
+    /* the scalar loops: x from 4 to w-4, y from 4 to h-5, both even */
+    f.cx0 = 2; f.cx1 = MAX(f.cx0, (w-4+1) / 2);
+    f.cy0 = 2; f.cy1 = MAX(f.cy0, (h-5+1) / 2);
+    if (f.cx0 == f.cx1 || f.cy0 == f.cy1)
+        return 1;
+
+    f.pcx0 = f.cx0 - max_ij/2; f.pcx1 = f.cx1 + max_ij/2;
+    f.pcy0 = f.cy0 - max_ij/2; f.pcy1 = f.cy1 + max_ij/2;
+
+    size_t plane_size = (size_t)f.cw * (h/2 + 1);
+    f.dr = malloc(2 * plane_size * sizeof(f.dr[0]));
+    if (!f.dr)
+        return 0;
+    f.db = f.dr + plane_size;
+
+    if (threads <= 0)
+        threads = cpu_count();
+    threads = COERCE(threads, 1, MAX_THREADS);
+
+    /* all planes must be ready before the windows of the band edges can be read */
+    int ok = run_bands(&f, 0, f.pcy0, f.pcy1, threads) &&
+             run_bands(&f, 1, f.cy0, f.cy1, threads);
+
+    free(f.dr);
+    return ok;
+}
+
+#else
+
+int chroma_smooth_simd(int method, int w, int h, uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw, int threads)
+{
+    return 0;
+}
+
+#endif
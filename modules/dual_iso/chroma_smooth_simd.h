@@ -0,0 +1,11 @@
+#ifndef _CHROMA_SMOOTH_SIMD_H
+#define _CHROMA_SMOOTH_SIMD_H
+
+#include <stdint.h>
+
+/* Vectorized and multithreaded version of the chroma_smooth.c filters (2x2, 3x3, 5x5), bit exact.
+ * Same arguments as the CHROMA_SMOOTH_FUNC()s, plus the image size and 'threads' (0 = one per CPU core).
+ * Returns 0 without touching 'out' if the CPU has no SSE2 (the caller should use the scalar filter then). */
+int chroma_smooth_simd(int method, int w, int h, uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw, int threads);
+
+#endif
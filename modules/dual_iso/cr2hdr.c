@@ -38,6 +38,13 @@ static int is_bright[4];
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <poll.h>
+#endif
 
 #include "../../src/raw.h"
 #include "../../src/chdk-dng.h"
@@ -52,6 +59,8 @@ static int is_bright[4];
 #include "dither.h"
 #include "timing.h"
 #include "kelvin.h"
+#include "dng-reader.h"
+#include "chroma_smooth_simd.h"
 
 #define MODULE_STRINGS_PREFIX dual_iso_strings
 #include "../module_strings_wrapper.h"
@@ -93,6 +102,9 @@ int compress = 0;
 int same_levels = 0;
 int skip_existing = 0;
 int embed_original = 0;
+int jobs = 1;
+int threads = 0;
+int worker = 0;
 
 int shortcut_fast = 0;
 
@@ -213,6 +225,9 @@ struct cmd_group options[] = {
                                     "                  To recover the original: exiftool IMG_1234.DNG -OriginalRawFileData -b > IMG_1234.CR2" },
             { &embed_original, 2, "--embed-original-copy",  "\n"
                                     "                  Similar to --embed-original, but without deleting the original.\n" },
+            { &jobs,           1, "--jobs=%d",      "Process N files in parallel (one cr2hdr process per file)" },
+            { &threads,        1, "--threads=%d",   "Use N threads for AMaZE interpolation and chroma smoothing (default: CPU cores / jobs)" },
+            { &worker,         1, "--worker",       NULL },
             OPTION_EOL
         },
     },
@@ -567,95 +582,36 @@ static int is_file(const char* filename)
     }
 }
 
-int main(int argc, char** argv)
+/* per-file results, needed after all files were processed (--same-levels) */
+struct file_result
 {
-    printf("cr2hdr: a post processing tool for Dual ISO images\n\n");
-    printf("Last update: %s\n", module_get_string(dual_iso_strings, "Last update"));
-
-    fast_randn_init();
+    int done;                   /* a DNG was written */
+    int black;
+    int white;
+};
 
-    if (argc == 1)
-    {
-        printf("No input files.\n\n");
-        printf("GUI usage: drag some CR2 or DNG files over cr2hdr.exe.\n\n");
-        show_commandline_help(argv[0]);
-        return 0;
-    }
-    
+/* reads the raw data of 'filename' into raw_info, with "dcraw -4 -E" semantics, and returns the margins of the active area */
+static int read_raw(const char* filename, int* left_margin, int* top_margin)
+{
     int r;
+    int raw_width = 0, raw_height = 0;
+    int out_width = 0, out_height = 0;
+    void* buf = 0;
 
-    /* parse all command-line options */
-    for (int k = 1; k < argc; k++)
-        if (argv[k][0] == '-')
-            parse_commandline_option(argv[k]);
-    
-    solve_commandline_deps();
-    show_active_options();
-    
-    /* keep track of black and white levels (useful for deflicker) */
-    /* (we will not have more than "argc" files) */
-    int* file_indices = malloc(argc * sizeof(file_indices[0]));
-    int* blacks = malloc(argc * sizeof(blacks[0]));
-    int* whites = malloc(argc * sizeof(whites[0]));
-    int num_files = 0;
-    
-    /* all other arguments are input files */
-    for (int k = 1; k < argc; k++)
+    /* DNGs are read in-process, without the dcraw round trip */
+    struct dng_raw dng;
+    if (dng_read_raw(filename, &dng))
     {
-        if (argv[k][0] == '-')
-            continue;
-        
-        char* filename = argv[k];
-
-        printf("\nInput file      : %s\n", filename);
-        int len = strlen(filename);
-
-        char orig_filename[1000]; orig_filename[0] = 0;
-        char out_filename[1000];
-
-        if (strcmp(filename+len-4, ".DNG") == 0)
-        {
-            /* this DNG might have embedded CR2 data inside */
-            /* note: we only save uppercase .DNGs, so a case-sensitive extension check should be fine */
-
-            if (dng_has_original_raw(filename))
-            {
-                snprintf(orig_filename, sizeof(orig_filename), "%s", filename);
-                orig_filename[len-3] = 'C';
-                orig_filename[len-2] = 'R';
-                orig_filename[len-1] = '2';
-                
-                if (is_file(orig_filename))
-                {
-                    printf("Already exists  : %s (error)\n", orig_filename);
-                    continue;
-                }
-
-                if (extract_original_raw(filename, orig_filename))
-                {
-                    /* use the extracted CR2 as input */
-                    filename = orig_filename;
-                }
-                else
-                {
-                    /* error message was already printed, now just skip this file */
-                    continue;
-                }
-            }
-        }
-
-        snprintf(out_filename, sizeof(out_filename), "%s", filename);
-        out_filename[len-3] = 'D';
-        out_filename[len-2] = 'N';
-        out_filename[len-1] = 'G';
-        
-        /* note: skip_existing will be ignored if we are working on a DNG file with embedded RAW */
-        if (skip_existing && is_file(out_filename) && !orig_filename[0])
-        {
-            printf("Already exists  : %s (skipping)\n", out_filename);
-            continue;
-        }
+        get_raw_info(dng.model[0] ? dng.model : get_camera_model(filename), &raw_info);
 
+        raw_width = dng.raw_width;
+        raw_height = dng.raw_height;
+        out_width = dng.out_width;
+        out_height = dng.out_height;
+        buf = dng.buffer;
+    }
+    else
+    {
         char dcraw_cmd[1000];
         snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -v -i -t 0 \"%s\"", filename);
         FILE* t = popen(dcraw_cmd, "r");
@@ -664,9 +620,6 @@ int main(int argc, char** argv)
         const char * model = get_camera_model(filename);
         get_raw_info(model, &raw_info);
 
-        int raw_width = 0, raw_height = 0;
-        int out_width = 0, out_height = 0;
-        
         char line[100];
         while (fgets(line, sizeof(line), t))
         {
@@ -686,15 +639,9 @@ int main(int argc, char** argv)
         if (raw_width == 0)
         {
             printf("dcraw could not open this file\n");
-            continue;
+            return 0;
         }
 
-        printf("Full size       : %d x %d\n", raw_width, raw_height);
-        printf("Active area     : %d x %d\n", out_width, out_height);
-        
-        int left_margin = raw_width - out_width;
-        int top_margin = raw_height - out_height;
-
         snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -4 -E -c -t 0 \"%s\"", filename);
         FILE* fp = popen(dcraw_cmd, "r");
         CHECK(fp, "%s", filename);
@@ -723,7 +670,7 @@ int main(int argc, char** argv)
         {
             pclose(fp);
             printf("dcraw output is not a valid PGM file\n");
-            continue;
+            return 0;
         }
 
         int width = dim[0];
@@ -731,142 +678,551 @@ int main(int argc, char** argv)
         CHECK(width == raw_width, "pgm width");
         CHECK(height == raw_height, "pgm height");
 
-        void* buf = malloc(width * (height+1) * 2); /* 1 extra line for handling GBRG easier */
+        buf = malloc(width * (height+1) * 2); /* 1 extra line for handling GBRG easier */
         int size = fread(buf, 1, width * height * 2, fp);
         CHECK(size == width * height * 2, "fread");
         pclose(fp);
 
         /* PGM is big endian, need to reverse it */
         reverse_bytes_order(buf, width * height * 2);
+    }
 
-        raw_info.buffer = buf;
-        
-        /* did we read the PGM correctly? (right byte order etc) */
-        //~ for (int i = 0; i < 10; i++)
-            //~ printf("%d ", raw_get_pixel16(i, 0));
-        //~ printf("\n");
-        
-        raw_info.black_level = 2048;
-        raw_info.white_level = 15000;
-
-        raw_info.width = width;
-        raw_info.height = height;
-        raw_info.pitch = width * 2;
-        raw_info.frame_size = raw_info.height * raw_info.pitch;
-
-        raw_info.active_area.x1 = left_margin;
-        raw_info.active_area.x2 = raw_info.width;
-        raw_info.active_area.y1 = top_margin;
-        raw_info.active_area.y2 = raw_info.height;
-        raw_info.jpeg.x = 0;
-        raw_info.jpeg.y = 0;
-        raw_info.jpeg.width = raw_info.width - left_margin;
-        raw_info.jpeg.height = raw_info.height - top_margin;
-        
-        dng_set_thumbnail_size(384, 252);
+    printf("Full size       : %d x %d\n", raw_width, raw_height);
+    printf("Active area     : %d x %d\n", out_width, out_height);
+    
+    *left_margin = raw_width - out_width;
+    *top_margin = raw_height - out_height;
+
+    int width = raw_width;
+    int height = raw_height;
+
+    raw_info.buffer = buf;
+    
+    /* did we read the PGM correctly? (right byte order etc) */
+    //~ for (int i = 0; i < 10; i++)
+        //~ printf("%d ", raw_get_pixel16(i, 0));
+    //~ printf("\n");
+    
+    raw_info.black_level = 2048;
+    raw_info.white_level = 15000;
 
-        if (hdr_check())
+    raw_info.width = width;
+    raw_info.height = height;
+    raw_info.pitch = width * 2;
+    raw_info.frame_size = raw_info.height * raw_info.pitch;
+
+    raw_info.active_area.x1 = *left_margin;
+    raw_info.active_area.x2 = raw_info.width;
+    raw_info.active_area.y1 = *top_margin;
+    raw_info.active_area.y2 = raw_info.height;
+    raw_info.jpeg.x = 0;
+    raw_info.jpeg.y = 0;
+    raw_info.jpeg.width = raw_info.width - *left_margin;
+    raw_info.jpeg.height = raw_info.height - *top_margin;
+
+    return 1;
+}
+
+/* converts one input file; all the image state lives in globals, so only one file per process at a time */
+static void process_file(char* filename, struct file_result* result)
+{
+    printf("\nInput file      : %s\n", filename);
+    int len = strlen(filename);
+
+    char orig_filename[1000]; orig_filename[0] = 0;
+    char out_filename[1000];
+
+    /* same dithering noise for each file, no matter where it is in the batch */
+    fast_randn_rewind();
+
+    if (strcmp(filename+len-4, ".DNG") == 0)
+    {
+        /* this DNG might have embedded CR2 data inside */
+        /* note: we only save uppercase .DNGs, so a case-sensitive extension check should be fine */
+
+        if (dng_has_original_raw(filename))
         {
-            if (!black_subtract(left_margin, top_margin))
-                printf("Black subtract didn't work\n");
+            snprintf(orig_filename, sizeof(orig_filename), "%s", filename);
+            orig_filename[len-3] = 'C';
+            orig_filename[len-2] = 'R';
+            orig_filename[len-1] = '2';
+            
+            if (is_file(orig_filename))
+            {
+                printf("Already exists  : %s (error)\n", orig_filename);
+                return;
+            }
 
-            if (hdr_interpolate())
+            if (extract_original_raw(filename, orig_filename))
             {
-                reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
+                /* use the extracted CR2 as input */
+                filename = orig_filename;
+            }
+            else
+            {
+                /* error message was already printed, now just skip this file */
+                return;
+            }
+        }
+    }
+
+    snprintf(out_filename, sizeof(out_filename), "%s", filename);
+    out_filename[len-3] = 'D';
+    out_filename[len-2] = 'N';
+    out_filename[len-1] = 'G';
+    
+    /* note: skip_existing will be ignored if we are working on a DNG file with embedded RAW */
+    if (skip_existing && is_file(out_filename) && !orig_filename[0])
+    {
+        printf("Already exists  : %s (skipping)\n", out_filename);
+        return;
+    }
+
+    int left_margin, top_margin;
+    if (!read_raw(filename, &left_margin, &top_margin))
+    {
+        return;
+    }
+    void* buf = raw_info.buffer;
+    
+    dng_set_thumbnail_size(384, 252);
 
-                /* This option doesn't really work, since Canon WB is broken with Dual ISO. */
-                if (exif_wb)
+    if (hdr_check())
+    {
+        if (!black_subtract(left_margin, top_margin))
+            printf("Black subtract didn't work\n");
+
+        if (hdr_interpolate())
+        {
+            reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
+
+            /* This option doesn't really work, since Canon WB is broken with Dual ISO. */
+            if (exif_wb)
+            {
+                float red_balance = -1, blue_balance = -1;
+                read_white_balance(filename, &red_balance, &blue_balance);
+                if ((red_balance > 0) && (blue_balance > 0))
                 {
-                    float red_balance = -1, blue_balance = -1;
-                    read_white_balance(filename, &red_balance, &blue_balance);
-                    if ((red_balance > 0) && (blue_balance > 0))
-                    {
-                        dng_set_wbgain(1000000, red_balance*1000000, 1, 1, 1000000, blue_balance*1000000);
-                        printf("AsShotNeutral   : %.2f 1 %.2f\n", 1/red_balance, 1/blue_balance);
-                    }
-                    else
-                    {
-                        printf("AsShotNeutral   : (using default values)\n");
-                    }
+                    dng_set_wbgain(1000000, red_balance*1000000, 1, 1, 1000000, blue_balance*1000000);
+                    printf("AsShotNeutral   : %.2f 1 %.2f\n", 1/red_balance, 1/blue_balance);
                 }
-                
-                char renamed_filename[1000];
-                char* old_filename = 0;
-                if (strcasecmp(filename, out_filename) == 0)
+                else
                 {
-                    /* if the filesystem is not case-sensitive, we will overwrite the input file */
-                    /* I don't know how to detect this in a portable way, so I'll rename the input file just in case */
-                    /* if no overwriting takes place, the renaming will be undone */
-                    //~ printf("Might overwrite input file.\n");
-                    snprintf(renamed_filename, sizeof(renamed_filename), "%s", filename);
-                    int len = strlen(renamed_filename);
-                    renamed_filename[len-1] = '6';
-                    rename(filename, renamed_filename);
-                    old_filename = filename;
-                    filename = renamed_filename;
+                    printf("AsShotNeutral   : (using default values)\n");
                 }
+            }
+            
+            char renamed_filename[1000];
+            char* old_filename = 0;
+            if (strcasecmp(filename, out_filename) == 0)
+            {
+                /* if the filesystem is not case-sensitive, we will overwrite the input file */
+                /* I don't know how to detect this in a portable way, so I'll rename the input file just in case */
+                /* if no overwriting takes place, the renaming will be undone */
+                //~ printf("Might overwrite input file.\n");
+                snprintf(renamed_filename, sizeof(renamed_filename), "%s", filename);
+                int len = strlen(renamed_filename);
+                renamed_filename[len-1] = '6';
+                rename(filename, renamed_filename);
+                old_filename = filename;
+                filename = renamed_filename;
+            }
 
-                if (orig_filename[0])
-                {
-                    dng_backup_metadata(out_filename);
-                }
+            if (orig_filename[0])
+            {
+                dng_backup_metadata(out_filename);
+            }
 
-                printf("Output file     : %s %s\n", out_filename, is_file(out_filename) ? "(already exists, overwriting)" : "");
-                save_dng(out_filename);
+            printf("Output file     : %s %s\n", out_filename, is_file(out_filename) ? "(already exists, overwriting)" : "");
+            save_dng(out_filename);
 
-                copy_tags_from_source(filename, out_filename);
+            copy_tags_from_source(filename, out_filename);
 
-                if (orig_filename[0])
-                {
-                    dng_restore_metadata(out_filename);
-                }
-                
-                if (compress)
+            if (orig_filename[0])
+            {
+                dng_restore_metadata(out_filename);
+            }
+            
+            if (compress)
+            {
+                dng_compress(out_filename, compress-1);
+            }
+            
+            if (embed_original || orig_filename[0])
+            {
+                /* this will move the input file into the DNG (and maybe delete the original) */
+                int delete_original = (embed_original != 2);
+                embed_original_raw(out_filename, filename, delete_original);
+            }
+
+            if (old_filename && is_file(renamed_filename))
+            {
+                if (!is_file(old_filename))
                 {
-                    dng_compress(out_filename, compress-1);
+                    /* input file not overwritten, undo renaming */
+                    rename(renamed_filename, old_filename);
                 }
-                
-                if (embed_original || orig_filename[0])
+                else
                 {
-                    /* this will move the input file into the DNG (and maybe delete the original) */
-                    int delete_original = (embed_original != 2);
-                    embed_original_raw(out_filename, filename, delete_original);
+                    /* output file would overwrite the input file */
+                    unlink(renamed_filename);
                 }
+            }
 
-                if (old_filename && is_file(renamed_filename))
-                {
-                    if (!is_file(old_filename))
-                    {
-                        /* input file not overwritten, undo renaming */
-                        rename(renamed_filename, old_filename);
-                    }
-                    else
-                    {
-                        /* output file would overwrite the input file */
-                        unlink(renamed_filename);
-                    }
-                }
+            /* record black and white levels */
+            result->done = 1;
+            result->black = raw_info.black_level;
+            result->white = raw_info.white_level;
+        }
+        else
+        {
+            printf("ISO blending didn't work\n");
+        }
+    }
+    else
+    {
+        printf("Doesn't look like interlaced ISO\n");
+    }
+
+    free(buf);
+}
+
+/* --jobs: the files are converted by worker cr2hdr processes, up to 'jobs' at a time.
+ * The conversion keeps the whole image state in globals, and so does the DNG writer shared with the camera code,
+ * so each worker is a new cr2hdr process (--worker) that converts one file with our options.
+ * They are started with popen, like dcraw and exiftool, so this works on Windows, too.
+ * The output of each file is printed in input order, as if the files were processed one by one;
+ * the pipes of all workers are drained as data arrives, so none of them waits on a full pipe. */
+
+/* the worker reports its file_result on this line (not printed) */
+#define WORKER_RESULT "#cr2hdr-result"
+
+static void worker_command(char* cmd, int size, char** argv, int argc, char* filename)
+{
+    int len = 0;
 
-                /* record black and white levels */
-                file_indices[num_files] = k;
-                blacks[num_files] = raw_info.black_level;
-                whites[num_files] = raw_info.white_level;
-                num_files++;
+#ifdef _WIN32
+    /* cmd.exe would strip the first and the last quote from the command line */
+    len += snprintf(cmd + len, size - len, "\"");
+#endif
+
+    len += snprintf(cmd + len, size - len, "\"%s\" --worker", argv[0]);
+
+    for (int k = 1; k < argc && len < size; k++)
+    {
+        if (argv[k][0] == '-')
+        {
+            len += snprintf(cmd + len, size - len, " \"%s\"", argv[k]);
+        }
+    }
+
+    /* the default number of threads depends on --jobs (see main) */
+    if (threads > 0 && len < size)
+    {
+        len += snprintf(cmd + len, size - len, " --threads=%d", threads);
+    }
+
+    /* settings carried over from the files already processed (see process_files_parallel) */
+    if (!exif_wb && custom_wb[1] && len < size)
+    {
+        len += snprintf(cmd + len, size - len, " --wb=%.9g,%.9g,%.9g", custom_wb[0], custom_wb[1], custom_wb[2]);
+    }
+
+    if (len < size)
+    {
+        len += snprintf(cmd + len, size - len, " \"%s\" 2>&1", filename);
+    }
+
+#ifdef _WIN32
+    if (len < size)
+    {
+        len += snprintf(cmd + len, size - len, "\"");
+    }
+#endif
+
+    CHECK(len < size, "command line too long");
+}
+
+/* output of one worker, collected until it's its turn to be printed */
+struct worker_output
+{
+    FILE* pipe;
+    char* buf;
+    int len;
+    int size;
+    int eof;
+};
+
+static void worker_append(struct worker_output* w, char* data, int n)
+{
+    if (w->len + n + 1 > w->size)
+    {
+        w->size = MAX(2 * w->size, w->len + n + 4096);
+        w->buf = realloc(w->buf, w->size);
+        CHECK(w->buf, "realloc");
+    }
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+    w->buf[w->len] = 0;
+}
+
+static void worker_read(struct worker_output* w, int avail)
+{
+    char data[4096];
+    int n = read(fileno(w->pipe), data, MIN(avail, (int)sizeof(data)));
+    if (n > 0)
+    {
+        worker_append(w, data, n);
+    }
+    else if (n == 0 || errno != EINTR)
+    {
+        w->eof = 1;
+    }
+}
+
+/* wait until some of the running workers [first, last) have written something or exited, and collect that */
+static void workers_wait(struct worker_output* workers, int first, int last)
+{
+#ifdef _WIN32
+    /* pipes from _popen can't be polled, peek into each of them instead */
+    while (1)
+    {
+        int got = 0;
+        for (int i = first; i < last; i++)
+        {
+            struct worker_output* w = &workers[i];
+            DWORD avail = 0;
+            if (w->eof)
+            {
+                continue;
             }
-            else
+            if (!PeekNamedPipe((HANDLE)_get_osfhandle(fileno(w->pipe)), NULL, 0, NULL, &avail, NULL))
             {
-                printf("ISO blending didn't work\n");
+                /* broken pipe: the worker has exited */
+                w->eof = 1;
+                got = 1;
             }
+            else if (avail)
+            {
+                worker_read(w, avail);
+                got = 1;
+            }
+        }
+        if (got)
+        {
+            return;
+        }
+        Sleep(10);
+    }
+#else
+    struct pollfd fds[last - first];
+    int n = 0;
+    for (int i = first; i < last; i++)
+    {
+        if (!workers[i].eof)
+        {
+            fds[n].fd = fileno(workers[i].pipe);
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+    }
+
+    if (!n || poll(fds, n, -1) < 0)
+    {
+        return;
+    }
+
+    for (int i = first, k = 0; i < last; i++)
+    {
+        if (workers[i].eof)
+        {
+            continue;
+        }
+        if (fds[k++].revents)
+        {
+            worker_read(&workers[i], INT_MAX);
+        }
+    }
+#endif
+}
+
+/* print the complete lines collected from a worker, starting at 'printed' (and the rest, once it exited); returns the new 'printed' */
+static int worker_print(struct worker_output* w, int printed, struct file_result* result, int* got_result)
+{
+    while (printed < w->len)
+    {
+        char* line = w->buf + printed;
+        char* end = strchr(line, '\n');
+        if (!end && !w->eof)
+        {
+            break;
+        }
+        int len = end ? end - line + 1 : w->len - printed;
+
+        if (startswith(line, WORKER_RESULT))
+        {
+            *got_result = sscanf(line, WORKER_RESULT " %d %d %d", &result->done, &result->black, &result->white) == 3;
         }
         else
         {
-            printf("Doesn't look like interlaced ISO\n");
+            fwrite(line, 1, len, stdout);
         }
+        printed += len;
+    }
+    fflush(stdout);
+    return printed;
+}
 
-        free(buf);
+static void process_files_parallel(char** argv, int argc, char** files, int num_files, struct file_result* results, int jobs)
+{
+    /* some settings are carried over to the next files: the white balance picked from the first file
+     * is reused for the entire batch. Until it's known, the files are processed right here, like in the serial case;
+     * the workers get it on their command line. */
+    int next_start = 0;
+    while (next_start < num_files && !exif_wb && !custom_wb[1])
+    {
+        process_file(files[next_start], &results[next_start]);
+        next_start++;
+    }
+
+    struct worker_output* workers = calloc(num_files, sizeof(workers[0]));
+    CHECK(workers, "calloc");
+
+    int next_print = next_start;    /* oldest file whose output was not completely printed */
+    int printed = 0;                /* how much of its output was printed */
+    int got_result = 0;
+
+    while (next_print < num_files)
+    {
+        /* keep 'jobs' files in progress */
+        while (next_start < num_files && next_start - next_print < jobs)
+        {
+            char cmd[8192];
+            worker_command(cmd, sizeof(cmd), argv, argc, files[next_start]);
+
+            /* anything still buffered would be printed after the worker output */
+            fflush(stdout);
+
+            workers[next_start].pipe = popen(cmd, "r");
+            CHECK(workers[next_start].pipe, "%s", cmd);
+            next_start++;
+        }
+
+        /* the oldest file streams its output, the others keep theirs until it's their turn */
+        struct worker_output* w = &workers[next_print];
+        struct file_result* result = &results[next_print];
+        printed = worker_print(w, printed, result, &got_result);
+
+        if (!w->eof)
+        {
+            workers_wait(workers, next_print, next_start);
+            continue;
+        }
+
+        int status = pclose(w->pipe);
+        if (!got_result)
+        {
+            printf("Error: cr2hdr worker for %s failed (status %d)\n", files[next_print], status);
+            memset(result, 0, sizeof(*result));
+        }
+        free(w->buf);
+
+        next_print++;
+        printed = 0;
+        got_result = 0;
     }
+
+    free(workers);
+}
+
+int main(int argc, char** argv)
+{
+    fast_randn_init();
+
+    /* parse all command-line options */
+    for (int k = 1; k < argc; k++)
+        if (argv[k][0] == '-')
+            parse_commandline_option(argv[k]);
     
-    if (same_levels && num_files > 1)
+    solve_commandline_deps();
+
+    if (!worker)
+    {
+        printf("cr2hdr: a post processing tool for Dual ISO images\n\n");
+        printf("Last update: %s\n", module_get_string(dual_iso_strings, "Last update"));
+    }
+
+    if (argc == 1)
+    {
+        printf("No input files.\n\n");
+        printf("GUI usage: drag some CR2 or DNG files over cr2hdr.exe.\n\n");
+        show_commandline_help(argv[0]);
+        return 0;
+    }
+
+    if (!worker)
+    {
+        show_active_options();
+    }
+    else
+    {
+        /* the parent reads stdout and stderr from the same pipe; keep them in order */
+        setvbuf(stdout, NULL, _IONBF, 0);
+    }
+    
+    /* all other arguments are input files */
+    char** files = malloc(argc * sizeof(files[0]));
+    int num_files = 0;
+    for (int k = 1; k < argc; k++)
+        if (argv[k][0] != '-')
+            files[num_files++] = argv[k];
+
+    if (jobs > 1 && num_files > 1 && threads <= 0)
+    {
+        /* the files are processed in parallel, too, so they share the CPU cores */
+        int amaze_cpu_count();
+        threads = MAX(1, amaze_cpu_count() / MIN(jobs, num_files));
+    }
+
+    /* keep track of black and white levels (useful for deflicker) */
+    struct file_result* results = calloc(MAX(num_files, 1), sizeof(results[0]));
+    CHECK(results, "calloc");
+
+    if (jobs > 1 && num_files > 1)
+    {
+        process_files_parallel(argv, argc, files, num_files, results, MIN(jobs, num_files));
+    }
+    else
+    {
+        for (int i = 0; i < num_files; i++)
+        {
+            process_file(files[i], &results[i]);
+        }
+    }
+
+    if (worker)
+    {
+        /* for the parent cr2hdr (one file per worker) */
+        printf("%s %d %d %d\n", WORKER_RESULT, results[0].done, results[0].black, results[0].white);
+        free(results);
+        free(files);
+        return 0;
+    }
+    
+    /* only the files that were converted */
+    int num_done = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        if (results[i].done)
+        {
+            files[num_done] = files[i];
+            results[num_done] = results[i];
+            num_done++;
+        }
+    }
+
+    if (same_levels && num_done > 1)
     {
         /* Equalize white-black for all shots.
          * 
@@ -882,16 +1238,16 @@ int main(int argc, char** argv)
         
         printf("\nEqualizing levels...\n");
         
-        int* ranges = malloc(num_files * sizeof(ranges[0]));
-        for (int i = 0; i < num_files; i++)
+        int* ranges = malloc(num_done * sizeof(ranges[0]));
+        for (int i = 0; i < num_done; i++)
         {
-            ranges[i] = whites[i] - blacks[i];
+            ranges[i] = results[i].white - results[i].black;
         }
-        int new_range = kth_smallest_int(ranges, num_files, num_files * 8 / 9 - 1);
+        int new_range = kth_smallest_int(ranges, num_done, num_done * 8 / 9 - 1);
 
-        for (int i = 0; i < num_files; i++)
+        for (int i = 0; i < num_done; i++)
         {
-            char* input_file = argv[file_indices[i]];
+            char* input_file = files[i];
 
             /* fixme: duplicate code */
             char out_filename[1000];
@@ -901,17 +1257,16 @@ int main(int argc, char** argv)
             out_filename[len-2] = 'N';
             out_filename[len-1] = 'G';
 
-            int new_white = blacks[i] + new_range;
-            printf("%-16s: %d ... %d\n", out_filename, blacks[i], new_white);
+            int new_white = results[i].black + new_range;
+            printf("%-16s: %d ... %d\n", out_filename, results[i].black, new_white);
             set_white_level(out_filename, new_white);
         }
         
         free(ranges);
     }
     
-    free(whites);
-    free(blacks);
-    free(file_indices);
+    free(results);
+    free(files);
     
     return 0;
 }
@@ -1841,6 +2196,10 @@ static int mean3(int a, int b, int c, int white, int* err)
 
 static void chroma_smooth(uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw)
 {
+    /* same output, falls back to the filters below on CPUs without SSE2 */
+    if (chroma_smooth_simd(chroma_smooth_method, raw_info.width, raw_info.height, inp, out, raw2ev, ev2raw, threads))
+        return;
+
     switch (chroma_smooth_method)
     {
         case 2:
@@ -2297,10 +2656,11 @@ static int hdr_interpolate()
             float** green,      /* the interpolated green plane */
             float** blue,       /* the interpolated blue plane */
             int winx, int winy, /* crop window for demosaicing */
-            int winw, int winh
+            int winw, int winh,
+            int threads         /* 0 = one per CPU core */
         );
 
-        amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h);
+        amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h, threads);
 
         /* undo green channel scaling and clamp the other channels */
         for (int y = 0; y < h; y ++)
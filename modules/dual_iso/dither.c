@@ -21,6 +21,7 @@
 /* anti-posterization noise */
 /* before rounding, it's a good idea to add a Gaussian noise of stdev=0.5 */
 static float randn05_cache[1024];
+static int randn05_index = 0;
 
 void fast_randn_init()
 {
@@ -33,6 +34,10 @@ void fast_randn_init()
 
 float fast_randn05()
 {
-    static int k = 0;
-    return randn05_cache[(k++) & 1023];
+    return randn05_cache[(randn05_index++) & 1023];
+}
+
+void fast_randn_rewind()
+{
+    randn05_index = 0;
 }
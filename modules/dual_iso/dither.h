@@ -1,2 +1,3 @@
 void fast_randn_init();
 float fast_randn05();
+void fast_randn_rewind();
@@ -0,0 +1,403 @@
+/*
+ * In-process replacement for the dcraw calls in cr2hdr, for DNG files only.
+ *
+ * Handles what mlv_dump, raw2dng, Adobe DNG Converter and cr2hdr itself write:
+ * CFA data, uncompressed (8...16 bits, packed) or lossless JPEG (strips or tiles).
+ * Anything else (linearization tables, CR2 files...) is left to dcraw.
+ *
+ * The output matches "dcraw -4 -E -c": full sensor area including the masked pixels,
+ * no black subtraction, no scaling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../mlv_rec/lj92.h"
+#include "dng-reader.h"
+
+#define TAG_NEW_SUBFILE_TYPE        254
+#define TAG_IMAGE_WIDTH             256
+#define TAG_IMAGE_LENGTH            257
+#define TAG_BITS_PER_SAMPLE         258
+#define TAG_COMPRESSION             259
+#define TAG_PHOTOMETRIC             262
+#define TAG_MODEL                   272
+#define TAG_STRIP_OFFSETS           273
+#define TAG_SAMPLES_PER_PIXEL       277
+#define TAG_ROWS_PER_STRIP          278
+#define TAG_STRIP_BYTE_COUNTS       279
+#define TAG_PLANAR_CONFIG           284
+#define TAG_TILE_WIDTH              322
+#define TAG_TILE_LENGTH             323
+#define TAG_TILE_OFFSETS            324
+#define TAG_TILE_BYTE_COUNTS        325
+#define TAG_SUB_IFDS                330
+#define TAG_DNG_VERSION             50706
+#define TAG_LINEARIZATION_TABLE     50712
+#define TAG_ACTIVE_AREA             50829
+
+#define PHOTOMETRIC_CFA             32803
+#define COMPRESSION_NONE            1
+#define COMPRESSION_LJ92            7
+
+/* how deep we follow SubIFDs */
+#define MAX_IFD_DEPTH               4
+
+struct tiff_file
+{
+    const uint8_t* data;
+    uint32_t size;
+    int big_endian;
+};
+
+/* the tags of the raw IFD we care about */
+struct raw_ifd
+{
+    int found;
+    int width;
+    int height;
+    int bps;
+    int compression;
+    int samples;
+    int planar;
+    int linearized;
+    int tiled;
+    int tile_width;
+    int tile_length;
+    uint32_t offsets;           /* position of the directory entry with the strip/tile offsets */
+    uint32_t byte_counts;       /* same for the byte counts */
+    int active_area[4];         /* top, left, bottom, right */
+    int has_active_area;
+};
+
+static uint32_t get16(struct tiff_file* t, uint32_t pos)
+{
+    if (pos > t->size - 2 || t->size < 2)
+        return 0;
+
+    const uint8_t* p = t->data + pos;
+    return t->big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(struct tiff_file* t, uint32_t pos)
+{
+    if (pos > t->size - 4 || t->size < 4)
+        return 0;
+
+    const uint8_t* p = t->data + pos;
+    return t->big_endian
+        ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+        : p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int type_size(int type)
+{
+    switch (type)
+    {
+        case 1: case 2: case 6: case 7:
+            return 1;
+        case 3: case 8:
+            return 2;
+        case 4: case 9: case 11: case 13:
+            return 4;
+        case 5: case 10: case 12:
+            return 8;
+    }
+    return 0;
+}
+
+static uint32_t entry_count(struct tiff_file* t, uint32_t entry)
+{
+    return get32(t, entry + 4);
+}
+
+/* the i-th value of a directory entry (integer types only) */
+static uint32_t entry_value(struct tiff_file* t, uint32_t entry, uint32_t i)
+{
+    int type = get16(t, entry + 2);
+    uint32_t count = entry_count(t, entry);
+    uint64_t size = (uint64_t)type_size(type) * count;
+    uint32_t pos = size <= 4 ? entry + 8 : get32(t, entry + 8);
+
+    if (i >= count)
+        return 0;
+
+    switch (type)
+    {
+        case 1: case 7:
+            return pos + i < t->size ? t->data[pos + i] : 0;
+        case 3:
+            return get16(t, pos + 2*i);
+        case 4: case 13:
+            return get32(t, pos + 4*i);
+    }
+    return 0;
+}
+
+static void parse_ifd(struct tiff_file* t, uint32_t offset, int depth, struct raw_ifd* raw, char* model, int model_size)
+{
+    struct raw_ifd ifd;
+    memset(&ifd, 0, sizeof(ifd));
+    ifd.samples = 1;
+    ifd.planar = 1;
+
+    int subfile_type = 0;
+    int photometric = 0;
+    int rows_per_strip = 0;
+
+    int num = get16(t, offset);
+    for (int i = 0; i < num; i++)
+    {
+        uint32_t entry = offset + 2 + 12*i;
+        if (entry + 12 > t->size)
+            break;
+
+        switch (get16(t, entry))
+        {
+            case TAG_NEW_SUBFILE_TYPE:      subfile_type = entry_value(t, entry, 0); break;
+            case TAG_IMAGE_WIDTH:           ifd.width = entry_value(t, entry, 0); break;
+            case TAG_IMAGE_LENGTH:          ifd.height = entry_value(t, entry, 0); break;
+            case TAG_BITS_PER_SAMPLE:       ifd.bps = entry_value(t, entry, 0); break;
+            case TAG_COMPRESSION:           ifd.compression = entry_value(t, entry, 0); break;
+            case TAG_PHOTOMETRIC:           photometric = entry_value(t, entry, 0); break;
+            case TAG_SAMPLES_PER_PIXEL:     ifd.samples = entry_value(t, entry, 0); break;
+            case TAG_ROWS_PER_STRIP:        rows_per_strip = entry_value(t, entry, 0); break;
+            case TAG_PLANAR_CONFIG:         ifd.planar = entry_value(t, entry, 0); break;
+            case TAG_TILE_WIDTH:            ifd.tile_width = entry_value(t, entry, 0); ifd.tiled = 1; break;
+            case TAG_TILE_LENGTH:           ifd.tile_length = entry_value(t, entry, 0); ifd.tiled = 1; break;
+            case TAG_STRIP_OFFSETS:
+            case TAG_TILE_OFFSETS:          ifd.offsets = entry; break;
+            case TAG_STRIP_BYTE_COUNTS:
+            case TAG_TILE_BYTE_COUNTS:      ifd.byte_counts = entry; break;
+            case TAG_LINEARIZATION_TABLE:   ifd.linearized = 1; break;
+
+            case TAG_ACTIVE_AREA:
+            {
+                for (int k = 0; k < 4; k++)
+                    ifd.active_area[k] = entry_value(t, entry, k);
+                ifd.has_active_area = 1;
+                break;
+            }
+
+            case TAG_MODEL:
+            {
+                /* the raw IFD is the last one we visit, but the model is in IFD0, so keep the first one */
+                uint32_t count = entry_count(t, entry);
+                uint32_t pos = count <= 4 ? entry + 8 : get32(t, entry + 8);
+                if (!model[0] && count < (uint32_t)model_size && pos <= t->size - count)
+                {
+                    memcpy(model, t->data + pos, count);
+                    model[count] = 0;
+                }
+                break;
+            }
+
+            case TAG_SUB_IFDS:
+            {
+                if (depth < MAX_IFD_DEPTH)
+                {
+                    uint32_t count = entry_count(t, entry);
+                    for (uint32_t k = 0; k < count && k < 16; k++)
+                        parse_ifd(t, entry_value(t, entry, k), depth + 1, raw, model, model_size);
+                }
+                break;
+            }
+        }
+    }
+
+    if (!ifd.tiled)
+    {
+        /* strips are handled as tiles of full width */
+        ifd.tile_width = ifd.width;
+        ifd.tile_length = rows_per_strip ? rows_per_strip : ifd.height;
+    }
+
+    /* full resolution CFA image? */
+    if (!raw->found && subfile_type == 0 && photometric == PHOTOMETRIC_CFA && ifd.width > 0 && ifd.height > 0)
+    {
+        *raw = ifd;
+        raw->found = 1;
+    }
+}
+
+/* uncompressed data: 16-bit samples in file byte order, others packed MSB first, rows start at byte boundaries */
+static int read_uncompressed(struct tiff_file* t, struct raw_ifd* ifd, uint16_t* out)
+{
+    uint32_t row_bytes = ((uint64_t)ifd->width * ifd->bps + 7) / 8;
+    int strips = (ifd->height + ifd->tile_length - 1) / ifd->tile_length;
+
+    if (ifd->tiled || (int)entry_count(t, ifd->offsets) < strips)
+        return 0;
+
+    for (int s = 0; s < strips; s++)
+    {
+        int y0 = s * ifd->tile_length;
+        int rows = ifd->height - y0 < ifd->tile_length ? ifd->height - y0 : ifd->tile_length;
+        uint32_t pos = entry_value(t, ifd->offsets, s);
+
+        if (pos > t->size || (uint64_t)rows * row_bytes > t->size - pos)
+            return 0;
+
+        for (int y = y0; y < y0 + rows; y++, pos += row_bytes)
+        {
+            uint16_t* row = out + (size_t)y * ifd->width;
+
+            if (ifd->bps == 16)
+            {
+                for (int x = 0; x < ifd->width; x++)
+                    row[x] = get16(t, pos + 2*x);
+            }
+            else
+            {
+                const uint8_t* p = t->data + pos;
+                uint32_t bitbuf = 0;
+                int bits = 0;
+                for (int x = 0; x < ifd->width; x++)
+                {
+                    while (bits < ifd->bps)
+                    {
+                        bitbuf = (bitbuf << 8) | *p++;
+                        bits += 8;
+                    }
+                    bits -= ifd->bps;
+                    row[x] = (bitbuf >> bits) & ((1 << ifd->bps) - 1);
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* lossless JPEG: each strip/tile is one LJ92 stream. the decoded samples fill the tile row by row,
+   no matter how the encoder split them into JPEG rows and components (same as dcraw) */
+static int read_lj92(struct tiff_file* t, struct raw_ifd* ifd, uint16_t* out)
+{
+    if (ifd->tile_width <= 0 || ifd->tile_length <= 0)
+        return 0;
+
+    int tiles_across = (ifd->width + ifd->tile_width - 1) / ifd->tile_width;
+    int tiles_down = (ifd->height + ifd->tile_length - 1) / ifd->tile_length;
+    int tiles = tiles_across * tiles_down;
+
+    if ((int)entry_count(t, ifd->offsets) < tiles || (int)entry_count(t, ifd->byte_counts) < tiles)
+        return 0;
+
+    for (int i = 0; i < tiles; i++)
+    {
+        int trow = (i / tiles_across) * ifd->tile_length;
+        int tcol = (i % tiles_across) * ifd->tile_width;
+        uint32_t pos = entry_value(t, ifd->offsets, i);
+        uint32_t len = entry_value(t, ifd->byte_counts, i);
+
+        if (pos > t->size || len > t->size - pos)
+            return 0;
+
+        lj92 handle;
+        int width, height, bitdepth, components;
+        if (lj92_open(&handle, (uint8_t*)t->data + pos, len, &width, &height, &bitdepth, &components) != LJ92_ERROR_NONE)
+            return 0;
+
+        int samples = width * components;
+        uint16_t* decoded = malloc((size_t)samples * height * sizeof(uint16_t));
+        int ok = decoded && lj92_decode(handle, decoded, samples, 0, NULL, 0) == LJ92_ERROR_NONE;
+        lj92_close(handle);
+
+        if (!ok)
+        {
+            free(decoded);
+            return 0;
+        }
+
+        int row = 0, col = 0;
+        for (int k = 0; k < samples * height; k++)
+        {
+            if (trow + row < ifd->height && tcol + col < ifd->width)
+                out[(size_t)(trow + row) * ifd->width + tcol + col] = decoded[k];
+
+            if (++col >= ifd->tile_width || col >= ifd->width)
+            {
+                row++;
+                col = 0;
+            }
+        }
+        free(decoded);
+    }
+
+    return 1;
+}
+
+int dng_read_raw(const char* filename, struct dng_raw* raw)
+{
+    memset(raw, 0, sizeof(*raw));
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* data = size > 8 ? malloc(size) : NULL;
+    int ok = data && fread(data, 1, size, f) == (size_t)size;
+    fclose(f);
+
+    struct tiff_file t = { data, size, 0 };
+    struct raw_ifd ifd;
+    memset(&ifd, 0, sizeof(ifd));
+    char model[sizeof(raw->model)] = "";
+
+    if (ok)
+    {
+        t.big_endian = data[0] == 'M' && data[1] == 'M';
+        ok = (data[0] == data[1]) && (data[0] == 'I' || data[0] == 'M') && get16(&t, 2) == 42;
+    }
+
+    if (ok)
+    {
+        uint32_t ifd0 = get32(&t, 4);
+        int is_dng = 0;
+        for (int i = 0; i < (int)get16(&t, ifd0); i++)
+            if (get16(&t, ifd0 + 2 + 12*i) == TAG_DNG_VERSION)
+                is_dng = 1;
+
+        if (is_dng)
+            parse_ifd(&t, ifd0, 0, &ifd, model, sizeof(model));
+
+        ok = ifd.found && !ifd.linearized && ifd.samples == 1 && ifd.planar == 1 &&
+             ifd.bps >= 8 && ifd.bps <= 16 && ifd.offsets &&
+             (ifd.compression == COMPRESSION_NONE || (ifd.compression == COMPRESSION_LJ92 && ifd.byte_counts));
+    }
+
+    if (ok)
+    {
+        /* 1 extra line for handling GBRG easier (same as the PGM reader in cr2hdr) */
+        raw->buffer = calloc((size_t)ifd.width * (ifd.height + 1), sizeof(uint16_t));
+        ok = raw->buffer && (ifd.compression == COMPRESSION_LJ92
+            ? read_lj92(&t, &ifd, raw->buffer)
+            : read_uncompressed(&t, &ifd, raw->buffer));
+    }
+
+    free(data);
+
+    if (!ok)
+    {
+        free(raw->buffer);
+        raw->buffer = NULL;
+        return 0;
+    }
+
+    raw->raw_width = raw->out_width = ifd.width;
+    raw->raw_height = raw->out_height = ifd.height;
+
+    if (ifd.has_active_area)
+    {
+        raw->out_width = ifd.active_area[3] - ifd.active_area[1];
+        raw->out_height = ifd.active_area[2] - ifd.active_area[0];
+    }
+
+    snprintf(raw->model, sizeof(raw->model), "%s", strncmp(model, "Canon ", 6) == 0 ? model + 6 : model);
+    return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef _DNG_READER_H
+#define _DNG_READER_H
+
+#include <stdint.h>
+
+/* raw image as returned by "dcraw -i -v" (sizes) and "dcraw -4 -E -c" (pixels) */
+struct dng_raw
+{
+    int raw_width;              /* "Full size" */
+    int raw_height;
+    int out_width;              /* "Output size", i.e. the DNG ActiveArea */
+    int out_height;
+    uint16_t* buffer;           /* raw_width x (raw_height+1) pixels, the last line is left empty */
+    char model[64];             /* Model tag, without the "Canon " prefix */
+};
+
+/* Read the CFA raw data of an uncompressed or lossless JPEG DNG without a dcraw round trip.
+ * Returns 1 on success, 0 if the file is not a DNG or uses a feature we don't handle
+ * (the caller should fall back to dcraw then). The buffer must be freed by the caller. */
+int dng_read_raw(const char* filename, struct dng_raw* raw);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * tiled AMaZE: the multithreaded output must be bit-identical to the
+ * single-threaded one, for image sizes that are not multiples of the tile
+ * step and for crop windows that don't start at the origin.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+void amaze_demosaic_RT(
+    float** rawData, float** red, float** green, float** blue,
+    int winx, int winy, int winw, int winh, int threads);
+
+struct planes
+{
+    int w, h;
+    float* data;        /* red, green, blue */
+    float** rows;       /* 3*h row pointers */
+};
+
+static float** alloc_rows(float* data, int w, int h)
+{
+    float** rows = malloc(h * sizeof(rows[0]));
+    for (int y = 0; y < h; y++)
+        rows[y] = data + y * w;
+    return rows;
+}
+
+static void planes_alloc(struct planes* p, int w, int h)
+{
+    p->w = w;
+    p->h = h;
+    p->data = calloc(3 * w * h, sizeof(float));
+    p->rows = alloc_rows(p->data, w, 3 * h);
+}
+
+static void planes_free(struct planes* p)
+{
+    free(p->rows);
+    free(p->data);
+}
+
+/* RGGB mosaic of a scene with smooth gradients, sharp edges, fine detail near Nyquist and some noise */
+static float** make_cfa(int w, int h, unsigned seed)
+{
+    float* data = malloc(w * h * sizeof(float));
+    srand(seed);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            float r = 3000 + 20000 * (float)x / w;
+            float g = 5000 + 15000 * (float)y / h;
+            float b = 4000 + 8000 * (1 + sinf(x * 0.05f) * cosf(y * 0.07f));
+            if ((x / 37 + y / 23) % 2)
+            {
+                r *= 0.3f; g *= 0.5f; b *= 1.5f;
+            }
+            if (x > w / 2 && y > h / 2)
+            {
+                float k = 1 + 0.8f * sinf(x * 2.9f + y * 0.3f);
+                r *= k; g *= k; b *= k;
+            }
+            float v = (y % 2 == 0) ? (x % 2 == 0 ? r : g) : (x % 2 == 0 ? g : b);
+            data[y * w + x] = v + (rand() % 200) - 100;
+        }
+    }
+    return alloc_rows(data, w, h);
+}
+
+static void run(float** cfa, struct planes* out, int winx, int winy, int winw, int winh, int threads)
+{
+    memset(out->data, 0, 3 * out->w * out->h * sizeof(float));
+    amaze_demosaic_RT(cfa, out->rows, out->rows + out->h, out->rows + 2 * out->h, winx, winy, winw, winh, threads);
+}
+
+static void test_size(int w, int h, int winx, int winy, int winw, int winh)
+{
+    printf("%dx%d, window %d,%d %dx%d\n", w, h, winx, winy, winw, winh);
+
+    float** cfa = make_cfa(w, h, w * h);
+    struct planes ref, out;
+    planes_alloc(&ref, w, h);
+    planes_alloc(&out, w, h);
+
+    run(cfa, &ref, winx, winy, winw, winh, 1);
+
+    /* sanity check: the window was actually interpolated */
+    TRY(ref.rows[ref.h + winy + winh / 2][winx + winw / 2] > 0);
+
+    static const int threads[] = { 2, 3, 4, 7, 16 };
+    for (int i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++)
+    {
+        run(cfa, &out, winx, winy, winw, winh, threads[i]);
+        TRY(memcmp(ref.data, out.data, 3 * w * h * sizeof(float)) == 0);
+    }
+
+    planes_free(&ref);
+    planes_free(&out);
+    free(cfa[0]);
+    free(cfa);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void bench()
+{
+    /* 20 MP */
+    int w = 5496, h = 3670;
+    float** cfa = make_cfa(w, h, 1);
+    struct planes out;
+    planes_alloc(&out, w, h);
+
+    static const int threads[] = { 1, 2, 4, 0 };
+    for (int i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++)
+    {
+        double t0 = now();
+        run(cfa, &out, 0, 0, w, h, threads[i]);
+        printf("threads=%d: %.2f s\n", threads[i], now() - t0);
+    }
+
+    planes_free(&out);
+    free(cfa[0]);
+    free(cfa);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    /* one tile, a few tiles, sizes off the tile grid */
+    test_size(100, 80, 0, 0, 100, 80);
+    test_size(640, 360, 0, 0, 640, 360);
+    test_size(1001, 667, 0, 0, 1001, 667);
+    test_size(517, 1283, 0, 0, 517, 1283);
+
+    /* crop windows (same parity as the full image, as in cr2hdr) */
+    test_size(900, 600, 64, 32, 700, 500);
+    test_size(900, 600, 2, 2, 384, 130);
+
+    printf("all tests passed\n");
+    return 0;
+}
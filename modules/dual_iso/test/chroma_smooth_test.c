@@ -0,0 +1,218 @@
+/*
+ * SIMD chroma smoothing: the output must be bit-identical to the scalar
+ * filters from chroma_smooth.c, for every method, thread count and for
+ * image sizes that are odd or too small for the filter window.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "optmed.h"
+#include "chroma_smooth_simd.h"
+
+#define EV_RESOLUTION 65536
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+
+/* the scalar filters take the image size from here */
+static struct { int width, height; } raw_info;
+
+#define CHROMA_SMOOTH_2X2
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_2X2
+
+#define CHROMA_SMOOTH_3X3
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_3X3
+
+#define CHROMA_SMOOTH_5X5
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_5X5
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+/* 20-bit levels, as in hdr_interpolate */
+#define BLACK (2048*64)
+#define WHITE (15000*64)
+
+static int raw2ev[1<<20];
+static int ev2raw_0[24*EV_RESOLUTION];
+static int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+
+/* same tables as hdr_interpolate() in cr2hdr.c */
+static void init_tables(int black, int white)
+{
+    for (int i = 0; i < 1<<20; i++)
+    {
+        double signal = MAX(i/64.0 - black/64.0, -1023);
+        if (signal > 0)
+            raw2ev[i] = (int)round(log2(1+signal) * EV_RESOLUTION);
+        else
+            raw2ev[i] = -(int)round(log2(1-signal) * EV_RESOLUTION);
+    }
+
+    for (int i = -10*EV_RESOLUTION; i < 0; i++)
+    {
+        ev2raw[i] = COERCE(black+64 - round(64*pow(2, ((double)-i/EV_RESOLUTION))), 0, black);
+    }
+
+    for (int i = 0; i < 14*EV_RESOLUTION; i++)
+    {
+        ev2raw[i] = COERCE(black-64 + round(64*pow(2, ((double)i/EV_RESOLUTION))), black, (1<<20)-1);
+
+        if (i >= raw2ev[white])
+        {
+            ev2raw[i] = MAX(ev2raw[i], white);
+        }
+    }
+
+    ev2raw[raw2ev[0]] = 0;
+}
+
+/* smooth gradients with noise, some pixels in the dark (skipped by the filter), some clipped, some bad */
+static void fill_image(uint32_t* buf, int w, int h)
+{
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            int v = BLACK + ((x * 37 + y * 11) % 9000) * 64 + rand() % 25600 - 12800;
+            int r = rand() % 100;
+            if (r < 3) v = BLACK + rand() % 4096;
+            else if (r < 5) v = WHITE + rand() % 64000;
+            else if (r < 6) v = 0;
+            buf[x + y * w] = COERCE(v, 0, (1<<20)-1);
+        }
+    }
+}
+
+static void reference(int method, uint32_t* inp, uint32_t* out)
+{
+    switch (method)
+    {
+        case 2: chroma_smooth_2x2(inp, out, raw2ev, ev2raw); break;
+        case 3: chroma_smooth_3x3(inp, out, raw2ev, ev2raw); break;
+        case 5: chroma_smooth_5x5(inp, out, raw2ev, ev2raw); break;
+    }
+}
+
+static bool test_size(int method, int threads, int w, int h)
+{
+    size_t size = (size_t)w * h;
+    uint32_t* inp = malloc(size * sizeof(uint32_t));
+    uint32_t* ref = malloc(size * sizeof(uint32_t));
+    uint32_t* out = malloc(size * sizeof(uint32_t));
+
+    fill_image(inp, w, h);
+    memcpy(ref, inp, size * sizeof(uint32_t));
+    memcpy(out, inp, size * sizeof(uint32_t));
+
+    raw_info.width = w;
+    raw_info.height = h;
+    reference(method, inp, ref);
+
+    bool ok = chroma_smooth_simd(method, w, h, inp, out, raw2ev, ev2raw, threads) &&
+              !memcmp(ref, out, size * sizeof(uint32_t));
+
+    free(inp);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void bench()
+{
+    /* 20 MP */
+    int w = 5496, h = 3670;
+    size_t size = (size_t)w * h;
+    uint32_t* inp = malloc(size * sizeof(uint32_t));
+    uint32_t* out = malloc(size * sizeof(uint32_t));
+    fill_image(inp, w, h);
+
+    static const int methods[] = { 2, 3, 5 };
+    for (int m = 0; m < (int)(sizeof(methods) / sizeof(methods[0])); m++)
+    {
+        raw_info.width = w;
+        raw_info.height = h;
+        memcpy(out, inp, size * sizeof(uint32_t));
+        double t0 = now();
+        reference(methods[m], inp, out);
+        double t1 = now();
+        chroma_smooth_simd(methods[m], w, h, inp, out, raw2ev, ev2raw, 0);
+        double t2 = now();
+        printf("%dx%d: scalar %.2f s, simd %.2f s\n", methods[m], methods[m], t1 - t0, t2 - t1);
+    }
+
+    free(inp);
+    free(out);
+}
+
+int main(int argc, char** argv)
+{
+    init_tables(BLACK, WHITE);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    /* without SSE2 the caller falls back to the scalar filters, nothing to compare */
+    if (!chroma_smooth_simd(2, 16, 16, (uint32_t[256]){0}, (uint32_t[256]){0}, raw2ev, ev2raw, 1))
+    {
+        printf("no SSE2, skipped\n");
+        return 0;
+    }
+
+    /* unknown methods (e.g. --no-cs) are left to the caller */
+    TRY(!chroma_smooth_simd(0, 16, 16, (uint32_t[256]){0}, (uint32_t[256]){0}, raw2ev, ev2raw, 1));
+
+    static const int methods[] = { 2, 3, 5 };
+    static const int threads[] = { 1, 2, 3, 8 };
+    static const struct { int w, h; } sizes[] =
+    {
+        { 8, 8 }, { 12, 13 }, { 16, 16 }, { 33, 19 }, { 34, 20 }, { 37, 23 },
+        { 41, 24 }, { 46, 26 }, { 640, 360 }, { 1001, 667 },
+    };
+
+    for (int m = 0; m < (int)(sizeof(methods) / sizeof(methods[0])); m++)
+    {
+        for (int t = 0; t < (int)(sizeof(threads) / sizeof(threads[0])); t++)
+        {
+            for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+            {
+                if (!test_size(methods[m], threads[t], sizes[s].w, sizes[s].h))
+                {
+                    printf("%dx%d, %d threads, %dx%d pixels failed\n",
+                           methods[m], methods[m], threads[t], sizes[s].w, sizes[s].h);
+                    TRY(0);
+                }
+            }
+        }
+        printf("%dx%d: OK\n", methods[m], methods[m]);
+    }
+
+    printf("all tests passed\n");
+    return 0;
+}
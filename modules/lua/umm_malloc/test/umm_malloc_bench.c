@@ -0,0 +1,385 @@
+/*
+ * Replays allocation traces against umm_malloc, to compare the fit modes.
+ *
+ * Build it once per mode (see "make bench"). Each run prints the replay
+ * time, the slowest operations (that's what stalls the GUI, as the
+ * allocator runs with interrupts disabled) and how fragmented the heap got.
+ * The single slowest one is mostly host scheduling noise, so the 99.9th
+ * percentile is shown instead.
+ *
+ * Traces are text files with one operation per line:
+ *
+ *   m <id> <size>    malloc
+ *   r <id> <size>    realloc of the pointer stored under id (size 0 frees it)
+ *   f <id>           free
+ *
+ * ids are small integers naming the pointers. Such a trace is easy to log
+ * from the lua_Alloc function. Without a file, a trace is synthesized from
+ * what a script does in a seconds_clock handler: build small tables with
+ * string fields, keep some of them, and let the garbage collector free the
+ * rest in bursts. Object sizes are those of the 32 bit Lua 5.3 build.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "umm_malloc.h"
+
+char test_umm_heap[UMM_MALLOC_CFG__HEAP_SIZE];
+static int corruption_cnt = 0;
+
+void umm_corruption(void) {
+  corruption_cnt++;
+}
+
+#if defined(UMM_SEGREGATED_FIT)
+#  define MODE_NAME "segregated fit"
+#elif defined(UMM_FIRST_FIT)
+#  define MODE_NAME "first fit"
+#else
+#  define MODE_NAME "best fit"
+#endif
+
+typedef struct {
+  char op;
+  int id;
+  int size;
+} trace_op;
+
+static trace_op *ops = NULL;
+static int ops_count = 0;
+static int ops_alloc = 0;
+static int max_id = 0;
+
+static void add_op(char op, int id, int size) {
+  if (ops_count == ops_alloc) {
+    ops_alloc = ops_alloc ? ops_alloc * 2 : 65536;
+    ops = realloc(ops, ops_alloc * sizeof(trace_op));
+  }
+  ops[ops_count].op = op;
+  ops[ops_count].id = id;
+  ops[ops_count].size = size;
+  ops_count++;
+
+  if (id >= max_id) {
+    max_id = id + 1;
+  }
+}
+
+static bool load_trace(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  char line[128];
+
+  if (!f) {
+    printf("cannot open %s\n", filename);
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char op;
+    int id;
+    int size = 0;
+
+    if (sscanf(line, " %c %d %d", &op, &id, &size) < 2 || id < 0 ||
+        (op != 'm' && op != 'r' && op != 'f')) {
+      continue;
+    }
+    add_op(op, id, size);
+  }
+
+  fclose(f);
+  return ops_count > 0;
+}
+
+/* synthetic trace {{{ */
+
+#define LUA_TABLE     32
+#define LUA_NODE      20
+#define LUA_TVALUE    8
+#define LUA_TSTRING   16
+#define LUA_CLOSURE   20
+#define LUA_UPVAL     16
+
+/* pointers that became garbage, freed by the next collection */
+static int *garbage = NULL;
+static int garbage_count = 0;
+static int garbage_bytes = 0;
+static int live_bytes = 0;
+
+static int *free_ids = NULL;
+static int free_ids_count = 0;
+static int next_id = 0;
+
+static int new_id(void) {
+  return free_ids_count ? free_ids[--free_ids_count] : next_id++;
+}
+
+static int gen_malloc(int size) {
+  int id = new_id();
+  add_op('m', id, size);
+  live_bytes += size;
+  return id;
+}
+
+static void gen_dead(int id, int size) {
+  garbage[garbage_count++] = id;
+  garbage_bytes += size;
+  live_bytes -= size;
+}
+
+/* like the default GC pause of 200%: collect once the garbage reaches the live data */
+static void gen_collect(bool force) {
+  if (!force && garbage_bytes < live_bytes) {
+    return;
+  }
+
+  /* the sweep visits the newest objects first */
+  while (garbage_count) {
+    int id = garbage[--garbage_count];
+    add_op('f', id, 0);
+    free_ids[free_ids_count++] = id;
+  }
+  garbage_bytes = 0;
+}
+
+typedef struct {
+  int used;
+  int table;
+  int node;
+  int node_size;
+  int array;
+  int array_size;
+  int strings[12];
+  int string_sizes[12];
+  int nstrings;
+} gen_table;
+
+static void gen_table_free(gen_table *t) {
+  int i;
+
+  gen_dead(t->table, LUA_TABLE);
+  if (t->node_size) gen_dead(t->node, t->node_size);
+  if (t->array_size) gen_dead(t->array, t->array_size);
+  for (i = 0; i < t->nstrings; i++) {
+    gen_dead(t->strings[i], t->string_sizes[i]);
+  }
+}
+
+static void synthesize_trace(int calls) {
+  gen_table kept[64];
+  int kept_count = sizeof(kept) / sizeof(kept[0]);
+  int call;
+  int i;
+
+  garbage = malloc(calls * 64 * sizeof(int));
+  free_ids = malloc(calls * 64 * sizeof(int));
+  memset(kept, 0, sizeof(kept));
+
+  srand(1234);
+
+  for (call = 0; call < calls; call++) {
+    /* the handler closure and its upvalue */
+    int closure = gen_malloc(LUA_CLOSURE + 4);
+    int upval = gen_malloc(LUA_UPVAL);
+    int tables = 1 + rand() % 4;
+    int t;
+
+    for (t = 0; t < tables; t++) {
+      gen_table table;
+      int fields = 2 + rand() % 10;
+      int items = rand() % 3 ? 0 : 1 + rand() % 20;
+      int n;
+
+      memset(&table, 0, sizeof(table));
+      table.used = 1;
+      table.table = gen_malloc(LUA_TABLE);
+
+      /* the hash part doubles as fields are added */
+      for (n = 1; n <= fields; n++) {
+        if ((n & (n - 1)) == 0) {
+          if (table.node_size) {
+            add_op('r', table.node, n * LUA_NODE);
+            live_bytes += n * LUA_NODE - table.node_size;
+          } else {
+            table.node = gen_malloc(n * LUA_NODE);
+          }
+          table.node_size = n * LUA_NODE;
+        }
+
+        /* new string values, e.g. formatted time or status text */
+        if (rand() % 2 && table.nstrings < 12) {
+          int size = LUA_TSTRING + 4 + rand() % 28 + 1;
+          table.string_sizes[table.nstrings] = size;
+          table.strings[table.nstrings++] = gen_malloc(size);
+        }
+      }
+
+      /* so does the array part */
+      for (n = 1; n <= items; n++) {
+        if ((n & (n - 1)) == 0) {
+          if (table.array_size) {
+            add_op('r', table.array, n * LUA_TVALUE);
+            live_bytes += n * LUA_TVALUE - table.array_size;
+          } else {
+            table.array = gen_malloc(n * LUA_TVALUE);
+          }
+          table.array_size = n * LUA_TVALUE;
+        }
+      }
+
+      /* most tables are temporary, some replace an older one in a global */
+      if (rand() % 4 == 0) {
+        gen_table *slot = &kept[rand() % kept_count];
+        if (slot->used) {
+          gen_table_free(slot);
+        }
+        *slot = table;
+      } else {
+        gen_table_free(&table);
+      }
+    }
+
+    gen_dead(upval, LUA_UPVAL);
+    gen_dead(closure, LUA_CLOSURE + 4);
+
+    gen_collect(false);
+  }
+
+  for (i = 0; i < kept_count; i++) {
+    if (kept[i].used) {
+      gen_table_free(&kept[i]);
+    }
+  }
+  gen_collect(true);
+
+  free(garbage);
+  free(free_ids);
+}
+
+/* }}} */
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_float(const void *a, const void *b) {
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+/* returns the number of failed allocations; op_ns gets the time of each operation */
+static int replay(void **ptrs, float *op_ns, double *frag_avg, double *frag_max) {
+  bool timed = (op_ns != NULL);
+  int failed = 0;
+  int samples = 0;
+  double frag_sum = 0;
+  int i;
+
+  umm_init();
+  memset(ptrs, 0, max_id * sizeof(void *));
+
+  for (i = 0; i < ops_count; i++) {
+    trace_op *op = &ops[i];
+    double start = timed ? now_ns() : 0;
+
+    switch (op->op) {
+      case 'm':
+        ptrs[op->id] = umm_malloc(op->size);
+        failed += (ptrs[op->id] == NULL);
+        break;
+
+      case 'r':
+        {
+          void *p = umm_realloc(ptrs[op->id], op->size);
+          if (p || !op->size) {
+            ptrs[op->id] = p;
+          } else {
+            failed++;
+          }
+          break;
+        }
+
+      case 'f':
+        umm_free(ptrs[op->id]);
+        ptrs[op->id] = NULL;
+        break;
+    }
+
+    if (timed) {
+      op_ns[i] = now_ns() - start;
+
+      /* fraction of the free memory that can't be handed out in one piece */
+      if (i % 1024 == 0) {
+        umm_info(NULL, 0);
+        if (ummHeapInfo.freeBlocks) {
+          double frag = 1.0 - (double)ummHeapInfo.maxFreeContiguousBlocks / ummHeapInfo.freeBlocks;
+          frag_sum += frag;
+          if (frag > *frag_max) {
+            *frag_max = frag;
+          }
+          samples++;
+        }
+      }
+    }
+  }
+
+  if (timed && samples) {
+    *frag_avg = frag_sum / samples;
+  }
+
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  void **ptrs;
+  float *op_ns;
+  double best_ns = 0;
+  double frag_avg = 0;
+  double frag_max = 0;
+  int failed;
+  int run;
+
+  if (argc > 1) {
+    if (!load_trace(argv[1])) {
+      return 1;
+    }
+    printf("trace %s: %d operations\n", argv[1], ops_count);
+  } else {
+    synthesize_trace(20000);
+    printf("synthetic trace: %d operations\n", ops_count);
+  }
+
+  ptrs = malloc(max_id * sizeof(void *));
+  op_ns = malloc(ops_count * sizeof(float));
+
+  /* best of a few runs for the throughput */
+  for (run = 0; run < 5; run++) {
+    double start = now_ns();
+    replay(ptrs, NULL, NULL, NULL);
+    double elapsed = now_ns() - start;
+    if (run == 0 || elapsed < best_ns) {
+      best_ns = elapsed;
+    }
+  }
+
+  failed = replay(ptrs, op_ns, &frag_avg, &frag_max);
+  qsort(op_ns, ops_count, sizeof(float), compare_float);
+
+  printf("%-15s %8.2f ms, %6.1f ns/op, 99.9%% of ops below %6.2f us, failed %d, fragmentation avg %4.1f%% max %4.1f%%\n",
+      MODE_NAME, best_ns / 1e6, best_ns / ops_count, op_ns[ops_count - 1 - ops_count / 1000] / 1e3, failed,
+      frag_avg * 100, frag_max * 100);
+
+  free(op_ns);
+  free(ptrs);
+  free(ops);
+
+  return (corruption_cnt == 0) ? 0 : 1;
+}
@@ -42,6 +42,11 @@
  * Set this if you want to use a first-fit algorithm for allocating new
  * blocks
  *
+ * -D UMM_SEGREGATED_FIT
+ *
+ * Set this if you want to keep free blocks on one list per size class,
+ * so allocating does not walk the free list (see test/umm_malloc_bench.c)
+ *
  * -D UMM_DBG_LOG_LEVEL=n
  *
  * Set n to a value from 0 to 6 depending on how verbose you want the debug
@@ -61,7 +66,9 @@ extern void umm_corruption(void);
 
 /* Start and end addresses of the heap */
 #define UMM_MALLOC_CFG__HEAP_ADDR (test_umm_heap)
+#ifndef UMM_MALLOC_CFG__HEAP_SIZE
 #define UMM_MALLOC_CFG__HEAP_SIZE 0x10000
+#endif
 
 /* A couple of macros to make packing structures less compiler dependent */
 
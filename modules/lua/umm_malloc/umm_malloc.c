@@ -484,6 +484,30 @@
  * block (s) which adds it to the free list.
  *
  * ----------------------------------------------------------------------------
+ *
+ * Segregated fit (UMM_SEGREGATED_FIT)
+ *
+ * Best fit walks the whole free list on every malloc(), with the critical
+ * section held. With many small objects (e.g. Lua tables and strings) the
+ * free list gets long and every allocation pays for it.
+ *
+ * In this mode free blocks are kept on one list per size class instead of
+ * a single list headed by block 0. Blocks of 1 to UMM_EXACT_CLASSES units
+ * have one class per size; larger ones are binned by powers of two. A bit
+ * map tells which classes have free blocks.
+ *
+ * malloc() takes the head of the exact class, or the head of the smallest
+ * non-empty class above the requested one: every block there is big enough,
+ * so no list is walked. Only when all of them are empty, the list of the
+ * requested class is searched first-fit. The excess of a block is split off
+ * into the list of its own size.
+ *
+ * free() assimilates with both neighbours as before, so there are never two
+ * adjacent free blocks, and puts the result at the head of its class.
+ *
+ * The block layout is the same in all modes.
+ *
+ * ----------------------------------------------------------------------------
  */
 
 #include <stdio.h>
@@ -493,7 +517,7 @@
 
 #include "umm_malloc_cfg.h"   /* user-dependent */
 
-#ifndef UMM_FIRST_FIT
+#if !defined(UMM_FIRST_FIT) && !defined(UMM_SEGREGATED_FIT)
 #  ifndef UMM_BEST_FIT
 #    define UMM_BEST_FIT
 #  endif
@@ -631,6 +655,77 @@ unsigned short int umm_numblocks = 0;
 #define UMM_PFREE(b)  (UMM_BLOCK(b).body.free.prev)
 #define UMM_DATA(b)   (UMM_BLOCK(b).body.data)
 
+#define UMM_BLOCKS(b) ((UMM_NBLOCK(b) & UMM_BLOCKNO_MASK) - (b))
+
+/* size classes (UMM_SEGREGATED_FIT) {{{ */
+#if defined(UMM_SEGREGATED_FIT)
+/*
+ * Classes 0 .. UMM_EXACT_CLASSES-1 hold free blocks of exactly 1 .. 8 units,
+ * the others 9-16, 17-32, ... units, the last one everything bigger.
+ */
+#define UMM_EXACT_CLASSES 8
+#define UMM_FREE_CLASSES  16
+
+static unsigned short int umm_free_heads[UMM_FREE_CLASSES];
+static unsigned short int umm_free_map;
+
+static unsigned short int umm_free_class( unsigned short int blocks ) {
+  unsigned short int cls;
+
+  if( blocks <= UMM_EXACT_CLASSES )
+    return( blocks - 1 );
+
+  /* 9-16 -> 8, 17-32 -> 9 and so on */
+  cls = UMM_EXACT_CLASSES + (31 - __builtin_clz( blocks - 1 )) - 3;
+
+  return( cls < UMM_FREE_CLASSES ? cls : UMM_FREE_CLASSES - 1 );
+}
+
+/* put the free block `c` at the head of the list for its size */
+static void umm_connect_to_free_list( unsigned short int c ) {
+  unsigned short int cls = umm_free_class( UMM_BLOCKS(c) );
+
+  UMM_NFREE(c) = umm_free_heads[cls];
+  UMM_PFREE(c) = 0;
+
+  if( umm_free_heads[cls] )
+    UMM_PFREE(umm_free_heads[cls]) = c;
+
+  umm_free_heads[cls] = c;
+  umm_free_map |= (1 << cls);
+
+  UMM_NBLOCK(c) |= UMM_FREELIST_MASK;
+}
+
+/* a free block of at least `blocks` units, or 0 */
+static unsigned short int umm_find_free( unsigned short int blocks ) {
+  unsigned short int cls = umm_free_class( blocks );
+  unsigned short int larger;
+  unsigned short int cf;
+
+  /* every block in an exact class fits */
+  if( blocks <= UMM_EXACT_CLASSES && umm_free_heads[cls] )
+    return( umm_free_heads[cls] );
+
+  /* so does every block in the classes above */
+  larger = umm_free_map & ~((2 << cls) - 1);
+
+  if( larger )
+    return( umm_free_heads[__builtin_ctz( larger )] );
+
+  /* only blocks of our own class are left, some of them may be too small */
+  for( cf = umm_free_heads[cls]; cf; cf = UMM_NFREE(cf) ) {
+    DBG_LOG_TRACE( "Looking at block %6i size %6i\n", cf, UMM_BLOCKS(cf) );
+
+    if( UMM_BLOCKS(cf) >= blocks )
+      return( cf );
+  }
+
+  return( 0 );
+}
+#endif
+/* }}} */
+
 /* integrity check (UMM_INTEGRITY_CHECK) {{{ */
 #if defined(UMM_INTEGRITY_CHECK)
 /*
@@ -665,6 +760,51 @@ static int integrity_check(void) {
   }
 
   /* Iterate through all free blocks */
+#if defined(UMM_SEGREGATED_FIT)
+  {
+    unsigned short int cls;
+
+    for (cls = 0; cls < UMM_FREE_CLASSES; cls++) {
+      if (!umm_free_heads[cls] != !(umm_free_map & (1 << cls))) {
+        printf("heap integrity broken: free map 0x%x does not match class %d\n",
+            umm_free_map, cls);
+        ok = 0;
+        goto clean;
+      }
+
+      prev = 0;
+      cur = umm_free_heads[cls];
+      while (cur) {
+        if (cur >= UMM_NUMBLOCKS) {
+          printf("heap integrity broken: too large free num: %d "
+              "(after block %d)\n", cur, prev);
+          ok = 0;
+          goto clean;
+        }
+
+        if (UMM_PFREE(cur) != prev) {
+          printf("heap integrity broken: free links don't match: "
+              "%d -> %d, but %d -> %d\n",
+              prev, cur, cur, UMM_PFREE(cur));
+          ok = 0;
+          goto clean;
+        }
+
+        if (umm_free_class(UMM_BLOCKS(cur)) != cls) {
+          printf("heap integrity broken: block %d of size %d in class %d\n",
+              cur, UMM_BLOCKS(cur), cls);
+          ok = 0;
+          goto clean;
+        }
+
+        UMM_PBLOCK(cur) |= UMM_FREELIST_MASK;
+
+        prev = cur;
+        cur = UMM_NFREE(cur);
+      }
+    }
+  }
+#else
   prev = 0;
   while(1) {
     cur = UMM_NFREE(prev);
@@ -695,6 +835,7 @@ static int integrity_check(void) {
 
     prev = cur;
   }
+#endif
 
   /* Iterate through all blocks */
   prev = 0;
@@ -1137,8 +1278,24 @@ static void umm_make_new_block( unsigned short int c,
 static void umm_disconnect_from_free_list( unsigned short int c ) {
   /* Disconnect this block from the FREE list */
 
+#if defined(UMM_SEGREGATED_FIT)
+  /* the size of `c` must not have changed since it was put on the list */
+  if( UMM_PFREE(c) ) {
+    UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
+  } else {
+    unsigned short int cls = umm_free_class( UMM_BLOCKS(c) );
+
+    umm_free_heads[cls] = UMM_NFREE(c);
+    if( 0 == UMM_NFREE(c) )
+      umm_free_map &= ~(1 << cls);
+  }
+
+  if( UMM_NFREE(c) )
+    UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+#else
   UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
   UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+#endif
 
   /* And clear the free block indicator */
 
@@ -1232,6 +1389,14 @@ void umm_init( void ) {
      */
     UMM_NBLOCK(block_last) = 0;
     UMM_PBLOCK(block_last) = block_1th;
+
+#if defined(UMM_SEGREGATED_FIT)
+    /* block 0 is not a list head here, the 1st block goes to its size class */
+    memset(umm_free_heads, 0, sizeof(umm_free_heads));
+    umm_free_map = 0;
+    UMM_NFREE(block_0th) = 0;
+    umm_connect_to_free_list(block_1th);
+#endif
   }
 }
 
@@ -1273,6 +1438,18 @@ static void _umm_free( void *ptr ) {
 
   /* Then assimilate with the previous block if possible */
 
+#if defined(UMM_SEGREGATED_FIT)
+  /* the merged block grows out of its size class, so it is linked again */
+  if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
+
+    DBG_LOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
+
+    umm_disconnect_from_free_list( UMM_PBLOCK(c) );
+    c = umm_assimilate_down(c, 0);
+  }
+
+  umm_connect_to_free_list( c );
+#else
   if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
 
     DBG_LOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
@@ -1293,6 +1470,7 @@ static void _umm_free( void *ptr ) {
 
     UMM_NBLOCK(c)          |= UMM_FREELIST_MASK;
   }
+#endif
 
 #if 0
   /*
@@ -1327,8 +1505,10 @@ static void *_umm_malloc( size_t size ) {
   unsigned short int blocks;
   unsigned short int blockSize = 0;
 
+#if !defined(UMM_SEGREGATED_FIT)
   unsigned short int bestSize;
   unsigned short int bestBlock;
+#endif
 
   unsigned short int cf;
 
@@ -1354,6 +1534,33 @@ static void *_umm_malloc( size_t size ) {
 
   blocks = umm_blocks( size );
 
+#if defined(UMM_SEGREGATED_FIT)
+  cf = umm_find_free( blocks );
+
+  if( cf ) {
+    blockSize = UMM_BLOCKS(cf);
+
+    DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - size %6i\n", blocks, cf, blockSize );
+
+    umm_disconnect_from_free_list( cf );
+
+    if( blockSize > blocks ) {
+      /* the rest goes to the list for its own size */
+      umm_make_new_block( cf, blocks, 0, 0 );
+      umm_connect_to_free_list( cf + blocks );
+    }
+  } else {
+    /* Out of memory */
+
+    DBG_LOG_DEBUG(  "Can't allocate %5i blocks\n", blocks );
+
+    /* Release the critical section... */
+    UMM_CRITICAL_EXIT();
+
+    return( (void *)NULL );
+  }
+#else
+
   /*
    * Now we can scan through the free list until we find a space that's big
    * enough to hold the number of blocks we need.
@@ -1444,6 +1651,7 @@ static void *_umm_malloc( size_t size ) {
 
     return( (void *)NULL );
   }
+#endif
 
   /* Release the critical section... */
   UMM_CRITICAL_EXIT();
@@ -37,6 +37,11 @@
  * Set this if you want to use a first-fit algorithm for allocating new
  * blocks
  *
+ * -D UMM_SEGREGATED_FIT
+ *
+ * Set this if you want to keep free blocks on one list per size class,
+ * so allocating does not walk the free list (see test/umm_malloc_bench.c)
+ *
  * -D UMM_DBG_LOG_LEVEL=n
  *
  * Set n to a value from 0 to 6 depending on how verbose you want the debug
@@ -54,6 +59,9 @@
 #include "arm-mcr.h"
 extern void * __mem_malloc( size_t len, unsigned int flags, const char *file, unsigned int line);
 
+/* Lua allocates lots of small objects, often from GUI tasks with interrupts disabled */
+#define UMM_SEGREGATED_FIT
+
 /* Start addresses and the size of the heap */
 #define UMM_MALLOC_CFG__HEAP_ADDR __mem_malloc(UMM_MALLOC_CFG__HEAP_SIZE, 0, "umm", 0);
 #define UMM_MALLOC_CFG__HEAP_SIZE (256*1024-32)
@@ -34,6 +34,9 @@
 #include "../dual_iso/optmed.h"
 #include "../dual_iso/wirth.h"
 #include "../mlv_rec/mlv.h"
+#include "../mlv_rec/pipeline.h"
+#include <sys/time.h>
+#include <unistd.h>
 
 
 /* useful to clean pink dots, may also help with color aliasing, but it's best turned off if you don't have these problems */
@@ -45,9 +48,10 @@ struct raw_info raw_info;
 #define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
 #define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
 
-void fix_vertical_stripes();
-void find_and_fix_cold_pixels(int force_analysis);
-void chroma_smooth();
+void fix_vertical_stripes(void* buffer, int first_frame);
+void find_and_fix_cold_pixels(void* buffer, int force_analysis);
+void chroma_smooth(void* buffer);
+void reverse_bytes_order(char* buf, int32_t count);
 
 #define EV_RESOLUTION 32768
 
@@ -79,45 +83,135 @@ uint64_t mlv_generate_guid();
 uint64_t mlv_prng_lfsr(uint64_t value);
 uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence);
 
-int main(int argc, char** argv)
+/* conversion totals over all files, for the summary */
+struct convert_stats
+{
+    int files;
+    int frames;
+    uint64_t bytes;
+};
+
+/* the DNG header is the same for all frames of a file, so the frames can be written from several threads */
+struct dng_template
+{
+    char* header;
+    int32_t header_size;
+    int32_t thumb_width;
+    int32_t thumb_height;
+};
+
+/* one frame handed from the reading loop to the DNG workers */
+struct dng_job
+{
+    char* raw;
+    int framenumber;
+    int ok;
+    char fn[FILENAME_MAX];
+};
+
+static double get_time_sec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* what the serial loop does with a frame, except for the first one, which also analyzes the footage */
+static int dng_job_work(void* ctx, int worker, void* arg)
 {
-    if (argc < 2)
+    struct dng_template * t = (struct dng_template *)ctx;
+    struct dng_job * job = (struct dng_job *)arg;
+
+    fix_vertical_stripes(job->raw, 0);
+    find_and_fix_cold_pixels(job->raw, 0);
+
+    #ifdef CHROMA_SMOOTH
+    chroma_smooth(job->raw);
+    #endif
+
+    job->ok = dng_write_frame(job->fn, job->raw, &raw_info, t->header, t->header_size, t->thumb_width, t->thumb_height);
+    return 0;
+}
+
+/* runs in frame order, so the progress looks like in the serial loop */
+static int dng_job_write(void* ctx, void* arg, int error)
+{
+    struct dng_job * job = (struct dng_job *)arg;
+    int ret = 0;
+
+    if (!error)
     {
-        printf(
-            "\n"
-            "usage:\n"
-            "\n"
-            "%s file.raw [prefix|--mlv [sidecar]]\n"
-            "\n"
-            "  prefix    will create prefix000000.dng, prefix0000001.dng and so on.\n"
-            "   --mlv    will output MLV with unprocessed raw data and the same name as input.\n"
-            " sidecar    if needed specify (prerecorded or any) MLV file to override meaningless\n"
-            "            metadata values in IDNT, EXPO, LENS and WBAL blocks\n"
-            "\n",
-            argv[0]
-        );
-        return 1;
+        printf("\rProcessing frame %d of %d writing DNG...", job->framenumber+1, lv_rec_footer.frameCount);
+        fflush(stdout);
+
+        if (!job->ok)
+        {
+            printf("\nError: could not write %s\n", job->fn);
+            ret = 1;
+        }
     }
-    
-    char* prefix = "";
-    char* sidecar_name = "";
-    int mlvout = 0, sidecar_ok = 0;
-    uint64_t frame_dur_us;
+
+    free(job->raw);
+    free(job);
+    return ret;
+}
+
+/* read the next frame, it may continue in the next file chunk */
+static int read_frame(char* raw, FILE** in_files, int in_file_count, int* in_file_num, int framenumber)
+{
+    FILE* in_file = in_files[*in_file_num];
+    unsigned int r = fread(raw, 1, lv_rec_footer.frameSize, in_file);
+    if(r != lv_rec_footer.frameSize && *in_file_num + 1 < in_file_count)
+    {
+        (*in_file_num)++;
+        in_file = in_files[*in_file_num];
+
+        if(r != 0)
+        {
+            unsigned int h = fread(raw + r, 1, (lv_rec_footer.frameSize - r), in_file);
+            printf("\n\nFrame %d is splitted between neigbour file chunks in a sequence\nReconstructing frame -> %u bytes + %u bytes = %u bytes\n\n", framenumber + 1, r, h, r + h);
+        }
+        else
+        {
+            r = fread(raw, 1, lv_rec_footer.frameSize, in_file);
+            if(r != lv_rec_footer.frameSize)
+            {
+                printf("\nError: last file is corrupted.");
+                return 0;
+            }
+        }
+    }
+    else if(r != lv_rec_footer.frameSize)
+    {
+        printf("\nError: last file is corrupted.");
+        return 0;
+    }
+    return 1;
+}
+
+/* convert one .RAW (with its .R00, .R01 ... chunks) into DNG frames or a MLV */
+static int convert_file(char* in_file_name, char* prefix, int mlvout, char* sidecar_name, int threads, struct convert_stats * stats)
+{
+    int sidecar_ok = 0;
+    uint64_t frame_dur_us = 0;
+    int ret = 0;
     
     FILE *out_file = NULL;
     FILE **in_files = NULL;
     FILE *in_file = NULL;
-    char *in_file_name = argv[1];
     int in_file_count = 0;
     int in_file_num = 0;
-    
+
+    pipeline_t *dng_pipeline = NULL;
+    struct dng_template dng_template = { 0 };
+    char *raw = NULL;
 
     in_files = load_all_chunks(in_file_name, &in_file_count);
     if(!in_files || !in_file_count)
     {
         /* Print this out on RAW chunk opening errors */
-        printf(" - Exiting program\n");
-        exit(1);
+        printf(" - Skipping file\n");
+        return 0;
     }
     else
     {
@@ -125,20 +219,25 @@ int main(int argc, char** argv)
         in_file = in_files[in_file_num-1];
     }
 
-    if (sizeof(lv_rec_file_footer_t) != 192) FAIL("sizeof(lv_rec_file_footer_t) = %d, should be 192", sizeof(lv_rec_file_footer_t));
     file_set_pos(in_file, -192, SEEK_END);
 
     memset(&lv_rec_footer, 0x00, sizeof(lv_rec_file_footer_t));
     int r = fread(&lv_rec_footer, 1, sizeof(lv_rec_file_footer_t), in_file);
     CHECK(r == sizeof(lv_rec_file_footer_t), "footer");
-    raw_info = lv_rec_footer.raw_info;
+    raw_info_from_camera(&raw_info, &lv_rec_footer.raw_info);
     file_set_pos(in_file, 0, SEEK_SET);
 
     if (strncmp((char*)lv_rec_footer.magic, "RAWM", 4))
-        FAIL("This ain't a lv_rec RAW file\n");
+    {
+        printf("Error: This ain't a lv_rec RAW file\n");
+        goto abort;
+    }
     
     if (raw_info.api_version != 1)
-        FAIL("API version mismatch: %d\n", raw_info.api_version);
+    {
+        printf("Error: API version mismatch: %d\n", raw_info.api_version);
+        goto abort;
+    }
     
     /* override params here (e.g. when the footer is from some other file) */
     //~ lv_rec_footer.xRes=2048;
@@ -154,26 +253,23 @@ int main(int argc, char** argv)
     printf("Black level : %d\n", lv_rec_footer.raw_info.black_level);
     printf("White level : %d\n\n", lv_rec_footer.raw_info.white_level);
 
-    char *raw = malloc(lv_rec_footer.frameSize);
+    raw = malloc(lv_rec_footer.frameSize);
     CHECK(raw, "malloc");
     
-    if ((argc > 2) && (strcmp(argv[2], "--mlv") == 0))
+    if (mlvout)
     {
-        mlvout = 1;
-        
         /* Zero all structs */
         init_mlv_structs();
 
         /* Read sidecar MLV */
-        sidecar_name = argc > 3 ? argv[3] : "";
         if(strlen(sidecar_name))
         {
             sidecar_ok = parse_sidecar(sidecar_name);
         }
         
         /* Open MLV file for output */
-        char out_file_name[strlen(argv[1])];
-        set_out_file_name(out_file_name, argv[1]);
+        char out_file_name[strlen(in_file_name) + 1];
+        set_out_file_name(out_file_name, in_file_name);
         out_file = fopen(out_file_name, "wb");
         CHECK(out_file, "could not open %s", out_file_name);
 
@@ -226,7 +322,7 @@ int main(int argc, char** argv)
         }
 
         /* Write RTCI block */
-        set_rtci_block(argv[1]);
+        set_rtci_block(in_file_name);
         if(fwrite(&rtci_hdr, sizeof(mlv_rtci_hdr_t), 1, out_file) != 1)
         {
             printf("Failed writing RTCI block into .MLV file\n");
@@ -240,8 +336,6 @@ int main(int argc, char** argv)
     }
     else
     {
-        mlvout = 0;
-        prefix = argc > 2 ? argv[2] : "";
         /* override the resolution from raw_info with the one from lv_rec_footer, if they don't match */
         if (lv_rec_footer.xRes != raw_info.width)
         {
@@ -268,29 +362,43 @@ int main(int argc, char** argv)
 
     int framenumber;
     in_file_num = 0;
-    in_file = in_files[in_file_num];
     for (framenumber = 0; framenumber < lv_rec_footer.frameCount; framenumber++)
     {
-        printf("\rProcessing frame %d of %d ", framenumber+1, lv_rec_footer.frameCount);
-        fflush(stdout);
-        
-        unsigned int r = fread(raw, 1, lv_rec_footer.frameSize, in_file);
-        if(r != lv_rec_footer.frameSize && in_file_num < in_file_count)
+        /* frames after the first one are converted on the worker threads, while the next ones are read */
+        if (dng_pipeline)
         {
-            in_file_num++;
-            in_file = in_files[in_file_num];
-            
-            if(r != 0)
+            struct dng_job * job = calloc(1, sizeof(struct dng_job));
+            if (!job || !(job->raw = malloc(lv_rec_footer.frameSize)))
+            {
+                printf("\nError: malloc failed\n");
+                free(job);
+                goto abort;
+            }
+            job->framenumber = framenumber;
+            snprintf(job->fn, sizeof(job->fn), "%s%06d.dng", prefix, framenumber);
+
+            if (!read_frame(job->raw, in_files, in_file_count, &in_file_num, framenumber))
+            {
+                free(job->raw);
+                free(job);
+                goto abort;
+            }
+
+            /* blocks while all workers are busy */
+            if (pipeline_submit(dng_pipeline, job))
             {
-                raw += r;
-                unsigned int h = fread(raw, 1, (lv_rec_footer.frameSize - r), in_file);
-                raw -= r;
-                printf("\n\nFrame %d is splitted between neigbour file chunks in a sequence\nReconstructing frame -> %u bytes + %u bytes = %u bytes\n\n", framenumber + 1, r, h, r + h);
+                goto abort;
             }
+            stats->frames++;
+            stats->bytes += lv_rec_footer.frameSize;
+            continue;
         }
-        else if(r != lv_rec_footer.frameSize)
+
+        printf("\rProcessing frame %d of %d ", framenumber+1, lv_rec_footer.frameCount);
+        fflush(stdout);
+        
+        if (!read_frame(raw, in_files, in_file_count, &in_file_num, framenumber))
         {
-            printf("\nError: last file is corrupted.");
             goto abort;
         }
         
@@ -302,19 +410,35 @@ int main(int argc, char** argv)
             /* uncomment if the raw file is recovered from a DNG with dd */
             //~ reverse_bytes_order(raw, lv_rec_footer.frameSize);
             
-            char fn[100];
+            char fn[FILENAME_MAX];
             snprintf(fn, sizeof(fn), "%s%06d.dng", prefix, framenumber);
 
-            fix_vertical_stripes();
-            find_and_fix_cold_pixels(0);
+            /* the first frame of every file is used to find stripes and cold pixels */
+            fix_vertical_stripes(raw, framenumber == 0);
+            find_and_fix_cold_pixels(raw, framenumber == 0);
 
             #ifdef CHROMA_SMOOTH
-            chroma_smooth();
+            chroma_smooth(raw);
             #endif
 
             dng_set_camname((char*)idnt_hdr.cameraName);
             dng_set_framerate(lv_rec_footer.sourceFpsx1000);
             save_dng(fn, &raw_info);
+
+            /* from now on, stripe coefficients and the cold pixel list are only read, so the other frames can be done in parallel */
+            if (threads > 1 && framenumber == 0 && lv_rec_footer.frameCount > 1)
+            {
+                dng_template.header = dng_get_header(&raw_info, &dng_template.header_size, &dng_template.thumb_width, &dng_template.thumb_height);
+                if (dng_template.header)
+                {
+                    /* two frames per thread in flight: that's the read-ahead */
+                    dng_pipeline = pipeline_create(threads, 2 * threads, dng_job_work, dng_job_write, &dng_template);
+                }
+                if (!dng_pipeline)
+                {
+                    printf("\nFailed to start worker threads, converting frames serially\n");
+                }
+            }
         }
         else
         {
@@ -334,10 +458,23 @@ int main(int argc, char** argv)
 
             printf("writing MLV...");
         }
+
+        stats->frames++;
+        stats->bytes += lv_rec_footer.frameSize;
     }
 
+    ret = 1;
+
 abort:
 
+    /* wait for the frames still in flight */
+    if (dng_pipeline && pipeline_finish(dng_pipeline))
+    {
+        printf("\nError: DNG worker threads failed\n");
+        ret = 0;
+    }
+    free(dng_template.header);
+
     /* Close all opened input files and free list of input files */
     for(in_file_num = 0; in_file_num < in_file_count; in_file_num++)
     {
@@ -347,23 +484,132 @@ abort:
     
     free(raw);
 
+    if (out_file)
+    {
+        fclose(out_file);
+    }
+    printf(" Done.\n");
+
+    stats->files += ret;
+    return ret;
+}
+
+static int is_raw_file(char* name)
+{
+    char* dot = strrchr(name, '.');
+    return dot && !strcasecmp(dot, ".raw");
+}
+
+/* output prefix for one input file; several files must not write over each other's frames */
+static void get_file_prefix(char* buf, int size, char* prefix, char* file, int per_file)
+{
+    snprintf(buf, size, "%s", prefix);
+
+    if (per_file)
+    {
+        char* name = strrchr(file, '/');
+        char* name2 = strrchr(file, '\\');
+        if (name2 > name) name = name2;
+        name = name ? name + 1 : file;
+        char* dot = strrchr(name, '.');
+        int name_len = dot ? (int)(dot - name) : (int)strlen(name);
+        int len = strlen(buf);
+        snprintf(buf + len, size - len, "%.*s_", name_len, name);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    char* prefix = "";
+    char* sidecar_name = "";
+    int mlvout = 0;
+    int threads = pipeline_cpu_count();
+    char** files = malloc(argc * sizeof(char*));
+    int num_files = 0;
+
+    CHECK(files, "malloc");
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "--threads", 9))
+        {
+            threads = (argv[i][9] == '=') ? atoi(argv[i] + 10) : pipeline_cpu_count();
+            if (threads < 1) threads = 1;
+        }
+        else if (!strcmp(argv[i], "--mlv"))
+        {
+            mlvout = 1;
+            if (i + 1 < argc && !is_raw_file(argv[i+1]) && strncmp(argv[i+1], "--", 2))
+            {
+                sidecar_name = argv[++i];
+            }
+        }
+        else if (is_raw_file(argv[i]) || !num_files)
+        {
+            files[num_files++] = argv[i];
+        }
+        else
+        {
+            prefix = argv[i];
+        }
+    }
+
+    if (!num_files)
+    {
+        printf(
+            "\n"
+            "usage:\n"
+            "\n"
+            "%s [--threads=N] file.raw [file2.raw ...] [prefix|--mlv [sidecar]]\n"
+            "\n"
+            "  prefix    will create prefix000000.dng, prefix0000001.dng and so on.\n"
+            "            with more than one file: prefix<file name>_000000.dng ...\n"
+            "   --mlv    will output MLV with unprocessed raw data and the same name as input.\n"
+            " sidecar    if needed specify (prerecorded or any) MLV file to override meaningless\n"
+            "            metadata values in IDNT, EXPO, LENS and WBAL blocks\n"
+            " --threads  convert N frames at once (default: all CPUs, output is the same)\n"
+            "\n",
+            argv[0]
+        );
+        free(files);
+        return 1;
+    }
+
+    if (sizeof(lv_rec_file_footer_t) != 192) FAIL("sizeof(lv_rec_file_footer_t) = %d, should be 192", (int)sizeof(lv_rec_file_footer_t));
+
+    struct convert_stats stats = { 0 };
+    double start = get_time_sec();
+
+    for (int i = 0; i < num_files; i++)
+    {
+        char file_prefix[FILENAME_MAX];
+        get_file_prefix(file_prefix, sizeof(file_prefix), prefix, files[i], num_files > 1 && !mlvout);
+        convert_file(files[i], file_prefix, mlvout, sidecar_name, threads, &stats);
+    }
+
+    double elapsed = get_time_sec() - start;
+    printf("\nConverted %d frames from %d of %d file%s in %.2f s (%.2f frames/s, %.2f MB/s, %d thread%s)\n",
+        stats.frames, stats.files, num_files, num_files > 1 ? "s" : "", elapsed,
+        elapsed > 0 ? stats.frames / elapsed : 0.0, elapsed > 0 ? stats.bytes / elapsed / 1000000.0 : 0.0,
+        threads, threads > 1 ? "s" : "");
+
     if (!mlvout)
     {
-        printf(" Done.\n");
         printf("\nTo convert to jpg, you can try: \n");
         printf("    ufraw-batch --out-type=jpg %s*.dng\n", prefix);
         printf("\nTo get a mjpeg video: \n");
-        printf("    ffmpeg -i %s%%6d.jpg -vcodec mjpeg -qscale 1 video.avi\n\n", prefix);
-    }
-    else
-    {
-        fclose(out_file);
-        printf(" Done.\n");
+        for (int i = 0; i < num_files; i++)
+        {
+            char file_prefix[FILENAME_MAX];
+            get_file_prefix(file_prefix, sizeof(file_prefix), prefix, files[i], num_files > 1);
+            printf("    ffmpeg -i %s%%6d.jpg -vcodec mjpeg -qscale 1 %svideo.avi\n", file_prefix, num_files > 1 ? file_prefix : "");
+        }
+        printf("\n");
     }
-    
-    return 0;
-}
 
+    free(files);
+    return stats.files == num_files ? 0 : 1;
+}
 
 void set_out_file_name(char *outname, char *inname)
 {
@@ -817,8 +1063,8 @@ uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
 }
 #endif
 
-int raw_get_pixel(int x, int y) {
-    struct raw_pixblock * p = (void*)raw_info.buffer + y * raw_info.pitch + (x/8)*14;
+int raw_get_pixel_ex(void* raw_buffer, int x, int y) {
+    struct raw_pixblock * p = raw_buffer + y * raw_info.pitch + (x/8)*14;
     switch (x%8) {
         case 0: return p->a;
         case 1: return p->b_lo | (p->b_hi << 12);
@@ -832,9 +1078,9 @@ int raw_get_pixel(int x, int y) {
     return p->a;
 }
 
-void raw_set_pixel(int x, int y, int value)
+static void raw_set_pixel_ex(void* raw_buffer, int x, int y, int value)
 {
-    struct raw_pixblock * p = (void*)raw_info.buffer + y * raw_info.pitch + (x/8)*14;
+    struct raw_pixblock * p = raw_buffer + y * raw_info.pitch + (x/8)*14;
     switch (x%8) {
         case 0: p->a = value; break;
         case 1: p->b_lo = value; p->b_hi = value >> 12; break;
@@ -847,6 +1093,17 @@ void raw_set_pixel(int x, int y, int value)
     }
 }
 
+/* the raw.h accessors, on raw_info.buffer */
+int raw_get_pixel(int x, int y)
+{
+    return raw_get_pixel_ex(raw_info.buffer, x, y);
+}
+
+void raw_set_pixel(int x, int y, int value)
+{
+    raw_set_pixel_ex(raw_info.buffer, x, y, value);
+}
+
 /**
  * Fix vertical stripes (banding) from 5D Mark III (and maybe others).
  * 
@@ -946,19 +1203,20 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
 }
 
 
-static void detect_vertical_stripes_coeffs()
+static void detect_vertical_stripes_coeffs(void* buffer)
 {
     static int hist[8][FIXP_RANGE];
     static int num[8];
     
     memset(hist, 0, sizeof(hist));
     memset(num, 0, sizeof(num));
+    memset(stripes_coeffs, 0, sizeof(stripes_coeffs));
 
     /* compute 7 histograms: b./a, c./a ... h./a */
     /* that is, adjust all columns to make them as bright as a */
     /* process green pixels only, assuming the image is RGGB */
     struct raw_pixblock * row;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += 2 * raw_info.pitch / sizeof(struct raw_pixblock))
+    for (row = buffer; (void*)row < buffer + raw_info.pitch * raw_info.height; row += 2 * raw_info.pitch / sizeof(struct raw_pixblock))
     {
         /* first line is RG */
         struct raw_pixblock * rg;
@@ -1090,7 +1348,7 @@ static void detect_vertical_stripes_coeffs()
     }
 }
 
-static void apply_vertical_stripes_correction()
+static void apply_vertical_stripes_correction(void* buffer)
 {
     /**
      * inexact white level will result in banding in highlights, especially if some channels are clipped
@@ -1108,7 +1366,7 @@ static void apply_vertical_stripes_correction()
     
     struct raw_pixblock * row;
     
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    for (row = buffer; (void*)row < buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
     {
         struct raw_pixblock * p;
         for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
@@ -1125,7 +1383,7 @@ static void apply_vertical_stripes_correction()
     }
     
     int black = raw_info.black_level;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    for (row = buffer; (void*)row < buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
     {
         struct raw_pixblock * p;
         for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
@@ -1158,20 +1416,18 @@ static void apply_vertical_stripes_correction()
     }
 }
 
-void fix_vertical_stripes()
+void fix_vertical_stripes(void* buffer, int first_frame)
 {
-    /* for speed: only detect correction factors from the first frame */
-    static int first_time = 1;
-    if (first_time)
+    /* for speed: only detect correction factors from the first frame (of each file) */
+    if (first_frame)
     {
-        detect_vertical_stripes_coeffs();
-        first_time = 0;
+        detect_vertical_stripes_coeffs(buffer);
     }
     
     /* only apply stripe correction if we need it, since it takes a little CPU time */
     if (stripes_correction_needed)
     {
-        apply_vertical_stripes_correction();
+        apply_vertical_stripes_correction(buffer);
     }
 }
 
@@ -1192,7 +1448,7 @@ static inline int FC(int row, int col)
 }
 
 
-void find_and_fix_cold_pixels(int force_analysis)
+void find_and_fix_cold_pixels(void* buffer, int force_analysis)
 {
     #define MAX_COLD_PIXELS 200000
   
@@ -1217,7 +1473,7 @@ void find_and_fix_cold_pixels(int force_analysis)
         {
             for (int x = 0; x < w; x++)
             {
-                int p = raw_get_pixel(x, y);
+                int p = raw_get_pixel_ex(buffer, x, y);
                 int is_cold = (p < cold_thr);
 
                 /* create a list containing the cold pixels */
@@ -1265,13 +1521,13 @@ void find_and_fix_cold_pixels(int force_analysis)
                     continue;
                 }
 
-                int p = raw_get_pixel(x+j, y+i);
+                int p = raw_get_pixel_ex(buffer, x+j, y+i);
                 neighbours[k++] = -p;
             }
         }
         
         /* replace the cold pixel with the median of the neighbours */
-        raw_set_pixel(x, y, -median_int_wirth(neighbours, k));
+        raw_set_pixel_ex(buffer, x, y, -median_int_wirth(neighbours, k));
     }
     
 }
@@ -1778,22 +2034,28 @@ static void chroma_smooth_5x5(unsigned short * inp, unsigned short * out, int* r
     }
 }
 
-void chroma_smooth()
+void chroma_smooth(void* buffer)
 {
     int black = raw_info.black_level;
     static int raw2ev[16384];
     static int _ev2raw[24*EV_RESOLUTION];
+    static int tables_black = -1;
     int* ev2raw = _ev2raw + 10*EV_RESOLUTION;
     
-    int i;
-    for (i = 0; i < 16384; i++)
+    /* the first frame of each file fills the tables, worker threads only read them */
+    if (black != tables_black)
     {
-        raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
-    }
+        int i;
+        for (i = 0; i < 16384; i++)
+        {
+            raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
+        }
 
-    for (i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
-    {
-        ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
+        for (i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
+        {
+            ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
+        }
+        tables_black = black;
     }
 
     int w = raw_info.width;
@@ -1805,13 +2067,13 @@ void chroma_smooth()
     int x,y;
     for (y = 0; y < h; y++)
         for (x = 0; x < w; x++)
-            aux[x + y*w] = aux2[x + y*w] = raw_get_pixel(x, y);
+            aux[x + y*w] = aux2[x + y*w] = raw_get_pixel_ex(buffer, x, y);
     
     chroma_smooth_2x2(aux, aux2, raw2ev, ev2raw);
     
     for (y = 0; y < h; y++)
         for (x = 0; x < w; x++)
-            raw_set_pixel(x, y, aux2[x + y*w]);
+            raw_set_pixel_ex(buffer, x, y, aux2[x + y*w]);
 
     free(aux);
     free(aux2);
@@ -4230,7 +4230,9 @@ unsigned int raw_rec_update_preview(unsigned int ctx)
         -1,
         (need_for_speed && !get_halfshutter_pressed())
             ? RAW_PREVIEW_GRAY_ULTRA_FAST
-            : RAW_PREVIEW_COLOR_HALFRES
+            : (RAW_IS_RECORDING && !get_halfshutter_pressed())
+                ? RAW_PREVIEW_COLOR_LOWRES
+                : RAW_PREVIEW_COLOR_HALFRES
     );
 
     give_semaphore(settings_sem);
@@ -42,6 +42,7 @@
 #include "../ime_base/ime_base.h"
 #include "../trace/trace.h"
 #include "../mlv_rec/mlv.h"
+#include "../mlv_rec/mlv_index.h"
 #include "../file_man/file_man.h"
 #include "../lv_rec/lv_rec.h"
 #include "../raw_twk/raw_twk.h"
@@ -111,15 +112,6 @@ static uint32_t mlv_play_info = 1;
 static uint32_t mlv_play_timer_stop = 1;
 static uint32_t mlv_play_frames_skipped = 0;
 
-/* this structure is used to build the mlv_xref_t table */
-typedef struct 
-{
-    uint64_t    frameTime;
-    uint64_t    frameOffset;
-    uint16_t    fileNumber;
-    uint16_t    frameType;
-} frame_xref_t;
-
 typedef struct
 {
     char fullPath[MAX_PATH];
@@ -898,45 +890,21 @@ static void mlv_play_osd_task(void *priv)
 }
 
 
-static void mlv_play_xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
+static uint64_t mlv_play_xref_time(void *ctx, const mlv_xref_t *xref)
 {
-    /* make sure there is no crappy pointer before using */
-    if(*allocated == 0)
-    {
-        *table = NULL;
-    }
+    FILE **chunk_files = (FILE **)ctx;
+    mlv_hdr_t buf;
     
-    /* only resize if the buffer is too small */
-    if(entries * sizeof(frame_xref_t) > *allocated)
+    FIO_SeekSkipFile(chunk_files[xref->fileNumber], xref->frameOffset, SEEK_SET);
+    if(FIO_ReadFile(chunk_files[xref->fileNumber], &buf, sizeof(mlv_hdr_t)) != sizeof(mlv_hdr_t))
     {
-        *allocated += (entries + 1) * sizeof(frame_xref_t);
-        *table = realloc(*table, *allocated);
+        return 0;
     }
-}
-
-static void mlv_play_xref_sort(frame_xref_t *table, uint32_t entries)
-{
-    if (!entries) return;
     
-    uint32_t n = entries;
-    do
-    {
-        uint32_t newn = 1;
-        for (uint32_t i = 0; i < n-1; ++i)
-        {
-            if (table[i].frameTime > table[i+1].frameTime)
-            {
-                frame_xref_t tmp = table[i+1];
-                table[i+1] = table[i];
-                table[i] = tmp;
-                newn = i + 1;
-            }
-        }
-        n = newn;
-    } while (n > 1);
+    return mlv_index_block_time(&buf);
 }
 
-static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename)
+static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename, mlv_file_hdr_t *idx_hdr)
 {
     mlv_xref_hdr_t *block_hdr = NULL;
     char filename[128];
@@ -967,7 +935,7 @@ static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename)
         /* jump back to the beginning of the block just read */
         FIO_SeekSkipFile(in_file, position, SEEK_SET);
 
-        /* we should check the MLVI header for matching UID value to make sure its the right index... */
+        /* the MLVI header goes to 'idx_hdr', the caller checks its GUID against the clip */
         if(!memcmp(buf.blockType, "XREF", 4))
         {
             block_hdr = fio_malloc(buf.blockSize);
@@ -978,6 +946,14 @@ static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename)
                 block_hdr = NULL;
             }
         }
+        else if(idx_hdr && !memcmp(buf.blockType, "MLVI", 4) && buf.blockSize >= sizeof(mlv_file_hdr_t))
+        {
+            if(FIO_ReadFile(in_file, idx_hdr, sizeof(mlv_file_hdr_t)) != sizeof(mlv_file_hdr_t))
+            {
+                break;
+            }
+            FIO_SeekSkipFile(in_file, position + buf.blockSize, SEEK_SET);
+        }
         else
         {
             FIO_SeekSkipFile(in_file, position + buf.blockSize, SEEK_SET);
@@ -1086,14 +1062,25 @@ static void mlv_play_save_index(char *base_filename, mlv_file_hdr_t *ref_file_hd
     FIO_CloseFile(out_file);
 }
 
-static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t chunk_count)
+/* index chunks starting from 'first_chunk'. if 'saved' is given, it contains the index of all chunks before */
+static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t chunk_count, mlv_xref_hdr_t *saved, uint32_t first_chunk)
 {
-    frame_xref_t *frame_xref_table = NULL;
-    uint32_t frame_xref_entries = 0;
-    uint32_t frame_xref_allocated = 0;
+    mlv_index_t xref_index;
     mlv_file_hdr_t main_header;
     
-    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    mlv_index_init(&xref_index);
+    
+    /* when continuing an existing index, the main header is not part of the scanned chunks */
+    FIO_SeekSkipFile(chunk_files[0], 0, SEEK_SET);
+    if(FIO_ReadFile(chunk_files[0], &main_header, sizeof(mlv_file_hdr_t)) != sizeof(mlv_file_hdr_t))
+    {
+        bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
+        beep();
+        msleep(2000);
+        return;
+    }
+    
+    for(uint32_t chunk = first_chunk; chunk < chunk_count; chunk++)
     {
         uint32_t last_pct = 0;
         int64_t size = 0;
@@ -1112,7 +1099,6 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
             }
             
             mlv_hdr_t buf;
-            uint64_t timestamp = 0;
             
             uint32_t pct = ((position / 10) / (size / 1000));
             
@@ -1138,6 +1124,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                     bmp_printf(FONT_MED, 30, 190, "File #%d ends prematurely, %d bytes read", chunk, read);
                     beep();
                     msleep(2000);
+                    mlv_index_free(&xref_index);
                     return;
                 }
             }
@@ -1148,6 +1135,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                 bmp_printf(FONT_MED, 30, 190, "Invalid header size: %d bytes at 0x%08X", buf.blockSize, position);
                 beep();
                 msleep(2000);
+                mlv_index_free(&xref_index);
                 return;
             }
 
@@ -1165,6 +1153,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                     bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
                     beep();
                     msleep(2000);
+                    mlv_index_free(&xref_index);
                     return;
                 }
 
@@ -1181,34 +1170,20 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                         bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
                         beep();
                         msleep(2000);
+                        mlv_index_free(&xref_index);
                         return;
                     }
                 }
-                
-                /* emulate timestamp zero (will overwrite version string) */
-                timestamp = 0;
-            }
-            else
-            {
-                /* all other blocks have a timestamp */
-                timestamp = buf.timestamp;
             }
             
-            /* dont index NULL blocks */
-            if(memcmp(buf.blockType, "NULL", 4))
+            /* add xref data, NULL and BKUP blocks are skipped. MLVI headers get timestamp zero */
+            if(mlv_index_add_block(&xref_index, &buf, position, chunk))
             {
-                mlv_play_xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-                
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = chunk;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-                
-                frame_xref_entries++;
+                bmp_printf(FONT_MED, 30, 190, "Failed to allocate index");
+                beep();
+                msleep(2000);
+                mlv_index_free(&xref_index);
+                return;
             }
             
             position += buf.blockSize;
@@ -1216,25 +1191,85 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
         }
     }
     
-    mlv_play_xref_sort(frame_xref_table, frame_xref_entries);
-    mlv_play_save_index(filename, &main_header, chunk_count, frame_xref_table, frame_xref_entries);
+    int ret = 0;
+    if(saved)
+    {
+        mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)saved)[sizeof(mlv_xref_hdr_t)]);
+        
+        ret = mlv_index_merge_saved(&xref_index, xrefs, saved->entryCount, mlv_play_xref_time, chunk_files);
+    }
+    else
+    {
+        ret = mlv_index_sort(&xref_index);
+    }
+    
+    if(!ret)
+    {
+        mlv_play_save_index(filename, &main_header, chunk_count, xref_index.entries, xref_index.count);
+    }
+    mlv_index_free(&xref_index);
 }
 
 static mlv_xref_hdr_t *mlv_play_get_index(char *filename, FILE **chunk_files, uint32_t chunk_count)
 {
     mlv_xref_hdr_t *table = NULL;
     
-    table = mlv_play_load_index(filename);
+    mlv_file_hdr_t idx_hdr;
+    uint32_t covered = 0;
+    
+    memset(&idx_hdr, 0x00, sizeof(mlv_file_hdr_t));
+    table = mlv_play_load_index(filename, &idx_hdr);
+    if(table)
+    {
+        /* an index left over from another clip with the same name must not be used, same check as in mlv_dump */
+        mlv_file_hdr_t file_hdr;
+        
+        FIO_SeekSkipFile(chunk_files[0], 0, SEEK_SET);
+        if(FIO_ReadFile(chunk_files[0], &file_hdr, sizeof(mlv_file_hdr_t)) != sizeof(mlv_file_hdr_t) || idx_hdr.fileGuid != file_hdr.fileGuid)
+        {
+            free(table);
+            table = NULL;
+        }
+    }
+    
     if(table)
     {
-        return table;
+        /* old index files don't tell how many chunks they cover, just use them */
+        if(idx_hdr.fileNum == 0 || idx_hdr.fileNum - 1 >= chunk_count)
+        {
+            return table;
+        }
+        
+        /* chunks were added since the index was written, only those need to be scanned */
+        covered = idx_hdr.fileNum - 1;
+        mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)table)[sizeof(mlv_xref_hdr_t)]);
+        
+        for(uint32_t entry = 0; entry < table->entryCount; entry++)
+        {
+            if(xrefs[entry].fileNumber >= covered)
+            {
+                covered = 0;
+                break;
+            }
+        }
+        
+        if(!covered)
+        {
+            free(table);
+            table = NULL;
+        }
     }
     
     bmp_printf(FONT_LARGE, 30, 100, "Preparing:", filename);
     bmp_printf(FONT_MED, 40, 100 + font_large.height + 1, filename);
-    mlv_play_build_index(filename, chunk_files, chunk_count);
+    mlv_play_build_index(filename, chunk_files, chunk_count, table, covered);
+    
+    if(table)
+    {
+        free(table);
+    }
     
-    return mlv_play_load_index(filename);
+    return mlv_play_load_index(filename, NULL);
 }
 
 static unsigned int mlv_play_is_raw(FILE *f)
@@ -22,8 +22,15 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#ifndef __WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
 
 #include <raw.h>
 #include "../mlv.h"
@@ -38,6 +45,8 @@
 #include "../raw_proc/stripes.h"
 #include "../raw_proc/patternnoise.h"
 #include "../raw_proc/histogram.h"
+#include "../raw_proc/bitpack.h"
+#include "../raw_proc/stats_cache.h"
 
 #define IFD0_COUNT 42
 #define EXIF_IFD_COUNT 11
@@ -469,6 +478,65 @@ static char * format_datetime(char * datetime, struct frame_info * frame_info)
     return datetime;
 }
 
+/* the header of the last frame. as long as the clip parameters below do not change,
+   dng_init_header() copies it and only patches the fields that change from frame to frame */
+struct dng_header_template
+{
+    int valid;
+    uint8_t header[HEADER_SIZE];
+    size_t header_size;
+    int current_cam;
+
+    /* offsets of the per-frame fields in the header */
+    uint32_t strip_byte_counts;     /* value of the IFD0 entry */
+    uint32_t datetime;
+    uint32_t datetime_length;
+    uint32_t timecode;
+    uint32_t as_shot_neutral;
+    uint32_t exposure_time;
+    uint32_t f_number;
+    uint32_t iso;                   /* value of the EXIF IFD entry */
+    uint32_t subject_distance;
+    uint32_t focal_length;
+
+    /* clip parameters the header was built from */
+    mlv_file_hdr_t file_hdr;
+    mlv_idnt_hdr_t idnt_hdr;
+    mlv_rawi_hdr_t rawi_hdr;
+    mlv_rawc_hdr_t rawc_hdr;
+    uint8_t lens_name[32];
+    int fps_override;
+    int raw_state;
+    int pack_bits;
+    int crop_rec;
+    char * mlv_filename;
+    char * info_str;
+};
+
+static struct dng_header_template header_template;
+
+/* mlv_dump builds the headers on several threads */
+static pthread_mutex_t header_template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* value of a directory entry, 'ifd_offset' points to the entry count of the IFD */
+static uint32_t ifd_value_offset(uint32_t ifd_offset, int entry)
+{
+    return ifd_offset + sizeof(uint16_t) + entry * sizeof(struct directory_entry) + offsetof(struct directory_entry, value);
+}
+
+/* frame rate as written to the header */
+static double get_frame_rate(struct frame_info * frame_info, int32_t frame_rate[2])
+{
+    frame_rate[0] = frame_info->file_hdr.sourceFpsNom;
+    frame_rate[1] = frame_info->file_hdr.sourceFpsDenom;
+    if(frame_info->fps_override > 0)
+    {
+        frame_rate[0] = (int32_t)frame_info->fps_override;
+        frame_rate[1] = 1000;
+    }
+    return frame_rate[1] == 0 ? 0 : (double)frame_rate[0] / (double)frame_rate[1];
+}
+
 /* returns the size of uncompressed image data. does not include header
    frame_info - pointer to the struct of MLV blocks associated with the frame
    size_mode - returns 16 bit image size or bit-packed image size depending on actual bits per pixel
@@ -488,8 +556,9 @@ static size_t dng_get_image_size(struct frame_info * frame_info, int size_mode)
 /* generates the CDNG header. The result is written into dng_data struct
    frame_info - pointer to the struct of MLV blocks associated with the frame
    dng_data - pointer to the struct of DNG related data buffers and their sizes
+   template - if not NULL, receives the offsets of the per-frame fields
 */
-static void dng_fill_header(struct frame_info * frame_info, struct dng_data * dng_data)
+static void dng_fill_header(struct frame_info * frame_info, struct dng_data * dng_data, struct dng_header_template * template)
 {
     uint8_t * header = dng_data->header_buf;
     size_t position = 0;
@@ -563,25 +632,9 @@ static void dng_fill_header(struct frame_info * frame_info, struct dng_data * dn
             }
         }
 
-        //we get the active area of the original raw source, not the recorded data, so overwrite the active area if the recorded data does
-        //not contain the OB areas
-        if(frame_info->rawi_hdr.xRes < frame_info->rawi_hdr.raw_info.active_area.x2 ||
-           frame_info->rawi_hdr.yRes < frame_info->rawi_hdr.raw_info.active_area.y2)
-        {
-            frame_info->rawi_hdr.raw_info.active_area.x1 = 0;
-            frame_info->rawi_hdr.raw_info.active_area.y1 = 0;
-            frame_info->rawi_hdr.raw_info.active_area.x2 = frame_info->rawi_hdr.xRes;
-            frame_info->rawi_hdr.raw_info.active_area.y2 = frame_info->rawi_hdr.yRes;
-        }
-        
         /* FPS stuff*/
-        int32_t frame_rate[2] = {frame_info->file_hdr.sourceFpsNom, frame_info->file_hdr.sourceFpsDenom};
-        if(frame_info->fps_override > 0)
-        {
-            frame_rate[0] = (int32_t)frame_info->fps_override;
-            frame_rate[1] = 1000;
-        }
-        double frame_rate_f = frame_rate[1] == 0 ? 0 : (double)frame_rate[0] / (double)frame_rate[1];
+        int32_t frame_rate[2];
+        double frame_rate_f = get_frame_rate(frame_info, frame_rate);
         
         /* Date */
         char datetime[255];
@@ -709,7 +762,135 @@ static void dng_fill_header(struct frame_info * frame_info, struct dng_data * dn
         
         /* set real header size */
         dng_data->header_size = data_offset;
+
+        if(template)
+        {
+            uint32_t ifd0_offset = sizeof(tiff_header);
+            template->current_cam = current_cam;
+            template->strip_byte_counts = ifd_value_offset(ifd0_offset, 13);
+            template->datetime = IFD0[16].value;
+            template->datetime_length = IFD0[16].count;
+            template->timecode = IFD0[37].value;
+            template->as_shot_neutral = IFD0[29].value;
+            template->exposure_time = EXIF_IFD[0].value;
+            template->f_number = EXIF_IFD[1].value;
+            template->iso = ifd_value_offset(exif_ifd_offset, 2);
+            template->subject_distance = EXIF_IFD[5].value;
+            template->focal_length = EXIF_IFD[6].value;
+        }
+    }
+}
+
+/* we get the active area of the original raw source, not the recorded data, so overwrite the active area if the recorded data does
+   not contain the OB areas */
+static void dng_fix_active_area(struct frame_info * frame_info)
+{
+    if(frame_info->rawi_hdr.xRes < frame_info->rawi_hdr.raw_info.active_area.x2 ||
+       frame_info->rawi_hdr.yRes < frame_info->rawi_hdr.raw_info.active_area.y2)
+    {
+        frame_info->rawi_hdr.raw_info.active_area.x1 = 0;
+        frame_info->rawi_hdr.raw_info.active_area.y1 = 0;
+        frame_info->rawi_hdr.raw_info.active_area.x2 = frame_info->rawi_hdr.xRes;
+        frame_info->rawi_hdr.raw_info.active_area.y2 = frame_info->rawi_hdr.yRes;
+    }
+}
+
+/* 1 if the header in 'template' was built for the same clip parameters */
+static int dng_template_matches(struct frame_info * frame_info, struct dng_header_template * template)
+{
+    return template->valid &&
+           template->fps_override == frame_info->fps_override &&
+           template->raw_state == frame_info->raw_state &&
+           template->pack_bits == frame_info->pack_bits &&
+           template->crop_rec == frame_info->crop_rec &&
+           !memcmp(&template->file_hdr, &frame_info->file_hdr, sizeof(mlv_file_hdr_t)) &&
+           !memcmp(&template->idnt_hdr, &frame_info->idnt_hdr, sizeof(mlv_idnt_hdr_t)) &&
+           !memcmp(&template->rawi_hdr, &frame_info->rawi_hdr, sizeof(mlv_rawi_hdr_t)) &&
+           !memcmp(&template->rawc_hdr, &frame_info->rawc_hdr, sizeof(mlv_rawc_hdr_t)) &&
+           !memcmp(template->lens_name, frame_info->lens_hdr.lensName, sizeof(template->lens_name)) &&
+           !strcmp(template->mlv_filename, frame_info->mlv_filename) &&
+           !strcmp(template->info_str, frame_info->info_str);
+}
+
+static char * copy_string(char * str)
+{
+    char * copy = malloc(strlen(str) + 1);
+    if(copy) strcpy(copy, str);
+    return copy;
+}
+
+static void dng_free_template(struct dng_header_template * template)
+{
+    free(template->mlv_filename);
+    free(template->info_str);
+    memset(template, 0, sizeof(struct dng_header_template));
+}
+
+/* keep the header just built by dng_fill_header() as template for the next frames */
+static void dng_save_template(struct frame_info * frame_info, struct dng_data * dng_data, struct dng_header_template * template)
+{
+    free(template->mlv_filename);
+    free(template->info_str);
+
+    memcpy(template->header, dng_data->header_buf, HEADER_SIZE);
+    template->header_size = dng_data->header_size;
+    template->fps_override = frame_info->fps_override;
+    template->raw_state = frame_info->raw_state;
+    template->pack_bits = frame_info->pack_bits;
+    template->crop_rec = frame_info->crop_rec;
+    template->file_hdr = frame_info->file_hdr;
+    template->idnt_hdr = frame_info->idnt_hdr;
+    template->rawi_hdr = frame_info->rawi_hdr;
+    template->rawc_hdr = frame_info->rawc_hdr;
+    memcpy(template->lens_name, frame_info->lens_hdr.lensName, sizeof(template->lens_name));
+    template->mlv_filename = copy_string(frame_info->mlv_filename);
+    template->info_str = copy_string(frame_info->info_str);
+    template->valid = template->mlv_filename && template->info_str;
+}
+
+/* write the per-frame fields into a copy of the template header, same values as dng_fill_header() would.
+   returns 0 if the header has to be built from scratch (the length of the date string changed) */
+static int dng_patch_header(struct frame_info * frame_info, struct dng_data * dng_data, struct dng_header_template * template)
+{
+    uint8_t * header = dng_data->header_buf;
+
+    char datetime[255];
+    format_datetime(datetime, frame_info);
+    if(strlen(datetime) + 1 != template->datetime_length)
+    {
+        return 0;
     }
+
+    memcpy(header, template->header, HEADER_SIZE);
+    dng_data->header_size = template->header_size;
+
+    uint32_t strip_byte_counts = (!frame_info->raw_state && frame_info->pack_bits) ? dng_data->image_size_bitpacked : dng_data->image_size;
+    memcpy(header + template->strip_byte_counts, &strip_byte_counts, sizeof(uint32_t));
+
+    memcpy(header + template->datetime, datetime, template->datetime_length);
+
+    int32_t frame_rate[2];
+    uint32_t offset = template->timecode;
+    add_timecode(get_frame_rate(frame_info, frame_rate), (int)frame_info->vidf_hdr.frameNumber, header, &offset);
+
+    int32_t wbal[6];
+    get_white_balance(frame_info->wbal_hdr, wbal, &camera_id[template->current_cam]);
+    offset = template->as_shot_neutral;
+    add_array(wbal, header, &offset, 6);
+
+    offset = template->exposure_time;
+    add_rational((int32_t)frame_info->expo_hdr.shutterValue/1000, 1000, header, &offset);
+    offset = template->f_number;
+    add_rational(frame_info->lens_hdr.aperture, 100, header, &offset);
+    offset = template->subject_distance;
+    add_rational(frame_info->lens_hdr.focalDist, 1, header, &offset);
+    offset = template->focal_length;
+    add_rational(frame_info->lens_hdr.focalLength, 1, header, &offset);
+
+    uint32_t iso = frame_info->expo_hdr.isoValue;
+    memcpy(header + template->iso, &iso, sizeof(uint32_t));
+
+    return 1;
 }
 
 /* unpack bits to 16 bit little endian
@@ -720,27 +901,7 @@ static void dng_fill_header(struct frame_info * frame_info, struct dng_data * dn
 */
 void dng_unpack_image_bits(uint16_t * input_buffer, uint16_t * output_buffer, size_t max_size, uint32_t bpp)
 {
-    uint32_t pixel_end = (uint32_t)(max_size / 2);
-    uint32_t mask = (1 << bpp) - 1;
-
-    uint16_t *packed_bits = input_buffer;
-    uint16_t *unpacked_bits = output_buffer;
-
-    for (uint32_t pixel_index = 0; pixel_index < pixel_end; pixel_index++)
-    {
-        uint32_t bits_offset = pixel_index * bpp;
-        uint32_t bits_address = bits_offset / 16;
-        uint32_t bits_shift = bits_offset % 16;
-
-        /* fetch two 16 bit words into a 32 bit register and correct it plus shift it as needed.
-        after the 32 bit fetch, the two 16 bit words will be swapped, so use a ROR to align them correctly.
-        ROR by 16 to swap 16 bit words plus the bits needed to put the needed pixel bits to right position */
-        uint32_t rotate_value = 16 + ((32 - bpp) - bits_shift);
-        uint32_t uncorrected_data = *((uint32_t *)&packed_bits[bits_address]);
-        uint32_t data = ROR32(uncorrected_data, rotate_value);
-
-        unpacked_bits[pixel_index] = (uint16_t)(data & mask);
-    }
+    bitpack_unpack(input_buffer, output_buffer, (uint32_t)(max_size / 2), bpp);
 }
 
 /* pack bits to 16 bit little endian and convert to big endian (raw payload DNG spec)
@@ -751,32 +912,7 @@ void dng_unpack_image_bits(uint16_t * input_buffer, uint16_t * output_buffer, si
 */
 void dng_pack_image_bits(uint16_t * input_buffer, uint16_t * output_buffer, size_t max_size, uint32_t bpp)
 {
-    uint32_t pixel_end = (uint32_t)(max_size / 2);
-    uint32_t bits_free = 16 - bpp;
-
-    uint16_t *unpacked_bits = input_buffer;
-    uint16_t *packed_bits = output_buffer;
-
-    packed_bits[0] = unpacked_bits[0] << bits_free;
-    for (uint32_t pixel_index = 1; pixel_index < pixel_end; pixel_index++)
-    {
-        uint32_t bits_offset = (pixel_index * bits_free) % 16;
-        uint32_t bits_to_rol = bits_free + bits_offset + (bits_offset > 0) * 16;
-
-        /* increment pointer by two bytes but fetch 32 bit words from input and outbut buffers.
-        after the 32 bit fetch, the two 16 bit words will be swapped, so use a ROL by 16 to swap
-        16 bit words plus shift to the left to put the needed pixel bits to right position.
-        mask/zero high 16 bits of 32 bit word of packed buffer and do logical OR to ROLed unpacked one.
-        make current packed 16 bit word big endian to satisfy DNG spec */
-        uint32_t data = ROL32((uint32_t)unpacked_bits[pixel_index], bits_to_rol);
-        *(uint32_t *)packed_bits = (*(uint32_t *)packed_bits & 0x0000FFFF) | data;
-
-        if(bits_offset > 0 && bits_offset <= bpp)
-        {
-            *(uint16_t *)packed_bits = ROL16(*(uint16_t *)packed_bits, 8);
-            packed_bits++;
-        }
-    }
+    bitpack_dng_pack(input_buffer, output_buffer, (uint32_t)(max_size / 2), bpp);
 }
 
 /* changes endianness of the 16 bit buffer values
@@ -797,30 +933,42 @@ static void dng_reverse_byte_order(uint16_t * input_buffer, size_t max_size)
 /* fill DNG header buffer */
 void dng_init_header(struct frame_info * frame_info, struct dng_data * dng_data)
 {
-    static int first_time = 1;
-    
-    if (first_time)
+    /* allocate once per 'dng_data', so every worker thread can have its own set of buffers */
+    if (!dng_data->header_buf)
     {
         dng_data->header_size = HEADER_SIZE;
         dng_data->header_buf = (uint8_t*)malloc(dng_data->header_size);
-        first_time = 0;
+    }
+    if (!dng_data->header_buf)
+    {
+        return;
+    }
+
+    dng_fix_active_area(frame_info);
+
+    /* most of the header stays the same for the whole clip, so it is only built for the first frame */
+    pthread_mutex_lock(&header_template_mutex);
+    if (dng_template_matches(frame_info, &header_template) && dng_patch_header(frame_info, dng_data, &header_template))
+    {
+        pthread_mutex_unlock(&header_template_mutex);
+        return;
     }
 
-    dng_fill_header(frame_info, dng_data);
+    dng_fill_header(frame_info, dng_data, &header_template);
+    dng_save_template(frame_info, dng_data, &header_template);
+    pthread_mutex_unlock(&header_template_mutex);
 }
 
 /* fill DNG image data buffer */
 void dng_init_data(struct frame_info * frame_info, struct dng_data * dng_data)
 {
-    static int first_time = 1;
-    
-    if (first_time)
+    if (!dng_data->image_buf_bak)
     {
         dng_data->image_size = dng_get_image_size(frame_info, IMG_SIZE_MAX);
         dng_data->image_buf = (uint16_t*)malloc(dng_data->image_size);
     
         dng_data->image_size_bitpacked = dng_get_image_size(frame_info, IMG_SIZE_AUTO);
-        /* add extra padding at the end so dng_pack_image_bits can write 32-bits at a time */
+        /* add extra padding at the end for a partially used last 16 bit word */
         dng_data->image_buf_bitpacked = (uint16_t*)malloc(dng_data->image_size_bitpacked + sizeof(uint16_t));
 
         /* backup size and pointer of the original image buffer
@@ -828,8 +976,6 @@ void dng_init_data(struct frame_info * frame_info, struct dng_data * dng_data)
            restoring from backup takes place in dng_save() routine */
         dng_data->image_size_bak = dng_data->image_size;
         dng_data->image_buf_bak = dng_data->image_buf;        
-        
-        first_time = 0;
     }
     
     if(frame_info->rawi_hdr.raw_info.bits_per_pixel < 16)
@@ -847,11 +993,63 @@ void dng_init_data(struct frame_info * frame_info, struct dng_data * dng_data)
     }
 }
 
+/* one-time setup of the raw processing, called from the main thread before the first frame is processed */
+/* the DNG pipeline workers only run dng_process_data(), so they never touch 'started' */
+void dng_process_start(struct frame_info * frame_info)
+{
+    static int started = 0;
+
+    if (started)
+    {
+        return;
+    }
+    started = 1;
+
+    /* statistics of previous exports or sample frames, keyed by the clip parameters and processing options */
+    if (frame_info->stats_cache || frame_info->stats_interval > 1)
+    {
+        struct stats_cache_key key =
+        {
+            frame_info->idnt_hdr.cameraModel,
+            frame_info->rawi_hdr.xRes,
+            frame_info->rawi_hdr.yRes,
+            frame_info->rawi_hdr.raw_info.black_level,
+            frame_info->rawi_hdr.raw_info.white_level,
+            frame_info->vertical_stripes,
+            frame_info->dual_iso,
+            frame_info->focus_pixels,
+            frame_info->fpi_method,
+            frame_info->bad_pixels,
+            frame_info->bpi_method,
+            frame_info->chroma_smooth
+        };
+        stats_cache_init(frame_info->mlv_filename, &key, frame_info->stats_cache, frame_info->stats_interval, frame_info->show_progress);
+    }
+
+    if (!frame_info->show_progress)
+    {
+        return;
+    }
+
+    if (frame_info->pattern_noise)
+    {
+        printf("\nFixing pattern noise...\n");
+    }
+
+    if (frame_info->chroma_smooth)
+    {
+        printf("\nUsing chroma smooth method: '%dx%d'\n", frame_info->chroma_smooth, frame_info->chroma_smooth);
+    }
+
+    if (frame_info->deflicker_target)
+    {
+        printf("\nPer-frame exposure compensation: 'ON'\nDeflicker target: '%d'\n", frame_info->deflicker_target);
+    }
+}
+
 /* all raw processing takes place here */
 void dng_process_data(struct frame_info * frame_info, struct dng_data * dng_data)
 {
-    static int first_time = 1;
-
     /* fix vertical stripes */
     if (frame_info->vertical_stripes)
     {
@@ -861,6 +1059,7 @@ void dng_process_data(struct frame_info * frame_info, struct dng_data * dng_data
                              frame_info->rawi_hdr.raw_info.frame_size,
                              frame_info->rawi_hdr.xRes,
                              frame_info->rawi_hdr.yRes,
+                             frame_info->vidf_hdr.frameNumber,
                              frame_info->vertical_stripes,
                              frame_info->show_progress);
     }
@@ -868,14 +1067,11 @@ void dng_process_data(struct frame_info * frame_info, struct dng_data * dng_data
     /* fix pattern noise */
     if (frame_info->pattern_noise)
     {
-        if (first_time && frame_info->show_progress) 
-        {
-            printf("\nFixing pattern noise...\n");
-        }
         fix_pattern_noise((int16_t *)dng_data->image_buf,
                           frame_info->rawi_hdr.xRes,
                           frame_info->rawi_hdr.yRes,
-                          frame_info->rawi_hdr.raw_info.white_level, 0);
+                          frame_info->rawi_hdr.raw_info.white_level,
+                          frame_info->vidf_hdr.frameNumber, 0);
     }
 
     /* set crop_rec flag from MLV or CLI */
@@ -920,80 +1116,114 @@ void dng_process_data(struct frame_info * frame_info, struct dng_data * dng_data
     /* do chroma smoothing */
     if (frame_info->chroma_smooth)
     {
-        if (first_time && frame_info->show_progress) 
-        {
-            printf("\nUsing chroma smooth method: '%dx%d'\n", frame_info->chroma_smooth, frame_info->chroma_smooth);
-        }
         chroma_smooth(dng_data->image_buf,
                       frame_info->rawi_hdr.xRes,
                       frame_info->rawi_hdr.yRes,
                       frame_info->rawi_hdr.raw_info.black_level,
                       frame_info->rawi_hdr.raw_info.white_level,
-                      frame_info->chroma_smooth);
+                      frame_info->chroma_smooth,
+                      frame_info->cs_isa,
+                      frame_info->cs_threads);
     }
     
     /* deflicker RAW data */
     if (frame_info->deflicker_target)
     {
-        if (first_time && frame_info->show_progress) 
-        {
-            printf("\nPer-frame exposure compensation: 'ON'\nDeflicker target: '%d'\n", frame_info->deflicker_target);
-        }
         deflicker(frame_info,
                   frame_info->deflicker_target,
                   dng_data->image_buf,
                   dng_data->image_size);
     }
-
-    first_time = 0;
 }
 
-/* save DNG file */
-int dng_save(struct frame_info * frame_info, struct dng_data * dng_data)
+/* bring image data into its on-disk layout (bit packed and/or big endian) */
+void dng_finalize_data(struct frame_info * frame_info, struct dng_data * dng_data)
 {
-    static uint32_t frame_count = 0;
+    /* if raw is uncompressed and 16 bit unpacked DNGs are not requested with "--no-bitpack" */
+    if(frame_info->raw_state == UNCOMPRESSED_RAW && frame_info->pack_bits)
+    {
+        /* pack bits and make raw data big endian before saving to the dng file */
+        dng_pack_image_bits(dng_data->image_buf, dng_data->image_buf_bitpacked, dng_data->image_size, frame_info->rawi_hdr.raw_info.bits_per_pixel);
+    }
+    else if(frame_info->raw_state == UNCOMPRESSED_ORIG && (frame_info->rawi_hdr.raw_info.bits_per_pixel != 16))
+    {
+        dng_reverse_byte_order(dng_data->image_buf, dng_data->image_size);
+    }
+}
 
-    FILE* dngf = fopen(frame_info->dng_filename, "wb");
+/* header and image data in one go: a single writev() instead of two buffered writes per (small) file */
+static int dng_write_file(char * filename, void * header, size_t header_size, void * image, size_t image_size)
+{
+#ifdef __WIN32
+    FILE* dngf = fopen(filename, "wb");
     if (!dngf)
     {
         return 0;
     }
     
-    /* write DNG header */
-    if (fwrite(dng_data->header_buf, dng_data->header_size, 1, dngf) != 1)
+    int ok = fwrite(header, header_size, 1, dngf) == 1 && fwrite(image, image_size, 1, dngf) == 1;
+    fclose(dngf);
+    return ok;
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
     {
-        fclose(dngf);
         return 0;
     }
-    
-    /* write DNG image data */
-    /* if raw is uncompressed and 16 bit unpacked DNGs are not requested with "--no-bitpack" */
-    if(frame_info->raw_state == UNCOMPRESSED_RAW && frame_info->pack_bits)
+
+    struct iovec iov[2] =
     {
-        /* pack bits and make raw data big endian before saving to the dng file */
-        dng_pack_image_bits(dng_data->image_buf, dng_data->image_buf_bitpacked, dng_data->image_size, frame_info->rawi_hdr.raw_info.bits_per_pixel);
+        { header, header_size },
+        { image, image_size },
+    };
+    struct iovec * pending = iov;
+    int count = 2;
 
-        if (fwrite(dng_data->image_buf_bitpacked, dng_data->image_size_bitpacked, 1, dngf) != 1)
+    while (count)
+    {
+        ssize_t written = writev(fd, pending, count);
+        if (written <= 0)
         {
-            fclose(dngf);
+            close(fd);
             return 0;
         }
-    }
-    else // a) when "--no-bitpack" specified, b) when passing through uncompressed/lossless raw, c) when raw is compressed by "-c"
-    {
-        if(frame_info->raw_state == UNCOMPRESSED_ORIG && (frame_info->rawi_hdr.raw_info.bits_per_pixel != 16))
+
+        /* short write: continue after the bytes already written */
+        while (count && (size_t)written >= pending->iov_len)
         {
-            dng_reverse_byte_order(dng_data->image_buf, dng_data->image_size);
+            written -= pending->iov_len;
+            pending++;
+            count--;
         }
-
-        if (fwrite(dng_data->image_buf, dng_data->image_size, 1, dngf) != 1)
+        if (count)
         {
-            fclose(dngf);
-            return 0;
+            pending->iov_base = (uint8_t *)pending->iov_base + written;
+            pending->iov_len -= written;
         }
     }
 
-    fclose(dngf);
+    return close(fd) == 0;
+#endif
+}
+
+/* write DNG file from header and image data prepared by dng_finalize_data() */
+int dng_write(struct frame_info * frame_info, struct dng_data * dng_data)
+{
+    static uint32_t frame_count = 0;
+
+    void * image_buf = dng_data->image_buf;
+    size_t image_size = dng_data->image_size;
+    if(frame_info->raw_state == UNCOMPRESSED_RAW && frame_info->pack_bits)
+    {
+        image_buf = dng_data->image_buf_bitpacked;
+        image_size = dng_data->image_size_bitpacked;
+    }
+    // else: a) when "--no-bitpack" specified, b) when passing through uncompressed/lossless raw, c) when raw is compressed by "-c"
+
+    if (!dng_write_file(frame_info->dng_filename, dng_data->header_buf, dng_data->header_size, image_buf, image_size))
+    {
+        return 0;
+    }
 
     /* show writing progress */
     if (frame_info->show_progress)
@@ -1027,11 +1257,30 @@ int dng_save(struct frame_info * frame_info, struct dng_data * dng_data)
     return 1;
 }
 
-/* free all buffers used for DNG creation and RAW processing */
-void dng_free_data(struct dng_data * dng_data)
+/* save DNG file */
+int dng_save(struct frame_info * frame_info, struct dng_data * dng_data)
+{
+    dng_finalize_data(frame_info, dng_data);
+    return dng_write(frame_info, dng_data);
+}
+
+/* free the buffers of one 'dng_data' set, the shared pixel maps stay loaded */
+void dng_free_buffers(struct dng_data * dng_data)
 {
     if(dng_data->header_buf) free(dng_data->header_buf);
     if(dng_data->image_buf) free(dng_data->image_buf);
     if(dng_data->image_buf_bitpacked) free(dng_data->image_buf_bitpacked);
+    dng_data->header_buf = NULL;
+    dng_data->image_buf = NULL;
+    dng_data->image_buf_bak = NULL;
+    dng_data->image_buf_bitpacked = NULL;
+}
+
+/* free all buffers used for DNG creation and RAW processing */
+void dng_free_data(struct dng_data * dng_data)
+{
+    dng_free_buffers(dng_data);
     free_pixel_maps();
+    free_stats_cache();
+    dng_free_template(&header_template);
 }
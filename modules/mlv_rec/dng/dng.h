@@ -59,7 +59,11 @@ struct frame_info
     int save_bpm;         // "--save-bpm" (saves bad pixel map to file)
     int dual_iso;         // "--is-dualiso" (means RAW data is dual iso process bad/focus pixels correctly (can be removed if DISO block parsing implemented)
     int chroma_smooth;    // 2 - "--cs2x2", 3 "--cs3x3", 5 - "--cs5x5"
+    int cs_isa;           // "--cs-impl=scalar|sse2|avx2" (chroma smooth instruction set, default: best available)
+    int cs_threads;       // threads used for chroma smoothing of one frame
     int pattern_noise;    // "--fixpn" (fixes pattern noise)
+    int stats_cache;      // "--stats-cache" (load/save stripe and pattern noise statistics from/to the .rpc file)
+    int stats_interval;   // "--stats-interval=N" (compute stripe and pattern noise statistics every N frames only)
     int show_progress;    // "--show-progress" (verbose mode for 'dng.c')
     int raw_state;        // see 'enum raw_state' above
     int pack_bits;        // 0 - "--no-bitpack" (saves 16bit dngs), 1 - bit packing will be done (default)
@@ -97,7 +101,9 @@ struct dng_data
 /* routines to initialize, process and free raw image buffers of 'dng_data' struct */
 void dng_init_header(struct frame_info * frame_info, struct dng_data * dng_data);
 void dng_init_data(struct frame_info * frame_info, struct dng_data * dng_data);
+void dng_process_start(struct frame_info * frame_info);
 void dng_process_data(struct frame_info * frame_info, struct dng_data * dng_data);
+void dng_free_buffers(struct dng_data * dng_data);
 void dng_free_data(struct dng_data * dng_data);
 
 /* routines to unpack and pack bits */
@@ -107,4 +113,8 @@ void dng_pack_image_bits(uint16_t * input_buffer, uint16_t * output_buffer, size
 /* routine to save cdng file */
 int dng_save(struct frame_info * frame_info, struct dng_data * dng_data);
 
+/* dng_save() split in two: the CPU heavy part that can run on a worker thread and the file write */
+void dng_finalize_data(struct frame_info * frame_info, struct dng_data * dng_data);
+int dng_write(struct frame_info * frame_info, struct dng_data * dng_data);
+
 #endif
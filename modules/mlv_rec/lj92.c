@@ -26,6 +26,10 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef LJ92_THREADS
+#include <pthread.h>
+#endif
+
 #include "lj92.h"
 
 typedef uint8_t u8;
@@ -33,8 +37,31 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 
 //#define SLOW_HUFF
+//#define SINGLE_HUFF // One symbol per lookup, unstuffing while reading (the decoder before FAST_HUFF)
 //#define DEBUG
 
+#if !defined(SLOW_HUFF) && !defined(SINGLE_HUFF)
+#define FAST_HUFF
+#define FAST_BITS 12 // Index bits of the combined lookup table
+#endif
+
+#ifdef FAST_HUFF
+typedef struct {
+    int16_t diff[2];
+    u8 count; // Complete diffs in this entry, 0 means use hufflut
+    u8 len; // Bits used by all diffs of the entry
+    u8 firstlen; // Bits used by the first diff
+    u8 reserved;
+} fastlut_entry;
+
+typedef struct {
+    const u8* next; // Next byte to load into buf
+    const u8* limit; // Last byte position that may be loaded
+    uint64_t buf; // Bits not consumed yet, MSB first
+    int64_t bits; // Valid bits in buf
+} ljbits;
+#endif
+
 typedef struct _ljp {
     u8* data;
     u8* dataend;
@@ -63,6 +90,18 @@ typedef struct _ljp {
     u16* hufflut;
     int huffbits;
 #endif
+#ifdef FAST_HUFF
+    int segcount;
+    int segrows; // Rows per restart interval
+    int pred;
+    int predcomps; // Components the predictor works on
+    int rowlen;
+    fastlut_entry* fastlut;
+    u8* scan; // Entropy coded data without stuffing, zero padded
+    int* segstart; // Byte offset of every restart interval in scan, plus the end
+#endif
+    int restart; // Restart interval in MCUs, 0 if none
+    int threads;
     // Parse state
     int cnt;
     u32 b;
@@ -71,6 +110,10 @@ typedef struct _ljp {
     u16* outrow[2];
 } ljp;
 
+#ifdef FAST_HUFF
+static int buildFastLut(ljp* self);
+#endif
+
 static int find(ljp* self) {
     int ix = self->ix;
     u8* data = self->data;
@@ -224,7 +267,7 @@ static int parseHuff(ljp* self) {
     }
     self->huffbits = maxbits;
     /* Now fill the lut */
-    u16* hufflut = malloc((1<<maxbits) * sizeof(u16));
+    u16* hufflut = calloc(1<<maxbits, sizeof(u16));
     if (hufflut == NULL) return LJ92_ERROR_NO_MEMORY;
     self->hufflut = hufflut;
     int i = 0;
@@ -261,6 +304,9 @@ static int parseHuff(ljp* self) {
         rv++;
     }
     ret = LJ92_ERROR_NONE;
+#ifdef FAST_HUFF
+    ret = buildFastLut(self);
+#endif
 #endif
     return ret;
 }
@@ -281,6 +327,13 @@ static int parseBlock(ljp* self) {
     return LJ92_ERROR_NONE;
 }
 
+static int parseDri(ljp* self) {
+    if (self->ix+3 >= self->datalen) return LJ92_ERROR_CORRUPT;
+    self->restart = BEH(self->data[self->ix+2]);
+    return parseBlock(self);
+}
+
+#ifndef FAST_HUFF
 #ifdef SLOW_HUFF
 static int nextbit(ljp* self) {
     u32 b = self->b;
@@ -587,6 +640,372 @@ static int parseScan(ljp* self) {
     return ret;
 }
 
+#endif
+
+#ifdef FAST_HUFF
+/* Fast decoder
+ * The scan is copied once with byte stuffing and restart markers removed, so the
+ * bits can be read through a 64 bit reservoir that is refilled without branches.
+ * Rows are entropy decoded into a diff buffer first, then predicted.
+ * fastlut is indexed by the next FAST_BITS bits of the stream and holds up to two
+ * complete diffs (code + extra bits). Longer codes and diffs go through hufflut.
+ */
+static inline uint64_t load64(const u8* p) {
+    uint64_t w;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    memcpy(&w, p, sizeof(w));
+    w = __builtin_bswap64(w);
+#else
+    w = 0;
+    for (int i = 0; i < 8; i++) w = (w << 8) | p[i];
+#endif
+    return w;
+}
+
+// At least 56 valid bits afterwards
+static inline void refillBits(ljbits* bits) {
+    bits->buf |= load64(bits->next) >> bits->bits;
+    bits->next += (63 - bits->bits) >> 3;
+    bits->bits |= 56;
+}
+
+static inline void skipBits(ljbits* bits, int count) {
+    bits->buf <<= count;
+    bits->bits -= count;
+}
+
+static inline int extendDiff(int diff, int t) {
+    if (t == 0) return 0;
+    if (diff < (1 << (t-1))) diff += 1 - (1 << t);
+    return diff;
+}
+
+static int buildFastLut(ljp* self) {
+    int huffbits = self->huffbits;
+    if (huffbits == 0) return LJ92_ERROR_CORRUPT;
+    fastlut_entry* lut = calloc(1 << FAST_BITS, sizeof(fastlut_entry));
+    if (lut == NULL) return LJ92_ERROR_NO_MEMORY;
+    self->fastlut = lut;
+    // First diff of every index
+    for (int i = 0; i < (1 << FAST_BITS); i++) {
+        int index = huffbits <= FAST_BITS ? i >> (FAST_BITS - huffbits) : i << (huffbits - FAST_BITS);
+        u16 ssssused = self->hufflut[index];
+        int usedbits = ssssused&0xFF;
+        int t = ssssused>>8;
+        // ssss 16 carries 16 extra bits and doesn't fit
+        if (usedbits == 0 || t >= 16 || usedbits + t > FAST_BITS) continue;
+        int diff = (i >> (FAST_BITS - usedbits - t)) & ((1 << t) - 1);
+        lut[i].diff[0] = extendDiff(diff, t);
+        lut[i].firstlen = lut[i].len = usedbits + t;
+        lut[i].count = 1;
+    }
+    // Second diff from the bits left over, if it is complete
+    for (int i = 0; i < (1 << FAST_BITS); i++) {
+        if (lut[i].count != 1) continue;
+        int used = lut[i].firstlen;
+        fastlut_entry* next = &lut[(i << used) & ((1 << FAST_BITS) - 1)];
+        if (next->count && next->firstlen <= FAST_BITS - used) {
+            lut[i].diff[1] = next->diff[0];
+            lut[i].len = used + next->firstlen;
+            lut[i].count = 2;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+// Copy the entropy coded data without stuffing, note where every restart interval starts
+static int unstuffScan(ljp* self, int ix) {
+    u8* data = self->data;
+    int datalen = self->datalen;
+    u8* scan = malloc(datalen - ix + 16);
+    if (scan == NULL) return LJ92_ERROR_NO_MEMORY;
+    self->scan = scan;
+    int len = 0;
+    int segments = 1;
+    self->segstart[0] = 0;
+    while (ix < datalen) {
+        // Copy up to the next 0xFF
+        u8* ff = memchr(&data[ix], 0xFF, datalen - ix);
+        int run = (ff ? (int)(ff - data) : datalen) - ix;
+        memcpy(&scan[len], &data[ix], run);
+        len += run;
+        ix += run;
+        if (ix++ >= datalen) break;
+        int marker = ix < datalen ? data[ix] : 0xd9;
+        if (marker == 0x00) { // Stuffed 0xFF
+            scan[len++] = 0xFF;
+            ix++;
+        } else if (marker == 0xFF) { // Fill byte
+            continue;
+        } else if (marker >= 0xd0 && marker <= 0xd7) { // RSTn, intervals start byte aligned
+            if (segments == self->segcount) return LJ92_ERROR_CORRUPT;
+            self->segstart[segments++] = len;
+            ix++;
+        } else {
+            break; // End of scan
+        }
+    }
+    if (segments != self->segcount) return LJ92_ERROR_CORRUPT;
+    self->segstart[segments] = len;
+    // Zero padding for the 64 bit loads, the reservoir may run up to 8 bytes ahead
+    memset(&scan[len], 0, 16);
+    return LJ92_ERROR_NONE;
+}
+
+// One diff through hufflut, for codes and diffs that don't fit in fastlut
+static inline int slowDiff(ljp* self, ljbits* bits, int* diff) {
+    u16 ssssused = self->hufflut[bits->buf >> (64 - self->huffbits)];
+    int usedbits = ssssused&0xFF;
+    int t = ssssused>>8;
+    if (usedbits == 0 || usedbits > 16 || t > 16) return LJ92_ERROR_CORRUPT;
+    *diff = t ? extendDiff((int)((bits->buf << usedbits) >> (64 - t)), t) : 0;
+    skipBits(bits, usedbits + t);
+    return LJ92_ERROR_NONE;
+}
+
+// 'diffs' has room for count+1 values
+static int decodeDiffs(ljp* self, ljbits* bits, int* diffs, int count) {
+    const fastlut_entry* lut = self->fastlut;
+    int i = 0;
+    // Both diffs of an entry are stored, the second one may be overwritten later
+    while (i < count - 1) {
+        if (bits->next > bits->limit) return LJ92_ERROR_CORRUPT;
+        refillBits(bits);
+        const fastlut_entry* e = &lut[bits->buf >> (64 - FAST_BITS)];
+        if (e->count) {
+            diffs[i] = e->diff[0];
+            diffs[i+1] = e->diff[1];
+            i += e->count;
+            skipBits(bits, e->len);
+        } else {
+            if (slowDiff(self, bits, &diffs[i++]) != LJ92_ERROR_NONE) return LJ92_ERROR_CORRUPT;
+        }
+    }
+    // The last diff of the row alone
+    if (i < count) {
+        if (bits->next > bits->limit) return LJ92_ERROR_CORRUPT;
+        refillBits(bits);
+        const fastlut_entry* e = &lut[bits->buf >> (64 - FAST_BITS)];
+        if (e->count) {
+            diffs[i] = e->diff[0];
+            skipBits(bits, e->firstlen);
+        } else {
+            if (slowDiff(self, bits, &diffs[i]) != LJ92_ERROR_NONE) return LJ92_ERROR_CORRUPT;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+// Same predictions as parseScan/parsePred6, 'first' is the first row of the image or of a restart interval
+static void predictRow(ljp* self, int first, const int* diffs, u16* thisrow, const u16* lastrow) {
+    int n = self->rowlen;
+    int comps = self->predcomps;
+    int i;
+    u16 left = 0; // Samples are reconstructed modulo 2^16
+    if (first) {
+        if (comps == 1) {
+            left = (1 << (self->bits-1)) + diffs[0];
+            thisrow[0] = left;
+            for (i = 1; i < n; i++) {
+                left += diffs[i];
+                thisrow[i] = left;
+            }
+        } else {
+            for (i = 0; i < comps; i++) thisrow[i] = (1 << (self->bits-1)) + diffs[i];
+            for (; i < n; i++) thisrow[i] = thisrow[i - comps] + diffs[i];
+        }
+        return;
+    }
+    // First column is predicted from the value above
+    for (i = 0; i < comps; i++) {
+        left = lastrow[i] + diffs[i];
+        thisrow[i] = left;
+    }
+    switch (self->pred) {
+        case 1:
+            for (; i < n; i++) thisrow[i] = thisrow[i - comps] + diffs[i];
+            break;
+        case 6:
+            for (; i < n; i++) {
+                left = lastrow[i] + ((left - lastrow[i-1])>>1) + diffs[i];
+                thisrow[i] = left;
+            }
+            break;
+        default:
+            for (; i < n; i++) {
+                int prev = i - comps;
+                int Px = 0;
+                switch (self->pred) {
+                    case 0: Px = 0; break;
+                    case 2: Px = lastrow[i]; break;
+                    case 3: Px = lastrow[prev]; break;
+                    case 4: Px = left + lastrow[i] - lastrow[prev]; break;
+                    case 5: Px = left + ((lastrow[i] - lastrow[prev]) >> 1); break;
+                    case 7: Px = (left + lastrow[i]) >> 1; break;
+                }
+                left = Px + diffs[i];
+                thisrow[i] = left;
+            }
+            break;
+    }
+}
+
+static int writeRow(ljp* self, int row, const u16* thisrow) {
+    int n = self->rowlen;
+    u16* linearize = self->linearize;
+    u16* out;
+    // Predictor 6 output is tiled by writelen/skiplen, the others skip after every row
+    if (self->pred == 6 && self->skiplen && self->writelen > 0) {
+        size_t c = (size_t)row * n;
+        out = self->image;
+        for (int i = 0; i < n; i++, c++) {
+            u16 v = thisrow[i];
+            if (linearize) {
+                if (v >= self->linlen) return LJ92_ERROR_CORRUPT;
+                v = linearize[v];
+            }
+            out[c + (c / self->writelen) * self->skiplen] = v;
+        }
+        return LJ92_ERROR_NONE;
+    }
+    if (self->pred == 6)
+        out = &self->image[(size_t)row * n];
+    else
+        out = &self->image[(size_t)row * (n + self->skiplen)];
+    if (linearize) {
+        for (int i = 0; i < n; i++) {
+            if (thisrow[i] >= self->linlen) return LJ92_ERROR_CORRUPT;
+            out[i] = linearize[thisrow[i]];
+        }
+    } else {
+        memcpy(out, thisrow, n * sizeof(u16));
+    }
+    return LJ92_ERROR_NONE;
+}
+
+// Decode every 'step'th restart interval starting at 'first'
+static int decodeSegments(ljp* self, int first, int step) {
+    int ret = LJ92_ERROR_NONE;
+    int n = self->rowlen;
+    int* diffs = malloc((n + 1) * sizeof(int));
+    u16* rows = malloc(2 * n * sizeof(u16));
+    if (diffs == NULL || rows == NULL) {
+        free(diffs);
+        free(rows);
+        return LJ92_ERROR_NO_MEMORY;
+    }
+    for (int seg = first; seg < self->segcount && ret == LJ92_ERROR_NONE; seg += step) {
+        ljbits bits;
+        bits.next = &self->scan[self->segstart[seg]];
+        bits.limit = &self->scan[self->segstart[self->segcount] + 8];
+        bits.buf = 0;
+        bits.bits = 0;
+        int row = seg * self->segrows;
+        int rowend = row + self->segrows;
+        if (rowend > self->y) rowend = self->y;
+        u16* thisrow = rows;
+        u16* lastrow = &rows[n];
+        for (; row < rowend; row++) {
+            ret = decodeDiffs(self, &bits, diffs, n);
+            if (ret != LJ92_ERROR_NONE) break;
+            predictRow(self, row == seg * self->segrows, diffs, thisrow, lastrow);
+            ret = writeRow(self, row, thisrow);
+            if (ret != LJ92_ERROR_NONE) break;
+            u16* temprow = lastrow;
+            lastrow = thisrow;
+            thisrow = temprow;
+        }
+        // Truncated interval
+        size_t used = (size_t)(bits.next - self->scan) * 8 - bits.bits;
+        if (ret == LJ92_ERROR_NONE && used > (size_t)self->segstart[seg+1] * 8) ret = LJ92_ERROR_CORRUPT;
+    }
+    free(diffs);
+    free(rows);
+    return ret;
+}
+
+#ifdef LJ92_THREADS
+typedef struct {
+    ljp* self;
+    int first;
+    int step;
+    int ret;
+} ljworker;
+
+static void* decodeWorker(void* arg) {
+    ljworker* worker = arg;
+    worker->ret = decodeSegments(worker->self, worker->first, worker->step);
+    return NULL;
+}
+#endif
+
+static int decodeScan(ljp* self) {
+    int ret = LJ92_ERROR_CORRUPT;
+    int ix = self->scanstart;
+    if (ix + 3 > self->datalen) return ret;
+    int compcount = self->data[ix+2];
+    if (ix + 4 + 2*compcount > self->datalen) return ret;
+    int pred = self->data[ix+3+2*compcount];
+    if (pred<0 || pred>7) return ret;
+    ix += BEH(self->data[ix]);
+    if (ix > self->datalen) return ret;
+    self->pred = pred;
+    // The predictor 6 path always treated the image as a single component
+    self->predcomps = pred == 6 ? 1 : self->components;
+    self->rowlen = self->x * self->predcomps;
+    if (self->rowlen <= 0 || self->y <= 0) return ret;
+    // Restart intervals have to cover whole rows in lossless mode
+    self->segrows = self->y;
+    if (self->restart) {
+        if (self->restart % self->x) return ret;
+        self->segrows = self->restart / self->x;
+    }
+    self->segcount = (self->y + self->segrows - 1) / self->segrows;
+    self->segstart = malloc((self->segcount + 1) * sizeof(int));
+    if (self->segstart == NULL) return LJ92_ERROR_NO_MEMORY;
+    ret = unstuffScan(self, ix);
+    if (ret == LJ92_ERROR_NONE) {
+        int workers = 1;
+#ifdef LJ92_THREADS
+        workers = self->threads < self->segcount ? self->threads : self->segcount;
+        if (workers > 1) {
+            ljworker* worker = calloc(workers, sizeof(ljworker));
+            pthread_t* thread = calloc(workers, sizeof(pthread_t));
+            int started = 0;
+            if (worker && thread) {
+                for (int i = 0; i < workers; i++) {
+                    worker[i].self = self;
+                    worker[i].first = i;
+                    worker[i].step = workers;
+                }
+                // Worker 0 runs on this thread
+                for (started = 1; started < workers; started++) {
+                    if (pthread_create(&thread[started], NULL, decodeWorker, &worker[started])) break;
+                }
+                decodeWorker(&worker[0]);
+                for (int i = 1; i < started; i++) pthread_join(thread[i], NULL);
+                // Intervals of threads that failed to start
+                for (int i = started; i < workers; i++) decodeWorker(&worker[i]);
+                for (int i = 0; i < workers; i++) {
+                    if (worker[i].ret != LJ92_ERROR_NONE) ret = worker[i].ret;
+                }
+            } else {
+                workers = 1;
+            }
+            free(worker);
+            free(thread);
+        }
+#endif
+        if (workers <= 1) ret = decodeSegments(self, 0, 1);
+    }
+    free(self->scan);
+    self->scan = NULL;
+    free(self->segstart);
+    self->segstart = NULL;
+    return ret;
+}
+#endif
+
 static int parseImage(ljp* self) {
     int ret = LJ92_ERROR_NONE;
     while (1) {
@@ -597,6 +1016,8 @@ static int parseImage(ljp* self) {
             ret = parseSof3(self);
         else if (nextMarker == 0xfe)// Comment
             ret = parseBlock(self);
+        else if (nextMarker == 0xdd) // Restart interval
+            ret = parseDri(self);
         else if (nextMarker == 0xd9) // End of image
             break;
         else if (nextMarker == 0xda) {
@@ -637,6 +1058,10 @@ static void free_memory(ljp* self) {
 #else
     free(self->hufflut);
     self->hufflut = NULL;
+#endif
+#ifdef FAST_HUFF
+    free(self->fastlut);
+    self->fastlut = NULL;
 #endif
     free(self->rowcache);
     self->rowcache = NULL;
@@ -689,10 +1114,19 @@ int lj92_decode(lj92 lj,
     self->skiplen = skipLength;
     self->linearize = linearize;
     self->linlen = linearizeLength;
+#ifdef FAST_HUFF
+    ret = decodeScan(self);
+#else
     ret = parseScan(self);
+#endif
     return ret;
 }
 
+void lj92_set_threads(lj92 lj, int threads) {
+    ljp* self = lj;
+    if (self != NULL) self->threads = threads;
+}
+
 void lj92_close(lj92 lj) {
     ljp* self = lj;
     if (self != NULL)
@@ -702,262 +1136,216 @@ void lj92_close(lj92 lj) {
 
 /* Encoder implementation */
 
+// Huffman table of the encoder, made from a frequency scan
+struct _lj92_table {
+    int bitdepth;
+    int complete; // Every difference category of bitdepth has a code
+    int bits[17]; // Number of codes of each length
+    int huffval[17]; // Symbols (ssss) in order of the codes
+    int count; // Number of symbols
+    u16 huffenc[17]; // Code of each ssss
+    u16 huffbits[17]; // Code length of each ssss, 0 if it has none
+};
+
 typedef struct _lje {
     uint16_t* image;
+    uint16_t* delinearize;
+    uint8_t* encoded;
+    const struct _lj92_table* use; // Table used for encoding
+    uint16_t* pixel; // Tile read position
+    uint64_t bitacc; // Bits not written yet, right aligned
+    int bitcount;
+    int scan;
     int width;
     int height;
     int bitdepth;
     int components;
     int readLength;
     int skipLength;
-    uint16_t* delinearize;
     int delinearizeLength;
-    uint8_t* encoded;
     int encodedWritten;
     int encodedLength;
     int hist[17]; // SSSS frequency histogram
-    int bits[17];
-    int huffval[17];
-    u16 huffenc[17];
-    u16 huffbits[17];
-    int huffsym[17];
+    struct _lj92_table table; // Table made for this image
 } lje;
 
-int frequencyScan(lje* self) {
-    // Scan through the tile using the standard type 6 prediction
-    // Need to cache the previous 2 row in target coordinates because of tiling
-    uint16_t* pixel = self->image;
-    int pixcount = self->width*self->height;
-    int scan = self->readLength;
-    uint16_t* rowcache = (uint16_t*)calloc(1, self->width * self->components * 4);
-    uint16_t* rows[2];
-    rows[0] = rowcache;
-    rows[1] = &rowcache[self->width];
-
-    int col = 0;
-    int row = 0;
-    int Px = 0;
-    int32_t diff = 0;
-    int maxval = (1 << self->bitdepth);
-    while (pixcount--) {
-        uint16_t p = *pixel;
+// Fetch the next image row from the tile, delinearized and range checked
+static int readRow(lje* self, u16* row) {
+    int maxval = 1 << self->bitdepth;
+    for (int col = 0; col < self->width; col++) {
+        uint16_t p = *self->pixel++;
+        if (--self->scan == 0) {
+            self->pixel += self->skipLength;
+            self->scan = self->readLength;
+        }
         if (self->delinearize) {
-            if (p>=self->delinearizeLength) {
-                free(rowcache);
-                return LJ92_ERROR_TOO_WIDE;
-            }
+            if (p >= self->delinearizeLength) return LJ92_ERROR_TOO_WIDE;
             p = self->delinearize[p];
         }
-        if (p>=maxval) {
-            free(rowcache);
-            return LJ92_ERROR_TOO_WIDE;
-        }
-        rows[1][col] = p;
-
-        if ((row == 0)&&(col == 0))
-            Px = 1 << (self->bitdepth-1);
-        else if (row == 0)
-            Px = rows[1][col-1];
-        else if (col == 0)
-            Px = rows[0][col];
-        else
-            Px = rows[0][col] + ((rows[1][col-1] - rows[0][col-1])>>1);
-        diff = rows[1][col] - Px;
-        int ssss = 32 - __builtin_clz(abs(diff));
-        if (diff==0) ssss=0;
-        self->hist[ssss]++;
-        //printf("%d %d %d %d %d %d\n",col,row,p,Px,diff,ssss);
-        pixel++;
-        scan--;
-        col++;
-        if (scan==0) { pixel += self->skipLength; scan = self->readLength; }
-        if (col==self->width) {
-            uint16_t* tmprow = rows[1];
-            rows[1] = rows[0];
-            rows[0] = tmprow;
-            col=0;
-            row++;
+        if (p >= maxval) return LJ92_ERROR_TOO_WIDE;
+        row[col] = p;
+    }
+    return LJ92_ERROR_NONE;
+}
+
+// Differences to the standard type 6 prediction
+static void rowDiffs(lje* self, int row, const u16* thisrow, const u16* lastrow, int* diffs) {
+    int n = self->width;
+    if (row == 0) {
+        diffs[0] = thisrow[0] - (1 << (self->bitdepth-1));
+        for (int col = 1; col < n; col++) diffs[col] = thisrow[col] - thisrow[col-1];
+        return;
+    }
+    diffs[0] = thisrow[0] - lastrow[0];
+    for (int col = 1; col < n; col++)
+        diffs[col] = thisrow[col] - (lastrow[col] + ((thisrow[col-1] - lastrow[col-1])>>1));
+    // 16 bit images can have differences beyond 16 bits, these are sent modulo 2^16
+    if (self->bitdepth == 16) {
+        for (int col = 1; col < n; col++) {
+            if (diffs[col] >= 65536) diffs[col] -= 65536;
+            else if (diffs[col] <= -65536) diffs[col] += 65536;
         }
     }
-#ifdef DEBUG
-    int sort[17];
-    for (int h=0;h<17;h++) {
-        sort[h] = h;
-        printf("%d:%d\n",h,self->hist[h]);
+}
+
+static inline int diffBits(int diff) {
+    return diff ? 32 - __builtin_clz(abs(diff)) : 0;
+}
+
+// Walk the tile row by row, 'rows' has room for two rows and 'diffs' for one
+static int encodeRows(lje* self, u16* rows, int* diffs, int (*body)(lje*, const int*)) {
+    u16* thisrow = rows;
+    u16* lastrow = &rows[self->width];
+    self->pixel = self->image;
+    self->scan = self->readLength;
+    for (int row = 0; row < self->height; row++) {
+        int ret = readRow(self, thisrow);
+        if (ret != LJ92_ERROR_NONE) return ret;
+        rowDiffs(self, row, thisrow, lastrow, diffs);
+        ret = body(self, diffs);
+        if (ret != LJ92_ERROR_NONE) return ret;
+        u16* tmprow = lastrow;
+        lastrow = thisrow;
+        thisrow = tmprow;
     }
-#endif
-    free(rowcache);
     return LJ92_ERROR_NONE;
 }
 
-void createEncodeTable(lje* self) {
-    float freq[18];
+static int histRow(lje* self, const int* diffs) {
+    for (int col = 0; col < self->width; col++) self->hist[diffBits(diffs[col])]++;
+    return LJ92_ERROR_NONE;
+}
+
+int frequencyScan(lje* self) {
+    u16* rows = calloc(self->width * 2, sizeof(u16));
+    int* diffs = malloc(self->width * sizeof(int));
+    int ret = LJ92_ERROR_NO_MEMORY;
+    if (rows && diffs) ret = encodeRows(self, rows, diffs, histRow);
+    free(rows);
+    free(diffs);
+    return ret;
+}
+
+// Optimal code lengths limited to 16 bits (JPEG Annex K.2/K.3)
+void createEncodeTable(lje* self, struct _lj92_table* table, int complete) {
+    long freq[18];
     int codesize[18];
     int others[18];
-
-    // Calculate frequencies
-    float totalpixels = self->width * self->height;
-    for (int i=0;i<17;i++) {
-        freq[i] = (float)(self->hist[i])/totalpixels;
-#ifdef DEBUG
-        printf("%d:%f\n",i,freq[i]);
-#endif
+    int bits[33];
+    int maxssss = self->bitdepth < 16 ? self->bitdepth + 1 : 16;
+
+    memset(table, 0, sizeof(*table));
+    table->bitdepth = self->bitdepth;
+    table->complete = complete;
+    for (int i = 0; i < 17; i++) {
+        freq[i] = self->hist[i];
+        // Reusable tables need a code for every difference that can occur
+        if (complete && i <= maxssss && freq[i] == 0) freq[i] = 1;
         codesize[i] = 0;
         others[i] = -1;
     }
+    // Reserved symbol, keeps the all ones code out of the table
+    freq[17] = 1;
     codesize[17] = 0;
     others[17] = -1;
-    freq[17] = 1.0f;
-
-    float v1f,v2f;
-    int v1,v2;
 
     while (1) {
-        v1f=3.0f;
-        v1=-1;
-        for (int i=0;i<18;i++) {
-            if ((freq[i]<=v1f) && (freq[i]>0.0f)) {
-                v1f = freq[i];
-                v1 = i;
-            }
+        int v1 = -1;
+        int v2 = -1;
+        for (int i = 0; i < 18; i++) {
+            if (freq[i] && (v1 < 0 || freq[i] <= freq[v1])) v1 = i;
         }
-#ifdef DEBUG
-        printf("v1:%d,%f\n",v1,v1f);
-#endif
-        v2f=3.0f;
-        v2=-1;
-        for (int i=0;i<18;i++) {
-            if (i==v1) continue;
-            if ((freq[i]<v2f) && (freq[i]>0.0f)) {
-                v2f = freq[i];
-                v2 = i;
-            }
+        for (int i = 0; i < 18; i++) {
+            if (freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2])) v2 = i;
         }
-        if (v2==-1) break; // Done
-
+        if (v2 < 0) break;
         freq[v1] += freq[v2];
-        freq[v2] = 0.0f;
-
-        while (1) {
-            codesize[v1]++;
-            if (others[v1]==-1) break;
+        freq[v2] = 0;
+        codesize[v1]++;
+        while (others[v1] >= 0) {
             v1 = others[v1];
+            codesize[v1]++;
         }
         others[v1] = v2;
-        while (1) {
-            codesize[v2]++;
-            if (others[v2]==-1) break;
+        codesize[v2]++;
+        while (others[v2] >= 0) {
             v2 = others[v2];
+            codesize[v2]++;
         }
     }
-    int* bits = self->bits;
-    memset(bits,0,sizeof(self->bits));
-    for (int i=0;i<18;i++) {
-        if (codesize[i]!=0) {
-            bits[codesize[i]]++;
-        }
-    }
-#ifdef DEBUG
-    for (int i=0;i<17;i++) {
-        printf("bits:%d,%d,%d\n",i,bits[i],codesize[i]);
+
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i < 18; i++) {
+        if (codesize[i]) bits[codesize[i]]++;
     }
-#endif
-    int* huffval = self->huffval;
-    int i=1;
-    int k=0;
-    int j;
-    memset(huffval,0,sizeof(self->huffval));
-    while (i<=32) {
-        j=0;
-        while (j<17) {
-            if (codesize[j]==i) {
-                huffval[k++] = j;
-            }
-            j++;
+    for (int i = 32; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i-1]++;
+            bits[j+1] += 2;
+            bits[j]--;
         }
-        i++;
-    }
-#ifdef DEBUG
-    for (i=0;i<17;i++) {
-        printf("i=%d,huffval[i]=%x\n",i,huffval[i]);
-    }
-#endif
-    int maxbits = 16;
-    while (maxbits>0) {
-        if (bits[maxbits]) break;
-        maxbits--;
     }
-    u16* huffenc = self->huffenc;
-    u16* huffbits = self->huffbits;
-    int* huffsym = self->huffsym;
-    memset(huffenc,0,sizeof(self->huffenc));
-    memset(huffbits,0,sizeof(self->huffbits));
-    memset(self->huffsym,0,sizeof(self->huffsym));
-    i = 0;
-    int hv = 0;
-    int rv = 0;
-    int vl = 0; // i
-    //int hcode;
-    int bitsused = 1;
-    int sym = 0;
-    //printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-    while (i<1<<maxbits) {
-        if (bitsused>maxbits) {
-            break; // Done. Should never get here!
-        }
-        if (vl >= bits[bitsused]) {
-            bitsused++;
-            vl = 0;
-            continue;
-        }
-        if (rv == 1 << (maxbits-bitsused)) {
-            rv = 0;
-            vl++;
-            hv++;
-            //printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-            continue;
+    // Drop the reserved code, it is the longest one
+    int i = 16;
+    while (bits[i] == 0) i--;
+    bits[i]--;
+
+    for (i = 1; i <= 16; i++) table->bits[i] = bits[i];
+    for (int size = 1; size <= 32; size++) {
+        for (int ssss = 0; ssss < 17; ssss++) {
+            if (codesize[ssss] == size) table->huffval[table->count++] = ssss;
         }
-        huffbits[sym] = bitsused;
-        huffenc[sym++] = i>>(maxbits-bitsused);
-        //printf("%d %d %d\n",i,bitsused,hcode);
-        i+= (1<<(maxbits-bitsused));
-        rv = 1<<(maxbits-bitsused);
     }
-    for (i=0;i<17;i++) {
-        if (huffbits[i]>0) {
-            huffsym[huffval[i]] = i;
-        }
-#ifdef DEBUG
-        printf("huffval[%d]=%d,huffenc[%d]=%x,bits=%d\n",i,huffval[i],i,huffenc[i],huffbits[i]);
-#endif
-        if (huffbits[i]>0) {
-            huffsym[huffval[i]] = i;
+
+    // Canonical codes in huffval order
+    int code = 0;
+    int k = 0;
+    for (int size = 1; size <= 16; size++) {
+        for (int n = 0; n < table->bits[size]; n++, k++) {
+            table->huffenc[table->huffval[k]] = code++;
+            table->huffbits[table->huffval[k]] = size;
         }
+        code <<= 1;
     }
-#ifdef DEBUG
-    for (i=0;i<17;i++) {
-        printf("huffsym[%d]=%d\n",i,huffsym[i]);
-    }
-#endif
 }
 
 void writeHeader(lje* self) {
+    const struct _lj92_table* table = self->use;
     int w = self->encodedWritten;
     uint8_t* e = self->encoded;
     e[w++] = 0xff; e[w++] = 0xd8; //SOI
     e[w++] = 0xff; e[w++] = 0xc4; //HUFF
     // Write HUFF
-        int count = 0;
-        for (int i=0;i<17;i++) {
-            count += self->bits[i];
-        }
-        e[w++] = 0x0; e[w++] = 17+2+count; //Lf, frame header length
+        e[w++] = 0x0; e[w++] = 17+2+table->count; //Lf, frame header length
         e[w++] = 0; // Table ID
         for (int i=1;i<17;i++) {
-            e[w++] = self->bits[i];
+            e[w++] = table->bits[i];
         }
-        for (int i=0;i<count;i++) {
-            e[w++] = self->huffval[i];
+        for (int i=0;i<table->count;i++) {
+            e[w++] = table->huffval[i];
         }
     e[w++] = 0xff; e[w++] = 0xc3; //SOF3
         // Write SOF
@@ -988,130 +1376,85 @@ void writePost(lje* self) {
     self->encodedWritten = w;
 }
 
-void writeBody(lje* self) {
-    // Scan through the tile using the standard type 6 prediction
-    // Need to cache the previous 2 row in target coordinates because of tiling
-    uint16_t* pixel = self->image;
-    int pixcount = self->width*self->height;
-    int scan = self->readLength;
-    uint16_t* rowcache = (uint16_t*)calloc(1, self->width * self->components * 4);
-    uint16_t* rows[2];
-    rows[0] = rowcache;
-    rows[1] = &rowcache[self->width];
-
-    int col = 0;
-    int row = 0;
-    int Px = 0;
-    int32_t diff = 0;
-    int bitcount = 0;
+// Write 'count' bytes from the pending bits, with a zero after every 0xFF
+static void flushBytes(lje* self, int count) {
     uint8_t* out = self->encoded;
     int w = self->encodedWritten;
-    uint8_t next = 0;
-    uint8_t nextbits = 8;
-    while (pixcount--) {
-        uint16_t p = *pixel;
-        if (self->delinearize) p = self->delinearize[p];
-        rows[1][col] = p;
-
-        if ((row == 0)&&(col == 0))
-            Px = 1 << (self->bitdepth-1);
-        else if (row == 0)
-            Px = rows[1][col-1];
-        else if (col == 0)
-            Px = rows[0][col];
-        else
-            Px = rows[0][col] + ((rows[1][col-1] - rows[0][col-1])>>1);
-        diff = rows[1][col] - Px;
-        int ssss = 32 - __builtin_clz(abs(diff));
-        if (diff==0) ssss=0;
-        //printf("%d %d %d %d %d\n",col,row,Px,diff,ssss);
-
-        // Write the huffman code for the ssss value
-        int huffcode = self->huffsym[ssss];
-        int huffenc = self->huffenc[huffcode];
-        int huffbits = self->huffbits[huffcode];
-        bitcount += huffbits + ssss;
-
-        int vt = ssss>0?(1<<(ssss-1)):0;
-        //printf("%d %d %d %d\n",rows[1][col],Px,diff,Px+diff);
-#ifdef DEBUG
-#endif
-        if (diff < vt)
-            diff += (1 << (ssss))-1;
-
-        // Write the ssss
-        while (huffbits>0) {
-            int usebits = huffbits>nextbits?nextbits:huffbits;
-            // Add top usebits from huffval to next usebits of nextbits
-            int tophuff = huffenc >> (huffbits - usebits);
-            next |= (tophuff << (nextbits-usebits));
-            nextbits -= usebits;
-            huffbits -= usebits;
-            huffenc &= (1<<huffbits)-1;
-            if (nextbits==0) {
-                out[w++] = next;
-                if (next==0xff) out[w++] = 0x0;
-                next = 0;
-                nextbits = 8;
-            }
-        }
-        // Write the rest of the bits for the value
-
-        while (ssss>0) {
-            int usebits = ssss>nextbits?nextbits:ssss;
-            // Add top usebits from huffval to next usebits of nextbits
-            int tophuff = diff >> (ssss - usebits);
-            next |= (tophuff << (nextbits-usebits));
-            nextbits -= usebits;
-            ssss -= usebits;
-            diff &= (1<<ssss)-1;
-            if (nextbits==0) {
-                out[w++] = next;
-                if (next==0xff) out[w++] = 0x0;
-                next = 0;
-                nextbits = 8;
+    while (count--) {
+        self->bitcount -= 8;
+        uint8_t v = self->bitacc >> self->bitcount;
+        out[w++] = v;
+        if (v == 0xff) out[w++] = 0x0;
+    }
+    self->encodedWritten = w;
+}
+
+static int bodyRow(lje* self, const int* diffs) {
+    const struct _lj92_table* table = self->use;
+    // Worst case for a row is 32 bits per value with every byte stuffed
+    if (self->encodedWritten + self->width * 8 + 16 > self->encodedLength) {
+        int length = self->encodedLength + self->encodedLength / 2 + self->width * 8 + 16;
+        uint8_t* encoded = realloc(self->encoded, length);
+        if (encoded == NULL) return LJ92_ERROR_NO_MEMORY;
+        self->encoded = encoded;
+        self->encodedLength = length;
+    }
+    for (int col = 0; col < self->width; col++) {
+        int diff = diffs[col];
+        int ssss = diffBits(diff);
+        int huffbits = table->huffbits[ssss];
+        if (huffbits == 0) return LJ92_ERROR_TOO_WIDE;
+        if (diff < 0) diff += (1 << ssss) - 1;
+        // Code and extra bits together, at most 32 bits
+        self->bitacc = (self->bitacc << (huffbits + ssss)) | ((uint64_t)table->huffenc[ssss] << ssss) | (diff & ((1 << ssss) - 1));
+        self->bitcount += huffbits + ssss;
+        if (self->bitcount >= 32) {
+            u32 word = self->bitacc >> (self->bitcount - 32);
+            // Store the word at once unless one of its bytes is 0xFF
+            if ((~word - 0x01010101) & word & 0x80808080) {
+                flushBytes(self, 4);
+            } else {
+                uint8_t* out = &self->encoded[self->encodedWritten];
+                out[0] = word >> 24;
+                out[1] = word >> 16;
+                out[2] = word >> 8;
+                out[3] = word;
+                self->encodedWritten += 4;
+                self->bitcount -= 32;
             }
         }
+    }
+    return LJ92_ERROR_NONE;
+}
 
-        //printf("%d %d\n",diff,ssss);
-        pixel++;
-        scan--;
-        col++;
-        if (scan==0) { pixel += self->skipLength; scan = self->readLength; }
-        if (col==self->width) {
-            uint16_t* tmprow = rows[1];
-            rows[1] = rows[0];
-            rows[0] = tmprow;
-            col=0;
-            row++;
+int writeBody(lje* self) {
+    u16* rows = calloc(self->width * 2, sizeof(u16));
+    int* diffs = malloc(self->width * sizeof(int));
+    int ret = LJ92_ERROR_NO_MEMORY;
+    self->bitacc = 0;
+    self->bitcount = 0;
+    if (rows && diffs) ret = encodeRows(self, rows, diffs, bodyRow);
+    if (ret == LJ92_ERROR_NONE) {
+        flushBytes(self, self->bitcount / 8);
+        // Pad the last byte with ones
+        if (self->bitcount) {
+            int pad = 8 - self->bitcount;
+            self->bitacc = (self->bitacc << pad) | ((1 << pad) - 1);
+            self->bitcount += pad;
+            flushBytes(self, 1);
         }
     }
-    // Flush the final bits
-    if (nextbits<8) {
-        out[w++] = next;
-        if (next==0xff) out[w++] = 0x0;
-    }
-#ifdef DEBUG
-    int sort[17];
-    for (int h=0;h<17;h++) {
-        sort[h] = h;
-        printf("%d:%d\n",h,self->hist[h]);
-    }
-    printf("Total bytes: %d\n",bitcount>>3);
-#endif
-    free(rowcache);
-    self->encodedWritten = w;
+    free(rows);
+    free(diffs);
+    return ret;
 }
-/* Encoder
- * Read tile from an image and encode in one shot
- * Return the encoded data
- */
-int lj92_encode(uint16_t* image, int width, int height, int bitdepth, int components,
-                int readLength, int skipLength,
-                uint16_t* delinearize,int delinearizeLength,
-                uint8_t** encoded, int* encodedLength) {
-    int ret = LJ92_ERROR_NONE;
 
+static int encodeImage(uint16_t* image, int width, int height, int bitdepth, int components,
+                       int readLength, int skipLength,
+                       uint16_t* delinearize, int delinearizeLength,
+                       lje** encoder) {
+    if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF) return LJ92_ERROR_TOO_WIDE;
+    if (bitdepth < 1 || bitdepth > 16 || readLength <= 0) return LJ92_ERROR_TOO_WIDE;
     lje* self = (lje*)calloc(sizeof(lje),1);
     if (self==NULL) return LJ92_ERROR_NO_MEMORY;
     self->image = image;
@@ -1123,22 +1466,69 @@ int lj92_encode(uint16_t* image, int width, int height, int bitdepth, int compon
     self->delinearize = delinearize;
     self->delinearizeLength = delinearizeLength;
     self->components = components;
+    *encoder = self;
+    return LJ92_ERROR_NONE;
+}
+
+int lj92_encode_table(uint16_t* image, int width, int height, int bitdepth,
+                      int readLength, int skipLength,
+                      uint16_t* delinearize, int delinearizeLength,
+                      lj92_table* table) {
+    lje* self;
+    *table = NULL;
+    int ret = encodeImage(image, width, height, bitdepth, 1, readLength, skipLength, delinearize, delinearizeLength, &self);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    ret = frequencyScan(self);
+    if (ret == LJ92_ERROR_NONE) {
+        *table = malloc(sizeof(struct _lj92_table));
+        if (*table == NULL) ret = LJ92_ERROR_NO_MEMORY;
+        else createEncodeTable(self, *table, 1);
+    }
+    free(self);
+    return ret;
+}
+
+void lj92_free_table(lj92_table table) {
+    free(table);
+}
+
+int lj92_encode_with_table(uint16_t* image, int width, int height, int bitdepth, int components,
+                           int readLength, int skipLength,
+                           uint16_t* delinearize, int delinearizeLength,
+                           lj92_table table,
+                           uint8_t** encoded, int* encodedLength) {
+    lje* self;
+    int ret = encodeImage(image, width, height, bitdepth, components, readLength, skipLength, delinearize, delinearizeLength, &self);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    if (table) {
+        if (table->bitdepth != bitdepth || !table->complete) {
+            free(self);
+            return LJ92_ERROR_TOO_WIDE;
+        }
+        self->use = table;
+    } else {
+        // Scan through data to gather frequencies of ssss prefixes
+        ret = frequencyScan(self);
+        if (ret != LJ92_ERROR_NONE) {
+            free(self);
+            return ret;
+        }
+        createEncodeTable(self, &self->table, 0);
+        self->use = &self->table;
+    }
+    // Grows while writing if needed
     self->encodedLength = width*height*components+200;
     self->encoded = malloc(self->encodedLength);
     if (self->encoded==NULL) { free(self); return LJ92_ERROR_NO_MEMORY; }
-    // Scan through data to gather frequencies of ssss prefixes
-    ret = frequencyScan(self);
+    // Write JPEG head and scan header
+    writeHeader(self);
+    // Scan through and do the compression
+    ret = writeBody(self);
     if (ret != LJ92_ERROR_NONE) {
         free(self->encoded);
         free(self);
         return ret;
     }
-
-    createEncodeTable(self);
-    // Write JPEG head and scan header
-    writeHeader(self);
-    // Scan through and do the compression
-    writeBody(self);
     // Finish
     writePost(self);
 #ifdef DEBUG
@@ -1154,4 +1544,14 @@ int lj92_encode(uint16_t* image, int width, int height, int bitdepth, int compon
     return ret;
 }
 
-
+/* Encoder
+ * Read tile from an image and encode in one shot
+ * Return the encoded data
+ */
+int lj92_encode(uint16_t* image, int width, int height, int bitdepth, int components,
+                int readLength, int skipLength,
+                uint16_t* delinearize,int delinearizeLength,
+                uint8_t** encoded, int* encodedLength) {
+    return lj92_encode_with_table(image, width, height, bitdepth, components, readLength, skipLength,
+                                  delinearize, delinearizeLength, NULL, encoded, encodedLength);
+}
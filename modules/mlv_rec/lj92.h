@@ -57,6 +57,12 @@ int lj92_decode(lj92 lj,
                 uint16_t* target, int writeLength, int skipLength, // The image is written to target as a tile
                 uint16_t* linearize, int linearizeLength); // If not null, linearize the data using this table
 
+/*
+ * Decode restart intervals (if the image has any) on up to 'threads' threads in lj92_decode.
+ * Only effective when built with LJ92_THREADS, the default is a single thread.
+ */
+void lj92_set_threads(lj92 lj, int threads);
+
 /*
  * Encode a grayscale image supplied as 16bit values within the given bitdepth
  * Read from tile in the image
@@ -67,4 +73,29 @@ int lj92_encode(uint16_t* image, int width, int height, int bitdepth, int compon
                 int readLength, int skipLength,
                 uint16_t* delinearize,int delinearizeLength,
                 uint8_t** encoded, int* encodedLength);
+
+/*
+ * Huffman table for encoding several similar images without a frequency scan of each one
+ * It has codes for all differences that can occur at its bitdepth, so any image
+ * of that bitdepth can be encoded with it, only less efficiently than with its own table
+ * Must be freed with lj92_free_table
+ */
+typedef struct _lj92_table* lj92_table;
+
+int lj92_encode_table(uint16_t* image, int width, int height, int bitdepth,
+                      int readLength, int skipLength,
+                      uint16_t* delinearize, int delinearizeLength,
+                      lj92_table* table); // Return table made from this image here
+
+void lj92_free_table(lj92_table table);
+
+/*
+ * Same as lj92_encode, using a table from lj92_encode_table (if not NULL)
+ * The table is only read, so it can be shared by encoders running on several threads
+ */
+int lj92_encode_with_table(uint16_t* image, int width, int height, int bitdepth, int components,
+                           int readLength, int skipLength,
+                           uint16_t* delinearize, int delinearizeLength,
+                           lj92_table table,
+                           uint8_t** encoded, int* encodedLength);
 #endif
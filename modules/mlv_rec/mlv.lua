@@ -67,3 +67,17 @@ function handle_RTCI(hdr)
     return ret;
 end
 
+
+-- 
+-- handlers registered with mlv.register() are only called for their block type and get views
+-- of the block instead of string copies, so they can read and patch fields in place.
+-- blocks without a handler cost nothing, and as long as no frame data handler is registered,
+-- frames keep being copied or converted on the fast paths.
+-- 
+mlv.register("EXPO", function(hdr)
+    print("  --  EXPO: ISO "..hdr:u32(20));
+end)
+
+mlv.register("VIDF", "data_write_dng", function(hdr, data)
+    print("  --  VIDF #"..hdr:u32(16).." before write as DNG ("..#data.." byte)");
+end)
@@ -29,7 +29,9 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <time.h>
+#include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define MODULE_STRINGS_PREFIX mlv_dump_strings
 #include "../module_strings_wrapper.h"
@@ -48,14 +50,6 @@ MODULE_STRINGS()
 #define ERR_INDEX_REQ       4
 #define ERR_MALLOC          5
 
-#if defined(USE_LUA)
-#define LUA_LIB
-#include "lua.h"
-#include "lualib.h"
-#include "lauxlib.h"
-#else
-typedef void lua_State;
-#endif
 
 /* helper macros */
 #define MAX(a,b) \
@@ -99,6 +93,8 @@ char *strdup(const char *s);
 
 #ifdef MLV_USE_LZMA
 #include <LzmaLib.h>
+#include <LzmaEnc.h>
+#include <Alloc.h>
 #endif
 
 #ifdef MLV_USE_LJ92
@@ -111,6 +107,13 @@ char *strdup(const char *s);
 #include "mlv.h"
 #include "dng/dng.h"
 #include "wav.h"
+#include "pipeline.h"
+#include "mlv_index.h"
+#include "mlv_map.h"
+#include "mlv_lua.h"
+#include "raw_proc/bitpack.h"
+#include "raw_proc/chroma_smooth_simd.h"
+#include "raw_proc/calib.h"
 
 enum bug_id
 {
@@ -193,402 +196,270 @@ void print_msg(uint32_t type, const char* format, ... )
 }
 
 
-/* based on http://www.lua.org/pil/25.3.html */
-int32_t lua_call_va(lua_State *L, const char *func, const char *sig, ...)
+/* platform/target specific fseek/ftell functions go here */
+uint64_t file_get_pos(FILE *stream)
 {
-    va_list vl;
-
-    va_start(vl, sig);
-#if defined(USE_LUA)
-    int narg, nres;  /* number of arguments and results */
-    int verbose = 0;
-    
-    lua_getglobal(L, func);  /* get function */
-
-    /* push arguments */
-    narg = 0;
-    while (*sig)
-    {
-        /* push arguments */
-        switch (*sig++)
-        {
-            case 'v':
-                verbose = 1;
-                break;
-
-            case 'd':  /* double argument */
-                lua_pushnumber(L, va_arg(vl, double));
-                break;
-
-            case 'i':  /* int argument */
-                lua_pushnumber(L, va_arg(vl, int));
-                break;
-
-            case 's':  /* string argument */
-                lua_pushstring(L, va_arg(vl, char *));
-                break;
-
-            case 'l':  /* lstring argument */
-            {
-                char *ptr = va_arg(vl, char *);
-                int len = va_arg(vl, int);
-                lua_pushlstring(L, ptr, len);
-                break;
-            }
-
-            case '>':
-                goto endwhile;
-
-            default:
-                return -5;
-        }
-        narg++;
-        luaL_checkstack(L, 1, "too many arguments");
-    }
-    endwhile:
+#if defined(__WIN32)
+    return ftello64(stream);
+#else
+    return ftello(stream);
+#endif
+}
 
-    /* do the call */
-    nres = strlen(sig);  /* number of expected results */
-    int ret = lua_pcall(L, narg, nres, 0);
+uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
+{
+#if defined(__WIN32)
+    return fseeko64(stream, offset, whence);
+#else
+    return fseeko(stream, offset, whence);
+#endif
+}
 
-    if (ret != 0)  /* do the call */
-    {
-        if (lua_isstring(L, -1))
-        {
-            //if(1 ||verbose)
-            {
-                print_msg(MSG_INFO, "LUA: Error while calling '%s': '%s'\n", func, lua_tostring(L, -1));
-            }
-        }
-        lua_pop(L, -1);
-        return -4;
-    }
 
+void xref_dump(mlv_xref_hdr_t *xref)
+{
+    mlv_xref_t *xrefs = (mlv_xref_t*)&(((unsigned char *)xref)[sizeof(mlv_xref_hdr_t)]);
 
-    /* retrieve results */
-    nres = -nres;  /* stack index of first result */
-    while (lua_gettop(L) && *sig)
+    for(uint32_t pos = 0; pos < xref->entryCount; pos++)
     {
-        /* get results */
-        switch (*sig++)
+        print_msg(MSG_INFO, "Entry %d/%d\n", pos + 1, xref->entryCount);
+        print_msg(MSG_INFO, "    File   #%d\n", xrefs[pos].fileNumber);
+        print_msg(MSG_INFO, "    Offset 0x%08X\n", xrefs[pos].frameOffset);
+        switch (xrefs[pos].frameType)
         {
-            case 'd':  /* double result */
-                if (!lua_isnumber(L, nres))
-                {
-                    if(verbose)
-                    {
-                        print_msg(MSG_INFO, "LUA: Error while calling '%s': Expected double, got %d\n", func, lua_type(L, nres));
-                    }
-                    lua_pop(L, -1);
-                    break;
-                }
-                *va_arg(vl, double *) = lua_tonumber(L, nres);
-                lua_pop(L, -1);
-                break;
-
-            case 'i':  /* int result */
-                if (!lua_isnumber(L, nres))
-                {
-                    if(verbose)
-                    {
-                        print_msg(MSG_INFO, "LUA: Error while calling '%s': Expected number, got %d\n", func, lua_type(L, nres));
-                    }
-                    lua_pop(L, -1);
-                    break;
-                }
-                *va_arg(vl, int *) = (int)lua_tonumber(L, nres);
-                lua_pop(L, -1);
-                break;
-
-            case 's':  /* string result */
-                if (!lua_isstring(L, nres))
-                {
-                    if(verbose)
-                    {
-                        print_msg(MSG_INFO, "LUA: Error while calling '%s': Expected string, got %d\n", func, lua_type(L, nres));
-                    }
-                    lua_pop(L, -1);
-                    break;
-                }
-                *va_arg(vl, const char **) = lua_tostring(L, nres);
-                lua_pop(L, -1);
+            case MLV_FRAME_VIDF:
+                print_msg(MSG_INFO, "    Type   VIDF\n");
                 break;
-
-            case 'l':  /* lstring result */
-            {
-                if (!lua_isstring(L, nres))
-                {
-                    if(verbose)
-                    {
-                        print_msg(MSG_INFO, "LUA: Error while calling '%s': Expected string, got %d\n", func, lua_type(L, nres));
-                    }
-                    lua_pop(L, -1);
-                    break;
-                }
-                const char **ret_data = va_arg(vl, const char **);
-                size_t *ret_length = va_arg(vl, size_t *);
-
-                *ret_data = lua_tolstring(L, nres, ret_length);
-                lua_pop(L, -1);
+            case MLV_FRAME_AUDF:
+                print_msg(MSG_INFO, "    Type   AUDF\n");
                 break;
-            }
-
             default:
-                print_msg(MSG_INFO, "LUA: Error while calling '%s': Expected unknown, got %d\n", func, lua_type(L, nres));
-                lua_pop(L, -1);
-                break;
-        }
-        nres++;
-    }
-#else
-    (void)L;
-    (void)func;
-    (void)sig;
-
-    /* consume all vararg arguments */
-    while (*sig)
-    {
-        switch (*sig++)
-        {
-            case 'd':
-                va_arg(vl, double);
-                break;
-            case 'i':
-                va_arg(vl, int);
-                break;
-            case 's':
-                va_arg(vl, char *);
-                break;
-            case 'l':
-                va_arg(vl, char *);
-                va_arg(vl, int);
-                break;
-            case '>':
                 break;
         }
     }
-#endif
-
-    va_end(vl);
-
-    return 0;
 }
 
+/* return codes of the frame_* helpers */
+#define FRAME_OK        0
+#define FRAME_SKIP      1 /* corrupt frame, may get skipped in --relaxed mode */
+#define FRAME_ERROR     2
 
-int32_t lua_handle_hdr_suffix(lua_State *lua_state, uint8_t *type, char *suffix, void *hdr, int hdr_len, void *data, int data_len)
+#ifdef MLV_USE_LJ92
+/* decompress a LJ92 frame in place. 'frame_buffer' must hold at least 'frame_size' bytes.
+   frames with restart markers are decoded on up to 'threads' threads */
+static int frame_decompress_lj92(uint8_t *frame_buffer, int read_size, int frame_size, int xRes, int yRes, int bpp, int threads, int verbose)
 {
-#if defined(USE_LUA)
-    uint8_t *ret_hdr = NULL;
-    uint8_t *ret_data = NULL;
-    int ret_hdr_len = 0;
-    int ret_data_len = 0;
-    char func[128];
+    lj92 handle;
+    int lj92_width = 0;
+    int lj92_height = 0;
+    int lj92_bitdepth = 0;
+    int lj92_components = 0;
 
-    snprintf(func, sizeof(func), "handle_%.4s%s", type, suffix);
+    int ret = lj92_open(&handle, frame_buffer, read_size, &lj92_width, &lj92_height, &lj92_bitdepth, &lj92_components);
 
-    if(data)
+    /* this is the raw data size with 16 bit words. it's just temporary */
+    size_t out_size = lj92_width * lj92_height * sizeof(uint16_t) * lj92_components;
+    
+    if(ret == LJ92_ERROR_NONE)
     {
-        lua_call_va(lua_state, func, "ll>ll", hdr, hdr_len, data, data_len, &ret_hdr, &ret_hdr_len, &ret_data, &ret_data_len);
+        lj92_set_threads(handle, threads);
+
+        if(verbose)
+        {
+            print_msg(MSG_INFO, "    LJ92: Decompressing\n");
+            print_msg(MSG_INFO, "    LJ92: %dx%dx%d %d bpp (%d bytes buffer)\n", lj92_width, lj92_height, lj92_components, lj92_bitdepth, out_size);
+        }
     }
     else
     {
-        lua_call_va(lua_state, func, "l>l", hdr, hdr_len, &ret_hdr, &ret_hdr_len);
+        print_msg(MSG_ERROR, "    LJ92: Open failed (%d)\n", ret);
+        return FRAME_SKIP;
     }
-
-    /* callee updated block header */
-    if(ret_hdr_len > 0 && ret_hdr_len == hdr_len)
+    
+    /* do a proper size check before we continue */
+    int lj92_frame_size = ((lj92_width * lj92_height * lj92_components * bpp + 7) / 8);
+    
+    if(lj92_frame_size != frame_size)
     {
-        print_msg(MSG_INFO, "LUA: Function '%s' updated hdr data\n", func);
-        memcpy(hdr, ret_hdr, hdr_len);
+        print_msg(MSG_ERROR, "    LJ92: decompressed image size (%d) does not match size retrieved from RAWI (%d)\n", lj92_frame_size, frame_size);
+        lj92_close(handle);
+        return FRAME_ERROR;
     }
-    else if(ret_hdr_len)
+    
+    /* we need a temporary buffer so we don't overwrite source data */
+    uint16_t *decompressed = malloc(out_size);
+    if(!decompressed)
     {
-        print_msg(MSG_INFO, "LUA: Error while calling '%s': Returned header size mismatch - %d instead of %d\n", func, ret_hdr_len, hdr_len);
+        lj92_close(handle);
+        return FRAME_ERROR;
     }
+    
+    ret = lj92_decode(handle, decompressed, lj92_width * lj92_height * lj92_components, 0, NULL, 0);
+    lj92_close(handle);
 
-    /* callee updated block data */
-    if(ret_data_len > 0 && ret_data_len == data_len)
+    if(ret != LJ92_ERROR_NONE)
     {
-        print_msg(MSG_INFO, "LUA: Function '%s' updated hdr data\n", func);
-        memcpy(data, ret_data, data_len);
+        print_msg(MSG_ERROR, "    LJ92: Decompress failed (%d)\n", ret);
+        free(decompressed);
+        return FRAME_SKIP;
     }
-    else if(ret_data_len)
+    
+    if(verbose)
     {
-        print_msg(MSG_INFO, "LUA: Error while calling '%s': Returned data size mismatch - %d instead of %d\n", func, ret_data_len, data_len);
+        print_msg(MSG_INFO, "    LJ92: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%% ratio)\n", read_size, frame_size, ((float)read_size * 100.0f) / (float)frame_size);
     }
-#else
-    (void)lua_state;
-    (void)type;
-    (void)suffix;
-    (void)hdr;
-    (void)hdr_len;
-    (void)data;
-    (void)data_len;
-#endif
-    return 0;
-}
+    
+    /* repack the 16 bit words containing values with max 14 bit */
+    int orig_pitch = xRes * bpp / 8;
 
-int32_t lua_handle_hdr(lua_State *lua_state, uint8_t *type, void *hdr, int hdr_len)
-{
-    return lua_handle_hdr_suffix(lua_state, type, "", hdr, hdr_len, NULL, 0);
-}
+    for(int y = 0; y < yRes; y++)
+    {
+        uint16_t *src_line = &decompressed[y * xRes];
+        void *dst_line = &frame_buffer[y * orig_pitch];
 
-int32_t lua_handle_hdr_data(lua_State *lua_state, uint8_t *type, char *suffix, void *hdr, int hdr_len, void *data, int data_len)
-{
-    return lua_handle_hdr_suffix(lua_state, type, suffix, hdr, hdr_len, data, data_len);
+        bitpack_pack(src_line, dst_line, xRes, bpp);
+    }
+    
+    free(decompressed);
+    return FRAME_OK;
 }
-
-/* platform/target specific fseek/ftell functions go here */
-uint64_t file_get_pos(FILE *stream)
-{
-#if defined(__WIN32)
-    return ftello64(stream);
-#else
-    return ftello(stream);
 #endif
-}
 
-uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
+#ifdef MLV_USE_LZMA
+/* decompress a LZMA frame in place. 'frame_buffer' must hold at least 'frame_size' bytes */
+static int frame_decompress_lzma(uint8_t *frame_buffer, int read_size, int frame_size, int verbose)
 {
-#if defined(__WIN32)
-    return fseeko64(stream, offset, whence);
-#else
-    return fseeko(stream, offset, whence);
-#endif
-}
+    size_t lzma_out_size = *(uint32_t *)frame_buffer;
+    size_t lzma_in_size = read_size - LZMA_PROPS_SIZE - 4;
+    size_t lzma_props_size = LZMA_PROPS_SIZE;
+    unsigned char *lzma_out = malloc(lzma_out_size);
 
+    if(!lzma_out)
+    {
+        return FRAME_ERROR;
+    }
 
-/* this structure is used to build the mlv_xref_t table */
-typedef struct
-{
-    uint64_t    frameTime;
-    uint64_t    frameOffset;
-    uint16_t    fileNumber;
-    uint16_t    frameType;
-} frame_xref_t;
-
-void xref_resize(frame_xref_t **table, int entries, int *allocated)
-{
-    /* make sure there is no crappy pointer before using */
-    if(*allocated == 0)
+    int ret = LzmaUncompress(
+        lzma_out, &lzma_out_size,
+        (unsigned char *)&frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
+        (unsigned char *)&frame_buffer[4], lzma_props_size
+        );
+        
+    if(lzma_out_size != (size_t)frame_size)
+    {
+        print_msg(MSG_ERROR, "    LZMA: decompressed image size (%d) does not match size retrieved from RAWI (%d)\n", lzma_out_size, frame_size);
+        free(lzma_out);
+        return FRAME_ERROR;
+    }
+    
+    if(ret != SZ_OK)
     {
-        *table = NULL;
+        print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
+        free(lzma_out);
+        return FRAME_ERROR;
     }
 
-    /* only resize if the buffer is too small */
-    if(entries * sizeof(frame_xref_t) > (uint32_t)(*allocated))
+    memcpy(frame_buffer, lzma_out, lzma_out_size);
+    
+    if(verbose)
     {
-        *allocated += (entries + 1) * sizeof(frame_xref_t);
-        *table = realloc(*table, *allocated);
+        print_msg(MSG_INFO, "    LZMA: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, lzma_out_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
     }
+
+    free(lzma_out);
+    return FRAME_OK;
 }
 
-void xref_dump(mlv_xref_hdr_t *xref)
+static void *lzma_alloc(void *UNUSED(p), size_t size) { return MyAlloc(size); }
+static void lzma_free(void *UNUSED(p), void *address) { MyFree(address); }
+static ISzAlloc lzma_allocator = { lzma_alloc, lzma_free };
+
+/* compress 'frame_size' bytes of packed raw data into the layout frame_decompress_lzma reads:
+   uncompressed size, LZMA properties, LZMA stream. thread safe, so it can run on the compressor threads */
+static int frame_compress_lzma(uint8_t *frame_buffer, int frame_size, int level, uint8_t **compressed, int *compressed_size)
 {
-    mlv_xref_t *xrefs = (mlv_xref_t*)&(((unsigned char *)xref)[sizeof(mlv_xref_hdr_t)]);
+    /* incompressible data (e.g. noise in the lowest bits) may grow a little */
+    size_t lzma_out_size = frame_size + frame_size / 16 + 1024;
+    size_t lzma_props_size = LZMA_PROPS_SIZE;
+    uint8_t *lzma_out = malloc(4 + LZMA_PROPS_SIZE + lzma_out_size);
 
-    for(uint32_t pos = 0; pos < xref->entryCount; pos++)
+    if(!lzma_out)
     {
-        print_msg(MSG_INFO, "Entry %d/%d\n", pos + 1, xref->entryCount);
-        print_msg(MSG_INFO, "    File   #%d\n", xrefs[pos].fileNumber);
-        print_msg(MSG_INFO, "    Offset 0x%08X\n", xrefs[pos].frameOffset);
-        switch (xrefs[pos].frameType)
-        {
-            case MLV_FRAME_VIDF:
-                print_msg(MSG_INFO, "    Type   VIDF\n");
-                break;
-            case MLV_FRAME_AUDF:
-                print_msg(MSG_INFO, "    Type   AUDF\n");
-                break;
-            default:
-                break;
-        }
+        return FRAME_ERROR;
     }
-}
 
+    CLzmaEncProps props;
+    LzmaEncProps_Init(&props);
+    props.level = level;
 
-void xref_sort(frame_xref_t *table, int entries)
-{
-    int n = entries;
-    do
+    /* every frame is a stream on its own, so the dictionary never has to be larger than one frame.
+       this keeps the match finder memory (about 10x the dictionary) per worker thread in check.
+       numThreads stays at default: two threads for the match finder if LzFindMt is compiled in (no _7ZIP_ST) */
+    props.reduceSize = frame_size;
+
+    int ret = LzmaEncode(
+        &lzma_out[4 + LZMA_PROPS_SIZE], &lzma_out_size,
+        frame_buffer, frame_size,
+        &props, &lzma_out[4], &lzma_props_size, 0,
+        NULL, &lzma_allocator, &lzma_allocator
+        );
+
+    if(ret != SZ_OK)
     {
-        int newn = 1;
-        for (int i = 0; i < n-1; ++i)
-        {
-            if (table[i].frameTime > table[i+1].frameTime)
-            {
-                frame_xref_t tmp = table[i+1];
-                table[i+1] = table[i];
-                table[i] = tmp;
-                newn = i + 1;
-            }
-        }
-        n = newn;
-    } while (n > 1);
+        print_msg(MSG_ERROR, "    LZMA: Failed (%d)\n", ret);
+        free(lzma_out);
+        return FRAME_ERROR;
+    }
+
+    *(uint32_t *)lzma_out = frame_size;
+    *compressed = lzma_out;
+    *compressed_size = 4 + LZMA_PROPS_SIZE + lzma_out_size;
+    return FRAME_OK;
 }
+#endif
 
-void bitinsert(uint16_t *dst, int position, int depth, uint16_t new_value)
+/* convert a bit packed frame from 'old_depth' to 'new_depth' bits per pixel */
+static void frame_convert_depth(uint8_t *src, uint8_t *dst, int xRes, int yRes, int old_depth, int new_depth)
 {
-    uint16_t old_value = 0;
-    int dst_pos = position * depth / 16;
-    int bits_to_left = ((depth * position) - (16 * dst_pos)) % 16;
-    int shift_right = 16 - depth - bits_to_left;
+    int old_pitch = xRes * old_depth / 8;
+    int new_pitch = xRes * new_depth / 8;
 
-    old_value = dst[dst_pos];
-    if(shift_right >= 0)
+    for(int y = 0; y < yRes; y++)
     {
-        /* this case is a bit simpler. the word fits into this uint16_t */
-        uint16_t mask = ((1<<depth)-1) << shift_right;
+        uint16_t *src_line = (uint16_t *)&src[y * old_pitch];
+        uint16_t *dst_line = (uint16_t *)&dst[y * new_pitch];
 
-        /* shift and mask out */
-        new_value <<= shift_right;
-        new_value &= mask;
-        old_value &= ~mask;
-
-        /* now combine */
-        new_value |= old_value;
-        dst[dst_pos] = new_value;
-    }
-    else
-    {
-        /* here we need two operations as the bits are split over two words */
-        uint16_t mask1 = ((1<<(depth + shift_right))-1);
-        uint16_t mask2 = ((1<<(-shift_right))-1) << (16+shift_right);
-
-        /* write the upper bits */
-        old_value &= ~mask1;
-        old_value |= (new_value >> (-shift_right)) & mask1;
-        dst[dst_pos] = old_value;
-
-        /* write the lower bits */
-        old_value = dst[dst_pos + 1];
-        old_value &= ~mask2;
-        old_value |= (new_value << (16+shift_right)) & mask2;
-        dst[dst_pos + 1] = old_value;
+        /* normalizes to 16 bits with a bias of 0.5 LSB to minimize the roundoff error, see bitpack.c */
+        bitpack_convert(src_line, dst_line, xRes, old_depth, new_depth);
     }
 }
 
-uint16_t bitextract(uint16_t *src, int position, int depth)
+/* zero the lowest bits so only 'bit_zap' bits (in 16 bit scale) carry information */
+static void frame_zap_bits(uint8_t *frame_buffer, int xRes, int yRes, int depth, int bit_zap)
 {
-    uint16_t value = 0;
-    int src_pos = position * depth / 16;
-    int bits_to_left = ((depth * position) - (16 * src_pos)) % 16;
-    int shift_right = 16 - depth - bits_to_left;
+    int pitch = xRes * depth / 8;
+    uint32_t mask = ~((1 << (16 - bit_zap)) - 1);
 
-    value = src[src_pos];
-
-    if(shift_right >= 0)
-    {
-        value >>= shift_right;
-    }
-    else
+    for(int y = 0; y < yRes; y++)
     {
-        value <<= -shift_right;
-        value |= src[src_pos + 1] >> (16 + shift_right);
-    }
-    value &= (1<<depth) - 1;
+        uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
+
+        for(int x = 0; x < xRes; x++)
+        {
+            int32_t value = bitextract(src_line, x, depth);
+
+            /* normalize the old value to 16 bits */
+            value <<= (16-depth);
 
-    return value;
+            value &= mask;
+
+            /* convert the old value to destination depth */
+            value >>= (16-depth);
+
+
+            bitinsert(src_line, x, depth, value);
+        }
+    }
 }
 
 int load_frame(char *filename, uint8_t **frame_buffer, uint32_t *frame_buffer_size)
@@ -697,7 +568,7 @@ load_frame_finish:
     return ret;
 }
 
-mlv_xref_hdr_t *load_index(char *base_filename)
+mlv_xref_hdr_t *load_index(char *base_filename, mlv_file_hdr_t *idx_hdr)
 {
     mlv_xref_hdr_t *block_hdr = NULL;
     int max_name_len = strlen(base_filename) + 16;
@@ -746,6 +617,15 @@ mlv_xref_hdr_t *load_index(char *base_filename)
                 block_hdr = NULL;
             }
         }
+        else if(idx_hdr && !memcmp(buf.blockType, "MLVI", 4) && buf.blockSize >= sizeof(mlv_file_hdr_t))
+        {
+            if(fread(idx_hdr, sizeof(mlv_file_hdr_t), 1, in_file) != 1)
+            {
+                print_msg(MSG_ERROR, "File '%s' ends in the middle of a block\n", filename);
+                break;
+            }
+            file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+        }
         else
         {
             file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
@@ -916,51 +796,207 @@ FILE **load_all_chunks(char *base_filename, int *entries)
     return files;
 }
 
-void show_usage(char *executable)
+/* add all blocks of one chunk to the index, only reading the block headers */
+static int index_chunk(mlv_index_t *index, FILE *in_file, mlv_map_t *in_map, int file_num)
 {
-    print_msg(MSG_INFO, "Usage: %s [options] <inputfile>\n", executable);
-    print_msg(MSG_INFO, "Parameters:\n");
-    print_msg(MSG_INFO, "  -o output_file      write video data into a MLV file\n");
-    print_msg(MSG_INFO, "  -v                  verbose output\n");
-    print_msg(MSG_INFO, "  --version           print version information\n");
-    print_msg(MSG_INFO, "  --batch             format output message suitable for batch processing\n");
-    print_msg(MSG_INFO, "  --relaxed           do not exit on every error, skip blocks that are erroneous\n");
-    print_msg(MSG_INFO, "  --no-audio          for DNG output WAV not saved, for MLV output WAVI/AUDF blocks are not included in destination MLV\n");
-    
-    print_msg(MSG_INFO, "\n");
-    print_msg(MSG_INFO, "-- DNG output --\n");
-    print_msg(MSG_INFO, "  --dng               output frames into separate .dng files. set prefix with -o\n");
-    print_msg(MSG_INFO, "  --no-cs             no chroma smoothing (default)\n");
-    print_msg(MSG_INFO, "  --cs2x2             2x2 chroma smoothing\n");
-    print_msg(MSG_INFO, "  --cs3x3             3x3 chroma smoothing\n");
-    print_msg(MSG_INFO, "  --cs5x5             5x5 chroma smoothing\n");
-    print_msg(MSG_INFO, "  --no-fixfp          do not fix focus pixels\n");
-    print_msg(MSG_INFO, "  --no-fixcp          do not fix bad pixels\n");
-    print_msg(MSG_INFO, "  --fixcp2            use aggressive method for revealing more bad pixels\n");
-    print_msg(MSG_INFO, "  --no-stripes        do not fix vertical stripes in highlights\n");
-    print_msg(MSG_INFO, "  --force-stripes     compute stripe correction for every frame\n");
-    print_msg(MSG_INFO, "  --is-dualiso        use dual iso compatible horizontal interpolation of focus and bad pixels\n");
-    print_msg(MSG_INFO, "  --is-croprec        generate focus map for crop_rec mode\n");
-    print_msg(MSG_INFO, "  --save-bpm          save bad pixels to .BPM file\n");
-    print_msg(MSG_INFO, "  --fixpn             fix pattern noise\n");
-    print_msg(MSG_INFO, "  --deflicker=value   per-frame exposure compensation. value is target median in raw units ex: 3072 (default)\n");
-    print_msg(MSG_INFO, "  --no-bitpack        write DNG files with unpacked to 16 bit raw data\n");
-    print_msg(MSG_INFO, "  --show-progress     show DNG file creation progress. ignored when -v or --batch is specified\n");
-    print_msg(MSG_INFO, "                      also works when compressing MLV to MLV and shows compression ratio for each frame\n");
-    print_msg(MSG_INFO, "  --fpi <method>      focus pixel interpolation method: 0 (mlvfs), 1 (raw2dng), default is 0\n");
-    print_msg(MSG_INFO, "  --bpi <method>      bad pixel interpolation method: 0 (mlvfs), 1 (raw2dng), default is 0\n");
+    uint64_t position = 0;
 
-    print_msg(MSG_INFO, "\n");
-    print_msg(MSG_INFO, "-- RAW output --\n");
-    print_msg(MSG_INFO, "  -r                  output into a legacy raw file for e.g. raw2dng\n");
+    file_set_pos(in_file, 0, SEEK_SET);
 
-    print_msg(MSG_INFO, "\n");
-    print_msg(MSG_INFO, "-- MLV output --\n");
-    print_msg(MSG_INFO, "  -b bits             convert image data to given bit depth per channel (1-16)\n");
-    print_msg(MSG_INFO, "  -z bits             zero the lowest bits, so we have only specified number of bits containing data (1-16) (improves compression rate)\n");
-    print_msg(MSG_INFO, "  -f frames           frames to save. e.g. '12' saves frames 0 to 12, '12-40' saves frames 12 to 40\n");
+    while(1)
+    {
+        mlv_hdr_t hdr;
+
+        if(in_map)
+        {
+            mlv_hdr_t *mapped = mlv_map_get(in_map, file_num, position, sizeof(mlv_hdr_t));
+
+            if(!mapped)
+            {
+                break;
+            }
+            hdr = *mapped;
+        }
+        else if(fread(&hdr, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        {
+            break;
+        }
+
+        if(hdr.blockSize < sizeof(mlv_hdr_t))
+        {
+            print_msg(MSG_ERROR, "Invalid block size at position 0x%08" PRIx64 " in chunk %d\n", position, file_num);
+            return -1;
+        }
+
+        if(mlv_index_add_block(index, &hdr, position, file_num))
+        {
+            print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+            return -1;
+        }
+
+        position += hdr.blockSize;
+        if(!in_map)
+        {
+            file_set_pos(in_file, position, SEEK_SET);
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t xref_block_time(void *ctx, const mlv_xref_t *xref)
+{
+    FILE **in_files = (FILE **)ctx;
+    FILE *in_file = in_files[xref->fileNumber];
+    mlv_hdr_t hdr;
+
+    file_set_pos(in_file, xref->frameOffset, SEEK_SET);
+    if(fread(&hdr, sizeof(mlv_hdr_t), 1, in_file) != 1)
+    {
+        return 0;
+    }
+
+    return mlv_index_block_time(&hdr);
+}
+
+/* bring the .IDX up to date with the chunks on disk. only chunks appended since it was written are scanned */
+static int update_index(char *input_filename, FILE **in_files, mlv_map_t *in_map, int in_file_count)
+{
+    mlv_file_hdr_t file_hdr;
+    mlv_file_hdr_t idx_hdr;
+    mlv_index_t index;
+    int covered = 0;
+
+    file_set_pos(in_files[0], 0, SEEK_SET);
+    if(fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, in_files[0]) != 1 || memcmp(file_hdr.fileMagic, "MLVI", 4))
+    {
+        print_msg(MSG_ERROR, "File '%s' has no MLVI header\n", input_filename);
+        return ERR_FILE;
+    }
+
+    memset(&idx_hdr, 0x00, sizeof(mlv_file_hdr_t));
+    mlv_xref_hdr_t *block_xref = load_index(input_filename, &idx_hdr);
+    mlv_xref_t *xrefs = NULL;
+
+    if(block_xref)
+    {
+        xrefs = (mlv_xref_t *)(block_xref + 1);
+        covered = idx_hdr.fileNum - 1;
+
+        if(idx_hdr.fileGuid != file_hdr.fileGuid || covered < 1 || covered > in_file_count)
+        {
+            print_msg(MSG_INFO, "XREF table does not match the input files, rebuilding\n");
+            covered = 0;
+        }
+
+        for(uint32_t entry = 0; covered && entry < block_xref->entryCount; entry++)
+        {
+            if(xrefs[entry].fileNumber >= covered)
+            {
+                print_msg(MSG_INFO, "XREF table has invalid entries, rebuilding\n");
+                covered = 0;
+            }
+        }
+    }
+
+    if(covered == in_file_count)
+    {
+        print_msg(MSG_INFO, "XREF table is up to date (%d entries, %d chunks)\n", block_xref->entryCount, covered);
+        free(block_xref);
+        return 0;
+    }
+
+    mlv_index_init(&index);
+
+    for(int file_num = covered; file_num < in_file_count; file_num++)
+    {
+        if(index_chunk(&index, in_files[file_num], in_map, file_num))
+        {
+            mlv_index_free(&index);
+            free(block_xref);
+            return ERR_FILE;
+        }
+    }
+
+    print_msg(MSG_INFO, "Indexed %d new blocks in %d chunk%s\n", index.count, in_file_count - covered, (in_file_count - covered == 1) ? "" : "s");
+
+    int ret = 0;
+    if(covered)
+    {
+        ret = mlv_index_merge_saved(&index, xrefs, block_xref->entryCount, xref_block_time, in_files);
+    }
+    else
+    {
+        ret = mlv_index_sort(&index);
+    }
+    free(block_xref);
+
+    if(ret)
+    {
+        print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+        mlv_index_free(&index);
+        return ERR_MALLOC;
+    }
+
+    print_msg(MSG_INFO, "XREF table contains %d entries\n", index.count);
+    save_index(input_filename, &file_hdr, in_file_count, index.entries, index.count);
+    mlv_index_free(&index);
+
+    return 0;
+}
+
+void show_usage(char *executable)
+{
+    print_msg(MSG_INFO, "Usage: %s [options] <inputfile>\n", executable);
+    print_msg(MSG_INFO, "Parameters:\n");
+    print_msg(MSG_INFO, "  -o output_file      write video data into a MLV file\n");
+    print_msg(MSG_INFO, "  -v                  verbose output\n");
+    print_msg(MSG_INFO, "  --version           print version information\n");
+    print_msg(MSG_INFO, "  --batch             format output message suitable for batch processing\n");
+    print_msg(MSG_INFO, "  --relaxed           do not exit on every error, skip blocks that are erroneous\n");
+    print_msg(MSG_INFO, "  --no-audio          for DNG output WAV not saved, for MLV output WAVI/AUDF blocks are not included in destination MLV\n");
+    print_msg(MSG_INFO, "  --no-mmap           read input files instead of memory mapping them\n");
+    
+    print_msg(MSG_INFO, "\n");
+    print_msg(MSG_INFO, "-- DNG output --\n");
+    print_msg(MSG_INFO, "  --dng               output frames into separate .dng files. set prefix with -o\n");
+    print_msg(MSG_INFO, "  --no-cs             no chroma smoothing (default)\n");
+    print_msg(MSG_INFO, "  --cs2x2             2x2 chroma smoothing\n");
+    print_msg(MSG_INFO, "  --cs3x3             3x3 chroma smoothing\n");
+    print_msg(MSG_INFO, "  --cs5x5             5x5 chroma smoothing\n");
+    print_msg(MSG_INFO, "  --cs-impl=name      chroma smoothing implementation: scalar, sse2 or avx2 (default: best supported by this CPU)\n");
+    print_msg(MSG_INFO, "  --no-fixfp          do not fix focus pixels\n");
+    print_msg(MSG_INFO, "  --no-fixcp          do not fix bad pixels\n");
+    print_msg(MSG_INFO, "  --fixcp2            use aggressive method for revealing more bad pixels\n");
+    print_msg(MSG_INFO, "  --no-stripes        do not fix vertical stripes in highlights\n");
+    print_msg(MSG_INFO, "  --force-stripes     compute stripe correction for every frame\n");
+    print_msg(MSG_INFO, "  --is-dualiso        use dual iso compatible horizontal interpolation of focus and bad pixels\n");
+    print_msg(MSG_INFO, "  --is-croprec        generate focus map for crop_rec mode\n");
+    print_msg(MSG_INFO, "  --save-bpm          save bad pixels to .BPM file\n");
+    print_msg(MSG_INFO, "  --fixpn             fix pattern noise\n");
+    print_msg(MSG_INFO, "  --stats-cache       reuse stripe and pattern noise statistics from the .rpc file of earlier exports, and update it\n");
+    print_msg(MSG_INFO, "  --stats-interval=N  compute stripe (with --force-stripes) and pattern noise statistics every N frames only\n");
+    print_msg(MSG_INFO, "  --deflicker=value   per-frame exposure compensation. value is target median in raw units ex: 3072 (default)\n");
+    print_msg(MSG_INFO, "  --no-bitpack        write DNG files with unpacked to 16 bit raw data\n");
+    print_msg(MSG_INFO, "  --show-progress     show DNG file creation progress. ignored when -v or --batch is specified\n");
+    print_msg(MSG_INFO, "                      also works when compressing MLV to MLV and shows compression ratio for each frame\n");
+    print_msg(MSG_INFO, "  --fpi <method>      focus pixel interpolation method: 0 (mlvfs), 1 (raw2dng), default is 0\n");
+    print_msg(MSG_INFO, "  --bpi <method>      bad pixel interpolation method: 0 (mlvfs), 1 (raw2dng), default is 0\n");
+    print_msg(MSG_INFO, "  --threads=N         decode and process frames on N threads, written in order. if no N given, use all CPUs\n");
+    print_msg(MSG_INFO, "                      also compresses frames with -c into a MLV on N threads\n");
+
+    print_msg(MSG_INFO, "\n");
+    print_msg(MSG_INFO, "-- RAW output --\n");
+    print_msg(MSG_INFO, "  -r                  output into a legacy raw file for e.g. raw2dng\n");
+
+    print_msg(MSG_INFO, "\n");
+    print_msg(MSG_INFO, "-- MLV output --\n");
+    print_msg(MSG_INFO, "  -b bits             convert image data to given bit depth per channel (1-16)\n");
+    print_msg(MSG_INFO, "  -z bits             zero the lowest bits, so we have only specified number of bits containing data (1-16) (improves compression rate)\n");
+    print_msg(MSG_INFO, "  -f frames           frames to save. e.g. '12' saves frames 0 to 12, '12-40' saves frames 12 to 40\n");
     print_msg(MSG_INFO, "  -A fpsx1000         Alter the video file's FPS metadata\n");
     print_msg(MSG_INFO, "  -x                  build xref file (indexing)\n");
+    print_msg(MSG_INFO, "  --xref-update       update xref file, only index chunks added since it was built\n");
 
     print_msg(MSG_INFO, "\n");
     print_msg(MSG_INFO, "-- MLV autopsy --\n");
@@ -986,6 +1022,10 @@ void show_usage(char *executable)
     print_msg(MSG_INFO, "  -a                  average all frames in <inputfile> and output a single-frame MLV from it\n");
     print_msg(MSG_INFO, "  --avg-vertical      [DARKFRAME ONLY] average the resulting frame in vertical direction, so we will extract vertical banding\n");
     print_msg(MSG_INFO, "  --avg-horizontal    [DARKFRAME ONLY] average the resulting frame in horizontal direction, so we will extract horizontal banding\n");
+    print_msg(MSG_INFO, "  --stack=method      how -a combines the frames: 'mean' (default), 'median' or 'sigma' (mean after sigma clipping)\n");
+    print_msg(MSG_INFO, "  --sigma=k           reject values more than k standard deviations from the mean with --stack=sigma (default 3)\n");
+    print_msg(MSG_INFO, "  --stack-mem=MB      memory used by --stack=median/sigma, frames are spooled to a temporary file (default 256)\n");
+    print_msg(MSG_INFO, "  --stack-dir=DIR     put that file into DIR instead of next to the output file\n");
     print_msg(MSG_INFO, "  -s mlv_file         subtract the reference frame in given file from every single frame during processing\n");
     print_msg(MSG_INFO, "  -t mlv_file         use the reference frame in given file as flat field (gain correction)\n");
 
@@ -998,6 +1038,13 @@ void show_usage(char *executable)
 
 #if defined(MLV_USE_LZMA) || defined(MLV_USE_LJ92)
     print_msg(MSG_INFO, "  -c                  compress video frames using LJ92. if input is lossless, then decompress and recompress again.\n");
+    print_msg(MSG_INFO, "  --reuse-huff=N      with -c into a MLV, build the LJ92 Huffman table only every N frames and use it\n");
+    print_msg(MSG_INFO, "                      for the frames in between. faster, but files get slightly larger\n");
+#if defined(MLV_USE_LZMA)
+    print_msg(MSG_INFO, "  --lzma[=level]      like -c, but compress the frames of a MLV with LZMA (level 0-9, default 5) for archiving.\n");
+    print_msg(MSG_INFO, "                      slower than LJ92, but smaller. use --threads to compress several frames at once\n");
+    print_msg(MSG_INFO, "                      with -c or --lzma into a .MLV, its .IDX is written in the same pass\n");
+#endif
     print_msg(MSG_INFO, "  -d                  decompress compressed video and audio frames using LZMA or LJ92\n");
 #else
     print_msg(MSG_INFO, "  -c, -d              NOT AVAILABLE: compression support was not compiled into this release\n");
@@ -1240,6 +1287,586 @@ static void fix_black_white_level(int32_t * black_level, int32_t * white_level,
 }
 
 
+/* returns a monotonic-enough wall clock in seconds for the throughput statistics */
+static double get_time_sec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* settings shared by all DNG jobs of the threaded pipeline, constant while it runs */
+struct dng_pipeline_ctx
+{
+    int compressed_lj92;
+    int compressed_lzma;
+    int run_decompressor;
+    int run_compressor;
+    int bit_depth;
+    int bit_zap;
+    int relaxed;
+    int verbose;
+
+    /* only accessed by the writer thread */
+    uint32_t frames_written;
+};
+
+/* one VIDF handed from the reading loop to the DNG worker threads */
+struct dng_job
+{
+    struct frame_info frame_info;
+    struct dng_data dng_data;
+    char info_str[1024];
+
+    /* copy of the VIDF payload, decompressed/converted in place */
+    uint8_t *frame_buffer;
+    uint32_t frame_buffer_size;
+    int read_size;
+    int frame_size;
+
+    int xRes;
+    int yRes;
+    int bpp;
+
+    /* LJ92 data when compressing with -c */
+    uint8_t *compressed;
+
+    /* frame was corrupt and is skipped in --relaxed mode */
+    int skip;
+};
+
+static void dng_job_free(struct dng_job *job)
+{
+    /* if dng_write() failed, it didn't restore the original image buffer */
+    job->dng_data.image_buf = job->dng_data.image_buf_bak;
+    dng_free_buffers(&job->dng_data);
+
+    free(job->frame_info.dng_filename);
+    free(job->frame_buffer);
+    free(job->compressed);
+    free(job);
+}
+
+/* everything the serial path does with a VIDF up to the file write, executed on a worker thread */
+static int dng_job_work(void *ctx, int UNUSED(worker), void *arg)
+{
+    struct dng_pipeline_ctx *pctx = (struct dng_pipeline_ctx *)ctx;
+    struct dng_job *job = (struct dng_job *)arg;
+    struct frame_info *frame_info = &job->frame_info;
+    struct dng_data *dng_data = &job->dng_data;
+
+    if(pctx->run_decompressor)
+    {
+        int ret = FRAME_OK;
+#ifdef MLV_USE_LJ92
+        if(pctx->compressed_lj92)
+        {
+            ret = frame_decompress_lj92(job->frame_buffer, job->read_size, job->frame_size, job->xRes, job->yRes, job->bpp, 1, pctx->verbose);
+        }
+#endif
+#ifdef MLV_USE_LZMA
+        if(pctx->compressed_lzma)
+        {
+            ret = frame_decompress_lzma(job->frame_buffer, job->read_size, job->frame_size, pctx->verbose);
+        }
+#endif
+        if(ret == FRAME_SKIP && pctx->relaxed)
+        {
+            job->skip = 1;
+            return 0;
+        }
+        if(ret != FRAME_OK)
+        {
+            return ret;
+        }
+    }
+
+    /* now resample bit depth if requested */
+    int current_depth = job->bpp;
+    if(pctx->bit_depth && (pctx->bit_depth != job->bpp))
+    {
+        int new_size = (job->xRes * job->yRes * pctx->bit_depth + 7) / 8;
+        uint8_t *new_buffer = malloc(new_size);
+
+        if(!new_buffer)
+        {
+            return FRAME_ERROR;
+        }
+
+        frame_convert_depth(job->frame_buffer, new_buffer, job->xRes, job->yRes, job->bpp, pctx->bit_depth);
+
+        free(job->frame_buffer);
+        job->frame_buffer = new_buffer;
+        job->frame_buffer_size = new_size;
+        job->frame_size = new_size;
+        current_depth = pctx->bit_depth;
+    }
+
+    if(pctx->bit_zap)
+    {
+        frame_zap_bits(job->frame_buffer, job->xRes, job->yRes, current_depth, pctx->bit_zap);
+    }
+
+    frame_info->frame_buffer = job->frame_buffer;
+    frame_info->frame_buffer_size = job->frame_buffer_size;
+    dng_init_data(frame_info, dng_data);
+    dng_process_data(frame_info, dng_data);
+
+#ifdef MLV_USE_LJ92
+    if(pctx->run_compressor)
+    {
+        /* same 'x2' single component layout as the serial path, see there */
+        int lj92_width = job->xRes * 2;
+        int lj92_height = job->yRes / 2;
+        int compressed_size = 0;
+
+        int ret = lj92_encode(dng_data->image_buf, lj92_width, lj92_height, job->bpp, 2, lj92_width * lj92_height, 0, NULL, 0, &job->compressed, &compressed_size);
+
+        if(ret != LJ92_ERROR_NONE)
+        {
+            print_msg(MSG_ERROR, "    LJ92: Failed (%d)\n", ret);
+            return FRAME_ERROR;
+        }
+
+        dng_data->image_buf = (uint16_t *)job->compressed;
+        dng_data->image_size = compressed_size;
+    }
+#endif
+
+    dng_init_header(frame_info, dng_data);
+    dng_finalize_data(frame_info, dng_data);
+
+    return 0;
+}
+
+/* writes the prepared DNG files in frame order, runs on the pipeline's writer thread */
+static int dng_job_write(void *ctx, void *arg, int error)
+{
+    struct dng_pipeline_ctx *pctx = (struct dng_pipeline_ctx *)ctx;
+    struct dng_job *job = (struct dng_job *)arg;
+    int ret = 0;
+
+    if(!error && !job->skip)
+    {
+        if(dng_write(&job->frame_info, &job->dng_data))
+        {
+            pctx->frames_written++;
+        }
+        else
+        {
+            print_msg(MSG_ERROR, "VIDF: Failed writing into .DNG file\n");
+            if(!pctx->relaxed)
+            {
+                ret = FRAME_ERROR;
+            }
+        }
+    }
+
+    dng_job_free(job);
+    return ret;
+}
+
+#ifdef MLV_USE_LJ92
+/* Huffman table shared by a group of frames with --reuse-huff. the first frame of the group builds it,
+   the others wait until it is published. freed when the last frame of the group was written */
+struct lj92_shared_table
+{
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    lj92_table table;
+    int ready;
+    int users;
+};
+
+static struct lj92_shared_table *lj92_shared_table_create()
+{
+    struct lj92_shared_table *shared = calloc(1, sizeof(struct lj92_shared_table));
+
+    if(shared)
+    {
+        pthread_mutex_init(&shared->lock, NULL);
+        pthread_cond_init(&shared->published, NULL);
+        shared->users = 1;
+    }
+    return shared;
+}
+
+static void lj92_shared_table_get(struct lj92_shared_table *shared)
+{
+    if(shared)
+    {
+        pthread_mutex_lock(&shared->lock);
+        shared->users++;
+        pthread_mutex_unlock(&shared->lock);
+    }
+}
+
+static void lj92_shared_table_put(struct lj92_shared_table *shared)
+{
+    if(!shared)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&shared->lock);
+    int users = --shared->users;
+    pthread_mutex_unlock(&shared->lock);
+
+    if(!users)
+    {
+        lj92_free_table(shared->table);
+        pthread_cond_destroy(&shared->published);
+        pthread_mutex_destroy(&shared->lock);
+        free(shared);
+    }
+}
+
+/* only the first call counts. NULL tells the waiting frames to make their own tables */
+static void lj92_shared_table_publish(struct lj92_shared_table *shared, lj92_table table)
+{
+    pthread_mutex_lock(&shared->lock);
+    if(!shared->ready)
+    {
+        shared->table = table;
+        shared->ready = 1;
+        pthread_cond_broadcast(&shared->published);
+    }
+    else
+    {
+        lj92_free_table(table);
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+static lj92_table lj92_shared_table_wait(struct lj92_shared_table *shared)
+{
+    pthread_mutex_lock(&shared->lock);
+    while(!shared->ready)
+    {
+        pthread_cond_wait(&shared->published, &shared->lock);
+    }
+    lj92_table table = shared->table;
+    pthread_mutex_unlock(&shared->lock);
+
+    return table;
+}
+
+/* returns the --reuse-huff group of the next frame with a reference for it, or NULL if tables are not reused.
+   every 'reuse_huff' frames a new group is started, its first frame becomes the 'owner' that builds the table.
+   groups only depend on the frame order, so serial and threaded compression write the same data */
+static struct lj92_shared_table *lj92_shared_table_next(struct lj92_shared_table **group, uint32_t *frames, int reuse_huff, int *owner)
+{
+    *owner = 0;
+
+    if(reuse_huff < 2)
+    {
+        return NULL;
+    }
+
+    if(!(*frames % reuse_huff))
+    {
+        lj92_shared_table_put(*group);
+        *group = lj92_shared_table_create();
+        *owner = 1;
+    }
+    (*frames)++;
+
+    lj92_shared_table_get(*group);
+    return *group;
+}
+
+/* compresses a frame unpacked to 16 bit, using the 'x2' layout described in the serial path.
+   with a shared table, the owner builds it from this frame and the others use it */
+static int frame_compress_lj92(uint16_t *image, int xRes, int yRes, int bpp, struct lj92_shared_table *shared, int owner, uint8_t **compressed, int *compressed_size)
+{
+    int lj92_width = xRes * 2;
+    int lj92_height = yRes / 2;
+    lj92_table table = NULL;
+
+    if(shared)
+    {
+        if(owner)
+        {
+            lj92_table new_table = NULL;
+
+            if(lj92_encode_table(image, lj92_width, lj92_height, bpp, lj92_width * lj92_height, 0, NULL, 0, &new_table) != LJ92_ERROR_NONE)
+            {
+                new_table = NULL;
+            }
+            lj92_shared_table_publish(shared, new_table);
+        }
+        table = lj92_shared_table_wait(shared);
+    }
+
+    return lj92_encode_with_table(image, lj92_width, lj92_height, bpp, 2, lj92_width * lj92_height, 0, NULL, 0, table, compressed, compressed_size);
+}
+
+/* compression statistics for -c */
+struct lj92_stats
+{
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    double encode_time;
+    uint32_t frames;
+    uint32_t reserved;
+};
+
+static void lj92_stats_add(struct lj92_stats *stats, int frame_size, int compressed_size, double encode_time, int show_progress)
+{
+    stats->bytes_in += frame_size;
+    stats->bytes_out += compressed_size;
+    stats->encode_time += encode_time;
+    stats->frames++;
+
+    if(show_progress)
+    {
+        static int first_time = 1;
+        if(first_time)
+        {
+            print_msg(MSG_INFO, "\nWriting LJ92 compressed frames...\n");
+            first_time = 0;
+        }
+        print_msg(MSG_INFO, "  saving: %d -> %d  (%2.2f%% ratio, %2.2f MB/s)\n", frame_size, compressed_size, ((float)compressed_size * 100.0f) / (float)frame_size, encode_time > 0 ? frame_size / encode_time / 1000000.0 : 0.0);
+    }
+}
+
+/* settings shared by all jobs of the threaded MLV compressor, constant while it runs */
+struct lj92_pipeline_ctx
+{
+    FILE *out_file;
+    int compressed_lj92;
+    int compressed_lzma;
+    int bit_zap;
+    int relaxed;
+    int verbose;
+    int show_progress;
+
+    /* compress with LZMA at this level instead of LJ92 if >= 0 */
+    int lzma_level;
+    int reserved;
+
+    /* only accessed by the writer thread */
+    struct lj92_stats stats;
+
+    /* XREF of the output file, if it is built while writing */
+    mlv_index_t *out_index;
+};
+
+/* one block for the output MLV, handed from the reading loop to the compressor threads.
+   VIDFs are compressed, all other blocks are only written, so they stay in order with the frames */
+struct lj92_job
+{
+    /* VIDF payload or the whole block */
+    uint8_t *data;
+    uint8_t *compressed;
+
+    /* --reuse-huff group of this frame */
+    struct lj92_shared_table *table;
+    double encode_time;
+
+    mlv_vidf_hdr_t vidf_hdr;
+    uint32_t data_size;
+    int is_frame;
+    int table_owner;
+    int read_size;
+    int frame_size;
+    int compressed_size;
+    int xRes;
+    int yRes;
+    int bpp;
+
+    /* frame was corrupt and is skipped in --relaxed mode */
+    int skip;
+};
+
+static void lj92_job_free(struct lj92_job *job)
+{
+    lj92_shared_table_put(job->table);
+    free(job->data);
+    free(job->compressed);
+    free(job);
+}
+
+/* what the serial path does with a VIDF when compressing into a MLV, executed on a worker thread */
+static int lj92_job_compress(struct lj92_pipeline_ctx *pctx, struct lj92_job *job)
+{
+    int ret = FRAME_OK;
+
+    if(pctx->compressed_lj92)
+    {
+        ret = frame_decompress_lj92(job->data, job->read_size, job->frame_size, job->xRes, job->yRes, job->bpp, 1, pctx->verbose);
+    }
+    if(pctx->compressed_lzma)
+    {
+#ifdef MLV_USE_LZMA
+        ret = frame_decompress_lzma(job->data, job->read_size, job->frame_size, pctx->verbose);
+#else
+        print_msg(MSG_INFO, "    LZMA: not compiled into this release, aborting.\n");
+        ret = FRAME_ERROR;
+#endif
+    }
+    if(ret != FRAME_OK)
+    {
+        return ret;
+    }
+
+    if(pctx->bit_zap)
+    {
+        frame_zap_bits(job->data, job->xRes, job->yRes, job->bpp, pctx->bit_zap);
+    }
+
+    double start = get_time_sec();
+
+    if(pctx->lzma_level >= 0)
+    {
+#ifdef MLV_USE_LZMA
+        /* LZMA works on the packed bits as they are */
+        ret = frame_compress_lzma(job->data, job->frame_size, pctx->lzma_level, &job->compressed, &job->compressed_size);
+        job->encode_time = get_time_sec() - start;
+        return ret;
+#else
+        return FRAME_ERROR;
+#endif
+    }
+
+    uint16_t *image = malloc(job->xRes * job->yRes * sizeof(uint16_t));
+
+    if(!image)
+    {
+        return FRAME_ERROR;
+    }
+
+    int pitch = job->xRes * job->bpp / 8;
+    for(int y = 0; y < job->yRes; y++)
+    {
+        bitpack_unpack((uint16_t *)&job->data[y * pitch], &image[y * job->xRes], job->xRes, job->bpp);
+    }
+
+    ret = frame_compress_lj92(image, job->xRes, job->yRes, job->bpp, job->table, job->table_owner, &job->compressed, &job->compressed_size);
+    free(image);
+
+    if(ret != LJ92_ERROR_NONE)
+    {
+        print_msg(MSG_ERROR, "    LJ92: Failed (%d)\n", ret);
+        return FRAME_ERROR;
+    }
+
+    job->encode_time = get_time_sec() - start;
+    return FRAME_OK;
+}
+
+static int lj92_job_work(void *ctx, int UNUSED(worker), void *arg)
+{
+    struct lj92_pipeline_ctx *pctx = (struct lj92_pipeline_ctx *)ctx;
+    struct lj92_job *job = (struct lj92_job *)arg;
+
+    if(!job->is_frame)
+    {
+        return 0;
+    }
+
+    int ret = lj92_job_compress(pctx, job);
+
+    /* the rest of the group is waiting for the table, let them make their own if this frame failed */
+    if(job->table_owner)
+    {
+        lj92_shared_table_publish(job->table, NULL);
+    }
+
+    if(ret == FRAME_SKIP && pctx->relaxed)
+    {
+        job->skip = 1;
+        return 0;
+    }
+    return (ret != FRAME_OK) ? ret : 0;
+}
+#endif
+
+/* remember where a block of the output MLV starts, so its XREF can be saved without reading the file again.
+   'out_index' is NULL when no XREF is built */
+static int out_index_add(mlv_index_t *out_index, FILE *out_file, const void *hdr)
+{
+    if(out_index && mlv_index_add_block(out_index, (mlv_hdr_t *)hdr, file_get_pos(out_file), 0))
+    {
+        print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+        return 0;
+    }
+    return 1;
+}
+
+#ifdef MLV_USE_LJ92
+/* writes the blocks in file order, runs on the pipeline's writer thread */
+static int lj92_job_write(void *ctx, void *arg, int error)
+{
+    struct lj92_pipeline_ctx *pctx = (struct lj92_pipeline_ctx *)ctx;
+    struct lj92_job *job = (struct lj92_job *)arg;
+    int ret = 0;
+
+    if(!error && !job->skip)
+    {
+        if(job->is_frame)
+        {
+            /* delete free space and correct header size */
+            job->vidf_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + job->compressed_size;
+            job->vidf_hdr.frameSpace = 0;
+
+            if(!out_index_add(pctx->out_index, pctx->out_file, &job->vidf_hdr))
+            {
+                ret = FRAME_ERROR;
+            }
+            else if(fwrite(&job->vidf_hdr, sizeof(mlv_vidf_hdr_t), 1, pctx->out_file) != 1 || fwrite(job->compressed, job->compressed_size, 1, pctx->out_file) != 1)
+            {
+                print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
+                ret = FRAME_ERROR;
+            }
+            else
+            {
+                if(pctx->verbose)
+                {
+                    print_msg(MSG_INFO, "    %s: %d -> %d  (%2.2f%% ratio)\n", (pctx->lzma_level >= 0) ? "LZMA" : "LJ92", job->frame_size, job->compressed_size, ((float)job->compressed_size * 100.0f) / (float)job->frame_size);
+                }
+                lj92_stats_add(&pctx->stats, job->frame_size, job->compressed_size, job->encode_time, pctx->show_progress && !pctx->verbose);
+            }
+        }
+        else if(!out_index_add(pctx->out_index, pctx->out_file, job->data))
+        {
+            ret = FRAME_ERROR;
+        }
+        else if(fwrite(job->data, job->data_size, 1, pctx->out_file) != 1)
+        {
+            print_msg(MSG_ERROR, "Failed writing into .MLV file\n");
+            ret = FRAME_ERROR;
+        }
+    }
+
+    lj92_job_free(job);
+    return ret;
+}
+#endif
+
+/* writes a block into the output MLV. while frames are compressed on threads, it is queued behind them */
+static int write_mlv_block(pipeline_t *pipeline, FILE *out_file, mlv_index_t *out_index, const void *data, uint32_t size)
+{
+#ifdef MLV_USE_LJ92
+    if(pipeline)
+    {
+        struct lj92_job *job = calloc(1, sizeof(struct lj92_job));
+
+        if(!job || !(job->data = malloc(size)))
+        {
+            print_msg(MSG_ERROR, "Failed to allocate %d byte\n", size);
+            free(job);
+            return 0;
+        }
+        memcpy(job->data, data, size);
+        job->data_size = size;
+
+        return !pipeline_submit(pipeline, job);
+    }
+#endif
+    return out_index_add(out_index, out_file, data) && fwrite(data, size, 1, out_file) == 1;
+}
+
 int main (int argc, char *argv[])
 {
     char *input_filename = NULL;
@@ -1266,10 +1893,15 @@ int main (int argc, char *argv[])
     int average_hor = 0;
     int subtract_mode = 0;
     int flatfield_mode = 0;
-    int average_samples = 0;
+    int stack_method = CALIB_MEAN;
+    double stack_sigma = 3.0;
+    int stack_memory = 256;
+    char *stack_dir = NULL;
     int relaxed = 0;
     int visualize = 0;
     int skip_xref = 0;
+    int xref_update = 0;
+    int no_mmap = 0;
 
     int mlv_output = 0;
     int raw_output = 0;
@@ -1299,6 +1931,8 @@ int main (int argc, char *argv[])
     int is_dual_iso = 0;
     int save_bpm_file = 0;
     int fix_pattern_noise = 0;
+    int stats_cache = 0;
+    int stats_interval = 1;
     int deflicker_target = 0;
     int show_progress = 0;
     int pack_dng_bits = 1;
@@ -1306,10 +1940,34 @@ int main (int argc, char *argv[])
     int fpi_method = 0; // default is 'mlvfs'
     int bpi_method = 0; // default is 'mlvfs'
     int crop_rec = 0;
+    int dng_threads = 1;
+    int chroma_smooth_isa = chroma_smooth_best_isa();
     
     /* helper structs for DNG exporting */
     struct frame_info frame_info = { 0 };
     struct dng_data dng_data = { 0, 0, 0, 0, NULL, NULL, NULL, NULL };
+
+    /* threaded DNG export, set up after the first frame went through the serial path */
+    pipeline_t *dng_pipeline = NULL;
+    struct dng_pipeline_ctx dng_pipeline_ctx = { 0 };
+    uint32_t dng_frames_written = 0;
+    double start_time = 0;
+
+    /* threaded compression into MLV with -c, set up at the first frame */
+    pipeline_t *lj92_pipeline = NULL;
+    int compress_threads = 1;
+    int reuse_huff = 0;
+    /* --lzma: compress MLV output with LZMA at this level instead of LJ92 */
+    int lzma_level = -1;
+    /* XREF of the output file when compressing into a MLV, saved along with it */
+    mlv_index_t out_xref = { 0 };
+    mlv_index_t *out_index = NULL;
+#ifdef MLV_USE_LJ92
+    struct lj92_pipeline_ctx lj92_pipeline_ctx = { 0 };
+    struct lj92_stats lj92_stats = { 0 };
+    struct lj92_shared_table *lj92_group = NULL;
+    uint32_t lj92_group_frames = 0;
+#endif
     
     enum bug_id fix_bug = BUG_ID_NONE;
     
@@ -1365,28 +2023,40 @@ int main (int argc, char *argv[])
         {"cs2x2",  no_argument, &chroma_smooth_method,  2 },
         {"cs3x3",  no_argument, &chroma_smooth_method,  3 },
         {"cs5x5",  no_argument, &chroma_smooth_method,  5 },
+        {"cs-impl",  required_argument, NULL,  'C' },
         {"no-fixfp",  no_argument, &fix_focus_pixels,  0 },
         {"no-fixcp",  no_argument, &fix_cold_pixels,  0 },
         {"fixcp2",    no_argument, &fix_cold_pixels,  2 },
         {"no-stripes",  no_argument, &fix_vert_stripes,  0 },
         {"avg-vertical",  no_argument, &average_vert,  1 },
         {"avg-horizontal",  no_argument, &average_hor,  1 },
+        {"stack",   required_argument, NULL,  'G' },
+        {"sigma",   required_argument, NULL,  'Q' },
+        {"stack-mem", required_argument, NULL,  'R' },
+        {"stack-dir", required_argument, NULL,  'O' },
         {"is-dualiso",    no_argument, &is_dual_iso,  1 },
         {"is-croprec",    no_argument, &crop_rec,  1 },
         {"save-bpm",    no_argument, &save_bpm_file,  1 },
         {"force-stripes",  no_argument, &fix_vert_stripes,  2 },
         {"fixpn",  no_argument, &fix_pattern_noise,  1 },
+        {"stats-cache",  no_argument, &stats_cache,  1 },
+        {"stats-interval",  required_argument, NULL,  'K' },
         {"deflicker",  optional_argument, NULL,  'D' },
         {"show-progress",  no_argument, &show_progress,  1 },
         {"no-bitpack",  no_argument, &pack_dng_bits,  0 },
         {"no-audio",  no_argument, &no_audio,  1 },
         {"fpi",     required_argument, NULL,  'i' },
         {"bpi",     required_argument, NULL,  'j' },
+        {"threads", optional_argument, NULL,  'N' },
+        {"reuse-huff", required_argument, NULL,  'H' },
+        {"lzma",    optional_argument, NULL,  'M' },
+        {"no-mmap", no_argument, &no_mmap,  1 },
         
         /* MLV autopsy */
         {"relaxed",       no_argument, &relaxed,  1 },
         {"visualize",     no_argument, &visualize,  1 },
         {"skip-xref",     no_argument, &skip_xref,  1 },
+        {"xref-update",   no_argument, &xref_update,  1 },
         {"hex",           no_argument, &autopsy_dump,  AUTOPSY_DUMP_HEX },
         {"ascii",         no_argument, &autopsy_dump,  AUTOPSY_DUMP_ASCII },
         {"skip-type",     required_argument, NULL,  'T' },
@@ -1517,35 +2187,17 @@ int main (int argc, char *argv[])
                 break;
                 
             case 'L':
-#ifdef USE_LUA
                 if(!optarg)
                 {
                     print_msg(MSG_ERROR, "Error: Missing LUA script filename\n");
                     return ERR_PARAM;
                 }
-                lua_state = luaL_newstate();
+                lua_state = mlv_lua_init(optarg);
                 if(!lua_state)
                 {
-                    print_msg(MSG_ERROR, "LUA: Failed to init LUA library\n");
                     return ERR_PARAM;
                 }
-
-                luaL_openlibs(lua_state);
-
-                if(luaL_loadfile(lua_state, optarg) != 0 || lua_pcall(lua_state, 0, 0, 0) != 0)
-                {
-                    print_msg(MSG_ERROR, "LUA: Failed to load script\n");
-                }
-
-                if(lua_call_va(lua_state, "init", "", 0) != 0)
-                {
-                    print_msg(MSG_ERROR, "LUA: Failed to call 'init' in script\n");
-                }
                 break;
-#else
-                print_msg(MSG_ERROR, "LUA support not compiled into this binary\n");
-                return ERR_PARAM;
-#endif
 
             case 'x':
                 xref_mode = 1;
@@ -1643,45 +2295,137 @@ int main (int argc, char *argv[])
             case 'o':
                 if(!optarg)
                 {
-                    print_msg(MSG_ERROR, "Error: Missing output filename\n");
+                    print_msg(MSG_ERROR, "Error: Missing output filename\n");
+                    return ERR_PARAM;
+                }
+                output_filename = strdup(optarg);
+                break;
+
+            case 'f':
+                {
+                    extract_frames = 1;
+
+                    char *dash = strchr(optarg, '-');
+
+                    /* try to parse "1-10" */
+                    if(dash)
+                    {
+                        *dash = '\000';
+                        frame_start = atoi(optarg);
+                        frame_end = atoi(&dash[1]);
+
+                        /* to makse sure it is a valid range */
+                        if(frame_start > frame_end)
+                        {
+                            frame_end = frame_start;
+                        }
+                    }
+                    else
+                    {
+                        /* only the frame end is specified */
+                        frame_end = MAX(0, atoi(optarg));
+                    }
+                }
+                break;
+
+            case 'i':
+                fpi_method = MIN(1, MAX(0, atoi(optarg)));
+                break;
+
+            case 'j':
+                bpi_method = MIN(1, MAX(0, atoi(optarg)));
+                break;
+
+            case 'N':
+                if(!optarg)
+                {
+                    dng_threads = pipeline_cpu_count();
+                }
+                else
+                {
+                    dng_threads = MIN(256, MAX(1, atoi(optarg)));
+                }
+                break;
+
+            case 'H':
+                reuse_huff = MAX(0, atoi(optarg));
+                break;
+
+            case 'M':
+#if defined(MLV_USE_LJ92) && defined(MLV_USE_LZMA)
+                compress_output = (!pass_through) ? 1 : 0;
+                lzma_level = optarg ? MIN(9, MAX(0, atoi(optarg))) : 5;
+#else
+                print_msg(MSG_ERROR, "Error: Compression support was not compiled into this release\n");
+                return ERR_PARAM;
+#endif
+                break;
+
+            case 'K':
+                stats_interval = MAX(1, atoi(optarg));
+                break;
+
+            case 'G':
+                if(!strcasecmp(optarg, "mean"))
+                {
+                    stack_method = CALIB_MEAN;
+                }
+                else if(!strcasecmp(optarg, "median"))
+                {
+                    stack_method = CALIB_MEDIAN;
+                }
+                else if(!strcasecmp(optarg, "sigma"))
+                {
+                    stack_method = CALIB_SIGMA_CLIP;
+                }
+                else
+                {
+                    print_msg(MSG_ERROR, "Error: unknown stacking method '%s'\n", optarg);
                     return ERR_PARAM;
                 }
-                output_filename = strdup(optarg);
                 break;
 
-            case 'f':
+            case 'Q':
+                stack_sigma = atof(optarg);
+                if(stack_sigma <= 0)
                 {
-                    extract_frames = 1;
-
-                    char *dash = strchr(optarg, '-');
-
-                    /* try to parse "1-10" */
-                    if(dash)
-                    {
-                        *dash = '\000';
-                        frame_start = atoi(optarg);
-                        frame_end = atoi(&dash[1]);
-
-                        /* to makse sure it is a valid range */
-                        if(frame_start > frame_end)
-                        {
-                            frame_end = frame_start;
-                        }
-                    }
-                    else
-                    {
-                        /* only the frame end is specified */
-                        frame_end = MAX(0, atoi(optarg));
-                    }
+                    print_msg(MSG_ERROR, "Error: --sigma must be positive\n");
+                    return ERR_PARAM;
                 }
                 break;
 
-            case 'i':
-                fpi_method = MIN(1, MAX(0, atoi(optarg)));
+            case 'R':
+                stack_memory = MAX(1, atoi(optarg));
                 break;
 
-            case 'j':
-                bpi_method = MIN(1, MAX(0, atoi(optarg)));
+            case 'O':
+                stack_dir = optarg;
+                break;
+
+            case 'C':
+                if(!strcasecmp(optarg, "scalar"))
+                {
+                    chroma_smooth_isa = CHROMA_SMOOTH_SCALAR;
+                }
+                else if(!strcasecmp(optarg, "sse2"))
+                {
+                    chroma_smooth_isa = CHROMA_SMOOTH_SSE2;
+                }
+                else if(!strcasecmp(optarg, "avx2"))
+                {
+                    chroma_smooth_isa = CHROMA_SMOOTH_AVX2;
+                }
+                else
+                {
+                    print_msg(MSG_ERROR, "Error: unknown chroma smoothing implementation '%s'\n", optarg);
+                    return ERR_PARAM;
+                }
+
+                if(!chroma_smooth_isa_supported(chroma_smooth_isa))
+                {
+                    print_msg(MSG_INFO, "Chroma smoothing: %s not supported by this CPU, using scalar code\n", chroma_smooth_isa_name(chroma_smooth_isa));
+                    chroma_smooth_isa = CHROMA_SMOOTH_SCALAR;
+                }
                 break;
 
             case 'b':
@@ -1771,6 +2515,16 @@ int main (int argc, char *argv[])
         if(compress_output) 
         {
             print_msg(MSG_INFO, "   - Compress frames written into DNG (slow)\n");
+            if(lzma_level >= 0)
+            {
+                print_msg(MSG_INFO, "   - WARNING: DNG does not support LZMA, using LJ92\n");
+                lzma_level = -1;
+            }
+            if(reuse_huff)
+            {
+                print_msg(MSG_INFO, "   - WARNING: Ignoring --reuse-huff, only used for MLV output\n");
+                reuse_huff = 0;
+            }
             if(bit_depth)
             {
                 /* ignore "-b" switch */
@@ -1825,6 +2579,44 @@ int main (int argc, char *argv[])
             delta_encode_mode = 0;
             mlv_output = 0;
             raw_output = 0;
+
+            if(dng_threads > 1)
+            {
+                /* these modes depend on frame-by-frame processing in file order */
+                const char *serial_reason = NULL;
+
+                if(mlv_lua_wants_frames(lua_state))
+                {
+                    serial_reason = "Lua scripts";
+                }
+                else if(pass_through)
+                {
+                    serial_reason = "-p";
+                }
+                else if(subtract_mode || flatfield_mode || average_mode)
+                {
+                    serial_reason = "-s, -t and -a";
+                }
+                else if(fix_vert_stripes == 2)
+                {
+                    serial_reason = "--force-stripes";
+                }
+                else if(stats_interval > 1 && fix_pattern_noise)
+                {
+                    /* sample frames must be processed before the frames that reuse their statistics */
+                    serial_reason = "--stats-interval";
+                }
+
+                if(serial_reason)
+                {
+                    print_msg(MSG_INFO, "   - WARNING: %s not supported with --threads, processing frames serially\n", serial_reason);
+                    dng_threads = 1;
+                }
+                else
+                {
+                    print_msg(MSG_INFO, "   - Process DNG frames on %d threads\n", dng_threads);
+                }
+            }
         }
         else if(raw_output)
         {
@@ -1861,11 +2653,82 @@ int main (int argc, char *argv[])
             }
             if(compress_output)
             {
-                print_msg(MSG_INFO, "   - Compress frame data\n");
+                if(lzma_level >= 0)
+                {
+                    print_msg(MSG_INFO, "   - Compress frame data using LZMA level %d\n", lzma_level);
+                    if(reuse_huff)
+                    {
+                        print_msg(MSG_INFO, "   - WARNING: Ignoring --reuse-huff, only used for LJ92\n");
+                        reuse_huff = 0;
+                    }
+                }
+                else
+                {
+                    print_msg(MSG_INFO, "   - Compress frame data\n");
+                }
+
+                if(reuse_huff > 1)
+                {
+                    print_msg(MSG_INFO, "   - Build Huffman tables every %d frames\n", reuse_huff);
+                }
+
+                if(dng_threads > 1)
+                {
+                    /* these modes depend on frame-by-frame processing in file order or write on their own */
+                    const char *serial_reason = NULL;
+
+                    if(mlv_lua_wants_frames(lua_state))
+                    {
+                        serial_reason = "Lua scripts";
+                    }
+                    else if(subtract_mode || flatfield_mode || average_mode)
+                    {
+                        serial_reason = "-s, -t and -a";
+                    }
+                    else if(delta_encode_mode || bit_depth)
+                    {
+                        serial_reason = "-e and -b";
+                    }
+                    else if(extract_block || autopsy_mode != AUTOPSY_OFF)
+                    {
+                        serial_reason = "block extraction and manipulation";
+                    }
+
+                    if(serial_reason)
+                    {
+                        print_msg(MSG_INFO, "   - WARNING: %s not supported with --threads, compressing frames serially\n", serial_reason);
+                    }
+                    else
+                    {
+                        print_msg(MSG_INFO, "   - Compress frames on %d threads\n", dng_threads);
+                        compress_threads = dng_threads;
+                    }
+                }
+
+                /* blocks are written in their final order, so the XREF of the output can be collected on the way.
+                   the .IDX name is derived from the .MLV extension like -x does */
+                char *dot = output_filename ? strrchr(output_filename, '.') : NULL;
+                if(dot && !strcasecmp(dot, ".mlv") && !extract_block && !inject_filename && !average_mode && autopsy_mode == AUTOPSY_OFF)
+                {
+                    print_msg(MSG_INFO, "   - Write XREF index of the output\n");
+                    out_index = &out_xref;
+                }
             }
             if(average_mode)
             {
                 print_msg(MSG_INFO, "   - Output only one frame with averaged pixel values\n");
+                if(stack_method == CALIB_MEDIAN)
+                {
+                    print_msg(MSG_INFO, "   - Use the median of each pixel\n");
+                }
+                else if(stack_method == CALIB_SIGMA_CLIP)
+                {
+                    print_msg(MSG_INFO, "   - Reject values more than %.2f standard deviations from the mean\n", stack_sigma);
+                }
+                if(dng_threads > 1)
+                {
+                    print_msg(MSG_INFO, "   - Stack frames on %d threads\n", dng_threads);
+                }
                 if(average_vert)
                 {
                     print_msg(MSG_INFO, "   - Also average the images in vertical direction to extract vertical banding\n");
@@ -1950,7 +2813,9 @@ int main (int argc, char *argv[])
     uint32_t subtract_frame_buffer_size = 0;
     uint32_t flatfield_frame_buffer_size = 0;
 
-    uint32_t *frame_arith_buffer = NULL;
+    struct calib_stack *avg_stack = NULL;
+    struct calib_ref *sub_ref = NULL;
+    struct calib_ref *flat_ref = NULL;
     uint8_t *frame_sub_buffer = NULL;
     uint8_t *frame_flat_buffer = NULL;
     uint8_t *frame_buffer = NULL;
@@ -1960,6 +2825,7 @@ int main (int argc, char *argv[])
     FILE *out_file_wav = NULL;
     FILE **in_files = NULL;
     FILE *in_file = NULL;
+    mlv_map_t *in_map = NULL;
 
     int in_file_count = 0;
     int in_file_num = 0;
@@ -1968,9 +2834,8 @@ int main (int argc, char *argv[])
     uint32_t wav_header_size = 0;
 
     /* this is for our generated XREF table */
-    frame_xref_t *frame_xref_table = NULL;
-    int frame_xref_allocated = 0;
-    int frame_xref_entries = 0;
+    mlv_index_t xref_index;
+    mlv_index_init(&xref_index);
 
     int total_vidf_count = 0;
     int total_audf_count = 0;
@@ -1988,9 +2853,33 @@ int main (int argc, char *argv[])
         in_file = in_files[in_file_num];
     }
 
+    /* hand out blocks straight from a memory mapping of the files, keep reading them if that is not possible */
+    if(!no_mmap)
+    {
+        in_map = mlv_map_open(in_files, in_file_count);
+
+        if(!in_map && verbose)
+        {
+            print_msg(MSG_INFO, "Memory mapping not possible, reading files instead\n");
+        }
+    }
+
+    if(xref_update)
+    {
+        int ret = update_index(input_filename, in_files, in_map, in_file_count);
+
+        mlv_map_close(in_map);
+        for(int pos = 0; pos < in_file_count; pos++)
+        {
+            fclose(in_files[pos]);
+        }
+        free(in_files);
+        return ret;
+    }
+
     if(!xref_mode && !skip_xref)
     {
-        block_xref = load_index(input_filename);
+        block_xref = load_index(input_filename, NULL);
 
         if(block_xref)
         {
@@ -2047,7 +2936,7 @@ int main (int argc, char *argv[])
     }
 
     
-    if(output_filename || lua_state)
+    if(output_filename || mlv_lua_wants_frames(lua_state))
     {
         frame_buffer = malloc(frame_buffer_size);
         if(!frame_buffer)
@@ -2069,8 +2958,13 @@ int main (int argc, char *argv[])
     }
 
     print_msg(MSG_INFO, "Processing...\n");
+    start_time = get_time_sec();
     uint32_t mlv_block_size = 8192*1024;
-    mlv_hdr_t *mlv_block = malloc(mlv_block_size);
+    mlv_hdr_t *mlv_block_buf = in_map ? NULL : malloc(mlv_block_size);
+    mlv_hdr_t *mlv_block = mlv_block_buf;
+
+    /* when reading from the mapping, the file position is kept here instead */
+    uint64_t map_position = 0;
     
     do
     {
@@ -2094,12 +2988,30 @@ read_headers:
                 return ERR_FILE;
             }
             in_file = in_files[in_file_num];
-            file_set_pos(in_file, position, SEEK_SET);
+            if(in_map)
+            {
+                map_position = position;
+            }
+            else
+            {
+                file_set_pos(in_file, position, SEEK_SET);
+            }
         }
 
-        position = file_get_pos(in_file);
+        int header_read = 0;
+        if(in_map)
+        {
+            position = map_position;
+            mlv_block = mlv_map_get(in_map, in_file_num, position, sizeof(mlv_hdr_t));
+            header_read = (mlv_block != NULL);
+        }
+        else
+        {
+            position = file_get_pos(in_file);
+            header_read = (fread(mlv_block, sizeof(mlv_hdr_t), 1, in_file) == 1);
+        }
 
-        if(fread(mlv_block, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        if(!header_read)
         {
             print_msg(MSG_INFO, "\n");
             
@@ -2114,6 +3026,7 @@ read_headers:
             {
                 in_file_num++;
                 in_file = in_files[in_file_num];
+                map_position = 0;
             }
             else
             {
@@ -2140,29 +3053,45 @@ read_headers:
             }
         }
         
-        /* will the buffer fit its size? */
-        if(mlv_block->blockSize > mlv_block_size)
+        if(in_map)
         {
-            mlv_block_size = mlv_block->blockSize;
-            mlv_block = realloc(mlv_block, mlv_block_size);
-            
+            /* the whole block is right there, just make sure the chunk really contains it */
+            uint32_t block_size = mlv_block->blockSize;
+
+            mlv_block = mlv_map_get(in_map, in_file_num, position, block_size);
             if(!mlv_block)
             {
-                print_msg(MSG_ERROR, "Invalid block size of 0x%08X at position 0x%08" PRIx64 "\n", mlv_block_size, position);
+                print_msg(MSG_ERROR, "Invalid block size of 0x%08X at position 0x%08" PRIx64 ", file ended prematurely\n", block_size, position);
                 goto abort;
             }
         }
-
-        /* jump back to the beginning of the block just read and read it all */
-        file_set_pos(in_file, position, SEEK_SET);
-        
-        if(fread(mlv_block, mlv_block->blockSize, 1, in_file) != 1)
+        else
         {
-            print_msg(MSG_ERROR, "Invalid block size of 0x%08X at position 0x%08" PRIx64 ", file ended prematurely\n", mlv_block->blockSize, position);
-            goto abort;
+            /* will the buffer fit its size? */
+            if(mlv_block->blockSize > mlv_block_size)
+            {
+                mlv_block_size = mlv_block->blockSize;
+                mlv_block_buf = realloc(mlv_block_buf, mlv_block_size);
+                mlv_block = mlv_block_buf;
+
+                if(!mlv_block)
+                {
+                    print_msg(MSG_ERROR, "Invalid block size of 0x%08X at position 0x%08" PRIx64 "\n", mlv_block_size, position);
+                    goto abort;
+                }
+            }
+
+            /* jump back to the beginning of the block just read and read it all */
+            file_set_pos(in_file, position, SEEK_SET);
+
+            if(fread(mlv_block, mlv_block->blockSize, 1, in_file) != 1)
+            {
+                print_msg(MSG_ERROR, "Invalid block size of 0x%08X at position 0x%08" PRIx64 ", file ended prematurely\n", mlv_block->blockSize, position);
+                goto abort;
+            }
         }
         
-        lua_handle_hdr(lua_state, mlv_block->blockType, &mlv_block, mlv_block->blockSize);
+        mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_HDR, mlv_block, mlv_block->blockSize, NULL, 0);
         
         /* show all block types in a more convenient style, but needs little housekeeping code */
         if(visualize)
@@ -2183,12 +3112,9 @@ read_headers:
                 mlv_file_hdr_t file_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_file_hdr_t), mlv_block->blockSize);
 
-                /* read the whole header block, but limit size to either our local type size or the written block size */
-                if(fread(&file_hdr, hdr_size, 1, in_file) != 1)
-                {
-                    print_msg(MSG_ERROR, "File ends in the middle of a block\n");
-                    goto abort;
-                }
+                /* take the header from the block, but limit size to either our local type size or the written block size */
+                memset(&file_hdr, 0x00, sizeof(mlv_file_hdr_t));
+                memcpy(&file_hdr, mlv_block, hdr_size);
 
                 /* is this the first file? */
                 if(main_header.fileGuid == 0)
@@ -2278,23 +3204,8 @@ read_headers:
                             }
                         }
                         
-                        /* allocate a null-terminatable buffer */
-                        uint8_t *autopsy_buf = malloc(length + 1);
-                        if(!autopsy_buf)
-                        {
-                            print_msg(MSG_ERROR, "Failed to allocate buffer for data to extract\n");
-                            goto abort;
-                        }
-                        autopsy_buf[length] = 0;
-                        
-                        if(fread(autopsy_buf, length, 1, in_file) != 1)
-                        {
-                            print_msg(MSG_ERROR, "Failed to read data from input file\n");
-                            goto abort;
-                        }
-                        
-                        /* rewind to block start, as if noone played with it */
-                        file_set_pos(in_file, position, SEEK_SET);
+                        /* the whole block is already in memory */
+                        uint8_t *autopsy_buf = (uint8_t *)mlv_block;
                         
                         switch(autopsy_content)
                         {
@@ -2377,15 +3288,13 @@ read_headers:
                                 print_msg(MSG_INFO, "  Offset: 0x%08" PRIx64 "\n", position);
                                 print_msg(MSG_INFO, "  Number: %d\n", blocks_processed);
                                 print_msg(MSG_INFO, "    Size: %d\n", mlv_block->blockSize);
-                                print_msg(MSG_INFO, " Content: \"%s\"\n", &autopsy_buf[start]);
+                                print_msg(MSG_INFO, " Content: \"%.*s\"\n", (int)length, &autopsy_buf[start]);
                                 print_msg(MSG_INFO, "---------------------\n");
                                 print_msg(MSG_INFO, "\n");
                                 break;
                             }
                         }
 
-                        free(autopsy_buf);
-
                         /* when extracting block types, keep rolling, there might be more */
                         if(autopsy_mode != AUTOPSY_EXTRACT_TYPE)
                         {
@@ -2419,23 +3328,16 @@ read_headers:
                         {
                             case AUTOPSY_HEADER:
                             {
-                                /* to replace header, read original block and replace data */
-                                mlv_hdr_t *autopsy_block = malloc(mlv_block->blockSize);
+                                /* to replace header, take the original block and replace data */
+                                mlv_hdr_t *autopsy_block = mlv_block;
                                 mlv_hdr_t *autopsy_header = malloc(autopsy_size);
 
-                                if(!autopsy_block || !autopsy_header)
+                                if(!autopsy_header)
                                 {
                                     print_msg(MSG_ERROR, "Failed to allocate buffer for data to extract\n");
                                     goto abort;
                                 }
 
-                                /* read original block from input file */
-                                if(fread(autopsy_block, mlv_block->blockSize, 1, in_file) != 1)
-                                {
-                                    print_msg(MSG_ERROR, "Failed to read data from input file\n");
-                                    goto abort;
-                                }
-
                                 /* read new header from autopsy file */
                                 if(fread(autopsy_header, autopsy_size, 1, autopsy_handle) != 1)
                                 {
@@ -2470,7 +3372,6 @@ read_headers:
                                     goto abort;
                                 }
 
-                                free(autopsy_block);
                                 free(autopsy_header);
                                 break;
                             }
@@ -2495,12 +3396,8 @@ read_headers:
                                     goto abort;
                                 }
                                 
-                                /* read original header from input file */
-                                if(fread(autopsy_header, header_size, 1, in_file) != 1)
-                                {
-                                    print_msg(MSG_ERROR, "Failed to read data from input file\n");
-                                    goto abort;
-                                }
+                                /* copy original header from the block */
+                                memcpy(autopsy_header, mlv_block, header_size);
                         
                                 /* calculate new block size from payload length */
                                 autopsy_header->blockSize = header_size + autopsy_size;
@@ -2597,17 +3494,10 @@ read_headers:
             }
 
             /* in xref mode, use every block and get its timestamp etc */
-            if(xref_mode)
+            if(xref_mode && mlv_index_add_block(&xref_index, mlv_block, position, in_file_num))
             {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = 0;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = in_file_num;
-                frame_xref_table[frame_xref_entries].frameType = MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
+                print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+                goto abort;
             }
 
             /* is this the first file? */
@@ -2629,7 +3519,12 @@ read_headers:
                     }
 
                     /* set the output compression flag */
-                    if(compress_output)
+                    if(compress_output && lzma_level >= 0)
+                    {
+                        file_hdr.videoClass |= MLV_VIDEO_CLASS_FLAG_LZMA;
+                        file_hdr.videoClass &= ~MLV_VIDEO_CLASS_FLAG_LJ92;
+                    }
+                    else if(compress_output)
                     {
                         file_hdr.videoClass |= MLV_VIDEO_CLASS_FLAG_LJ92;
                         file_hdr.videoClass &= ~MLV_VIDEO_CLASS_FLAG_LZMA;
@@ -2652,6 +3547,10 @@ read_headers:
 
                     if(!extract_block || !strncasecmp(extract_block, (char*)file_hdr.fileMagic, 4))
                     {
+                        if(!out_index_add(out_index, out_file, &file_hdr))
+                        {
+                            goto abort;
+                        }
                         if(fwrite(&file_hdr, file_hdr.blockSize, 1, out_file) != 1)
                         {
                             print_msg(MSG_ERROR, "Failed writing into .MLV file\n");
@@ -2721,20 +3620,10 @@ read_headers:
         else
         {
             /* in xref mode, use every block and get its timestamp etc */
-            if(xref_mode && memcmp(mlv_block->blockType, "NULL", 4) && memcmp(mlv_block->blockType, "BKUP", 4))
+            if(xref_mode && mlv_index_add_block(&xref_index, mlv_block, position, in_file_num))
             {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = mlv_block->timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = in_file_num;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(mlv_block->blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(mlv_block->blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
+                print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+                goto abort;
             }
 
             if(main_header.blockSize == 0)
@@ -2761,7 +3650,6 @@ read_headers:
             {
                 mlv_audf_hdr_t block_hdr = *(mlv_audf_hdr_t *)mlv_block;
 
-                lua_handle_hdr(lua_state, mlv_block->blockType, &block_hdr, sizeof(block_hdr));
                 if(verbose)
                 {
                     print_msg(MSG_INFO, "   Frame: #%04d\n", block_hdr.frameNumber);
@@ -2835,10 +3723,207 @@ read_headers:
                     a) if we should output a RAW file
                     b) if we should output a MLV file
                     c) if we should output DNG files
-                    d) if LUA is enabled
+                    d) if a LUA script looks at frame data
                     e) but not if this block should be skipped (due to inconsistent header data)
                 */
-                if((raw_output || mlv_output || dng_output || lua_state) && !skip_block)
+                /* plain copy into another MLV file: nothing touches the image data, so write it straight from the block */
+                int copy_vidf =
+                    mlv_output && !average_mode && !raw_output && !dng_output && !mlv_lua_wants_frames(lua_state) &&
+                    !compress_output && !decompress_input && !subtract_mode && !flatfield_mode && !bit_zap &&
+                    !delta_encode_mode && !(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA) &&
+                    (!bit_depth || bit_depth == lv_rec_footer.raw_info.bits_per_pixel);
+
+#ifdef MLV_USE_LJ92
+                /* threaded compression into a MLV needs no setup by a serially processed frame, so start right at the first one.
+                   delta encoded footage depends on the previous frame, so it has to stay serial */
+                if(compress_threads > 1 && !lj92_pipeline && !(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA) &&
+                   (!bit_depth || bit_depth == lv_rec_footer.raw_info.bits_per_pixel))
+                {
+                    lj92_pipeline_ctx.out_file = out_file;
+                    lj92_pipeline_ctx.compressed_lj92 = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
+                    lj92_pipeline_ctx.compressed_lzma = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
+                    lj92_pipeline_ctx.bit_zap = bit_zap;
+                    lj92_pipeline_ctx.relaxed = relaxed;
+                    lj92_pipeline_ctx.verbose = verbose;
+                    lj92_pipeline_ctx.show_progress = show_progress;
+                    lj92_pipeline_ctx.lzma_level = lzma_level;
+                    lj92_pipeline_ctx.out_index = out_index;
+
+                    lj92_pipeline = pipeline_create(compress_threads, 2 * compress_threads, lj92_job_work, lj92_job_write, &lj92_pipeline_ctx);
+
+                    if(!lj92_pipeline)
+                    {
+                        print_msg(MSG_ERROR, "Failed to start LJ92 worker threads, compressing frames serially\n");
+                        compress_threads = 1;
+                    }
+                }
+#endif
+
+                /* threaded DNG export: the workers do everything below on a copy of the payload */
+                if(dng_pipeline && !skip_block)
+                {
+                    uint32_t frame_selected = (!extract_frames) || ((block_hdr.frameNumber >= frame_start) && (block_hdr.frameNumber <= frame_end));
+
+                    if(frame_selected)
+                    {
+                        struct dng_job *job = calloc(1, sizeof(struct dng_job));
+                        if(!job)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", sizeof(struct dng_job));
+                            goto abort;
+                        }
+
+                        job->xRes = video_xRes;
+                        job->yRes = video_yRes;
+                        job->bpp = lv_rec_footer.raw_info.bits_per_pixel;
+                        job->frame_size = ((video_xRes * video_yRes * job->bpp + 7) / 8);
+                        job->read_size = job->frame_size;
+
+                        if(dng_pipeline_ctx.compressed_lj92 || dng_pipeline_ctx.compressed_lzma)
+                        {
+                            job->read_size = block_hdr.blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr.frameSpace;
+                        }
+
+                        job->frame_buffer_size = MAX((uint32_t)job->frame_size, (uint32_t)job->read_size);
+                        job->frame_buffer = malloc(job->frame_buffer_size);
+
+                        int filename_len = strlen(output_filename) + 32;
+                        job->frame_info.dng_filename = malloc(filename_len);
+
+                        if(!job->frame_buffer || !job->frame_info.dng_filename)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Failed to allocate %d byte\n", job->frame_buffer_size);
+                            dng_job_free(job);
+                            goto abort;
+                        }
+
+                        void *payload = BYTE_OFFSET(mlv_block, sizeof(mlv_vidf_hdr_t) + block_hdr.frameSpace);
+                        memcpy(job->frame_buffer, payload, job->read_size);
+
+                        /* options were set up by the serially processed first frame, only take over the current headers */
+                        char *dng_filename = job->frame_info.dng_filename;
+                        struct raw_info raw_info;
+
+                        job->frame_info                 = frame_info;
+                        job->frame_info.dng_filename    = dng_filename;
+                        job->frame_info.pack_bits       = pack_dng_bits;
+                        job->frame_info.cs_threads      = 1;
+                        job->frame_info.file_hdr        = main_header;
+                        job->frame_info.vidf_hdr        = last_vidf;
+                        job->frame_info.rtci_hdr        = rtci_info;
+                        job->frame_info.idnt_hdr        = idnt_info;
+                        job->frame_info.expo_hdr        = expo_info;
+                        job->frame_info.lens_hdr        = lens_info;
+                        job->frame_info.wbal_hdr        = wbal_info;
+                        job->frame_info.rawc_hdr        = rawc_info;
+                        job->frame_info.rawi_hdr.xRes   = lv_rec_footer.xRes;
+                        job->frame_info.rawi_hdr.yRes   = lv_rec_footer.yRes;
+
+                        /* INFO blocks may update the string while this frame is still in flight */
+                        strcpy(job->info_str, info_string);
+                        job->frame_info.info_str = job->info_str;
+
+                        raw_info_from_camera(&raw_info, &lv_rec_footer.raw_info);
+                        fix_black_white_level(&raw_info.black_level, &raw_info.white_level, &raw_info.bits_per_pixel, bit_depth, black_fix, white_fix, verbose);
+                        raw_info_to_camera(&job->frame_info.rawi_hdr.raw_info, &raw_info);
+
+                        snprintf(dng_filename, filename_len, "%s%06d.dng", output_filename, block_hdr.frameNumber);
+
+                        /* blocks while the pipeline is full */
+                        if(pipeline_submit(dng_pipeline, job))
+                        {
+                            goto abort;
+                        }
+                    }
+                }
+#ifdef MLV_USE_LJ92
+                /* threaded compression into a MLV: same as the serial path below, on a copy of the payload */
+                else if(lj92_pipeline && !skip_block)
+                {
+                    uint32_t frame_selected = (!extract_frames) || ((block_hdr.frameNumber >= frame_start) && (block_hdr.frameNumber <= frame_end));
+
+                    if(frame_selected)
+                    {
+                        struct lj92_job *job = calloc(1, sizeof(struct lj92_job));
+                        if(!job)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", sizeof(struct lj92_job));
+                            goto abort;
+                        }
+
+                        job->is_frame = 1;
+                        job->vidf_hdr = block_hdr;
+                        job->vidf_hdr.frameNumber -= frame_start;
+                        job->xRes = video_xRes;
+                        job->yRes = video_yRes;
+                        job->bpp = lv_rec_footer.raw_info.bits_per_pixel;
+                        job->frame_size = ((video_xRes * video_yRes * job->bpp + 7) / 8);
+                        job->read_size = job->frame_size;
+
+                        if(lj92_pipeline_ctx.compressed_lj92 || lj92_pipeline_ctx.compressed_lzma)
+                        {
+                            job->read_size = block_hdr.blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr.frameSpace;
+                        }
+
+                        job->data_size = MAX((uint32_t)job->frame_size, (uint32_t)job->read_size);
+                        job->data = malloc(job->data_size);
+
+                        if(!job->data)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Failed to allocate %d byte\n", job->data_size);
+                            lj92_job_free(job);
+                            goto abort;
+                        }
+
+                        void *payload = BYTE_OFFSET(mlv_block, sizeof(mlv_vidf_hdr_t) + block_hdr.frameSpace);
+                        memcpy(job->data, payload, job->read_size);
+
+                        job->table = lj92_shared_table_next(&lj92_group, &lj92_group_frames, reuse_huff, &job->table_owner);
+
+                        /* blocks while the pipeline is full */
+                        if(pipeline_submit(lj92_pipeline, job))
+                        {
+                            goto abort;
+                        }
+                    }
+                }
+#endif
+                else if(copy_vidf && !skip_block)
+                {
+                    uint32_t frame_selected = (!extract_frames) || ((block_hdr.frameNumber >= frame_start) && (block_hdr.frameNumber <= frame_end));
+                    int compressed = main_header.videoClass & (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92);
+                    uint32_t payload_size = block_hdr.blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr.frameSpace;
+
+                    /* uncompressed frames may have padding behind the image data, drop it */
+                    if(!compressed)
+                    {
+                        uint32_t frame_size = ((video_xRes * video_yRes * lv_rec_footer.raw_info.bits_per_pixel + 7) / 8);
+
+                        if(frame_size > payload_size)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Frame size %d exceeds block payload %d\n", frame_size, payload_size);
+                            goto abort;
+                        }
+                        payload_size = frame_size;
+                    }
+
+                    if(frame_selected && (!extract_block || !strncasecmp(extract_block, (char*)block_hdr.blockType, 4)))
+                    {
+                        void *payload = BYTE_OFFSET(mlv_block, sizeof(mlv_vidf_hdr_t) + block_hdr.frameSpace);
+
+                        /* delete free space and correct header size */
+                        block_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + payload_size;
+                        block_hdr.frameSpace = 0;
+                        block_hdr.frameNumber -= frame_start;
+
+                        if(fwrite(&block_hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1 || fwrite(payload, payload_size, 1, out_file) != 1)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
+                            goto abort;
+                        }
+                    }
+                }
+                else if((raw_output || mlv_output || dng_output || mlv_lua_wants_frames(lua_state)) && !skip_block)
                 {
                     /* if already compressed, we have to decompress it first */
                     int compressed_lzma = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
@@ -2927,86 +4012,23 @@ read_headers:
                     void *payload = BYTE_OFFSET(mlv_block, sizeof(mlv_vidf_hdr_t) + block_hdr.frameSpace);
                     memcpy(frame_buffer, payload, read_size);
 
-                    lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_read", &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
+                    mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_READ, &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
 
                     if(run_decompressor)
                     {
                         if(compressed_lj92)
                         {
 #ifdef MLV_USE_LJ92
-                            lj92 handle;
-                            int lj92_width = 0;
-                            int lj92_height = 0;
-                            int lj92_bitdepth = 0;
-                            int lj92_components = 0;
-
-                            int ret = lj92_open(&handle, (uint8_t *)frame_buffer, read_size, &lj92_width, &lj92_height, &lj92_bitdepth, &lj92_components);
-
-                            /* this is the raw data size with 16 bit words. it's just temporary */
-                            size_t out_size = lj92_width * lj92_height * sizeof(uint16_t) * lj92_components;
-                            
-                            if(ret == LJ92_ERROR_NONE)
-                            {
-                                if(verbose)
-                                {
-                                    print_msg(MSG_INFO, "    LJ92: Decompressing\n");
-                                    print_msg(MSG_INFO, "    LJ92: %dx%dx%d %d bpp (%d bytes buffer)\n", lj92_width, lj92_height, lj92_components, lj92_bitdepth, out_size);
-                                }
-                            }
-                            else
-                            {
-                                print_msg(MSG_ERROR, "    LJ92: Open failed (%d)\n", ret);
-                                if(relaxed)
-                                {
-                                    goto skip_block;
-                                }
-                                goto abort;
-                            }
-                            
-                            /* do a proper size check before we continue */
-                            int lj92_frame_size = ((lj92_width * lj92_height * lj92_components * lv_rec_footer.raw_info.bits_per_pixel + 7) / 8);
-                            
-                            if(lj92_frame_size != frame_size)
-                            {
-                                print_msg(MSG_ERROR, "    LJ92: decompressed image size (%d) does not match size retrieved from RAWI (%d)\n", lj92_frame_size, frame_size);
-                                goto abort;
-                            }
-                            
-                            /* we need a temporary buffer so we don't overwrite source data */
-                            uint16_t *decompressed = malloc(out_size);
-                            
-                            ret = lj92_decode(handle, decompressed, lj92_width * lj92_height * lj92_components, 0, NULL, 0);
+                            int ret = frame_decompress_lj92(frame_buffer, read_size, frame_size, video_xRes, video_yRes, lv_rec_footer.raw_info.bits_per_pixel, dng_pipeline ? 1 : dng_threads, verbose);
 
-                            if(ret != LJ92_ERROR_NONE)
+                            if(ret != FRAME_OK)
                             {
-                                print_msg(MSG_ERROR, "    LJ92: Decompress failed (%d)\n", ret);
-                                if(relaxed)
+                                if(ret == FRAME_SKIP && relaxed)
                                 {
                                     goto skip_block;
                                 }
                                 goto abort;
                             }
-                            
-                            if(verbose)
-                            {
-                                print_msg(MSG_INFO, "    LJ92: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%% ratio)\n", frame_buffer_size, frame_size, ((float)frame_buffer_size * 100.0f) / (float)frame_size);
-                            }
-                            
-                            /* repack the 16 bit words containing values with max 14 bit */
-                            int orig_pitch = video_xRes * lv_rec_footer.raw_info.bits_per_pixel / 8;
-
-                            for(int y = 0; y < video_yRes; y++)
-                            {
-                                uint16_t *src_line = &decompressed[y * video_xRes];
-                                void *dst_line = &frame_buffer[y * orig_pitch];
-
-                                for(int x = 0; x < video_xRes; x++)
-                                {
-                                    bitinsert(dst_line, x, lv_rec_footer.raw_info.bits_per_pixel, src_line[x]);
-                                }
-                            }
-                            
-                            free(decompressed);
 #else
                             print_msg(MSG_INFO, "    LJ92: not compiled into this release, aborting.\n");
                             goto abort;
@@ -3015,35 +4037,8 @@ read_headers:
                         else if(compressed_lzma)
                         {
 #ifdef MLV_USE_LZMA
-                            size_t lzma_out_size = *(uint32_t *)frame_buffer;
-                            size_t lzma_in_size = frame_buffer_size - LZMA_PROPS_SIZE - 4;
-                            size_t lzma_props_size = LZMA_PROPS_SIZE;
-                            unsigned char *lzma_out = malloc(lzma_out_size);
-
-                            int ret = LzmaUncompress(
-                                lzma_out, &lzma_out_size,
-                                (unsigned char *)&frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
-                                (unsigned char *)&frame_buffer[4], lzma_props_size
-                                );
-                                
-                            if(lzma_out_size != frame_size)
-                            {
-                                print_msg(MSG_ERROR, "    LZMA: decompressed image size (%d) does not match size retrieved from RAWI (%d)\n", lzma_out_size, frame_size);
-                                goto abort;
-                            }
-                            
-                            if(ret == SZ_OK)
-                            {
-                                memcpy(frame_buffer, lzma_out, lzma_out_size);
-                                
-                                if(verbose)
-                                {
-                                    print_msg(MSG_INFO, "    LZMA: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, lzma_out_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
-                                }
-                            }
-                            else
+                            if(frame_decompress_lzma(frame_buffer, frame_buffer_size, frame_size, verbose) != FRAME_OK)
                             {
-                                print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
                                 goto abort;
                             }
 #else
@@ -3067,26 +4062,19 @@ read_headers:
                             print_msg(MSG_ERROR, "Error: Frame sizes of footage and subtract frame differ (%d, %d)", frame_size, subtract_frame_buffer_size);
                             break;
                         }
-                        
-                        int pitch = video_xRes * current_depth / 8;
 
-                        for(int y = 0; y < video_yRes; y++)
+                        if(!sub_ref)
                         {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                            uint16_t *sub_line = (uint16_t *)&frame_sub_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
+                            sub_ref = calib_ref_create((uint16_t *)frame_sub_buffer, video_xRes, video_yRes, current_depth);
+                            if(!sub_ref)
                             {
-                                int32_t value = bitextract(src_line, x, current_depth);
-                                int32_t sub_value = bitextract(sub_line, x, current_depth);
-
-                                value -= sub_value;
-                                value += lv_rec_footer.raw_info.black_level; /* should we really add it here? or better subtract it from averaged frame? */
-                                value = COERCE(value, 0, (1<<current_depth)-1);
-
-                                bitinsert(src_line, x, current_depth, value);
+                                print_msg(MSG_ERROR, "Failed to allocate subtract frame\n");
+                                goto abort;
                             }
                         }
+
+                        /* should we really add the black level here? or better subtract it from averaged frame? */
+                        calib_subtract(sub_ref, (uint16_t *)frame_buffer, lv_rec_footer.raw_info.black_level);
                     }
 
                     /* in flat-field mode, divide each image by the normalized reference frame */
@@ -3097,135 +4085,75 @@ read_headers:
                             print_msg(MSG_ERROR, "Error: Frame sizes of footage and flat-field frame differ (%d, %d)", frame_size, flatfield_frame_buffer_size);
                             break;
                         }
-                        
-                        int pitch = video_xRes * current_depth / 8;
-
-                        /* normalize flat frame on each Bayer channel (median) */
-                        /* and adjust all medians using green's 5th percentile to prevent whites from clipping */
-                        static int32_t med[2][2] = {{0,0},{0,0}};
-                        static int32_t pr5[2][2] = {{0,0},{0,0}};
-                        static int32_t adj_num = 0;
-                        static int32_t adj_den = 0;
 
-                        int black = lv_rec_footer.raw_info.black_level;
-                        
-                        if (!med[0][0])
+                        if(!flat_ref)
                         {
-                            /* normalize using frame center only
-                             * (also works on lenses with heavy vignetting) */
-                            
-                            int* hist[2][2];
-                            int total[2][2] = {{0,0},{0,0}};
-                            
-                            hist[0][0] = calloc(1 << current_depth, sizeof(int));
-                            hist[0][1] = calloc(1 << current_depth, sizeof(int));
-                            hist[1][0] = calloc(1 << current_depth, sizeof(int));
-                            hist[1][1] = calloc(1 << current_depth, sizeof(int));
-                            
-                            for(int y = video_yRes/4; y < video_yRes*3/4; y++)
-                            {
-                                uint16_t *flat_line = (uint16_t *)&frame_flat_buffer[y * pitch];
-                                for(int x = video_xRes/4; x < video_xRes*3/4; x++)
-                                {
-                                    uint32_t value = bitextract(flat_line, x, current_depth);
-                                    hist[y%2][x%2][value]++;
-                                    total[y%2][x%2]++;
-                                }
-                            }
-                            
-                            for (int dy = 0; dy < 2; dy++)
+                            flat_ref = calib_ref_create((uint16_t *)frame_flat_buffer, video_xRes, video_yRes, current_depth);
+                            if(!flat_ref)
                             {
-                                for (int dx = 0; dx < 2; dx++)
-                                {
-                                    int acc = 0;
-                                    for (int i = 0; i < (1 << current_depth); i++)
-                                    {
-                                        acc += hist[dy][dx][i];
-                                        
-                                        if (acc < total[dy][dx]/20)
-                                        {
-                                            /* 5th percentile */
-                                            pr5[dy][dx] = i - black;
-                                        }
-                                        
-                                        if (acc < total[dy][dx]/2)
-                                        {
-                                            /* median */
-                                            med[dy][dx] = i - black;
-                                        }
-                                    }
-                                }
+                                print_msg(MSG_ERROR, "Failed to allocate flat-field frame\n");
+                                goto abort;
                             }
-                            
-                            free(hist[0][0]);
-                            free(hist[0][1]);
-                            free(hist[1][0]);
-                            free(hist[1][1]);
-                            
-                            adj_num = (pr5[0][1] + pr5[1][0]) / 2;
-                            adj_den = (med[0][1] + med[1][0]) / 2;
+                        }
+
+                        /* normalize flat frame on each Bayer channel (median) */
+                        /* and adjust all medians using green's 5th percentile to prevent whites from clipping */
+                        if(!flat_ref->med[0][0])
+                        {
+                            calib_flat_normalize(flat_ref, lv_rec_footer.raw_info.black_level);
 
                             print_msg(MSG_INFO, "Flat-field median: [%d %d; %d %d], adjusted by %d/%d\n", 
-                                med[0][0], med[0][1],
-                                med[1][0], med[1][1],
-                                adj_num, adj_den
+                                flat_ref->med[0][0], flat_ref->med[0][1],
+                                flat_ref->med[1][0], flat_ref->med[1][1],
+                                flat_ref->adj_num, flat_ref->adj_den
                             );
                         }
-                        
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                            uint16_t *flat_line = (uint16_t *)&frame_flat_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int32_t value = bitextract(src_line, x, current_depth);
-                                int32_t flat_value = bitextract(flat_line, x, current_depth);
-                                
-                                if (flat_value - black <= 0)
-                                {
-                                    int left  = bitextract(flat_line, MAX(x-1,0), current_depth);
-                                    int right = bitextract(flat_line, MIN(x+1,video_xRes-1), current_depth);
-                                    flat_value = MAX(left, right);
-                                }
 
-                                if (flat_value - black > 0)
-                                {
-                                    value -= black;
-                                    value = (int64_t) value * med[y%2][x%2] * adj_num / adj_den / (flat_value - black);
-                                    value += black;
-                                    value = COERCE(value, 0, (1<<current_depth)-1);
-                                }
-
-                                bitinsert(src_line, x, current_depth, value);
-                            }
+                        if(!calib_flatfield(flat_ref, (uint16_t *)frame_buffer, lv_rec_footer.raw_info.black_level))
+                        {
+                            print_msg(MSG_ERROR, "Error: Flat-field frame has no signal in its center\n");
+                            break;
                         }
                     }
-                    static int countzz = 1;
-                    /* in average mode, sum up all pixel values of a pixel position */
+
+                    /* in average mode, hand the frame to the stacking engine */
                     if(average_mode)
                     {
-                        int pitch = video_xRes * current_depth / 8;
-
-                        for(int y = 0; y < video_yRes; y++)
+                        if(!avg_stack)
                         {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
+                            /* --stack=median/sigma spool the packed frames next to the output file, or into --stack-dir */
+                            char *spool_base = output_filename ? output_filename : input_filename;
+                            if(stack_dir)
                             {
-                                uint16_t value = bitextract(src_line, x, current_depth);
+                                char *name = strrchr(spool_base, '/');
+                                char *name2 = strrchr(spool_base, '\\');
+                                if(name2 > name) name = name2;
+                                spool_base = name ? name + 1 : spool_base;
+                            }
 
-                                frame_arith_buffer[y * video_xRes + x] += value;
+                            int spool_name_len = (stack_dir ? strlen(stack_dir) : 0) + strlen(spool_base) + 16;
+                            char *spool_name = malloc(spool_name_len);
+                            if(!spool_name)
+                            {
+                                print_msg(MSG_ERROR, "Failed to set up frame stacking\n");
+                                goto abort;
+                            }
+                            snprintf(spool_name, spool_name_len, "%s%s%s.stack", stack_dir ? stack_dir : "", stack_dir ? "/" : "", spool_base);
 
-                                if(countzz)
-                                {
-                                    printf("#%u avg[0] = %u, unpacked[0] = %u\n", average_samples, frame_arith_buffer[0], value);
-                                    countzz = 0;
-                                }
+                            avg_stack = calib_create(video_xRes, video_yRes, current_depth, stack_method, stack_sigma, dng_threads, (size_t)stack_memory * 1024 * 1024, spool_name);
+                            free(spool_name);
+                            if(!avg_stack)
+                            {
+                                print_msg(MSG_ERROR, "Failed to set up frame stacking\n");
+                                goto abort;
                             }
                         }
-                        countzz = 1;
-                        average_samples++;
+
+                        if(!calib_add_frame(avg_stack, (uint16_t *)frame_buffer))
+                        {
+                            print_msg(MSG_ERROR, "Failed to stack frame %d\n", block_hdr.frameNumber);
+                            goto abort;
+                        }
                     }
 
                     /* now resample bit depth if requested */
@@ -3246,30 +4174,7 @@ read_headers:
                             break;
                         }
 
-                        int old_pitch = video_xRes * old_depth / 8;
-                        int new_pitch = video_xRes * new_depth / 8;
-
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * old_pitch];
-                            uint16_t *dst_line = (uint16_t *)&new_buffer[y * new_pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                uint16_t value = bitextract(src_line, x, old_depth);
-
-                                /* normalize the old value to 16 bits, minimizing the roundoff error */
-                                /* assume the bit depth reduction simply discarded the lower bits */
-                                /* => we have a bias of 0.5 LSB that can be corrected here. */
-                                value <<= (16-old_depth);
-                                value += (1 << (15-old_depth));
-
-                                /* convert the old value to destination depth */
-                                value >>= (16-new_depth);
-
-                                bitinsert(dst_line, x, new_depth, value);
-                            }
-                        }
+                        frame_convert_depth(frame_buffer, new_buffer, video_xRes, video_yRes, old_depth, new_depth);
 
                         /* update uncompressed frame and buffer size */
                         frame_size = new_size;
@@ -3284,29 +4189,7 @@ read_headers:
 
                     if(bit_zap)
                     {
-                        int pitch = video_xRes * current_depth / 8;
-                        uint32_t mask = ~((1 << (16 - bit_zap)) - 1);
-
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int32_t value = bitextract(src_line, x, current_depth);
-
-                                /* normalize the old value to 16 bits */
-                                value <<= (16-current_depth);
-
-                                value &= mask;
-
-                                /* convert the old value to destination depth */
-                                value >>= (16-current_depth);
-
-
-                                bitinsert(src_line, x, current_depth, value);
-                            }
-                        }
+                        frame_zap_bits(frame_buffer, video_xRes, video_yRes, current_depth, bit_zap);
                     }
 
                     if(delta_encode_mode)
@@ -3400,7 +4283,7 @@ read_headers:
 
                     if(frame_selected)
                     {
-                        lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_write", &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
+                        mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_WRITE, &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
 
                         if(raw_output)
                         {
@@ -3409,7 +4292,7 @@ read_headers:
                                 lv_rec_footer.frameSize = frame_size;
                             }
 
-                            lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_write_raw", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
+                            mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_WRITE_RAW, &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
 
                             file_set_pos(out_file, (uint64_t)block_hdr.frameNumber * (uint64_t)frame_size, SEEK_SET);
                             if(fwrite(frame_buffer, frame_size, 1, out_file) != 1)
@@ -3424,7 +4307,7 @@ read_headers:
                         {
                             struct raw_info raw_info;
 
-                            lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_write_dng", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
+                            mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_WRITE_DNG, &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
 
                             /* copy over raw info from camera type to native (potentially x64) type */
                             raw_info_from_camera(&raw_info, &lv_rec_footer.raw_info);
@@ -3450,7 +4333,11 @@ read_headers:
                             frame_info.dual_iso             = is_dual_iso;
                             frame_info.save_bpm             = save_bpm_file;
                             frame_info.chroma_smooth        = chroma_smooth_method;
+                            frame_info.cs_isa               = chroma_smooth_isa;
+                            frame_info.cs_threads           = dng_threads;
                             frame_info.pattern_noise        = fix_pattern_noise;
+                            frame_info.stats_cache          = stats_cache;
+                            frame_info.stats_interval       = stats_interval;
                             frame_info.show_progress        = show_progress;
                             frame_info.raw_state            = raw_state;
                             frame_info.pack_bits            = pack_dng_bits;
@@ -3483,6 +4370,7 @@ read_headers:
                                 case COMPRESSED_RAW:
                                     frame_info.frame_buffer = frame_buffer;
                                     frame_info.frame_buffer_size = frame_buffer_size;
+                                    dng_process_start(&frame_info);
                                     dng_init_data(&frame_info, &dng_data);
                                     dng_process_data(&frame_info, &dng_data);
                                     break;
@@ -3495,6 +4383,37 @@ read_headers:
                             }
                         }
 
+#if defined(MLV_USE_LJ92) && defined(MLV_USE_LZMA)
+                        /* --lzma, only for MLV output. the packed frame is compressed as it is */
+                        if(run_compressor && lzma_level >= 0)
+                        {
+                            uint8_t *compressed = NULL;
+                            int compressed_size = 0;
+                            double encode_start = get_time_sec();
+
+                            if(frame_compress_lzma(frame_buffer, frame_size, lzma_level, &compressed, &compressed_size) != FRAME_OK)
+                            {
+                                goto abort;
+                            }
+
+                            double encode_time = get_time_sec() - encode_start;
+
+                            if(verbose)
+                            {
+                                print_msg(MSG_INFO, "    LZMA: %d -> %d  (%2.2f%% ratio)\n", frame_size, compressed_size, ((float)compressed_size * 100.0f) / (float)frame_size);
+                            }
+
+                            /* set new compressed size and copy buffers */
+                            frame_buffer = realloc(frame_buffer, compressed_size);
+                            assert(frame_buffer);
+                            memcpy(frame_buffer, compressed, compressed_size);
+                            frame_buffer_size = compressed_size;
+                            free(compressed);
+
+                            lj92_stats_add(&lj92_stats, frame_size, frame_buffer_size, encode_time, !verbose && show_progress);
+                        }
+                        else
+#endif
                         if(run_compressor)
                         {
 #ifdef MLV_USE_LJ92
@@ -3523,10 +4442,7 @@ read_headers:
                                     void *src_line = &frame_buffer[y * orig_pitch];
                                     uint16_t *dst_line = &compress_buffer[y * video_xRes];
 
-                                    for(int x = 0; x < video_xRes; x++)
-                                    {
-                                        dst_line[x] = bitextract(src_line, x, lv_rec_footer.raw_info.bits_per_pixel);
-                                    }
+                                    bitpack_unpack(src_line, dst_line, video_xRes, lv_rec_footer.raw_info.bits_per_pixel);
                                 }
                             }
                             
@@ -3565,7 +4481,15 @@ read_headers:
                                 print_msg(MSG_INFO, "    LJ92: %dx%dx%d %d bpp (%d bytes buffer)\n", lj92_width, lj92_height, lj92_components, lj92_bitdepth, compress_buffer_size);
                             }
                             
-                            int ret = lj92_encode(compress_buffer, lj92_width, lj92_height, lj92_bitdepth, 2, lj92_width * lj92_height, 0, NULL, 0, &compressed, &compressed_size);
+                            /* --reuse-huff only applies to MLV output */
+                            int table_owner = 0;
+                            struct lj92_shared_table *table = dng_output ? NULL : lj92_shared_table_next(&lj92_group, &lj92_group_frames, reuse_huff, &table_owner);
+                            double encode_start = get_time_sec();
+
+                            int ret = frame_compress_lj92(compress_buffer, video_xRes, video_yRes, lj92_bitdepth, table, table_owner, &compressed, &compressed_size);
+
+                            double encode_time = get_time_sec() - encode_start;
+                            lj92_shared_table_put(table);
 
                             if(ret == LJ92_ERROR_NONE)
                             {
@@ -3596,8 +4520,10 @@ read_headers:
                                 print_msg(MSG_ERROR, "    LJ92: Failed (%d)\n", ret);
                                 goto abort;
                             }
-                            
+
                             free(compressed);
+
+                            lj92_stats_add(&lj92_stats, frame_size, frame_buffer_size, encode_time, frame_buffer_size != (uint32_t)frame_size && !verbose && show_progress);
 #else
                             print_msg(MSG_INFO, "    no compression type compiled into this release, aborting.\n");
                             if(relaxed)
@@ -3606,16 +4532,6 @@ read_headers:
                             }
                             goto abort;
 #endif
-                            if(frame_buffer_size != (uint32_t)frame_size && !verbose && show_progress)
-                            {
-                                static int first_time = 1;
-                                if(first_time)
-                                {
-                                    print_msg(MSG_INFO, "\nWriting LJ92 compressed frames...\n");
-                                    first_time = 0;
-                                }
-                                print_msg(MSG_INFO, "  saving: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%% ratio)\n", frame_size, frame_buffer_size, ((float)frame_buffer_size * 100.0f) / (float)frame_size);
-                            }
                         }
 
                         /* save DNG frame */
@@ -3624,7 +4540,7 @@ read_headers:
                             int frame_filename_len = strlen(output_filename) + 32;
                             char *frame_filename = malloc(frame_filename_len);
                             snprintf(frame_filename, frame_filename_len, "%s%06d.dng", output_filename, block_hdr.frameNumber);
-                            lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_write_dng", &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
+                            mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_WRITE_DNG, &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
                             frame_info.dng_filename = frame_filename;
 
                             dng_init_header(&frame_info, &dng_data);
@@ -3640,20 +4556,49 @@ read_headers:
                             }
 
                             /* callout for a saved dng file */
-                            lua_call_va(lua_state, "dng_saved", "si", frame_filename, block_hdr.frameNumber);
+                            mlv_lua_dng_saved(lua_state, frame_filename, block_hdr.frameNumber);
 
                             free(frame_filename);
+                            dng_frames_written++;
+
+                            /* first frame went through the serial path and initialized the lazily loaded pixel maps,
+                               stripe coefficients and LUTs. from now on they are read-only and frames can be processed in parallel.
+                               delta encoded footage depends on the previous frame, so it has to stay serial. */
+                            if(dng_threads > 1 && !dng_pipeline && !(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA))
+                            {
+                                dng_pipeline_ctx.compressed_lj92 = compressed_lj92;
+                                dng_pipeline_ctx.compressed_lzma = compressed_lzma;
+                                dng_pipeline_ctx.run_decompressor = run_decompressor;
+                                dng_pipeline_ctx.run_compressor = run_compressor;
+                                dng_pipeline_ctx.bit_depth = bit_depth;
+                                dng_pipeline_ctx.bit_zap = bit_zap;
+                                dng_pipeline_ctx.relaxed = relaxed;
+                                dng_pipeline_ctx.verbose = verbose;
+
+                                /* two frames per thread in flight keeps the workers busy while the writer catches up */
+                                dng_pipeline = pipeline_create(dng_threads, 2 * dng_threads, dng_job_work, dng_job_write, &dng_pipeline_ctx);
+
+                                if(!dng_pipeline)
+                                {
+                                    print_msg(MSG_ERROR, "Failed to start DNG worker threads, processing frames serially\n");
+                                    dng_threads = 1;
+                                }
+                            }
                         }
 
                         if(write_block)
                         {
-                            lua_handle_hdr_data(lua_state, mlv_block->blockType, "_data_write_mlv", &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
+                            mlv_lua_hook(lua_state, mlv_block->blockType, MLV_LUA_DATA_WRITE_MLV, &block_hdr, sizeof(block_hdr), frame_buffer, frame_buffer_size);
 
                             /* delete free space and correct header size if needed */
                             block_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_buffer_size;
                             block_hdr.frameSpace = 0;
                             block_hdr.frameNumber -= frame_start;
 
+                            if(!out_index_add(out_index, out_file, &block_hdr))
+                            {
+                                goto abort;
+                            }
                             if(fwrite(&block_hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1)
                             {
                                 print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
@@ -3915,13 +4860,19 @@ read_headers:
                 int frame_size = MAX(bit_depth, block_hdr.raw_info.bits_per_pixel) * block_hdr.raw_info.height * block_hdr.raw_info.width / 8;
                 
                 /* resolution change, old data will be thrown away */
-                if(frame_arith_buffer)
+                if(avg_stack)
                 {
                     print_msg(MSG_INFO, "Got a new RAWI, throwing away average buffers etc.\n");
-                    free(frame_arith_buffer);
-                    frame_arith_buffer = NULL;
+                    calib_free(avg_stack);
+                    avg_stack = NULL;
                 }
                 
+                /* reference frames are unpacked again with the new format */
+                calib_ref_free(sub_ref);
+                calib_ref_free(flat_ref);
+                sub_ref = NULL;
+                flat_ref = NULL;
+                
                 if(prev_frame_buffer)
                 {
                     print_msg(MSG_INFO, "Got a new RAWI, throwing away previous frame buffers etc.\n");
@@ -3929,13 +4880,6 @@ read_headers:
                     prev_frame_buffer = NULL;
                 }
                 
-                frame_arith_buffer = malloc(frame_size * sizeof(uint32_t));
-                if(!frame_arith_buffer)
-                {
-                    print_msg(MSG_ERROR, "Failed to allocate %d byte for frame_arith_buffer\n", frame_size * sizeof(uint32_t));
-                    goto abort;
-                }
-                
                 prev_frame_buffer = malloc(frame_size);
                 if(!prev_frame_buffer)
                 {
@@ -3943,7 +4887,6 @@ read_headers:
                     goto abort;
                 }
                 
-                memset(frame_arith_buffer, 0x00, frame_size * sizeof(uint32_t));
                 memset(prev_frame_buffer, 0x00, frame_size);
 
                 /* always output RAWI blocks, its not just metadata, but important frame format data */
@@ -3956,7 +4899,7 @@ read_headers:
                     /* patch raw info if black and/or white fix specified or bit depth changed */
                     fix_black_white_level(&block_hdr.raw_info.black_level, &block_hdr.raw_info.white_level, &block_hdr.raw_info.bits_per_pixel, bit_depth, black_fix, white_fix, verbose);
 
-                    if(fwrite(&block_hdr, block_hdr.blockSize, 1, out_file) != 1)
+                    if(!write_mlv_block(lj92_pipeline, out_file, out_index, &block_hdr, block_hdr.blockSize))
                     {
                         print_msg(MSG_ERROR, "Failed writing into .MLV file\n");
                         goto abort;
@@ -4097,8 +5040,6 @@ read_headers:
                 {
                     print_msg(MSG_INFO, "Unknown Block: %c%c%c%c, skipping\n", mlv_block->blockType[0], mlv_block->blockType[1], mlv_block->blockType[2], mlv_block->blockType[3]);
                 }
-
-                lua_handle_hdr(lua_state, mlv_block->blockType, "", 0);
             }
         }
 
@@ -4110,7 +5051,7 @@ read_headers:
             (!extract_block || !strncasecmp(extract_block, (char *)mlv_block->blockType, 4)) /* when block extraction was requested, only write those */
             )
         {
-            if(fwrite(mlv_block, mlv_block->blockSize, 1, out_file) != 1)
+            if(!write_mlv_block(lj92_pipeline, out_file, out_index, mlv_block, mlv_block->blockSize))
             { 
                 print_msg(MSG_ERROR, "Failed writing into .MLV file\n");
                 goto abort;
@@ -4118,7 +5059,14 @@ read_headers:
         }
 
 skip_block:
-        file_set_pos(in_file, position + mlv_block->blockSize, SEEK_SET);
+        if(in_map)
+        {
+            map_position = position + mlv_block->blockSize;
+        }
+        else
+        {
+            file_set_pos(in_file, position + mlv_block->blockSize, SEEK_SET);
+        }
             
         /* count any read block, no matter if header or video frame */
         blocks_processed++;
@@ -4139,18 +5087,68 @@ skip_block:
 
 abort:
 
+    /* write out the frames still in flight */
+    if(dng_pipeline)
+    {
+        if(pipeline_finish(dng_pipeline))
+        {
+            print_msg(MSG_ERROR, "DNG worker threads failed\n");
+        }
+        dng_frames_written += dng_pipeline_ctx.frames_written;
+        dng_pipeline = NULL;
+    }
+
+#ifdef MLV_USE_LJ92
+    if(lj92_pipeline)
+    {
+        if(pipeline_finish(lj92_pipeline))
+        {
+            print_msg(MSG_ERROR, "%s worker threads failed\n", (lzma_level >= 0) ? "LZMA" : "LJ92");
+            /* the output is incomplete, don't index it */
+            out_index = NULL;
+        }
+        lj92_stats.bytes_in += lj92_pipeline_ctx.stats.bytes_in;
+        lj92_stats.bytes_out += lj92_pipeline_ctx.stats.bytes_out;
+        lj92_stats.encode_time += lj92_pipeline_ctx.stats.encode_time;
+        lj92_stats.frames += lj92_pipeline_ctx.stats.frames;
+        lj92_pipeline = NULL;
+    }
+    lj92_shared_table_put(lj92_group);
+    lj92_group = NULL;
+#endif
+
     /* free block buffer */
-    if(mlv_block)
+    if(mlv_block_buf)
     {
-        free(mlv_block);
-        mlv_block = NULL;
+        free(mlv_block_buf);
+        mlv_block_buf = NULL;
     }
+    mlv_block = NULL;
 
     {
         float fps = main_header.sourceFpsNom / (float)main_header.sourceFpsDenom;
 
         print_msg(MSG_INFO, "Processed %d video frames at %2.2f FPS (%2.2f s)\n", vidf_frames_processed, fps, vidf_frames_processed / fps);
     }
+
+    if(dng_output)
+    {
+        double elapsed = get_time_sec() - start_time;
+
+        print_msg(MSG_INFO, "Wrote %d DNG frames in %2.2f s (%2.2f frames/s, %d thread%s)\n", dng_frames_written, elapsed, elapsed > 0 ? dng_frames_written / elapsed : 0.0, dng_threads, dng_threads > 1 ? "s" : "");
+    }
+
+#ifdef MLV_USE_LJ92
+    if(mlv_output && lj92_stats.frames)
+    {
+        double elapsed = get_time_sec() - start_time;
+
+        print_msg(MSG_INFO, "Compressed %d frames: %"PRIu64" -> %"PRIu64" bytes (%2.2f%% ratio), %2.2f MB/s per thread, %2.2f MB/s total (%d thread%s)\n",
+            lj92_stats.frames, lj92_stats.bytes_in, lj92_stats.bytes_out, lj92_stats.bytes_out * 100.0 / lj92_stats.bytes_in,
+            lj92_stats.encode_time > 0 ? lj92_stats.bytes_in / lj92_stats.encode_time / 1000000.0 : 0.0,
+            elapsed > 0 ? lj92_stats.bytes_in / elapsed / 1000000.0 : 0.0, compress_threads, compress_threads > 1 ? "s" : "");
+    }
+#endif
     
     /* in average mode, finalize average calculation and output the resulting average */
     if(average_mode)
@@ -4159,7 +5157,7 @@ abort:
         {
             print_msg(MSG_ERROR, "Averaged image, but no out file specified\n");
         }
-        else if(!average_samples)
+        else if(!avg_stack || !calib_frames(avg_stack))
         {
             print_msg(MSG_ERROR, "Number of averaged frames is zero. Cannot continue.\n");
         }
@@ -4167,63 +5165,39 @@ abort:
         {
             int old_depth = lv_rec_footer.raw_info.bits_per_pixel;
             int new_depth = bit_depth ? bit_depth : old_depth;
-            int new_pitch = video_xRes * new_depth / 8;
+            uint32_t average_samples = calib_frames(avg_stack);
+            int pixel_count = video_xRes * video_yRes;
             
-            print_msg(MSG_INFO, "Writing averaged frame with %dbpp\n", new_depth);
+            uint32_t *frame_sums = malloc(pixel_count * sizeof(uint32_t));
+            uint16_t *frame_pixels = malloc(pixel_count * sizeof(uint16_t));
             
-            /* average the pixels in vertical direction, so we will extract vertical banding noise */
-            if(average_vert)
+            if(!frame_sums || !frame_pixels)
             {
-                for(int x = 0; x < video_xRes; x++)
-                {
-                    uint64_t column = 0;
-                    
-                    for(int y = 0; y < video_yRes; y++)
-                    {
-                        column += frame_arith_buffer[y * video_xRes + x];
-                    }
-                    column /= video_yRes;
-                    for(int y = 0; y < video_yRes; y++)
-                    {
-                        frame_arith_buffer[y * video_xRes + x] = column;
-                    }
-                }
+                print_msg(MSG_ERROR, "Failed to allocate averaged frame\n");
             }
-            if(average_hor)
+            else if(!calib_finish(avg_stack, frame_sums))
             {
-                for(int y = 0; y < video_yRes; y++)
+                print_msg(MSG_ERROR, "Failed to stack %u frames\n", average_samples);
+            }
+            else
+            {
+                print_msg(MSG_INFO, "Writing averaged frame of %u frames with %dbpp\n", average_samples, new_depth);
+            
+                /* average the pixels in vertical direction, so we will extract vertical banding noise */
+                if(average_vert)
                 {
-                    uint64_t line = 0;
-                    
-                    for(int x = 0; x < video_xRes; x++)
-                    {
-                        line += frame_arith_buffer[y * video_xRes + x];
-                    }
-                    line /= video_yRes;
-                    for(int x = 0; x < video_xRes; x++)
-                    {
-
-                        frame_arith_buffer[y * video_xRes + x] = line;
-                    }
+                    calib_average_columns(frame_sums, video_xRes, video_yRes);
+                }
+                if(average_hor)
+                {
+                    calib_average_rows(frame_sums, video_xRes, video_yRes);
                 }
-            }
             
-            for(int y = 0; y < video_yRes; y++)
-            {
-                uint16_t *dst_line = (uint16_t *)&frame_buffer[y * new_pitch];
-                for(int x = 0; x < video_xRes; x++)
+                for(int pos = 0; pos < pixel_count; pos++)
                 {
-                    uint32_t value = frame_arith_buffer[y * video_xRes + x];
-                    
                     /* complete the averaging, minimizing the roundoff error */
-                    value = (value + average_samples/2) / average_samples;
-                    static int countz = 1;
-                    if(countz)
-                    {
-                        printf("avg[0] = %u samples = %u\n", value, average_samples);
-                        countz = 0;
-                    }
-                    
+                    uint32_t value = (frame_sums[pos] + average_samples/2) / average_samples;
+                
                     /* scale value when bit depth changed according to depth conversion in VIDF block */
                     if(old_depth != new_depth)
                     {
@@ -4231,30 +5205,34 @@ abort:
                         value += (1 << (15-old_depth));
                         value >>= (16-new_depth);
                     }
-
-                    bitinsert(dst_line, x, new_depth, value);
+                
+                    frame_pixels[pos] = value;
                 }
-            }
             
+                bitpack_pack(frame_pixels, (uint16_t *)frame_buffer, pixel_count, new_depth);
 
-            int frame_size = ((video_xRes * video_yRes * new_depth + 7) / 8);
+                int frame_size = ((video_xRes * video_yRes * new_depth + 7) / 8);
 
-            mlv_vidf_hdr_t hdr;
+                mlv_vidf_hdr_t hdr;
 
-            memset(&hdr, 0x00, sizeof(mlv_vidf_hdr_t));
-            memcpy(hdr.blockType, "VIDF", 4);
-            hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size;
-            hdr.frameNumber = 0;
-            hdr.timestamp = last_vidf.timestamp;
+                memset(&hdr, 0x00, sizeof(mlv_vidf_hdr_t));
+                memcpy(hdr.blockType, "VIDF", 4);
+                hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size;
+                hdr.frameNumber = 0;
+                hdr.timestamp = last_vidf.timestamp;
 
-            if(fwrite(&hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1)
-            {
-                print_msg(MSG_ERROR, "Failed writing average frame header into .MLV file\n");
-            }
-            if(fwrite(frame_buffer, frame_size, 1, out_file) != 1)
-            {
-                print_msg(MSG_ERROR, "Failed writing average frame data into .MLV file\n");
+                if(fwrite(&hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1)
+                {
+                    print_msg(MSG_ERROR, "Failed writing average frame header into .MLV file\n");
+                }
+                if(fwrite(frame_buffer, frame_size, 1, out_file) != 1)
+                {
+                    print_msg(MSG_ERROR, "Failed writing average frame data into .MLV file\n");
+                }
             }
+            
+            free(frame_sums);
+            free(frame_pixels);
         }
     }
 
@@ -4272,10 +5250,17 @@ abort:
 
     if(xref_mode && !autopsy_mode && !visualize)
     {
-        print_msg(MSG_INFO, "XREF table contains %d entries\n", frame_xref_entries);
-        xref_sort(frame_xref_table, frame_xref_entries);
-        save_index(input_filename, &main_header, in_file_count, frame_xref_table, frame_xref_entries);
+        print_msg(MSG_INFO, "XREF table contains %d entries\n", xref_index.count);
+        if(mlv_index_sort(&xref_index))
+        {
+            print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+        }
+        else
+        {
+            save_index(input_filename, &main_header, in_file_count, xref_index.entries, xref_index.count);
+        }
     }
+    mlv_index_free(&xref_index);
 
     /* fix frame count */
     if(mlv_output && !extract_block)
@@ -4295,7 +5280,12 @@ abort:
         main_header.videoFrameCount = vidf_frames_processed;
         main_header.audioFrameCount = audf_frames_processed;
 
-        if(compress_output)
+        if(compress_output && lzma_level >= 0)
+        {
+            main_header.videoClass |= MLV_VIDEO_CLASS_FLAG_LZMA;
+            main_header.videoClass &= ~MLV_VIDEO_CLASS_FLAG_LJ92;
+        }
+        else if(compress_output)
         {
             main_header.videoClass |= MLV_VIDEO_CLASS_FLAG_LJ92;
             main_header.videoClass &= ~MLV_VIDEO_CLASS_FLAG_LZMA;
@@ -4327,9 +5317,25 @@ abort:
             print_msg(MSG_ERROR, "Failed to rewrite header in .MLV file\n");
         }
     }
+
+    /* same as running -x on the output afterwards */
+    if(out_index)
+    {
+        print_msg(MSG_INFO, "XREF table of the output contains %d entries\n", out_index->count);
+        if(mlv_index_sort(out_index))
+        {
+            print_msg(MSG_ERROR, "Failed to allocate XREF table\n");
+        }
+        else
+        {
+            save_index(output_filename, &main_header, 1, out_index->entries, out_index->count);
+        }
+    }
+    mlv_index_free(&out_xref);
     
     
     /* free list of input files */
+    mlv_map_close(in_map);
     for(in_file_num = 0; in_file_num < in_file_count; in_file_num++)
     {
         fclose(in_files[in_file_num]);
@@ -4370,8 +5376,11 @@ abort:
     free(subtract_filename);
     free(output_filename);
     free(prev_frame_buffer);
-    free(frame_arith_buffer);
+    calib_free(avg_stack);
+    calib_ref_free(sub_ref);
+    calib_ref_free(flat_ref);
     free(block_xref);
+    mlv_lua_close(lua_state);
 
     print_msg(MSG_INFO, "Done\n");
     print_msg(MSG_INFO, "\n");
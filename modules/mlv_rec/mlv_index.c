@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef CONFIG_MAGICLANTERN
+#include <dryos.h>
+#include <raw.h>
+#else
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../src/raw.h"
+#endif
+
+#include "mlv_index.h"
+
+/* initial table size, doubled whenever it is full */
+#define MLV_INDEX_MIN_ENTRIES 1024
+
+void mlv_index_init(mlv_index_t *index)
+{
+    index->entries = NULL;
+    index->count = 0;
+    index->allocated = 0;
+}
+
+void mlv_index_free(mlv_index_t *index)
+{
+    if(index->entries)
+    {
+        free(index->entries);
+    }
+    mlv_index_init(index);
+}
+
+int mlv_index_add(mlv_index_t *index, uint64_t timestamp, uint64_t offset, uint16_t file_number, uint16_t frame_type)
+{
+    if(index->count >= index->allocated)
+    {
+        uint32_t allocated = index->allocated ? index->allocated * 2 : MLV_INDEX_MIN_ENTRIES;
+        frame_xref_t *entries = realloc(index->entries, allocated * sizeof(frame_xref_t));
+
+        if(!entries)
+        {
+            return -1;
+        }
+        index->entries = entries;
+        index->allocated = allocated;
+    }
+
+    frame_xref_t *entry = &index->entries[index->count++];
+
+    entry->frameTime = timestamp;
+    entry->frameOffset = offset;
+    entry->fileNumber = file_number;
+    entry->frameType = frame_type;
+
+    return 0;
+}
+
+int mlv_index_skip_block(mlv_hdr_t *hdr)
+{
+    return !memcmp(hdr->blockType, "NULL", 4) || !memcmp(hdr->blockType, "BKUP", 4);
+}
+
+/* MLVI headers have no timestamp, the version string is at its place. emulate timestamp zero */
+uint64_t mlv_index_block_time(mlv_hdr_t *hdr)
+{
+    return memcmp(hdr->blockType, "MLVI", 4) ? hdr->timestamp : 0;
+}
+
+int mlv_index_add_block(mlv_index_t *index, mlv_hdr_t *hdr, uint64_t offset, uint16_t file_number)
+{
+    if(mlv_index_skip_block(hdr))
+    {
+        return 0;
+    }
+
+    uint16_t frame_type =
+        !memcmp(hdr->blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
+        !memcmp(hdr->blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
+        MLV_FRAME_UNSPECIFIED;
+
+    return mlv_index_add(index, mlv_index_block_time(hdr), offset, file_number, frame_type);
+}
+
+/* heap of run numbers, ordered by the timestamp of their current head entry. ties go to the lower run, that keeps the merge stable */
+struct run_heap
+{
+    frame_xref_t *entries;
+    uint32_t *pos;
+    uint32_t *heap;
+    uint32_t size;
+};
+
+static int run_less(struct run_heap *h, uint32_t a, uint32_t b)
+{
+    uint64_t ta = h->entries[h->pos[a]].frameTime;
+    uint64_t tb = h->entries[h->pos[b]].frameTime;
+
+    return (ta < tb) || (ta == tb && a < b);
+}
+
+static void run_sift_down(struct run_heap *h, uint32_t node)
+{
+    while(1)
+    {
+        uint32_t smallest = node;
+        uint32_t left = 2 * node + 1;
+        uint32_t right = left + 1;
+
+        if(left < h->size && run_less(h, h->heap[left], h->heap[smallest]))
+        {
+            smallest = left;
+        }
+        if(right < h->size && run_less(h, h->heap[right], h->heap[smallest]))
+        {
+            smallest = right;
+        }
+        if(smallest == node)
+        {
+            break;
+        }
+
+        uint32_t tmp = h->heap[node];
+        h->heap[node] = h->heap[smallest];
+        h->heap[smallest] = tmp;
+        node = smallest;
+    }
+}
+
+int mlv_index_sort(mlv_index_t *index)
+{
+    frame_xref_t *entries = index->entries;
+    uint32_t count = index->count;
+
+    if(count < 2)
+    {
+        return 0;
+    }
+
+    /* count the ascending runs */
+    uint32_t runs = 1;
+    for(uint32_t i = 1; i < count; i++)
+    {
+        if(entries[i].frameTime < entries[i - 1].frameTime)
+        {
+            runs++;
+        }
+    }
+
+    if(runs == 1)
+    {
+        return 0;
+    }
+
+    /* start position of every run plus the end of the table */
+    uint32_t *bounds = malloc((runs + 1) * sizeof(uint32_t));
+    uint32_t *pos = malloc(runs * sizeof(uint32_t));
+    uint32_t *heap = malloc(runs * sizeof(uint32_t));
+    frame_xref_t *sorted = malloc(count * sizeof(frame_xref_t));
+
+    if(!bounds || !pos || !heap || !sorted)
+    {
+        free(bounds);
+        free(pos);
+        free(heap);
+        free(sorted);
+        return -1;
+    }
+
+    uint32_t run = 0;
+    bounds[run++] = 0;
+    for(uint32_t i = 1; i < count; i++)
+    {
+        if(entries[i].frameTime < entries[i - 1].frameTime)
+        {
+            bounds[run++] = i;
+        }
+    }
+    bounds[runs] = count;
+
+    struct run_heap h = { entries, pos, heap, runs };
+
+    for(uint32_t r = 0; r < runs; r++)
+    {
+        pos[r] = bounds[r];
+        heap[r] = r;
+    }
+    for(uint32_t node = runs / 2; node-- > 0; )
+    {
+        run_sift_down(&h, node);
+    }
+
+    /* k-way merge: always take the head of the run on top of the heap */
+    for(uint32_t out = 0; out < count; out++)
+    {
+        uint32_t top = heap[0];
+
+        sorted[out] = entries[pos[top]++];
+
+        if(pos[top] == bounds[top + 1])
+        {
+            /* run exhausted, replace it by the last one in the heap */
+            heap[0] = heap[--h.size];
+        }
+        run_sift_down(&h, 0);
+    }
+
+    free(bounds);
+    free(pos);
+    free(heap);
+    free(entries);
+
+    index->entries = sorted;
+    index->allocated = count;
+
+    return 0;
+}
+
+int mlv_index_merge_saved(mlv_index_t *index, const mlv_xref_t *saved, uint32_t saved_count, mlv_index_time_cb get_time, void *ctx)
+{
+    if(mlv_index_sort(index))
+    {
+        return -1;
+    }
+
+    uint32_t total = saved_count + index->count;
+    frame_xref_t *merged = malloc((total ? total : 1) * sizeof(frame_xref_t));
+
+    if(!merged)
+    {
+        return -1;
+    }
+
+    uint32_t out = 0;
+    uint32_t done = 0;
+    uint64_t lower = 0;
+
+    for(uint32_t entry = 0; entry <= index->count; entry++)
+    {
+        /* find the first saved entry that is later than the new one. on equal timestamps the saved one goes first,
+           it is from an older chunk. gallop forward from where the last search ended, then bisect */
+        uint32_t end = saved_count;
+        uint32_t known_pos = done;
+        uint64_t known_time = lower;
+
+        if(entry < index->count)
+        {
+            uint64_t time = index->entries[entry].frameTime;
+            uint32_t lo = done;
+            uint32_t hi = done;
+            uint32_t step = 1;
+
+            while(hi < saved_count)
+            {
+                uint64_t t = get_time(ctx, &saved[hi]);
+
+                if(t > time)
+                {
+                    break;
+                }
+                known_pos = hi;
+                known_time = t;
+                lo = hi + 1;
+                hi = done + step;
+                step *= 2;
+            }
+
+            if(hi > saved_count)
+            {
+                hi = saved_count;
+            }
+
+            /* first later entry is in [lo, hi] */
+            while(lo < hi)
+            {
+                uint32_t mid = lo + (hi - lo) / 2;
+                uint64_t t = get_time(ctx, &saved[mid]);
+
+                if(t > time)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    known_pos = mid;
+                    known_time = t;
+                    lo = mid + 1;
+                }
+            }
+            end = lo;
+        }
+
+        /* take over the saved entries in front of it, only timestamps that were fetched are known */
+        for(uint32_t pos = done; pos < end; pos++)
+        {
+            merged[out].frameTime = (pos >= known_pos) ? known_time : lower;
+            merged[out].frameOffset = saved[pos].frameOffset;
+            merged[out].fileNumber = saved[pos].fileNumber;
+            merged[out].frameType = saved[pos].frameType;
+            out++;
+        }
+        if(end > done)
+        {
+            lower = known_time;
+        }
+        done = end;
+
+        if(entry < index->count)
+        {
+            merged[out++] = index->entries[entry];
+            lower = index->entries[entry].frameTime;
+        }
+    }
+
+    free(index->entries);
+    index->entries = merged;
+    index->count = out;
+    index->allocated = total;
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_index_h_
+#define _mlv_index_h_
+
+#include <stdint.h>
+#include "mlv.h"
+
+/*
+   XREF index builder shared by mlv_dump and mlv_play.
+
+   blocks are appended chunk by chunk in file order. within a chunk they are already
+   almost sorted by timestamp, so sorting splits the table into its ascending runs and
+   does a k-way merge of them. this is O(n log k) instead of the O(n^2) bubble sort and
+   degrades gracefully to O(n log n) for badly interleaved files.
+   the sort is stable, so blocks with equal timestamps keep their file/chunk order.
+*/
+
+/* this structure is used to build the mlv_xref_t table */
+typedef struct
+{
+    uint64_t    frameTime;
+    uint64_t    frameOffset;
+    uint16_t    fileNumber;
+    uint16_t    frameType;
+} frame_xref_t;
+
+typedef struct
+{
+    frame_xref_t *entries;
+    uint32_t count;
+    uint32_t allocated;
+} mlv_index_t;
+
+/* returns the timestamp of a block referenced by a saved index entry, used for incremental updates */
+typedef uint64_t (*mlv_index_time_cb)(void *ctx, const mlv_xref_t *xref);
+
+void mlv_index_init(mlv_index_t *index);
+void mlv_index_free(mlv_index_t *index);
+
+/* append a block, returns 0 on success or -1 if out of memory */
+int mlv_index_add(mlv_index_t *index, uint64_t timestamp, uint64_t offset, uint16_t file_number, uint16_t frame_type);
+
+/* same, but derives timestamp and frame type from the block header like both tools did before */
+int mlv_index_add_block(mlv_index_t *index, mlv_hdr_t *hdr, uint64_t offset, uint16_t file_number);
+
+/* returns 1 for blocks that don't belong into an index (NULL and BKUP) */
+int mlv_index_skip_block(mlv_hdr_t *hdr);
+
+/* timestamp used for sorting, MLVI headers count as zero */
+uint64_t mlv_index_block_time(mlv_hdr_t *hdr);
+
+/* stable sort by timestamp, returns 0 on success or -1 if out of memory */
+int mlv_index_sort(mlv_index_t *index);
+
+/*
+   incremental mode: 'index' contains the blocks of chunks appended since 'saved' (sorted XREF
+   entries of an existing .IDX) was written. the result is the sorted union of both in 'index'.
+
+   .IDX files don't store timestamps, so they are fetched through 'get_time' only for the saved
+   entries close to where new blocks get inserted. usually that's just the tail of the last chunk.
+   frameTime of saved entries that were not fetched is set to a lower bound, which keeps the
+   table ordered but is not exact.
+*/
+int mlv_index_merge_saved(mlv_index_t *index, const mlv_xref_t *saved, uint32_t saved_count, mlv_index_time_cb get_time, void *ctx);
+
+#endif
@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mlv_lua.h"
+
+/* from mlv_dump.c */
+#define MSG_INFO     0
+#define MSG_ERROR    1
+void print_msg(uint32_t type, const char* format, ... );
+
+#if defined(USE_LUA)
+
+#include "lualib.h"
+#include "lauxlib.h"
+
+#define MLV_LUA_MAX_HOOKS 64
+#define MLV_LUA_VIEW "mlv.view"
+
+/* event names for mlv.register() and the suffixes of the global handler functions */
+static const char *event_names[MLV_LUA_EVENTS] = { "hdr", "data_read", "data_write", "data_write_raw", "data_write_dng", "data_write_mlv" };
+static const char *event_suffixes[MLV_LUA_EVENTS] = { "", "_data_read", "_data_write", "_data_write_raw", "_data_write_dng", "_data_write_mlv" };
+
+struct mlv_lua_hook
+{
+    uint32_t type;
+    int event;
+    int ref;            /* function in the registry */
+    int legacy;         /* handle_XXXX global: strings in, modified strings out */
+    char name[64];      /* for error messages */
+};
+
+/* block data a handler can see, only while it runs */
+struct mlv_lua_view
+{
+    uint8_t *ptr;
+    size_t len;
+};
+
+static struct
+{
+    int count;
+    struct mlv_lua_hook hooks[MLV_LUA_MAX_HOOKS];
+
+    /* event bit masks of all hooks, to skip blocks nobody asked for without searching */
+    uint32_t events;
+    int dng_saved_ref;
+
+    /* the two views passed to handlers, created once */
+    int hdr_view_ref;
+    int data_view_ref;
+} mlv_lua = { 0, { { 0, 0, 0, 0, "" } }, 0, LUA_NOREF, LUA_NOREF, LUA_NOREF };
+
+static uint32_t block_type(const uint8_t *type)
+{
+    uint32_t value;
+    memcpy(&value, type, 4);
+    return value;
+}
+
+static struct mlv_lua_hook *find_hook(uint32_t type, int event)
+{
+    for(int i = 0; i < mlv_lua.count; i++)
+    {
+        if(mlv_lua.hooks[i].type == type && mlv_lua.hooks[i].event == event)
+        {
+            return &mlv_lua.hooks[i];
+        }
+    }
+    return NULL;
+}
+
+/* takes the function on top of the stack, replaces an earlier hook for the same block and event */
+static int add_hook(lua_State *L, const char *type, int event, int legacy, const char *name)
+{
+    uint32_t type_id = block_type((const uint8_t *)type);
+    struct mlv_lua_hook *hook = find_hook(type_id, event);
+
+    if(hook)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, hook->ref);
+    }
+    else
+    {
+        if(mlv_lua.count >= MLV_LUA_MAX_HOOKS)
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+        hook = &mlv_lua.hooks[mlv_lua.count++];
+    }
+
+    hook->type = type_id;
+    hook->event = event;
+    hook->legacy = legacy;
+    hook->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    snprintf(hook->name, sizeof(hook->name), "%s", name);
+
+    mlv_lua.events |= 1 << event;
+    return 1;
+}
+
+/* block views ***********************************************************************************/
+
+static struct mlv_lua_view *check_view(lua_State *L, size_t offset, size_t size)
+{
+    struct mlv_lua_view *view = luaL_checkudata(L, 1, MLV_LUA_VIEW);
+    if(!view->ptr)
+    {
+        luaL_error(L, "block view used outside of its handler");
+    }
+    if(offset > view->len || size > view->len - offset)
+    {
+        luaL_error(L, "offset %d out of range (view has %d bytes)", (int)offset, (int)view->len);
+    }
+    return view;
+}
+
+static size_t check_offset(lua_State *L)
+{
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, offset >= 0, 2, "negative offset");
+    return (size_t)offset;
+}
+
+static void push_unsigned(lua_State *L, uint64_t value)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer)value);
+#else
+    /* 5.2 integers may be 32 bit */
+    lua_pushnumber(L, (lua_Number)value);
+#endif
+}
+
+static uint64_t check_unsigned(lua_State *L, int arg)
+{
+#if LUA_VERSION_NUM >= 503
+    return (uint64_t)luaL_checkinteger(L, arg);
+#else
+    return (uint64_t)luaL_checknumber(L, arg);
+#endif
+}
+
+/* MLV is little endian like all hosts mlv_dump runs on, so values are copied as they are */
+#define VIEW_GETTER(name, ctype) \
+static int view_##name(lua_State *L) \
+{ \
+    size_t offset = check_offset(L); \
+    struct mlv_lua_view *view = check_view(L, offset, sizeof(ctype)); \
+    ctype value; \
+    memcpy(&value, view->ptr + offset, sizeof(ctype)); \
+    push_unsigned(L, (uint64_t)value); \
+    return 1; \
+}
+
+#define VIEW_SIGNED_GETTER(name, ctype) \
+static int view_##name(lua_State *L) \
+{ \
+    size_t offset = check_offset(L); \
+    struct mlv_lua_view *view = check_view(L, offset, sizeof(ctype)); \
+    ctype value; \
+    memcpy(&value, view->ptr + offset, sizeof(ctype)); \
+    lua_pushinteger(L, (lua_Integer)value); \
+    return 1; \
+}
+
+#define VIEW_SETTER(name, ctype) \
+static int view_set_##name(lua_State *L) \
+{ \
+    size_t offset = check_offset(L); \
+    struct mlv_lua_view *view = check_view(L, offset, sizeof(ctype)); \
+    ctype value = (ctype)check_unsigned(L, 3); \
+    memcpy(view->ptr + offset, &value, sizeof(ctype)); \
+    return 0; \
+}
+
+VIEW_GETTER(u8, uint8_t)
+VIEW_GETTER(u16, uint16_t)
+VIEW_GETTER(u32, uint32_t)
+VIEW_GETTER(u64, uint64_t)
+VIEW_SIGNED_GETTER(i16, int16_t)
+VIEW_SIGNED_GETTER(i32, int32_t)
+VIEW_SETTER(u8, uint8_t)
+VIEW_SETTER(u16, uint16_t)
+VIEW_SETTER(u32, uint32_t)
+VIEW_SETTER(u64, uint64_t)
+
+/* view:string([offset [, length]]), a copy of the bytes */
+static int view_string(lua_State *L)
+{
+    struct mlv_lua_view *view = luaL_checkudata(L, 1, MLV_LUA_VIEW);
+    size_t offset = lua_isnoneornil(L, 2) ? 0 : check_offset(L);
+    check_view(L, offset, 0);
+    lua_Integer length = luaL_optinteger(L, 3, (lua_Integer)(view->len - offset));
+    luaL_argcheck(L, length >= 0, 3, "negative length");
+    check_view(L, offset, (size_t)length);
+
+    lua_pushlstring(L, (const char *)view->ptr + offset, (size_t)length);
+    return 1;
+}
+
+static int view_len(lua_State *L)
+{
+    struct mlv_lua_view *view = check_view(L, 0, 0);
+    lua_pushinteger(L, (lua_Integer)view->len);
+    return 1;
+}
+
+static const luaL_Reg view_methods[] =
+{
+    { "u8",      view_u8 },
+    { "u16",     view_u16 },
+    { "u32",     view_u32 },
+    { "u64",     view_u64 },
+    { "i16",     view_i16 },
+    { "i32",     view_i32 },
+    { "set_u8",  view_set_u8 },
+    { "set_u16", view_set_u16 },
+    { "set_u32", view_set_u32 },
+    { "set_u64", view_set_u64 },
+    { "string",  view_string },
+    { NULL, NULL }
+};
+
+static int new_view(lua_State *L)
+{
+    struct mlv_lua_view *view = lua_newuserdata(L, sizeof(struct mlv_lua_view));
+    view->ptr = NULL;
+    view->len = 0;
+    luaL_setmetatable(L, MLV_LUA_VIEW);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static struct mlv_lua_view *push_view(lua_State *L, int ref, void *ptr, int len)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    struct mlv_lua_view *view = lua_touserdata(L, -1);
+    view->ptr = ptr;
+    view->len = len > 0 ? len : 0;
+    return view;
+}
+
+/* mlv library ***********************************************************************************/
+
+/* mlv.register(type, [event,] function) */
+static int mlv_register(lua_State *L)
+{
+    size_t type_len = 0;
+    const char *type = luaL_checklstring(L, 1, &type_len);
+    luaL_argcheck(L, type_len == 4, 1, "block type must have 4 characters");
+
+    int event = MLV_LUA_HDR;
+    int func = 2;
+    if(lua_type(L, 2) == LUA_TSTRING)
+    {
+        const char *name = lua_tostring(L, 2);
+        for(event = 0; event < MLV_LUA_EVENTS; event++)
+        {
+            if(!strcmp(name, event_names[event]))
+            {
+                break;
+            }
+        }
+        luaL_argcheck(L, event < MLV_LUA_EVENTS, 2, "unknown event");
+        func = 3;
+    }
+    luaL_checktype(L, func, LUA_TFUNCTION);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%.4s %s handler", type, event_names[event]);
+
+    lua_pushvalue(L, func);
+    if(!add_hook(L, type, event, 0, name))
+    {
+        return luaL_error(L, "too many handlers registered");
+    }
+    return 0;
+}
+
+static const luaL_Reg mlv_lib[] =
+{
+    { "register", mlv_register },
+    { NULL, NULL }
+};
+
+/* handle_XXXX<suffix> globals of scripts written for the old interface */
+static void find_legacy_hooks(lua_State *L)
+{
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while(lua_next(L, -2))
+    {
+        /* key at -2, value at -1 */
+        if(lua_type(L, -2) == LUA_TSTRING && lua_isfunction(L, -1))
+        {
+            const char *name = lua_tostring(L, -2);
+            if(!strncmp(name, "handle_", 7) && strlen(name) >= 11)
+            {
+                for(int event = 0; event < MLV_LUA_EVENTS; event++)
+                {
+                    /* registered handlers take precedence */
+                    if(!strcmp(name + 11, event_suffixes[event]) && !find_hook(block_type((const uint8_t *)name + 7), event))
+                    {
+                        lua_pushvalue(L, -1);
+                        add_hook(L, name + 7, event, 1, name);
+                        break;
+                    }
+                }
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static int call_hook(lua_State *L, struct mlv_lua_hook *hook, int args, int results)
+{
+    if(lua_pcall(L, args, results, 0) != 0)
+    {
+        print_msg(MSG_INFO, "LUA: Error while calling '%s': '%s'\n", hook->name, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/* returned strings of the same size replace the header or data */
+static void legacy_result(struct mlv_lua_hook *hook, lua_State *L, int index, void *dst, int dst_len, const char *what)
+{
+    if(!lua_isstring(L, index))
+    {
+        return;
+    }
+
+    size_t len = 0;
+    const char *ret = lua_tolstring(L, index, &len);
+    if(len > 0 && (int)len == dst_len)
+    {
+        print_msg(MSG_INFO, "LUA: Function '%s' updated hdr data\n", hook->name);
+        memcpy(dst, ret, len);
+    }
+    else if(len)
+    {
+        print_msg(MSG_INFO, "LUA: Error while calling '%s': Returned %s size mismatch - %d instead of %d\n", hook->name, what, (int)len, dst_len);
+    }
+}
+
+lua_State *mlv_lua_init(const char *script)
+{
+    lua_State *L = luaL_newstate();
+    if(!L)
+    {
+        print_msg(MSG_ERROR, "LUA: Failed to init LUA library\n");
+        return NULL;
+    }
+
+    luaL_openlibs(L);
+
+    luaL_newlib(L, mlv_lib);
+    lua_setglobal(L, "mlv");
+
+    luaL_newmetatable(L, MLV_LUA_VIEW);
+    lua_newtable(L);
+    luaL_setfuncs(L, view_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, view_len);
+    lua_setfield(L, -2, "__len");
+    lua_pop(L, 1);
+
+    mlv_lua.hdr_view_ref = new_view(L);
+    mlv_lua.data_view_ref = new_view(L);
+
+    if(luaL_loadfile(L, script) != 0 || lua_pcall(L, 0, 0, 0) != 0)
+    {
+        print_msg(MSG_ERROR, "LUA: Failed to load script: %s\n", lua_tostring(L, -1));
+        mlv_lua_close(L);
+        return NULL;
+    }
+
+    lua_getglobal(L, "init");
+    if(lua_isfunction(L, -1))
+    {
+        if(lua_pcall(L, 0, 0, 0) != 0)
+        {
+            print_msg(MSG_ERROR, "LUA: Failed to call 'init' in script: %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+
+    find_legacy_hooks(L);
+
+    lua_getglobal(L, "dng_saved");
+    if(lua_isfunction(L, -1))
+    {
+        mlv_lua.dng_saved_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+
+    return L;
+}
+
+void mlv_lua_close(lua_State *L)
+{
+    if(!L)
+    {
+        return;
+    }
+    lua_close(L);
+    mlv_lua.count = 0;
+    mlv_lua.events = 0;
+    mlv_lua.dng_saved_ref = LUA_NOREF;
+}
+
+int mlv_lua_wants(lua_State *L, const uint8_t *type, int event)
+{
+    if(!L || !(mlv_lua.events & (1 << event)))
+    {
+        return 0;
+    }
+    return find_hook(block_type(type), event) != NULL;
+}
+
+int mlv_lua_wants_frames(lua_State *L)
+{
+    if(!L)
+    {
+        return 0;
+    }
+    return (mlv_lua.events & ~(1 << MLV_LUA_HDR)) || mlv_lua.dng_saved_ref != LUA_NOREF;
+}
+
+void mlv_lua_hook(lua_State *L, const uint8_t *type, int event, void *hdr, int hdr_len, void *data, int data_len)
+{
+    if(!L || !(mlv_lua.events & (1 << event)))
+    {
+        return;
+    }
+
+    struct mlv_lua_hook *hook = find_hook(block_type(type), event);
+    if(!hook)
+    {
+        return;
+    }
+
+    int args = data ? 2 : 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hook->ref);
+
+    if(hook->legacy)
+    {
+        lua_pushlstring(L, hdr, hdr_len);
+        if(data)
+        {
+            lua_pushlstring(L, data, data_len);
+        }
+
+        if(call_hook(L, hook, args, args))
+        {
+            legacy_result(hook, L, -args, hdr, hdr_len, "header");
+            if(data)
+            {
+                legacy_result(hook, L, -1, data, data_len, "data");
+            }
+            lua_pop(L, args);
+        }
+        return;
+    }
+
+    struct mlv_lua_view *hdr_view = push_view(L, mlv_lua.hdr_view_ref, hdr, hdr_len);
+    struct mlv_lua_view *data_view = NULL;
+    if(data)
+    {
+        data_view = push_view(L, mlv_lua.data_view_ref, data, data_len);
+    }
+
+    call_hook(L, hook, args, 0);
+
+    /* the buffers are reused, a view kept by the script must not reach them later */
+    hdr_view->ptr = NULL;
+    hdr_view->len = 0;
+    if(data_view)
+    {
+        data_view->ptr = NULL;
+        data_view->len = 0;
+    }
+}
+
+void mlv_lua_dng_saved(lua_State *L, const char *filename, uint32_t frame_number)
+{
+    if(!L || mlv_lua.dng_saved_ref == LUA_NOREF)
+    {
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, mlv_lua.dng_saved_ref);
+    lua_pushstring(L, filename);
+    lua_pushinteger(L, frame_number);
+    if(lua_pcall(L, 2, 0, 0) != 0)
+    {
+        print_msg(MSG_INFO, "LUA: Error while calling 'dng_saved': '%s'\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+#else
+
+lua_State *mlv_lua_init(const char *script)
+{
+    (void)script;
+    print_msg(MSG_ERROR, "LUA support not compiled into this binary\n");
+    return NULL;
+}
+
+void mlv_lua_close(lua_State *L)
+{
+    (void)L;
+}
+
+int mlv_lua_wants(lua_State *L, const uint8_t *type, int event)
+{
+    (void)L;
+    (void)type;
+    (void)event;
+    return 0;
+}
+
+int mlv_lua_wants_frames(lua_State *L)
+{
+    (void)L;
+    return 0;
+}
+
+void mlv_lua_hook(lua_State *L, const uint8_t *type, int event, void *hdr, int hdr_len, void *data, int data_len)
+{
+    (void)L;
+    (void)type;
+    (void)event;
+    (void)hdr;
+    (void)hdr_len;
+    (void)data;
+    (void)data_len;
+}
+
+void mlv_lua_dng_saved(lua_State *L, const char *filename, uint32_t frame_number)
+{
+    (void)L;
+    (void)filename;
+    (void)frame_number;
+}
+
+#endif
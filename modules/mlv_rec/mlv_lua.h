@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_lua_h_
+#define _mlv_lua_h_
+
+#include <stdint.h>
+
+#if defined(USE_LUA)
+#include "lua.h"
+#else
+typedef void lua_State;
+#endif
+
+/*
+   Lua hooks of mlv_dump.
+
+   scripts register the blocks they want to see, all other blocks cost a table lookup:
+
+     mlv.register("EXPO", function(hdr) print(hdr:u32(20)) end)
+     mlv.register("VIDF", "data_write_dng", function(hdr, data) data:set_u16(0, 0) end)
+
+   handlers get zero-copy views of the header and data with typed accessors
+   (u8/u16/u32/u64/i16/i32 and set_*, byte offsets from 0, little endian), :string()
+   copies bytes out, #view is the size. views are only valid during the call.
+
+   global functions named handle_<type><suffix> (e.g. handle_RTCI, handle_VIDF_data_write)
+   still work as before: they get the block as strings and may return modified copies.
+   they are looked up once after the script ran init().
+*/
+
+enum mlv_lua_event
+{
+    MLV_LUA_HDR = 0,                /* every block as read, "hdr" */
+    MLV_LUA_DATA_READ,              /* VIDF payload as read, "data_read" */
+    MLV_LUA_DATA_WRITE,             /* processed frame, "data_write" */
+    MLV_LUA_DATA_WRITE_RAW,         /* before writing into a legacy RAW, "data_write_raw" */
+    MLV_LUA_DATA_WRITE_DNG,         /* before writing a DNG, "data_write_dng" */
+    MLV_LUA_DATA_WRITE_MLV,         /* before writing into a MLV, "data_write_mlv" */
+    MLV_LUA_EVENTS
+};
+
+/* load 'script', call its init() and collect the hooks. returns NULL on failure */
+lua_State *mlv_lua_init(const char *script);
+void mlv_lua_close(lua_State *L);
+
+/* 1 if a hook is registered for blocks of 'type' on 'event' */
+int mlv_lua_wants(lua_State *L, const uint8_t *type, int event);
+
+/* 1 if the script looks at frame data or saved DNGs, so frames must be processed one by one in file order */
+int mlv_lua_wants_frames(lua_State *L);
+
+/* call the hooks of 'type' on 'event'. 'data' may be NULL */
+void mlv_lua_hook(lua_State *L, const uint8_t *type, int event, void *hdr, int hdr_len, void *data, int data_len);
+
+/* dng_saved(filename, frame_number) of the script */
+void mlv_lua_dng_saved(lua_State *L, const char *filename, uint32_t frame_number);
+
+#endif
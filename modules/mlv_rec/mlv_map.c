@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __WIN32
+/* fileno, mmap and posix_madvise */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include "mlv_map.h"
+
+struct mlv_map_chunk
+{
+    uint8_t *base;
+    uint64_t size;
+#ifdef __WIN32
+    HANDLE mapping;
+#endif
+};
+
+struct mlv_map
+{
+    struct mlv_map_chunk *chunks;
+    int count;
+};
+
+static int mlv_map_chunk(struct mlv_map_chunk *chunk, FILE *file)
+{
+#ifdef __WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER size;
+
+    if(handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &size))
+    {
+        return -1;
+    }
+
+    chunk->size = size.QuadPart;
+    if(chunk->size == 0)
+    {
+        return 0;
+    }
+    if(chunk->size > (uint64_t)SIZE_MAX)
+    {
+        return -1;
+    }
+
+    /* copy-on-write, changes never reach the file */
+    chunk->mapping = CreateFileMapping(handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if(!chunk->mapping)
+    {
+        return -1;
+    }
+
+    chunk->base = MapViewOfFile(chunk->mapping, FILE_MAP_COPY, 0, 0, 0);
+    if(!chunk->base)
+    {
+        CloseHandle(chunk->mapping);
+        chunk->mapping = NULL;
+        return -1;
+    }
+#else
+    struct stat st;
+
+    if(fstat(fileno(file), &st))
+    {
+        return -1;
+    }
+
+    chunk->size = st.st_size;
+    if(chunk->size == 0)
+    {
+        return 0;
+    }
+    if(chunk->size > (uint64_t)SIZE_MAX)
+    {
+        return -1;
+    }
+
+    /* private mapping, writes go to a copy of the page and never reach the file */
+    void *base = mmap(NULL, chunk->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    if(base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    /* blocks are mostly processed in file order */
+    posix_madvise(base, chunk->size, POSIX_MADV_SEQUENTIAL);
+    chunk->base = base;
+#endif
+    return 0;
+}
+
+static void mlv_unmap_chunk(struct mlv_map_chunk *chunk)
+{
+    if(!chunk->base)
+    {
+        return;
+    }
+#ifdef __WIN32
+    UnmapViewOfFile(chunk->base);
+    CloseHandle(chunk->mapping);
+#else
+    munmap(chunk->base, chunk->size);
+#endif
+    chunk->base = NULL;
+}
+
+mlv_map_t *mlv_map_open(FILE **files, int count)
+{
+    mlv_map_t *map = calloc(1, sizeof(mlv_map_t));
+    if(!map)
+    {
+        return NULL;
+    }
+
+    map->chunks = calloc(count, sizeof(struct mlv_map_chunk));
+    if(!map->chunks)
+    {
+        free(map);
+        return NULL;
+    }
+
+    for(int chunk = 0; chunk < count; chunk++)
+    {
+        if(mlv_map_chunk(&map->chunks[chunk], files[chunk]))
+        {
+            mlv_map_close(map);
+            return NULL;
+        }
+        map->count++;
+    }
+
+    return map;
+}
+
+void mlv_map_close(mlv_map_t *map)
+{
+    if(!map)
+    {
+        return;
+    }
+
+    for(int chunk = 0; chunk < map->count; chunk++)
+    {
+        mlv_unmap_chunk(&map->chunks[chunk]);
+    }
+
+    free(map->chunks);
+    free(map);
+}
+
+uint64_t mlv_map_size(mlv_map_t *map, int chunk)
+{
+    if(chunk < 0 || chunk >= map->count)
+    {
+        return 0;
+    }
+    return map->chunks[chunk].size;
+}
+
+void *mlv_map_get(mlv_map_t *map, int chunk, uint64_t offset, uint64_t length)
+{
+    if(chunk < 0 || chunk >= map->count)
+    {
+        return NULL;
+    }
+
+    struct mlv_map_chunk *c = &map->chunks[chunk];
+
+    if(offset > c->size || length > c->size - offset || !c->base)
+    {
+        return NULL;
+    }
+
+    return c->base + offset;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_map_h_
+#define _mlv_map_h_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+   memory mapped access to the chunks of a MLV file for the host tools.
+
+   every chunk is mapped as a whole and blocks are handed out as pointers into the mapping,
+   so reading a block costs neither a syscall nor a copy. the mapping is private and writable:
+   patching a header in place (e.g. fixing a broken block size) only touches a private copy
+   of that page, the file itself is never modified.
+
+   mapping fails if the address space is too small (32 bit hosts with large files) or the
+   file system doesn't support it. callers then fall back to fread().
+*/
+
+typedef struct mlv_map mlv_map_t;
+
+/* map all 'count' chunks, returns NULL if any of them can't be mapped */
+mlv_map_t *mlv_map_open(FILE **files, int count);
+void mlv_map_close(mlv_map_t *map);
+
+/* size of a chunk in bytes */
+uint64_t mlv_map_size(mlv_map_t *map, int chunk);
+
+/* pointer to 'length' bytes at 'offset' within a chunk, NULL if the chunk doesn't contain all of them */
+void *mlv_map_get(mlv_map_t *map, int chunk, uint64_t offset, uint64_t length);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "pipeline.h"
+
+enum slot_state
+{
+    SLOT_FREE = 0,
+    SLOT_QUEUED,
+    SLOT_DONE
+};
+
+struct slot
+{
+    void *job;
+    int state;
+};
+
+struct pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    pipeline_work_cb work;
+    pipeline_write_cb write;
+    void *ctx;
+
+    /* ring of 'depth' slots, indexed by sequence number modulo depth */
+    struct slot *slots;
+    int depth;
+
+    /* sequence numbers: next to submit, next to process, next to write */
+    uint64_t next_submit;
+    uint64_t next_work;
+    uint64_t next_write;
+
+    int error;
+    int closing;
+
+    int workers;
+    pthread_t *worker_threads;
+    pthread_t writer_thread;
+};
+
+struct worker_arg
+{
+    pipeline_t *pipeline;
+    int index;
+};
+
+static void *pipeline_worker(void *arg)
+{
+    struct worker_arg *wa = (struct worker_arg *)arg;
+    pipeline_t *p = wa->pipeline;
+    int index = wa->index;
+
+    free(wa);
+
+    pthread_mutex_lock(&p->lock);
+    while(1)
+    {
+        while(p->next_work == p->next_submit && !p->closing)
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+
+        if(p->next_work == p->next_submit)
+        {
+            break;
+        }
+
+        uint64_t seq = p->next_work++;
+        struct slot *slot = &p->slots[seq % p->depth];
+        int error = p->error;
+
+        /* don't hold the lock while processing, that's the whole point */
+        pthread_mutex_unlock(&p->lock);
+        if(!error)
+        {
+            error = p->work(p->ctx, index, slot->job);
+        }
+        pthread_mutex_lock(&p->lock);
+
+        if(error && !p->error)
+        {
+            p->error = error;
+        }
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+
+    pthread_mutex_lock(&p->lock);
+    while(1)
+    {
+        struct slot *slot = &p->slots[p->next_write % p->depth];
+
+        while(!(p->next_write < p->next_submit && slot->state == SLOT_DONE) && !(p->closing && p->next_write == p->next_submit))
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+
+        if(p->next_write == p->next_submit)
+        {
+            break;
+        }
+
+        int error = p->error;
+
+        pthread_mutex_unlock(&p->lock);
+        int ret = p->write(p->ctx, slot->job, error);
+        pthread_mutex_lock(&p->lock);
+
+        if(ret && !p->error)
+        {
+            p->error = ret;
+        }
+        slot->job = NULL;
+        slot->state = SLOT_FREE;
+        p->next_write++;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+pipeline_t *pipeline_create(int workers, int depth, pipeline_work_cb work, pipeline_write_cb write, void *ctx)
+{
+    if(workers < 1 || depth < 1 || !work || !write)
+    {
+        return NULL;
+    }
+
+    pipeline_t *p = calloc(1, sizeof(pipeline_t));
+    if(!p)
+    {
+        return NULL;
+    }
+
+    p->slots = calloc(depth, sizeof(struct slot));
+    p->worker_threads = calloc(workers, sizeof(pthread_t));
+    if(!p->slots || !p->worker_threads)
+    {
+        free(p->slots);
+        free(p->worker_threads);
+        free(p);
+        return NULL;
+    }
+
+    p->work = work;
+    p->write = write;
+    p->ctx = ctx;
+    p->depth = depth;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    for(int i = 0; i < workers; i++)
+    {
+        struct worker_arg *wa = malloc(sizeof(struct worker_arg));
+        if(!wa)
+        {
+            break;
+        }
+        wa->pipeline = p;
+        wa->index = i;
+
+        if(pthread_create(&p->worker_threads[i], NULL, pipeline_worker, wa))
+        {
+            free(wa);
+            break;
+        }
+        p->workers++;
+    }
+
+    if(!p->workers || pthread_create(&p->writer_thread, NULL, pipeline_writer, p))
+    {
+        /* let the workers that did start terminate before giving up */
+        pthread_mutex_lock(&p->lock);
+        p->closing = 1;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+
+        for(int i = 0; i < p->workers; i++)
+        {
+            pthread_join(p->worker_threads[i], NULL);
+        }
+        pthread_cond_destroy(&p->changed);
+        pthread_mutex_destroy(&p->lock);
+        free(p->slots);
+        free(p->worker_threads);
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int pipeline_submit(pipeline_t *p, void *job)
+{
+    pthread_mutex_lock(&p->lock);
+
+    /* wait until the writer released the slot this job will use */
+    struct slot *slot = &p->slots[p->next_submit % p->depth];
+    while(slot->state != SLOT_FREE)
+    {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+
+    slot->job = job;
+    slot->state = SLOT_QUEUED;
+    p->next_submit++;
+    pthread_cond_broadcast(&p->changed);
+
+    int error = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    return error;
+}
+
+int pipeline_finish(pipeline_t *p)
+{
+    if(!p)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+
+    for(int i = 0; i < p->workers; i++)
+    {
+        pthread_join(p->worker_threads[i], NULL);
+    }
+    pthread_join(p->writer_thread, NULL);
+
+    int error = p->error;
+
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+    free(p->slots);
+    free(p->worker_threads);
+    free(p);
+
+    return error;
+}
+
+int pipeline_cpu_count()
+{
+#ifdef __WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = info.dwNumberOfProcessors;
+#else
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count < 1 ? 1 : count;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _pipeline_h_
+#define _pipeline_h_
+
+/*
+   ordered frame pipeline for the host tools:
+
+     caller (reader) --pipeline_submit()--> N workers --> writer thread
+
+   jobs are opaque pointers. 'work' runs on any worker thread, in parallel and in any order.
+   'write' runs on a single writer thread, strictly in the order the jobs were submitted.
+   at most 'depth' jobs are in flight, pipeline_submit() blocks until a slot is free,
+   so memory use stays bounded no matter how fast the reader is.
+
+   the first non-zero value returned by 'work' or 'write' is latched. after that, no more
+   jobs are processed, remaining jobs are only handed to 'write' with the error code so
+   they can be freed, and pipeline_submit()/pipeline_finish() return the error.
+*/
+
+typedef struct pipeline pipeline_t;
+
+/* process one job on worker thread 'worker' (0 ... workers-1) */
+typedef int (*pipeline_work_cb)(void *ctx, int worker, void *job);
+
+/* consume one job in submission order. 'error' is non-zero if the pipeline already failed */
+typedef int (*pipeline_write_cb)(void *ctx, void *job, int error);
+
+pipeline_t *pipeline_create(int workers, int depth, pipeline_work_cb work, pipeline_write_cb write, void *ctx);
+int pipeline_submit(pipeline_t *pipeline, void *job);
+int pipeline_finish(pipeline_t *pipeline);
+
+/* number of online CPUs, used as default for the thread count switches */
+int pipeline_cpu_count();
+
+#endif
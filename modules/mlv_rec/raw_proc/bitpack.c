@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "bitpack.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITPACK_X86
+#include <immintrin.h>
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define KERNEL static inline __attribute__((always_inline))
+#endif
+
+void bitinsert(uint16_t *dst, int position, int depth, uint16_t new_value)
+{
+    uint16_t old_value = 0;
+    int dst_pos = position * depth / 16;
+    int bits_to_left = ((depth * position) - (16 * dst_pos)) % 16;
+    int shift_right = 16 - depth - bits_to_left;
+
+    old_value = dst[dst_pos];
+    if(shift_right >= 0)
+    {
+        /* this case is a bit simpler. the word fits into this uint16_t */
+        uint16_t mask = ((1<<depth)-1) << shift_right;
+
+        /* shift and mask out */
+        new_value <<= shift_right;
+        new_value &= mask;
+        old_value &= ~mask;
+
+        /* now combine */
+        new_value |= old_value;
+        dst[dst_pos] = new_value;
+    }
+    else
+    {
+        /* here we need two operations as the bits are split over two words */
+        uint16_t mask1 = ((1<<(depth + shift_right))-1);
+        uint16_t mask2 = ((1<<(-shift_right))-1) << (16+shift_right);
+
+        /* write the upper bits */
+        old_value &= ~mask1;
+        old_value |= (new_value >> (-shift_right)) & mask1;
+        dst[dst_pos] = old_value;
+
+        /* write the lower bits */
+        old_value = dst[dst_pos + 1];
+        old_value &= ~mask2;
+        old_value |= (new_value << (16+shift_right)) & mask2;
+        dst[dst_pos + 1] = old_value;
+    }
+}
+
+uint16_t bitextract(const uint16_t *src, int position, int depth)
+{
+    uint16_t value = 0;
+    int src_pos = position * depth / 16;
+    int bits_to_left = ((depth * position) - (16 * src_pos)) % 16;
+    int shift_right = 16 - depth - bits_to_left;
+
+    value = src[src_pos];
+
+    if(shift_right >= 0)
+    {
+        value >>= shift_right;
+    }
+    else
+    {
+        value <<= -shift_right;
+        value |= src[src_pos + 1] >> (16 + shift_right);
+    }
+    value &= (1<<depth) - 1;
+
+    return value;
+}
+
+/* normalize to 16 bits with a bias of 0.5 LSB (the depth reduction simply discarded the lower bits), then scale to the new depth */
+static uint16_t bitpack_convert_value(uint16_t value, int old_depth, int new_depth)
+{
+    value <<= (16 - old_depth);
+    if(old_depth < 16)
+    {
+        value += (1 << (15 - old_depth));
+    }
+    value >>= (16 - new_depth);
+
+    return value;
+}
+
+static void bitpack_swap_words(uint16_t *buf, uint32_t start, uint32_t end)
+{
+    for(uint32_t pos = start; pos < end; pos++)
+    {
+        buf[pos] = (uint16_t)((buf[pos] >> 8) | (buf[pos] << 8));
+    }
+}
+
+#ifdef BITPACK_X86
+
+/*
+   a group of 8 pixels with B bits each is a big endian bit string of 8*B bits, stored in B/2 words.
+   after reversing the word order of a 16 byte load it is the top 8*B bits of a 128 bit number N:
+
+       N = (U << (128 - 4*B)) | (L << (128 - 8*B))
+
+   with U and L being pixels 0-3 and 4-7 as 4*B bit numbers. SSE has no 128 bit shifts, but
+   4*B <= 64 so U and L fit into the 64 bit lanes and N can be assembled from 64 bit shifts.
+   U and L are split into pairs of pixels in the 32 bit lanes and those into single pixels.
+   packing does the same in reverse, combining the pairs with pmaddwd.
+*/
+
+KERNEL TARGET_SSE2 __m128i sse2_reverse_words(__m128i v)
+{
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+KERNEL TARGET_SSE2 __m128i sse2_swap_bytes(__m128i v)
+{
+    return _mm_or_si128(_mm_srli_epi16(v, 8), _mm_slli_epi16(v, 8));
+}
+
+/* B bytes (from a 16 byte load) to 8 pixels */
+KERNEL TARGET_SSE2 __m128i sse2_unpack_group(__m128i v, const int B)
+{
+    if(B == 16)
+    {
+        return v;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    v = sse2_reverse_words(v);
+
+    /* [U, L] */
+    __m128i u = _mm_srli_epi64(_mm_unpackhi_epi64(v, zero), 64 - 4 * B);
+    __m128i l = _mm_or_si128(_mm_slli_epi64(v, 8 * B - 64), _mm_srli_epi64(_mm_slli_si128(v, 8), 128 - 8 * B));
+    l = _mm_and_si128(l, _mm_set_epi64x((1LL << (4 * B)) - 1, 0));
+    v = _mm_or_si128(u, l);
+
+    /* pairs of pixels in the 32 bit lanes */
+    v = _mm_or_si128(_mm_srli_epi64(v, 2 * B), _mm_slli_epi64(_mm_and_si128(v, _mm_set1_epi64x((1LL << (2 * B)) - 1)), 32));
+
+    /* single pixels in the 16 bit lanes */
+    return _mm_or_si128(_mm_srli_epi32(v, B), _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32((1 << B) - 1)), 16));
+}
+
+/* 8 pixels to B bytes at the start of the result, the rest is zero */
+KERNEL TARGET_SSE2 __m128i sse2_pack_group(__m128i v, const int B)
+{
+    if(B == 16)
+    {
+        return v;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    /* pairs of pixels: p0 * 2^B + p1 */
+    v = _mm_and_si128(v, _mm_set1_epi16((1 << B) - 1));
+    v = _mm_madd_epi16(v, _mm_set1_epi32((1 << 16) | (1 << B)));
+
+    /* [U, L] */
+    v = _mm_add_epi64(_mm_mul_epu32(v, _mm_set1_epi32(1 << (2 * B))), _mm_srli_epi64(v, 32));
+
+    /* N */
+    __m128i hi = _mm_slli_epi64(_mm_unpacklo_epi64(zero, v), 64 - 4 * B);
+    __m128i mid = _mm_srli_epi64(_mm_unpackhi_epi64(zero, v), 8 * B - 64);
+    __m128i lo = _mm_slli_epi64(_mm_unpackhi_epi64(v, zero), 128 - 8 * B);
+    v = _mm_or_si128(_mm_or_si128(hi, mid), lo);
+
+    return sse2_reverse_words(v);
+}
+
+KERNEL TARGET_SSE2 __m128i sse2_convert_pixels(__m128i v, const int A, const int B)
+{
+    v = _mm_slli_epi16(v, 16 - A);
+    if(A < 16)
+    {
+        v = _mm_add_epi16(v, _mm_set1_epi16(1 << (15 - A)));
+    }
+    return _mm_srli_epi16(v, 16 - B);
+}
+
+KERNEL TARGET_SSE2 __m128i sse2_load_group(const uint8_t *in, const int B)
+{
+    uint8_t tmp[16] = { 0 };
+
+    memcpy(tmp, in, B);
+    return _mm_loadu_si128((const __m128i *)tmp);
+}
+
+KERNEL TARGET_SSE2 void sse2_store_group(uint8_t *out, __m128i v, const int B)
+{
+    uint8_t tmp[16];
+
+    _mm_storeu_si128((__m128i *)tmp, v);
+    memcpy(out, tmp, B);
+}
+
+/*
+   the runs process 'groups' groups of 8 pixels. loads and stores are 16 bytes, so they overlap
+   the following group and would run past the end of the packed data for the last group(s).
+   those go through a temporary buffer.
+*/
+
+KERNEL TARGET_SSE2 void sse2_unpack_run(const uint8_t *in, uint16_t *out, size_t groups, const int B)
+{
+    size_t g = 0;
+
+    for(; (groups - g) * B >= 16; g++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&in[g * B]);
+        _mm_storeu_si128((__m128i *)&out[g * 8], sse2_unpack_group(v, B));
+    }
+    for(; g < groups; g++)
+    {
+        _mm_storeu_si128((__m128i *)&out[g * 8], sse2_unpack_group(sse2_load_group(&in[g * B], B), B));
+    }
+}
+
+KERNEL TARGET_SSE2 void sse2_pack_run(const uint16_t *in, uint8_t *out, size_t groups, const int B, const int swap)
+{
+    size_t g = 0;
+
+    for(; (groups - g) * B >= 16; g++)
+    {
+        __m128i v = sse2_pack_group(_mm_loadu_si128((const __m128i *)&in[g * 8]), B);
+        _mm_storeu_si128((__m128i *)&out[g * B], swap ? sse2_swap_bytes(v) : v);
+    }
+    for(; g < groups; g++)
+    {
+        __m128i v = sse2_pack_group(_mm_loadu_si128((const __m128i *)&in[g * 8]), B);
+        sse2_store_group(&out[g * B], swap ? sse2_swap_bytes(v) : v, B);
+    }
+}
+
+KERNEL TARGET_SSE2 void sse2_convert_run(const uint8_t *in, uint8_t *out, size_t groups, const int A, const int B)
+{
+    for(size_t g = 0; g < groups; g++)
+    {
+        __m128i v = ((groups - g) * A >= 16)
+            ? _mm_loadu_si128((const __m128i *)&in[g * A])
+            : sse2_load_group(&in[g * A], A);
+
+        v = sse2_pack_group(sse2_convert_pixels(sse2_unpack_group(v, A), A, B), B);
+
+        if((groups - g) * B >= 16)
+        {
+            _mm_storeu_si128((__m128i *)&out[g * B], v);
+        }
+        else
+        {
+            sse2_store_group(&out[g * B], v, B);
+        }
+    }
+}
+
+/* AVX2 does the same in both 128 bit lanes, lane 1 holds the group after the one in lane 0 */
+
+KERNEL TARGET_AVX2 __m256i avx2_reverse_words(__m256i v)
+{
+    v = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm256_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+KERNEL TARGET_AVX2 __m256i avx2_swap_bytes(__m256i v)
+{
+    return _mm256_or_si256(_mm256_srli_epi16(v, 8), _mm256_slli_epi16(v, 8));
+}
+
+KERNEL TARGET_AVX2 __m256i avx2_unpack_group(__m256i v, const int B)
+{
+    if(B == 16)
+    {
+        return v;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+    const int64_t mask = (1LL << (4 * B)) - 1;
+
+    v = avx2_reverse_words(v);
+
+    __m256i u = _mm256_srli_epi64(_mm256_unpackhi_epi64(v, zero), 64 - 4 * B);
+    __m256i l = _mm256_or_si256(_mm256_slli_epi64(v, 8 * B - 64), _mm256_srli_epi64(_mm256_slli_si256(v, 8), 128 - 8 * B));
+    l = _mm256_and_si256(l, _mm256_set_epi64x(mask, 0, mask, 0));
+    v = _mm256_or_si256(u, l);
+
+    v = _mm256_or_si256(_mm256_srli_epi64(v, 2 * B), _mm256_slli_epi64(_mm256_and_si256(v, _mm256_set1_epi64x((1LL << (2 * B)) - 1)), 32));
+
+    return _mm256_or_si256(_mm256_srli_epi32(v, B), _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32((1 << B) - 1)), 16));
+}
+
+KERNEL TARGET_AVX2 __m256i avx2_pack_group(__m256i v, const int B)
+{
+    if(B == 16)
+    {
+        return v;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+
+    v = _mm256_and_si256(v, _mm256_set1_epi16((1 << B) - 1));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32((1 << 16) | (1 << B)));
+
+    v = _mm256_add_epi64(_mm256_mul_epu32(v, _mm256_set1_epi32(1 << (2 * B))), _mm256_srli_epi64(v, 32));
+
+    __m256i hi = _mm256_slli_epi64(_mm256_unpacklo_epi64(zero, v), 64 - 4 * B);
+    __m256i mid = _mm256_srli_epi64(_mm256_unpackhi_epi64(zero, v), 8 * B - 64);
+    __m256i lo = _mm256_slli_epi64(_mm256_unpackhi_epi64(v, zero), 128 - 8 * B);
+    v = _mm256_or_si256(_mm256_or_si256(hi, mid), lo);
+
+    return avx2_reverse_words(v);
+}
+
+KERNEL TARGET_AVX2 __m256i avx2_convert_pixels(__m256i v, const int A, const int B)
+{
+    v = _mm256_slli_epi16(v, 16 - A);
+    if(A < 16)
+    {
+        v = _mm256_add_epi16(v, _mm256_set1_epi16(1 << (15 - A)));
+    }
+    return _mm256_srli_epi16(v, 16 - B);
+}
+
+/* two groups, 'B' bytes apart */
+KERNEL TARGET_AVX2 __m256i avx2_load_groups(const uint8_t *in, const int B)
+{
+    __m128i first = _mm_loadu_si128((const __m128i *)in);
+    __m128i second = _mm_loadu_si128((const __m128i *)&in[B]);
+
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+}
+
+/* the second store overwrites the zeros the first one wrote behind its group */
+KERNEL TARGET_AVX2 void avx2_store_groups(uint8_t *out, __m256i v, const int B)
+{
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *)&out[B], _mm256_extracti128_si256(v, 1));
+}
+
+KERNEL TARGET_AVX2 void avx2_unpack_run(const uint8_t *in, uint16_t *out, size_t groups, const int B)
+{
+    size_t g = 0;
+
+    for(; (groups - g) * B >= (size_t)(16 + B); g += 2)
+    {
+        _mm256_storeu_si256((__m256i *)&out[g * 8], avx2_unpack_group(avx2_load_groups(&in[g * B], B), B));
+    }
+    sse2_unpack_run(&in[g * B], &out[g * 8], groups - g, B);
+}
+
+KERNEL TARGET_AVX2 void avx2_pack_run(const uint16_t *in, uint8_t *out, size_t groups, const int B, const int swap)
+{
+    size_t g = 0;
+
+    for(; (groups - g) * B >= (size_t)(16 + B); g += 2)
+    {
+        __m256i v = avx2_pack_group(_mm256_loadu_si256((const __m256i *)&in[g * 8]), B);
+        avx2_store_groups(&out[g * B], swap ? avx2_swap_bytes(v) : v, B);
+    }
+    sse2_pack_run(&in[g * 8], &out[g * B], groups - g, B, swap);
+}
+
+KERNEL TARGET_AVX2 void avx2_convert_run(const uint8_t *in, uint8_t *out, size_t groups, const int A, const int B)
+{
+    size_t g = 0;
+
+    for(; (groups - g) * A >= (size_t)(16 + A) && (groups - g) * B >= (size_t)(16 + B); g += 2)
+    {
+        __m256i v = avx2_unpack_group(avx2_load_groups(&in[g * A], A), A);
+        avx2_store_groups(&out[g * B], avx2_pack_group(avx2_convert_pixels(v, A, B), B), B);
+    }
+    sse2_convert_run(&in[g * A], &out[g * B], groups - g, A, B);
+}
+
+/* instantiate the runs with constant depths, so all shifts and masks become immediates */
+
+#define BITPACK_DEPTH_CASES(call) \
+    case 10: call(10); break; \
+    case 12: call(12); break; \
+    case 14: call(14); break; \
+    case 16: call(16); break;
+
+#define BITPACK_CONVERT_CASES(call) \
+    case 10: switch(new_depth) { BITPACK_DEPTH_CASES_2(call, 10) } break; \
+    case 12: switch(new_depth) { BITPACK_DEPTH_CASES_2(call, 12) } break; \
+    case 14: switch(new_depth) { BITPACK_DEPTH_CASES_2(call, 14) } break; \
+    case 16: switch(new_depth) { BITPACK_DEPTH_CASES_2(call, 16) } break;
+
+#define BITPACK_DEPTH_CASES_2(call, a) \
+    case 10: call(a, 10); break; \
+    case 12: call(a, 12); break; \
+    case 14: call(a, 14); break; \
+    case 16: call(a, 16); break;
+
+static TARGET_SSE2 void bitpack_unpack_sse2(const uint16_t *src, uint16_t *dst, size_t groups, int depth)
+{
+#define CALL(b) sse2_unpack_run((const uint8_t *)src, dst, groups, b)
+    switch(depth) { BITPACK_DEPTH_CASES(CALL) }
+#undef CALL
+}
+
+static TARGET_SSE2 void bitpack_pack_sse2(const uint16_t *src, uint16_t *dst, size_t groups, int depth, int swap)
+{
+#define CALL(b) if(swap) sse2_pack_run(src, (uint8_t *)dst, groups, b, 1); else sse2_pack_run(src, (uint8_t *)dst, groups, b, 0)
+    switch(depth) { BITPACK_DEPTH_CASES(CALL) }
+#undef CALL
+}
+
+static TARGET_SSE2 void bitpack_convert_sse2(const uint16_t *src, uint16_t *dst, size_t groups, int old_depth, int new_depth)
+{
+#define CALL(a, b) sse2_convert_run((const uint8_t *)src, (uint8_t *)dst, groups, a, b)
+    switch(old_depth) { BITPACK_CONVERT_CASES(CALL) }
+#undef CALL
+}
+
+static TARGET_AVX2 void bitpack_unpack_avx2(const uint16_t *src, uint16_t *dst, size_t groups, int depth)
+{
+#define CALL(b) avx2_unpack_run((const uint8_t *)src, dst, groups, b)
+    switch(depth) { BITPACK_DEPTH_CASES(CALL) }
+#undef CALL
+}
+
+static TARGET_AVX2 void bitpack_pack_avx2(const uint16_t *src, uint16_t *dst, size_t groups, int depth, int swap)
+{
+#define CALL(b) if(swap) avx2_pack_run(src, (uint8_t *)dst, groups, b, 1); else avx2_pack_run(src, (uint8_t *)dst, groups, b, 0)
+    switch(depth) { BITPACK_DEPTH_CASES(CALL) }
+#undef CALL
+}
+
+static TARGET_AVX2 void bitpack_convert_avx2(const uint16_t *src, uint16_t *dst, size_t groups, int old_depth, int new_depth)
+{
+#define CALL(a, b) avx2_convert_run((const uint8_t *)src, (uint8_t *)dst, groups, a, b)
+    switch(old_depth) { BITPACK_CONVERT_CASES(CALL) }
+#undef CALL
+}
+
+#endif
+
+static int bitpack_simd_depth(int depth)
+{
+    return depth == 10 || depth == 12 || depth == 14 || depth == 16;
+}
+
+int bitpack_isa_supported(int isa)
+{
+    switch(isa)
+    {
+        case BITPACK_SCALAR:
+            return 1;
+#ifdef BITPACK_X86
+        case BITPACK_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case BITPACK_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+int bitpack_best_isa(void)
+{
+    if(bitpack_isa_supported(BITPACK_AVX2))
+    {
+        return BITPACK_AVX2;
+    }
+    if(bitpack_isa_supported(BITPACK_SSE2))
+    {
+        return BITPACK_SSE2;
+    }
+    return BITPACK_SCALAR;
+}
+
+const char *bitpack_isa_name(int isa)
+{
+    switch(isa)
+    {
+        case BITPACK_SCALAR:
+            return "scalar";
+        case BITPACK_SSE2:
+            return "SSE2";
+        case BITPACK_AVX2:
+            return "AVX2";
+        default:
+            return "unknown";
+    }
+}
+
+/* the SIMD kernels return the number of pixels they processed, always a multiple of 8 */
+
+static uint32_t bitpack_unpack_simd(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+#ifdef BITPACK_X86
+    if(bitpack_simd_depth(depth))
+    {
+        switch(isa)
+        {
+            case BITPACK_SSE2:
+                bitpack_unpack_sse2(src, dst, count / 8, depth);
+                return count & ~7;
+            case BITPACK_AVX2:
+                bitpack_unpack_avx2(src, dst, count / 8, depth);
+                return count & ~7;
+        }
+    }
+#endif
+    (void)isa; (void)src; (void)dst; (void)count; (void)depth;
+    return 0;
+}
+
+static uint32_t bitpack_pack_simd(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth, int swap)
+{
+#ifdef BITPACK_X86
+    if(bitpack_simd_depth(depth))
+    {
+        switch(isa)
+        {
+            case BITPACK_SSE2:
+                bitpack_pack_sse2(src, dst, count / 8, depth, swap);
+                return count & ~7;
+            case BITPACK_AVX2:
+                bitpack_pack_avx2(src, dst, count / 8, depth, swap);
+                return count & ~7;
+        }
+    }
+#endif
+    (void)isa; (void)src; (void)dst; (void)count; (void)depth; (void)swap;
+    return 0;
+}
+
+static uint32_t bitpack_convert_simd(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int old_depth, int new_depth)
+{
+#ifdef BITPACK_X86
+    if(bitpack_simd_depth(old_depth) && bitpack_simd_depth(new_depth))
+    {
+        switch(isa)
+        {
+            case BITPACK_SSE2:
+                bitpack_convert_sse2(src, dst, count / 8, old_depth, new_depth);
+                return count & ~7;
+            case BITPACK_AVX2:
+                bitpack_convert_avx2(src, dst, count / 8, old_depth, new_depth);
+                return count & ~7;
+        }
+    }
+#endif
+    (void)isa; (void)src; (void)dst; (void)count; (void)old_depth; (void)new_depth;
+    return 0;
+}
+
+/* the remaining pixels start at a word boundary (8 pixels are 'depth' bytes), so bitinsert() doesn't touch anything the kernels wrote */
+
+void bitpack_unpack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    for(uint32_t pos = bitpack_unpack_simd(isa, src, dst, count, depth); pos < count; pos++)
+    {
+        dst[pos] = bitextract(src, pos, depth);
+    }
+}
+
+void bitpack_pack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    for(uint32_t pos = bitpack_pack_simd(isa, src, dst, count, depth, 0); pos < count; pos++)
+    {
+        bitinsert(dst, pos, depth, src[pos]);
+    }
+}
+
+void bitpack_convert_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int old_depth, int new_depth)
+{
+    for(uint32_t pos = bitpack_convert_simd(isa, src, dst, count, old_depth, new_depth); pos < count; pos++)
+    {
+        bitinsert(dst, pos, new_depth, bitpack_convert_value(bitextract(src, pos, old_depth), old_depth, new_depth));
+    }
+}
+
+void bitpack_dng_pack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    uint32_t done = bitpack_pack_simd(isa, src, dst, count, depth, 1);
+
+    /* words written by the tail, the last one may be partially used */
+    uint32_t start = (uint32_t)((uint64_t)done * depth / 16);
+    uint32_t full = (uint32_t)((uint64_t)count * depth / 16);
+    uint32_t end = (uint32_t)(((uint64_t)count * depth + 15) / 16);
+
+    memset(&dst[start], 0, (end - start) * sizeof(uint16_t));
+    for(uint32_t pos = done; pos < count; pos++)
+    {
+        bitinsert(dst, pos, depth, src[pos]);
+    }
+    bitpack_swap_words(dst, start, full);
+}
+
+void bitpack_unpack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    bitpack_unpack_isa(bitpack_best_isa(), src, dst, count, depth);
+}
+
+void bitpack_pack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    bitpack_pack_isa(bitpack_best_isa(), src, dst, count, depth);
+}
+
+void bitpack_convert(const uint16_t *src, uint16_t *dst, uint32_t count, int old_depth, int new_depth)
+{
+    bitpack_convert_isa(bitpack_best_isa(), src, dst, count, old_depth, new_depth);
+}
+
+void bitpack_dng_pack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth)
+{
+    bitpack_dng_pack_isa(bitpack_best_isa(), src, dst, count, depth);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _bitpack_h_
+#define _bitpack_h_
+
+#include <stdint.h>
+
+/*
+   conversion between bit packed raw data and 16 bit pixels.
+
+   packed data is a stream of 16 bit words, pixels are stored MSB first, so the first pixel
+   occupies the upper bits of the first word. this is the layout of MLV VIDF payloads.
+   DNG uses the same stream with every word in big endian byte order.
+
+   for 10, 12, 14 and 16 bpp there are SSE2 and AVX2 kernels that process groups of 8 pixels
+   (which take exactly 'bpp' bytes). the fastest one the CPU supports is picked at runtime,
+   everything else (other depths, the pixels after the last full group, non-x86 hosts)
+   is done by bitinsert()/bitextract(). results are bit exact in all cases.
+*/
+
+enum
+{
+    BITPACK_SCALAR = 0,
+    BITPACK_SSE2   = 1,
+    BITPACK_AVX2   = 2,
+};
+
+/* single pixel access, 'position' is the pixel index within the packed stream */
+void bitinsert(uint16_t *dst, int position, int depth, uint16_t new_value);
+uint16_t bitextract(const uint16_t *src, int position, int depth);
+
+/* 'count' packed pixels to 16 bit */
+void bitpack_unpack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+
+/* 'count' 16 bit pixels to packed. bits of a partially used last word are preserved like bitinsert() does */
+void bitpack_pack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+
+/* repack 'count' pixels from 'old_depth' to 'new_depth', rounding like mlv_dump always did */
+void bitpack_convert(const uint16_t *src, uint16_t *dst, uint32_t count, int old_depth, int new_depth);
+
+/* 'count' 16 bit pixels to packed big endian DNG data. a partially used last word is zero padded and stays little endian */
+void bitpack_dng_pack(const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+
+/* the same with an explicit instruction set, for testing and benchmarking */
+int bitpack_isa_supported(int isa);
+int bitpack_best_isa(void);
+const char *bitpack_isa_name(int isa);
+void bitpack_unpack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+void bitpack_pack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+void bitpack_convert_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int old_depth, int new_depth);
+void bitpack_dng_pack_isa(int isa, const uint16_t *src, uint16_t *dst, uint32_t count, int depth);
+
+#endif
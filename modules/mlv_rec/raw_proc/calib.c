@@ -0,0 +1,753 @@
+/*
+ * Copyright (C) 2017 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "wirth.h"
+#include "bitpack.h"
+#include "calib.h"
+#include "../pipeline.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+
+#define MAX_THREADS 256
+
+/* sigma clipping stops earlier if no more values are rejected */
+#define SIGMA_CLIP_ITERATIONS 5
+
+struct calib_stack
+{
+    int width;
+    int height;
+    int depth;
+    int method;
+    double sigma;
+    int threads;
+    size_t memory_limit;
+
+    uint32_t frames;
+    uint32_t max_frames;
+    int error;
+
+    /* CALIB_MEAN: one set of sums per worker, added up in calib_finish() */
+    int sum_sets;
+    uint32_t ** sums;
+
+    /* CALIB_MEDIAN, CALIB_SIGMA_CLIP: the packed frames, one after the other */
+    FILE * spool;
+    char * spool_name;
+
+    /* CALIB_MEAN, single threaded: frames are unpacked here */
+    uint16_t * pixels;
+    pipeline_t * pipeline;
+};
+
+struct calib_job
+{
+    uint16_t * packed;
+    uint16_t * pixels;
+};
+
+/* a band of the rows read back from the spool file, split between threads by pixels */
+struct calib_band
+{
+    struct calib_stack * stack;
+    uint16_t * values;      /* all frames of the band, [frame][pixel] */
+    uint32_t * sums;        /* output of the band */
+    int pixels;             /* pixels in the band */
+    int start;
+    int end;
+};
+
+static size_t packed_size(struct calib_stack * stack)
+{
+    return ((size_t)stack->width * stack->height * stack->depth + 7) / 8;
+}
+
+static size_t frame_pixels(struct calib_stack * stack)
+{
+    return (size_t)stack->width * stack->height;
+}
+
+/* the inner loop of the mean, vectorized by the compiler */
+static void accumulate(uint32_t * sums, const uint16_t * pixels, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        sums[i] += pixels[i];
+    }
+}
+
+static int calib_job_work(void * ctx, int worker, void * job)
+{
+    struct calib_stack * stack = ctx;
+    struct calib_job * j = job;
+
+    bitpack_unpack(j->packed, j->pixels, frame_pixels(stack), stack->depth);
+    accumulate(stack->sums[worker], j->pixels, frame_pixels(stack));
+    return 0;
+}
+
+static int calib_job_write(void * ctx, void * job, int error)
+{
+    struct calib_job * j = job;
+
+    (void)ctx;
+    (void)error;
+    free(j->packed);
+    free(j->pixels);
+    free(j);
+    return 0;
+}
+
+struct calib_stack * calib_create(int width, int height, int depth, int method, double sigma, int threads, size_t memory_limit, const char * spool_name)
+{
+    struct calib_stack * stack = calloc(1, sizeof(struct calib_stack));
+    if (!stack)
+    {
+        return NULL;
+    }
+
+    stack->width = width;
+    stack->height = height;
+    stack->depth = depth;
+    stack->method = method;
+    stack->sigma = sigma > 0 ? sigma : 3.0;
+    stack->threads = COERCE(threads, 1, MAX_THREADS);
+    stack->memory_limit = memory_limit;
+
+    /* every result is stored scaled by the frame count, that must fit into 32 bits */
+    stack->max_frames = UINT32_MAX / ((1u << depth) - 1);
+
+    if (method == CALIB_MEAN)
+    {
+        stack->sum_sets = stack->threads > 1 ? stack->threads : 1;
+        stack->sums = calloc(stack->sum_sets, sizeof(uint32_t *));
+        if (!stack->sums)
+        {
+            calib_free(stack);
+            return NULL;
+        }
+        for (int i = 0; i < stack->sum_sets; i++)
+        {
+            stack->sums[i] = calloc(frame_pixels(stack), sizeof(uint32_t));
+            if (!stack->sums[i])
+            {
+                calib_free(stack);
+                return NULL;
+            }
+        }
+    }
+    else
+    {
+        /* not tmpfile(): /tmp is often in RAM, and on Windows it writes to the root of the drive */
+        stack->spool_name = malloc(strlen(spool_name) + 1);
+        if (stack->spool_name)
+        {
+            strcpy(stack->spool_name, spool_name);
+            stack->spool = fopen(stack->spool_name, "w+b");
+        }
+        if (!stack->spool)
+        {
+            err_printf("Failed to create calibration spool file '%s'\n", spool_name);
+            calib_free(stack);
+            return NULL;
+        }
+
+        /* frames go to the spool as they are, only calib_finish() unpacks them */
+        return stack;
+    }
+
+    if (stack->threads > 1)
+    {
+        stack->pipeline = pipeline_create(stack->threads, 2 * stack->threads, calib_job_work, calib_job_write, stack);
+    }
+
+    if (!stack->pipeline)
+    {
+        /* everything happens on the calling thread, with one set of sums */
+        stack->threads = 1;
+        stack->pixels = malloc(frame_pixels(stack) * sizeof(uint16_t));
+        if (!stack->pixels)
+        {
+            calib_free(stack);
+            return NULL;
+        }
+    }
+
+    return stack;
+}
+
+int calib_add_frame(struct calib_stack * stack, const uint16_t * packed)
+{
+    if (stack->error)
+    {
+        return 0;
+    }
+
+    if (stack->frames >= stack->max_frames)
+    {
+        err_printf("Can not stack more than %u frames of %d bits\n", stack->max_frames, stack->depth);
+        stack->error = 1;
+        return 0;
+    }
+
+    if (stack->method != CALIB_MEAN)
+    {
+        if (fwrite(packed, 1, packed_size(stack), stack->spool) != packed_size(stack))
+        {
+            err_printf("Failed to write frame to calibration spool file\n");
+            stack->error = 1;
+            return 0;
+        }
+        stack->frames++;
+        return 1;
+    }
+
+    if (!stack->pipeline)
+    {
+        bitpack_unpack(packed, stack->pixels, frame_pixels(stack), stack->depth);
+        accumulate(stack->sums[0], stack->pixels, frame_pixels(stack));
+        stack->frames++;
+        return 1;
+    }
+
+    /* the caller reuses its buffer for the next frame right away */
+    struct calib_job * job = calloc(1, sizeof(struct calib_job));
+    if (job)
+    {
+        job->packed = malloc(packed_size(stack));
+        job->pixels = malloc(frame_pixels(stack) * sizeof(uint16_t));
+    }
+    if (!job || !job->packed || !job->pixels)
+    {
+        err_printf("malloc error\n");
+        if (job)
+        {
+            free(job->packed);
+            free(job->pixels);
+            free(job);
+        }
+        stack->error = 1;
+        return 0;
+    }
+    memcpy(job->packed, packed, packed_size(stack));
+
+    if (pipeline_submit(stack->pipeline, job))
+    {
+        stack->error = 1;
+        return 0;
+    }
+
+    stack->frames++;
+    return 1;
+}
+
+uint32_t calib_frames(struct calib_stack * stack)
+{
+    return stack->frames;
+}
+
+/* median of 'n' values, times 'n' */
+static uint32_t stack_median(uint16_t * values, int n)
+{
+    uint32_t upper = kth_smallest_ushort(values, n, n / 2);
+    if (n & 1)
+    {
+        return upper * n;
+    }
+
+    /* the other middle value is the largest one left of it */
+    uint32_t lower = values[0];
+    for (int i = 1; i < n / 2; i++)
+    {
+        lower = MAX(lower, values[i]);
+    }
+    return ((lower + upper) * n + 1) / 2;
+}
+
+/* mean of the values within 'sigma' standard deviations of the mean, repeated while values are rejected; times 'n' */
+static uint32_t stack_sigma_clip(uint16_t * values, int n, double sigma)
+{
+    int count = n;
+    double mean = 0;
+
+    for (int iteration = 0; iteration < SIGMA_CLIP_ITERATIONS; iteration++)
+    {
+        double sum = 0;
+        double sum_sq = 0;
+        for (int i = 0; i < count; i++)
+        {
+            sum += values[i];
+            sum_sq += (double)values[i] * values[i];
+        }
+        mean = sum / count;
+        double stdev = sqrt(MAX(0, sum_sq / count - mean * mean));
+        double limit = sigma * stdev;
+
+        /* move the values that are kept to the front */
+        int kept = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (fabs(values[i] - mean) <= limit)
+            {
+                values[kept++] = values[i];
+            }
+        }
+
+        if (kept == count || kept == 0)
+        {
+            break;
+        }
+        count = kept;
+    }
+
+    /* the mean of the last set of values, which are all kept or the iterations ran out */
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += values[i];
+    }
+    mean = sum / count;
+
+    return (uint32_t)(mean * n + 0.5);
+}
+
+static void * calib_band_work(void * arg)
+{
+    struct calib_band * band = arg;
+    struct calib_stack * stack = band->stack;
+    int n = stack->frames;
+
+    uint16_t * values = malloc(n * sizeof(uint16_t));
+    if (!values)
+    {
+        return (void *)1;
+    }
+
+    for (int p = band->start; p < band->end; p++)
+    {
+        for (int f = 0; f < n; f++)
+        {
+            values[f] = band->values[(size_t)f * band->pixels + p];
+        }
+
+        if (stack->method == CALIB_MEDIAN)
+        {
+            band->sums[p] = stack_median(values, n);
+        }
+        else
+        {
+            band->sums[p] = stack_sigma_clip(values, n, stack->sigma);
+        }
+    }
+
+    free(values);
+    return 0;
+}
+
+/* pixels of one band split between the threads, the calling thread takes the first part */
+static int stack_band(struct calib_stack * stack, uint16_t * values, uint32_t * sums, int pixels)
+{
+    struct calib_band bands[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int started[MAX_THREADS];
+    int failed = 0;
+
+    int threads = COERCE(stack->threads, 1, MAX(1, pixels));
+
+    for (int t = 0; t < threads; t++)
+    {
+        bands[t].stack = stack;
+        bands[t].values = values;
+        bands[t].sums = sums;
+        bands[t].pixels = pixels;
+        bands[t].start = (int64_t)pixels * t / threads;
+        bands[t].end = (int64_t)pixels * (t + 1) / threads;
+    }
+
+    for (int t = 1; t < threads; t++)
+    {
+        started[t] = pthread_create(&tid[t], 0, calib_band_work, &bands[t]) == 0;
+    }
+
+    failed |= calib_band_work(&bands[0]) != 0;
+
+    for (int t = 1; t < threads; t++)
+    {
+        void * ret = 0;
+        if (started[t])
+        {
+            pthread_join(tid[t], &ret);
+        }
+        else
+        {
+            ret = calib_band_work(&bands[t]);
+        }
+        failed |= ret != 0;
+    }
+
+    return !failed;
+}
+
+/* unpack 'count' pixels of frame 'f' from the spool, starting at pixel 'first' */
+/* reading starts at a multiple of 16 pixels, where the packed stream is word aligned for every bit depth */
+static int read_spool(struct calib_stack * stack, uint32_t f, size_t first, int count, uint16_t * packed, uint16_t * unpacked, uint16_t * out)
+{
+    size_t start = first & ~(size_t)15;
+    size_t start_byte = start * stack->depth / 8;
+    size_t unpack_count = first + count - start;
+    size_t bytes = MIN((unpack_count * stack->depth + 15) / 16 * 2, packed_size(stack) - start_byte);
+
+    /* a frame may end in the middle of a word */
+    packed[bytes / 2] = 0;
+
+    int64_t offset = (int64_t)f * packed_size(stack) + start_byte;
+#if defined(__WIN32)
+    int ok = fseeko64(stack->spool, offset, SEEK_SET) == 0;
+#else
+    int ok = fseeko(stack->spool, offset, SEEK_SET) == 0;
+#endif
+    if (!ok || fread(packed, 1, bytes, stack->spool) != bytes)
+    {
+        return 0;
+    }
+
+    bitpack_unpack(packed, unpacked, unpack_count, stack->depth);
+    memcpy(out, &unpacked[first - start], count * sizeof(uint16_t));
+    return 1;
+}
+
+static int stack_spool(struct calib_stack * stack, uint32_t * sums)
+{
+    int w = stack->width;
+    int h = stack->height;
+    size_t row_bytes = (size_t)w * sizeof(uint16_t);
+
+    /* as many rows as fit into the memory limit for all frames, at least one */
+    size_t rows = stack->memory_limit / (row_bytes * stack->frames);
+    rows = COERCE(rows, 1, (size_t)h);
+
+    /* one band of one frame, packed and unpacked, plus the 15 pixels before it for alignment */
+    size_t band_pixels = rows * w + 16;
+    uint16_t * values = malloc(rows * row_bytes * stack->frames);
+    uint16_t * packed = malloc((band_pixels * stack->depth + 15) / 16 * 2 + 2);
+    uint16_t * unpacked = malloc(band_pixels * sizeof(uint16_t));
+    if (!values || !packed || !unpacked)
+    {
+        err_printf("Failed to allocate %u rows of %u frames for stacking\n", (uint32_t)rows, stack->frames);
+        free(values);
+        free(packed);
+        free(unpacked);
+        return 0;
+    }
+
+    int ok = fflush(stack->spool) == 0;
+
+    for (int y = 0; ok && y < h; y += rows)
+    {
+        int band_rows = MIN((int)rows, h - y);
+        int pixels = band_rows * w;
+
+        for (uint32_t f = 0; ok && f < stack->frames; f++)
+        {
+            ok = read_spool(stack, f, (size_t)y * w, pixels, packed, unpacked, &values[(size_t)f * pixels]);
+        }
+        if (!ok)
+        {
+            err_printf("Failed to read calibration spool file\n");
+            break;
+        }
+
+        ok = stack_band(stack, values, &sums[(size_t)y * w], pixels);
+    }
+
+    free(values);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
+
+int calib_finish(struct calib_stack * stack, uint32_t * sums)
+{
+    if (stack->pipeline)
+    {
+        if (pipeline_finish(stack->pipeline))
+        {
+            stack->error = 1;
+        }
+        stack->pipeline = NULL;
+    }
+
+    if (stack->error || !stack->frames)
+    {
+        return 0;
+    }
+
+    if (stack->method != CALIB_MEAN)
+    {
+        return stack_spool(stack, sums);
+    }
+
+    memcpy(sums, stack->sums[0], frame_pixels(stack) * sizeof(uint32_t));
+    for (int i = 1; i < stack->sum_sets; i++)
+    {
+        uint32_t * set = stack->sums[i];
+        for (size_t p = 0; p < frame_pixels(stack); p++)
+        {
+            sums[p] += set[p];
+        }
+    }
+    return 1;
+}
+
+void calib_free(struct calib_stack * stack)
+{
+    if (!stack)
+    {
+        return;
+    }
+
+    if (stack->pipeline)
+    {
+        pipeline_finish(stack->pipeline);
+    }
+    if (stack->sums)
+    {
+        for (int i = 0; i < stack->sum_sets; i++)
+        {
+            free(stack->sums[i]);
+        }
+        free(stack->sums);
+    }
+    if (stack->spool)
+    {
+        fclose(stack->spool);
+        remove(stack->spool_name);
+    }
+    free(stack->spool_name);
+    free(stack->pixels);
+    free(stack);
+}
+
+void calib_average_columns(uint32_t * sums, int width, int height)
+{
+    for (int x = 0; x < width; x++)
+    {
+        uint64_t column = 0;
+
+        for (int y = 0; y < height; y++)
+        {
+            column += sums[y * width + x];
+        }
+        column /= height;
+        for (int y = 0; y < height; y++)
+        {
+            sums[y * width + x] = column;
+        }
+    }
+}
+
+void calib_average_rows(uint32_t * sums, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        uint64_t line = 0;
+
+        for (int x = 0; x < width; x++)
+        {
+            line += sums[y * width + x];
+        }
+        line /= width;
+        for (int x = 0; x < width; x++)
+        {
+            sums[y * width + x] = line;
+        }
+    }
+}
+
+/* reference frames *****************************************************************************/
+
+struct calib_ref * calib_ref_create(const uint16_t * packed, int width, int height, int depth)
+{
+    struct calib_ref * ref = calloc(1, sizeof(struct calib_ref));
+    if (!ref)
+    {
+        return NULL;
+    }
+
+    ref->width = width;
+    ref->height = height;
+    ref->depth = depth;
+    ref->pixels = malloc((size_t)width * height * sizeof(uint16_t));
+    ref->scratch = malloc((size_t)width * height * sizeof(uint16_t));
+    if (!ref->pixels || !ref->scratch)
+    {
+        calib_ref_free(ref);
+        return NULL;
+    }
+
+    bitpack_unpack(packed, ref->pixels, width * height, depth);
+    return ref;
+}
+
+void calib_ref_free(struct calib_ref * ref)
+{
+    if (!ref)
+    {
+        return;
+    }
+    free(ref->pixels);
+    free(ref->scratch);
+    free(ref);
+}
+
+void calib_subtract(struct calib_ref * dark, uint16_t * packed, int black)
+{
+    int count = dark->width * dark->height;
+    int max = (1 << dark->depth) - 1;
+    uint16_t * pixels = dark->scratch;
+
+    bitpack_unpack(packed, pixels, count, dark->depth);
+
+    for (int i = 0; i < count; i++)
+    {
+        int32_t value = (int32_t)pixels[i] - dark->pixels[i] + black;
+        pixels[i] = COERCE(value, 0, max);
+    }
+
+    bitpack_pack(pixels, packed, count, dark->depth);
+}
+
+void calib_flat_normalize(struct calib_ref * flat, int black)
+{
+    int w = flat->width;
+    int h = flat->height;
+    int levels = 1 << flat->depth;
+
+    /* normalize using frame center only
+     * (also works on lenses with heavy vignetting) */
+    int * hist[2][2];
+    int total[2][2] = {{0,0},{0,0}};
+
+    hist[0][0] = calloc(levels * 4, sizeof(int));
+    if (!hist[0][0])
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+    hist[0][1] = hist[0][0] + levels;
+    hist[1][0] = hist[0][0] + 2 * levels;
+    hist[1][1] = hist[0][0] + 3 * levels;
+
+    for (int y = h/4; y < h*3/4; y++)
+    {
+        for (int x = w/4; x < w*3/4; x++)
+        {
+            hist[y%2][x%2][flat->pixels[x + y * w]]++;
+            total[y%2][x%2]++;
+        }
+    }
+
+    for (int dy = 0; dy < 2; dy++)
+    {
+        for (int dx = 0; dx < 2; dx++)
+        {
+            int acc = 0;
+            for (int i = 0; i < levels; i++)
+            {
+                acc += hist[dy][dx][i];
+
+                if (acc < total[dy][dx]/20)
+                {
+                    /* 5th percentile */
+                    flat->pr5[dy][dx] = i - black;
+                }
+
+                if (acc < total[dy][dx]/2)
+                {
+                    /* median */
+                    flat->med[dy][dx] = i - black;
+                }
+            }
+        }
+    }
+
+    free(hist[0][0]);
+
+    /* adjust all medians using green's 5th percentile to prevent whites from clipping */
+    flat->adj_num = (flat->pr5[0][1] + flat->pr5[1][0]) / 2;
+    flat->adj_den = (flat->med[0][1] + flat->med[1][0]) / 2;
+    flat->black = black;
+}
+
+int calib_flatfield(struct calib_ref * flat, uint16_t * packed, int black)
+{
+    if (!flat->adj_den)
+    {
+        return 0;
+    }
+
+    int w = flat->width;
+    int h = flat->height;
+    int max = (1 << flat->depth) - 1;
+    uint16_t * pixels = flat->scratch;
+
+    bitpack_unpack(packed, pixels, w * h, flat->depth);
+
+    for (int y = 0; y < h; y++)
+    {
+        uint16_t * src_line = &pixels[y * w];
+        uint16_t * flat_line = &flat->pixels[y * w];
+
+        for (int x = 0; x < w; x++)
+        {
+            int32_t value = src_line[x];
+            int32_t flat_value = flat_line[x];
+
+            if (flat_value - black <= 0)
+            {
+                int left  = flat_line[MAX(x-1,0)];
+                int right = flat_line[MIN(x+1,w-1)];
+                flat_value = MAX(left, right);
+            }
+
+            if (flat_value - black > 0)
+            {
+                value -= black;
+                value = (int64_t) value * flat->med[y%2][x%2] * flat->adj_num / flat->adj_den / (flat_value - black);
+                value += black;
+                value = COERCE(value, 0, max);
+            }
+
+            src_line[x] = value;
+        }
+    }
+
+    bitpack_pack(pixels, packed, w * h, flat->depth);
+    return 1;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2017 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _calib_h_
+#define _calib_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   calibration frames: stacking many frames into a master dark or flat,
+   and applying such a reference frame to footage.
+
+   frames are passed bit packed, as they are stored in VIDF blocks.
+
+   CALIB_MEAN sums up the frames, on worker threads with one set of 32 bit
+   accumulators each, so nothing but the sums is kept in memory.
+
+   CALIB_MEDIAN and CALIB_SIGMA_CLIP need all values of a pixel at once: the
+   packed frames are spooled to the file 'spool_name' (next to the output, not
+   in /tmp which may be a RAM disk) and read back in bands of rows that fit
+   into 'memory_limit' bytes for all frames. the file is deleted by calib_free().
+
+   the stacked result is returned scaled by the frame count, like the sum of
+   all frames, so the mean result and the rounding of mlv_dump -a stay the same.
+*/
+
+enum calib_method
+{
+    CALIB_MEAN       = 0,
+    CALIB_MEDIAN     = 1,
+    CALIB_SIGMA_CLIP = 2,
+};
+
+struct calib_stack;
+
+/* reference frame for calib_subtract() or calib_flatfield() */
+struct calib_ref
+{
+    int width;
+    int height;
+    int depth;
+    uint16_t * pixels;
+    uint16_t * scratch;
+
+    /* flat-field normalization, per Bayer channel */
+    int black;
+    int32_t med[2][2];
+    int32_t pr5[2][2];
+    int32_t adj_num;
+    int32_t adj_den;
+};
+
+/* 'sigma' is the rejection threshold of CALIB_SIGMA_CLIP in standard deviations */
+/* 'spool_name' is only used by CALIB_MEDIAN and CALIB_SIGMA_CLIP */
+struct calib_stack * calib_create(int width, int height, int depth, int method, double sigma, int threads, size_t memory_limit, const char * spool_name);
+/* add one frame, returns 0 on error (out of memory, spool file not writable, too many frames) */
+int calib_add_frame(struct calib_stack * stack, const uint16_t * packed);
+/* number of frames added so far */
+uint32_t calib_frames(struct calib_stack * stack);
+/* stack all frames into 'sums' (width * height values, each the result times calib_frames()), returns 0 on error */
+int calib_finish(struct calib_stack * stack, uint32_t * sums);
+void calib_free(struct calib_stack * stack);
+
+/* replace every value by the mean of its column or row, to extract vertical or horizontal banding */
+void calib_average_columns(uint32_t * sums, int width, int height);
+void calib_average_rows(uint32_t * sums, int width, int height);
+
+/* unpack a reference frame once, for all frames it is applied to */
+struct calib_ref * calib_ref_create(const uint16_t * packed, int width, int height, int depth);
+void calib_ref_free(struct calib_ref * ref);
+
+/* frame - dark + black, clipped to the bit depth */
+void calib_subtract(struct calib_ref * dark, uint16_t * packed, int black);
+/* median and 5th percentile of each Bayer channel in the frame center, needed by calib_flatfield() */
+void calib_flat_normalize(struct calib_ref * flat, int black);
+/* divide by the normalized flat, returns 0 if the flat is unusable */
+int calib_flatfield(struct calib_ref * flat, uint16_t * packed, int black);
+
+#endif
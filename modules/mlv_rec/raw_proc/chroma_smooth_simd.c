@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "opt_med_simd.h"
+#include "chroma_smooth_simd.h"
+
+#define EV_RESOLUTION 65536
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+
+/* per RG/GB cell terms, indexed by cell (x/2, y/2) of the red pixel */
+struct cs_planes
+{
+    int32_t *rh;    /* red minus horizontally interpolated green */
+    int32_t *bh;    /* blue minus horizontally interpolated green */
+    int32_t *eh;    /* horizontal interpolation error */
+    int32_t *rv;    /* the same with vertical interpolation */
+    int32_t *bv;
+    int32_t *ev;
+};
+
+/* medians and error sums of one row of output cells */
+struct cs_row
+{
+    int32_t *drh;
+    int32_t *dbh;
+    int32_t *drv;
+    int32_t *dbv;
+    int32_t *eh;
+    int32_t *ev;
+};
+
+struct cs_ctx
+{
+    int isa;
+    int w;
+    int h;
+    int cw;             /* cells per plane row */
+    const uint16_t *inp;
+    uint16_t *out;
+    const int *raw2ev;
+    const int *ev2raw;
+    int black;
+    int white;
+
+    /* window: 'n' cells at these plane offsets, in the order the scalar filter visits them */
+    int n;
+    int off[25];
+
+    /* output cells */
+    int cx0, cx1;
+    int cy0, cy1;
+
+    /* plane cells needed by those */
+    int pcx0, pcx1;
+    int pcy0, pcy1;
+
+    struct cs_planes planes;
+};
+
+struct cs_band
+{
+    struct cs_ctx *ctx;
+    int phase;          /* 0: planes, 1: output */
+    int y0, y1;         /* cell rows */
+};
+
+/* step 1: the terms of every cell in a row */
+static void cs_planes_row(struct cs_ctx *ctx, int cy)
+{
+    const int w = ctx->w;
+    const int *raw2ev = ctx->raw2ev;
+    const uint16_t *r0 = ctx->inp + 2 * cy * w;
+    const uint16_t *rm = r0 - w;
+    const uint16_t *r1 = r0 + w;
+    const uint16_t *r2 = r0 + 2 * w;
+    int base = cy * ctx->cw;
+
+    for (int cx = ctx->pcx0; cx < ctx->pcx1; cx++)
+    {
+        int x = 2 * cx;
+        int r = raw2ev[r0[x]];
+        int b = raw2ev[r1[x+1]];
+                                        /*  for R      for B      */
+        int g1 = raw2ev[r0[x+1]];       /*  Right      Top        */
+        int g2 = raw2ev[r1[x]];         /*  Bottom     Left       */
+        int g3 = raw2ev[r0[x-1]];       /*  Left                  */
+        int g4 = raw2ev[rm[x]];         /*  Top                   */
+        int g5 = raw2ev[r1[x+2]];       /*             Right      */
+        int g6 = raw2ev[r2[x+1]];       /*             Bottom     */
+
+        int i = base + cx;
+        ctx->planes.rh[i] = r - (g1+g3)/2;
+        ctx->planes.bh[i] = b - (g2+g5)/2;
+        ctx->planes.eh[i] = ABS(g1-g3) + ABS(g2-g5);
+        ctx->planes.rv[i] = r - (g2+g4)/2;
+        ctx->planes.bv[i] = b - (g1+g6)/2;
+        ctx->planes.ev[i] = ABS(g2-g4) + ABS(g1-g6);
+    }
+}
+
+/* step 2: medians over the window; these do cells [cx, cx1) of row 'cy' */
+static void cs_medians_scalar(struct cs_ctx *ctx, int cy, int cx, struct cs_row *row)
+{
+    const struct cs_planes *p = &ctx->planes;
+    const int n = ctx->n;
+
+    for (; cx < ctx->cx1; cx++)
+    {
+        int c = cy * ctx->cw + cx;
+        int rh[25], bh[25], rv[25], bv[25];
+        int eh = 0, ev = 0;
+
+        for (int k = 0; k < n; k++)
+        {
+            int i = c + ctx->off[k];
+            rh[k] = p->rh[i];
+            bh[k] = p->bh[i];
+            rv[k] = p->rv[i];
+            bv[k] = p->bv[i];
+            eh += p->eh[i];
+            ev += p->ev[i];
+        }
+
+        row->drh[cx] = opt_med_scalar(rh, n);
+        row->dbh[cx] = opt_med_scalar(bh, n);
+        row->drv[cx] = opt_med_scalar(rv, n);
+        row->dbv[cx] = opt_med_scalar(bv, n);
+        row->eh[cx] = eh;
+        row->ev[cx] = ev;
+    }
+}
+
+#ifdef OPT_MED_X86
+
+#define LOAD_SSE2(ptr)          _mm_loadu_si128((const __m128i *)(ptr))
+#define STORE_SSE2(ptr, v)      _mm_storeu_si128((__m128i *)(ptr), v)
+#define LOAD_AVX2(ptr)          _mm256_loadu_si256((const __m256i *)(ptr))
+#define STORE_AVX2(ptr, v)      _mm256_storeu_si256((__m256i *)(ptr), v)
+
+/* returns the first cell it did not process */
+OPT_MED_KERNEL OPT_MED_TARGET_SSE2 int sse2_medians_run(struct cs_ctx *ctx, int cy, struct cs_row *row, const int n)
+{
+    const struct cs_planes *p = &ctx->planes;
+    int cx;
+
+    for (cx = ctx->cx0; cx + 4 <= ctx->cx1; cx += 4)
+    {
+        int c = cy * ctx->cw + cx;
+        __m128i rh[25], bh[25], rv[25], bv[25];
+        __m128i eh = _mm_setzero_si128();
+        __m128i ev = _mm_setzero_si128();
+
+        for (int k = 0; k < n; k++)
+        {
+            int i = c + ctx->off[k];
+            rh[k] = LOAD_SSE2(&p->rh[i]);
+            bh[k] = LOAD_SSE2(&p->bh[i]);
+            rv[k] = LOAD_SSE2(&p->rv[i]);
+            bv[k] = LOAD_SSE2(&p->bv[i]);
+            eh = _mm_add_epi32(eh, LOAD_SSE2(&p->eh[i]));
+            ev = _mm_add_epi32(ev, LOAD_SSE2(&p->ev[i]));
+        }
+
+        STORE_SSE2(&row->drh[cx], opt_med_sse2(rh, n));
+        STORE_SSE2(&row->dbh[cx], opt_med_sse2(bh, n));
+        STORE_SSE2(&row->drv[cx], opt_med_sse2(rv, n));
+        STORE_SSE2(&row->dbv[cx], opt_med_sse2(bv, n));
+        STORE_SSE2(&row->eh[cx], eh);
+        STORE_SSE2(&row->ev[cx], ev);
+    }
+
+    return cx;
+}
+
+OPT_MED_KERNEL OPT_MED_TARGET_AVX2 int avx2_medians_run(struct cs_ctx *ctx, int cy, struct cs_row *row, const int n)
+{
+    const struct cs_planes *p = &ctx->planes;
+    int cx;
+
+    for (cx = ctx->cx0; cx + 8 <= ctx->cx1; cx += 8)
+    {
+        int c = cy * ctx->cw + cx;
+        __m256i rh[25], bh[25], rv[25], bv[25];
+        __m256i eh = _mm256_setzero_si256();
+        __m256i ev = _mm256_setzero_si256();
+
+        for (int k = 0; k < n; k++)
+        {
+            int i = c + ctx->off[k];
+            rh[k] = LOAD_AVX2(&p->rh[i]);
+            bh[k] = LOAD_AVX2(&p->bh[i]);
+            rv[k] = LOAD_AVX2(&p->rv[i]);
+            bv[k] = LOAD_AVX2(&p->bv[i]);
+            eh = _mm256_add_epi32(eh, LOAD_AVX2(&p->eh[i]));
+            ev = _mm256_add_epi32(ev, LOAD_AVX2(&p->ev[i]));
+        }
+
+        STORE_AVX2(&row->drh[cx], opt_med_avx2(rh, n));
+        STORE_AVX2(&row->dbh[cx], opt_med_avx2(bh, n));
+        STORE_AVX2(&row->drv[cx], opt_med_avx2(rv, n));
+        STORE_AVX2(&row->dbv[cx], opt_med_avx2(bv, n));
+        STORE_AVX2(&row->eh[cx], eh);
+        STORE_AVX2(&row->ev[cx], ev);
+    }
+
+    return cx;
+}
+
+/* instantiate the runs with a constant window size, so the networks are fully unrolled */
+static OPT_MED_TARGET_SSE2 int cs_medians_sse2(struct cs_ctx *ctx, int cy, struct cs_row *row)
+{
+    switch (ctx->n)
+    {
+        case 5:  return sse2_medians_run(ctx, cy, row, 5);
+        case 9:  return sse2_medians_run(ctx, cy, row, 9);
+        case 25: return sse2_medians_run(ctx, cy, row, 25);
+    }
+    return ctx->cx0;
+}
+
+static OPT_MED_TARGET_AVX2 int cs_medians_avx2(struct cs_ctx *ctx, int cy, struct cs_row *row)
+{
+    switch (ctx->n)
+    {
+        case 5:  return avx2_medians_run(ctx, cy, row, 5);
+        case 9:  return avx2_medians_run(ctx, cy, row, 9);
+        case 25: return avx2_medians_run(ctx, cy, row, 25);
+    }
+    return ctx->cx0;
+}
+
+#endif
+
+/* step 3: choose the interpolation direction and write the red and blue pixels, exactly like chroma_smooth.c */
+static void cs_output_row(struct cs_ctx *ctx, int cy, const struct cs_row *row)
+{
+    const int w = ctx->w;
+    const int *raw2ev = ctx->raw2ev;
+    const int *ev2raw = ctx->ev2raw;
+    const uint16_t *inp = ctx->inp;
+    uint16_t *out = ctx->out;
+    int y = 2 * cy;
+
+    for (int cx = ctx->cx0; cx < ctx->cx1; cx++)
+    {
+        int x = 2 * cx;
+        int eh = row->eh[cx];
+        int ev = row->ev[cx];
+        int drh = row->drh[cx];
+        int dbh = row->dbh[cx];
+        int drv = row->drv[cx];
+        int dbv = row->dbv[cx];
+
+        int g1 = raw2ev[inp[x+1 +     y * w]];
+        int g2 = raw2ev[inp[x   + (y+1) * w]];
+        int g3 = raw2ev[inp[x-1 +   (y) * w]];
+        int g4 = raw2ev[inp[x   + (y-1) * w]];
+        int g5 = raw2ev[inp[x+2 + (y+1) * w]];
+        int g6 = raw2ev[inp[x+1 + (y+2) * w]];
+
+        int grv = (g2+g4)/2;
+        int grh = (g1+g3)/2;
+        int gbv = (g1+g6)/2;
+        int gbh = (g2+g5)/2;
+        int gr = ev < eh ? grv : grh;
+        int gb = ev < eh ? gbv : gbh;
+        int dr = ev < eh ? drv : drh;
+        int db = ev < eh ? dbv : dbh;
+
+        int r0 = inp[x   +     y * w];
+        int b0 = inp[x+1 + (y+1) * w];
+
+        int thr = 64;
+        if (r0 < ctx->black+thr || b0 < ctx->black+thr || ABS(drv - drh) < thr || ABS(grv-grh) < thr || ABS(gbv-gbh) < thr)
+        {
+            dr = (drv+drh)/2;
+            db = (dbv+dbh)/2;
+            gr = (g1+g2+g3+g4)/4;
+            gb = (g1+g2+g5+g6)/4;
+        }
+
+        if (out[x   +     y * w] < ctx->white)
+            out[x   +     y * w] = ev2raw[COERCE(gr + dr, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
+
+        if (out[x+1  + (y+1)* w] < ctx->white)
+            out[x+1 + (y+1) * w] = ev2raw[COERCE(gb + db, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
+    }
+}
+
+static int cs_row_alloc(struct cs_row *row, int cw)
+{
+    int32_t *buf = malloc(6 * cw * sizeof(int32_t));
+    if (!buf)
+    {
+        return 0;
+    }
+    row->drh = buf;
+    row->dbh = buf + cw;
+    row->drv = buf + 2 * cw;
+    row->dbv = buf + 3 * cw;
+    row->eh  = buf + 4 * cw;
+    row->ev  = buf + 5 * cw;
+    return 1;
+}
+
+static void *cs_band_work(void *arg)
+{
+    struct cs_band *band = (struct cs_band *)arg;
+    struct cs_ctx *ctx = band->ctx;
+
+    if (band->phase == 0)
+    {
+        for (int cy = band->y0; cy < band->y1; cy++)
+        {
+            cs_planes_row(ctx, cy);
+        }
+        return NULL;
+    }
+
+    struct cs_row row;
+    if (!cs_row_alloc(&row, ctx->cw))
+    {
+        return (void *)1;
+    }
+
+    for (int cy = band->y0; cy < band->y1; cy++)
+    {
+        int cx = ctx->cx0;
+#ifdef OPT_MED_X86
+        switch (ctx->isa)
+        {
+            case CHROMA_SMOOTH_SSE2:
+                cx = cs_medians_sse2(ctx, cy, &row);
+                break;
+            case CHROMA_SMOOTH_AVX2:
+                cx = cs_medians_avx2(ctx, cy, &row);
+                break;
+        }
+#endif
+        cs_medians_scalar(ctx, cy, cx, &row);
+        cs_output_row(ctx, cy, &row);
+    }
+
+    free(row.drh);
+    return NULL;
+}
+
+/* split cell rows [y0, y1) into bands, one per thread; the calling thread takes the first one */
+static int cs_run_bands(struct cs_ctx *ctx, int phase, int y0, int y1, int threads)
+{
+    struct cs_band bands[64];
+    pthread_t tid[64];
+    int started[64];
+    int failed = 0;
+
+    threads = COERCE(threads, 1, 64);
+    threads = MAX(1, MIN(threads, y1 - y0));
+
+    for (int t = 0; t < threads; t++)
+    {
+        bands[t].ctx = ctx;
+        bands[t].phase = phase;
+        bands[t].y0 = y0 + (y1 - y0) * t / threads;
+        bands[t].y1 = y0 + (y1 - y0) * (t + 1) / threads;
+        started[t] = 0;
+    }
+
+    for (int t = 1; t < threads; t++)
+    {
+        started[t] = (pthread_create(&tid[t], NULL, cs_band_work, &bands[t]) == 0);
+    }
+
+    failed |= (cs_band_work(&bands[0]) != NULL);
+
+    for (int t = 1; t < threads; t++)
+    {
+        if (started[t])
+        {
+            void *ret = NULL;
+            pthread_join(tid[t], &ret);
+            failed |= (ret != NULL);
+        }
+        else
+        {
+            /* could not start a thread, do its band here */
+            failed |= (cs_band_work(&bands[t]) != NULL);
+        }
+    }
+
+    return !failed;
+}
+
+int chroma_smooth_isa_supported(int isa)
+{
+    switch (isa)
+    {
+        case CHROMA_SMOOTH_SCALAR:
+            return 1;
+#ifdef OPT_MED_X86
+        case CHROMA_SMOOTH_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case CHROMA_SMOOTH_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+int chroma_smooth_best_isa(void)
+{
+    if (chroma_smooth_isa_supported(CHROMA_SMOOTH_AVX2))
+    {
+        return CHROMA_SMOOTH_AVX2;
+    }
+    if (chroma_smooth_isa_supported(CHROMA_SMOOTH_SSE2))
+    {
+        return CHROMA_SMOOTH_SSE2;
+    }
+    return CHROMA_SMOOTH_SCALAR;
+}
+
+const char *chroma_smooth_isa_name(int isa)
+{
+    switch (isa)
+    {
+        case CHROMA_SMOOTH_SCALAR:
+            return "scalar";
+        case CHROMA_SMOOTH_SSE2:
+            return "SSE2";
+        case CHROMA_SMOOTH_AVX2:
+            return "AVX2";
+        default:
+            return "unknown";
+    }
+}
+
+int chroma_smooth_simd(int isa, int threads, int method, int w, int h, const uint16_t *inp, uint16_t *out,
+                       const int *raw2ev, const int *ev2raw, int black, int white)
+{
+    if (!chroma_smooth_isa_supported(isa))
+    {
+        return 0;
+    }
+
+    struct cs_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.isa = isa;
+    ctx.w = w;
+    ctx.h = h;
+    ctx.cw = w / 2 + 1;
+    ctx.inp = inp;
+    ctx.out = out;
+    ctx.raw2ev = raw2ev;
+    ctx.ev2raw = ev2raw;
+    ctx.black = black;
+    ctx.white = white;
+
+    if (method != 2 && method != 3 && method != 5)
+    {
+        return 0;
+    }
+
+    /* the window of chroma_smooth.c, 'max_ij' is CHROMA_SMOOTH_MAX_XY_IJ */
+    int max_ij = (method == 5) ? 4 : 2;
+    for (int i = -max_ij; i <= max_ij; i += 2)
+    {
+        for (int j = -max_ij; j <= max_ij; j += 2)
+        {
+            if (method == 2 && ABS(i) + ABS(j) == 4)
+                continue;
+
+            ctx.off[ctx.n++] = (j / 2) * ctx.cw + i / 2;
+        }
+    }
+
+    /* same ranges as the scalar loops: x in [2+max_ij, w-2-max_ij), y in [2+max_ij, h-3-max_ij), both even */
+    ctx.cx0 = (2 + max_ij) / 2;
+    ctx.cx1 = MAX(ctx.cx0, (w - 2 - max_ij + 1) / 2);
+    ctx.cy0 = (2 + max_ij) / 2;
+    ctx.cy1 = MAX(ctx.cy0, (h - 3 - max_ij + 1) / 2);
+
+    if (ctx.cx0 >= ctx.cx1 || ctx.cy0 >= ctx.cy1)
+    {
+        /* too small, nothing to do */
+        return 1;
+    }
+
+    ctx.pcx0 = ctx.cx0 - max_ij / 2;
+    ctx.pcx1 = ctx.cx1 + max_ij / 2;
+    ctx.pcy0 = ctx.cy0 - max_ij / 2;
+    ctx.pcy1 = ctx.cy1 + max_ij / 2;
+
+    size_t plane_size = (size_t)ctx.cw * (h / 2 + 1);
+    int32_t *planes = malloc(6 * plane_size * sizeof(int32_t));
+    if (!planes)
+    {
+        return 0;
+    }
+    ctx.planes.rh = planes;
+    ctx.planes.bh = planes + plane_size;
+    ctx.planes.eh = planes + 2 * plane_size;
+    ctx.planes.rv = planes + 3 * plane_size;
+    ctx.planes.bv = planes + 4 * plane_size;
+    ctx.planes.ev = planes + 5 * plane_size;
+
+    /* output rows need the planes of their neighbours, so all planes are done before */
+    int ok = cs_run_bands(&ctx, 0, ctx.pcy0, ctx.pcy1, threads) &&
+             cs_run_bands(&ctx, 1, ctx.cy0, ctx.cy1, threads);
+
+    free(planes);
+
+    /* on failure the caller runs the scalar filter; rows already written get the same values again */
+    return ok;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _chroma_smooth_simd_h_
+#define _chroma_smooth_simd_h_
+
+#include <stdint.h>
+
+/*
+   vectorized version of the chroma_smooth.c filters (2x2, 3x3 and 5x5), bit exact.
+
+   the scalar filter looks up and interpolates the same RG/GB cells for every window they
+   are part of (up to 25 times for 5x5). here the per-cell terms (R/B minus interpolated G
+   in both directions and the interpolation errors) are computed once into planes, then
+   the medians of 4 (SSE2) or 8 (AVX2) neighbouring cells are computed with one run of the
+   sorting network. both steps are split into row bands over 'threads' threads.
+*/
+
+enum
+{
+    CHROMA_SMOOTH_SCALAR = 0,
+    CHROMA_SMOOTH_SSE2   = 1,
+    CHROMA_SMOOTH_AVX2   = 2,
+};
+
+int chroma_smooth_isa_supported(int isa);
+int chroma_smooth_best_isa(void);
+const char *chroma_smooth_isa_name(int isa);
+
+/* 'inp' is an unmodified copy of 'out', the same arguments as the CHROMA_SMOOTH_FUNC()s in chroma_smooth.c.
+   returns 0 without touching 'out' if 'isa' is not available (the caller should use the scalar filter then) */
+int chroma_smooth_simd(int isa, int threads, int method, int w, int h, const uint16_t *inp, uint16_t *out,
+                       const int *raw2ev, const int *ev2raw, int black, int white);
+
+#endif
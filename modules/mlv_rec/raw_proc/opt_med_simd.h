@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2017 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _opt_med_simd_h_
+#define _opt_med_simd_h_
+
+/*
+   the opt_med5/9/25 sorting networks from opt_med.h on vectors of 32 bit ints.
+
+   every lane is an independent set of values, so one call computes 4 (SSE2) or 8 (AVX2)
+   medians. the compare/exchange steps are exactly those of the scalar networks, so the
+   results are identical to opt_med5(), opt_med9() and opt_med25().
+
+   shared by mlv_rec/raw_proc and dual_iso (cr2hdr).
+*/
+
+/* the networks, 'S(a, b)' must leave the smaller value in a and the larger one in b */
+#define OPT_MED5_NETWORK(S, p) \
+    S(p[0], p[1]) ; S(p[3], p[4]) ; S(p[0], p[3]) ; \
+    S(p[1], p[4]) ; S(p[1], p[2]) ; S(p[2], p[3]) ; \
+    S(p[1], p[2]) ;
+
+#define OPT_MED9_NETWORK(S, p) \
+    S(p[1], p[2]) ; S(p[4], p[5]) ; S(p[7], p[8]) ; \
+    S(p[0], p[1]) ; S(p[3], p[4]) ; S(p[6], p[7]) ; \
+    S(p[1], p[2]) ; S(p[4], p[5]) ; S(p[7], p[8]) ; \
+    S(p[0], p[3]) ; S(p[5], p[8]) ; S(p[4], p[7]) ; \
+    S(p[3], p[6]) ; S(p[1], p[4]) ; S(p[2], p[5]) ; \
+    S(p[4], p[7]) ; S(p[4], p[2]) ; S(p[6], p[4]) ; \
+    S(p[4], p[2]) ;
+
+#define OPT_MED25_NETWORK(S, p) \
+    S(p[0], p[1]) ;   S(p[3], p[4]) ;   S(p[2], p[4]) ; \
+    S(p[2], p[3]) ;   S(p[6], p[7]) ;   S(p[5], p[7]) ; \
+    S(p[5], p[6]) ;   S(p[9], p[10]) ;  S(p[8], p[10]) ; \
+    S(p[8], p[9]) ;   S(p[12], p[13]) ; S(p[11], p[13]) ; \
+    S(p[11], p[12]) ; S(p[15], p[16]) ; S(p[14], p[16]) ; \
+    S(p[14], p[15]) ; S(p[18], p[19]) ; S(p[17], p[19]) ; \
+    S(p[17], p[18]) ; S(p[21], p[22]) ; S(p[20], p[22]) ; \
+    S(p[20], p[21]) ; S(p[23], p[24]) ; S(p[2], p[5]) ; \
+    S(p[3], p[6]) ;   S(p[0], p[6]) ;   S(p[0], p[3]) ; \
+    S(p[4], p[7]) ;   S(p[1], p[7]) ;   S(p[1], p[4]) ; \
+    S(p[11], p[14]) ; S(p[8], p[14]) ;  S(p[8], p[11]) ; \
+    S(p[12], p[15]) ; S(p[9], p[15]) ;  S(p[9], p[12]) ; \
+    S(p[13], p[16]) ; S(p[10], p[16]) ; S(p[10], p[13]) ; \
+    S(p[20], p[23]) ; S(p[17], p[23]) ; S(p[17], p[20]) ; \
+    S(p[21], p[24]) ; S(p[18], p[24]) ; S(p[18], p[21]) ; \
+    S(p[19], p[22]) ; S(p[8], p[17]) ;  S(p[9], p[18]) ; \
+    S(p[0], p[18]) ;  S(p[0], p[9]) ;   S(p[10], p[19]) ; \
+    S(p[1], p[19]) ;  S(p[1], p[10]) ;  S(p[11], p[20]) ; \
+    S(p[2], p[20]) ;  S(p[2], p[11]) ;  S(p[12], p[21]) ; \
+    S(p[3], p[21]) ;  S(p[3], p[12]) ;  S(p[13], p[22]) ; \
+    S(p[4], p[22]) ;  S(p[4], p[13]) ;  S(p[14], p[23]) ; \
+    S(p[5], p[23]) ;  S(p[5], p[14]) ;  S(p[15], p[24]) ; \
+    S(p[6], p[24]) ;  S(p[6], p[15]) ;  S(p[7], p[16]) ; \
+    S(p[7], p[19]) ;  S(p[13], p[21]) ; S(p[15], p[23]) ; \
+    S(p[7], p[13]) ;  S(p[7], p[15]) ;  S(p[1], p[9]) ; \
+    S(p[3], p[11]) ;  S(p[5], p[17]) ;  S(p[11], p[17]) ; \
+    S(p[9], p[17]) ;  S(p[4], p[10]) ;  S(p[6], p[12]) ; \
+    S(p[7], p[14]) ;  S(p[4], p[6]) ;   S(p[4], p[7]) ; \
+    S(p[12], p[14]) ; S(p[10], p[14]) ; S(p[6], p[7]) ; \
+    S(p[10], p[12]) ; S(p[6], p[10]) ;  S(p[6], p[17]) ; \
+    S(p[12], p[17]) ; S(p[7], p[17]) ;  S(p[7], p[10]) ; \
+    S(p[12], p[18]) ; S(p[7], p[12]) ;  S(p[10], p[18]) ; \
+    S(p[12], p[20]) ; S(p[10], p[20]) ; S(p[10], p[12]) ;
+
+/* scalar version, for the pixels left over at the end of a row */
+#define OPT_MED_SORT_SCALAR(a, b) { if ((a) > (b)) { int tmp = (a); (a) = (b); (b) = tmp; } }
+
+static inline __attribute__((always_inline)) int opt_med_scalar(int * p, const int n)
+{
+    switch (n)
+    {
+        case 5:  OPT_MED5_NETWORK(OPT_MED_SORT_SCALAR, p)  return p[2];
+        case 9:  OPT_MED9_NETWORK(OPT_MED_SORT_SCALAR, p)  return p[4];
+        case 25: OPT_MED25_NETWORK(OPT_MED_SORT_SCALAR, p) return p[12];
+    }
+    return 0;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OPT_MED_X86
+#include <immintrin.h>
+
+#define OPT_MED_TARGET_SSE2 __attribute__((target("sse2")))
+#define OPT_MED_TARGET_AVX2 __attribute__((target("avx2")))
+#define OPT_MED_KERNEL static inline __attribute__((always_inline))
+
+/* SSE2 has no 32 bit min/max, so exchange the lanes where a > b */
+#define OPT_MED_SORT_SSE2(a, b) { \
+    __m128i swap = _mm_and_si128(_mm_xor_si128(a, b), _mm_cmpgt_epi32(a, b)); \
+    a = _mm_xor_si128(a, swap); \
+    b = _mm_xor_si128(b, swap); }
+
+#define OPT_MED_SORT_AVX2(a, b) { \
+    __m256i lo = _mm256_min_epi32(a, b); \
+    b = _mm256_max_epi32(a, b); \
+    a = lo; }
+
+/* median of the first 'n' vectors (5, 9 or 25), the input array is modified */
+OPT_MED_KERNEL OPT_MED_TARGET_SSE2 __m128i opt_med_sse2(__m128i * p, const int n)
+{
+    switch (n)
+    {
+        case 5:  OPT_MED5_NETWORK(OPT_MED_SORT_SSE2, p)  return p[2];
+        case 9:  OPT_MED9_NETWORK(OPT_MED_SORT_SSE2, p)  return p[4];
+        case 25: OPT_MED25_NETWORK(OPT_MED_SORT_SSE2, p) return p[12];
+    }
+    return p[0];
+}
+
+OPT_MED_KERNEL OPT_MED_TARGET_AVX2 __m256i opt_med_avx2(__m256i * p, const int n)
+{
+    switch (n)
+    {
+        case 5:  OPT_MED5_NETWORK(OPT_MED_SORT_AVX2, p)  return p[2];
+        case 9:  OPT_MED9_NETWORK(OPT_MED_SORT_AVX2, p)  return p[4];
+        case 25: OPT_MED25_NETWORK(OPT_MED_SORT_AVX2, p) return p[12];
+    }
+    return p[0];
+}
+#endif
+
+#endif
@@ -25,8 +25,8 @@
 #include "wirth.h"
 #include "math.h"
 #include "patternnoise.h"
+#include "stats_cache.h"
 
-static int g_debug_flags;
 #ifndef WIN32
 #define MIN(a,b) \
 ({ __typeof__ ((a)+(b)) _a = (a); \
@@ -179,10 +179,30 @@ static void horizontal_edge_aware_blur_rggb(
     free(dif_bg);
 }
 
+/* apply the column offsets found by fix_column_noise, then remove their median 'mc' */
+static void apply_column_offsets(int16_t * original, int * col_offsets, int mc, int w, int h)
+{
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            original[x + y*w] = COERCE((int)original[x + y*w] + col_offsets[x], -32767, 32767);
+        }
+    }
+    
+    for (int i = 0; i < w*h; i++)
+    {
+        /* FIXME: clamping to 32766 causes overflow */
+        original[i] = COERCE((int)original[i] - mc, 0, 32760);
+    }
+}
+
 /* Find and apply a scalar offset to each column, to reduce pattern noise */
 /* original: input and output */
 /* denoised: input only */
-static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int white)
+/* profile: output, the w column offsets followed by their median (for stats_cache) */
+/* debug_flags: FIXPN_DBG_*, passed down rather than kept in a global (mlv_dump calls this from several threads) */
+static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int white, int * profile, int debug_flags)
 {
     /* let's say the difference between original and denoised is mostly noise */
     int16_t * noise = malloc(w * h * sizeof(noise[0]));
@@ -212,14 +232,14 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
         }
     }
     
-    if (g_debug_flags & FIXPN_DBG_DENOISED)
+    if (debug_flags & FIXPN_DBG_DENOISED)
     {
         /* debug: show denoised image */
         for (int i = 0; i < w*h; i++)
             original[i] = denoised[i];
         goto end;
     }
-    else if (g_debug_flags & FIXPN_DBG_NOISE)
+    else if (debug_flags & FIXPN_DBG_NOISE)
     {
         /* debug: show the noise image */
         for (int i = 0; i < w*h; i++)
@@ -229,7 +249,7 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
         }
         goto end;
     }
-    else if (g_debug_flags & FIXPN_DBG_MASK)
+    else if (debug_flags & FIXPN_DBG_MASK)
     {
         /* debug: show the mask */
         for (int i = 0; i < w*h; i++)
@@ -254,24 +274,14 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
         col_offsets[x] = offset;
     }
     
-    /* almost done, now apply the offsets */
-    for (int y = 0; y < h; y++)
-    {
-        for (int x = 0; x < w; x++)
-        {
-            original[x + y*w] = COERCE((int)original[x + y*w] + col_offsets[x], -32767, 32767);
-        }
-    }
-    
     /* remove median from offsets, to prevent color cast */
-    /* note: median modifies the array, so we do this after applying the offsets to the image */
+    /* note: median modifies the array, so keep a copy of the offsets */
+    memcpy(profile, col_offsets, w * sizeof(col_offsets[0]));
     int mc = median_int_wirth(col_offsets, w);
+    profile[w] = mc;
     
-    for (int i = 0; i < w*h; i++)
-    {
-        /* FIXME: clamping to 32766 causes overflow */
-        original[i] = COERCE((int)original[i] - mc, 0, 32760);
-    }
+    /* almost done, now apply the offsets */
+    apply_column_offsets(original, profile, mc, w, h);
     
 end:
     free(noise);
@@ -309,7 +319,9 @@ static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int d
     }
 }
 
-static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
+/* profile: 4 * (w/2 + 1) values, the column offsets and their median for each channel */
+/* if 'cached', these are applied as they are, otherwise they are computed from the image */
+static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white, int * profile, int cached, int debug_flags)
 {
     /* assume Bayer order [RGGB] */
     int16_t * r        = malloc(w/2 * h/2 * sizeof(r[0]));   /* red channel (bottom left) */
@@ -327,15 +339,29 @@ static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
     extract_channel(raw, g2, w, h, 0, 1);
     extract_channel(raw, b,  w, h, 1, 1);
     
-    /* strong horizontal denoising (1-D median blur on G, R-G and B-G, stop on edge */
-    /* (this step takes a lot of time) */
-    horizontal_edge_aware_blur_rggb(r, g1, g2, b, rs, g1s, g2s, bs, w/2, h/2, 50, 500);
+    int16_t * channels[4] = { r, g1, g2, b };
+    int16_t * smoothed[4] = { rs, g1s, g2s, bs };
+    int stride = w/2 + 1;
     
-    /* after blurring horizontally, the difference reveals vertical FPN */
-    fix_column_noise(r,  rs,  w/2, h/2, white);
-    fix_column_noise(g1, g1s, w/2, h/2, white);
-    fix_column_noise(g2, g2s, w/2, h/2, white);
-    fix_column_noise(b,  bs,  w/2, h/2, white);
+    if (cached)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            apply_column_offsets(channels[c], &profile[c * stride], profile[c * stride + w/2], w/2, h/2);
+        }
+    }
+    else
+    {
+        /* strong horizontal denoising (1-D median blur on G, R-G and B-G, stop on edge */
+        /* (this step takes a lot of time) */
+        horizontal_edge_aware_blur_rggb(r, g1, g2, b, rs, g1s, g2s, bs, w/2, h/2, 50, 500);
+        
+        /* after blurring horizontally, the difference reveals vertical FPN */
+        for (int c = 0; c < 4; c++)
+        {
+            fix_column_noise(channels[c], smoothed[c], w/2, h/2, white, &profile[c * stride], debug_flags);
+        }
+    }
     
     /* commit changes */
     set_channel(raw, r,  w, h, 0, 0);
@@ -354,25 +380,36 @@ static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
     free(bs);
 }
 
-void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags)
+void fix_pattern_noise(int16_t * raw, int w, int h, int white, uint32_t frame_number, int debug_flags)
 {
-    g_debug_flags = debug_flags;
+    /* the column profiles of both passes, see fix_column_noise_rggb; statistics are not cached when debugging */
+    int col_size = 4 * (w/2 + 1);
+    int row_size = 4 * (h/2 + 1);
+    int * profile = malloc((col_size + row_size) * sizeof(profile[0]));
+    int cached = !debug_flags && stats_cache_get(STATS_PATTERN_NOISE, frame_number, profile, col_size + row_size);
     
     /* fix vertical noise, then transpose and repeat for the horizontal one */
     /* not very efficient, but at least avoids duplicate code */
     /* note: when debugging, we process only one direction */
-    if (!g_debug_flags || !(g_debug_flags & FIXPN_DBG_ROWNOISE))
+    if (!debug_flags || !(debug_flags & FIXPN_DBG_ROWNOISE))
     {
-        fix_column_noise_rggb(raw, w, h, white);
+        fix_column_noise_rggb(raw, w, h, white, profile, cached, debug_flags);
     }
     
-    if (!g_debug_flags || (g_debug_flags & FIXPN_DBG_ROWNOISE))
+    if (!debug_flags || (debug_flags & FIXPN_DBG_ROWNOISE))
     {
         /* transpose, process just like before, then transpose back */
         int16_t * raw_t = malloc(w * h * sizeof(raw[0]));
         transpose(raw, raw_t, w, h);
-        fix_column_noise_rggb(raw_t, h, w, white);
+        fix_column_noise_rggb(raw_t, h, w, white, profile + col_size, cached, debug_flags);
         transpose(raw_t, raw, h, w);
         free(raw_t);
     }
-}
\ No newline at end of file
+    
+    if (!debug_flags && !cached)
+    {
+        stats_cache_put(STATS_PATTERN_NOISE, frame_number, profile, col_size + row_size);
+    }
+    
+    free(profile);
+}
@@ -13,7 +13,8 @@
 
 #include "stdint.h"
 
-void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags);
+/* frame_number: for reusing the offsets from stats_cache.h (re-exports, or one estimate every N frames) */
+void fix_pattern_noise(int16_t * raw, int w, int h, int white, uint32_t frame_number, int debug_flags);
 
 /* debug flags */
 #define FIXPN_DBG_COLNOISE  0
@@ -24,11 +24,13 @@
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <raw.h>
 #include "opt_med.h"
 #include "wirth.h"
 #include "pixel_proc.h"
+#include "chroma_smooth_simd.h"
 
 #define EV_RESOLUTION 65536
 
@@ -91,7 +93,7 @@ static int * get_ev2raw(int black)
     return ev2raw;
 }
 
-void chroma_smooth(uint16_t * image_data, int width, int height, int black, int white, int method)
+void chroma_smooth(uint16_t * image_data, int width, int height, int black, int white, int method, int isa, int threads)
 {
     int * raw2ev = get_raw2ev(black);
     int * ev2raw = get_ev2raw(black);
@@ -105,6 +107,13 @@ void chroma_smooth(uint16_t * image_data, int width, int height, int black, int
     }
     memcpy(buf, image_data, width*height*sizeof(uint16_t));
     
+    /* bit exact with the filters below, falls back to them if the instruction set is not available */
+    if (isa != CHROMA_SMOOTH_SCALAR && chroma_smooth_simd(isa, threads, method, width, height, buf, image_data, raw2ev, ev2raw, black, white))
+    {
+        free(buf);
+        return;
+    }
+    
     switch (method) {
         case 2:
             chroma_smooth_2x2(width, height, buf, image_data, raw2ev, ev2raw, black, white);
@@ -292,9 +301,6 @@ struct pixel_map
     struct pixel_xy * pixels;
 };
 
-static struct pixel_map focus_pixel_map = { PIX_FOCUS, 0, 0, NULL };
-static struct pixel_map bad_pixel_map = { PIX_BAD, 0, 0, NULL };
-
 static int add_pixel_to_map(struct pixel_map * map, int x, int y)
 {
     if(!map->capacity)
@@ -352,7 +358,11 @@ static int load_pixel_map(struct pixel_map * map, char * mlv_name, uint32_t came
     }
 
     /* if .fpm has header compare cameraID from this header to cameraID from MLV, if different then return 0 */
-    if(cam_id != 0 && cam_id != camera_id) return 0;
+    if(cam_id != 0 && cam_id != camera_id)
+    {
+        fclose(f);
+        return 0;
+    }
 
     int x, y;
     while (fscanf(f, "%d%*[ \t]%d%*[^\n]", &x, &y) != EOF)
@@ -1003,349 +1013,591 @@ static int fpm_get_video_mode(int32_t raw_width, int32_t raw_height, int crop_re
     }
 }
 
-void fix_focus_pixels(uint16_t * image_data, struct parameter_list par)
+/* compiled pixel maps ***************************************************************************/
+
+/* how a map pixel is repaired, decided once per frame geometry instead of for every pixel of every frame */
+enum fix_method { FIX_AROUND, FIX_HORIZONTAL, FIX_VERTICAL, FIX_MEDIAN, FIX_COPY_RIGHT, FIX_COPY_LEFT };
+
+/* 'count' map pixels of one row, 'step' apart, the first one at image index 'start' = (x, y) */
+struct pixel_run
 {
-    int w = par.width;
-    int h = par.height;
-    int black = par.black_level;
-    int cropX = (par.pan_x + 7) & ~7;
-    int cropY = par.pan_y & ~1;
+    int method;
+    int start;
+    int step;
+    int count;
+    int x;
+    int y;
+};
 
-    int * raw2ev = get_raw2ev(black);
-    int * ev2raw = get_ev2raw(black);
-    if(raw2ev == NULL)
+/* a pixel map translated to image indices for one frame geometry, in map order (the repairs read already repaired neighbours) */
+struct compiled_map
+{
+    int width;
+    int height;
+    int crop_x;
+    int crop_y;
+    int dual_iso;
+    int median;
+    size_t count;
+    size_t capacity;
+    struct pixel_run * runs;
+    struct compiled_map * next;
+};
+
+/* a map in sensor coordinates, with all frame geometries it was compiled for */
+struct cached_map
+{
+    int type;
+    char key[1024];
+    struct pixel_map map;
+    struct compiled_map * compiled;
+    struct cached_map * next;
+};
+
+/* the map of the clip being processed, NULL if it does not need one */
+struct clip_map
+{
+    char mlv_name[1024];
+    int resolved;
+    struct cached_map * cached;
+};
+
+/* all maps of the process: clips from the same camera and video mode share the generated focus pixel map */
+static struct cached_map * pixel_map_cache = NULL;
+static struct clip_map clip_maps[2] = { { "", 0, NULL }, { "", 0, NULL } };
+
+/* mlv_dump processes frames on several threads, compiled maps are never changed once published */
+static pthread_mutex_t pixel_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int add_run(struct compiled_map * cm, int method, int i, int x, int y)
+{
+    if (cm->count)
     {
-        err_printf("raw2ev LUT error\n");
-        return;
+        struct pixel_run * run = &cm->runs[cm->count - 1];
+        if (run->method == method && run->y == y)
+        {
+            if (run->count == 1 && i > run->start)
+            {
+                run->step = i - run->start;
+                run->count++;
+                return 1;
+            }
+            if (run->count > 1 && i == run->start + run->count * run->step)
+            {
+                run->count++;
+                return 1;
+            }
+        }
+    }
+
+    if (cm->count >= cm->capacity)
+    {
+        size_t capacity = cm->capacity ? cm->capacity * 2 : 64;
+        struct pixel_run * runs = realloc(cm->runs, capacity * sizeof(struct pixel_run));
+        if (!runs)
+        {
+            err_printf("malloc error\n");
+            return 0;
+        }
+        cm->runs = runs;
+        cm->capacity = capacity;
     }
 
-    static int fpm_status = 0;
-fpm_check:
-    // fpm_status: 0 = not loaded, 1 = not exists (generate), 2 = loaded/generated (interpolate), 3 = no focus pixel map is generated (unsupported camera)
-    switch(fpm_status)
+    struct pixel_run * run = &cm->runs[cm->count++];
+    run->method = method;
+    run->start = i;
+    run->step = 0;
+    run->count = 1;
+    run->x = x;
+    run->y = y;
+    return 1;
+}
+
+/* same decisions as the per-pixel loop used to make, see apply_compiled_map() for the repairs */
+static void compile_pixel_map(struct pixel_map * map, struct compiled_map * cm)
+{
+    int w = cm->width;
+    int h = cm->height;
+
+    for (size_t m = 0; m < map->count; m++)
     {
-        case 0: // load fpm
+        int x = map->pixels[m].x - cm->crop_x;
+        int y = map->pixels[m].y - cm->crop_y;
+        int i = x + y*w;
+        int method = -1;
+
+        if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
         {
-            if(load_pixel_map(&focus_pixel_map, par.mlv_name, par.camera_id, par.raw_width, par.raw_height, par.dual_iso, par.show_progress))
+            if(cm->dual_iso)
+            {
+                method = FIX_HORIZONTAL;
+            }
+            else if(cm->median)
             {
-                fpm_status = 2;
+                method = FIX_MEDIAN;
             }
             else
             {
-                fpm_status = 1;
+                method = FIX_AROUND;
             }
-            goto fpm_check;
         }
-        
-        case 1: // generate pixel pattern
+        else if(i > 0 && i < w * h)
         {
-            enum pattern pattern = fpm_get_pattern(par.camera_id);
-            if(pattern == PATTERN_NONE)
+            // handle edge pixels
+            int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
+            int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
+
+            if (horizontal_edge && !vertical_edge && !cm->dual_iso)
             {
-                fpm_status = 3;
+                method = FIX_VERTICAL;
             }
-            else
+            else if (vertical_edge && !horizontal_edge)
             {
-                enum video_mode video_mode = fpm_get_video_mode(par.raw_width, par.raw_height, par.crop_rec, par.unified);
-                if (par.show_progress) printf("\nGenerating focus pixel map for ");
-                switch(video_mode)
-                {
-                    case MV_720:
-                        if (par.show_progress) printf("'mv720' mode\n");
-                        fpm_mv720(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_1080:
-                        if (par.show_progress) printf("'mv1080' mode\n");
-                        fpm_mv1080(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_1080CROP:
-                        if (par.show_progress) printf("'mv1080crop' mode\n");
-                        fpm_mv1080crop(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_ZOOM:
-                        if (par.show_progress) printf("'mvZoom' mode\n");
-                        fpm_zoom(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_CROPREC:
-                        if (par.show_progress) printf("'mvCrop_rec' mode\n");
-                        fpm_crop_rec(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-
-                    case MV_720_U:
-                        if (par.show_progress)printf("'mv720' lossless mode\n");
-                        fpm_mv720_u(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_1080_U:
-                        if (par.show_progress) printf("'mv1080' lossless mode\n");
-                        fpm_mv1080_u(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_1080CROP_U:
-                        if (par.show_progress) printf("'mv1080crop' lossless mode\n");
-                        fpm_mv1080crop_u(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_ZOOM_U:
-                        if (par.show_progress) printf("'mvZoom' lossless mode\n");
-                        fpm_zoom_u(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    case MV_CROPREC_U:
-                        if (par.show_progress) printf("'mvCrop_rec' lossless mode\n");
-                        fpm_crop_rec_u(&focus_pixel_map, pattern, par.raw_width);
-                        break;
-                    
-                    default:
-                        break;
-                }
-                if (par.show_progress) printf(""FMT_SIZE" pixels generated\n", focus_pixel_map.count);
-
-                fpm_status = 2;
+                method = FIX_HORIZONTAL;
+            }
+            else if(x >= 0 && x <= 3)
+            {
+                method = FIX_COPY_RIGHT;
+            }
+            else if(x >= w - 3 && x < w)
+            {
+                method = FIX_COPY_LEFT;
             }
-            goto fpm_check;
         }
 
-        case 2: // interpolate pixels
+        if (method >= 0 && !add_run(cm, method, i, x, y))
         {
-            for (size_t m = 0; m < focus_pixel_map.count; m++)
-            {
-                int x = focus_pixel_map.pixels[m].x - cropX;
-                int y = focus_pixel_map.pixels[m].y - cropY;
-
-                int i = x + y*w;
-                if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
-                {
-                    if(par.dual_iso)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(par.fpi_method)
-                    {
-                        interpolate_pixel(image_data, x, y, w, h);
-                    }
-                    else
-                    {
-                        interpolate_around(image_data, i, w, raw2ev, ev2raw);
-                    }
-                }
-                else if(i > 0 && i < w * h)
-                {
-                    // handle edge pixels
-                    int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
-                    int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
-                    
-                    if (horizontal_edge && !vertical_edge && !par.dual_iso)
-                    {
-                        interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
-                    }
-                    else if (vertical_edge && !horizontal_edge)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(x >= 0 && x <= 3)
-                    {
-                        image_data[i] = image_data[i + 2];
-                    }
-                    else if(x >= w - 3 && x < w)
-                    {
-                        image_data[i] = image_data[i - 2];
-                    }
-                }
-            }
-            break;
+            cm->count = 0;
+            return;
         }
-        default:
+    }
+}
+
+/* one branch per run of pixels, not per pixel */
+static void apply_compiled_map(uint16_t * image_data, struct compiled_map * cm, int * raw2ev, int * ev2raw)
+{
+    int w = cm->width;
+    int h = cm->height;
+
+    for (size_t r = 0; r < cm->count; r++)
+    {
+        struct pixel_run * run = &cm->runs[r];
+        int i = run->start;
+        int step = run->step;
+        int n = run->count;
+
+        switch (run->method)
         {
-            break;
+            case FIX_AROUND:
+                for (int k = 0; k < n; k++, i += step)
+                    interpolate_around(image_data, i, w, raw2ev, ev2raw);
+                break;
+
+            case FIX_HORIZONTAL:
+                for (int k = 0; k < n; k++, i += step)
+                    interpolate_horizontal(image_data, i, raw2ev, ev2raw);
+                break;
+
+            case FIX_VERTICAL:
+                for (int k = 0; k < n; k++, i += step)
+                    interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
+                break;
+
+            case FIX_MEDIAN:
+                for (int k = 0, x = run->x; k < n; k++, x += step)
+                    interpolate_pixel(image_data, x, run->y, w, h);
+                break;
+
+            case FIX_COPY_RIGHT:
+                for (int k = 0; k < n; k++, i += step)
+                    image_data[i] = image_data[i + 2];
+                break;
+
+            case FIX_COPY_LEFT:
+                for (int k = 0; k < n; k++, i += step)
+                    image_data[i] = image_data[i - 2];
+                break;
         }
     }
 }
 
-void fix_bad_pixels(uint16_t * image_data, struct parameter_list par)
+static void free_compiled_maps(struct cached_map * cached)
 {
-    int w = par.width;
-    int h = par.height;
-    int black = par.black_level;
-    int cropX = (par.pan_x + 7) & ~7;
-    int cropY = par.pan_y & ~1;
+    while (cached->compiled)
+    {
+        struct compiled_map * next = cached->compiled->next;
+        free(cached->compiled->runs);
+        free(cached->compiled);
+        cached->compiled = next;
+    }
+}
 
-    int * raw2ev = get_raw2ev(black);
-    int * ev2raw = get_ev2raw(black);
-    if(raw2ev == NULL)
+static struct cached_map * find_cached_map(int type, const char * key)
+{
+    for (struct cached_map * cached = pixel_map_cache; cached; cached = cached->next)
     {
-        err_printf("raw2ev LUT error\n");
-        return;
+        if (cached->type == type && !strcmp(cached->key, key))
+        {
+            return cached;
+        }
     }
+    return NULL;
+}
 
-    static int bpm_status = 0;
-bpm_check:
-    // bpm_status: 0 = not loaded, 1 = not exists (search), 2 = loaded/found (interpolate), 3 = no bad pixels found
-    switch(bpm_status)
+/* takes over the pixels of 'map', replaces a map with the same key (e.g. the same clip processed again) */
+static struct cached_map * add_cached_map(int type, const char * key, struct pixel_map * map)
+{
+    struct cached_map * cached = find_cached_map(type, key);
+    if (cached)
     {
-        case 0: // load bpm
+        free(cached->map.pixels);
+        free_compiled_maps(cached);
+    }
+    else
+    {
+        cached = calloc(1, sizeof(struct cached_map));
+        if (!cached)
         {
-            if(load_pixel_map(&bad_pixel_map, par.mlv_name, par.camera_id, par.raw_width, par.raw_height, par.dual_iso, par.show_progress))
-            {
-                bpm_status = 2;
-            }
-            else
-            {
-                bpm_status = 1;
-            }
-            goto bpm_check;
+            err_printf("malloc error\n");
+            free(map->pixels);
+            return NULL;
         }
-        case 1: // search for bad pixels and save to file if needed
+        cached->type = type;
+        snprintf(cached->key, sizeof(cached->key), "%s", key);
+        cached->next = pixel_map_cache;
+        pixel_map_cache = cached;
+    }
+
+    cached->map = *map;
+    return cached;
+}
+
+static struct compiled_map * get_compiled_map(struct cached_map * cached, int w, int h, int crop_x, int crop_y, int dual_iso, int median)
+{
+    struct compiled_map * cm;
+    for (cm = cached->compiled; cm; cm = cm->next)
+    {
+        if (cm->width == w && cm->height == h && cm->crop_x == crop_x && cm->crop_y == crop_y &&
+            cm->dual_iso == dual_iso && cm->median == median)
         {
-            //just guess the dark noise for speed reasons
-            int dark_noise = 12 ;
-            int dark_min = black - (dark_noise * 8);
-            int dark_max = black + (dark_noise * 8);
-            int x,y;
-            for (y = 6; y < h - 6; y ++)
+            return cm;
+        }
+    }
+
+    cm = calloc(1, sizeof(struct compiled_map));
+    if (!cm)
+    {
+        err_printf("malloc error\n");
+        return NULL;
+    }
+    cm->width = w;
+    cm->height = h;
+    cm->crop_x = crop_x;
+    cm->crop_y = crop_y;
+    cm->dual_iso = dual_iso;
+    cm->median = median;
+    compile_pixel_map(&cached->map, cm);
+
+    cm->next = cached->compiled;
+    cached->compiled = cm;
+    return cm;
+}
+
+/* map state of the clip 'mlv_name', starts over when another clip is processed */
+static struct clip_map * get_clip_map(int type, char * mlv_name)
+{
+    struct clip_map * clip = &clip_maps[type];
+    if (clip->resolved && strcmp(clip->mlv_name, mlv_name))
+    {
+        clip->resolved = 0;
+        clip->cached = NULL;
+    }
+    if (!clip->resolved)
+    {
+        snprintf(clip->mlv_name, sizeof(clip->mlv_name), "%s", mlv_name);
+    }
+    return clip;
+}
+
+/* the .fpm of the clip or camera, otherwise the generated pattern (once per process for every camera and video mode) */
+static struct cached_map * find_focus_map(struct parameter_list * par)
+{
+    struct pixel_map map = { PIX_FOCUS, 0, 0, NULL };
+    if(load_pixel_map(&map, par->mlv_name, par->camera_id, par->raw_width, par->raw_height, par->dual_iso, par->show_progress))
+    {
+        return add_cached_map(PIX_FOCUS, par->mlv_name, &map);
+    }
+    free(map.pixels);
+    map.pixels = NULL;
+    map.count = map.capacity = 0;
+
+    enum pattern pattern = fpm_get_pattern(par->camera_id);
+    if(pattern == PATTERN_NONE)
+    {
+        return NULL;
+    }
+
+    enum video_mode video_mode = fpm_get_video_mode(par->raw_width, par->raw_height, par->crop_rec, par->unified);
+
+    /* '*' can not be part of a file name, so these keys never match a clip */
+    char key[64];
+    snprintf(key, sizeof(key), "*%X %dx%d mode %d", par->camera_id, par->raw_width, par->raw_height, video_mode);
+    struct cached_map * cached = find_cached_map(PIX_FOCUS, key);
+    if(cached)
+    {
+        if (par->show_progress) printf("\nUsing focus pixel map generated for a previous clip ("FMT_SIZE" pixels)\n", cached->map.count);
+        return cached;
+    }
+
+    if (par->show_progress) printf("\nGenerating focus pixel map for ");
+    switch(video_mode)
+    {
+        case MV_720:
+            if (par->show_progress) printf("'mv720' mode\n");
+            fpm_mv720(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_1080:
+            if (par->show_progress) printf("'mv1080' mode\n");
+            fpm_mv1080(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_1080CROP:
+            if (par->show_progress) printf("'mv1080crop' mode\n");
+            fpm_mv1080crop(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_ZOOM:
+            if (par->show_progress) printf("'mvZoom' mode\n");
+            fpm_zoom(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_CROPREC:
+            if (par->show_progress) printf("'mvCrop_rec' mode\n");
+            fpm_crop_rec(&map, pattern, par->raw_width);
+            break;
+
+        case MV_720_U:
+            if (par->show_progress)printf("'mv720' lossless mode\n");
+            fpm_mv720_u(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_1080_U:
+            if (par->show_progress) printf("'mv1080' lossless mode\n");
+            fpm_mv1080_u(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_1080CROP_U:
+            if (par->show_progress) printf("'mv1080crop' lossless mode\n");
+            fpm_mv1080crop_u(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_ZOOM_U:
+            if (par->show_progress) printf("'mvZoom' lossless mode\n");
+            fpm_zoom_u(&map, pattern, par->raw_width);
+            break;
+        
+        case MV_CROPREC_U:
+            if (par->show_progress) printf("'mvCrop_rec' lossless mode\n");
+            fpm_crop_rec_u(&map, pattern, par->raw_width);
+            break;
+        
+        default:
+            break;
+    }
+    if (par->show_progress) printf(""FMT_SIZE" pixels generated\n", map.count);
+
+    return add_cached_map(PIX_FOCUS, key, &map);
+}
+
+/* search for bad pixels in this frame and save them to a file if needed */
+static struct cached_map * find_bad_pixels(uint16_t * image_data, struct parameter_list * par, int * raw2ev)
+{
+    int w = par->width;
+    int h = par->height;
+    int black = par->black_level;
+    int cropX = (par->pan_x + 7) & ~7;
+    int cropY = par->pan_y & ~1;
+
+    struct pixel_map map = { PIX_BAD, 0, 0, NULL };
+
+    //just guess the dark noise for speed reasons
+    int dark_noise = 12 ;
+    int dark_min = black - (dark_noise * 8);
+    int dark_max = black + (dark_noise * 8);
+    int x,y;
+    for (y = 6; y < h - 6; y ++)
+    {
+        for (x = 6; x < w - 6; x ++)
+        {
+            int p = image_data[x + y * w];
+            
+            int neighbours[10];
+            int max1 = 0;
+            int max2 = 0;
+            int k = 0;
+            for (int i = -2; i <= 2; i+=2)
             {
-                for (x = 6; x < w - 6; x ++)
+                for (int j = -2; j <= 2; j+=2)
                 {
-                    int p = image_data[x + y * w];
-                    
-                    int neighbours[10];
-                    int max1 = 0;
-                    int max2 = 0;
-                    int k = 0;
-                    for (int i = -2; i <= 2; i+=2)
-                    {
-                        for (int j = -2; j <= 2; j+=2)
-                        {
-                            if (i == 0 && j == 0) continue;
-                            int q = -(int)image_data[(x + j) + (y + i) * w];
-                            neighbours[k++] = q;
-                            if(q <= max1)
-                            {
-                                max2 = max1;
-                                max1 = q;
-                            }
-                            else if(q <= max2)
-                            {
-                                max2 = q;
-                            }
-                        }
-                    }
-                    
-                    if (p < dark_min) //cold pixel
-                    {
-                        add_pixel_to_map(&bad_pixel_map, x + cropX, y + cropY);
-                    }
-                    else if ((raw2ev[p] - raw2ev[-max2] > 2 * EV_RESOLUTION) && (p > dark_max)) //hot pixel
+                    if (i == 0 && j == 0) continue;
+                    int q = -(int)image_data[(x + j) + (y + i) * w];
+                    neighbours[k++] = q;
+                    if(q <= max1)
                     {
-                        add_pixel_to_map(&bad_pixel_map, x + cropX, y + cropY);
+                        max2 = max1;
+                        max1 = q;
                     }
-                    else if (par.aggressive)
+                    else if(q <= max2)
                     {
-                        int max3 = kth_smallest_int(neighbours, k, 2);
-                        if(((raw2ev[p] - raw2ev[-max2] > EV_RESOLUTION) || (raw2ev[p] - raw2ev[-max3] > EV_RESOLUTION)) && (p > dark_max))
-                        {
-                            add_pixel_to_map(&bad_pixel_map, x + cropX, y + cropY);
-                        }
+                        max2 = q;
                     }
                 }
             }
             
-            if (par.show_progress)
+            if (p < dark_min) //cold pixel
             {
-                const char * method = NULL;
-                if (par.aggressive)
-                {
-                    method = "AGGRESSIVE";
-                }
-                else
-                {
-                    method = "NORMAL";
-                }
-
-                printf("\nUsing bad pixel revealing method: '%s'\n", method);
-                if (par.dual_iso) printf("Dualiso iterpolation method 'HORIZONTAL'\n");
-                printf(""FMT_SIZE" bad pixels found for '%s' (crop: %d, %d)\n", bad_pixel_map.count, par.mlv_name, cropX, cropY);
-                if (!bad_pixel_map.count && par.save_bpm) printf("Bad pixel map file not written\n");
+                add_pixel_to_map(&map, x + cropX, y + cropY);
             }
-
-            if (bad_pixel_map.count)
+            else if ((raw2ev[p] - raw2ev[-max2] > 2 * EV_RESOLUTION) && (p > dark_max)) //hot pixel
             {
-                if (par.save_bpm)
-                {
-                    /* if save_bpm is non zero - save bad pixels to a file */
-                    save_pixel_map(&bad_pixel_map, par.mlv_name, par.show_progress);
-                }
-                bpm_status = 2; // bad pixels found, goto interpolation stage
+                add_pixel_to_map(&map, x + cropX, y + cropY);
             }
-            else
+            else if (par->aggressive)
             {
-                bpm_status = 3; // bad pixels not found, interpolation not needed
+                int max3 = kth_smallest_int(neighbours, k, 2);
+                if(((raw2ev[p] - raw2ev[-max2] > EV_RESOLUTION) || (raw2ev[p] - raw2ev[-max3] > EV_RESOLUTION)) && (p > dark_max))
+                {
+                    add_pixel_to_map(&map, x + cropX, y + cropY);
+                }
             }
-
-            goto bpm_check;
         }
-        case 2: // interpolate pixels
+    }
+    
+    if (par->show_progress)
+    {
+        const char * method = NULL;
+        if (par->aggressive)
         {
-            for (size_t m = 0; m < bad_pixel_map.count; m++)
-            {
-                int x = bad_pixel_map.pixels[m].x - cropX;
-                int y = bad_pixel_map.pixels[m].y - cropY;
-               
-                int i = x + y*w;
-                if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
-                {
-                    if(par.dual_iso)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(par.bpi_method)
-                    {
-                        interpolate_pixel(image_data, x, y, w, h);
-                    }
-                    else
-                    {
-                        interpolate_around(image_data, i, w, raw2ev, ev2raw);
-                    }
-                }
-                else if(i > 0 && i < w * h)
-                {
-                    // handle edge pixels
-                    int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
-                    int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
+            method = "AGGRESSIVE";
+        }
+        else
+        {
+            method = "NORMAL";
+        }
 
-                    if (horizontal_edge && !vertical_edge && !par.dual_iso)
-                    {
-                        interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
-                    }
-                    else if (vertical_edge && !horizontal_edge)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(x >= 0 && x <= 3)
-                    {
-                        image_data[i] = image_data[i + 2];
-                    }
-                    else if(x >= w - 3 && x < w)
-                    {
-                        image_data[i] = image_data[i - 2];
-                    }
-                }
-            }
-            break;
+        printf("\nUsing bad pixel revealing method: '%s'\n", method);
+        if (par->dual_iso) printf("Dualiso iterpolation method 'HORIZONTAL'\n");
+        printf(""FMT_SIZE" bad pixels found for '%s' (crop: %d, %d)\n", map.count, par->mlv_name, cropX, cropY);
+        if (!map.count && par->save_bpm) printf("Bad pixel map file not written\n");
+    }
+
+    if (!map.count)
+    {
+        // bad pixels not found, interpolation not needed
+        free(map.pixels);
+        return NULL;
+    }
+
+    if (par->save_bpm)
+    {
+        /* if save_bpm is non zero - save bad pixels to a file */
+        save_pixel_map(&map, par->mlv_name, par->show_progress);
+    }
+
+    return add_cached_map(PIX_BAD, par->mlv_name, &map);
+}
+
+void fix_focus_pixels(uint16_t * image_data, struct parameter_list par)
+{
+    int cropX = (par.pan_x + 7) & ~7;
+    int cropY = par.pan_y & ~1;
+
+    int * raw2ev = get_raw2ev(par.black_level);
+    int * ev2raw = get_ev2raw(par.black_level);
+    if(raw2ev == NULL)
+    {
+        err_printf("raw2ev LUT error\n");
+        return;
+    }
+
+    struct compiled_map * cm = NULL;
+
+    pthread_mutex_lock(&pixel_map_mutex);
+    struct clip_map * clip = get_clip_map(PIX_FOCUS, par.mlv_name);
+    if (!clip->resolved)
+    {
+        clip->cached = find_focus_map(&par);
+        clip->resolved = 1;
+    }
+    if (clip->cached)
+    {
+        cm = get_compiled_map(clip->cached, par.width, par.height, cropX, cropY, par.dual_iso, par.fpi_method);
+    }
+    pthread_mutex_unlock(&pixel_map_mutex);
+
+    if (cm)
+    {
+        apply_compiled_map(image_data, cm, raw2ev, ev2raw);
+    }
+}
+
+void fix_bad_pixels(uint16_t * image_data, struct parameter_list par)
+{
+    int cropX = (par.pan_x + 7) & ~7;
+    int cropY = par.pan_y & ~1;
+
+    int * raw2ev = get_raw2ev(par.black_level);
+    int * ev2raw = get_ev2raw(par.black_level);
+    if(raw2ev == NULL)
+    {
+        err_printf("raw2ev LUT error\n");
+        return;
+    }
+
+    struct compiled_map * cm = NULL;
+
+    pthread_mutex_lock(&pixel_map_mutex);
+    struct clip_map * clip = get_clip_map(PIX_BAD, par.mlv_name);
+    if (!clip->resolved)
+    {
+        /* the .bpm of the clip, otherwise the bad pixels of its first frame */
+        struct pixel_map map = { PIX_BAD, 0, 0, NULL };
+        if(load_pixel_map(&map, par.mlv_name, par.camera_id, par.raw_width, par.raw_height, par.dual_iso, par.show_progress))
+        {
+            clip->cached = add_cached_map(PIX_BAD, par.mlv_name, &map);
         }
-        default:
+        else
         {
-            break;
+            free(map.pixels);
+            clip->cached = find_bad_pixels(image_data, &par, raw2ev);
         }
+        clip->resolved = 1;
+    }
+    if (clip->cached)
+    {
+        cm = get_compiled_map(clip->cached, par.width, par.height, cropX, cropY, par.dual_iso, par.bpi_method);
+    }
+    pthread_mutex_unlock(&pixel_map_mutex);
+
+    if (cm)
+    {
+        apply_compiled_map(image_data, cm, raw2ev, ev2raw);
     }
 }
 
 void free_pixel_maps()
 {
-    if(focus_pixel_map.pixels) free(focus_pixel_map.pixels);
-    if(bad_pixel_map.pixels) free(bad_pixel_map.pixels);
+    pthread_mutex_lock(&pixel_map_mutex);
+    while (pixel_map_cache)
+    {
+        struct cached_map * next = pixel_map_cache->next;
+        free_compiled_maps(pixel_map_cache);
+        free(pixel_map_cache->map.pixels);
+        free(pixel_map_cache);
+        pixel_map_cache = next;
+    }
+    clip_maps[PIX_FOCUS].resolved = clip_maps[PIX_BAD].resolved = 0;
+    clip_maps[PIX_FOCUS].cached = clip_maps[PIX_BAD].cached = NULL;
+    pthread_mutex_unlock(&pixel_map_mutex);
 }
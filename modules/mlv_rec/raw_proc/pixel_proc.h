@@ -46,8 +46,8 @@ struct parameter_list
 	int32_t black_level;
 };
 
-/* do chroma smoothing with methods: 2x2, 3x3 and 5x5 */
-void chroma_smooth(uint16_t * image_data, int width, int height, int black, int white, int method);
+/* do chroma smoothing with methods: 2x2, 3x3 and 5x5, 'isa' is one of CHROMA_SMOOTH_SCALAR/SSE2/AVX2 from chroma_smooth_simd.h */
+void chroma_smooth(uint16_t * image_data, int width, int height, int black, int white, int method, int isa, int threads);
 /* fix focus raw pixels */
 void fix_focus_pixels(uint16_t * image_data, struct parameter_list par);
 /* fix all kind of bad raw pixels */
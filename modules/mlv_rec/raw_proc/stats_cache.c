@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2017 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wirth.h"
+#include "stats_cache.h"
+
+#ifdef __WIN32
+#define FMT_SIZE "%u"
+#else
+#define FMT_SIZE "%zu"
+#endif
+
+/* one line of the sidecar: 'S' or 'P', the sample frame, the value count, the values */
+static const char stats_kind_tag[STATS_KINDS] = { 'S', 'P' };
+
+struct stats_entry
+{
+    int kind;
+    uint32_t frame;
+    int count;
+    int * data;
+};
+
+struct stats_cache
+{
+    int enabled;
+    int use_file;
+    int interval;
+    int dirty;
+    int show_progress;
+    char file_name[1024];
+    struct stats_cache_key key;
+
+    /* sorted by kind, then frame */
+    size_t count;
+    size_t capacity;
+    struct stats_entry * entries;
+};
+
+static struct stats_cache stats_cache = { 0, 0, 1, 0, 0, "", { 0 }, 0, 0, NULL };
+
+/* first line of the sidecar */
+#define STATS_CACHE_HEADER "#RPC %X %dx%d %d %d stripes=%d dualiso=%d fixfp=%d fpi=%d fixcp=%d bpi=%d cs=%d"
+#define STATS_CACHE_HEADER_FIELDS 12
+
+/* mlv_dump processes frames on several threads */
+static pthread_mutex_t stats_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* index of the entry, or of the place where it would be inserted */
+static size_t find_entry(int kind, uint32_t frame)
+{
+    size_t lo = 0;
+    size_t hi = stats_cache.count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        struct stats_entry * e = &stats_cache.entries[mid];
+        if (e->kind < kind || (e->kind == kind && e->frame < frame))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int is_entry(size_t pos, int kind, uint32_t frame)
+{
+    return pos < stats_cache.count && stats_cache.entries[pos].kind == kind && stats_cache.entries[pos].frame == frame;
+}
+
+/* takes ownership of 'data' */
+static int set_entry(int kind, uint32_t frame, int * data, int count)
+{
+    size_t pos = find_entry(kind, frame);
+    if (is_entry(pos, kind, frame))
+    {
+        free(stats_cache.entries[pos].data);
+        stats_cache.entries[pos].data = data;
+        stats_cache.entries[pos].count = count;
+        return 1;
+    }
+
+    if (stats_cache.count >= stats_cache.capacity)
+    {
+        size_t capacity = stats_cache.capacity ? stats_cache.capacity * 2 : 64;
+        struct stats_entry * entries = realloc(stats_cache.entries, capacity * sizeof(struct stats_entry));
+        if (!entries)
+        {
+            err_printf("malloc error\n");
+            free(data);
+            return 0;
+        }
+        stats_cache.entries = entries;
+        stats_cache.capacity = capacity;
+    }
+
+    memmove(&stats_cache.entries[pos + 1], &stats_cache.entries[pos], (stats_cache.count - pos) * sizeof(struct stats_entry));
+    stats_cache.entries[pos].kind = kind;
+    stats_cache.entries[pos].frame = frame;
+    stats_cache.entries[pos].count = count;
+    stats_cache.entries[pos].data = data;
+    stats_cache.count++;
+    return 1;
+}
+
+static void load_stats_cache()
+{
+    FILE * f = fopen(stats_cache.file_name, "r");
+    if (!f) return;
+
+    struct stats_cache_key key;
+    memset(&key, 0, sizeof(key));
+    if (fscanf(f, STATS_CACHE_HEADER,
+               &key.camera_id, &key.width, &key.height, &key.black, &key.white,
+               &key.vertical_stripes, &key.dual_iso, &key.focus_pixels, &key.fpi_method,
+               &key.bad_pixels, &key.bpi_method, &key.chroma_smooth) != STATS_CACHE_HEADER_FIELDS ||
+        memcmp(&key, &stats_cache.key, sizeof(key)))
+    {
+        /* another clip, settings changed (e.g. --black-fix, --cs3x3, --no-fixfp)
+         * or an older sidecar: start over, the file will be rewritten */
+        if (stats_cache.show_progress)
+        {
+            printf("\nStatistics cache '%s' does not match this clip or its processing options, ignored\n", stats_cache.file_name);
+        }
+        fclose(f);
+        return;
+    }
+
+    char tag;
+    uint32_t frame;
+    int count;
+    while (fscanf(f, " %c %u %d", &tag, &frame, &count) == 3)
+    {
+        int kind = (tag == stats_kind_tag[STATS_PATTERN_NOISE]) ? STATS_PATTERN_NOISE : STATS_STRIPES;
+        int * data = count > 0 ? malloc(count * sizeof(int)) : NULL;
+        if (!data) break;
+
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            if (fscanf(f, "%d", &data[i]) != 1) break;
+        }
+
+        /* truncated file */
+        if (i < count || tag != stats_kind_tag[kind])
+        {
+            free(data);
+            break;
+        }
+
+        set_entry(kind, frame, data, count);
+    }
+
+    if (stats_cache.show_progress)
+    {
+        printf("\nUsing statistics cache: '%s'\n"FMT_SIZE" entries loaded\n", stats_cache.file_name, stats_cache.count);
+    }
+
+    fclose(f);
+}
+
+static void save_stats_cache()
+{
+    FILE * f = fopen(stats_cache.file_name, "w");
+    if (!f)
+    {
+        if (stats_cache.show_progress)
+        {
+            printf("ERROR: Can not write to %s\n", stats_cache.file_name);
+        }
+        return;
+    }
+
+    struct stats_cache_key * key = &stats_cache.key;
+    fprintf(f, STATS_CACHE_HEADER "\n",
+            key->camera_id, key->width, key->height, key->black, key->white,
+            key->vertical_stripes, key->dual_iso, key->focus_pixels, key->fpi_method,
+            key->bad_pixels, key->bpi_method, key->chroma_smooth);
+
+    for (size_t i = 0; i < stats_cache.count; i++)
+    {
+        struct stats_entry * e = &stats_cache.entries[i];
+        fprintf(f, "%c %u %d", stats_kind_tag[e->kind], e->frame, e->count);
+        for (int j = 0; j < e->count; j++)
+        {
+            fprintf(f, " %d", e->data[j]);
+        }
+        fprintf(f, "\n");
+    }
+
+    if (stats_cache.show_progress)
+    {
+        printf(""FMT_SIZE" statistics entries saved to '%s'\n", stats_cache.count, stats_cache.file_name);
+    }
+
+    fclose(f);
+}
+
+void stats_cache_init(char * mlv_name, struct stats_cache_key * key, int use_file, int interval, int show_progress)
+{
+    free_stats_cache();
+
+    stats_cache.use_file = use_file;
+    stats_cache.interval = interval > 1 ? interval : 1;
+    stats_cache.show_progress = show_progress;
+    stats_cache.key = *key;
+    stats_cache.dirty = 0;
+
+    /* with neither a file nor a sampling interval, nothing would ever be looked up again */
+    stats_cache.enabled = use_file || stats_cache.interval > 1;
+
+    if (use_file)
+    {
+        snprintf(stats_cache.file_name, sizeof(stats_cache.file_name), "%s", mlv_name);
+        char *ext_dot = strrchr(stats_cache.file_name, '.');
+        if(ext_dot) *ext_dot = '\000';
+        strncat(stats_cache.file_name, ".rpc", sizeof(stats_cache.file_name) - strlen(stats_cache.file_name) - 1);
+        load_stats_cache();
+    }
+}
+
+int stats_cache_enabled()
+{
+    return stats_cache.enabled;
+}
+
+uint32_t stats_cache_sample(uint32_t frame_number)
+{
+    return frame_number - frame_number % stats_cache.interval;
+}
+
+int stats_cache_get(int kind, uint32_t frame_number, int * data, int count)
+{
+    if (!stats_cache.enabled) return 0;
+
+    uint32_t frame = stats_cache_sample(frame_number);
+    int found = 0;
+
+    pthread_mutex_lock(&stats_cache_mutex);
+    size_t pos = find_entry(kind, frame);
+    if (is_entry(pos, kind, frame) && stats_cache.entries[pos].count == count)
+    {
+        memcpy(data, stats_cache.entries[pos].data, count * sizeof(int));
+        found = 1;
+    }
+    pthread_mutex_unlock(&stats_cache_mutex);
+
+    return found;
+}
+
+void stats_cache_put(int kind, uint32_t frame_number, const int * data, int count)
+{
+    if (!stats_cache.enabled) return;
+
+    int * copy = malloc(count * sizeof(int));
+    if (!copy)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+    memcpy(copy, data, count * sizeof(int));
+
+    pthread_mutex_lock(&stats_cache_mutex);
+    if (set_entry(kind, stats_cache_sample(frame_number), copy, count))
+    {
+        stats_cache.dirty = 1;
+    }
+    pthread_mutex_unlock(&stats_cache_mutex);
+}
+
+void free_stats_cache()
+{
+    if (stats_cache.use_file && stats_cache.dirty)
+    {
+        save_stats_cache();
+    }
+
+    for (size_t i = 0; i < stats_cache.count; i++)
+    {
+        free(stats_cache.entries[i].data);
+    }
+    free(stats_cache.entries);
+
+    stats_cache.entries = NULL;
+    stats_cache.count = 0;
+    stats_cache.capacity = 0;
+    stats_cache.dirty = 0;
+    stats_cache.enabled = 0;
+    stats_cache.use_file = 0;
+    stats_cache.interval = 1;
+}
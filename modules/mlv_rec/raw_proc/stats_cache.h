@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _stats_cache_h_
+#define _stats_cache_h_
+
+#include <stdint.h>
+
+/*
+   per-frame statistics of the raw corrections (vertical stripe coefficients,
+   column/row pattern noise offsets), kept in memory and in a '.rpc' sidecar
+   next to the MLV, so re-exporting a clip does not compute them again.
+
+   the sidecar is only used if camera, resolution, black and white level match,
+   and if it was made with the same raw processing options (these change the
+   image the statistics are taken from, or what is done with them).
+   with an interval N > 1, frames share the statistics of frame N*k (the sample frame);
+   the first frame processed in each group computes them.
+*/
+
+enum stats_kind
+{
+    STATS_STRIPES       = 0,
+    STATS_PATTERN_NOISE = 1,
+    STATS_KINDS
+};
+
+struct stats_cache_key
+{
+    uint32_t camera_id;
+    int width;
+    int height;
+    int black;
+    int white;
+
+    /* raw processing options, as in struct frame_info */
+    int vertical_stripes;
+    int dual_iso;
+    int focus_pixels;
+    int fpi_method;
+    int bad_pixels;
+    int bpi_method;
+    int chroma_smooth;
+};
+
+/* load the sidecar of 'mlv_name' (if 'use_file') and set the sampling interval; call before the first frame */
+void stats_cache_init(char * mlv_name, struct stats_cache_key * key, int use_file, int interval, int show_progress);
+/* 1 if lookups can succeed, i.e. init was called with a file or an interval > 1 */
+int stats_cache_enabled();
+/* the frame whose statistics are used for 'frame_number' */
+uint32_t stats_cache_sample(uint32_t frame_number);
+/* copy 'count' values stored for the sample frame of 'frame_number', returns 0 if there are none */
+int stats_cache_get(int kind, uint32_t frame_number, int * data, int count);
+/* store 'count' values for the sample frame of 'frame_number' */
+void stats_cache_put(int kind, uint32_t frame_number, const int * data, int count);
+/* write the sidecar if anything changed, then free everything */
+void free_stats_cache();
+
+#endif
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <math.h>
 #include "stripes.h"
+#include "stats_cache.h"
 
 /* Vertical stripes correction code from raw2dng, credits: a1ex */
 
@@ -351,6 +352,7 @@ void fix_vertical_stripes(uint16_t * image_data,
                           int32_t raw_info_frame_size,
                           uint16_t width,
                           uint16_t height,
+                          uint32_t frame_number,
                           int vertical_stripes,
                           int show_progress)
 {
@@ -360,7 +362,22 @@ void fix_vertical_stripes(uint16_t * image_data,
     static int first_time = 1;
     if (first_time || vertical_stripes == 2)
     {
-        detect_vertical_stripes_coeffs(&correction, image_data, black_level, white_level, raw_info_frame_size, width, height);
+        /* the cache stores 'correction_needed' followed by the coefficients */
+        int cached[9];
+        int from_cache = stats_cache_get(STATS_STRIPES, frame_number, cached, 9);
+        if (from_cache)
+        {
+            correction.correction_needed = cached[0];
+            memcpy(correction.coeffficients, &cached[1], sizeof(correction.coeffficients));
+        }
+        else
+        {
+            detect_vertical_stripes_coeffs(&correction, image_data, black_level, white_level, raw_info_frame_size, width, height);
+
+            cached[0] = correction.correction_needed;
+            memcpy(&cached[1], correction.coeffficients, sizeof(correction.coeffficients));
+            stats_cache_put(STATS_STRIPES, frame_number, cached, 9);
+        }
         
         if (first_time && show_progress)
         {
@@ -378,7 +395,7 @@ void fix_vertical_stripes(uint16_t * image_data,
                 method = "UNNEEDED";
             }
 
-            printf("\nVertical stripes correction: '%s'\n", method);
+            printf("\nVertical stripes correction: '%s'%s\n", method, from_cache ? " (cached)" : "");
             for (int j = 0; j < 8; j++)
             {
                 if (correction.coeffficients[j])
@@ -37,6 +37,7 @@ void fix_vertical_stripes(uint16_t * image_data,
                           int32_t raw_info_frame_size,
                           uint16_t width,
                           uint16_t height,
+                          uint32_t frame_number,
                           int vertical_stripes,
                           int show_progress);
 #endif
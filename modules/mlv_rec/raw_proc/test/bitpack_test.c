@@ -0,0 +1,388 @@
+/*
+ * bit exactness test and microbenchmark for the bitpack kernels
+ *
+ * every kernel is compared against bitinsert()/bitextract() and the
+ * loops mlv_dump and dng.c used before, on random data and for all
+ * pixel counts up to a few groups (so every tail length is covered).
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "bitpack.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define ROL32(v,a) ((v) << (a) | (v) >> (32-(a)))
+#define ROR32(v,a) ((v) >> (a) | (v) << (32-(a)))
+#define ROL16(v,a) ((v) << (a) | (v) >> (16-(a)))
+
+/* extra words behind every buffer, they must stay untouched */
+#define GUARD 16
+
+static const int depths[] = { 8, 10, 11, 12, 14, 16 };
+#define DEPTH_COUNT ((int)(sizeof(depths) / sizeof(depths[0])))
+
+/* dng_unpack_image_bits() from dng.c */
+static void ref_dng_unpack(uint16_t * input_buffer, uint16_t * output_buffer, size_t max_size, uint32_t bpp)
+{
+    uint32_t pixel_end = (uint32_t)(max_size / 2);
+    uint32_t mask = (1 << bpp) - 1;
+
+    uint16_t *packed_bits = input_buffer;
+    uint16_t *unpacked_bits = output_buffer;
+
+    for (uint32_t pixel_index = 0; pixel_index < pixel_end; pixel_index++)
+    {
+        uint32_t bits_offset = pixel_index * bpp;
+        uint32_t bits_address = bits_offset / 16;
+        uint32_t bits_shift = bits_offset % 16;
+        uint32_t rotate_value = 16 + ((32 - bpp) - bits_shift);
+        uint32_t uncorrected_data = *((uint32_t *)&packed_bits[bits_address]);
+        uint32_t data = ROR32(uncorrected_data, rotate_value);
+
+        unpacked_bits[pixel_index] = (uint16_t)(data & mask);
+    }
+}
+
+/* dng_pack_image_bits() from dng.c */
+static void ref_dng_pack(uint16_t * input_buffer, uint16_t * output_buffer, size_t max_size, uint32_t bpp)
+{
+    uint32_t pixel_end = (uint32_t)(max_size / 2);
+    uint32_t bits_free = 16 - bpp;
+
+    uint16_t *unpacked_bits = input_buffer;
+    uint16_t *packed_bits = output_buffer;
+
+    packed_bits[0] = unpacked_bits[0] << bits_free;
+    for (uint32_t pixel_index = 1; pixel_index < pixel_end; pixel_index++)
+    {
+        uint32_t bits_offset = (pixel_index * bits_free) % 16;
+        uint32_t bits_to_rol = bits_free + bits_offset + (bits_offset > 0) * 16;
+        uint32_t data = ROL32((uint32_t)unpacked_bits[pixel_index], bits_to_rol);
+        *(uint32_t *)packed_bits = (*(uint32_t *)packed_bits & 0x0000FFFF) | data;
+
+        if(bits_offset > 0 && bits_offset <= bpp)
+        {
+            *(uint16_t *)packed_bits = ROL16(*(uint16_t *)packed_bits, 8);
+            packed_bits++;
+        }
+    }
+}
+
+/* frame_convert_depth() from mlv_dump.c, for a single line */
+static void ref_convert(uint16_t *src_line, uint16_t *dst_line, int xRes, int old_depth, int new_depth)
+{
+    for(int x = 0; x < xRes; x++)
+    {
+        uint16_t value = bitextract(src_line, x, old_depth);
+
+        value <<= (16-old_depth);
+        if(old_depth < 16)
+        {
+            value += (1 << (15-old_depth));
+        }
+        value >>= (16-new_depth);
+
+        bitinsert(dst_line, x, new_depth, value);
+    }
+}
+
+static void fill_random(uint16_t *buf, size_t words)
+{
+    for(size_t pos = 0; pos < words; pos++)
+    {
+        buf[pos] = (uint16_t)rand();
+    }
+}
+
+static size_t packed_words(uint32_t count, int depth)
+{
+    return ((size_t)count * depth + 15) / 16;
+}
+
+static bool test_unpack(int isa, uint32_t count, int depth)
+{
+    size_t words = packed_words(count, depth);
+    uint16_t *src = malloc((words + GUARD) * 2);
+    uint16_t *ref = malloc((count + GUARD) * 2);
+    uint16_t *out = malloc((count + GUARD) * 2);
+
+    fill_random(src, words + GUARD);
+    fill_random(ref, count + GUARD);
+    memcpy(out, ref, (count + GUARD) * 2);
+
+    for(uint32_t pos = 0; pos < count; pos++)
+    {
+        ref[pos] = bitextract(src, pos, depth);
+    }
+    bitpack_unpack_isa(isa, src, out, count, depth);
+
+    bool ok = !memcmp(ref, out, (count + GUARD) * 2);
+
+    /* the DNG loop reads 32 bits at a time, so it can only be compared with a guard word */
+    if(depth < 16)
+    {
+        ref_dng_unpack(src, ref, count * 2, depth);
+        ok = ok && !memcmp(ref, out, count * 2);
+    }
+
+    free(src);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static bool test_pack(int isa, uint32_t count, int depth)
+{
+    size_t words = packed_words(count, depth);
+    uint16_t *src = malloc((count + 1) * 2);
+    uint16_t *ref = malloc((words + GUARD) * 2);
+    uint16_t *out = malloc((words + GUARD) * 2);
+
+    /* values out of range must be masked */
+    fill_random(src, count + 1);
+    fill_random(ref, words + GUARD);
+    memcpy(out, ref, (words + GUARD) * 2);
+
+    for(uint32_t pos = 0; pos < count; pos++)
+    {
+        bitinsert(ref, pos, depth, src[pos]);
+    }
+    bitpack_pack_isa(isa, src, out, count, depth);
+
+    bool ok = !memcmp(ref, out, (words + GUARD) * 2);
+
+    free(src);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static bool test_dng_pack(int isa, uint32_t count, int depth)
+{
+    size_t words = packed_words(count, depth);
+    uint16_t *src = malloc((count + 1) * 2);
+    uint16_t *ref = malloc((words + GUARD) * 2);
+    uint16_t *out = malloc((words + GUARD) * 2);
+
+    /* the DNG loop doesn't mask, values have to be in range */
+    fill_random(src, count + 1);
+    for(uint32_t pos = 0; pos < count; pos++)
+    {
+        src[pos] &= (1 << depth) - 1;
+    }
+    fill_random(ref, words + GUARD);
+    memcpy(out, ref, (words + GUARD) * 2);
+
+    ref_dng_pack(src, ref, count * 2, depth);
+    bitpack_dng_pack_isa(isa, src, out, count, depth);
+
+    /* it also writes one word behind the packed data */
+    bool ok = !memcmp(ref, out, words * 2) && !memcmp(&ref[words + 1], &out[words + 1], (GUARD - 1) * 2);
+
+    free(src);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static bool test_convert(int isa, uint32_t count, int old_depth, int new_depth)
+{
+    size_t old_words = packed_words(count, old_depth);
+    size_t new_words = packed_words(count, new_depth);
+    uint16_t *src = malloc((old_words + GUARD) * 2);
+    uint16_t *ref = malloc((new_words + GUARD) * 2);
+    uint16_t *out = malloc((new_words + GUARD) * 2);
+
+    fill_random(src, old_words + GUARD);
+    fill_random(ref, new_words + GUARD);
+    memcpy(out, ref, (new_words + GUARD) * 2);
+
+    ref_convert(src, ref, count, old_depth, new_depth);
+    bitpack_convert_isa(isa, src, out, count, old_depth, new_depth);
+
+    bool ok = !memcmp(ref, out, (new_words + GUARD) * 2);
+
+    free(src);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static bool test_isa(int isa)
+{
+    /* every tail length for a few groups, then some line sizes */
+    static const uint32_t counts[] = { 1000, 1736, 1920, 1921, 5796, 65543 };
+
+    for(int d = 0; d < DEPTH_COUNT; d++)
+    {
+        int depth = depths[d];
+
+        for(uint32_t count = 0; count < 100 + sizeof(counts) / sizeof(counts[0]); count++)
+        {
+            uint32_t n = (count < 100) ? count : counts[count - 100];
+
+            if(!test_unpack(isa, n, depth))
+            {
+                printf("%s: unpack %d bpp, %u pixels failed\n", bitpack_isa_name(isa), depth, n);
+                return false;
+            }
+            if(!test_pack(isa, n, depth))
+            {
+                printf("%s: pack %d bpp, %u pixels failed\n", bitpack_isa_name(isa), depth, n);
+                return false;
+            }
+            if(depth < 16 && n > 0 && !test_dng_pack(isa, n, depth))
+            {
+                printf("%s: DNG pack %d bpp, %u pixels failed\n", bitpack_isa_name(isa), depth, n);
+                return false;
+            }
+            for(int d2 = 0; d2 < DEPTH_COUNT; d2++)
+            {
+                if(!test_convert(isa, n, depth, depths[d2]))
+                {
+                    printf("%s: convert %d -> %d bpp, %u pixels failed\n", bitpack_isa_name(isa), depth, depths[d2], n);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Mpixel/s over a 1920x1080 frame, processed line by line like mlv_dump does */
+#define BENCH_X 1920
+#define BENCH_Y 1080
+#define BENCH_RUNS 20
+
+enum { BENCH_UNPACK, BENCH_PACK, BENCH_DNG_PACK, BENCH_CONVERT };
+
+static double bench(int isa, int what, int old_depth, int new_depth, uint16_t *src, uint16_t *dst)
+{
+    double start = now();
+
+    for(int run = 0; run < BENCH_RUNS; run++)
+    {
+        for(int y = 0; y < BENCH_Y; y++)
+        {
+            uint16_t *in = &src[(size_t)y * BENCH_X];
+            uint16_t *out = &dst[(size_t)y * BENCH_X];
+
+            switch(what)
+            {
+                case BENCH_UNPACK:
+                    if(isa < 0) ref_dng_unpack(in, out, BENCH_X * 2, old_depth);
+                    else bitpack_unpack_isa(isa, in, out, BENCH_X, old_depth);
+                    break;
+                case BENCH_PACK:
+                    if(isa < 0) for(int x = 0; x < BENCH_X; x++) bitinsert(out, x, new_depth, in[x]);
+                    else bitpack_pack_isa(isa, in, out, BENCH_X, new_depth);
+                    break;
+                case BENCH_DNG_PACK:
+                    if(isa < 0) ref_dng_pack(in, out, BENCH_X * 2, new_depth);
+                    else bitpack_dng_pack_isa(isa, in, out, BENCH_X, new_depth);
+                    break;
+                case BENCH_CONVERT:
+                    if(isa < 0) ref_convert(in, out, BENCH_X, old_depth, new_depth);
+                    else bitpack_convert_isa(isa, in, out, BENCH_X, old_depth, new_depth);
+                    break;
+            }
+        }
+    }
+
+    return (double)BENCH_X * BENCH_Y * BENCH_RUNS / (now() - start) / 1e6;
+}
+
+static void benchmark(void)
+{
+    static const struct { int what; int old_depth; int new_depth; const char *name; } cases[] =
+    {
+        { BENCH_UNPACK,   14,  0, "unpack 14"     },
+        { BENCH_UNPACK,   12,  0, "unpack 12"     },
+        { BENCH_PACK,      0, 14, "pack 14"       },
+        { BENCH_DNG_PACK,  0, 14, "DNG pack 14"   },
+        { BENCH_DNG_PACK,  0, 12, "DNG pack 12"   },
+        { BENCH_CONVERT,  14, 12, "convert 14->12" },
+        { BENCH_CONVERT,  14, 10, "convert 14->10" },
+        { BENCH_CONVERT,  12, 16, "convert 12->16" },
+    };
+
+    /* one pixel per word is enough room for any depth */
+    uint16_t *src = malloc((size_t)BENCH_X * BENCH_Y * 2);
+    uint16_t *dst = malloc((size_t)BENCH_X * BENCH_Y * 2);
+
+    for(size_t pos = 0; pos < (size_t)BENCH_X * BENCH_Y; pos++)
+    {
+        src[pos] = rand() & 0x0FFF;
+    }
+
+    printf("%-16s %10s", "Mpixel/s", "previous");
+    for(int isa = BITPACK_SCALAR; isa <= BITPACK_AVX2; isa++)
+    {
+        printf(" %10s", bitpack_isa_name(isa));
+    }
+    printf("\n");
+
+    for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        printf("%-16s %10.1f", cases[c].name, bench(-1, cases[c].what, cases[c].old_depth, cases[c].new_depth, src, dst));
+        for(int isa = BITPACK_SCALAR; isa <= BITPACK_AVX2; isa++)
+        {
+            if(bitpack_isa_supported(isa))
+            {
+                printf(" %10.1f", bench(isa, cases[c].what, cases[c].old_depth, cases[c].new_depth, src, dst));
+            }
+            else
+            {
+                printf(" %10s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(dst);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        benchmark();
+        return 0;
+    }
+
+    for(int isa = BITPACK_SCALAR; isa <= BITPACK_AVX2; isa++)
+    {
+        if(!bitpack_isa_supported(isa))
+        {
+            printf("%s: not supported, skipped\n", bitpack_isa_name(isa));
+            continue;
+        }
+        TRY(test_isa(isa));
+        printf("%s: OK\n", bitpack_isa_name(isa));
+    }
+
+    return 0;
+}
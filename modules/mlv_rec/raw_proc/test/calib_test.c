@@ -0,0 +1,239 @@
+/*
+ * test for the calibration frame engine
+ *
+ * stacking must give the same result on one or more threads and with
+ * any number of spool bands; median and sigma clipping are checked
+ * against a plain sort of every pixel, subtract and flat-field against
+ * the per-pixel loops mlv_dump used before.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "bitpack.h"
+#include "calib.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+
+#define W 96
+#define H 38
+#define FRAMES 25
+
+static int depth;
+static uint16_t frames[FRAMES][W * H];
+static uint16_t packed[FRAMES][W * H];
+
+static void make_frames(int seed)
+{
+    int max = (1 << depth) - 1;
+    srand(seed);
+    for (int f = 0; f < FRAMES; f++)
+    {
+        for (int i = 0; i < W * H; i++)
+        {
+            int value = 2048 * max / 16383 + i % 37 + rand() % 64;
+            /* some outliers, e.g. cosmic ray hits */
+            if (rand() % 50 == 0) value = max - rand() % 16;
+            frames[f][i] = COERCE(value, 0, max);
+        }
+        bitpack_pack(frames[f], packed[f], W * H, depth);
+    }
+}
+
+static int compare_ushort(const void * a, const void * b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static uint32_t reference(int method, int i, double sigma)
+{
+    uint16_t values[FRAMES];
+    for (int f = 0; f < FRAMES; f++)
+    {
+        values[f] = frames[f][i];
+    }
+
+    int n = FRAMES;
+    if (method == CALIB_MEAN)
+    {
+        uint32_t sum = 0;
+        for (int f = 0; f < n; f++) sum += values[f];
+        return sum;
+    }
+    if (method == CALIB_MEDIAN)
+    {
+        qsort(values, n, sizeof(uint16_t), compare_ushort);
+        return (n & 1) ? values[n/2] * n : ((values[n/2-1] + values[n/2]) * n + 1) / 2;
+    }
+
+    int count = n;
+    double mean = 0;
+    for (int iteration = 0; iteration < 5; iteration++)
+    {
+        double sum = 0, sum_sq = 0;
+        for (int k = 0; k < count; k++)
+        {
+            sum += values[k];
+            sum_sq += (double)values[k] * values[k];
+        }
+        mean = sum / count;
+        double limit = sigma * sqrt(MAX(0, sum_sq / count - mean * mean));
+        int kept = 0;
+        for (int k = 0; k < count; k++)
+        {
+            if (fabs(values[k] - mean) <= limit) values[kept++] = values[k];
+        }
+        if (kept == count || kept == 0) break;
+        count = kept;
+    }
+    double sum = 0;
+    for (int k = 0; k < count; k++) sum += values[k];
+    return (uint32_t)(sum / count * n + 0.5);
+}
+
+/* the frames may also be read as w x h with w * h == W * H, to get bands that do not start on a packed word */
+static bool check_stack(int method, int threads, size_t memory_limit, int w, int h)
+{
+    struct calib_stack * stack = calib_create(w, h, depth, method, 2.5, threads, memory_limit, "calib_test.stack");
+    TRY(stack != NULL);
+    for (int f = 0; f < FRAMES; f++)
+    {
+        TRY(calib_add_frame(stack, packed[f]));
+    }
+    TRY(calib_frames(stack) == FRAMES);
+
+    uint32_t * sums = malloc(W * H * sizeof(uint32_t));
+    TRY(calib_finish(stack, sums));
+    calib_free(stack);
+
+    /* the spool file is gone */
+    TRY(fopen("calib_test.stack", "rb") == NULL);
+
+    bool ok = true;
+    for (int i = 0; i < W * H && ok; i++)
+    {
+        ok = sums[i] == reference(method, i, 2.5);
+    }
+    free(sums);
+    return ok;
+}
+
+static bool check_subtract()
+{
+    int max = (1 << depth) - 1;
+    int black = 2048 * max / 16383;
+    uint16_t dark[W * H];
+    uint16_t frame[W * H];
+
+    bitpack_pack(frames[1], dark, W * H, depth);
+    memcpy(frame, packed[0], sizeof(frame));
+
+    struct calib_ref * ref = calib_ref_create(dark, W, H, depth);
+    calib_subtract(ref, frame, black);
+    calib_ref_free(ref);
+
+    for (int i = 0; i < W * H; i++)
+    {
+        int value = COERCE((int)frames[0][i] - frames[1][i] + black, 0, max);
+        if (bitextract(frame, i, depth) != value) return false;
+    }
+    return true;
+}
+
+static bool check_flatfield()
+{
+    int max = (1 << depth) - 1;
+    int black = 2048 * max / 16383;
+    uint16_t flat[W * H];
+    uint16_t flat_pixels[W * H];
+    uint16_t frame[W * H];
+
+    /* vignetting, and a few pixels at or below black */
+    for (int y = 0; y < H; y++)
+    {
+        for (int x = 0; x < W; x++)
+        {
+            int i = x + y * W;
+            flat_pixels[i] = black + 200 + (W/2 - abs(x - W/2)) * 8 + (y & 1) * 40 + (x & 1) * 20;
+            if (i % 97 == 0) flat_pixels[i] = black - 3;
+        }
+    }
+    bitpack_pack(flat_pixels, flat, W * H, depth);
+    memcpy(frame, packed[0], sizeof(frame));
+
+    struct calib_ref * ref = calib_ref_create(flat, W, H, depth);
+    calib_flat_normalize(ref, black);
+    TRY(ref->adj_den > 0);
+    TRY(calib_flatfield(ref, frame, black));
+
+    bool ok = true;
+    for (int y = 0; y < H && ok; y++)
+    {
+        for (int x = 0; x < W && ok; x++)
+        {
+            int32_t value = frames[0][x + y * W];
+            int32_t flat_value = flat_pixels[x + y * W];
+            if (flat_value - black <= 0)
+            {
+                flat_value = MAX(flat_pixels[MAX(x-1,0) + y * W], flat_pixels[MIN(x+1,W-1) + y * W]);
+            }
+            if (flat_value - black > 0)
+            {
+                value = (int64_t)(value - black) * ref->med[y%2][x%2] * ref->adj_num / ref->adj_den / (flat_value - black) + black;
+                value = COERCE(value, 0, max);
+            }
+            ok = bitextract(frame, x + y * W, depth) == value;
+        }
+    }
+    calib_ref_free(ref);
+    return ok;
+}
+
+int main()
+{
+    int depths[] = { 14, 12, 10 };
+    for (int d = 0; d < 3; d++)
+    {
+        depth = depths[d];
+        make_frames(d);
+
+        for (int method = CALIB_MEAN; method <= CALIB_SIGMA_CLIP; method++)
+        {
+            TRY(check_stack(method, 1, 64 << 20, W, H));
+            TRY(check_stack(method, 3, 64 << 20, W, H));
+            /* one row per band */
+            TRY(check_stack(method, 4, 1, W, H));
+            /* bands that do not divide the height */
+            TRY(check_stack(method, 2, W * sizeof(uint16_t) * FRAMES * 5, W, H));
+            /* rows of 57 pixels, bands start anywhere in the packed stream */
+            TRY(check_stack(method, 1, 1, 57, W * H / 57));
+            TRY(check_stack(method, 3, 57 * sizeof(uint16_t) * FRAMES * 3, 57, W * H / 57));
+        }
+
+        TRY(check_subtract());
+        TRY(check_flatfield());
+    }
+
+    uint32_t sums[4 * 3] = { 1, 2, 3, 4,  5, 6, 7, 8,  9, 10, 11, 12 };
+    calib_average_columns(sums, 4, 3);
+    TRY(sums[0] == 5 && sums[11] == 8);
+    calib_average_rows(sums, 4, 3);
+    TRY(sums[0] == 6 && sums[8] == 6);
+
+    printf("calib: OK\n");
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * bit exactness test and microbenchmark for the vectorized chroma smoothing
+ *
+ * chroma_smooth_simd() is compared against the chroma_smooth.c filters for
+ * every method, instruction set and a few thread counts, on noisy images
+ * with clipped areas and on sizes that leave every tail length of a row.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "opt_med.h"
+#include "chroma_smooth_simd.h"
+
+#define EV_RESOLUTION 65536
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+
+#define CHROMA_SMOOTH_2X2
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_2X2
+
+#define CHROMA_SMOOTH_3X3
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_3X3
+
+#define CHROMA_SMOOTH_5X5
+#include "chroma_smooth.c"
+#undef CHROMA_SMOOTH_5X5
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define BLACK 2048
+#define WHITE 15000
+
+static int raw2ev[EV_RESOLUTION];
+static int _ev2raw[24*EV_RESOLUTION];
+static int *ev2raw = _ev2raw + 10*EV_RESOLUTION;
+
+/* same tables as get_raw2ev() and get_ev2raw() in pixel_proc.c */
+static void init_tables(int black)
+{
+    for (int i = 0; i < EV_RESOLUTION; i++)
+    {
+        raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
+    }
+    for (int i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
+    {
+        ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
+    }
+}
+
+/* smooth gradients with noise, some pixels near black and some clipped */
+static void fill_image(uint16_t *buf, int w, int h)
+{
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            int v = BLACK + (x * 37 + y * 11) % 9000 + rand() % 400 - 200;
+            int r = rand() % 100;
+            if (r < 3) v = BLACK + rand() % 64;
+            else if (r < 5) v = WHITE + rand() % 1000;
+            buf[x + y * w] = COERCE(v, 0, 16383);
+        }
+    }
+}
+
+static void reference(int method, int w, int h, uint16_t *inp, uint16_t *out)
+{
+    switch (method)
+    {
+        case 2: chroma_smooth_2x2(w, h, inp, out, raw2ev, ev2raw, BLACK, WHITE); break;
+        case 3: chroma_smooth_3x3(w, h, inp, out, raw2ev, ev2raw, BLACK, WHITE); break;
+        case 5: chroma_smooth_5x5(w, h, inp, out, raw2ev, ev2raw, BLACK, WHITE); break;
+    }
+}
+
+static bool test_size(int isa, int threads, int method, int w, int h)
+{
+    size_t size = (size_t)w * h;
+    uint16_t *inp = malloc(size * sizeof(uint16_t));
+    uint16_t *ref = malloc(size * sizeof(uint16_t));
+    uint16_t *out = malloc(size * sizeof(uint16_t));
+
+    fill_image(inp, w, h);
+    memcpy(ref, inp, size * sizeof(uint16_t));
+    memcpy(out, inp, size * sizeof(uint16_t));
+
+    reference(method, w, h, inp, ref);
+    bool ok = chroma_smooth_simd(isa, threads, method, w, h, inp, out, raw2ev, ev2raw, BLACK, WHITE) &&
+              !memcmp(ref, out, size * sizeof(uint16_t));
+
+    free(inp);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+static bool test_isa(int isa)
+{
+    static const int methods[] = { 2, 3, 5 };
+    static const int threads[] = { 1, 2, 3, 8 };
+    static const struct { int w; int h; } sizes[] =
+    {
+        { 8, 8 }, { 12, 13 }, { 32, 18 }, { 33, 19 }, { 34, 20 }, { 36, 21 },
+        { 38, 22 }, { 40, 23 }, { 42, 24 }, { 44, 25 }, { 46, 26 }, { 640, 360 }, { 1736, 976 },
+    };
+
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+    {
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+        {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            {
+                if (!test_size(isa, threads[t], methods[m], sizes[s].w, sizes[s].h))
+                {
+                    printf("%s: %dx%d, %d threads, %dx%d pixels failed\n", chroma_smooth_isa_name(isa),
+                           methods[m], methods[m], threads[t], sizes[s].w, sizes[s].h);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Mpixel/s over a 1920x1080 frame */
+#define BENCH_X 1920
+#define BENCH_Y 1080
+#define BENCH_RUNS 5
+
+static double bench(int isa, int threads, int method, uint16_t *inp, uint16_t *out)
+{
+    double start = now();
+
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        if (isa < 0)
+        {
+            reference(method, BENCH_X, BENCH_Y, inp, out);
+        }
+        else
+        {
+            chroma_smooth_simd(isa, threads, method, BENCH_X, BENCH_Y, inp, out, raw2ev, ev2raw, BLACK, WHITE);
+        }
+    }
+
+    return (double)BENCH_X * BENCH_Y * BENCH_RUNS / (now() - start) / 1e6;
+}
+
+static void benchmark(int threads)
+{
+    uint16_t *inp = malloc((size_t)BENCH_X * BENCH_Y * sizeof(uint16_t));
+    uint16_t *out = malloc((size_t)BENCH_X * BENCH_Y * sizeof(uint16_t));
+    fill_image(inp, BENCH_X, BENCH_Y);
+
+    printf("%-16s %10s", "Mpixel/s", "previous");
+    for (int isa = CHROMA_SMOOTH_SCALAR; isa <= CHROMA_SMOOTH_AVX2; isa++)
+    {
+        printf(" %10s", chroma_smooth_isa_name(isa));
+    }
+    printf("   (%d threads)\n", threads);
+
+    for (int method = 2; method <= 5; method++)
+    {
+        if (method == 4) continue;
+
+        char name[16];
+        snprintf(name, sizeof(name), "%dx%d", method, method);
+        printf("%-16s %10.1f", name, bench(-1, 1, method, inp, out));
+        for (int isa = CHROMA_SMOOTH_SCALAR; isa <= CHROMA_SMOOTH_AVX2; isa++)
+        {
+            if (chroma_smooth_isa_supported(isa))
+            {
+                printf(" %10.1f", bench(isa, threads, method, inp, out));
+            }
+            else
+            {
+                printf(" %10s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    free(inp);
+    free(out);
+}
+
+int main(int argc, char *argv[])
+{
+    init_tables(BLACK);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        benchmark(argc > 2 ? atoi(argv[2]) : 1);
+        return 0;
+    }
+
+    for (int isa = CHROMA_SMOOTH_SCALAR; isa <= CHROMA_SMOOTH_AVX2; isa++)
+    {
+        if (!chroma_smooth_isa_supported(isa))
+        {
+            printf("%s: not supported, skipped\n", chroma_smooth_isa_name(isa));
+            continue;
+        }
+        TRY(test_isa(isa));
+        printf("%s: OK\n", chroma_smooth_isa_name(isa));
+    }
+
+    return 0;
+}
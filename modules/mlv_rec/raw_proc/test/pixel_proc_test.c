@@ -0,0 +1,169 @@
+/*
+ * test for the compiled focus/bad pixel maps
+ *
+ * the runs applied by fix_focus_pixels() and fix_bad_pixels() must give
+ * the same frame as repairing every map pixel on its own, for pixels on
+ * the edges and outside of the frame too; generated maps must be shared
+ * between clips of the same camera and video mode.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* for the interpolation routines and the cache */
+#include "../pixel_proc.c"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define FPM_NAME "pixel_proc_test.fpm"
+
+/* one map pixel at a time, as fix_focus_pixels() used to do it */
+static void fix_reference(uint16_t * image_data, struct pixel_map * map, struct parameter_list * par, int median)
+{
+    int w = par->width;
+    int h = par->height;
+    int cropX = (par->pan_x + 7) & ~7;
+    int cropY = par->pan_y & ~1;
+    int * raw2ev = get_raw2ev(par->black_level);
+    int * ev2raw = get_ev2raw(par->black_level);
+
+    for (size_t m = 0; m < map->count; m++)
+    {
+        int x = map->pixels[m].x - cropX;
+        int y = map->pixels[m].y - cropY;
+        int i = x + y*w;
+        if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
+        {
+            if (par->dual_iso)
+                interpolate_horizontal(image_data, i, raw2ev, ev2raw);
+            else if (median)
+                interpolate_pixel(image_data, x, y, w, h);
+            else
+                interpolate_around(image_data, i, w, raw2ev, ev2raw);
+        }
+        else if (i > 0 && i < w * h)
+        {
+            int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
+            int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
+
+            if (horizontal_edge && !vertical_edge && !par->dual_iso)
+                interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
+            else if (vertical_edge && !horizontal_edge)
+                interpolate_horizontal(image_data, i, raw2ev, ev2raw);
+            else if (x >= 0 && x <= 3)
+                image_data[i] = image_data[i + 2];
+            else if (x >= w - 3 && x < w)
+                image_data[i] = image_data[i - 2];
+        }
+    }
+}
+
+static void fill(uint16_t * image_data, int count, int seed)
+{
+    srand(seed);
+    for (int i = 0; i < count; i++)
+    {
+        image_data[i] = 2048 + rand() % 12000;
+    }
+}
+
+/* fix one frame both ways, 1 if they match */
+static bool check(struct pixel_map * map, struct parameter_list * par, int median, int seed)
+{
+    int count = par->width * par->height;
+    uint16_t * image = malloc(count * sizeof(uint16_t));
+    uint16_t * ref = malloc(count * sizeof(uint16_t));
+    fill(image, count, seed);
+    memcpy(ref, image, count * sizeof(uint16_t));
+
+    fix_focus_pixels(image, *par);
+    fix_reference(ref, map, par, median);
+
+    bool ok = !memcmp(image, ref, count * sizeof(uint16_t));
+    free(image);
+    free(ref);
+    return ok;
+}
+
+int main()
+{
+    struct parameter_list par = { 0 };
+    par.camera_id = 0x80000331;
+    par.raw_width = 1808;
+    par.raw_height = 1190;
+    par.width = 1736;
+    par.height = 976;
+    par.black_level = 2047;
+
+    /* generated map, several pans, all interpolation methods */
+    struct pixel_map map = { PIX_FOCUS, 0, 0, NULL };
+    fpm_mv1080(&map, PATTERN_EOSM, par.raw_width);
+    TRY(map.count > 0);
+
+    par.mlv_name = "clip_a.MLV";
+    for (int pan = 0; pan < 4; pan++)
+    {
+        par.pan_x = 72 + pan * 13;
+        par.pan_y = 28 + pan * 7;
+        for (int method = 0; method < 3; method++)
+        {
+            par.dual_iso = method == 2;
+            par.fpi_method = method == 1;
+            TRY(check(&map, &par, par.fpi_method, pan * 3 + method));
+        }
+    }
+
+    /* another clip from the same camera and mode gets the same map */
+    struct cached_map * cached = clip_maps[PIX_FOCUS].cached;
+    TRY(cached && cached->map.count == map.count);
+    par.mlv_name = "clip_b.MLV";
+    TRY(check(&map, &par, par.fpi_method, 100));
+    TRY(clip_maps[PIX_FOCUS].cached == cached);
+    free(map.pixels);
+
+    /* map file with pixels on the edges, in the corners and outside of the frame */
+    par.pan_x = 72;
+    par.pan_y = 28;
+    par.dual_iso = 0;
+    par.fpi_method = 0;
+    map.pixels = NULL;
+    map.count = map.capacity = 0;
+    FILE * f = fopen(FPM_NAME, "w");
+    TRY(f != NULL);
+    for (int y = 0; y < 1100; y += 5)
+    {
+        for (int x = 60; x < 1900; x += (y % 3) ? 9 : 4)
+        {
+            fprintf(f, "%d \t %d\n", x, y);
+            add_pixel_to_map(&map, x, y);
+        }
+    }
+    fclose(f);
+
+    par.mlv_name = "pixel_proc_test.MLV";
+    TRY(check(&map, &par, 0, 200));
+    TRY(clip_maps[PIX_FOCUS].cached != cached);
+    for (int method = 0; method < 3; method++)
+    {
+        par.dual_iso = method == 2;
+        par.fpi_method = method == 1;
+        TRY(check(&map, &par, par.fpi_method, 300 + method));
+    }
+    free(map.pixels);
+
+    free_pixel_maps();
+    TRY(pixel_map_cache == NULL);
+
+    remove(FPM_NAME);
+    printf("pixel_proc: OK\n");
+    return 0;
+}
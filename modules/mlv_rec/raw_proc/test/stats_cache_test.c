@@ -0,0 +1,167 @@
+/*
+ * test for the stripe/pattern noise statistics cache
+ *
+ * entries must survive a round trip through the .rpc sidecar, be dropped
+ * when the clip parameters or the raw processing options change, and be
+ * shared between the frames of one sampling interval.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "stats_cache.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define MLV_NAME "stats_cache_test.MLV"
+#define RPC_NAME "stats_cache_test.rpc"
+
+static void fill(int * data, int count, int seed)
+{
+    for (int i = 0; i < count; i++)
+    {
+        data[i] = seed * 1000 + i - count / 2;
+    }
+}
+
+static bool check(int kind, uint32_t frame, int count, int seed)
+{
+    int * data = malloc(count * sizeof(int));
+    int * ref = malloc(count * sizeof(int));
+    fill(ref, count, seed);
+    bool ok = stats_cache_get(kind, frame, data, count) && !memcmp(data, ref, count * sizeof(int));
+    free(data);
+    free(ref);
+    return ok;
+}
+
+static void put(int kind, uint32_t frame, int count, int seed)
+{
+    int * data = malloc(count * sizeof(int));
+    fill(data, count, seed);
+    stats_cache_put(kind, frame, data, count);
+    free(data);
+}
+
+int main()
+{
+    /* default mlv_dump options: stripes and focus/bad pixel fixes on, no chroma smoothing */
+    struct stats_cache_key key = { 0x80000285, 1920, 1080, 2047, 16383, 1, 0, 1, 0, 1, 0, 0 };
+    int dummy[9];
+
+    remove(RPC_NAME);
+
+    /* nothing to look up without a file or an interval */
+    stats_cache_init(MLV_NAME, &key, 0, 1, 0);
+    TRY(!stats_cache_enabled());
+    put(STATS_STRIPES, 0, 9, 1);
+    TRY(!stats_cache_get(STATS_STRIPES, 0, dummy, 9));
+    free_stats_cache();
+
+    /* fill in random order, both kinds */
+    stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+    TRY(stats_cache_enabled());
+    for (int frame = 10; frame >= 0; frame -= 2)
+    {
+        put(STATS_PATTERN_NOISE, frame, 3000, frame + 1);
+        put(STATS_STRIPES, frame, 9, frame + 100);
+    }
+    for (int frame = 1; frame <= 11; frame += 2)
+    {
+        put(STATS_PATTERN_NOISE, frame, 3000, frame + 1);
+    }
+    TRY(check(STATS_PATTERN_NOISE, 7, 3000, 8));
+    TRY(!stats_cache_get(STATS_STRIPES, 7, dummy, 9));
+    /* wrong size, e.g. another resolution */
+    TRY(!stats_cache_get(STATS_STRIPES, 6, dummy, 8));
+    free_stats_cache();
+
+    /* reload from the sidecar */
+    stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+    for (int frame = 0; frame <= 11; frame++)
+    {
+        TRY(check(STATS_PATTERN_NOISE, frame, 3000, frame + 1));
+        TRY(check(STATS_STRIPES, frame, 9, frame + 100) == !(frame & 1));
+    }
+    free_stats_cache();
+
+    /* every 4 frames: 0..3 share the values of frame 0 */
+    stats_cache_init(MLV_NAME, &key, 1, 4, 0);
+    TRY(stats_cache_sample(6) == 4);
+    TRY(check(STATS_PATTERN_NOISE, 3, 3000, 1));
+    TRY(check(STATS_PATTERN_NOISE, 6, 3000, 5));
+    free_stats_cache();
+
+    /* other processing options: the sidecar is ignored, one option at a time */
+    {
+        struct stats_cache_key other[7];
+        for (int i = 0; i < 7; i++) other[i] = key;
+        other[0].chroma_smooth = 3;         /* --cs3x3 */
+        other[1].focus_pixels = 0;          /* --no-fixfp */
+        other[2].bad_pixels = 0;            /* --no-fixcp */
+        other[3].fpi_method = 1;            /* --fpi 1 */
+        other[4].bpi_method = 1;            /* --bpi 1 */
+        other[5].vertical_stripes = 2;      /* --force-stripes */
+        other[6].dual_iso = 1;              /* --is-dualiso */
+
+        for (int i = 0; i < 7; i++)
+        {
+            stats_cache_init(MLV_NAME, &other[i], 1, 1, 0);
+            TRY(!check(STATS_PATTERN_NOISE, 0, 3000, 1));
+            TRY(!check(STATS_STRIPES, 0, 9, 100));
+            free_stats_cache();
+        }
+
+        /* nothing was written: the original options still find their entries */
+        stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+        TRY(check(STATS_PATTERN_NOISE, 0, 3000, 1));
+        free_stats_cache();
+
+        /* an export with --cs3x3 rewrites the sidecar with its own options */
+        stats_cache_init(MLV_NAME, &other[0], 1, 1, 0);
+        put(STATS_PATTERN_NOISE, 0, 3000, 42);
+        free_stats_cache();
+
+        stats_cache_init(MLV_NAME, &other[0], 1, 1, 0);
+        TRY(check(STATS_PATTERN_NOISE, 0, 3000, 42));
+        free_stats_cache();
+
+        stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+        TRY(!check(STATS_PATTERN_NOISE, 0, 3000, 42));
+        TRY(!check(STATS_PATTERN_NOISE, 0, 3000, 1));
+        free_stats_cache();
+    }
+
+    /* a sidecar from before the processing options were recorded is ignored */
+    {
+        FILE * f = fopen(RPC_NAME, "w");
+        TRY(f);
+        fprintf(f, "#RPC %X %dx%d %d %d\nS 0 9 1 2 3 4 5 6 7 8 9\n", key.camera_id, key.width, key.height, key.black, key.white);
+        fclose(f);
+        stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+        TRY(!stats_cache_get(STATS_STRIPES, 0, dummy, 9));
+        free_stats_cache();
+    }
+
+    /* another black level: the sidecar is ignored */
+    stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+    put(STATS_PATTERN_NOISE, 0, 3000, 1);
+    free_stats_cache();
+    key.black = 2048;
+    stats_cache_init(MLV_NAME, &key, 1, 1, 0);
+    TRY(!check(STATS_PATTERN_NOISE, 0, 3000, 1));
+    free_stats_cache();
+
+    remove(RPC_NAME);
+    printf("stats_cache: OK\n");
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * the previous LJ92 decoder (SINGLE_HUFF), built with renamed symbols
+ * so lj92_test can compare it with the current one
+ */
+
+#define SINGLE_HUFF
+
+#define lj92_open ref_lj92_open
+#define lj92_close ref_lj92_close
+#define lj92_decode ref_lj92_decode
+#define lj92_set_threads ref_lj92_set_threads
+#define lj92_encode ref_lj92_encode
+#define lj92_encode_table ref_lj92_encode_table
+#define lj92_free_table ref_lj92_free_table
+#define lj92_encode_with_table ref_lj92_encode_with_table
+#define frequencyScan ref_frequencyScan
+#define createEncodeTable ref_createEncodeTable
+#define writeHeader ref_writeHeader
+#define writePost ref_writePost
+#define writeBody ref_writeBody
+
+#include "../lj92.c"
@@ -0,0 +1,694 @@
+/*
+ * bit exactness test and benchmark for the LJ92 decoder
+ *
+ * the current decoder is compared against the previous one (lj92_ref.c)
+ * and against the source image on:
+ *  - images compressed with lj92_encode (predictor 6, 10..16 bit), also
+ *    with a table shared between images
+ *  - streams written here with a fixed Huffman table that has codes longer
+ *    than the lookup table, all predictors, 1 and 2 components and restart
+ *    markers, decoded on 1 and 4 threads
+ *  - damaged copies of these streams, which must not crash the decoder
+ *  - LJ92 frames of the MLV files given on the command line (camera footage)
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "lj92.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+int ref_lj92_open(lj92* lj, uint8_t* data, int datalen, int* width, int* height, int* bitdepth, int* components);
+void ref_lj92_close(lj92 lj);
+int ref_lj92_decode(lj92 lj, uint16_t* target, int writeLength, int skipLength, uint16_t* linearize, int linearizeLength);
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* both decoders modify the stream while parsing it, so each one gets a copy */
+static int decode(bool reference, int threads, const uint8_t *data, int size, uint16_t **image, int *samples, double *seconds)
+{
+    uint8_t *copy = malloc(size);
+    lj92 handle;
+    int width, height, depth, components;
+    int ret;
+
+    memcpy(copy, data, size);
+    *image = NULL;
+
+    double start = now();
+    if(reference)
+    {
+        ret = ref_lj92_open(&handle, copy, size, &width, &height, &depth, &components);
+    }
+    else
+    {
+        ret = lj92_open(&handle, copy, size, &width, &height, &depth, &components);
+    }
+
+    if(ret == LJ92_ERROR_NONE)
+    {
+        /* first touch of the output buffer is not part of the decoding time */
+        double pause = now();
+        *samples = width * height * components;
+        *image = calloc(*samples, sizeof(uint16_t));
+        memset(*image, 0, *samples * sizeof(uint16_t));
+        start += now() - pause;
+
+        if(reference)
+        {
+            ret = ref_lj92_decode(handle, *image, *samples, 0, NULL, 0);
+            ref_lj92_close(handle);
+        }
+        else
+        {
+            lj92_set_threads(handle, threads);
+            ret = lj92_decode(handle, *image, *samples, 0, NULL, 0);
+            lj92_close(handle);
+        }
+    }
+    if(seconds)
+    {
+        *seconds = now() - start;
+    }
+
+    free(copy);
+    return ret;
+}
+
+/* decode with the current decoder, compare with the expected image and optionally with the reference decoder */
+static bool check(const char *name, const uint8_t *data, int size, const uint16_t *expected, int samples, bool compare_reference, int threads)
+{
+    uint16_t *image;
+    int decoded;
+
+    if(decode(false, threads, data, size, &image, &decoded, NULL) != LJ92_ERROR_NONE || decoded != samples)
+    {
+        printf("%s: decoding failed\n", name);
+        free(image);
+        return false;
+    }
+    if(expected && memcmp(image, expected, samples * sizeof(uint16_t)))
+    {
+        printf("%s: doesn't match the source image\n", name);
+        free(image);
+        return false;
+    }
+    if(compare_reference)
+    {
+        uint16_t *ref;
+
+        if(decode(true, 1, data, size, &ref, &decoded, NULL) != LJ92_ERROR_NONE || decoded != samples || memcmp(image, ref, samples * sizeof(uint16_t)))
+        {
+            printf("%s: doesn't match the previous decoder\n", name);
+            free(image);
+            free(ref);
+            return false;
+        }
+        free(ref);
+    }
+
+    free(image);
+    return true;
+}
+
+/* smooth gradient with noise of the given amplitude, like a raw frame */
+static uint16_t *make_image(int width, int height, int depth, int noise)
+{
+    uint16_t *image = malloc(width * height * sizeof(uint16_t));
+    int max = (1 << depth) - 1;
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            int value = x * max / width / 2 + y * max / height / 8 + (noise ? rand() % (2 * noise + 1) - noise : 0);
+            image[y * width + x] = value < 0 ? 0 : value > max ? max : value;
+        }
+    }
+    return image;
+}
+
+static bool test_encoder_streams(void)
+{
+    static const struct { int width; int height; int depth; int noise; } cases[] =
+    {
+        {    1,   1, 14,     0 },
+        {    7,   3, 12,    20 },
+        {  100,  50, 10,    30 },
+        {  333,  17, 14,   500 },
+        {  640,  40, 14,    30 },
+        {  256,  64, 16, 65535 },
+        { 1024, 512, 16,    12 },
+        { 1920,  32, 12,     8 },
+        {  500,  20, 12,  4095 },
+    };
+
+    for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        int samples = cases[c].width * cases[c].height;
+        uint16_t *image = make_image(cases[c].width, cases[c].height, cases[c].depth, cases[c].noise);
+        uint8_t *encoded;
+        int encoded_size;
+        char name[64];
+
+        /* black / half scale pixel pairs give 15 and 16 bit differences */
+        if(cases[c].depth == 16)
+        {
+            for(int i = 0; i + 1 < samples; i += 101)
+            {
+                image[i] = 0;
+                image[i + 1] = 32768;
+            }
+        }
+
+        /* the previous decoder writes out of bounds on 16 bit differences */
+        bool compare_reference = cases[c].depth < 15;
+
+        TRY(lj92_encode(image, cases[c].width, cases[c].height, cases[c].depth, 1, samples, 0, NULL, 0, &encoded, &encoded_size) == LJ92_ERROR_NONE);
+        snprintf(name, sizeof(name), "lj92_encode %dx%d %d bit", cases[c].width, cases[c].height, cases[c].depth);
+        if(!check(name, encoded, encoded_size, image, samples, compare_reference, 1))
+        {
+            return false;
+        }
+        free(encoded);
+
+        /* tiled source: every row of the image is followed by a row of garbage */
+        uint16_t *tiled = malloc(samples * 2 * sizeof(uint16_t));
+        for(int y = 0; y < cases[c].height; y++)
+        {
+            memcpy(&tiled[y * 2 * cases[c].width], &image[y * cases[c].width], cases[c].width * sizeof(uint16_t));
+            memset(&tiled[(y * 2 + 1) * cases[c].width], 0xFF, cases[c].width * sizeof(uint16_t));
+        }
+        TRY(lj92_encode(tiled, cases[c].width, cases[c].height, cases[c].depth, 1, cases[c].width, cases[c].width, NULL, 0, &encoded, &encoded_size) == LJ92_ERROR_NONE);
+        snprintf(name, sizeof(name), "lj92_encode %dx%d %d bit tiled", cases[c].width, cases[c].height, cases[c].depth);
+        if(!check(name, encoded, encoded_size, image, samples, compare_reference, 1))
+        {
+            return false;
+        }
+        free(encoded);
+        free(tiled);
+        free(image);
+    }
+
+    /* values beyond the bit depth */
+    {
+        uint16_t image[4] = { 0, 1, 4096, 2 };
+        uint8_t *encoded;
+        int encoded_size;
+
+        TRY(lj92_encode(image, 2, 2, 12, 1, 4, 0, NULL, 0, &encoded, &encoded_size) == LJ92_ERROR_TOO_WIDE);
+    }
+
+    printf("lj92_encode streams: OK\n");
+    return true;
+}
+
+/* tables made from one frame encode other frames, even if they have larger differences */
+static bool test_encoder_tables(void)
+{
+    int width = 640;
+    int height = 48;
+    int samples = width * height;
+
+    for(int depth = 10; depth <= 16; depth += 2)
+    {
+        uint16_t *smooth = make_image(width, height, depth, 0);
+        uint16_t *noisy = make_image(width, height, depth, 1 << (depth - 2));
+        lj92_table table;
+        uint8_t *encoded;
+        int encoded_size;
+        char name[64];
+
+        TRY(lj92_encode_table(smooth, width, height, depth, samples, 0, NULL, 0, &table) == LJ92_ERROR_NONE);
+
+        for(int frame = 0; frame < 2; frame++)
+        {
+            uint16_t *image = frame ? noisy : smooth;
+
+            TRY(lj92_encode_with_table(image, width, height, depth, 1, samples, 0, NULL, 0, table, &encoded, &encoded_size) == LJ92_ERROR_NONE);
+            snprintf(name, sizeof(name), "shared table, %d bit, frame %d", depth, frame);
+            if(!check(name, encoded, encoded_size, image, samples, depth < 15, 1))
+            {
+                return false;
+            }
+            free(encoded);
+        }
+
+        /* a table only fits its bit depth */
+        TRY(lj92_encode_with_table(smooth, width, height, depth - 1, 1, samples, 0, NULL, 0, table, &encoded, &encoded_size) == LJ92_ERROR_TOO_WIDE);
+
+        lj92_free_table(table);
+        free(smooth);
+        free(noisy);
+    }
+
+    printf("shared encoder tables: OK\n");
+    return true;
+}
+
+/* minimal encoder with a fixed table, predictors exactly as the decoders implement them */
+
+struct writer
+{
+    uint8_t *data;
+    int size;
+    uint32_t bits;
+    int count;
+};
+
+static void put_byte(struct writer *w, int value)
+{
+    w->data[w->size++] = value;
+}
+
+static void put_bits(struct writer *w, uint32_t value, int count)
+{
+    for(int bit = count - 1; bit >= 0; bit--)
+    {
+        w->bits = (w->bits << 1) | ((value >> bit) & 1);
+        if(++w->count == 8)
+        {
+            put_byte(w, w->bits);
+            if(w->bits == 0xFF)
+            {
+                put_byte(w, 0x00);
+            }
+            w->bits = 0;
+            w->count = 0;
+        }
+    }
+}
+
+/* pad the last byte with ones */
+static void flush_bits(struct writer *w)
+{
+    while(w->count)
+    {
+        put_bits(w, 1, 1);
+    }
+}
+
+/* code lengths of ssss 0..16, several are longer than the 12 bit lookup table */
+static const int code_length[17] = { 4, 5, 4, 3, 3, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13, 14, 14 };
+
+static int predict(int pred, int comps, int bits, bool first, const uint16_t *thisrow, const uint16_t *lastrow, int i, int left)
+{
+    if(first)
+    {
+        return i < comps ? 1 << (bits - 1) : thisrow[i - comps];
+    }
+    if(i < comps)
+    {
+        return lastrow[i];
+    }
+    switch(pred)
+    {
+        case 1: return thisrow[i - comps];
+        case 2: return lastrow[i];
+        case 3: return lastrow[i - comps];
+        case 4: return left + lastrow[i] - lastrow[i - comps];
+        case 5: return left + ((lastrow[i] - lastrow[i - comps]) >> 1);
+        case 6: return lastrow[i] + ((left - lastrow[i - 1]) >> 1);
+        case 7: return (left + lastrow[i]) >> 1;
+    }
+    return 0;
+}
+
+static uint8_t *encode_fixed(const uint16_t *image, int width, int height, int comps, int bits, int pred, int restart_rows, int *size)
+{
+    struct writer w = { malloc(width * height * comps * 5 + 1024), 0, 0, 0 };
+    int count[17] = { 0 };
+    int code[17];
+    int rowlen = width * comps;
+
+    /* canonical codes, symbols sorted by length */
+    int order[17];
+    int symbols = 0;
+    for(int length = 1; length <= 16; length++)
+    {
+        for(int ssss = 0; ssss <= 16; ssss++)
+        {
+            if(code_length[ssss] == length)
+            {
+                order[symbols++] = ssss;
+                count[length]++;
+            }
+        }
+    }
+    int next = 0;
+    for(int length = 1, s = 0; length <= 16; length++)
+    {
+        for(int n = 0; n < count[length]; n++)
+        {
+            code[order[s++]] = next++;
+        }
+        next <<= 1;
+    }
+
+    put_byte(&w, 0xFF); put_byte(&w, 0xD8);
+
+    put_byte(&w, 0xFF); put_byte(&w, 0xC4);
+    put_byte(&w, 0); put_byte(&w, 2 + 1 + 16 + 17);
+    put_byte(&w, 0);
+    for(int length = 1; length <= 16; length++)
+    {
+        put_byte(&w, count[length]);
+    }
+    for(int s = 0; s < 17; s++)
+    {
+        put_byte(&w, order[s]);
+    }
+
+    put_byte(&w, 0xFF); put_byte(&w, 0xC3);
+    put_byte(&w, 0); put_byte(&w, 8 + 3 * comps);
+    put_byte(&w, bits);
+    put_byte(&w, height >> 8); put_byte(&w, height & 0xFF);
+    put_byte(&w, width >> 8); put_byte(&w, width & 0xFF);
+    put_byte(&w, comps);
+    for(int c = 0; c < comps; c++)
+    {
+        put_byte(&w, c); put_byte(&w, 0x11); put_byte(&w, 0);
+    }
+
+    if(restart_rows)
+    {
+        int interval = restart_rows * width;
+        put_byte(&w, 0xFF); put_byte(&w, 0xDD);
+        put_byte(&w, 0); put_byte(&w, 4);
+        put_byte(&w, interval >> 8); put_byte(&w, interval & 0xFF);
+    }
+
+    put_byte(&w, 0xFF); put_byte(&w, 0xDA);
+    put_byte(&w, 0); put_byte(&w, 6 + 2 * comps);
+    put_byte(&w, comps);
+    for(int c = 0; c < comps; c++)
+    {
+        put_byte(&w, c); put_byte(&w, 0);
+    }
+    put_byte(&w, pred); put_byte(&w, 0); put_byte(&w, 0);
+
+    for(int row = 0; row < height; row++)
+    {
+        bool first = row == 0;
+
+        if(restart_rows && row && row % restart_rows == 0)
+        {
+            flush_bits(&w);
+            put_byte(&w, 0xFF); put_byte(&w, 0xD0 + (row / restart_rows - 1) % 8);
+            first = true;
+        }
+
+        const uint16_t *thisrow = &image[row * rowlen];
+        const uint16_t *lastrow = row ? &image[(row - 1) * rowlen] : NULL;
+        int left = 0;
+
+        for(int i = 0; i < rowlen; i++)
+        {
+            int diff = thisrow[i] - predict(pred, comps, bits, first, thisrow, lastrow, i, left);
+            int ssss = diff ? 32 - __builtin_clz(abs(diff)) : 0;
+
+            left = thisrow[i];
+            if(diff < 0)
+            {
+                diff += (1 << ssss) - 1;
+            }
+            put_bits(&w, code[ssss], code_length[ssss]);
+            put_bits(&w, diff, ssss);
+        }
+    }
+    flush_bits(&w);
+    put_byte(&w, 0xFF); put_byte(&w, 0xD9);
+
+    *size = w.size;
+    return w.data;
+}
+
+static bool test_fixed_streams(void)
+{
+    for(int comps = 1; comps <= 2; comps++)
+    {
+        for(int pred = 1; pred <= 7; pred++)
+        {
+            /* predictor 6 always decoded a single component */
+            if(pred == 6 && comps > 1)
+            {
+                continue;
+            }
+
+            static const int restarts[] = { 0, 1, 3, 64 };
+            int width = 157;
+            int height = 23;
+            /* predictors that average two samples can't leave the 16 bit range, with
+               black / half scale pixel pairs they give the 16 bit differences (ssss 16) */
+            int bits = (pred == 1 || pred == 7) ? 16 : (pred == 4) ? 12 : 14;
+            uint16_t *image = make_image(width * comps, height, bits, 1 << (bits - 3));
+
+            if(bits == 16)
+            {
+                for(int i = 0; i + 1 < width * height * comps; i += 37)
+                {
+                    image[i] = 0;
+                    image[i + 1] = 32768;
+                }
+            }
+
+            for(size_t r = 0; r < sizeof(restarts) / sizeof(restarts[0]); r++)
+            {
+                int size;
+                uint8_t *data = encode_fixed(image, width, height, comps, bits, pred, restarts[r], &size);
+                char name[64];
+
+                /* the previous decoder has no restart support, and its row buffers overlap for 2 components,
+                   which breaks all predictors that look at the row above beyond the first column */
+                bool compare_reference = !restarts[r] && (comps == 1 || pred == 1);
+
+                for(int threads = 1; threads <= 4; threads += 3)
+                {
+                    snprintf(name, sizeof(name), "predictor %d, %d components, restart %d, %d threads", pred, comps, restarts[r], threads);
+                    if(!check(name, data, size, image, width * height * comps, compare_reference, threads))
+                    {
+                        return false;
+                    }
+                }
+                free(data);
+            }
+            free(image);
+        }
+    }
+
+    printf("fixed table streams: OK\n");
+    return true;
+}
+
+/* streams with truncated or damaged entropy coded data must fail or decode to something,
+   but stay within the buffers (the headers are not checked that thoroughly) */
+static bool test_corrupt_streams(void)
+{
+    int width = 64;
+    int height = 16;
+    uint16_t *image = make_image(width, height, 14, 100);
+
+    for(int restart = 0; restart <= 2; restart += 2)
+    {
+        int size;
+        uint8_t *data = encode_fixed(image, width, height, 1, 14, 1, restart, &size);
+        int header = 2;
+
+        while(data[header + 1] != 0xDA)
+        {
+            header += 2 + (data[header + 2] << 8 | data[header + 3]);
+        }
+        header += 2 + (data[header + 2] << 8 | data[header + 3]);
+
+        for(int run = 0; run < 2000; run++)
+        {
+            uint8_t *damaged = malloc(size);
+            int damaged_size = run % 2 ? size : header + 1 + rand() % (size - header);
+            uint16_t *decoded;
+            int samples;
+
+            memcpy(damaged, data, size);
+            for(int i = 0; i < 4; i++)
+            {
+                damaged[header + rand() % (damaged_size - header)] = rand();
+            }
+            for(int threads = 1; threads <= 2; threads++)
+            {
+                decode(false, threads, damaged, damaged_size, &decoded, &samples, NULL);
+                free(decoded);
+            }
+            free(damaged);
+        }
+        free(data);
+    }
+    free(image);
+
+    printf("damaged streams: OK\n");
+    return true;
+}
+
+/* LJ92 frames of MLV files, the VIDF payload starts with a SOI marker */
+static bool test_mlv(const char *filename, double *ref_time, double *new_time, int *frames)
+{
+    FILE *file = fopen(filename, "rb");
+    uint8_t header[32];
+
+    if(!file)
+    {
+        printf("%s: can't open\n", filename);
+        return false;
+    }
+
+    while(fread(header, 8, 1, file) == 1)
+    {
+        uint32_t block_size = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+        if(block_size < 8)
+        {
+            break;
+        }
+
+        uint8_t *block = malloc(block_size);
+        memcpy(block, header, 8);
+        if(fread(&block[8], block_size - 8, 1, file) != 1)
+        {
+            free(block);
+            break;
+        }
+
+        if(!memcmp(block, "VIDF", 4) && block_size > 32)
+        {
+            uint32_t frame_space = block[28] | (block[29] << 8) | (block[30] << 16) | ((uint32_t)block[31] << 24);
+            uint8_t *payload = &block[32 + frame_space];
+            int payload_size = block_size - 32 - frame_space;
+
+            if(32 + frame_space < block_size && payload[0] == 0xFF && payload[1] == 0xD8)
+            {
+                uint16_t *ref;
+                uint16_t *image;
+                int ref_samples, samples;
+                double ref_seconds, new_seconds;
+
+                int ref_ret = decode(true, 1, payload, payload_size, &ref, &ref_samples, &ref_seconds);
+                int new_ret = decode(false, 1, payload, payload_size, &image, &samples, &new_seconds);
+
+                if(ref_ret != new_ret || (ref_ret == LJ92_ERROR_NONE && (ref_samples != samples || memcmp(ref, image, samples * sizeof(uint16_t)))))
+                {
+                    printf("%s: frame %d differs\n", filename, *frames);
+                    return false;
+                }
+
+                *ref_time += ref_seconds;
+                *new_time += new_seconds;
+                (*frames)++;
+                free(ref);
+                free(image);
+            }
+        }
+        free(block);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static void benchmark(void)
+{
+    int width = 1920 * 2;
+    int height = 1080 / 2;
+    int samples = width * height;
+    uint16_t *image = make_image(width, height, 14, 40);
+    uint8_t *encoded;
+    int encoded_size;
+
+    TRY(lj92_encode(image, width, height, 14, 1, samples, 0, NULL, 0, &encoded, &encoded_size) == LJ92_ERROR_NONE);
+
+    for(int reference = 1; reference >= 0; reference--)
+    {
+        double best = 1e9;
+
+        for(int run = 0; run < 10; run++)
+        {
+            uint16_t *decoded;
+            int decoded_samples;
+            double seconds;
+
+            TRY(decode(reference, 1, encoded, encoded_size, &decoded, &decoded_samples, &seconds) == LJ92_ERROR_NONE);
+            free(decoded);
+            best = seconds < best ? seconds : best;
+        }
+        printf("decode %-8s 1920x1080 14 bit: %6.2f ms, %6.1f Mpixel/s\n", reference ? "previous" : "current", best * 1000, samples / best / 1e6);
+    }
+    free(encoded);
+
+    /* encoding with the table of the previous frame skips the frequency scan */
+    uint16_t *next = make_image(width, height, 14, 40);
+    lj92_table table;
+
+    TRY(lj92_encode_table(image, width, height, 14, samples, 0, NULL, 0, &table) == LJ92_ERROR_NONE);
+
+    for(int shared = 0; shared <= 1; shared++)
+    {
+        double best = 1e9;
+
+        for(int run = 0; run < 10; run++)
+        {
+            double start = now();
+            TRY(lj92_encode_with_table(next, width, height, 14, 1, samples, 0, NULL, 0, shared ? table : NULL, &encoded, &encoded_size) == LJ92_ERROR_NONE);
+            double seconds = now() - start;
+
+            free(encoded);
+            best = seconds < best ? seconds : best;
+        }
+        printf("encode %-8s 1920x1080 14 bit: %6.2f ms, %6.1f Mpixel/s, %5.2f bits/pixel\n", shared ? "shared" : "own", best * 1000, samples / best / 1e6, encoded_size * 8.0 / samples);
+    }
+
+    lj92_free_table(table);
+    free(next);
+    free(image);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        benchmark();
+        return 0;
+    }
+
+    TRY(test_encoder_streams());
+    TRY(test_encoder_tables());
+    TRY(test_fixed_streams());
+    TRY(test_corrupt_streams());
+
+    if(argc > 1)
+    {
+        double ref_time = 0, new_time = 0;
+        int frames = 0;
+
+        for(int arg = 1; arg < argc; arg++)
+        {
+            TRY(test_mlv(argv[arg], &ref_time, &new_time, &frames));
+        }
+        printf("%d MLV frames: OK, %.1f ms -> %.1f ms per frame\n", frames, frames ? ref_time * 1000 / frames : 0, frames ? new_time * 1000 / frames : 0);
+    }
+
+    return 0;
+}
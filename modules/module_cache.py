@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+import struct
+import argparse
+
+# Must match src/module_cache.h
+CACHE_FILE = "LINKED.BIN"
+CACHE_MAGIC = 0x4B4E4C4D
+CACHE_VERSION = 1
+HEADER_FORMAT = "<13I"
+MODULE_FORMAT = "<32sII"
+SYMBOL_FORMAT = "<II"
+FIXUP_KINDS = {0: "abs", 1: "rel", 2: "branch"}
+HASH_INIT = 0x811C9DC5
+
+
+class CacheError(Exception):
+    pass
+
+
+def main():
+    args = parse_args()
+
+    modules_dir = os.path.join(args.card_dir, "ML", "MODULES")
+    settings_dir = os.path.join(args.card_dir, "ML", "SETTINGS")
+    cache_path = os.path.join(modules_dir, CACHE_FILE)
+
+    if not os.path.isfile(cache_path):
+        print("No module cache on the card; "
+              "the camera writes one the next time it links the modules.")
+        sys.exit(0)
+
+    try:
+        cache = read_cache(cache_path)
+    except CacheError as e:
+        print("Invalid cache: %s" % e)
+        remove_if_asked(args, cache_path)
+        sys.exit(1)
+
+    print_cache(cache, args.verbose)
+
+    stale = find_stale(cache, modules_dir, settings_dir, args.sym)
+    if stale:
+        print("Stale, the camera will link the modules again:")
+        for s in stale:
+            print("  " + s)
+        remove_if_asked(args, cache_path)
+        sys.exit(1)
+
+    print("OK, the camera will load the modules from this cache.")
+
+
+def parse_args():
+    description = """Checks the cache of linked modules (ML/MODULES/%s)
+    on a card, or a copy of it.
+
+    The camera writes this cache after linking the enabled modules with TCC,
+    and loads it instead of linking on the next boots, as long as the symbol
+    file and the enabled modules stay the same. This tool validates the file
+    and tells whether the files on the card still match it.
+    """ % CACHE_FILE
+
+    parser = argparse.ArgumentParser(description=description)
+
+    parser.add_argument("card_dir",
+                        help="root of the card, the one with the ML dir")
+    parser.add_argument("--sym",
+                        help="symbol file, e.g. 6D_116.sym "
+                             "(default: the only .sym in ML/MODULES)")
+    parser.add_argument("-v", "--verbose",
+                        action="store_true",
+                        help="also list the cached symbols")
+    parser.add_argument("--remove-stale",
+                        action="store_true",
+                        help="delete the cache if it's invalid or stale")
+
+    args = parser.parse_args()
+
+    if not os.path.isdir(os.path.join(args.card_dir, "ML")):
+        print("card_dir doesn't have an ML dir: '%s'" % args.card_dir)
+        sys.exit(2)
+
+    return args
+
+
+def remove_if_asked(args, cache_path):
+    if args.remove_stale:
+        os.remove(cache_path)
+        print("Removed %s" % cache_path)
+
+
+def cache_hash(data, h=HASH_INIT):
+    """32-bit FNV-1a over little endian words, the tail padded with zeros"""
+    if len(data) % 4:
+        data = data + bytes(4 - len(data) % 4)
+    for (word,) in struct.iter_unpack("<I", data):
+        h = ((h ^ word) * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def file_hash(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    return len(data), cache_hash(data)
+
+
+def read_cache(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    header_size = struct.calcsize(HEADER_FORMAT)
+    if len(data) < header_size:
+        raise CacheError("too short")
+
+    names = ("magic", "version", "hash", "sym_size", "sym_hash",
+             "core_symbols", "module_count", "symbol_count", "names_size",
+             "fixup_count", "image_base", "image_size", "image_stored")
+    cache = dict(zip(names, struct.unpack_from(HEADER_FORMAT, data)))
+
+    if cache["magic"] != CACHE_MAGIC:
+        raise CacheError("bad magic 0x%08X" % cache["magic"])
+    if cache["version"] != CACHE_VERSION:
+        raise CacheError("version %d, expected %d"
+                         % (cache["version"], CACHE_VERSION))
+    if cache["image_stored"] > cache["image_size"]:
+        raise CacheError("stored image larger than the image")
+
+    module_size = struct.calcsize(MODULE_FORMAT)
+    symbol_size = struct.calcsize(SYMBOL_FORMAT)
+    sizes = (cache["module_count"] * module_size,
+             cache["symbol_count"] * symbol_size,
+             cache["names_size"],
+             cache["fixup_count"] * 4,
+             cache["image_stored"])
+    if header_size + sum(sizes) != len(data):
+        raise CacheError("size %d doesn't match the header (%d)"
+                         % (len(data), header_size + sum(sizes)))
+
+    if cache_hash(data[header_size:]) != cache["hash"]:
+        raise CacheError("hash mismatch, the file is damaged")
+
+    pos = header_size
+    cache["modules"] = []
+    for i in range(cache["module_count"]):
+        name, size, h = struct.unpack_from(MODULE_FORMAT, data, pos)
+        cache["modules"].append((name.split(b"\0")[0].decode(), size, h))
+        pos += module_size
+
+    symbols = []
+    for i in range(cache["symbol_count"]):
+        symbols.append(struct.unpack_from(SYMBOL_FORMAT, data, pos))
+        pos += symbol_size
+
+    names_blob = data[pos:pos + cache["names_size"]]
+    pos += cache["names_size"]
+    cache["symbols"] = []
+    for name, address in symbols:
+        if name >= len(names_blob):
+            raise CacheError("symbol name out of bounds")
+        name = names_blob[name:].split(b"\0")[0].decode()
+        cache["symbols"].append((name, address))
+
+    cache["fixups"] = {kind: 0 for kind in FIXUP_KINDS.values()}
+    for (fixup,) in struct.iter_unpack("<I", data[pos:pos + cache["fixup_count"] * 4]):
+        kind = FIXUP_KINDS.get(fixup & 3)
+        if kind is None:
+            raise CacheError("unknown fixup kind at offset 0x%X" % (fixup & ~3))
+        if (fixup & ~3) + 4 > cache["image_size"]:
+            raise CacheError("fixup at offset 0x%X outside the image" % (fixup & ~3))
+        cache["fixups"][kind] += 1
+
+    return cache
+
+
+def print_cache(cache, verbose):
+    print("Image: %d bytes linked at 0x%08X (%d stored), %d fixups (%s)"
+          % (cache["image_size"], cache["image_base"], cache["image_stored"],
+             cache["fixup_count"],
+             ", ".join("%d %s" % (n, k) for k, n in cache["fixups"].items())))
+    print("Modules:")
+    for name, size, h in cache["modules"]:
+        print("  %-12s %7d bytes  hash %08X" % (name, size, h))
+
+    if verbose:
+        lo = cache["image_base"]
+        hi = lo + cache["image_size"]
+        print("Symbols:")
+        for name, address in cache["symbols"]:
+            where = "image+0x%X" % (address - lo) if lo <= address <= hi else "core"
+            if not address:
+                where = "not found"
+            print("  %-32s %08X %s" % (name, address, where))
+
+
+def list_dir_nocase(path):
+    """FAT is case insensitive, the copy on the PC might not be"""
+    try:
+        return {f.lower(): f for f in os.listdir(path)}
+    except FileNotFoundError:
+        return {}
+
+
+def enabled_modules(modules_dir, settings_dir):
+    """enabled .mo files in load order, as in _module_load_all"""
+    settings = list_dir_nocase(settings_dir)
+    modules = []
+    for f in os.listdir(modules_dir):
+        if f.startswith(".") or f.startswith("_") or not f.lower().endswith(".mo"):
+            continue
+        name = f[:-3].lower()[:8]
+        if name + ".en" in settings:
+            modules.append((name, f))
+    return [f for name, f in sorted(modules)]
+
+
+def find_stale(cache, modules_dir, settings_dir, sym):
+    stale = []
+
+    if sym is None:
+        syms = [f for f in os.listdir(modules_dir) if f.lower().endswith(".sym")]
+        if len(syms) != 1:
+            stale.append("can't tell the symbol file, found %s; use --sym"
+                         % (", ".join(syms) or "none"))
+            return stale
+        sym = syms[0]
+
+    sym_path = sym if os.path.isfile(sym) else os.path.join(modules_dir, sym)
+    if not os.path.isfile(sym_path):
+        stale.append("symbol file %s missing" % sym_path)
+    elif file_hash(sym_path) != (cache["sym_size"], cache["sym_hash"]):
+        stale.append("%s changed (new ML build?)" % os.path.basename(sym_path))
+
+    enabled = enabled_modules(modules_dir, settings_dir)
+    cached = [name for name, size, h in cache["modules"]]
+    if [f.lower() for f in enabled] != [f.lower() for f in cached]:
+        stale.append("enabled modules are now: %s" % " ".join(enabled))
+        return stale
+
+    for f, (name, size, h) in zip(enabled, cache["modules"]):
+        if file_hash(os.path.join(modules_dir, f)) != (size, h):
+            stale.append("%s changed" % f)
+
+    return stale
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,23 @@
+# objects: attribute reads and writes, method calls
+class Counter:
+    def __init__(self):
+        self.count = 0
+        self.step = 1
+        self.limit = 100
+
+    def tick(self):
+        self.count = self.count + self.step
+        if self.count >= self.limit:
+            self.count = 0
+        return self.count
+
+def main():
+    c = Counter()
+    total = 0
+    i = 0
+    while i < 200000:
+        total = total + c.tick()
+        i = i + 1
+    print(total)
+
+main()
@@ -0,0 +1,7 @@
+# function calls and global lookups
+def fib(n):
+    if n < 2:
+        return n
+    return fib(n - 1) + fib(n - 2)
+
+print(fib(24))
@@ -0,0 +1,27 @@
+# garbage collector: a long lived table that keeps getting new entries,
+# next to many short lived temporaries
+def main():
+    table = []
+    i = 0
+    while i < 20000:
+        table.append({"id": i, "name": "item" + str(i), "tags": [i, i * 2]})
+        i = i + 1
+
+    total = 0
+    frame = 0
+    while frame < 3000:
+        # temporaries, e.g. formatting a status line
+        line = "frame " + str(frame) + " of " + str(3000)
+        parts = [line, str(len(line))]
+        total = total + len(parts[0])
+        # and a few entries that replace old ones
+        slot = (frame * 7) % len(table)
+        table[slot] = {"id": frame, "name": "new" + str(frame), "tags": [frame]}
+        frame = frame + 1
+
+    check = 0
+    for entry in table:
+        check = check + entry["id"] + len(entry["name"]) + entry["tags"][0]
+    print(total, check)
+
+main()
@@ -0,0 +1,27 @@
+# intervalometer-style logic: settings in dicts, builtins, small lists
+settings = {"interval": 5, "frames": 0, "ramp": 1, "iso": 100, "shutter": 30}
+isos = [100, 200, 400, 800, 1600, 3200, 6400]
+
+def next_iso(iso, ev):
+    n = isos.index(iso) + ev
+    n = max(0, min(len(isos) - 1, n))
+    return isos[n]
+
+def step(t, brightness):
+    if t % settings["interval"] == 0:
+        settings["frames"] = settings["frames"] + 1
+        if brightness < 40:
+            settings["iso"] = next_iso(settings["iso"], settings["ramp"])
+        elif brightness > 200:
+            settings["iso"] = next_iso(settings["iso"], -settings["ramp"])
+    return settings["frames"]
+
+def main():
+    frames = 0
+    t = 0
+    while t < 100000:
+        frames = step(t, (t * 7) % 256)
+        t = t + 1
+    print(frames, settings["iso"])
+
+main()
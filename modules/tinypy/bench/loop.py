@@ -0,0 +1,13 @@
+# arithmetic and comparisons on locals
+def main():
+    total = 0
+    i = 0
+    while i < 1000000:
+        if i % 3 == 0:
+            total = total + i * 2
+        else:
+            total = total - 1
+        i = i + 1
+    print(total)
+
+main()
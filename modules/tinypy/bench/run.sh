@@ -0,0 +1,21 @@
+#!/bin/sh
+# run.sh <interpreter>... - time every benchmark script with each interpreter
+# (best of 3 runs, in ms; compiling the script is included, as it runs in the VM too)
+cd "$(dirname "$0")"
+printf "%-12s" "script"
+for tp in "$@"; do printf "%24s" "$(basename "$tp")"; done
+echo
+for script in *.py; do
+    printf "%-12s" "$script"
+    for tp in "$@"; do
+        best=
+        for run in 1 2 3; do
+            start=$(date +%s%N)
+            "$tp" "$script" > /dev/null || exit 1
+            ms=$(( ($(date +%s%N) - start) / 1000000 ))
+            if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+        done
+        printf "%24s" "$best"
+    done
+    echo
+done
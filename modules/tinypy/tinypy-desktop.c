@@ -5,6 +5,16 @@
 #define tcc_realloc(x,y) realloc(x,y)
 #define tcc_free(x) free(x)
 
+#ifdef TP_GC_STATS
+#include <time.h>
+static double tp_gc_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+#endif
+
 int GetFileSize(const char* fname)
 {
     struct stat s;
@@ -17,6 +27,9 @@ int GetFileSize(const char* fname)
 int main(int argc, char *argv[]) {
     tp_vm *tp = tp_init(argc, argv);
     tp_ez_call(tp,"py2bc","tinypy",tp_None);
+#ifdef TP_GC_STATS
+    tp_gc_stats(tp);
+#endif
     tp_deinit(tp);
     return(0);
 }
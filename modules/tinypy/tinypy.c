@@ -226,6 +226,7 @@ typedef struct _tp_dict {
     int cur;
     int mask;
     int used;
+    int version;
     tp_obj meta;
 } _tp_dict;
 typedef struct _tp_fnc {
@@ -259,10 +260,47 @@ typedef struct tp_frame_ {
 } tp_frame_;
 
 #define TP_GCMAX 64
+#define TP_GCMAJOR 1024
+#define TP_POOL_CHUNK 64
 #define TP_FRAMES 64
 #define TP_REGS_EXTRA 2
 /* #define TP_REGS_PER_FRAME 256*/
 #define TP_REGS 8192
+#define TP_ICACHE 256
+
+/* Inline cache for the name lookups of one GET or GGET instruction.
+ * A slot is only a hint: it is used if the item there still holds the
+ * same key. For builtins, the globals must not have changed since the
+ * name was found missing there (version is bumped on every insert). */
+typedef struct tp_icache {
+    tp_code *pc;
+    int slot;
+    int builtin;
+    struct _tp_dict *globals;
+    int globals_version;
+} tp_icache;
+
+/* Fixed size objects (the headers of lists, dicts, functions and data)
+ * are carved from chunks of TP_POOL_CHUNK, and kept on a free list when
+ * collected, instead of going through tp_malloc one by one. */
+enum {
+    TP_POOL_LIST,TP_POOL_DICT,TP_POOL_FNC,TP_POOL_DATA,
+    TP_POOLS
+};
+
+typedef struct tp_pool {
+    int size;
+    void *free;
+    void *chunks;
+} tp_pool;
+
+/* gci of the collected objects. The touched flags are used in turn by
+ * consecutive minor cycles (tp->touched_flag). */
+#define TP_GC_MARK 1
+#define TP_GC_OLD 2
+#define TP_GC_TOUCHED_A 4
+#define TP_GC_TOUCHED_B 8
+#define TP_GC_TOUCHED (TP_GC_TOUCHED_A|TP_GC_TOUCHED_B)
 
 /* Type: tp_vm
  * Representation of a tinypy virtual machine instance.
@@ -304,8 +342,23 @@ typedef struct tp_vm {
     /* gc */
     _tp_list *white;
     _tp_list *grey;
-    _tp_list *black;
+    _tp_list *young;
+    _tp_list *old;
+    _tp_list *touched;
+    int touched_flag;
+    _tp_list *sweep;
+    _tp_list *unmark;
     int steps;
+    int major;
+    int major_at;
+    int sweep_major;
+    tp_pool pools[TP_POOLS];
+#ifdef TP_GC_STATS
+    int gc_cycles[2];
+    int gc_pauses[4];
+    double gc_time;
+    double gc_pause_max;
+#endif
     /* sandbox */
     clock_t clocks;
     double time_elapsed;
@@ -313,6 +366,9 @@ typedef struct tp_vm {
     unsigned long mem_limit;
     unsigned long mem_used;
     int mem_exceeded;
+    /* name lookups */
+    int dict_version;
+    tp_icache icache[TP_ICACHE];
 } tp_vm;
 
 #define TP tp_vm *tp
@@ -353,6 +409,9 @@ void _tp_raise(TP,tp_obj);
 tp_obj tp_printf(TP,char const *fmt,...);
 tp_obj tp_track(TP,tp_obj);
 void tp_grey(TP,tp_obj);
+void tp_barrier(TP,int type,void *self,tp_obj v);
+void *tp_pool_alloc(TP,int pool);
+void tp_pool_free(TP,int pool,void *p);
 tp_obj tp_call(TP, tp_obj fnc, tp_obj params);
 tp_obj tp_add(TP,tp_obj a, tp_obj b) ;
 
@@ -564,6 +623,8 @@ tp_num _roundf(tp_num v) ;
 tp_obj tp_round(TP) ;
 tp_obj tp_exists(TP) ;
 tp_obj tp_mtime(TP) ;
+int _tp_lookup_hash_(TP,tp_obj self, tp_obj k, int hash, tp_obj *meta, int depth) ;
+int _tp_lookup_meta_(TP,tp_obj self, tp_obj k, int hash, tp_obj *meta, int depth) ;
 int _tp_lookup_(TP,tp_obj self, tp_obj k, tp_obj *meta, int depth) ;
 int _tp_lookup(TP,tp_obj self, tp_obj k, tp_obj *meta) ;
 tp_obj tp_setmeta(TP) ;
@@ -576,13 +637,22 @@ tp_obj tp_class(TP) ;
 tp_obj tp_builtins_bool(TP) ;
 void tp_follow(TP,tp_obj v) ;
 void tp_reset(TP) ;
+void tp_mark_roots(TP) ;
+void tp_pool_init(TP,int pool,int size) ;
+void tp_pool_deinit(TP,int pool) ;
 void tp_gc_init(TP) ;
 void tp_gc_deinit(TP) ;
 void tp_delete(TP,tp_obj v) ;
+void tp_sweep(TP,int n) ;
+void tp_unmark(TP,int n) ;
 void tp_collect(TP) ;
 void _tp_gcinc(TP) ;
 void tp_full(TP) ;
 void tp_gcinc(TP) ;
+void _tp_track(TP,tp_obj v) ;
+#ifdef TP_GC_STATS
+void tp_gc_stats(TP) ;
+#endif
 tp_obj tp_iter(TP,tp_obj self, tp_obj k) ;
 int tp_iget(TP,tp_obj *r, tp_obj self, tp_obj k) ;
 tp_obj tp_mul(TP,tp_obj a, tp_obj b) ;
@@ -623,11 +693,11 @@ void _tp_list_set(TP,_tp_list *self,int k, tp_obj v, const char *error) {
         tp_raise(,tp_string("(_tp_list_set) KeyError"));
     }
     self->items[k] = v;
-    tp_grey(tp,v);
+    tp_barrier(tp,TP_LIST,self,v);
 }
 void _tp_list_free(TP, _tp_list *self) {
     tp_free(tp, self->items);
-    tp_free(tp, self);
+    tp_pool_free(tp, TP_POOL_LIST, self);
 }
 
 tp_obj _tp_list_get(TP,_tp_list *self,int k,const char *error) {
@@ -649,7 +719,7 @@ void _tp_list_appendx(TP,_tp_list *self, tp_obj v) {
 }
 void _tp_list_insert(TP,_tp_list *self, int n, tp_obj v) {
     _tp_list_insertx(tp,self,n,v);
-    tp_grey(tp,v);
+    tp_barrier(tp,TP_LIST,self,v);
 }
 void _tp_list_append(TP,_tp_list *self, tp_obj v) {
     _tp_list_insert(tp,self,self->len,v);
@@ -682,7 +752,7 @@ tp_obj tp_index(TP) {
 }
 
 _tp_list *_tp_list_new(TP) {
-    return (_tp_list*)tp_malloc(tp, sizeof(_tp_list));
+    return (_tp_list*)tp_pool_alloc(tp, TP_POOL_LIST);
 }
 
 tp_obj _tp_list_copy(TP, tp_obj rr) {
@@ -770,7 +840,7 @@ int tp_lua_hash(void const *v,int l) {
 }
 void _tp_dict_free(TP, _tp_dict *self) {
     tp_free(tp, self->items);
-    tp_free(tp, self);
+    tp_pool_free(tp, TP_POOL_DICT, self);
 }
 
 /* void _tp_dict_reset(_tp_dict *self) {
@@ -803,6 +873,7 @@ void _tp_dict_hash_set(TP,_tp_dict *self, int hash, tp_obj k, tp_obj v) {
         int n = i&self->mask;
         if (self->items[n].used > 0) { continue; }
         if (self->items[n].used == 0) { self->used += 1; }
+        self->version = ++tp->dict_version;
         item.used = 1;
         item.hash = hash;
         item.key = k;
@@ -862,7 +933,7 @@ void _tp_dict_setx(TP,_tp_dict *self,tp_obj k, tp_obj v) {
 
 void _tp_dict_set(TP,_tp_dict *self,tp_obj k, tp_obj v) {
     _tp_dict_setx(tp,self,k,v);
-    tp_grey(tp,k); tp_grey(tp,v);
+    tp_barrier(tp,TP_DICT,self,k); tp_barrier(tp,TP_DICT,self,v);
 }
 
 tp_obj _tp_dict_get(TP,_tp_dict *self,tp_obj k, const char *error) {
@@ -883,14 +954,15 @@ void _tp_dict_del(TP,_tp_dict *self,tp_obj k, const char *error) {
 }
 
 _tp_dict *_tp_dict_new(TP) {
-    _tp_dict *self = (_tp_dict*)tp_malloc(tp, sizeof(_tp_dict));
+    _tp_dict *self = (_tp_dict*)tp_pool_alloc(tp, TP_POOL_DICT);
+    self->version = ++tp->dict_version;
     return self;
 }
 tp_obj _tp_dict_copy(TP,tp_obj rr) {
     tp_obj obj = {TP_DICT};
     _tp_dict *o = rr.dict.val;
     _tp_dict *r = _tp_dict_new(tp);
-    *r = *o; r->gci = 0;
+    *r = *o; r->gci = 0; r->version = ++tp->dict_version;
     r->items = (tp_item*)tp_malloc(tp, sizeof(tp_item)*o->alloc);
     memcpy(r->items,o->items,sizeof(tp_item)*o->alloc);
     obj.dict.val = r;
@@ -961,7 +1033,7 @@ tp_obj _tp_tcall(TP,tp_obj fnc) {
 
 tp_obj tp_fnc_new(TP,int t, void *v, tp_obj c,tp_obj s, tp_obj g) {
     tp_obj r = {TP_FNC};
-    _tp_fnc *info = (_tp_fnc*)tp_malloc(tp, sizeof(_tp_fnc));
+    _tp_fnc *info = (_tp_fnc*)tp_pool_alloc(tp, TP_POOL_FNC);
     info->code = c;
     info->self = s;
     info->globals = g;
@@ -1022,7 +1094,7 @@ tp_obj tp_method(TP,tp_obj self,tp_obj v(TP)) {
  */
 tp_obj tp_data(TP,int magic,void *v) {
     tp_obj r = {TP_DATA};
-    r.data.info = (_tp_data*)tp_malloc(tp, sizeof(_tp_data));
+    r.data.info = (_tp_data*)tp_pool_alloc(tp, TP_POOL_DATA);
     r.data.val = v;
     r.data.magic = magic;
     return tp_track(tp,r);
@@ -1468,14 +1540,9 @@ tp_obj tp_mtime(TP) {
     tp_raise(tp_None,tp_string("(tp_mtime) IOError: ?"));
 }
 
-int _tp_lookup_(TP,tp_obj self, tp_obj k, tp_obj *meta, int depth) {
-    int n = _tp_dict_find(tp,self.dict.val,k);
-    if (n != -1) {
-        *meta = self.dict.val->items[n].val;
-        return 1;
-    }
-    depth--; if (!depth) { tp_raise(0,tp_string("(tp_lookup) RuntimeError: maximum lookup depth exceeded")); }
-    if (self.dict.dtype && self.dict.val->meta.type == TP_DICT && _tp_lookup_(tp,self.dict.val->meta,k,meta,depth)) {
+/* look k up in the meta of self (and on up), for when self itself doesn't have it */
+int _tp_lookup_meta_(TP,tp_obj self, tp_obj k, int hash, tp_obj *meta, int depth) {
+    if (self.dict.val->meta.type == TP_DICT && _tp_lookup_hash_(tp,self.dict.val->meta,k,hash,meta,depth)) {
         if (self.dict.dtype == 2 && meta->type == TP_FNC) {
             *meta = tp_fnc_new(tp,meta->fnc.ftype|2,
                 meta->fnc.cfnc,meta->fnc.info->code,
@@ -1486,13 +1553,30 @@ int _tp_lookup_(TP,tp_obj self, tp_obj k, tp_obj *meta, int depth) {
     return 0;
 }
 
+int _tp_lookup_hash_(TP,tp_obj self, tp_obj k, int hash, tp_obj *meta, int depth) {
+    int n = _tp_dict_hash_find(tp,self.dict.val,hash,k);
+    if (n != -1) {
+        *meta = self.dict.val->items[n].val;
+        return 1;
+    }
+    depth--; if (!depth) { tp_raise(0,tp_string("(tp_lookup) RuntimeError: maximum lookup depth exceeded")); }
+    return self.dict.dtype && _tp_lookup_meta_(tp,self,k,hash,meta,depth);
+}
+
+int _tp_lookup_(TP,tp_obj self, tp_obj k, tp_obj *meta, int depth) {
+    return _tp_lookup_hash_(tp,self,k,tp_hash(tp,k),meta,depth);
+}
+
 int _tp_lookup(TP,tp_obj self, tp_obj k, tp_obj *meta) {
     return _tp_lookup_(tp,self,k,meta,8);
 }
 
+/* the name is a constant, so its hash is computed once per call site */
 #define TP_META_BEGIN(self,name) \
     if (self.dict.dtype == 2) { \
-        tp_obj meta; if (_tp_lookup(tp,self,tp_string(name),&meta)) {
+        static int _meta_hash; tp_obj meta; tp_obj _meta_name = tp_string(name); \
+        if (!_meta_hash) { _meta_hash = tp_hash(tp,_meta_name); } \
+        if (_tp_lookup_hash_(tp,self,_meta_name,_meta_hash,&meta,8)) {
 
 #define TP_META_END \
         } \
@@ -1524,6 +1608,7 @@ tp_obj tp_setmeta(TP) {
     tp_obj self = TP_TYPE(TP_DICT);
     tp_obj meta = TP_TYPE(TP_DICT);
     self.dict.val->meta = meta;
+    tp_barrier(tp,TP_DICT,self.dict.val,meta);
     return tp_None;
 }
 
@@ -1609,16 +1694,44 @@ tp_obj tp_builtins_bool(TP) {
    void tp_gc_deinit(TP) { }
    void tp_delete(TP,tp_obj v) { }*/
 
+/* The collector is incremental (tri-color, one grey object traced per
+ * step) and generational, with sticky marks: objects that survive a cycle
+ * become old and stay marked, so minor cycles only trace the young ones,
+ * starting from the registers and from the old objects that got young
+ * references since (tp_barrier). Once the old objects have doubled (or
+ * grown by TP_GCMAJOR), a major cycle traces everything from the root,
+ * after unmarking the old objects step by step (tp_unmark). The garbage
+ * is freed step by step during the next cycle (tp_sweep).
+ *
+ * Every object is on one of the white, young, old, sweep or unmark lists,
+ * which is where it gets freed from. Marked strings and data need no
+ * tracing, so they don't go on the grey list. */
+
 void tp_grey(TP,tp_obj v) {
     if (v.type < TP_STRING || (!v.gci.data) || *v.gci.data) { return; }
-    *v.gci.data = 1;
-    if (v.type == TP_STRING || v.type == TP_DATA) {
-        _tp_list_appendx(tp,tp->black,v);
-        return;
-    }
+    *v.gci.data = TP_GC_MARK;
+    if (v.type == TP_STRING || v.type == TP_DATA) { return; }
     _tp_list_appendx(tp,tp->grey,v);
 }
 
+/* Write barrier: self, a list or dict, now refers to v. Old objects that
+ * get young references are traced again in the next minor cycle. A major
+ * cycle needs none of that: the objects that were old are white again and
+ * get promoted like the young ones, and those promoted since are already
+ * on the touched list. */
+void tp_barrier(TP,int type,void *self,tp_obj v) {
+    int *gci = (int*)self;
+    tp_grey(tp,v);
+    if (tp->major) { return; }
+    if ((*gci & (TP_GC_OLD|tp->touched_flag)) == TP_GC_OLD && v.type >= TP_STRING &&
+        v.gci.data && !(*v.gci.data & TP_GC_OLD)) {
+        tp_obj r = {type};
+        r.gci.data = gci;
+        *gci |= tp->touched_flag;
+        _tp_list_appendx(tp,tp->touched,r);
+    }
+}
+
 void tp_follow(TP,tp_obj v) {
     int type = v.type;
     if (type == TP_LIST) {
@@ -1646,25 +1759,151 @@ void tp_follow(TP,tp_obj v) {
 void tp_reset(TP) {
     int n;
     _tp_list *tmp;
-    for (n=0; n<tp->black->len; n++) {
-        *tp->black->items[n].gci.data = 0;
+    /* the new objects of this cycle get checked in the next one; the
+       others are old, or survivors of this cycle that tp_sweep promotes */
+    for (n=0; n<tp->young->len; n++) {
+        *tp->young->items[n].gci.data = 0;
     }
     tmp = tp->white;
-    tp->white = tp->black;
-    tp->black = tmp;
+    tp->white = tp->young;
+    tp->young = tmp;
+
+    tp->major = (tp->old->len >= tp->major_at);
+    if (tp->major) {
+        tmp = tp->unmark;
+        tp->unmark = tp->old;
+        tp->old = tmp;
+        tp->touched->len = 0;
+    }
+}
+
+/* the roots of a cycle */
+void tp_mark_roots(TP) {
+    int n;
+    tp_obj *r;
+    _tp_list *tmp;
+    if (tp->major) {
+        tp_follow(tp,tp->root);
+        return;
+    }
+
+    /* traced step by step, like the grey objects they now are. Their flag
+       is cleared when they are, and the other one records the old objects
+       for the next cycle, even those that are still grey. */
+    tp->touched_flag ^= TP_GC_TOUCHED;
+    if (tp->grey->len) {
+        for (n=0; n<tp->touched->len; n++) {
+            _tp_list_appendx(tp,tp->grey,tp->touched->items[n]);
+        }
+        tp->touched->len = 0;
+    } else {
+        tmp = tp->grey;
+        tp->grey = tp->touched;
+        tp->touched = tmp;
+    }
+    tp_follow(tp,tp->root);
+
+    /* all of them, like tracing _regs would: returned frames are cleared,
+       but frames left by an exception are not, and must stay valid */
+    if (!tp->regs) { return; }
+    for (r = tp->regs; r < tp->regs + TP_REGS; r++) {
+        tp_grey(tp,*r);
+    }
+}
+
+/* Unmarks up to n old objects for a major cycle, which starts tracing
+ * once they are all white again. Until then nothing is traced, so no
+ * black object can refer to one that is unmarked later. */
+void tp_unmark(TP,int n) {
+    if (!tp->unmark->len) { return; }
+    while (n-- > 0 && tp->unmark->len) {
+        tp_obj v = tp->unmark->items[--tp->unmark->len];
+        *v.gci.data = 0;
+        _tp_list_appendx(tp,tp->white,v);
+    }
+    if (!tp->unmark->len) {
+        tp_mark_roots(tp);
+    }
+}
+
+void tp_pool_init(TP,int pool,int size) {
+    tp->pools[pool].size = size;
+    tp->pools[pool].free = 0;
+    tp->pools[pool].chunks = 0;
+}
+
+void tp_pool_deinit(TP,int pool) {
+    void *chunk = tp->pools[pool].chunks;
+    while (chunk) {
+        void *next = *(void**)chunk;
+        tp_free(tp, chunk);
+        chunk = next;
+    }
+    tp->pools[pool].free = 0;
+    tp->pools[pool].chunks = 0;
+}
+
+/* the first object of each chunk links the chunks */
+void *tp_pool_alloc(TP,int pool) {
+    tp_pool *p = &tp->pools[pool];
+    void **r = (void**)p->free;
+    if (!r) {
+        char *chunk = (char*)tp_malloc(tp, p->size*TP_POOL_CHUNK);
+        int i;
+        *(void**)chunk = p->chunks;
+        p->chunks = chunk;
+        for (i=TP_POOL_CHUNK-1; i>0; i--) {
+            void **o = (void**)(chunk+i*p->size);
+            *o = p->free;
+            p->free = o;
+        }
+        r = (void**)p->free;
+    }
+    p->free = *r;
+    memset(r,0,p->size);
+    return r;
+}
+
+void tp_pool_free(TP,int pool,void *o) {
+    *(void**)o = tp->pools[pool].free;
+    tp->pools[pool].free = o;
 }
 
 void tp_gc_init(TP) {
+    tp_pool_init(tp,TP_POOL_LIST,sizeof(_tp_list));
+    tp_pool_init(tp,TP_POOL_DICT,sizeof(_tp_dict));
+    tp_pool_init(tp,TP_POOL_FNC,sizeof(_tp_fnc));
+    tp_pool_init(tp,TP_POOL_DATA,sizeof(_tp_data));
     tp->white = _tp_list_new(tp);
     tp->grey = _tp_list_new(tp);
-    tp->black = _tp_list_new(tp);
+    tp->young = _tp_list_new(tp);
+    tp->old = _tp_list_new(tp);
+    tp->touched = _tp_list_new(tp);
+    tp->touched_flag = TP_GC_TOUCHED_A;
+    tp->sweep = _tp_list_new(tp);
+    tp->unmark = _tp_list_new(tp);
     tp->steps = 0;
+    tp->major = 1;
+    tp->major_at = TP_GCMAJOR;
 }
 
+/* Frees all the objects, reachable or not. */
 void tp_gc_deinit(TP) {
-    _tp_list_free(tp, tp->white);
+    _tp_list *lists[5];
+    int i,n;
+    lists[0] = tp->white; lists[1] = tp->young; lists[2] = tp->old;
+    lists[3] = tp->sweep; lists[4] = tp->unmark;
+    for (i=0; i<5; i++) {
+        for (n=0; n<lists[i]->len; n++) {
+            tp_delete(tp,lists[i]->items[n]);
+        }
+        _tp_list_free(tp, lists[i]);
+    }
     _tp_list_free(tp, tp->grey);
-    _tp_list_free(tp, tp->black);
+    _tp_list_free(tp, tp->touched);
+    for (n=0; n<TP_POOLS; n++) {
+        tp_pool_deinit(tp,n);
+    }
 }
 
 void tp_delete(TP,tp_obj v) {
@@ -1682,24 +1921,48 @@ void tp_delete(TP,tp_obj v) {
         if (v.data.info->free) {
             v.data.info->free(tp,v);
         }
-        tp_free(tp, v.data.info);
+        tp_pool_free(tp, TP_POOL_DATA, v.data.info);
         return;
     } else if (type == TP_FNC) {
-        tp_free(tp, v.fnc.info);
+        tp_pool_free(tp, TP_POOL_FNC, v.fnc.info);
         return;
     }
     tp_raise(,tp_string("(tp_delete) TypeError: ?"));
 }
 
+/* Frees or promotes up to n objects left over by the last cycle. */
+void tp_sweep(TP,int n) {
+    while (n-- > 0 && tp->sweep->len) {
+        tp_obj r = tp->sweep->items[--tp->sweep->len];
+        if (!*r.gci.data) {
+            tp_delete(tp,r);
+            continue;
+        }
+        /* survived a cycle: old from now on. The young objects it refers
+           to are traced in this cycle, and the ones that are new in this
+           cycle at the start of the next one. */
+        *r.gci.data |= TP_GC_OLD;
+        _tp_list_appendx(tp,tp->old,r);
+        if (r.type != TP_STRING && r.type != TP_DATA) {
+            *r.gci.data |= tp->touched_flag;
+            _tp_list_appendx(tp,tp->touched,r);
+            _tp_list_appendx(tp,tp->grey,r);
+        }
+    }
+    if (!tp->sweep->len && tp->sweep_major) {
+        tp->sweep_major = 0;
+        tp->major_at = _tp_max(tp->old->len*2,tp->old->len+TP_GCMAJOR);
+    }
+}
+
+/* The unmarked white objects are garbage. They are swept step by step
+ * during the next cycle. */
 void tp_collect(TP) {
     //printf("collect %d\n", GetFreeMemForAllocateMemory());
-    int n;
-    for (n=0; n<tp->white->len; n++) {
-        tp_obj r = tp->white->items[n];
-        if (*r.gci.data) { continue; }
-        tp_delete(tp,r);
-    }
-    tp->white->len = 0;
+    _tp_list *tmp = tp->sweep;
+    tp->sweep = tp->white;
+    tp->white = tmp;
+    tp->sweep_major = tp->major;
     tp_reset(tp);
 }
 
@@ -1709,36 +1972,75 @@ void _tp_gcinc(TP) {
         return;
     }
     v = _tp_list_pop(tp,tp->grey,tp->grey->len-1,"_tp_gcinc");
+    *v.gci.data &= ~(TP_GC_TOUCHED ^ tp->touched_flag);
     tp_follow(tp,v);
-    _tp_list_appendx(tp,tp->black,v);
 }
 
 void tp_full(TP) {
+    tp_sweep(tp,tp->sweep->len);
+    tp_unmark(tp,tp->unmark->len);
     while (tp->grey->len) {
         _tp_gcinc(tp);
     }
+#ifdef TP_GC_STATS
+    tp->gc_cycles[tp->major] += 1;
+#endif
     tp_collect(tp);
-    tp_follow(tp,tp->root);
+    if (!tp->unmark->len) { tp_mark_roots(tp); }
 }
 
 void tp_gcinc(TP) {
     tp->steps += 1;
     int i;
     // aggressive garbage collection
-    for (i = 0; i < 100 && tp->grey->len > 0; i++) {
-        _tp_gcinc(tp);
+    if (tp->unmark->len) {
+        tp_unmark(tp,1000);
+    } else {
+        for (i = 0; i < 100 && tp->grey->len > 0; i++) {
+            _tp_gcinc(tp);
+        }
     }
-    if (tp->steps < TP_GCMAX || tp->grey->len > 0) { return; }
+    tp_sweep(tp,100);
+    if (tp->steps < TP_GCMAX || tp->grey->len > 0 || tp->sweep->len > 0 || tp->unmark->len > 0) { return; }
     tp->steps = 0;
     tp_full(tp);
     return;
 }
 
+/* new objects are marked, so they live at least until the next cycle ends */
+void _tp_track(TP,tp_obj v) {
+    if (v.type < TP_STRING || (!v.gci.data) || *v.gci.data) { return; }
+    tp_grey(tp,v);
+    _tp_list_appendx(tp,tp->young,v);
+}
+
+#ifdef TP_GC_STATS
+/* pauses of the script at allocations, by tp_gc_clock() of the host (microseconds) */
+void tp_gc_stats(TP) {
+    fprintf(stderr,"gc: %d minor, %d major cycles, %.1f ms total, longest pause %.0f us\n",
+        tp->gc_cycles[0],tp->gc_cycles[1],tp->gc_time/1000,tp->gc_pause_max);
+    fprintf(stderr,"gc: pauses < 10 us %d, < 100 us %d, < 1 ms %d, longer %d\n",
+        tp->gc_pauses[0],tp->gc_pauses[1],tp->gc_pauses[2],tp->gc_pauses[3]);
+}
+
 tp_obj tp_track(TP,tp_obj v) {
+    double start = tp_gc_clock();
+    double pause;
     tp_gcinc(tp);
-    tp_grey(tp,v);
+    pause = tp_gc_clock() - start;
+    tp->gc_time += pause;
+    tp->gc_pause_max = pause > tp->gc_pause_max ? pause : tp->gc_pause_max;
+    tp->gc_pauses[pause < 10 ? 0 : pause < 100 ? 1 : pause < 1000 ? 2 : 3] += 1;
+    _tp_track(tp,v);
+    return v;
+}
+#else
+tp_obj tp_track(TP,tp_obj v) {
+    tp_gcinc(tp);
+    _tp_track(tp,v);
     return v;
 }
+#endif
 
 /**/
 
@@ -2128,9 +2430,9 @@ tp_vm *_tp_init(void) {
     tp->cur = 0;
     tp->jmp = 0;
     tp->ex = tp_None;
+    tp_gc_init(tp);
     tp->root = tp_list_nt(tp);
     for (i=0; i<256; i++) { tp->chars[i][0]=i; }
-    tp_gc_init(tp);
     tp->_regs = tp_list(tp);
     for (i=0; i<TP_REGS; i++) { tp_set(tp,tp->_regs,tp_None,tp_None); }
     tp->builtins = tp_dict(tp);
@@ -2161,10 +2463,6 @@ tp_vm *_tp_init(void) {
  * may be good practice to call this function on shutdown.
  */
 void tp_deinit(TP) {
-    while (tp->root.list.val->len) {
-        _tp_list_pop(tp,tp->root.list.val,0,"tp_deinit");
-    }
-    tp_full(tp); tp_full(tp);
     tp_delete(tp,tp->root);
     tp_gc_deinit(tp);
     tp->mem_used -= sizeof(tp_vm);
@@ -2342,45 +2640,187 @@ enum {
 #define SR(v) f->cur = cur; return(v);
 
 
+#ifndef TP_NO_ICACHE
+tp_inline static tp_icache *_tp_icache(TP,tp_code *pc) {
+    return &tp->icache[((size_t)pc/sizeof(tp_code))&(TP_ICACHE-1)];
+}
+
+/* does item n of self hold the string k? */
+tp_inline static int _tp_icache_check(_tp_dict *self, int n, tp_obj k) {
+    tp_item *item;
+    if (n >= self->alloc) { return 0; }
+    item = &self->items[n];
+    return item->used == 1 && item->key.type == TP_STRING && item->key.string.len == k.string.len &&
+        (item->key.string.val == k.string.val || memcmp(item->key.string.val,k.string.val,k.string.len) == 0);
+}
+
+/* GGET: globals, then builtins */
+static tp_obj _tp_gget(TP,tp_code *pc,tp_obj globals,tp_obj k) {
+    tp_icache *c = _tp_icache(tp,pc);
+    _tp_dict *g = globals.dict.val;
+    _tp_dict *b = tp->builtins.dict.val;
+    int hash,n;
+    if (c->pc == pc) {
+        if (!c->builtin) {
+            if (_tp_icache_check(g,c->slot,k)) { return g->items[c->slot].val; }
+        } else if (c->globals == g && c->globals_version == g->version && _tp_icache_check(b,c->slot,k)) {
+            return b->items[c->slot].val;
+        }
+    }
+    hash = tp_hash(tp,k);
+    n = _tp_dict_hash_find(tp,g,hash,k);
+    if (n != -1) {
+        c->pc = pc; c->slot = n; c->builtin = 0;
+        return g->items[n].val;
+    }
+    n = _tp_dict_hash_find(tp,b,hash,k);
+    if (n == -1) { return tp_get(tp,tp->builtins,k); }
+    c->pc = pc; c->slot = n; c->builtin = 1;
+    c->globals = g; c->globals_version = g->version;
+    return b->items[n].val;
+}
+
+/* GET of a string key from a dict, e.g. an attribute */
+static tp_obj _tp_get_cached(TP,tp_code *pc,tp_obj self,tp_obj k) {
+    tp_icache *c;
+    _tp_dict *d;
+    int hash,n;
+    tp_obj r;
+    if (self.type != TP_DICT || k.type != TP_STRING) { return tp_get(tp,self,k); }
+    TP_META_BEGIN(self,"__get__");
+        return tp_call(tp,meta,tp_params_v(tp,1,k));
+    TP_META_END;
+    c = _tp_icache(tp,pc); d = self.dict.val;
+    if (c->pc == pc && _tp_icache_check(d,c->slot,k)) { return d->items[c->slot].val; }
+    hash = tp_hash(tp,k);
+    n = _tp_dict_hash_find(tp,d,hash,k);
+    if (n != -1) {
+        c->pc = pc; c->slot = n; c->builtin = 0;
+        return d->items[n].val;
+    }
+    if (self.dict.dtype && _tp_lookup_meta_(tp,self,k,hash,&r,7)) { return r; }
+    return _tp_dict_get(tp,d,k,"tp_get");
+}
+
+/* SET of a string key that is already in the dict */
+static void _tp_set_cached(TP,tp_code *pc,tp_obj self,tp_obj k,tp_obj v) {
+    tp_icache *c;
+    _tp_dict *d;
+    if (self.type != TP_DICT || k.type != TP_STRING) { tp_set(tp,self,k,v); return; }
+    TP_META_BEGIN(self,"__set__");
+        tp_call(tp,meta,tp_params_v(tp,2,k,v));
+        return;
+    TP_META_END;
+    c = _tp_icache(tp,pc); d = self.dict.val;
+    if (c->pc != pc || !_tp_icache_check(d,c->slot,k)) {
+        int n = _tp_dict_find(tp,d,k);
+        if (n == -1) { _tp_dict_set(tp,d,k,v); return; }
+        c->pc = pc; c->slot = n; c->builtin = 0;
+    }
+    d->items[c->slot].val = v;
+    tp_barrier(tp,TP_DICT,d,k); tp_barrier(tp,TP_DICT,d,v);
+}
+
+#define TP_GET(pc,self,k) _tp_get_cached(tp,pc,self,k)
+#define TP_SET(pc,self,k,v) _tp_set_cached(tp,pc,self,k,v)
+#define TP_GGET(pc,globals,k) _tp_gget(tp,pc,globals,k)
+#else
+tp_inline static tp_obj _tp_gget(TP,tp_obj globals,tp_obj k) {
+    tp_obj r;
+    if (!tp_iget(tp,&r,globals,k)) { r = tp_get(tp,tp->builtins,k); }
+    return r;
+}
+#define TP_GET(pc,self,k) tp_get(tp,self,k)
+#define TP_SET(pc,self,k,v) tp_set(tp,self,k,v)
+#define TP_GGET(pc,globals,k) _tp_gget(tp,globals,k)
+#endif
+
+/* With gcc, every instruction jumps straight to the code of the next one
+ * (labels as values), instead of going back through the switch. That gives
+ * the branch predictor one indirect jump per instruction to learn from. */
+#if defined(__GNUC__) && !defined(TP_SANDBOX) && !defined(TP_NO_COMPUTED_GOTO)
+#define TP_COMPUTED_GOTO
+#endif
+
+#ifdef TP_COMPUTED_GOTO
+#define TP_CASE(x) L_##x: case x
+#define TP_DISPATCH e = *cur; goto *ops[e.i]
+#define TP_NEXT cur += 1; TP_DISPATCH
+#else
+#define TP_CASE(x) case x
+#define TP_NEXT break
+#endif
+
 int tp_step(TP) {
     tp_frame_ *f = &tp->frames[tp->cur];
     tp_obj *regs = f->regs;
     tp_code *cur = f->cur;
+    #ifdef TP_COMPUTED_GOTO
+    /* the range initializer sets the default; the opcodes override it */
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Woverride-init"
+    static void *ops[256] = {
+        [0 ... 255] = &&L_invalid,
+        [TP_IEOF] = &&L_TP_IEOF, [TP_IADD] = &&L_TP_IADD, [TP_ISUB] = &&L_TP_ISUB,
+        [TP_IMUL] = &&L_TP_IMUL, [TP_IDIV] = &&L_TP_IDIV, [TP_IPOW] = &&L_TP_IPOW,
+        [TP_IBITAND] = &&L_TP_IBITAND, [TP_IBITOR] = &&L_TP_IBITOR, [TP_ICMP] = &&L_TP_ICMP,
+        [TP_IGET] = &&L_TP_IGET, [TP_ISET] = &&L_TP_ISET, [TP_INUMBER] = &&L_TP_INUMBER,
+        [TP_ISTRING] = &&L_TP_ISTRING, [TP_IGGET] = &&L_TP_IGGET, [TP_IGSET] = &&L_TP_IGSET,
+        [TP_IMOVE] = &&L_TP_IMOVE, [TP_IDEF] = &&L_TP_IDEF, [TP_IPASS] = &&L_TP_IPASS,
+        [TP_IJUMP] = &&L_TP_IJUMP, [TP_ICALL] = &&L_TP_ICALL, [TP_IRETURN] = &&L_TP_IRETURN,
+        [TP_IIF] = &&L_TP_IIF, [TP_IDEBUG] = &&L_TP_IDEBUG, [TP_IEQ] = &&L_TP_IEQ,
+        [TP_ILE] = &&L_TP_ILE, [TP_ILT] = &&L_TP_ILT, [TP_IDICT] = &&L_TP_IDICT,
+        [TP_ILIST] = &&L_TP_ILIST, [TP_INONE] = &&L_TP_INONE, [TP_ILEN] = &&L_TP_ILEN,
+        [TP_ILINE] = &&L_TP_ILINE, [TP_IPARAMS] = &&L_TP_IPARAMS, [TP_IIGET] = &&L_TP_IIGET,
+        [TP_IFILE] = &&L_TP_IFILE, [TP_INAME] = &&L_TP_INAME, [TP_INE] = &&L_TP_INE,
+        [TP_IHAS] = &&L_TP_IHAS, [TP_IRAISE] = &&L_TP_IRAISE, [TP_ISETJMP] = &&L_TP_ISETJMP,
+        [TP_IMOD] = &&L_TP_IMOD, [TP_ILSH] = &&L_TP_ILSH, [TP_IRSH] = &&L_TP_IRSH,
+        [TP_IITER] = &&L_TP_IITER, [TP_IDEL] = &&L_TP_IDEL, [TP_IREGS] = &&L_TP_IREGS,
+        [TP_IBITXOR] = &&L_TP_IBITXOR, [TP_IIFN] = &&L_TP_IIFN, [TP_INOT] = &&L_TP_INOT,
+        [TP_IBITNOT] = &&L_TP_IBITNOT,
+    };
+    #pragma GCC diagnostic pop
+    #endif
     while(1) {
     #ifdef TP_SANDBOX
     tp_bounds(tp,cur,1);
     #endif
-    tp_code e = *cur;
+    tp_code e;
+    #ifdef TP_COMPUTED_GOTO
+    TP_DISPATCH;
+    #else
+    e = *cur;
+    #endif
     /*
      fprintf(stderr,"%2d.%4d: %-6s %3d %3d %3d\n",tp->cur,cur - (tp_code*)f->code.string.val,tp_strings[e.i],VA,VB,VC);
        int i; for(i=0;i<16;i++) { fprintf(stderr,"%d: %s\n",i,TP_xSTR(regs[i])); }
     */
     
     switch (e.i) {
-        case TP_IEOF: tp_return(tp,tp_None); SR(0); break;
-        case TP_IADD: RA = tp_add(tp,RB,RC); break;
-        case TP_ISUB: RA = tp_sub(tp,RB,RC); break;
-        case TP_IMUL: RA = tp_mul(tp,RB,RC); break;
-        case TP_IDIV: RA = tp_div(tp,RB,RC); break;
-        case TP_IPOW: RA = tp_pow(tp,RB,RC); break;
-        case TP_IBITAND: RA = tp_bitwise_and(tp,RB,RC); break;
-        case TP_IBITOR:  RA = tp_bitwise_or(tp,RB,RC); break;
-        case TP_IBITXOR:  RA = tp_bitwise_xor(tp,RB,RC); break;
-        case TP_IMOD:  RA = tp_mod(tp,RB,RC); break;
-        case TP_ILSH:  RA = tp_lsh(tp,RB,RC); break;
-        case TP_IRSH:  RA = tp_rsh(tp,RB,RC); break;
-        case TP_ICMP: RA = tp_number(tp_cmp(tp,RB,RC)); break;
-        case TP_INE: RA = tp_number(tp_cmp(tp,RB,RC)!=0); break;
-        case TP_IEQ: RA = tp_number(tp_cmp(tp,RB,RC)==0); break;
-        case TP_ILE: RA = tp_number(tp_cmp(tp,RB,RC)<=0); break;
-        case TP_ILT: RA = tp_number(tp_cmp(tp,RB,RC)<0); break;
-        case TP_IBITNOT:  RA = tp_bitwise_not(tp,RB); break;
-        case TP_INOT: RA = tp_number(!tp_bool(tp,RB)); break;
-        case TP_IPASS: break;
-        case TP_IIF: if (tp_bool(tp,RA)) { cur += 1; } break;
-        case TP_IIFN: if (!tp_bool(tp,RA)) { cur += 1; } break;
-        case TP_IGET: RA = tp_get(tp,RB,RC); GA; break;
-        case TP_IITER:
+        TP_CASE(TP_IEOF): tp_return(tp,tp_None); SR(0); break;
+        TP_CASE(TP_IADD): RA = tp_add(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_ISUB): RA = tp_sub(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IMUL): RA = tp_mul(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IDIV): RA = tp_div(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IPOW): RA = tp_pow(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IBITAND): RA = tp_bitwise_and(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IBITOR):  RA = tp_bitwise_or(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IBITXOR):  RA = tp_bitwise_xor(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IMOD):  RA = tp_mod(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_ILSH):  RA = tp_lsh(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IRSH):  RA = tp_rsh(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_ICMP): RA = tp_number(tp_cmp(tp,RB,RC)); TP_NEXT;
+        TP_CASE(TP_INE): RA = tp_number(tp_cmp(tp,RB,RC)!=0); TP_NEXT;
+        TP_CASE(TP_IEQ): RA = tp_number(tp_cmp(tp,RB,RC)==0); TP_NEXT;
+        TP_CASE(TP_ILE): RA = tp_number(tp_cmp(tp,RB,RC)<=0); TP_NEXT;
+        TP_CASE(TP_ILT): RA = tp_number(tp_cmp(tp,RB,RC)<0); TP_NEXT;
+        TP_CASE(TP_IBITNOT):  RA = tp_bitwise_not(tp,RB); TP_NEXT;
+        TP_CASE(TP_INOT): RA = tp_number(!tp_bool(tp,RB)); TP_NEXT;
+        TP_CASE(TP_IPASS): TP_NEXT;
+        TP_CASE(TP_IIF): if (tp_bool(tp,RA)) { cur += 1; } TP_NEXT;
+        TP_CASE(TP_IIFN): if (!tp_bool(tp,RA)) { cur += 1; } TP_NEXT;
+        TP_CASE(TP_IGET): RA = TP_GET(cur,RB,RC); GA; TP_NEXT;
+        TP_CASE(TP_IITER):
             if (RC.number.val < tp_len(tp,RB).number.val) {
                 RA = tp_iter(tp,RB,RC); GA;
                 RC.number.val += 1;
@@ -2390,19 +2830,19 @@ int tp_step(TP) {
                 cur += 1;
             }
             break;
-        case TP_IHAS: RA = tp_has(tp,RB,RC); break;
-        case TP_IIGET: tp_iget(tp,&RA,RB,RC); break;
-        case TP_ISET: tp_set(tp,RA,RB,RC); break;
-        case TP_IDEL: tp_del(tp,RA,RB); break;
-        case TP_IMOVE: RA = RB; break;
-        case TP_INUMBER:
+        TP_CASE(TP_IHAS): RA = tp_has(tp,RB,RC); TP_NEXT;
+        TP_CASE(TP_IIGET): tp_iget(tp,&RA,RB,RC); TP_NEXT;
+        TP_CASE(TP_ISET): TP_SET(cur,RA,RB,RC); TP_NEXT;
+        TP_CASE(TP_IDEL): tp_del(tp,RA,RB); TP_NEXT;
+        TP_CASE(TP_IMOVE): RA = RB; TP_NEXT;
+        TP_CASE(TP_INUMBER):
             #ifdef TP_SANDBOX
             tp_bounds(tp,cur,sizeof(tp_num)/4);
             #endif
             RA = tp_number(*(tp_num*)(*++cur).string.val);
             cur += sizeof(tp_num)/4;
             continue;
-        case TP_ISTRING: {
+        TP_CASE(TP_ISTRING): {
             #ifdef TP_SANDBOX
             tp_bounds(tp,cur,(UVBC/4)+1);
             #endif
@@ -2411,26 +2851,22 @@ int tp_step(TP) {
             RA = tp_string_sub(tp,f->code,a,a+UVBC),
             cur += (UVBC/4)+1;
             }
-            break;
-        case TP_IDICT: RA = tp_dict_n(tp,VC/2,&RB); break;
-        case TP_ILIST: RA = tp_list_n(tp,VC,&RB); break;
-        case TP_IPARAMS: RA = tp_params_n(tp,VC,&RB); break;
-        case TP_ILEN: RA = tp_len(tp,RB); break;
-        case TP_IJUMP: cur += SVBC; continue; break;
-        case TP_ISETJMP: f->jmp = SVBC?cur+SVBC:0; break;
-        case TP_ICALL:
+            TP_NEXT;
+        TP_CASE(TP_IDICT): RA = tp_dict_n(tp,VC/2,&RB); break;
+        TP_CASE(TP_ILIST): RA = tp_list_n(tp,VC,&RB); break;
+        TP_CASE(TP_IPARAMS): RA = tp_params_n(tp,VC,&RB); break;
+        TP_CASE(TP_ILEN): RA = tp_len(tp,RB); TP_NEXT;
+        TP_CASE(TP_IJUMP): cur += SVBC; continue; break;
+        TP_CASE(TP_ISETJMP): f->jmp = SVBC?cur+SVBC:0; break;
+        TP_CASE(TP_ICALL):
             #ifdef TP_SANDBOX
             tp_bounds(tp,cur,1);
             #endif
             f->cur = cur + 1;  RA = tp_call(tp,RB,RC); GA;
             return 0; break;
-        case TP_IGGET:
-            if (!tp_iget(tp,&RA,f->globals,RB)) {
-                RA = tp_get(tp,tp->builtins,RB); GA;
-            }
-            break;
-        case TP_IGSET: tp_set(tp,f->globals,RA,RB); break;
-        case TP_IDEF: {
+        TP_CASE(TP_IGGET): RA = TP_GGET(cur,f->globals,RB); GA; TP_NEXT;
+        TP_CASE(TP_IGSET): tp_set(tp,f->globals,RA,RB); break;
+        TP_CASE(TP_IDEF): {
 /*            RA = tp_def(tp,(*(cur+1)).string.val,f->globals);*/
             #ifdef TP_SANDBOX
             tp_bounds(tp,cur,SVBC);
@@ -2444,13 +2880,13 @@ int tp_step(TP) {
             }
             break;
 
-        case TP_IRETURN: tp_return(tp,RA); SR(0); break;
-        case TP_IRAISE: _tp_raise(tp,RA); SR(0); break;
-        case TP_IDEBUG:
+        TP_CASE(TP_IRETURN): tp_return(tp,RA); SR(0); break;
+        TP_CASE(TP_IRAISE): _tp_raise(tp,RA); SR(0); break;
+        TP_CASE(TP_IDEBUG):
             tp_params_v(tp,3,tp_string("DEBUG:"),tp_number(VA),RA); tp_print(tp);
             break;
-        case TP_INONE: RA = tp_None; break;
-        case TP_ILINE:
+        TP_CASE(TP_INONE): RA = tp_None; TP_NEXT;
+        TP_CASE(TP_ILINE):
             #ifdef TP_SANDBOX
             tp_bounds(tp,cur,VA);
             #endif
@@ -2460,11 +2896,14 @@ int tp_step(TP) {
             f->line = tp_string_sub(tp,f->code,a,a+VA*4-1);
 /*             fprintf(stderr,"%7d: %s\n",UVBC,f->line.string.val);*/
             cur += VA; f->lineno = UVBC;
-            break;
-        case TP_IFILE: f->fname = RA; break;
-        case TP_INAME: f->name = RA; break;
-        case TP_IREGS: f->cregs = VA; break;
+            TP_NEXT;
+        TP_CASE(TP_IFILE): f->fname = RA; break;
+        TP_CASE(TP_INAME): f->name = RA; break;
+        TP_CASE(TP_IREGS): f->cregs = VA; break;
         default:
+        #ifdef TP_COMPUTED_GOTO
+        L_invalid:
+        #endif
             tp_raise(0,tp_string("(tp_step) RuntimeError: invalid instruction"));
             break;
     }
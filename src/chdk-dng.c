@@ -70,7 +70,6 @@ static int32_t get_tick_count() { return get_ms_clock(); }
 
 /* adaptations from CHDK to ML */
 #define camera_sensor (*raw_info)
-#define get_raw_pixel raw_get_pixel
 #define raw_rowpix width
 #define raw_rows height
 #define raw_size frame_size
@@ -172,7 +171,7 @@ void dng_set_thumbnail_size(int32_t width, int32_t height)
     dng_th_height = height;
 }
 
-struct dir_entry{uint16_t tag; uint16_t type; uint32_t count; unsigned int offset;};
+struct dir_entry{uint16_t tag; uint16_t type; uint32_t count; uintptr_t offset;};
 
 #define T_BYTE      1
 #define T_ASCII     2
@@ -321,7 +320,6 @@ static int32_t get_type_size(int32_t type)
 static char* dng_header_buf;
 static int32_t dng_header_buf_size;
 static int32_t dng_header_buf_offset;
-static char *thumbnail_buf;
 
 static void add_to_buf(void* var, int32_t size)
 {
@@ -406,9 +404,9 @@ void dng_set_datetime(char *datetime, char *subsectime)
     strncpy(cam_subsectime, subsectime, sizeof(cam_subsectime));
 }
 
-static int32_t is_lossless_jpeg(struct raw_info * raw_info)
+static int32_t is_lossless_jpeg(void* buffer)
 {
-    return *(uint32_t*)(raw_info->buffer) == 0xC4FFD8FF;
+    return *(uint32_t*)(buffer) == 0xC4FFD8FF;
 }
 
 
@@ -419,7 +417,7 @@ static void create_dng_header(struct raw_info * raw_info){
 
     int32_t dng_compression = 1;
 
-    if (is_lossless_jpeg(raw_info))
+    if (is_lossless_jpeg(raw_info->buffer))
     {
         dng_compression = 7; /* JPEG */
     }
@@ -580,15 +578,6 @@ static void create_dng_header(struct raw_info * raw_info){
     dng_header_buf_offset=0;
     if (!dng_header_buf) return;
 
-    // create buffer for thumbnail
-    thumbnail_buf = malloc(dng_th_width*dng_th_height*3);
-    if (!thumbnail_buf)
-    {
-        ufree(dng_header_buf);
-        dng_header_buf = 0;
-        return;
-    }
-
     //  writing offsets for EXIF IFD and RAW data and calculating offset for extra data
 
     extra_offset=TIFF_HDR_SIZE;
@@ -674,22 +663,36 @@ static void free_dng_header(void)
         ufree(dng_header_buf);
         dng_header_buf=NULL;
     }
-    if (thumbnail_buf)
-    {
-        free(thumbnail_buf);
-        thumbnail_buf = 0;
-    }
 }
 
 //-------------------------------------------------------------------
 // Functions for creating DNG thumbnail image
 
-static inline int32_t raw_to_8bit(int32_t raw, int32_t wb, struct raw_info * raw_info)
+/* pixel (x,y) of a frame in the raw_info format, read from the given buffer (not from raw_info->buffer) */
+static int32_t thumbnail_get_pixel(char* buffer, struct raw_info * raw_info, int32_t x, int32_t y)
 {
     if (raw_info->bits_per_pixel == 16) /* big endian */
     {
-        raw = ((raw & 0xFF00) >> 8) | ((raw & 0xFF) << 8);
+        int32_t raw = ((uint16_t*)buffer)[x + y * raw_info->width];
+        return ((raw & 0xFF00) >> 8) | ((raw & 0xFF) << 8);
     }
+
+    struct raw_pixblock * p = (void*)(buffer + y * raw_info->pitch + (x/8)*14);
+    switch (x%8) {
+        case 0: return p->a;
+        case 1: return p->b_lo | (p->b_hi << 12);
+        case 2: return p->c_lo | (p->c_hi << 10);
+        case 3: return p->d_lo | (p->d_hi << 8);
+        case 4: return p->e_lo | (p->e_hi << 6);
+        case 5: return p->f_lo | (p->f_hi << 4);
+        case 6: return p->g_lo | (p->g_hi << 2);
+        case 7: return p->h;
+    }
+    return p->a;
+}
+
+static inline int32_t raw_to_8bit(int32_t raw, int32_t wb, struct raw_info * raw_info)
+{
     int32_t black = raw_info->black_level;
     int32_t white = raw_info->white_level;
     float ev = log2f(MAX(1, raw - black)) + wb - 5;
@@ -698,14 +701,14 @@ static inline int32_t raw_to_8bit(int32_t raw, int32_t wb, struct raw_info * raw
     return COERCE(out, 0, 255);
 }
 
-static void create_thumbnail(struct raw_info * raw_info)
+static void create_thumbnail(char* thumbnail, int32_t th_width, int32_t th_height, char* buffer, struct raw_info * raw_info)
 {
     register int32_t i, j, x, y, yadj, xadj;
-    register char *buf = thumbnail_buf;
+    register char *buf = thumbnail;
     
-    if (is_lossless_jpeg(raw_info))
+    if (is_lossless_jpeg(buffer))
     {
-        memset(thumbnail_buf, 0, dng_th_width*dng_th_height*3);
+        memset(thumbnail, 0, th_width*th_height*3);
         return;
     }
 
@@ -719,42 +722,87 @@ static void create_thumbnail(struct raw_info * raw_info)
     yadj = (camera_sensor.cfa_pattern == 0x01000201) ? 1 : 0;
     xadj = (camera_sensor.cfa_pattern == 0x01020001) ? 1 : 0;
     
-    for (i=0; i<dng_th_height; i++)
-        for (j=0; j<dng_th_width; j++)
+    for (i=0; i<th_height; i++)
+        for (j=0; j<th_width; j++)
         {
-            x = camera_sensor.active_area.x1 + ((camera_sensor.jpeg.x + (camera_sensor.jpeg.width  * j) / dng_th_width)  & 0xFFFFFFFE) + xadj;
-            y = camera_sensor.active_area.y1 + ((camera_sensor.jpeg.y + (camera_sensor.jpeg.height * i) / dng_th_height) & 0xFFFFFFFE) + yadj;
+            x = camera_sensor.active_area.x1 + ((camera_sensor.jpeg.x + (camera_sensor.jpeg.width  * j) / th_width)  & 0xFFFFFFFE) + xadj;
+            y = camera_sensor.active_area.y1 + ((camera_sensor.jpeg.y + (camera_sensor.jpeg.height * i) / th_height) & 0xFFFFFFFE) + yadj;
 
-            *buf++ = raw_to_8bit(get_raw_pixel(x,y), 0, raw_info);        // red pixel
-            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y), -1, raw_info);      // green pixel
-            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y+1), 0, raw_info);    // blue pixel
+            *buf++ = raw_to_8bit(thumbnail_get_pixel(buffer, raw_info, x, y), 0, raw_info);        // red pixel
+            *buf++ = raw_to_8bit(thumbnail_get_pixel(buffer, raw_info, x+1, y), -1, raw_info);     // green pixel
+            *buf++ = raw_to_8bit(thumbnail_get_pixel(buffer, raw_info, x+1, y+1), 0, raw_info);    // blue pixel
         }
 }
 
 //-------------------------------------------------------------------
 // Write DNG header, thumbnail and data to file
 
-static int32_t write_dng(FILE* fd, struct raw_info * raw_info) 
+/**
+ * Writes one frame, with a header from create_dng_header() or dng_get_header(): header, thumbnail and image data.
+ * The thumbnail is computed from 'buffer', which is in the raw_info format; the globals from this file are not used,
+ * so the desktop tools can write the frames of a clip from several threads.
+ * Uncompressed image data is byte-swapped in place, so the buffer is no longer usable afterwards.
+ * Returns 1 on success, 0 on error.
+ */
+int dng_write_frame(char* filename, void* buffer, struct raw_info * raw_info, char* header, int32_t header_size, int32_t thumbnail_width, int32_t thumbnail_height)
 {
-    create_dng_header(raw_info);
-    char* rawadr = (void*)raw_info->buffer;
+    int32_t thumbnail_size = thumbnail_width * thumbnail_height * 3;
+    char* thumbnail = malloc(thumbnail_size);
+    if (!thumbnail) return 0;
+    create_thumbnail(thumbnail, thumbnail_width, thumbnail_height, buffer, raw_info);
 
-    if (dng_header_buf)
+    int32_t ok = 0;
+    FILE* f = FIO_CreateFile(filename);
+    if (f)
     {
-        create_thumbnail(raw_info);
-        if (write(fd, dng_header_buf, dng_header_buf_size) != dng_header_buf_size) return 0;
-        if (write(fd, thumbnail_buf, dng_th_width*dng_th_height*3) != dng_th_width*dng_th_height*3) return 0;
+        if (!is_lossless_jpeg(buffer))
+        {
+            reverse_bytes_order(UNCACHEABLE(buffer), camera_sensor.raw_size);
+        }
 
-        if (!is_lossless_jpeg(raw_info))
+        ok = write(f, header, header_size) == header_size &&
+             write(f, thumbnail, thumbnail_size) == thumbnail_size &&
+             write(f, UNCACHEABLE(buffer), camera_sensor.raw_size) == camera_sensor.raw_size;
+
+#ifdef CONFIG_MAGICLANTERN
+        FIO_CloseFile(f);
+#else
+        ok = (fclose(f) == 0) && ok;    /* buffered data is written here */
+#endif
+        if (!ok)
         {
-            reverse_bytes_order(UNCACHEABLE(rawadr), camera_sensor.raw_size);
+            FIO_RemoveFile(filename);
         }
-        if (write(fd, UNCACHEABLE(rawadr), camera_sensor.raw_size) != camera_sensor.raw_size) return 0;
+    }
 
-        free_dng_header();
+    free(thumbnail);
+    return ok;
+}
+
+#ifndef CONFIG_MAGICLANTERN
+/**
+ * Desktop tools: the DNG header as save_dng() would write it (without thumbnail and image data).
+ * It only depends on the image format and the dng_set_* values, so it can be built once per clip
+ * and the frames can be written with dng_write_frame() from several threads. Returns a malloc'ed copy, or NULL.
+ */
+char* dng_get_header(struct raw_info * raw_info, int32_t * header_size, int32_t * thumbnail_width, int32_t * thumbnail_height)
+{
+    create_dng_header(raw_info);
+    if (!dng_header_buf) return NULL;
+
+    char* header = malloc(dng_header_buf_size);
+    if (header)
+    {
+        memcpy(header, dng_header_buf, dng_header_buf_size);
+        *header_size = dng_header_buf_size;
+        *thumbnail_width = dng_th_width;
+        *thumbnail_height = dng_th_height;
     }
-    return 1;
+
+    free_dng_header();
+    return header;
 }
+#endif
 
 #ifdef CONFIG_MAGICLANTERN
 PROP_HANDLER(PROP_CAM_MODEL)
@@ -777,14 +825,11 @@ int save_dng(char* filename, struct raw_info * raw_info)
     raw_info->jpeg.height = raw_info->height;
     #endif
     
-    FILE* f = FIO_CreateFile(filename);
-    if (!f) return 0;
-    int32_t ok = write_dng(f, raw_info);
-    FIO_CloseFile(f);
-    if (!ok)
-    {
-        FIO_RemoveFile(filename);
-        return 0;
-    }
-    return 1;
+    create_dng_header(raw_info);
+    if (!dng_header_buf) return 0;
+
+    int32_t ok = dng_write_frame(filename, raw_info->buffer, raw_info, dng_header_buf, dng_header_buf_size, dng_th_width, dng_th_height);
+
+    free_dng_header();
+    return ok;
 }
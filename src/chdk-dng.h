@@ -16,4 +16,14 @@ void dng_set_iso(int32_t value);
 void dng_set_wbgain(int32_t gain_r_n, int32_t gain_r_d, int32_t gain_g_n, int32_t gain_g_d, int32_t gain_b_n, int32_t gain_b_d);
 void dng_set_datetime(char *datetime, char *subsectime);
 
+struct raw_info;
+
+/* one frame with the given header (reentrant), see chdk-dng.c */
+int dng_write_frame(char* filename, void* buffer, struct raw_info * raw_info, char* header, int32_t header_size, int32_t thumbnail_width, int32_t thumbnail_height);
+
+#ifndef CONFIG_MAGICLANTERN
+/* desktop tools: header for writing DNG frames with dng_write_frame(), see chdk-dng.c */
+char* dng_get_header(struct raw_info * raw_info, int32_t * header_size, int32_t * thumbnail_width, int32_t * thumbnail_height);
+#endif
+
 #endif // __CHDK_DNG_H_
@@ -6,6 +6,7 @@
 #include "zebra.h"
 #include "imgconv.h"
 #include "greenscreen.h"
+#include "overlay.h"
 
 CONFIG_INT( "falsecolor.draw", falsecolor_draw, 0);
 CONFIG_INT( "falsecolor.palette", falsecolor_palette, 0);
@@ -34,8 +35,6 @@ int falsecolor_fordraw(int i)
   return falsecolor_draw ? false_colour[falsecolor_palette][i] : COLOR_WHITE;
 }
 
-extern uint8_t* get_bvram_mirror();
-
 #ifdef FEATURE_FALSE_COLOR
 void draw_false_downsampled( void )
 {
@@ -52,51 +51,28 @@ void draw_false_downsampled( void )
         return;
     }
 
-    //~ bvram_mirror_init();
-    uint8_t * const bvram = bmp_vram_real();
-    if (!bvram) return;
-    uint8_t * const bvram_mirror = get_bvram_mirror();
-    if (!bvram_mirror) return;
-
-    uint8_t * const lvram = get_yuv422_vram()->vram;
-    uint8_t* fc = false_colour[falsecolor_palette];
-
-    int off = get_y_skip_offset_for_overlays();
-    for(int y = os.y0 + off; y < os.y_max - off; y += 2 )
+    /* palette, as BMP words, for the overlay renderer */
+    static uint32_t lut[256];
+    static int lut_palette = -1;
+    if (lut_palette != falsecolor_palette)
     {
-        uint32_t * const v_row = (uint32_t*)( lvram        + BM2LV_R(y)    );  // 2 pixels
-        uint16_t * const b_row = (uint16_t*)( bvram        + BM_R(y)       );  // 2 pixels
-        uint16_t * const m_row = (uint16_t*)( bvram_mirror + BM_R(y)       );  // 2 pixels
-        
-        uint8_t* lvp; // that's a moving pointer through lv vram
-        uint16_t* bp;  // through bmp vram
-        uint16_t* mp;  // through mirror
-        
-        for (int x = os.x0; x < os.x_max; x += 2)
+        for (int i = 0; i < 256; i++)
         {
-            lvp = (uint8_t *)(v_row + BM2LV_X(x)/2); lvp++;
-            bp = b_row + x/2;
-            mp = m_row + x/2;
-            
-            #define BP (*bp)
-            #define MP (*mp)
-            #define BN (*(bp + BMPPITCH/2))
-            #define MN (*(mp + BMPPITCH/2))
-            
-            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
-            if (BN != 0 && BN != MN) { little_cleanup(bp + BMPPITCH/2, mp + BMPPITCH/2); continue; }
-            if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
-            
-            int c = fc[*lvp]; c |= (c << 8);
-            MP = BP = c;
-            MN = BN = c;
-
-            #undef BP
-            #undef MP
-            #undef BN
-            #undef MN
+            lut[i] = false_colour[falsecolor_palette][i] * 0x01010101;
         }
+        lut_palette = falsecolor_palette;
     }
+
+    /* one sample every 2 BMP pixels (overlay.c) */
+    static struct overlay_job job;
+    if (!zebra_overlay_setup(&job, 2)) return;
+
+    for (int i = 0; i < 4; i++)
+    {
+        job.lut[i] = lut;
+    }
+
+    overlay_draw(&job);
 }
 
 char* falsecolor_palette_name()
@@ -7,7 +7,9 @@
 #include "lens.h"
 #include "math.h"
 #include "raw.h"
+#include "raw_grid.h"
 #include "menu.h"
+#include "state-object.h"
 
 #include "imgconv.h"
 
@@ -64,19 +66,23 @@ void FAST hist_build_raw()
         qprintf("[HIST] RAW %d => %d (white=%d)\n", i, r2ev[i], raw_info.white_level);
     }
 
-    for (int i = os.y0; i < os.y_max; i += step)
+    struct raw_grid * grid = raw_hist_grid_take();
+    if (!grid) return;
+
+    for (int i = 0; i < grid->rows; i += step / RAW_GRID_DY)
     {
-        int y = BM2RAW_Y(i);
+        int y = grid->raw_y[i];
         if (y < raw_info.active_area.y1+8 || y > raw_info.active_area.y2-8) continue;
 
-        for (int j = os.x0; j < os.x_max; j += 8)
+        const struct raw_grid_cell * row = raw_grid_row(grid, i);
+        for (int j = 0; j < grid->cols; j++)
         {
-            int x = BM2RAW_X(j);
+            int x = grid->raw_x[j];
             if (x < raw_info.active_area.x1+8 || x > raw_info.active_area.x2-8) continue;
 
-            int r = raw_red_pixel_dark(x, y);
-            int g = raw_green_pixel_dark(x, y);
-            int b = raw_blue_pixel_dark(x, y);
+            int r = raw_cell_red_dark(&row[j]);
+            int g = raw_cell_green_dark(&row[j]);
+            int b = raw_cell_blue_dark(&row[j]);
 
             /* ignore bad pixels */
             if (r == 0 || g == 0 || b == 0) continue;
@@ -91,6 +97,8 @@ void FAST hist_build_raw()
             histogram.total_px++;
         }
     }
+
+    raw_hist_grid_give();
     
     /* in dark areas, spread the histogram count to show solid histogram instead of isolated bars */
     for (int i = 0; i < 5000; i++)
@@ -423,12 +431,90 @@ MENU_UPDATE_FUNC(hist_warn_display)
 
 #ifdef FEATURE_RAW_HISTOGRAM
 
+static struct raw_grid raw_grid;
+static int raw_grid_max_cells = 0;
+static int raw_grid_frame = -1;
+static void * raw_grid_buffer = 0;
+static struct semaphore * raw_grid_sem = 0;
+
+/* raw pixels at BMP positions, shared by the raw overlays (see raw_grid.h).
+ * In LiveView, they are unpacked once per frame; otherwise, on every call.
+ * call raw_update_params first; release the grid with raw_hist_grid_give */
+struct raw_grid * raw_hist_grid_take()
+{
+    /* on the same rows as raw zebras; the others use the nearest ones */
+    const int x0 = os.x0;
+    const int y0 = os.y0 + (get_y_skip_offset_for_overlays() & 1);
+    const int cols = MIN((os.x_max - x0 + RAW_GRID_DX - 1) / RAW_GRID_DX, RAW_GRID_MAX_COLS);
+    const int rows = MIN((os.y_max - y0 + RAW_GRID_DY - 1) / RAW_GRID_DY, RAW_GRID_MAX_ROWS);
+    if (cols <= 0 || rows <= 0) return 0;
+
+    take_semaphore(raw_grid_sem, 0);
+
+    if (cols * rows > raw_grid_max_cells)
+    {
+        free(raw_grid.cells);
+        raw_grid.cells = malloc(cols * rows * sizeof(raw_grid.cells[0]));
+        raw_grid_max_cells = raw_grid.cells ? cols * rows : 0;
+        raw_grid_frame = -1;
+
+        if (!raw_grid.cells)
+        {
+            give_semaphore(raw_grid_sem);
+            return 0;
+        }
+    }
+
+    int changed = (x0 != raw_grid.x0 || y0 != raw_grid.y0 || cols != raw_grid.cols || rows != raw_grid.rows);
+    raw_grid.x0 = x0;
+    raw_grid.y0 = y0;
+    raw_grid.cols = cols;
+    raw_grid.rows = rows;
+
+    for (int c = 0; c < cols; c++)
+    {
+        int x = BM2RAW_X(x0 + c * RAW_GRID_DX);
+        changed |= (x != raw_grid.raw_x[c]);
+        raw_grid.raw_x[c] = x;
+    }
+
+    for (int r = 0; r < rows; r++)
+    {
+        int y = BM2RAW_Y(y0 + r * RAW_GRID_DY);
+        changed |= (y != raw_grid.raw_y[r]);
+        raw_grid.raw_y[r] = y;
+    }
+
+    int frame = get_lv_frame_number();
+    if (changed || !lv || frame != raw_grid_frame || raw_info.buffer != raw_grid_buffer)
+    {
+        raw_grid_build(&raw_grid, raw_info.buffer, raw_info.width, raw_info.height);
+        raw_grid_frame = frame;
+        raw_grid_buffer = raw_info.buffer;
+    }
+
+    return &raw_grid;
+}
+
+void raw_hist_grid_give()
+{
+    give_semaphore(raw_grid_sem);
+}
+
+/* grid rows from BMP rows */
+static int raw_grid_row_index(struct raw_grid * grid, int y)
+{
+    return COERCE((y - grid->y0 + RAW_GRID_DY / 2) / RAW_GRID_DY, 0, grid->rows);
+}
+
 /* speed:
  * 0 = slowest, but 100% accurate (only for GRAY_PROJECTION_GREEN for now)
  * 1 = sample at LiveView resolution (720x480)
  * 2 = LiveView resolution downsampled by 2 on each axis
  * 3 = LiveView resolution downsampled by 3 on each axis
  * and so on, until 16
+ * speeds 1-16 read the raw grid (every 8th pixel of every 2nd BMP row),
+ * so speeds below 4 read every cell; columns are only skipped from 16
  */
 
 int FAST raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed)
@@ -499,16 +585,19 @@ int FAST raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_va
     else
     {
         speed = COERCE(speed, 1, 16);
-        for (int i = os.y0 + off; i < os.y_max - off; i += speed)
-        {
-            int y = BM2RAW_Y(i);
-            for (int j = os.x0; j < os.x_max; j += speed)
-            {
-                int x = BM2RAW_X(j);
-                int px = raw_get_gray_pixel(x, y, gray_projection);
-                hist[px & 16383]++;
-            }
-        }
+
+        /* the grid has every 8th pixel of every 2nd row; skip some more if speed is higher */
+        struct raw_grid * grid = raw_hist_grid_take();
+        if (!grid) { free(hist); goto err; }
+
+        raw_grid_histogram(grid, hist, gray_projection,
+            raw_grid_row_index(grid, os.y0 + off),
+            raw_grid_row_index(grid, os.y_max - off),
+            MAX(speed / RAW_GRID_DY, 1),
+            MAX(speed / RAW_GRID_DX, 1)
+        );
+
+        raw_hist_grid_give();
     }
 
     int total = 0;
@@ -566,18 +655,22 @@ int raw_hist_get_overexposure_percentage(int gray_projection)
 
     int step = lv ? 4 : 2;
 
-    for (int i = os.y0; i < os.y_max; i += step)
+    struct raw_grid * grid = raw_hist_grid_take();
+    if (!grid) return -1;
+
+    for (int i = 0; i < grid->rows; i += step / RAW_GRID_DY)
     {
-        int y = BM2RAW_Y(i);
-        for (int j = os.x0; j < os.x_max; j += step)
+        const struct raw_grid_cell * row = raw_grid_row(grid, i);
+        for (int j = 0; j < grid->cols; j++)
         {
-            int x = BM2RAW_X(j);
-            int px = raw_get_gray_pixel(x, y, gray_projection);
+            int px = raw_cell_gray(&row[j], gray_projection);
             if (px >= white) over++;
             total++;
         }
     }
 
+    raw_hist_grid_give();
+
     /* percentage x100 */
     return over * 10000 / total;
 }
@@ -791,6 +884,7 @@ static struct lvinfo_item info_items[] = {
 
 static void hist_init()
 {
+    raw_grid_sem = create_named_semaphore("raw_grid_sem", 1);
     lvinfo_add_items(info_items, COUNT(info_items));
 }
 
@@ -48,6 +48,11 @@ int raw_hist_get_percentile_level(int percentile, int gray_projection, int speed
 int raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed);
 int raw_hist_get_overexposure_percentage(int gray_projection);
 
+/* raw pixels at BMP positions, shared by the raw overlays; see raw_grid.h */
+struct raw_grid;
+struct raw_grid * raw_hist_grid_take();
+void raw_hist_grid_give();
+
 extern struct menu_entry hist_menu_entry;
 
 extern int hist_type;
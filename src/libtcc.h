@@ -26,6 +26,11 @@ LIBTCCAPI void tcc_set_lib_path(TCCState *s, const char *path);
 LIBTCCAPI void tcc_set_error_func(TCCState *s, void *error_opaque,
     void (*error_func)(void *opaque, const char *msg));
 
+/* set a callback that sees every relocation done by tcc_relocate():
+   ELF relocation type, address of the patched word and symbol value */
+LIBTCCAPI void tcc_set_reloc_func(TCCState *s, void *reloc_opaque,
+    void (*reloc_func)(void *opaque, int type, unsigned long addr, unsigned long val));
+
 /* set options as from command line (multiple supported) */
 LIBTCCAPI int tcc_set_options(TCCState *s, const char *str);
 
@@ -4,6 +4,7 @@
 #include "console.h"
 #include "libtcc.h"
 #include "module.h"
+#include "module_cache.h"
 #include "config.h"
 #include "string.h"
 #include "property.h"
@@ -38,6 +39,7 @@ static struct menu_entry module_menu[];
 CONFIG_INT("module.autoload", module_autoload_disabled, 0);
 CONFIG_INT("module.console", module_console_enabled, 0);
 CONFIG_INT("module.ignore_crashes", module_ignore_crashes, 0);
+CONFIG_INT("module.cache", module_cache_enabled, 1);
 char *module_lockfile = MODULE_PATH"LOADING.LCK";
 
 static struct msg_queue * module_mq = 0;
@@ -146,7 +148,7 @@ static int module_valid_filename(char* filename)
     return 0;
 }
 
-/* must be called before unloading TCC */
+/* must be called before unloading TCC (or the module cache) */
 static void module_update_core_symbols(TCCState* state)
 {
     printf("Updating symbols...\n");
@@ -158,7 +160,7 @@ static void module_update_core_symbols(TCCState* state)
     for( ; module_symbol_entry < _module_symbols_end ; module_symbol_entry++ )
     {
         void* old_address = *(module_symbol_entry->address);
-        void* new_address = (void*) tcc_get_symbol(state, (char*) module_symbol_entry->name);
+        void* new_address = module_link_symbol(state, module_symbol_entry->name);
         if (new_address)
         {
             if (new_address != module_symbol_entry->address)
@@ -500,22 +502,12 @@ static void _module_load_all(uint32_t list_only)
         return;
     }
 
-    /* initialize linker */
-    state = tcc_new();
-    tcc_set_options(state, "-nostdlib");
-    if(module_load_symbols(state, MAGIC_SYMBOLS) < 0)
-    {
-        NotifyBox(2000, "Missing symbol file: " MAGIC_SYMBOLS );
-        tcc_delete(state); console_show();
-        return;
-    }
-
     printf("Scanning modules...\n");
     struct fio_dirent * dirent = FIO_FindFirstEx( MODULE_PATH, &file );
     if( IS_ERROR(dirent) )
     {
         NotifyBox(2000, "Module dir missing" );
-        tcc_delete(state); console_show();
+        console_show();
         return;
     }
 
@@ -615,87 +607,117 @@ static void _module_load_all(uint32_t list_only)
     /* dont load anything, just return */
     if(list_only)
     {
-        tcc_delete(state);
         return;
     }
-    
-    /* load modules */
-    printf("Load modules...\n");
-    for (uint32_t mod = 0; mod < module_cnt; mod++)
+
+#ifdef CONFIG_TCC_UNLOAD
+    /* same symbols and modules as last time? skip linking */
+    if (module_cache_enabled)
+    {
+        printf("Load cached modules...\n");
+        module_code = module_cache_load(MAGIC_SYMBOLS, module_list, module_cnt);
+    }
+
+    if (!module_code)
+#endif
     {
-        if(module_list[mod].enabled)
+        /* initialize linker */
+        state = tcc_new();
+        tcc_set_options(state, "-nostdlib");
+        if(module_load_symbols(state, MAGIC_SYMBOLS) < 0)
         {
-            printf("  [i] load: %s\n", module_list[mod].filename);
+            NotifyBox(2000, "Missing symbol file: " MAGIC_SYMBOLS );
+            tcc_delete(state); console_show();
+            return;
+        }
 
-            int32_t ret = tcc_add_file(state, module_list[mod].long_filename);
+        /* load modules */
+        int load_errors = 0;
+        printf("Load modules...\n");
+        for (uint32_t mod = 0; mod < module_cnt; mod++)
+        {
+            if(module_list[mod].enabled)
+            {
+                printf("  [i] load: %s\n", module_list[mod].filename);
+
+                int32_t ret = tcc_add_file(state, module_list[mod].long_filename);
 
-            // SJE FIXME trying to determine module base address
-            // so I can use addr2line.  The listed address seems wrong,
-            // don't know why.  Instead I am dumping some function address
-            // from whatever module I'm testing, which is annoyingly module
-            // specific
+                // SJE FIXME trying to determine module base address
+                // so I can use addr2line.  The listed address seems wrong,
+                // don't know why.  Instead I am dumping some function address
+                // from whatever module I'm testing, which is annoyingly module
+                // specific
 #if 0
-            int size = 0;
-            void *data_addr = NULL;
-            data_addr = tcc_get_section_ptr(state, ".text", &size);
-            DryosDebugMsg(0, 15, "loading module: %s", module_list[mod].filename);
-            DryosDebugMsg(0, 15, "module priv: 0x%x", module_list[mod].cbr);
-            DryosDebugMsg(0, 15, "module .text: 0x%x", data_addr);
-            DryosDebugMsg(0, 15, "module text_addr: 0x%x", state->text_addr);
-//            DryosDebugMsg(0, 15, "sections: %d", state->nb_sections);
-//            for (int ii = 1; ii < state->nb_sections; ii++)
-//            {
-//                Section *s = state->sections[ii];
-//                DryosDebugMsg(0, 15, "section: %s", s->name);
-//                DryosDebugMsg(0, 15, "section sh_addr: 0x%x", s->sh_addr);
-//                DryosDebugMsg(0, 15, "section data_offset: 0x%x", s->data_offset);
-//                DryosDebugMsg(0, 15, "section data: 0x%x", s->data);
-//            }
+                int size = 0;
+                void *data_addr = NULL;
+                data_addr = tcc_get_section_ptr(state, ".text", &size);
+                DryosDebugMsg(0, 15, "loading module: %s", module_list[mod].filename);
+                DryosDebugMsg(0, 15, "module priv: 0x%x", module_list[mod].cbr);
+                DryosDebugMsg(0, 15, "module .text: 0x%x", data_addr);
+                DryosDebugMsg(0, 15, "module text_addr: 0x%x", state->text_addr);
+    //            DryosDebugMsg(0, 15, "sections: %d", state->nb_sections);
+    //            for (int ii = 1; ii < state->nb_sections; ii++)
+    //            {
+    //                Section *s = state->sections[ii];
+    //                DryosDebugMsg(0, 15, "section: %s", s->name);
+    //                DryosDebugMsg(0, 15, "section sh_addr: 0x%x", s->sh_addr);
+    //                DryosDebugMsg(0, 15, "section data_offset: 0x%x", s->data_offset);
+    //                DryosDebugMsg(0, 15, "section data: 0x%x", s->data);
+    //            }
 #endif
 
-            module_list[mod].valid = 1;
+                module_list[mod].valid = 1;
 
-            /* seems bad, disable it */
-            if(ret < 0)
-            {
-                module_list[mod].error = 1;
-                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "FileErr");
-                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Load failed: %s, ret 0x%02X");
-                printf("  [E] %s\n", module_list[mod].long_status);
+                /* seems bad, disable it */
+                if(ret < 0)
+                {
+                    load_errors++;
+                    module_list[mod].error = 1;
+                    snprintf(module_list[mod].status, sizeof(module_list[mod].status), "FileErr");
+                    snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Load failed: %s, ret 0x%02X");
+                    printf("  [E] %s\n", module_list[mod].long_status);
+                }
             }
         }
-    }
 
-    printf("Linking..\n");
+        printf("Linking..\n");
 #ifdef CONFIG_TCC_UNLOAD
-    int32_t size = tcc_relocate(state, NULL);
-    int32_t reloc_status = -1;
+        int32_t size = tcc_relocate(state, NULL);
+        int32_t reloc_status = -1;
     
-    if (size > 0)
-    {
-        void* buf = (void*) malloc(size);
+        if (size > 0)
+        {
+            void* buf = (void*) malloc(size);
         
-        reloc_status = tcc_relocate(state, buf);
-        module_code = buf;
-    }
-    if(size < 0 || reloc_status < 0)
+            if (buf && module_cache_enabled && !load_errors)
+            {
+                /* the cache stores the image up to the last nonzero word */
+                memset(buf, 0, size);
+                module_cache_record(state, buf, size);
+            }
+            reloc_status = tcc_relocate(state, buf);
+            module_code = buf;
+        }
+        if(size < 0 || reloc_status < 0)
 #else
-    int32_t ret = tcc_relocate(state, TCC_RELOCATE_AUTO);
-    if(ret < 0)
+        int32_t ret = tcc_relocate(state, TCC_RELOCATE_AUTO);
+        if(ret < 0)
 #endif
-    {
-        printf("  [E] failed to link modules\n");
-        for (uint32_t mod = 0; mod < module_cnt; mod++)
         {
-            if(module_list[mod].enabled)
+            printf("  [E] failed to link modules\n");
+            for (uint32_t mod = 0; mod < module_cnt; mod++)
             {
-                module_list[mod].error = 1;
-                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "Err");
-                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Linking failed");
+                if(module_list[mod].enabled)
+                {
+                    module_list[mod].error = 1;
+                    snprintf(module_list[mod].status, sizeof(module_list[mod].status), "Err");
+                    snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Linking failed");
+                }
             }
+            module_cache_done();
+            tcc_delete(state); console_show();
+            return;
         }
-        tcc_delete(state); console_show();
-        return;
     }
     
     /* load modules symbols */
@@ -708,15 +730,15 @@ static void _module_load_all(uint32_t list_only)
 
             /* now check for info structure */
             snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_INFO_PREFIX), module_list[mod].name);
-            module_list[mod].info = tcc_get_symbol(state, module_info_name);
+            module_list[mod].info = module_link_symbol(state, module_info_name);
             snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_STRINGS_PREFIX), module_list[mod].name);
-            module_list[mod].strings = tcc_get_symbol(state, module_info_name);
+            module_list[mod].strings = module_link_symbol(state, module_info_name);
             snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_PROPHANDLERS_PREFIX), module_list[mod].name);
-            module_list[mod].prop_handlers = tcc_get_symbol(state, module_info_name);
+            module_list[mod].prop_handlers = module_link_symbol(state, module_info_name);
             snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CBR_PREFIX), module_list[mod].name);
-            module_list[mod].cbr = tcc_get_symbol(state, module_info_name);
+            module_list[mod].cbr = module_link_symbol(state, module_info_name);
             snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CONFIG_PREFIX), module_list[mod].name);
-            module_list[mod].config = tcc_get_symbol(state, module_info_name);
+            module_list[mod].config = module_link_symbol(state, module_info_name);
 
             /* check if the module symbol is defined. simple check for valid memory address just in case. */
             if((uint32_t)module_list[mod].info > 0x1000)
@@ -757,6 +779,14 @@ static void _module_load_all(uint32_t list_only)
         }
     }
     
+#ifdef CONFIG_TCC_UNLOAD
+    /* the image is still as linked, no module code ran yet */
+    if (state)
+    {
+        module_cache_save(state);
+    }
+#endif
+
     printf("Load configs...\n");
     for (uint32_t mod = 0; mod < module_cnt; mod++)
     {
@@ -857,9 +887,10 @@ static void _module_load_all(uint32_t list_only)
     }
 
     module_update_core_symbols(state);
+    module_cache_done();
     
     #ifdef CONFIG_TCC_UNLOAD
-    tcc_delete(state);
+    if (state) tcc_delete(state);
     #else
     module_state = state;
     #endif
@@ -2017,6 +2048,12 @@ static struct menu_entry module_debug_menu[] = {
                 .max = 1,
                 .help = "Load modules even after camera crashed and you took battery out.",
             },
+            {
+                .name = "Cache linked modules",
+                .priv = &module_cache_enabled,
+                .max = 1,
+                .help = "Reuse the linked modules from last boot if nothing changed.",
+            },
             MENU_EOL,
         },
     },
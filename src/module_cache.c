@@ -0,0 +1,570 @@
+/*
+ * Cache of the linked module image, see module_cache.h
+ *
+ * While TCC relocates the modules, every relocation goes through a callback.
+ * Most of them need nothing when the image moves: calls and pointers into
+ * the core are absolute, and branches inside the image are PC-relative.
+ * What does depend on the load address is recorded as a fixup:
+ *
+ * - absolute pointers into the image (function tables, strings, ...)
+ * - PC-relative references out of the image (REL32, B/BL to the core)
+ *
+ * Anything that can't be rebased this way (e.g. MOVW/MOVT pairs or Thumb
+ * branches to the core) makes the image uncacheable; TCC links it at every
+ * boot, just like before.
+ */
+
+#include "dryos.h"
+#include "libtcc.h"
+#include "module.h"
+#include "module_cache.h"
+#include "string.h"
+
+/* ARM relocation types, see tcc/elf.h */
+#define R_ARM_NONE              0
+#define R_ARM_PC24              1
+#define R_ARM_ABS32             2
+#define R_ARM_REL32             3
+#define R_ARM_THM_CALL          10
+#define R_ARM_COPY              20
+#define R_ARM_PLT32             27
+#define R_ARM_CALL              28
+#define R_ARM_JUMP24            29
+#define R_ARM_THM_JUMP24        30
+#define R_ARM_V4BX              40
+#define R_ARM_MOVW_ABS_NC       43
+#define R_ARM_MOVT_ABS          44
+#define R_ARM_THM_MOVW_ABS_NC   47
+#define R_ARM_THM_MOVT_ABS      48
+
+/* what the cache is keyed on, found by module_cache_load */
+static struct module_cache_header key;
+static struct module_cache_module key_modules[MODULE_COUNT_MAX];
+static int key_valid = 0;
+
+/* fixups recorded while linking */
+static uint32_t image_lo = 0;
+static uint32_t image_hi = 0;
+static uint32_t * fixups = NULL;
+static int fixup_count = 0;
+static int fixup_alloc = 0;
+static int recording = 0;
+static int uncacheable = 0;
+
+/* symbols looked up while linking, or loaded from the cache */
+static struct module_cache_symbol * symbols = NULL;
+static int symbol_count = 0;
+static int symbol_alloc = 0;
+static char * names = NULL;
+static uint32_t names_size = 0;
+static int names_alloc = 0;
+static int from_cache = 0;
+
+static void * grow(void * buf, int * alloc, int needed, int item_size)
+{
+    if (needed <= *alloc)
+    {
+        return buf;
+    }
+
+    int new_alloc = MAX(*alloc * 2, MAX(needed, 256));
+    void * new_buf = realloc(buf, new_alloc * item_size);
+    if (!new_buf)
+    {
+        return NULL;
+    }
+    *alloc = new_alloc;
+    return new_buf;
+}
+
+static void add_fixup(uint32_t addr, int kind)
+{
+    if (addr & 3)
+    {
+        printf("  [i] cache: unaligned fixup at %x\n", addr);
+        uncacheable = 1;
+        return;
+    }
+
+    uint32_t * new_fixups = grow(fixups, &fixup_alloc, fixup_count + 1, sizeof(fixups[0]));
+    if (!new_fixups)
+    {
+        uncacheable = 1;
+        return;
+    }
+    fixups = new_fixups;
+    fixups[fixup_count++] = (addr - image_lo) | kind;
+}
+
+static void add_symbol(const char * name, uint32_t address)
+{
+    int len = strlen(name) + 1;
+
+    char * new_names = grow(names, &names_alloc, ALIGN32SUP(names_size + len), 1);
+    if (!new_names)
+    {
+        uncacheable = 1;
+        return;
+    }
+    names = new_names;
+
+    struct module_cache_symbol * new_symbols = grow(symbols, &symbol_alloc, symbol_count + 1, sizeof(symbols[0]));
+    if (!new_symbols)
+    {
+        uncacheable = 1;
+        return;
+    }
+    symbols = new_symbols;
+
+    memcpy(names + names_size, name, len);
+    symbols[symbol_count].name = names_size;
+    symbols[symbol_count].address = address;
+    symbol_count++;
+
+    /* keep the names word aligned in the file */
+    names_size += len;
+    while (names_size & 3)
+    {
+        names[names_size++] = 0;
+    }
+}
+
+static int in_image(uint32_t addr)
+{
+    /* end symbols of the last section point right after it */
+    return addr >= image_lo && addr <= image_hi;
+}
+
+static void module_cache_reloc(void * opaque, int type, unsigned long addr, unsigned long val)
+{
+    if (addr < image_lo || addr >= image_hi)
+    {
+        /* not loaded, e.g. debug info */
+        return;
+    }
+
+    int internal = in_image(val);
+
+    switch (type)
+    {
+        case R_ARM_NONE:
+        case R_ARM_COPY:
+        case R_ARM_V4BX:
+            return;
+
+        case R_ARM_ABS32:
+            if (internal) add_fixup(addr, MODULE_CACHE_FIXUP_ABS);
+            return;
+
+        case R_ARM_REL32:
+            if (!internal) add_fixup(addr, MODULE_CACHE_FIXUP_REL);
+            return;
+
+        case R_ARM_PC24:
+        case R_ARM_CALL:
+        case R_ARM_JUMP24:
+        case R_ARM_PLT32:
+            /* TCC may have sent it through a veneer in the image; checked in module_cache_save */
+            if (!internal) add_fixup(addr, MODULE_CACHE_FIXUP_BRANCH);
+            return;
+
+        case R_ARM_MOVW_ABS_NC:
+        case R_ARM_MOVT_ABS:
+        case R_ARM_THM_MOVW_ABS_NC:
+        case R_ARM_THM_MOVT_ABS:
+            /* absolute values into the core are fine, halves of a pointer into the image are not */
+            if (!internal) return;
+            break;
+
+        case R_ARM_THM_CALL:
+        case R_ARM_THM_JUMP24:
+            if (internal) return;
+            break;
+    }
+
+    if (!uncacheable)
+    {
+        printf("  [i] cache: can't rebase reloc %d at %x\n", type, addr);
+    }
+    uncacheable = 1;
+}
+
+void module_cache_record(TCCState * state, void * image, uint32_t size)
+{
+    module_cache_done();
+
+    image_lo = (uint32_t) image;
+    image_hi = (uint32_t) image + size;
+    recording = 1;
+    tcc_set_reloc_func(state, NULL, module_cache_reloc);
+}
+
+void * module_link_symbol(TCCState * state, const char * name)
+{
+    if (state)
+    {
+        void * address = tcc_get_symbol(state, name);
+        if (recording)
+        {
+            add_symbol(name, (uint32_t) address);
+        }
+        return address;
+    }
+
+    if (from_cache)
+    {
+        for (int i = 0; i < symbol_count; i++)
+        {
+            if (streq(names + symbols[i].name, name))
+            {
+                return (void *) symbols[i].address;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* the image as it will be executed, only the branch fixups need a second look */
+static void check_branches(void)
+{
+    int kept = 0;
+
+    for (int i = 0; i < fixup_count; i++)
+    {
+        uint32_t offset = fixups[i] & ~3;
+        int kind = fixups[i] & 3;
+
+        if (kind == MODULE_CACHE_FIXUP_BRANCH)
+        {
+            uint32_t insn = *(uint32_t *)(image_lo + offset);
+            if (((insn >> 25) & 7) != 5)
+            {
+                printf("  [i] cache: not a branch at %x\n", image_lo + offset);
+                uncacheable = 1;
+                return;
+            }
+
+            /* BLX (cond = 1111) also has the H bit, that doesn't matter for the range */
+            int32_t imm = (int32_t)(insn << 8) >> 6;
+            if (in_image(image_lo + offset + 8 + imm))
+            {
+                /* out of range, it goes through a veneer */
+                continue;
+            }
+        }
+
+        fixups[kept++] = fixups[i];
+    }
+
+    fixup_count = kept;
+}
+
+static int write_all(FILE * f, const void * buf, uint32_t size)
+{
+    return size == 0 || FIO_WriteFile(f, buf, size) == (int) size;
+}
+
+void module_cache_save(TCCState * state)
+{
+    if (!recording)
+    {
+        return;
+    }
+
+    check_branches();
+
+    /* core symbols are updated only after the modules ran their init, look them up already */
+    extern struct module_symbol_entry _module_symbols_start[];
+    extern struct module_symbol_entry _module_symbols_end[];
+    for (struct module_symbol_entry * e = _module_symbols_start; e < _module_symbols_end; e++)
+    {
+        module_link_symbol(state, e->name);
+    }
+
+    recording = 0;
+    tcc_set_reloc_func(state, NULL, NULL);
+
+    if (uncacheable || !key_valid)
+    {
+        printf("  [i] cache: not saved\n");
+        FIO_RemoveFile(MODULE_CACHE_FILE);
+        return;
+    }
+
+    /* .bss and the unused end of the PLT area are not worth storing */
+    /* (the image was cleared before linking) */
+    uint32_t stored = image_hi - image_lo;
+    while (stored >= 4 && *(uint32_t *)(image_lo + stored - 4) == 0)
+    {
+        stored -= 4;
+    }
+
+    struct module_cache_header header = key;
+    header.magic = MODULE_CACHE_MAGIC;
+    header.version = MODULE_CACHE_VERSION;
+    header.symbol_count = symbol_count;
+    header.names_size = names_size;
+    header.fixup_count = fixup_count;
+    header.image_base = image_lo;
+    header.image_size = image_hi - image_lo;
+    header.image_stored = stored;
+
+    uint32_t hash = MODULE_CACHE_HASH_INIT;
+    hash = module_cache_hash(hash, key_modules, key.module_count * sizeof(key_modules[0]));
+    hash = module_cache_hash(hash, symbols, symbol_count * sizeof(symbols[0]));
+    hash = module_cache_hash(hash, names, names_size);
+    hash = module_cache_hash(hash, fixups, fixup_count * sizeof(fixups[0]));
+    hash = module_cache_hash(hash, (void *) image_lo, stored);
+    header.hash = hash;
+
+    FILE * f = FIO_CreateFile(MODULE_CACHE_FILE);
+    if (!f)
+    {
+        return;
+    }
+
+    int ok =
+        write_all(f, &header, sizeof(header)) &&
+        write_all(f, key_modules, key.module_count * sizeof(key_modules[0])) &&
+        write_all(f, symbols, symbol_count * sizeof(symbols[0])) &&
+        write_all(f, names, names_size) &&
+        write_all(f, fixups, fixup_count * sizeof(fixups[0])) &&
+        write_all(f, (void *) image_lo, stored);
+    FIO_CloseFile(f);
+
+    if (!ok)
+    {
+        FIO_RemoveFile(MODULE_CACHE_FILE);
+        return;
+    }
+
+    printf("  [i] cache: saved, %d fixups, %d bytes\n", fixup_count, sizeof(header) + stored);
+}
+
+static int hash_file(const char * filename, uint32_t * size, uint32_t * hash)
+{
+    int buf_size = 0;
+    uint8_t * buf = read_entire_file(filename, &buf_size);
+    if (!buf)
+    {
+        return 0;
+    }
+
+    *size = buf_size;
+    *hash = module_cache_hash(MODULE_CACHE_HASH_INIT, buf, buf_size);
+    fio_free(buf);
+    return 1;
+}
+
+static int find_key(const char * symbols_file, module_entry_t * modules, int count)
+{
+    extern struct module_symbol_entry _module_symbols_start[];
+    extern struct module_symbol_entry _module_symbols_end[];
+
+    memset(&key, 0, sizeof(key));
+    memset(key_modules, 0, sizeof(key_modules));
+    key_valid = 0;
+
+    if (!hash_file(symbols_file, &key.sym_size, &key.sym_hash))
+    {
+        return 0;
+    }
+    key.core_symbols = _module_symbols_end - _module_symbols_start;
+
+    for (int mod = 0; mod < count; mod++)
+    {
+        if (!modules[mod].enabled)
+        {
+            continue;
+        }
+
+        struct module_cache_module * m = &key_modules[key.module_count++];
+        strncpy(m->filename, modules[mod].filename, sizeof(m->filename) - 1);
+        if (!hash_file(modules[mod].long_filename, &m->size, &m->hash))
+        {
+            return 0;
+        }
+    }
+
+    key_valid = 1;
+    return 1;
+}
+
+static void * rebase(struct module_cache_header * header, uint8_t * data)
+{
+    uint32_t * file_fixups = (uint32_t *)(data
+        + header->module_count * sizeof(struct module_cache_module)
+        + header->symbol_count * sizeof(struct module_cache_symbol)
+        + header->names_size);
+    uint8_t * file_image = (uint8_t *)(file_fixups + header->fixup_count);
+
+    /* TCC aligned the sections to 16 bytes from the original address; keep the same alignment */
+    void * block = malloc(header->image_size + 16);
+    if (!block)
+    {
+        return NULL;
+    }
+    uint32_t base = (uint32_t) block + ((header->image_base - (uint32_t) block) & 15);
+    uint32_t delta = base - header->image_base;
+
+    memcpy((void *) base, file_image, header->image_stored);
+    memset((void *) (base + header->image_stored), 0, header->image_size - header->image_stored);
+
+    /* the file was read into uncacheable memory, hashing the copy is faster */
+    uint32_t hash = module_cache_hash(MODULE_CACHE_HASH_INIT, data, file_image - data);
+    if (module_cache_hash(hash, (void *) base, header->image_stored) != header->hash)
+    {
+        printf("  [i] cache: invalid\n");
+        free(block);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < header->fixup_count; i++)
+    {
+        uint32_t offset = file_fixups[i] & ~3;
+        uint32_t * word = (uint32_t *)(base + offset);
+
+        if (offset + 4 > header->image_size)
+        {
+            free(block);
+            return NULL;
+        }
+
+        switch (file_fixups[i] & 3)
+        {
+            case MODULE_CACHE_FIXUP_ABS:
+                *word += delta;
+                break;
+
+            case MODULE_CACHE_FIXUP_REL:
+                *word -= delta;
+                break;
+
+            case MODULE_CACHE_FIXUP_BRANCH:
+            {
+                int32_t imm = ((int32_t)(*word << 8) >> 8) - (int32_t) delta / 4;
+                if (imm >= 0x800000 || imm < -0x800000)
+                {
+                    printf("  [i] cache: branch at %x out of range\n", word);
+                    free(block);
+                    return NULL;
+                }
+                *word = (*word & 0xFF000000) | (imm & 0xFFFFFF);
+                break;
+            }
+
+            default:
+                free(block);
+                return NULL;
+        }
+    }
+
+    /* symbols, for module_link_symbol */
+    struct module_cache_symbol * file_symbols = (void *)(data + header->module_count * sizeof(struct module_cache_module));
+    char * file_names = (char *)(file_symbols + header->symbol_count);
+    symbols = malloc(header->symbol_count * sizeof(symbols[0]) + 4);
+    names = malloc(header->names_size + 1);
+    if (!symbols || !names)
+    {
+        free(block);
+        module_cache_done();
+        return NULL;
+    }
+    memcpy(names, file_names, header->names_size);
+    names[header->names_size] = 0;
+    symbol_count = header->symbol_count;
+    names_size = header->names_size;
+    for (int i = 0; i < symbol_count; i++)
+    {
+        uint32_t address = file_symbols[i].address;
+        symbols[i].name = MIN(file_symbols[i].name, names_size);
+        symbols[i].address = (address >= header->image_base && address <= header->image_base + header->image_size)
+            ? address + delta : address;
+    }
+
+    return block;
+}
+
+void * module_cache_load(const char * symbols_file, module_entry_t * modules, int count)
+{
+    module_cache_done();
+
+    if (!find_key(symbols_file, modules, count))
+    {
+        return NULL;
+    }
+
+    int size = 0;
+    uint8_t * buf = read_entire_file(MODULE_CACHE_FILE, &size);
+    if (!buf)
+    {
+        printf("  [i] cache: none\n");
+        return NULL;
+    }
+
+    struct module_cache_header * header = (void *) buf;
+    uint8_t * data = buf + sizeof(*header);
+    uint32_t data_size = size - sizeof(*header);
+    void * block = NULL;
+
+    if (size < (int) sizeof(*header) ||
+        header->magic != MODULE_CACHE_MAGIC ||
+        header->version != MODULE_CACHE_VERSION ||
+        header->module_count > MODULE_COUNT_MAX ||
+        header->image_stored > header->image_size ||
+        data_size !=
+            header->module_count * sizeof(struct module_cache_module) +
+            header->symbol_count * sizeof(struct module_cache_symbol) +
+            header->names_size + header->fixup_count * 4 + header->image_stored)
+    {
+        printf("  [i] cache: invalid\n");
+        goto end;
+    }
+
+    if (header->sym_size != key.sym_size ||
+        header->sym_hash != key.sym_hash ||
+        header->core_symbols != key.core_symbols ||
+        header->module_count != key.module_count ||
+        memcmp(data, key_modules, key.module_count * sizeof(key_modules[0])) != 0)
+    {
+        printf("  [i] cache: outdated\n");
+        goto end;
+    }
+
+    block = rebase(header, data);
+    if (!block)
+    {
+        goto end;
+    }
+
+    from_cache = 1;
+    for (int mod = 0; mod < count; mod++)
+    {
+        if (modules[mod].enabled)
+        {
+            modules[mod].valid = 1;
+        }
+    }
+    printf("  [i] cache: %d fixups\n", header->fixup_count);
+
+end:
+    fio_free(buf);
+    return block;
+}
+
+void module_cache_done(void)
+{
+    free(fixups);
+    free(symbols);
+    free(names);
+    fixups = NULL;
+    symbols = NULL;
+    names = NULL;
+    fixup_count = fixup_alloc = 0;
+    symbol_count = symbol_alloc = 0;
+    names_size = names_alloc = 0;
+    recording = 0;
+    uncacheable = 0;
+    from_cache = 0;
+}
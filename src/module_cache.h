@@ -0,0 +1,105 @@
+#ifndef _module_cache_h_
+#define _module_cache_h_
+
+/*
+ * Cache of the linked module image.
+ *
+ * Linking all modules with TCC (parsing the symbol file, relocating every .mo)
+ * is most of the module loading time at boot. When the symbol file and the
+ * enabled modules did not change, the image TCC produced last time is loaded
+ * from the card instead, and only rebased to the new load address.
+ *
+ * The cache is written right after linking, before any module code ran.
+ * modules/module_cache.py checks a cache on the card from a PC.
+ */
+
+#include "module.h"
+#include "libtcc.h"
+
+#define MODULE_CACHE_FILE       MODULE_PATH "LINKED.BIN"
+#define MODULE_CACHE_MAGIC      0x4B4E4C4D      /* "MLNK" */
+#define MODULE_CACHE_VERSION    1
+
+/* file layout, all little endian: header, modules, symbols, names, fixups, image */
+struct module_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash;              /* of everything after this header */
+    uint32_t sym_size;          /* key: the symbol file */
+    uint32_t sym_hash;
+    uint32_t core_symbols;      /* key: number of MODULE_SYMBOL entries in core */
+    uint32_t module_count;
+    uint32_t symbol_count;
+    uint32_t names_size;
+    uint32_t fixup_count;
+    uint32_t image_base;        /* address the image was linked at */
+    uint32_t image_size;        /* bytes to allocate */
+    uint32_t image_stored;      /* bytes stored in the file, the rest is zero */
+};
+
+/* key: each enabled module, in load order */
+struct module_cache_module
+{
+    char filename[MODULE_FILENAME_LENGTH+1];
+    uint32_t size;
+    uint32_t hash;
+};
+
+/* symbols looked up after linking */
+struct module_cache_symbol
+{
+    uint32_t name;              /* offset into the names */
+    uint32_t address;           /* as linked, 0 if not found */
+};
+
+/* fixups: offset into the image (word aligned), kind in the low bits */
+#define MODULE_CACHE_FIXUP_ABS      0   /* pointer into the image: word += delta */
+#define MODULE_CACHE_FIXUP_REL      1   /* PC-relative pointer out of the image: word -= delta */
+#define MODULE_CACHE_FIXUP_BRANCH   2   /* ARM B/BL out of the image: imm24 -= delta / 4 */
+
+/* 32-bit FNV-1a over little endian words, the tail padded with zeros */
+static inline uint32_t module_cache_hash(uint32_t hash, const void * buf, uint32_t size)
+{
+    const uint8_t * p = buf;
+    uint32_t i = 0;
+
+    if (((uintptr_t) p & 3) == 0)
+    {
+        /* the camera is little endian, too */
+        for ( ; i + 4 <= size; i += 4)
+        {
+            hash = (hash ^ *(const uint32_t *)(p + i)) * 0x01000193;
+        }
+    }
+
+    for ( ; i < size; i += 4)
+    {
+        uint32_t word = p[i];
+        if (i + 1 < size) word |= p[i+1] << 8;
+        if (i + 2 < size) word |= p[i+2] << 16;
+        if (i + 3 < size) word |= p[i+3] << 24;
+        hash = (hash ^ word) * 0x01000193;
+    }
+    return hash;
+}
+#define MODULE_CACHE_HASH_INIT  0x811C9DC5
+
+/* looks for a cached image of the enabled modules in the list, linked against symbols_file
+ * on a hit, allocates and rebases it and returns the allocated block;
+ * module_link_symbol then answers from the cache */
+void * module_cache_load(const char * symbols_file, module_entry_t * modules, int count);
+
+/* call before tcc_relocate into 'image' to record a new cache while linking */
+void module_cache_record(TCCState * state, void * image, uint32_t size);
+
+/* tcc_get_symbol, or the cached address when the modules came from the cache (state == NULL) */
+void * module_link_symbol(TCCState * state, const char * name);
+
+/* after tcc_relocate and the module symbol lookups, before running any module code */
+void module_cache_save(TCCState * state);
+
+/* drop what's left from linking or loading */
+void module_cache_done(void);
+
+#endif
@@ -0,0 +1,186 @@
+/**\file
+ * Zebras and false colors, drawn from lookup tables.
+ */
+
+#include "overlay.h"
+#include "imgconv.h"
+
+static inline int clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Canon drew over some of our pixels: erase the rest of ours (little_cleanup) */
+static void overlay_cleanup(uint8_t * bp, uint8_t * mp)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (bp[i] != 0 && bp[i] == mp[i])
+        {
+            mp[i] = bp[i] = 0;
+        }
+    }
+}
+
+/* one 4x2 cell; returns 1 if written */
+static inline int overlay_put32(uint32_t * bp, uint32_t * mp, int next, uint32_t c1, uint32_t c2)
+{
+    const uint32_t B = bp[0], M = mp[0], BN = bp[next], MN = mp[next];
+
+    if (B == M && BN == MN && !((M | MN) & 0x80808080))
+    {
+        /* nothing but our own pixels here (usual case) */
+        if (M == c1 && MN == c2)
+            return 0;
+    }
+    else
+    {
+        if (B != 0 && B != M) { overlay_cleanup((uint8_t *)bp, (uint8_t *)mp); return 0; }
+        if (BN != 0 && BN != MN) { overlay_cleanup((uint8_t *)(bp + next), (uint8_t *)(mp + next)); return 0; }
+        if ((M | MN) & 0x80808080) return 0;
+    }
+
+    bp[0] = mp[0] = c1;
+    bp[next] = mp[next] = c2;
+    return 1;
+}
+
+/* one 2x2 cell; cleans up 4 pixels, like the old false color code */
+static inline int overlay_put16(uint16_t * bp, uint16_t * mp, int next, uint16_t c1, uint16_t c2)
+{
+    const uint16_t B = bp[0], M = mp[0], BN = bp[next], MN = mp[next];
+
+    if (B != 0 && B != M) { overlay_cleanup((uint8_t *)bp, (uint8_t *)mp); return 0; }
+    if (BN != 0 && BN != MN) { overlay_cleanup((uint8_t *)(bp + next), (uint8_t *)(mp + next)); return 0; }
+    if ((M | MN) & 0x8080) return 0;
+    if (B == c1 && M == c1 && BN == c2 && MN == c2) return 0;
+
+    bp[0] = mp[0] = c1;
+    bp[next] = mp[next] = c2;
+    return 1;
+}
+
+/* two 2x2 cells; returns how many were written */
+static inline int overlay_put_pair(uint32_t * bp, uint32_t * mp, int next, uint32_t c1, uint32_t c2)
+{
+    const uint32_t B = bp[0], M = mp[0], BN = bp[next], MN = mp[next];
+
+    if (B == M && BN == MN && !((M | MN) & 0x80808080))
+    {
+        if (M == c1 && MN == c2)
+            return 0;
+
+        bp[0] = mp[0] = c1;
+        bp[next] = mp[next] = c2;
+        return 2;
+    }
+
+    /* one at a time; cleaning up the first one may affect the second */
+    return
+        overlay_put16((uint16_t *)bp,     (uint16_t *)mp,     next * 2, c1,       c2) +
+        overlay_put16((uint16_t *)bp + 1, (uint16_t *)mp + 1, next * 2, c1 >> 16, c2 >> 16);
+}
+
+static inline int overlay_rgb_class(const struct overlay_job * job, uint32_t pixel)
+{
+    const int Y = UYVY_GET_AVG_Y(pixel);
+    if (Y < job->level_lo)
+        return OVERLAY_RGB_UNDER;
+
+    const int gu = UYVY_GET_U(pixel);
+    const int gv = UYVY_GET_V(pixel);
+    const int R = clamp255(Y + job->yuv2rgb_rv[gv]);
+    const int G = clamp255(Y + job->yuv2rgb_gu[gu] + job->yuv2rgb_gv[gv]);
+    const int B = clamp255(Y + job->yuv2rgb_bu[gu]);
+    const int hi = job->level_hi;
+    return (R > hi) << 2 | (G > hi) << 1 | (B > hi);
+}
+
+/* zebras: one sample per BMP word; rgb is a constant in each instance */
+static inline __attribute__((always_inline))
+int overlay_draw_4(struct overlay_job * job, const int rgb)
+{
+    const uint16_t * cols = job->cols;
+    const int col_count = job->col_count;
+    const int next = job->bmp_pitch / 4;
+    int written = 0;
+
+    for (int r = 0; r < job->row_count; r++)
+    {
+        const int y = job->y0 + 2 * r;
+        const uint32_t * row = job->buf + job->rows[r];
+        uint32_t * bp = (uint32_t *)(job->bmp + y * job->bmp_pitch + job->x0);
+        uint32_t * mp = (uint32_t *)(job->mirror + y * job->bmp_pitch + job->x0);
+        const uint32_t * top = rgb ? job->rgb_colors[y & 3] : job->lut[y & 3];
+        const uint32_t * bottom = rgb ? job->rgb_colors[(y + 1) & 3] : job->lut[(y + 1) & 3];
+
+        for (int c = 0; c < col_count; c++)
+        {
+            const uint32_t pixel = row[cols[c]];
+            const int i = rgb ? overlay_rgb_class(job, pixel) : (int)((pixel >> 8) & 0xFF);
+            written += overlay_put32(bp + c, mp + c, next, top[i], bottom[i]);
+        }
+    }
+
+    return written;
+}
+
+static int overlay_draw_luma(struct overlay_job * job) { return overlay_draw_4(job, 0); }
+static int overlay_draw_rgb(struct overlay_job * job)  { return overlay_draw_4(job, 1); }
+
+/* false colors: two samples per BMP word */
+static int overlay_draw_2(struct overlay_job * job)
+{
+    const uint16_t * cols = job->cols;
+    const int col_count = job->col_count;
+    const int next = job->bmp_pitch / 4;
+    int written = 0;
+
+    /* an odd cell at the start, if x0 is not word-aligned */
+    const int first = (job->x0 & 2) ? 1 : 0;
+
+    for (int r = 0; r < job->row_count; r++)
+    {
+        const int y = job->y0 + 2 * r;
+        const uint32_t * row = job->buf + job->rows[r];
+        uint8_t * b = job->bmp + y * job->bmp_pitch + job->x0;
+        uint8_t * m = job->mirror + y * job->bmp_pitch + job->x0;
+        const uint32_t * top = job->lut[y & 3];
+        const uint32_t * bottom = job->lut[(y + 1) & 3];
+        int c = 0;
+
+        if (first && col_count)
+        {
+            const int i = (row[cols[0]] >> 8) & 0xFF;
+            written += overlay_put16((uint16_t *)b, (uint16_t *)m, next * 2, top[i], bottom[i]);
+            c = 1;
+        }
+
+        for ( ; c + 1 < col_count; c += 2)
+        {
+            const int i0 = (row[cols[c]] >> 8) & 0xFF;
+            const int i1 = (row[cols[c + 1]] >> 8) & 0xFF;
+            written += overlay_put_pair(
+                (uint32_t *)(b + c * 2), (uint32_t *)(m + c * 2), next,
+                (top[i0] & 0xFFFF) | (top[i1] & 0xFFFF0000),
+                (bottom[i0] & 0xFFFF) | (bottom[i1] & 0xFFFF0000)
+            );
+        }
+
+        if (c < col_count)
+        {
+            const int i = (row[cols[c]] >> 8) & 0xFF;
+            written += overlay_put16((uint16_t *)(b + c * 2), (uint16_t *)(m + c * 2), next * 2, top[i], bottom[i]);
+        }
+    }
+
+    return written;
+}
+
+void overlay_draw(struct overlay_job * job)
+{
+    job->cells_written =
+        job->cell_width == 2 ? overlay_draw_2(job) :
+        job->rgb             ? overlay_draw_rgb(job) :
+                               overlay_draw_luma(job);
+}
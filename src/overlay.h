@@ -0,0 +1,66 @@
+#ifndef _overlay_h_
+#define _overlay_h_
+
+/*
+ * Zebras and false colors: LiveView pixels -> BMP colors, through lookup tables.
+ *
+ * Every 2nd row and every 2nd (false colors) or 4th (zebras) pixel is sampled;
+ * each sample paints a cell of 2x2 or 4x2 BMP pixels. Colors are looked up
+ * as BMP words, already repeated over the cell, for each y % 4 (zebra stripes).
+ * False color cells are written two at a time, so all BMP accesses are 32-bit.
+ *
+ * BMP words that already show the right colors are not written again, so the
+ * parts of the overlay that didn't change only cost the reads. As before,
+ * pixels drawn by Canon are cleaned up around, and those drawn by other ML
+ * overlays (with 0x80 set in the mirror) are left alone.
+ *
+ * No DryOS dependencies; src/test builds it on the PC.
+ */
+
+#include <stdint.h>
+
+#define OVERLAY_MAX_ROWS    320     /* every 2nd BMP row */
+#define OVERLAY_MAX_COLS    480     /* every 2nd BMP pixel */
+
+/* RGB zebras: index in rgb_colors */
+#define OVERLAY_RGB_UNDER   8       /* Y below level_lo; otherwise, clipped channels: R << 2 | G << 1 | B */
+#define OVERLAY_RGB_CLASSES 9
+
+struct overlay_job
+{
+    /* input: UYVY words; sampled rows and cells, as word offsets */
+    const uint32_t * buf;
+    uint32_t rows[OVERLAY_MAX_ROWS];
+    uint16_t cols[OVERLAY_MAX_COLS];
+    int row_count;
+    int col_count;
+
+    /* output: row r paints BMP rows y0 + 2*r and y0 + 2*r + 1,
+     * cell c paints cell_width pixels from x0 + c * cell_width */
+    uint8_t * bmp;
+    uint8_t * mirror;
+    int bmp_pitch;
+    int x0;                         /* multiple of cell_width */
+    int y0;
+    int cell_width;                 /* 2 or 4 */
+
+    /* BMP word for each Y (the first luma of the UYVY word), on rows with y % 4 == 0..3 */
+    const uint32_t * lut[4];
+
+    /* RGB zebras (cell_width 4 only): same, for each OVERLAY_RGB_* class, instead of lut */
+    int rgb;
+    const uint32_t * rgb_colors[4];
+    int level_lo;                   /* underexposed if average Y < level_lo */
+    int level_hi;                   /* clipped if R, G or B > level_hi */
+    const int * yuv2rgb_rv;         /* precompute_yuv2rgb tables */
+    const int * yuv2rgb_gu;
+    const int * yuv2rgb_gv;
+    const int * yuv2rgb_bu;
+
+    /* statistics of the last call */
+    int cells_written;
+};
+
+void overlay_draw(struct overlay_job * job);
+
+#endif
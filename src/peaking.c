@@ -0,0 +1,259 @@
+/**\file
+ * Focus peaking dots, redrawn only where the image changed.
+ */
+
+#include <string.h>
+#include "peaking.h"
+
+#define SAMPLE_DX   2
+#define SAMPLE_DY   3
+
+/* BMP pixels (two at a time) at the top and bottom of a dot */
+#define B1 (*(uint16_t*)(b))
+#define B2 (*(uint16_t*)(b + pitch))
+#define M1 (*(uint16_t*)(m))
+#define M2 (*(uint16_t*)(m + pitch))
+
+static void peak_dot_draw(struct peak_dot * dot, uint8_t * bmp, uint8_t * mirror, int pitch, int color)
+{
+    uint8_t * b = bmp + dot->offset;
+    uint8_t * m = mirror + dot->offset;
+    const uint16_t c = color | (color << 8);
+
+    if (dot->drawn && B1 == c && B2 == c)
+        return;
+
+    /* something else drawn by ML (cropmarks, zebras) */
+    if ((M1 & 0x8080) || (M2 & 0x8080))
+        return;
+
+    /* something drawn by Canon (menus, info bars) */
+    if ((B1 != 0 && B1 != M1) || (B2 != 0 && B2 != M2))
+        return;
+
+    if (!dot->drawn)
+    {
+        dot->saved = B1 | (B2 << 16);
+    }
+
+    B1 = B2 = M1 = M2 = c;
+    dot->drawn = 1;
+}
+
+static void peak_dot_erase(struct peak_dot * dot, uint8_t * bmp, uint8_t * mirror, int pitch)
+{
+    uint8_t * b = bmp + dot->offset;
+    uint8_t * m = mirror + dot->offset;
+
+    if (!dot->drawn)
+        return;
+
+    if ((B1 == 0 || B1 == M1) && (B2 == 0 || B2 == M2))
+    {
+        B1 = M1 = dot->saved & 0xFFFF;
+        B2 = M2 = dot->saved >> 16;
+    }
+    dot->drawn = 0;
+}
+
+#undef B1
+#undef B2
+#undef M1
+#undef M2
+
+void peak_tiles_init(struct peak_tiles * tiles, struct peak_dot * dots, int max_dots)
+{
+    memset(tiles, 0, sizeof(*tiles));
+    tiles->dots = dots;
+    tiles->next = dots + max_dots;
+    tiles->max_dots = max_dots;
+}
+
+void peak_tiles_erase(struct peak_tiles * tiles)
+{
+    for (int i = 0; i < tiles->dot_count; i++)
+    {
+        peak_dot_erase(&tiles->dots[i], tiles->bmp, tiles->mirror, tiles->bmp_pitch);
+    }
+
+    tiles->dot_count = 0;
+
+    for (int i = 0; i < PEAK_MAX_TILES_X * PEAK_MAX_TILES_Y; i++)
+    {
+        tiles->tile[i].valid = 0;
+        tiles->tile[i].count = 0;
+    }
+}
+
+/* did any sample move by more than the noise since the last scan?
+ * half of them are checked on each frame, in a checkerboard pattern */
+static int peak_tile_changed(const struct peak_job * job, struct peak_tile * t, int xs, int ys, int xe, int ye, int phase)
+{
+    const uint8_t * luma = t->luma;
+    const uint16_t * cols = job->lv_cols + (xs - job->x0);
+    const int n = (xe - xs + SAMPLE_DX - 1) / SAMPLE_DX;
+
+    for (int y = ys; y < ye; y += SAMPLE_DY, phase ^= 1)
+    {
+        const uint8_t * row = job->lv + job->lv_rows[y - job->y0];
+        int changed = 0;
+
+        /* no early exit inside the row, so it compiles to straight code */
+        for (int i = phase; i < n; i += 2)
+        {
+            int d = row[cols[i * SAMPLE_DX]] - luma[i];
+            changed |= (unsigned)(d + PEAK_TILE_NOISE) > 2 * PEAK_TILE_NOISE;
+        }
+
+        if (changed)
+            return 1;
+
+        luma += n;
+    }
+    return 0;
+}
+
+int peak_tiles_update(struct peak_tiles * tiles, const struct peak_job * job)
+{
+    uint8_t * const bmp = job->bmp;
+    uint8_t * const mirror = job->mirror;
+    const int bmp_pitch = job->bmp_pitch;
+    const int thr = job->thr;
+    const int tiles_x = (job->x1 - job->x0 + PEAK_TILE_W - 1) / PEAK_TILE_W;
+    const int tiles_y = (job->y1 - job->y0 + PEAK_TILE_H - 1) / PEAK_TILE_H;
+
+    if (tiles_x <= 0 || tiles_y <= 0 || tiles_x > PEAK_MAX_TILES_X || tiles_y > PEAK_MAX_TILES_Y)
+    {
+        peak_tiles_erase(tiles);
+        return 0;
+    }
+
+    if (job->x0 != tiles->x0 || job->y0 != tiles->y0 || job->x1 != tiles->x1 || job->y1 != tiles->y1 ||
+        bmp != tiles->bmp || mirror != tiles->mirror || bmp_pitch != tiles->bmp_pitch)
+    {
+        /* the dots we know about are in the old geometry */
+        peak_tiles_erase(tiles);
+        tiles->x0 = job->x0;
+        tiles->y0 = job->y0;
+        tiles->x1 = job->x1;
+        tiles->y1 = job->y1;
+        tiles->bmp = bmp;
+        tiles->mirror = mirror;
+        tiles->bmp_pitch = bmp_pitch;
+    }
+
+    /* keep the dots a bit below the threshold, so it can go down a few steps
+     * (it moves on every frame) without scanning again */
+    const int floor = thr - thr / 4;
+
+    struct peak_dot * dots = tiles->dots;
+    struct peak_dot * next = tiles->next;
+    int count = 0;
+    int n_over = 0;
+
+    tiles->frame++;
+    tiles->tiles_total = tiles_x * tiles_y;
+    tiles->tiles_scanned = 0;
+
+    for (int ty = 0; ty < tiles_y; ty++)
+    {
+        const int ys = job->y0 + ty * PEAK_TILE_H;
+        const int ye = ys + PEAK_TILE_H < job->y1 ? ys + PEAK_TILE_H : job->y1;
+
+        for (int tx = 0; tx < tiles_x; tx++)
+        {
+            const int xs = job->x0 + tx * PEAK_TILE_W;
+            const int xe = xs + PEAK_TILE_W < job->x1 ? xs + PEAK_TILE_W : job->x1;
+            const int index = ty * tiles_x + tx;
+            struct peak_tile * t = &tiles->tile[index];
+            struct peak_dot * old = dots + t->first;
+            const int first = count;
+
+            const int changed =
+                !t->valid ||                                        /* first time, or out of dots */
+                thr < t->floor ||                                   /* threshold went too low */
+                (tiles->frame + index) % PEAK_TILE_REFRESH == 0 ||
+                peak_tile_changed(job, t, xs, ys, xe, ye, tiles->frame & 1);
+
+            if (!changed)
+            {
+                /* same picture: keep the dots, show those above the current threshold */
+                for (int i = 0; i < t->count; i++)
+                {
+                    struct peak_dot * dot = &next[count++];
+                    *dot = old[i];
+
+                    if (dot->e >= thr)
+                    {
+                        n_over++;
+                        peak_dot_draw(dot, bmp, mirror, bmp_pitch, job->colors[dot->e]);
+                    }
+                    else
+                    {
+                        peak_dot_erase(dot, bmp, mirror, bmp_pitch);
+                    }
+                }
+
+                t->first = first;
+                t->count = count - first;
+                continue;
+            }
+
+            for (int i = 0; i < t->count; i++)
+            {
+                peak_dot_erase(&old[i], bmp, mirror, bmp_pitch);
+            }
+
+            uint8_t * luma = t->luma;
+            t->floor = floor;
+            t->valid = 1;
+            tiles->tiles_scanned++;
+
+            for (int y = ys; y < ye; y += SAMPLE_DY)
+            {
+                const uint8_t * row = job->lv + job->lv_rows[y - job->y0];
+
+                for (int x = xs; x < xe; x += SAMPLE_DX)
+                {
+                    const uint8_t * p8 = row + job->lv_cols[x - job->x0];
+                    *luma++ = *p8;
+
+                    int e = peak_laplacian(p8, job->lv_pitch, job->filter_edges);
+
+                    /* executed for a few % of pixels */
+                    if (e >= floor)
+                    {
+                        if (e > 255) e = 255;
+                        if (e >= thr) n_over++;
+
+                        if (count >= tiles->max_dots)
+                        {
+                            /* threshold too low; scan this one again next time */
+                            t->valid = 0;
+                            continue;
+                        }
+
+                        struct peak_dot * dot = &next[count++];
+                        /* BMP pixels are accessed in pairs; x may be odd (e.g. HDMI, os.x0 < 0) */
+                        dot->offset = y * bmp_pitch + (x & ~1);
+                        dot->e = e;
+                        dot->drawn = 0;
+
+                        if (e >= thr)
+                        {
+                            peak_dot_draw(dot, bmp, mirror, bmp_pitch, job->colors[e]);
+                        }
+                    }
+                }
+            }
+
+            t->first = first;
+            t->count = count - first;
+        }
+    }
+
+    tiles->dots = next;
+    tiles->next = dots;
+    tiles->dot_count = count;
+    return n_over;
+}
@@ -0,0 +1,134 @@
+#ifndef _peaking_h_
+#define _peaking_h_
+
+/*
+ * Focus peaking dots on a tile grid.
+ *
+ * The scanned area is split in tiles of PEAK_TILE_W x PEAK_TILE_H BMP pixels.
+ * Every frame, the luma of each tile is compared with the one from its last
+ * scan; only the tiles that changed are scanned for edges again and have
+ * their dots erased and redrawn. The other tiles keep their dots, which are
+ * only recolored or hidden when the threshold moves.
+ *
+ * A tile changed if any sample moved by more than PEAK_TILE_NOISE, so sensor
+ * noise doesn't count, but a blurred edge does. Half of the samples are
+ * checked on each frame, alternating, so a change shows up one frame later
+ * at worst. Slow drifts are caught as they add up; whatever is left, by
+ * scanning every tile again at least once every PEAK_TILE_REFRESH frames.
+ *
+ * No DryOS dependencies; src/test builds it on the PC.
+ */
+
+#include <stdint.h>
+
+#define PEAK_TILE_W         32      /* BMP pixels; 16 samples (every 2nd pixel) */
+#define PEAK_TILE_H         24      /* BMP rows; 8 samples (every 3rd row) */
+#define PEAK_TILE_SAMPLES   ((PEAK_TILE_W / 2) * (PEAK_TILE_H / 3))
+#define PEAK_TILE_NOISE     10      /* luma difference of a sample in an unchanged tile */
+#define PEAK_TILE_REFRESH   8       /* frames */
+#define PEAK_MAX_TILES_X    30      /* 960 pixels */
+#define PEAK_MAX_TILES_Y    23      /* 552 rows */
+
+/** approximate second derivative with a Laplacian kernel:
+ *     -1
+ *  -1  4 -1
+ *     -1
+ * p8 points to the Y of an UYVY pixel
+ */
+static inline int peak_laplacian(const uint8_t * p8, const int pitch, const int filter_edges)
+{
+    const int p8_xmin1 = (int)(*(p8 - 2));
+    const int p8_xplus1 = (int)(*(p8 + 2));
+    const int p8_ymin1 = (int)(*(p8 - pitch));
+    const int p8_yplus1 = (int)(*(p8 + pitch));
+
+    int result = ((int)(*p8) * 4);
+    result -= p8_xplus1 + p8_xmin1 + p8_yplus1 + p8_ymin1;
+
+    int e = result < 0 ? -result : result;
+
+    if (filter_edges)
+    {
+        // filter out strong edges where first derivative is strong
+        // as these are usually false positives
+        int d1x = p8_xplus1 - p8_xmin1;
+        int d1y = p8_yplus1 - p8_ymin1;
+        if (d1x < 0) d1x = -d1x;
+        if (d1y < 0) d1y = -d1y;
+        int d1 = d1x > d1y ? d1x : d1y;
+        e -= (d1 << filter_edges) >> 2;
+        e = (e > 0 ? e : 0) * 2;
+    }
+    return e;
+}
+
+/* a pixel above the floor of its tile; drawn as 2x2 BMP pixels when above the threshold */
+struct peak_dot
+{
+    uint32_t offset : 23;       /* in the BMP buffer, of the top 2 pixels */
+    uint32_t drawn : 1;
+    uint32_t e : 8;             /* edge strength, saturated */
+    uint32_t saved;             /* BMP pixels under the dot: top | bottom << 16, if drawn */
+};
+
+struct peak_tile
+{
+    uint8_t luma[PEAK_TILE_SAMPLES];    /* from the last scan */
+    uint16_t first;             /* its dots */
+    uint16_t count;
+    uint8_t floor;              /* dots were kept down to this edge strength */
+    uint8_t valid;
+};
+
+struct peak_tiles
+{
+    struct peak_tile tile[PEAK_MAX_TILES_X * PEAK_MAX_TILES_Y];
+    struct peak_dot * dots;     /* max_dots each, swapped every frame */
+    struct peak_dot * next;
+    int dot_count;
+    int max_dots;
+    int frame;
+
+    /* geometry of the last scan */
+    int x0, y0, x1, y1;
+    uint8_t * bmp;
+    uint8_t * mirror;
+    int bmp_pitch;
+
+    /* statistics of the last scan */
+    int tiles_total;
+    int tiles_scanned;
+};
+
+struct peak_job
+{
+    /* LiveView: Y of the pixel under BMP (x,y) is at lv + lv_rows[y - y0] + lv_cols[x - x0] */
+    const uint8_t * lv;
+    int lv_pitch;
+    const int * lv_rows;
+    const uint16_t * lv_cols;
+
+    /* BMP and its mirror (what ML drew); BMP pixels under a dot are only
+     * touched if they are transparent or still show what ML drew there */
+    uint8_t * bmp;
+    uint8_t * mirror;
+    int bmp_pitch;
+
+    /* area scanned, in BMP coordinates; every 2nd pixel of every 3rd row */
+    int x0, y0, x1, y1;
+
+    int thr;
+    int filter_edges;
+    const uint8_t * colors;     /* dot color for each edge strength at this thr */
+};
+
+/* dots: buffers of max_dots entries, twice */
+void peak_tiles_init(struct peak_tiles * tiles, struct peak_dot * dots, int max_dots);
+
+/* erases all dots and forgets the tiles */
+void peak_tiles_erase(struct peak_tiles * tiles);
+
+/* updates the dots for a new frame; returns how many samples are above thr */
+int peak_tiles_update(struct peak_tiles * tiles, const struct peak_job * job);
+
+#endif
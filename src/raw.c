@@ -28,6 +28,7 @@
 #include "menu.h"
 #include "edmac-memcpy.h"
 #include "imgconv.h"
+#include "raw_preview.h"
 #include "console.h"
 #include "fps.h"
 #include "platform/state-object.h"
@@ -2108,228 +2109,92 @@ int raw_lv_settings_still_valid()
 }
 #endif
 
-/* For accessing the pixels in a struct raw_pixblock, faster than via raw_get_pixel */
-/* todo: move in raw.h? */
-#define PA ((int)(p->a))
-#define PB ((int)(p->b_lo | (p->b_hi << 12)))
-#define PC ((int)(p->c_lo | (p->c_hi << 10)))
-#define PD ((int)(p->d_lo | (p->d_hi << 8)))
-#define PE ((int)(p->e_lo | (p->e_hi << 6)))
-#define PF ((int)(p->f_lo | (p->f_hi << 4)))
-#define PG ((int)(p->g_lo | (p->g_hi << 2)))
-#define PH ((int)(p->h))
-
-/* a second set of pixels */
-#define QA ((int)(q->a))
-#define QB ((int)(q->b_lo | (q->b_hi << 12)))
-#define QC ((int)(q->c_lo | (q->c_hi << 10)))
-#define QD ((int)(q->d_lo | (q->d_hi << 8)))
-#define QE ((int)(q->e_lo | (q->e_hi << 6)))
-#define QF ((int)(q->f_lo | (q->f_hi << 4)))
-#define QG ((int)(q->g_lo | (q->g_hi << 2)))
-#define QH ((int)(q->h))
-
-static void FAST raw_preview_color_work(void* raw_buffer, void* lv_buffer, int y1, int y2)
-{
-    dbg_printf("Raw color preview...\n");
+/* raw_preview_fast_ex keeps its tables until the levels or the geometry change */
+static struct semaphore * raw_preview_sem = 0;
 
-    uint16_t* lv16 = CACHEABLE(lv_buffer);
-    uint32_t* lv32 = (uint32_t*) lv16;
-    if (!lv16)
-    {
-        dbg_printf("No YUV buffer\n");
-        return;
-    }
+/* white balance 2,1,2 => use two gamma curves to simplify code */
+static uint8_t raw_preview_gamma_rb[RAW_PREVIEW_LEVELS];
+static uint8_t raw_preview_gamma_g[RAW_PREVIEW_LEVELS];
+static int raw_preview_black = -1;
+static int raw_preview_white = -1;
+static int raw_preview_div = 0;
 
-    struct raw_pixblock * raw = CACHEABLE(raw_buffer);
-    if (!raw)
+static int * raw_preview_cols = 0;
+static int raw_preview_cols_width = 0;
+static int raw_preview_cols_sx = 0;
+static int raw_preview_cols_tx = 0;
+
+/* as in rgb2yuv422 (imgconv.c) */
+#if defined(CONFIG_REC709)
+static const int raw_preview_yuv[9] = { 217, 732, 73, -117, -394, 512, 512, -465, -46 };
+#else
+static const int raw_preview_yuv[9] = { 306, 601, 116, -172, -337, 509, 509, -427, -82 };
+#endif
+
+static REQUIRES(raw_preview_sem)
+void raw_preview_update_gamma()
+{
+    int black = raw_info.black_level;
+    int white = raw_info.white_level;
+
+    if (black == raw_preview_black && white == raw_preview_white)
     {
-        dbg_printf("No RAW buffer\n");
         return;
     }
 
     /* scale useful range (black...white) to 0...1023 or less */
-    int black = raw_info.black_level;
-    int white = raw_info.white_level;
     int div = 0;
-    while (((white-black) >> div) >= 1024)
+    while (((white-black) >> div) >= RAW_PREVIEW_LEVELS)
     {
         div++;
     }
 
-    /* white balance 2,1,2 => use two gamma curves to simplify code */
-    uint8_t gamma_rb[1024];
-    uint8_t gamma_g[1024];
-
-    for (int i = 0; i < 1024; i++)
+    for (int i = 0; i < RAW_PREVIEW_LEVELS; i++)
     {
         /* only show 10 bits */
         int g_rb = COERCE(raw_to_ev((i << div) + black) + 11, 0, 10) * 255 / 10;
         int g_g  = COERCE(raw_to_ev((i << div) + black) + 10, 0, 10) * 255 / 10;
         /* gamma 2 */
-        gamma_rb[i] = COERCE(g_rb * g_rb / 255, 0, 255);
-        gamma_g[i]  = COERCE(g_g  * g_g  / 255, 0, 255);
+        raw_preview_gamma_rb[i] = COERCE(g_rb * g_rb / 255, 0, 255);
+        raw_preview_gamma_g[i]  = COERCE(g_g  * g_g  / 255, 0, 255);
     }
 
-    int x1 = COERCE(RAW2LV_X(preview_rect_x), 0, vram_lv.width);
-    int x2 = COERCE(RAW2LV_X(preview_rect_x + preview_rect_w), 0, vram_lv.width);
-    if (x2 < x1) return;
-
-    /* cache the LV to RAW transformation for the inner loop to make it faster */
-    /* we will always choose a green pixel */
-
-    int* lv2rx = malloc(x2 * 4);
-    if (!lv2rx) return;
-    for (int x = x1; x < x2; x++)
-        lv2rx[x] = LV2RAW_X(x) & ~1;
-
-    /* full-res vertically */
-    for (int y = y1; y < y2; y++)
-    {
-        int yr = LV2RAW_Y(y) & ~1;
-
-        if (yr <= preview_rect_y || yr >= preview_rect_y + preview_rect_h)
-        {
-            /* out of range, just fill with black */
-            memset(&lv32[LV(0,y)/4], 0, vram_lv.pitch);
-            continue;
-        }
-
-        /* fill left/right borders with black */
-        memset(&lv32[LV(0,y)/4],  0, LV(x1,y) - LV(0,y)/4*4);
-        memset(&lv32[LV(x2,y)/4], 0, LV(0,1) - LV(x2,0)/4*4);
-
-        struct raw_pixblock * row = (void*)raw + yr * raw_info.pitch;
-
-        /* half-res horizontally, to simplify YUV422 math */
-        for (int x = x1; x < x2; x += 2)
-        {
-            int xr = lv2rx[x];
-            struct raw_pixblock * p = row + (xr/8);                 /* RG (xr and yr are multiples of 2) */
-            struct raw_pixblock * q = (void*) p + raw_info.pitch;   /* GB, next line */
-            int r,g,b;
-
-            /* RGGB cell */
-            /* note: at 1920 horizontal resolution in raw, downsampling by 8 would result in 240px horizontally => looks ugly */
-            switch (xr%8)
-            {
-                case 0:
-                    r = PA;
-                    g = (PB + QA) >> 1;
-                    b = QB;
-                    break;
-                case 2:
-                    r = PC;
-                    g = (PD + QC) >> 1;
-                    b = QD;
-                    break;
-                case 4:
-                    r = PE;
-                    g = (PF + QE) >> 1;
-                    b = QF;
-                    break;
-                case 6:
-                    r = PG;
-                    g = (PH + QG) >> 1;
-                    b = QH;
-                    break;
-                default:
-                    r = g = b = 0;
-            }
-            
-            /* div is chosen so that ((white-black) >> div) < 1024 */
-            r = gamma_rb[COERCE(r - black, 0, white-black) >> div];
-            g = gamma_g [COERCE(g - black, 0, white-black) >> div];
-            b = gamma_rb[COERCE(b - black, 0, white-black) >> div];
-
-            uint32_t yuv = rgb2yuv422(r,g,b);
-            lv32[LV(x,y)/4] = yuv;
-        }
-    }
-    free(lv2rx);
+    raw_preview_black = black;
+    raw_preview_white = white;
+    raw_preview_div = div;
 }
 
-static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1, int y2)
+static REQUIRES(raw_preview_sem)
+int raw_preview_update_cols()
 {
-    dbg_printf("Raw grayscale preview...\n");
-
-    uint16_t* lv16 = CACHEABLE(lv_buffer);
-    uint64_t* lv64 = (uint64_t*) lv16;
-    if (!lv16)
+    if (vram_lv.width == raw_preview_cols_width &&
+        lv2raw.sx == raw_preview_cols_sx &&
+        lv2raw.tx == raw_preview_cols_tx)
     {
-        dbg_printf("No YUV buffer\n");
-        return;
-    }
-
-    struct raw_pixblock * raw = CACHEABLE(raw_buffer);
-    if (!raw)
-    {
-        dbg_printf("No RAW buffer\n");
-        return;
+        return 1;
     }
 
-    /* scale useful range (black...white) to 0...1023 or less */
-    int black = raw_info.black_level;
-    int white = raw_info.white_level;
-    int div = 0;
-    while (((white-black) >> div) >= 1024)
+    if (vram_lv.width != raw_preview_cols_width)
     {
-        div++;
+        if (raw_preview_cols) free(raw_preview_cols);
+        raw_preview_cols = malloc(vram_lv.width * sizeof(raw_preview_cols[0]));
+        raw_preview_cols_width = 0;
+        if (!raw_preview_cols)
+        {
+            return 0;
+        }
     }
 
-    uint8_t gamma[1024];
-
-    for (int i = 0; i < 1024; i++)
+    /* we will always choose a red or green pixel */
+    for (int x = 0; x < vram_lv.width; x++)
     {
-        /* only show 10 bits */
-        int g = COERCE(raw_to_ev((i << div) + black) + 10, 0, 10) * 255 / 10;
-        gamma[i] = g * g / 255; /* gamma 2 */
+        raw_preview_cols[x] = LV2RAW_X(x) & ~1;
     }
 
-    int x1 = COERCE(RAW2LV_X(preview_rect_x), 0, vram_lv.width);
-    int x2 = COERCE(RAW2LV_X(preview_rect_x + preview_rect_w), 0, vram_lv.width);
-    if (x2 < x1) return;
-
-    /* cache the LV to RAW transformation for the inner loop to make it faster */
-    /* we will always choose a green pixel */
-
-    int* lv2rx = malloc(x2 * 4);
-    if (!lv2rx) return;
-    for (int x = x1; x < x2; x++)
-        lv2rx[x] = LV2RAW_X(x) & ~1;
-
-    for (int y = y1; y < y2; y++)
-    {
-        int yr = LV2RAW_Y(y) | 1;
-
-        if (yr <= preview_rect_y || yr >= preview_rect_y + preview_rect_h)
-        {
-            /* out of range, just fill with black */
-            memset(&lv64[LV(0,y)/8], 0, vram_lv.pitch);
-            continue;
-        }
-
-        /* fill left/right borders with black */
-        memset(&lv64[LV(0,y)/8],  0, LV(x1,y) - LV(0,y)/8*8);
-        memset(&lv64[LV(x2,y)/8], 0, LV(0,1) - LV(x2,0)/8*8);
-
-        struct raw_pixblock * row = (void*)raw + yr * raw_info.pitch;
-
-        if (y%2) continue;
-
-        for (int x = x1; x < x2; x += 4)
-        {
-            int xr = lv2rx[x];
-            struct raw_pixblock * p = row + (xr/8);
-            int c = p->a;
-            uint64_t Y = gamma[COERCE(c - black, 0, white-black) >> div];
-            Y = (Y << 8) | (Y << 24) | (Y << 40) | (Y << 56);
-            int idx = LV(x,y)/8;
-            lv64[idx] = Y;
-            lv64[idx + vram_lv.pitch/8] = Y;
-        }
-    }
-    free(lv2rx);
+    raw_preview_cols_width = vram_lv.width;
+    raw_preview_cols_sx = lv2raw.sx;
+    raw_preview_cols_tx = lv2raw.tx;
+    return 1;
 }
 
 void FAST raw_preview_fast_ex(void* raw_buffer, void* lv_buffer, int y1, int y2, int quality)
@@ -2354,17 +2219,76 @@ void FAST raw_preview_fast_ex(void* raw_buffer, void* lv_buffer, int y1, int y2,
     if (quality == -1)
         quality = 0;
 
+    uint32_t * lv = CACHEABLE(lv_buffer);
+    if (!lv)
+    {
+        dbg_printf("No YUV buffer\n");
+        return;
+    }
+
+    void * raw = CACHEABLE(raw_buffer);
+    if (!raw)
+    {
+        dbg_printf("No RAW buffer\n");
+        return;
+    }
+
+    int x1 = COERCE(RAW2LV_X(preview_rect_x), 0, vram_lv.width);
+    int x2 = COERCE(RAW2LV_X(preview_rect_x + preview_rect_w), 0, vram_lv.width);
+    if (x2 < x1) return;
+
+    take_semaphore(raw_preview_sem, 0);
+
+    raw_preview_update_gamma();
+
+    if (!raw_preview_update_cols())
+    {
+        give_semaphore(raw_preview_sem);
+        return;
+    }
+
+    struct raw_preview_job job = {
+        .raw        = raw,
+        .raw_pitch  = raw_info.pitch,
+        .lv         = lv,
+        .lv_pitch   = vram_lv.pitch,
+        .y1         = y1,
+        .y2         = y2,
+        .x1         = x1,
+        .x2         = x2,
+        .raw_sy     = lv2raw.sy,
+        .raw_ty     = lv2raw.ty,
+        .raw_top    = preview_rect_y,
+        .raw_bottom = preview_rect_y + preview_rect_h,
+        .raw_x      = raw_preview_cols,
+        .gamma_rb   = raw_preview_gamma_rb,
+        .gamma_g    = raw_preview_gamma_g,
+        .black      = raw_preview_black,
+        .white      = raw_preview_white,
+        .div        = raw_preview_div,
+        .yuv        = raw_preview_yuv,
+    };
+
     switch (quality)
     {
         case RAW_PREVIEW_GRAY_ULTRA_FAST:
-            raw_preview_fast_work(raw_buffer, lv_buffer, y1, y2);
+            dbg_printf("Raw grayscale preview...\n");
+            raw_preview_gray(&job);
+            break;
+
+        case RAW_PREVIEW_COLOR_LOWRES:
+            dbg_printf("Raw low-res color preview...\n");
+            raw_preview_color_lowres(&job);
             break;
 
         case RAW_PREVIEW_COLOR_HALFRES:
         default:
-            raw_preview_color_work(raw_buffer, lv_buffer, y1, y2);
+            dbg_printf("Raw color preview...\n");
+            raw_preview_color(&job);
             break;
     }
+
+    give_semaphore(raw_preview_sem);
 }
 
 void FAST raw_preview_fast()
@@ -2765,6 +2689,7 @@ static struct menu_entry debug_menus[] = {
 static void raw_init()
 {
     raw_sem = create_named_semaphore("raw_sem", 1);
+    raw_preview_sem = create_named_semaphore("raw_preview_sem", 1);
 
     #ifdef RAW_DEBUG_TYPE
     menu_add("Debug", debug_menus, COUNT(debug_menus));
@@ -0,0 +1,91 @@
+/**\file
+ * Decimated copy of the raw frame, for the raw overlays.
+ */
+
+#include <string.h>
+#include "raw_grid.h"
+
+void raw_grid_build(struct raw_grid * grid, const void * raw_buffer, int width, int height)
+{
+    const struct raw_pixblock * buf = raw_buffer;
+    const int up = width * 2 / 8;       /* two lines above, as in raw_red_pixel_dark */
+    const int cols = grid->cols;
+
+    for (int r = 0; r < grid->rows; r++)
+    {
+        struct raw_grid_cell * cell = grid->cells + r * cols;
+        const int y = grid->raw_y[r];
+        const int yr = (y / 2) * 2;     /* red and green */
+        const int yb = yr - 1;          /* blue */
+
+        /* the lines above must be in the buffer, too */
+        if (y < 0 || yr < 4 || yr >= height)
+        {
+            memset(cell, 0, cols * sizeof(cell[0]));
+            continue;
+        }
+
+        for (int c = 0; c < cols; c++, cell++)
+        {
+            const int x = grid->raw_x[c];
+
+            if (x < 0 || x >= width)
+            {
+                memset(cell, 0, sizeof(cell[0]));
+                continue;
+            }
+
+            const struct raw_pixblock * p = buf + (yr * width + x) / 8;
+            const struct raw_pixblock * q = buf + (yb * width + x) / 8;
+            cell->r  = p->a;
+            cell->g  = p->h;
+            cell->b  = q->h;
+            cell->r2 = p[-up].a;
+            cell->g2 = p[-up].h;
+            cell->b2 = q[-up].h;
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void raw_grid_histogram_rows(const struct raw_grid * grid, int * hist, const int gray_projection,
+                             int row_start, int row_end, int row_step, int col_step)
+{
+    for (int r = row_start; r < row_end; r += row_step)
+    {
+        const struct raw_grid_cell * cell = raw_grid_row(grid, r);
+        for (int c = 0; c < grid->cols; c += col_step)
+        {
+            hist[raw_cell_gray(&cell[c], gray_projection) & 16383]++;
+        }
+    }
+}
+
+void raw_grid_histogram(const struct raw_grid * grid, int * hist, int gray_projection,
+                        int row_start, int row_end, int row_step, int col_step)
+{
+    if (row_start < 0) row_start = 0;
+    if (row_end > grid->rows) row_end = grid->rows;
+    if (row_step < 1) row_step = 1;
+    if (col_step < 1) col_step = 1;
+
+    /* the ones used by ETTR and deflicker get their own loop */
+    switch (gray_projection)
+    {
+        case GRAY_PROJECTION_GREEN:
+            raw_grid_histogram_rows(grid, hist, GRAY_PROJECTION_GREEN, row_start, row_end, row_step, col_step);
+            break;
+        case GRAY_PROJECTION_MEDIAN_RGB:
+            raw_grid_histogram_rows(grid, hist, GRAY_PROJECTION_MEDIAN_RGB, row_start, row_end, row_step, col_step);
+            break;
+        case GRAY_PROJECTION_MAX_RGB:
+            raw_grid_histogram_rows(grid, hist, GRAY_PROJECTION_MAX_RGB, row_start, row_end, row_step, col_step);
+            break;
+        case GRAY_PROJECTION_MAX_RB:
+            raw_grid_histogram_rows(grid, hist, GRAY_PROJECTION_MAX_RB, row_start, row_end, row_step, col_step);
+            break;
+        default:
+            raw_grid_histogram_rows(grid, hist, gray_projection, row_start, row_end, row_step, col_step);
+            break;
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef _raw_grid_h_
+#define _raw_grid_h_
+
+/*
+ * Decimated copy of the raw frame, for the raw overlays.
+ *
+ * Raw zebras, histogram, ETTR / deflicker percentiles and spotmeter all look
+ * at the raw buffer from BMP coordinates, through raw_red_pixel & co, which
+ * locate and unpack a struct raw_pixblock on every call. Here, the pixels
+ * they use are unpacked once, on a grid of BMP positions (every RAW_GRID_DX
+ * pixels of every RAW_GRID_DY rows), into 16-bit values, and all consumers
+ * read them from there.
+ *
+ * Each cell holds what raw_red_pixel, raw_green_pixel and raw_blue_pixel
+ * return for its position, and the same pixels two lines above (the other
+ * exposure with dual ISO), so the _dark and _bright variants are there too.
+ *
+ * No DryOS dependencies; src/test builds it on the PC.
+ */
+
+#include <stdint.h>
+#include "raw.h"
+
+#define RAW_GRID_DX         8       /* BMP pixels; as raw zebras and histogram */
+#define RAW_GRID_DY         2       /* BMP rows */
+#define RAW_GRID_MAX_COLS   120     /* 960 pixels */
+#define RAW_GRID_MAX_ROWS   320     /* 640 rows */
+
+struct raw_grid_cell
+{
+    uint16_t r, g, b;               /* raw_red_pixel, raw_green_pixel, raw_blue_pixel */
+    uint16_t r2, g2, b2;            /* the same pixels, two lines above */
+};
+
+struct raw_grid
+{
+    /* cell (c, r) is at BMP (x0 + c * RAW_GRID_DX, y0 + r * RAW_GRID_DY),
+     * that is, at raw (raw_x[c], raw_y[r]); cells outside the raw buffer are 0 */
+    int x0, y0;
+    int cols, rows;
+    int raw_x[RAW_GRID_MAX_COLS];
+    int raw_y[RAW_GRID_MAX_ROWS];
+
+    /* row by row; at least cols * rows of them */
+    struct raw_grid_cell * cells;
+};
+
+/* unpacks the cells from a 14-bit raw buffer, of width x height pixels */
+void raw_grid_build(struct raw_grid * grid, const void * raw_buffer, int width, int height);
+
+static inline const struct raw_grid_cell * raw_grid_row(const struct raw_grid * grid, int r)
+{
+    return grid->cells + r * grid->cols;
+}
+
+/* raw_*_pixel_dark and raw_*_pixel_bright */
+static inline int raw_cell_min(int a, int b) { return a < b ? a : b; }
+static inline int raw_cell_max(int a, int b) { return a > b ? a : b; }
+static inline int raw_cell_red_dark(const struct raw_grid_cell * c)      { return raw_cell_min(c->r, c->r2); }
+static inline int raw_cell_green_dark(const struct raw_grid_cell * c)    { return raw_cell_min(c->g, c->g2); }
+static inline int raw_cell_blue_dark(const struct raw_grid_cell * c)     { return raw_cell_min(c->b, c->b2); }
+static inline int raw_cell_red_bright(const struct raw_grid_cell * c)    { return raw_cell_max(c->r, c->r2); }
+static inline int raw_cell_green_bright(const struct raw_grid_cell * c)  { return raw_cell_max(c->g, c->g2); }
+static inline int raw_cell_blue_bright(const struct raw_grid_cell * c)   { return raw_cell_max(c->b, c->b2); }
+
+/* raw_get_gray_pixel at the cell */
+static inline int raw_cell_gray(const struct raw_grid_cell * c, int gray_projection)
+{
+    int r = c->r, g = c->g, b = c->b;
+
+    switch (gray_projection & GRAY_PROJECTION_BRIGHT_DARK_MASK)
+    {
+        case GRAY_PROJECTION_DARK_ONLY:
+            r = raw_cell_red_dark(c);
+            g = raw_cell_green_dark(c);
+            b = raw_cell_blue_dark(c);
+            break;
+
+        case GRAY_PROJECTION_BRIGHT_ONLY:
+            r = raw_cell_red_bright(c);
+            g = raw_cell_green_bright(c);
+            b = raw_cell_blue_bright(c);
+            break;
+
+        default:
+            break;
+    }
+
+    switch (gray_projection & 0xFF)
+    {
+        case GRAY_PROJECTION_RED:
+            return r;
+        case GRAY_PROJECTION_GREEN:
+            return g;
+        case GRAY_PROJECTION_BLUE:
+            return b;
+        case GRAY_PROJECTION_AVERAGE_RGB:
+            return (r + g + b) / 3;
+        case GRAY_PROJECTION_MAX_RGB:
+            return raw_cell_max(raw_cell_max(r, g), b);
+        case GRAY_PROJECTION_MAX_RB:
+            return raw_cell_max(r, b);
+        case GRAY_PROJECTION_MEDIAN_RGB:
+        {
+            /* as in raw_get_gray_pixel */
+            int M = raw_cell_max(raw_cell_max(r, g), b);
+            int m = raw_cell_min(raw_cell_min(r, g), b);
+            if (r >= m && r <= M) return r;
+            if (g >= m && g <= M) return g;
+            return b;
+        }
+        default:
+            return -1;
+    }
+}
+
+/* adds the gray levels of every col_step-th cell of every row_step-th row,
+ * from row_start to row_end (excluded), to hist[16384] */
+void raw_grid_histogram(const struct raw_grid * grid, int * hist, int gray_projection,
+                        int row_start, int row_end, int row_step, int col_step);
+
+#endif
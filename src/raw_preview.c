@@ -0,0 +1,163 @@
+/**\file
+ * Raw to YUV preview kernels.
+ */
+
+#include <string.h>
+#include "raw_preview.h"
+#include "imgconv.h"
+
+static inline int clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* pixel i of a raw_pixblock (a ... h) from its 7 words, taken as a 14-bit
+ * big-endian bit stream; see the encoding in raw.h. Pixel i starts at bit
+ * 14*i, in the 32-bit window of words raw_word[i] and raw_word[i] + 1,
+ * which stays within the block, so it's a shift and a mask. */
+static const uint8_t raw_word[8]  = {  0,  0,  1,  2,  3,  4,  5,  5 };
+static const uint8_t raw_shift[8] = { 18,  4,  6,  8, 10, 12, 14,  0 };
+
+static inline __attribute__((always_inline))
+int raw_pixel(const uint16_t * w, int i)
+{
+    const uint16_t * v = w + raw_word[i];
+    return (((uint32_t) v[0] << 16 | v[1]) >> raw_shift[i]) & 0x3FFF;
+}
+
+static inline int raw_row(const struct raw_preview_job * job, int y)
+{
+    return ((y * job->raw_sy) >> 10) + job->raw_ty;
+}
+
+/* RGGB cell at raw (xr, yr), both even, to an UYVY word */
+static inline __attribute__((always_inline))
+uint32_t raw_cell_yuv(const struct raw_preview_job * job, const uint8_t * row, int xr)
+{
+    const uint16_t * p = (const uint16_t *)(row + (xr >> 3) * 14);          /* RG */
+    const uint16_t * q = (const uint16_t *)(row + (xr >> 3) * 14 + job->raw_pitch);  /* GB, next line */
+    const int i = xr & 6;
+    const int r  = raw_pixel(p, i);
+    const int g1 = raw_pixel(p, i + 1);
+    const int g2 = raw_pixel(q, i);
+    const int b  = raw_pixel(q, i + 1);
+
+    const int black = job->black;
+    const int range = job->white - black;
+    const int div = job->div;
+    const int R = job->gamma_rb[clamp(r - black, 0, range) >> div];
+    const int G = job->gamma_g[clamp(((g1 + g2) >> 1) - black, 0, range) >> div];
+    const int B = job->gamma_rb[clamp(b - black, 0, range) >> div];
+    const int * k = job->yuv;
+
+    const int Y = clamp((k[0] * R + k[1] * G + k[2] * B) / 1024, 0, 255);
+    const int U = clamp((k[3] * R + k[4] * G + k[5] * B) / 1024, -128, 127);
+    const int V = clamp((k[6] * R + k[7] * G + k[8] * B) / 1024, -128, 127);
+    return UYVY_PACK(U,Y,V,Y);
+}
+
+void raw_preview_color(const struct raw_preview_job * job_in)
+{
+    /* local copy: the output stores can't alias it */
+    const struct raw_preview_job copy = *job_in;
+    const struct raw_preview_job * job = &copy;
+    const int pitch = job->lv_pitch;
+    const int x1 = job->x1;
+    const int x2 = job->x2;
+
+    for (int y = job->y1; y < job->y2; y++)
+    {
+        uint8_t * lv_row = (uint8_t *) job->lv + y * pitch;
+        const int yr = raw_row(job, y) & ~1;
+
+        if (yr <= job->raw_top || yr >= job->raw_bottom)
+        {
+            /* out of range, just fill with black */
+            memset(lv_row, 0, pitch);
+            continue;
+        }
+
+        /* fill left/right borders with black */
+        memset(lv_row, 0, x1 * 2);
+        memset(lv_row + (x2 * 2 & ~3), 0, pitch - (x2 * 2 & ~3));
+
+        const uint8_t * row = (const uint8_t *) job->raw + yr * job->raw_pitch;
+        uint32_t * out = (uint32_t *) lv_row + (x1 >> 1);
+
+        /* half-res horizontally, to simplify YUV422 math */
+        for (int x = x1; x < x2; x += 2)
+        {
+            *out++ = raw_cell_yuv(job, row, job->raw_x[x]);
+        }
+    }
+}
+
+/* the low-res modes draw every 4th pixel of every 2nd row, as 8-byte (4 pixel) blocks */
+static inline __attribute__((always_inline))
+void raw_preview_lowres(const struct raw_preview_job * job_in, const int color)
+{
+    const struct raw_preview_job copy = *job_in;
+    const struct raw_preview_job * job = &copy;
+    uint8_t * lv = (uint8_t *) job->lv;
+    const int pitch = job->lv_pitch;
+    const int x1 = job->x1;
+    const int x2 = job->x2;
+
+    for (int y = job->y1; y < job->y2; y++)
+    {
+        const int yr = color ? raw_row(job, y) & ~1 : raw_row(job, y) | 1;
+        const int start = (y * pitch) / 8 * 8;
+
+        if (yr <= job->raw_top || yr >= job->raw_bottom)
+        {
+            /* out of range, just fill with black */
+            memset(lv + start, 0, pitch);
+            continue;
+        }
+
+        /* fill left/right borders with black */
+        memset(lv + start, 0, x1 * 2 + y * pitch - start);
+        memset(lv + (y * pitch + x2 * 2) / 8 * 8, 0, pitch - (x2 * 2) / 8 * 8);
+
+        if (y % 2) continue;
+
+        const uint8_t * row = (const uint8_t *) job->raw + yr * job->raw_pitch;
+        const int below = (color && y + 1 >= job->y2) ? 0 : pitch / 8 * 2;
+
+        for (int x = x1; x < x2; x += 4)
+        {
+            const int xr = job->raw_x[x];
+            uint32_t word;
+
+            if (color)
+            {
+                word = raw_cell_yuv(job, row, xr);
+            }
+            else
+            {
+                /* green pixel (odd line), no chroma */
+                const uint16_t * p = (const uint16_t *)(row + (xr >> 3) * 14);
+                const int c = p[0] >> 2;
+                const uint32_t Y = job->gamma_g[clamp(c - job->black, 0, job->white - job->black) >> job->div];
+                word = (Y << 8) | (Y << 24);
+            }
+
+            uint32_t * out = (uint32_t *)(lv + (y * pitch + x * 2) / 8 * 8);
+            out[0] = out[1] = word;
+            if (below)
+            {
+                out[below] = out[below + 1] = word;
+            }
+        }
+    }
+}
+
+void raw_preview_color_lowres(const struct raw_preview_job * job)
+{
+    raw_preview_lowres(job, 1);
+}
+
+void raw_preview_gray(const struct raw_preview_job * job)
+{
+    raw_preview_lowres(job, 0);
+}
@@ -0,0 +1,59 @@
+#ifndef _raw_preview_h_
+#define _raw_preview_h_
+
+/*
+ * Raw to YUV preview kernels (raw_preview_fast_ex).
+ *
+ * Raw pixels are unpacked from the 16-bit words of each struct raw_pixblock
+ * with shifts and masks, without branching on the pixel position. Gamma
+ * curves and the LiveView to raw column map are tables the caller keeps
+ * until the levels or the geometry change. Output is written as whole UYVY
+ * words.
+ *
+ * No DryOS dependencies; src/test builds it on the PC.
+ */
+
+#include <stdint.h>
+
+#define RAW_PREVIEW_LEVELS  1024    /* gamma table size; 10 bits, small enough for the data cache */
+
+struct raw_preview_job
+{
+    /* input: 14-bit raw buffer */
+    const void * raw;
+    int raw_pitch;
+
+    /* output: UYVY, LiveView rows y1 ... y2-1; only columns x1 ... x2-1 have the image */
+    uint32_t * lv;
+    int lv_pitch;                   /* bytes */
+    int y1, y2;
+    int x1, x2;
+
+    /* raw row for a LiveView row: ((y * raw_sy) >> 10) + raw_ty (LV2RAW_Y);
+     * rows outside raw_top ... raw_bottom (excluded) are black */
+    int raw_sy, raw_ty;
+    int raw_top, raw_bottom;
+
+    /* raw column for each LiveView column, even (red or green) */
+    const int * raw_x;
+
+    /* 8-bit level for each raw value, at gamma[(raw - black) >> div], clipped to black ... white;
+     * red and blue use gamma_rb (white balance 2,1,2); ((white - black) >> div) < RAW_PREVIEW_LEVELS */
+    const uint8_t * gamma_rb;
+    const uint8_t * gamma_g;
+    int black, white, div;
+
+    /* as in rgb2yuv422: Y, U and V, from R, G and B, x1024 */
+    const int * yuv;
+};
+
+/* RAW_PREVIEW_COLOR_HALFRES: one Bayer cell for every 2 pixels of every row */
+void raw_preview_color(const struct raw_preview_job * job);
+
+/* RAW_PREVIEW_COLOR_LOWRES: one Bayer cell for every 4x2 pixels */
+void raw_preview_color_lowres(const struct raw_preview_job * job);
+
+/* RAW_PREVIEW_GRAY_ULTRA_FAST: one green pixel for every 4x2 pixels */
+void raw_preview_gray(const struct raw_preview_job * job);
+
+#endif
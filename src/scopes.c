@@ -0,0 +1,211 @@
+/**\file
+ * Fused histogram / waveform / vectorscope scan of the YUV422 LiveView buffer.
+ */
+
+#include "scopes.h"
+#include "imgconv.h"
+#include "math.h"
+
+/* magic zoom borders, same values as MZ_* in histogram.h */
+#define SCOPES_MZ_WHITE 0xFE12FE34
+#define SCOPES_MZ_BLACK 0x00120034
+#define SCOPES_MZ_GREEN 0xB68DB69E
+
+#define WAVEFORM_SATURATION     250
+#define VECTORSCOPE_SATURATION  (0x2A << 2)
+
+/* 16x16 bit multiplies from the ARMv5E DSP extension; U and V fit in the bottom halfwords */
+#if defined(__ARM_ARCH_5TE__) || defined(__ARM_ARCH_5TEJ__)
+static inline int32_t smulbb(int32_t a, int32_t b)
+{
+    int32_t r;
+    asm("smulbb %0, %1, %2" : "=r"(r) : "r"(a), "r"(b));
+    return r;
+}
+
+static inline int32_t smlabb(int32_t a, int32_t b, int32_t acc)
+{
+    int32_t r;
+    asm("smlabb %0, %1, %2, %3" : "=r"(r) : "r"(a), "r"(b), "r"(acc));
+    return r;
+}
+#else
+#define smulbb(a, b)        ((int32_t)(int16_t)(a) * (int16_t)(b))
+#define smlabb(a, b, acc)   ((int32_t)(int16_t)(a) * (int16_t)(b) + (acc))
+#endif
+
+static inline int clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void saturating_add(uint8_t * p, int weight, int limit)
+{
+    int v = *p;
+    if (v < limit)
+    {
+        v += weight;
+        *p = v < limit ? v : limit;
+    }
+}
+
+/* chroma too strong for the scope: mark the rim in the direction of U,V */
+static void vectorscope_rim(uint8_t * vectorscope, int U, int V, int r, uint8_t color)
+{
+    const int r_sqrt = (int)sqrtf(r);
+    for (int R = 124; R < 128; R++)
+    {
+        int c = U * R / r_sqrt;
+        int s = V * R / r_sqrt;
+        vectorscope[(c + 128) + (s + 128) * 256] = 255 - color;
+    }
+}
+
+/* the inner loop; flags is a constant in each instance, so the unused scopes compile away */
+static inline __attribute__((always_inline))
+void scopes_scan_flags(struct scopes_job * job, const int flags)
+{
+    const uint32_t * buf = job->buf;
+    const uint16_t * cols = job->cols;
+    const int col_count = job->col_count;
+    const int weight = job->weight;
+
+    uint32_t * hist = job->hist;
+    uint32_t * hist_r = job->hist_r;
+    uint32_t * hist_g = job->hist_g;
+    uint32_t * hist_b = job->hist_b;
+    uint32_t hist_max = job->hist_max;
+    uint32_t total_px = job->total_px;
+
+    uint8_t * waveform = job->waveform;
+    const uint8_t * waveform_cols = job->waveform_cols;
+    uint16_t waveform_rows[256];
+
+    uint8_t * vectorscope = job->vectorscope;
+    const int gain = job->vectorscope_gain;
+    uint32_t dither = job->dither;
+
+    if (flags & SCOPES_WAVEFORM)
+    {
+        /* luma -> offset of the waveform row */
+        for (int Y = 0; Y < 256; Y++)
+        {
+            waveform_rows[Y] = ((Y * job->waveform_height) >> 8) * job->waveform_width;
+        }
+    }
+
+    for (int r = 0; r < job->row_count; r++)
+    {
+        const uint32_t * row = buf + job->rows[r];
+
+        for (int c = 0; c < col_count; c++)
+        {
+            const uint32_t pixel = row[cols[c]];
+
+            if (flags & SCOPES_SKIP_MZ)
+            {
+                if (pixel == SCOPES_MZ_WHITE || pixel == SCOPES_MZ_BLACK || pixel == SCOPES_MZ_GREEN)
+                    continue;
+            }
+
+            /* both lumas in one register: Y2 << 16 | Y1 */
+            const uint32_t yy = (pixel >> 8) & 0x00FF00FF;
+            const int Y = ((yy & 0xFFFF) + (yy >> 16)) >> 1;
+
+            if (flags & SCOPES_HIST_RGB)
+            {
+                const int gu = UYVY_GET_U(pixel);
+                const int gv = UYVY_GET_V(pixel);
+                const int R = clamp255(Y + job->yuv2rgb_rv[gv]);
+                const int G = clamp255(Y + job->yuv2rgb_gu[gu] + job->yuv2rgb_gv[gv]);
+                const int B = clamp255(Y + job->yuv2rgb_bu[gu]);
+                hist_r[(R * SCOPES_HIST_WIDTH) >> 8]++;
+                hist_g[(G * SCOPES_HIST_WIDTH) >> 8]++;
+                hist_b[(B * SCOPES_HIST_WIDTH) >> 8]++;
+            }
+
+            if (flags & SCOPES_HIST)
+            {
+                total_px++;
+                const int level = (Y * SCOPES_HIST_WIDTH) >> 8;
+
+                /* ignore the 0 bin, it generates too much noise */
+                const uint32_t count = ++hist[level];
+                if (level && count > hist_max)
+                    hist_max = count;
+            }
+
+            if (flags & SCOPES_WAVEFORM)
+            {
+                saturating_add(&waveform[waveform_rows[Y] + waveform_cols[c]], weight, WAVEFORM_SATURATION);
+            }
+
+            if (flags & SCOPES_VECTORSCOPE)
+            {
+                int U = (int8_t)(pixel & 0xFF) << gain;
+                int V = -(int8_t)((pixel >> 16) & 0xFF) << gain;
+
+                const int rr = smlabb(V, V, smulbb(U, U));
+                if (rr > 124*124)
+                {
+                    vectorscope_rim(vectorscope, U, V, rr, job->vectorscope_rim);
+                    continue;
+                }
+
+                if (gain)
+                {
+                    /* simulate better resolution */
+                    dither = dither * 1664525 + 1013904223;
+                    U += (dither >> 30) & 1;
+                    V += (dither >> 31);
+                }
+
+                saturating_add(&vectorscope[(U + 128) + (V + 128) * 256], weight, VECTORSCOPE_SATURATION);
+            }
+        }
+    }
+
+    job->hist_max = hist_max;
+    job->total_px = total_px;
+    job->dither = dither;
+}
+
+#define SCOPES_VARIANT(flags) \
+    static void scopes_scan_##flags(struct scopes_job * job) { scopes_scan_flags(job, flags); }
+
+SCOPES_VARIANT(0)  SCOPES_VARIANT(1)  SCOPES_VARIANT(2)  SCOPES_VARIANT(3)
+SCOPES_VARIANT(4)  SCOPES_VARIANT(5)  SCOPES_VARIANT(6)  SCOPES_VARIANT(7)
+SCOPES_VARIANT(8)  SCOPES_VARIANT(9)  SCOPES_VARIANT(10) SCOPES_VARIANT(11)
+SCOPES_VARIANT(12) SCOPES_VARIANT(13) SCOPES_VARIANT(14) SCOPES_VARIANT(15)
+SCOPES_VARIANT(16) SCOPES_VARIANT(17) SCOPES_VARIANT(18) SCOPES_VARIANT(19)
+SCOPES_VARIANT(20) SCOPES_VARIANT(21) SCOPES_VARIANT(22) SCOPES_VARIANT(23)
+SCOPES_VARIANT(24) SCOPES_VARIANT(25) SCOPES_VARIANT(26) SCOPES_VARIANT(27)
+SCOPES_VARIANT(28) SCOPES_VARIANT(29) SCOPES_VARIANT(30) SCOPES_VARIANT(31)
+
+static void (*const scopes_variants[32])(struct scopes_job *) = {
+    scopes_scan_0,  scopes_scan_1,  scopes_scan_2,  scopes_scan_3,
+    scopes_scan_4,  scopes_scan_5,  scopes_scan_6,  scopes_scan_7,
+    scopes_scan_8,  scopes_scan_9,  scopes_scan_10, scopes_scan_11,
+    scopes_scan_12, scopes_scan_13, scopes_scan_14, scopes_scan_15,
+    scopes_scan_16, scopes_scan_17, scopes_scan_18, scopes_scan_19,
+    scopes_scan_20, scopes_scan_21, scopes_scan_22, scopes_scan_23,
+    scopes_scan_24, scopes_scan_25, scopes_scan_26, scopes_scan_27,
+    scopes_scan_28, scopes_scan_29, scopes_scan_30, scopes_scan_31,
+};
+
+void scopes_scan(struct scopes_job * job)
+{
+    int flags = job->flags & 31;
+
+    if (flags & SCOPES_HIST_RGB)
+    {
+        flags |= SCOPES_HIST;
+    }
+
+    if (!(flags & (SCOPES_HIST | SCOPES_WAVEFORM | SCOPES_VECTORSCOPE)))
+    {
+        return;
+    }
+
+    scopes_variants[flags](job);
+}
@@ -0,0 +1,70 @@
+#ifndef _scopes_h_
+#define _scopes_h_
+
+/*
+ * Fused LiveView analysis: histogram, waveform and vectorscope
+ * computed in a single pass over the YUV422 buffer.
+ *
+ * Each combination of enabled scopes has its own inner loop,
+ * specialized at compile time, so the per-pixel code only does
+ * the work that is actually needed.
+ *
+ * No DryOS dependencies; src/test builds it on the PC.
+ */
+
+#include <stdint.h>
+
+/* what to compute (job flags) */
+#define SCOPES_HIST         1   /* luma histogram */
+#define SCOPES_HIST_RGB     2   /* RGB histogram (with SCOPES_HIST) */
+#define SCOPES_WAVEFORM     4
+#define SCOPES_VECTORSCOPE  8
+#define SCOPES_SKIP_MZ      16  /* ignore magic zoom borders (MZ_* in histogram.h) */
+
+#define SCOPES_HIST_WIDTH   128 /* HIST_WIDTH */
+#define SCOPES_MAX_ROWS     640
+#define SCOPES_MAX_COLS     960
+
+struct scopes_job
+{
+    int flags;
+
+    /* input: UYVY words; rows and columns sampled, as word offsets */
+    const uint32_t * buf;
+    uint32_t rows[SCOPES_MAX_ROWS];
+    uint16_t cols[SCOPES_MAX_COLS];
+    int row_count;
+    int col_count;
+
+    /* each sample stands for this many pixels of the full scan (waveform, vectorscope) */
+    int weight;
+
+    /* histogram: luma always, RGB with SCOPES_HIST_RGB; bins are accumulated */
+    uint32_t * hist;
+    uint32_t * hist_r;
+    uint32_t * hist_g;
+    uint32_t * hist_b;
+    uint32_t hist_max;          /* ignoring the 0 bin */
+    uint32_t total_px;
+    const int * yuv2rgb_rv;     /* precompute_yuv2rgb tables */
+    const int * yuv2rgb_gu;
+    const int * yuv2rgb_gv;
+    const int * yuv2rgb_bu;
+
+    /* waveform: waveform_width x waveform_height bins, saturating at 250 */
+    uint8_t * waveform;
+    int waveform_width;
+    int waveform_height;
+    uint8_t waveform_cols[SCOPES_MAX_COLS];  /* bin for each sampled column */
+
+    /* vectorscope: 256 x 256 bins, saturating at 168 */
+    uint8_t * vectorscope;
+    int vectorscope_gain;
+    uint8_t vectorscope_rim;    /* color index marking out-of-range chroma */
+    uint32_t dither;            /* random state for the gain */
+};
+
+/* runs the loop specialized for job->flags */
+void scopes_scan(struct scopes_job * job);
+
+#endif
@@ -45,6 +45,14 @@ static void stateobj_install_hook(struct state_object * stateobj, int input, int
 */
 
 static volatile int vsync_counter = 0;
+static volatile int lv_frame_number = 0;
+
+/* counts LiveView frames; unlike vsync_counter, never reset */
+int get_lv_frame_number()
+{
+    return lv_frame_number;
+}
+
 #ifndef CONFIG_7D_MASTER
 /* waits for N LiveView frames */
 int wait_lv_frames(int num_frames)
@@ -78,6 +86,7 @@ extern void digic_iso_step();
 static void FAST vsync_func() // called once per frame.. in theory :)
 {
     vsync_counter++;
+    lv_frame_number++;
 
     #if defined(CONFIG_MODULES)
     module_exec_cbr(CBR_VSYNC);
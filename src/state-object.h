@@ -73,4 +73,7 @@ SIZE_CHECK_STRUCT( state_object, 0x20 );
 /* waits for N LiveView frames (using state object vsync) */
 int wait_lv_frames(int num_frames);
 
+/* number of the current LiveView frame (from state object vsync) */
+int get_lv_frame_number();
+
 #endif
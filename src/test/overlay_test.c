@@ -0,0 +1,571 @@
+/*
+ * exactness test and benchmark for the zebra / false color renderer (overlay.c)
+ *
+ * the reference is the per-pixel code from draw_zebras() (luma and RGB)
+ * and draw_false_downsampled(), walking the buffers through BM2LV and
+ * picking the colors for every pixel.
+ *
+ * the test draws a few frames over a BMP that also has Canon and ML
+ * graphics on it, with Canon drawing and erasing between frames; the BMP
+ * and its mirror must match the reference after every frame.
+ * "overlay_test bench" prints the time per frame of both, on a frame
+ * that changed and on one that didn't.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "overlay.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define COERCE(x,lo,hi) ((x) < (lo) ? (lo) : (x) > (hi) ? (hi) : (x))
+
+#define BMPPITCH        960
+#define BMP_H           540
+
+#define COLOR_BLACK     0x02
+#define COLOR_CYAN      0x05
+#define COLOR_GREEN2    0x07
+#define COLOR_RED       0x08
+#define COLOR_BLUE      0x0B
+#define COLOR_MAGENTA   0x0E
+#define COLOR_YELLOW    0x0F
+
+/* BMP overlay area (os.*) and the LV buffer behind it */
+struct frame
+{
+    uint32_t * buf;
+    int width;              /* LV pixels */
+    int height;
+    int pitch;              /* bytes */
+    int x0, y0, x_max, y_max, off;
+    int sx, sy;             /* bm2lv, as in vram.c */
+    int bm2lv_x[1024];
+};
+
+static int BM2LV_X(struct frame * f, int x) { return f->bm2lv_x[x]; }
+static int BM2LV_Y(struct frame * f, int y) { return (y * f->sy) >> 10; }
+
+struct screen
+{
+    uint8_t bmp[BMPPITCH * BMP_H];
+    uint8_t mirror[BMPPITCH * BMP_H];
+};
+
+static struct screen ref, out;
+
+static int yuv2rgb_RV[256];
+static int yuv2rgb_GU[256];
+static int yuv2rgb_GV[256];
+static int yuv2rgb_BU[256];
+
+/* REC 601, from imgconv.c */
+static void precompute_yuv2rgb(void)
+{
+    for (int u = 0; u < 256; u++)
+    {
+        int8_t U = u;
+        yuv2rgb_GU[u] = (-352 * U) >> 10;
+        yuv2rgb_BU[u] = (1812 * U) >> 10;
+    }
+
+    for (int v = 0; v < 256; v++)
+    {
+        int8_t V = v;
+        yuv2rgb_RV[v] = (1437 * V) >> 10;
+        yuv2rgb_GV[v] = (-731 * V) >> 10;
+    }
+}
+
+/* from zebra.c {{{ */
+
+static int zebra_color_word_row(int c, int y)
+{
+    if (!c) return 0;
+
+    uint32_t cw = 0;
+    switch(y % 4)
+    {
+        case 0: cw = c       | c << 8;  break;
+        case 1: cw = c << 8  | c << 16; break;
+        case 2: cw = c << 16 | c << 24; break;
+        case 3: cw = c << 24 | c;       break;
+    }
+    return cw;
+}
+
+#define ZEBRA_COLOR_WORD_SOLID(x) ( (x) | (x)<<8 | (x)<<16 | (x)<<24 )
+static int zebra_rgb_color(int underexposed, int clipR, int clipG, int clipB, int y)
+{
+    if (underexposed) return zebra_color_word_row(79, y);
+
+    switch ((clipR ? 4 : 0) |
+            (clipG ? 2 : 0) |
+            (clipB ? 1 : 0))
+    {
+        case 0b111: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLACK);
+        case 0b110: return ZEBRA_COLOR_WORD_SOLID(COLOR_YELLOW);
+        case 0b101: return ZEBRA_COLOR_WORD_SOLID(COLOR_MAGENTA);
+        case 0b011: return ZEBRA_COLOR_WORD_SOLID(COLOR_CYAN);
+        case 0b100: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_RED);
+        case 0b001: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_BLUE);
+        case 0b010: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_GREEN2);
+        default: return 0;
+    }
+}
+
+/* }}} */
+
+/* reference: the per-pixel loops {{{ */
+
+static void little_cleanup(void* BP, void* MP)
+{
+    uint8_t* bp = BP; uint8_t* mp = MP;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+}
+
+static void ref_draw_zebras(struct screen * s, struct frame * f, int zll, int zlh, int rgb)
+{
+    for (int y = f->y0 + f->off; y < f->y_max - f->off; y += 2)
+    {
+        uint32_t * const v_row = f->buf + ((BM2LV_Y(f, y) * f->pitch) >> 2);
+        uint32_t * const b_row = (uint32_t *)(s->bmp + y * BMPPITCH);
+        uint32_t * const m_row = (uint32_t *)(s->mirror + y * BMPPITCH);
+
+        for (int x = f->x0; x < f->x_max; x += 4)
+        {
+            uint32_t * lvp = v_row + (BM2LV_X(f, x) >> 1);
+            uint32_t * bp = b_row + (x >> 2);
+            uint32_t * mp = m_row + (x >> 2);
+            #define BP (*bp)
+            #define MP (*mp)
+            #define BN (*(bp + BMPPITCH/4))
+            #define MN (*(mp + BMPPITCH/4))
+            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
+            if (BN != 0 && BN != MN) { little_cleanup(bp + (BMPPITCH >> 2), mp + (BMPPITCH >> 2)); continue; }
+            if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
+
+            if (rgb)
+            {
+                uint32_t uyvy = *lvp;
+                int Y = ((((uyvy) >> 24) & 0xFF) + (((uyvy) >> 8) & 0xFF)) >> 1;
+                const int gv = (uyvy >> 16) & 0xFF;
+                const int gu = uyvy & 0xFF;
+                int v = Y + yuv2rgb_RV[gv];
+                int R = COERCE(v, 0, 255);
+                v = Y + yuv2rgb_GU[gu] + yuv2rgb_GV[gv];
+                int G = COERCE(v, 0, 255);
+                v = Y + yuv2rgb_BU[gu];
+                int B = COERCE(v, 0, 255);
+
+                BP = MP = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y);
+                BN = MN = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y+1);
+            }
+            else
+            {
+                int p0 = (*lvp) >> 8 & 0xFF;
+                if (p0 > zlh)
+                {
+                    BP = MP = zebra_color_word_row(COLOR_RED, y);
+                    BN = MN = zebra_color_word_row(COLOR_RED, y+1);
+                }
+                else if (p0 < zll)
+                {
+                    BP = MP = zebra_color_word_row(COLOR_BLUE, y);
+                    BN = MN = zebra_color_word_row(COLOR_BLUE, y+1);
+                }
+                else
+                    BN = MN = BP = MP = 0;
+            }
+            #undef BP
+            #undef MP
+            #undef BN
+            #undef MN
+        }
+    }
+}
+
+static void ref_draw_false(struct screen * s, struct frame * f, const uint8_t * fc)
+{
+    for (int y = f->y0 + f->off; y < f->y_max - f->off; y += 2)
+    {
+        uint32_t * const v_row = f->buf + ((BM2LV_Y(f, y) * f->pitch) >> 2);
+        uint16_t * const b_row = (uint16_t *)(s->bmp + y * BMPPITCH);
+        uint16_t * const m_row = (uint16_t *)(s->mirror + y * BMPPITCH);
+
+        for (int x = f->x0; x < f->x_max; x += 2)
+        {
+            uint8_t * lvp = (uint8_t *)(v_row + BM2LV_X(f, x)/2); lvp++;
+            uint16_t * bp = b_row + x/2;
+            uint16_t * mp = m_row + x/2;
+            #define BP (*bp)
+            #define MP (*mp)
+            #define BN (*(bp + BMPPITCH/2))
+            #define MN (*(mp + BMPPITCH/2))
+            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
+            if (BN != 0 && BN != MN) { little_cleanup(bp + BMPPITCH/2, mp + BMPPITCH/2); continue; }
+            if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
+
+            int c = fc[*lvp]; c |= (c << 8);
+            MP = BP = c;
+            MN = BN = c;
+            #undef BP
+            #undef MP
+            #undef BN
+            #undef MN
+        }
+    }
+}
+
+/* }}} */
+
+/* the new draw_zebras() and draw_false_downsampled(), minus the DryOS parts {{{ */
+
+static struct overlay_job job;
+static uint32_t zebra_lut[4][256];
+static uint32_t zebra_rgb_lut[4][OVERLAY_RGB_CLASSES];
+static uint32_t false_lut[256];
+
+static void overlay_setup(struct screen * s, struct frame * f, int cell_width)
+{
+    job.buf = f->buf;
+    job.bmp = s->bmp;
+    job.mirror = s->mirror;
+    job.bmp_pitch = BMPPITCH;
+    job.cell_width = cell_width;
+    job.x0 = f->x0 & ~(cell_width - 1);
+    job.y0 = f->y0 + f->off;
+    job.rgb = 0;
+    job.row_count = 0;
+    job.col_count = 0;
+
+    for (int y = f->y0 + f->off; y < f->y_max - f->off && job.row_count < OVERLAY_MAX_ROWS; y += 2)
+    {
+        job.rows[job.row_count++] = (BM2LV_Y(f, y) * f->pitch) >> 2;
+    }
+
+    for (int x = f->x0; x < f->x_max && job.col_count < OVERLAY_MAX_COLS; x += cell_width)
+    {
+        job.cols[job.col_count++] = BM2LV_X(f, x) >> 1;
+    }
+}
+
+static void lut_draw_zebras(struct screen * s, struct frame * f, int zll, int zlh, int rgb)
+{
+    for (int y = 0; y < 4; y++)
+    {
+        for (int Y = 0; Y < 256; Y++)
+        {
+            zebra_lut[y][Y] =
+                Y > zlh ? zebra_color_word_row(COLOR_RED,  y) :
+                Y < zll ? zebra_color_word_row(COLOR_BLUE, y) : 0;
+        }
+
+        for (int clip = 0; clip < 8; clip++)
+        {
+            zebra_rgb_lut[y][clip] = zebra_rgb_color(0, clip & 4, clip & 2, clip & 1, y);
+        }
+        zebra_rgb_lut[y][OVERLAY_RGB_UNDER] = zebra_rgb_color(1, 0, 0, 0, y);
+    }
+
+    overlay_setup(s, f, 4);
+    job.rgb = rgb;
+    for (int i = 0; i < 4; i++)
+    {
+        job.lut[i] = zebra_lut[i];
+        job.rgb_colors[i] = zebra_rgb_lut[i];
+    }
+    job.level_lo = zll;
+    job.level_hi = zlh;
+    job.yuv2rgb_rv = yuv2rgb_RV;
+    job.yuv2rgb_gu = yuv2rgb_GU;
+    job.yuv2rgb_gv = yuv2rgb_GV;
+    job.yuv2rgb_bu = yuv2rgb_BU;
+    overlay_draw(&job);
+}
+
+static void lut_draw_false(struct screen * s, struct frame * f, const uint8_t * fc)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        false_lut[i] = fc[i] * 0x01010101;
+    }
+
+    overlay_setup(s, f, 2);
+    for (int i = 0; i < 4; i++)
+    {
+        job.lut[i] = false_lut;
+    }
+    overlay_draw(&job);
+}
+
+/* }}} */
+
+/* frames and screens {{{ */
+
+static uint32_t uyvy(int u, int y1, int v, int y2)
+{
+    return (u & 0xFF) | ((y1 & 0xFF) << 8) | ((v & 0xFF) << 16) | ((y2 & 0xFF) << 24);
+}
+
+/* overlay area x0..x_max, y0..y_max on the BMP, mapped on the whole LV buffer */
+static void frame_init(struct frame * f, int width, int height, int x0, int y0, int x_max, int y_max, int off)
+{
+    f->width = width;
+    f->height = height;
+    f->pitch = width * 2;
+    f->x0 = x0;
+    f->y0 = y0;
+    f->x_max = x_max;
+    f->y_max = y_max;
+    f->off = off;
+    f->sx = width * 1024 / x_max;
+    f->sy = height * 1024 / y_max;
+    f->buf = malloc(f->pitch * height);
+
+    for (int x = 0; x < 1024; x++)
+    {
+        f->bm2lv_x[x] = COERCE((x * f->sx) >> 10, 0, width - 1);
+    }
+}
+
+/* gradients, saturated colors and noise; brightness shifts the luma */
+static void frame_fill(struct frame * f, unsigned seed, int brightness)
+{
+    srand(seed);
+
+    for (int y = 0; y < f->height; y++)
+    {
+        for (int x = 0; x < f->width / 2; x++)
+        {
+            int Y = x * 2 * 255 / f->width + brightness + rand() % 9 - 4;
+            int u = (y * 256 / f->height) - 128;
+            int v = ((x + y) % 256) - 128;
+
+            if (y > f->height * 3 / 4)
+            {
+                /* random everything */
+                u = rand(); v = rand(); Y = rand();
+            }
+
+            f->buf[y * f->width / 2 + x] = uyvy(u, COERCE(Y, 0, 255), v, COERCE(Y + rand() % 5 - 2, 0, 255));
+        }
+    }
+}
+
+static void fill_rect(uint8_t * buf, int x0, int y0, int w, int h, uint8_t c)
+{
+    for (int y = y0; y < y0 + h; y++)
+    {
+        memset(buf + y * BMPPITCH + x0, c, w);
+    }
+}
+
+/* something drawn by Canon (BMP only) and something drawn by ML (BMP and mirror, 0x80 set) */
+static void screen_init(struct screen * s)
+{
+    memset(s, 0, sizeof(*s));
+    fill_rect(s->bmp, 0, 0, 720, 30, 0x14);
+    fill_rect(s->bmp, 101, 201, 63, 11, 0x3C);
+    fill_rect(s->bmp, 301, 101, 40, 41, 0x85);
+    fill_rect(s->mirror, 301, 101, 40, 41, 0x85);
+}
+
+/* Canon redraws some of its stuff over the overlay, or erases it */
+static void screen_canon(struct screen * s, int step)
+{
+    fill_rect(s->bmp, 51 + step * 37, 250, 91, 13, step & 1 ? 0 : 0x21);
+    s->bmp[300 * BMPPITCH + 403 + step] = 0x55;
+}
+
+/* }}} */
+
+static void test_sequence(struct frame * f, int zebras, int rgb, int zll, int zlh, const uint8_t * fc)
+{
+    screen_init(&ref);
+    screen_init(&out);
+
+    for (int step = 0; step < 5; step++)
+    {
+        frame_fill(f, 1234 + step, step * 20 - 40);
+
+        if (zebras)
+        {
+            ref_draw_zebras(&ref, f, zll, zlh, rgb);
+            lut_draw_zebras(&out, f, zll, zlh, rgb);
+        }
+        else
+        {
+            ref_draw_false(&ref, f, fc);
+            lut_draw_false(&out, f, fc);
+        }
+
+        if (memcmp(ref.bmp, out.bmp, sizeof(ref.bmp)) || memcmp(ref.mirror, out.mirror, sizeof(ref.mirror)))
+        {
+            for (int i = 0; i < BMPPITCH * BMP_H; i++)
+                if (ref.bmp[i] != out.bmp[i] || ref.mirror[i] != out.mirror[i])
+                {
+                    printf("%d,%d: ref %02x/%02x out %02x/%02x\n", i % BMPPITCH, i / BMPPITCH, ref.bmp[i], ref.mirror[i], out.bmp[i], out.mirror[i]);
+                    break;
+                }
+            printf("mismatch: %s%s, levels %d..%d, area %d,%d, step %d\n",
+                zebras ? "zebras" : "false colors", rgb ? " rgb" : "",
+                zll, zlh, f->x0, f->y0, step);
+            abort();
+        }
+
+        screen_canon(&ref, step);
+        screen_canon(&out, step);
+    }
+}
+
+/* same picture again, nothing else on the screen: nothing to write
+ * (next to Canon graphics, the cleanup erases a few of our pixels on each frame,
+ * and they are drawn again; that's what the per-pixel code did, too) */
+static void test_unchanged(struct frame * f, int zebras, const uint8_t * fc)
+{
+    memset(&out, 0, sizeof(out));
+    frame_fill(f, 1234, 0);
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (zebras) lut_draw_zebras(&out, f, 38, 216, 0);
+        else lut_draw_false(&out, f, fc);
+        TRY(i == 0 || job.cells_written == 0);
+    }
+}
+
+static void test_overlays(void)
+{
+    static struct frame lcd, hdmi, odd;
+    frame_init(&lcd, 720, 480, 0, 0, 720, 480, 0);
+    frame_init(&hdmi, 1620, 1080, 0, 0, 960, 540, 0);
+    frame_init(&odd, 1056, 704, 6, 31, 714, 470, 4);   /* not word-aligned, with y skip offset */
+
+    uint8_t palette[256];
+    srand(42);
+    for (int i = 0; i < 256; i++)
+    {
+        /* ML colors, a few transparent, one with 0x80 set (must not matter) */
+        palette[i] = i < 20 ? 0 : i == 200 ? 0x84 : 0x20 + rand() % 0x30;
+    }
+
+    struct frame * frames[] = { &lcd, &hdmi, &odd };
+    for (int i = 0; i < 3; i++)
+    {
+        struct frame * f = frames[i];
+        test_sequence(f, 1, 0, 0, 251, 0);         /* over */
+        test_sequence(f, 1, 0, 12, 256, 0);        /* under */
+        test_sequence(f, 1, 0, 38, 216, 0);        /* both */
+        test_sequence(f, 1, 1, 12, 230, 0);        /* RGB */
+        test_sequence(f, 1, 1, 0, 199, 0);
+        test_sequence(f, 0, 0, 0, 0, palette);  /* false colors */
+        test_unchanged(f, 1, 0);
+        test_unchanged(f, 0, palette);
+    }
+
+    printf("zebras and false colors: OK\n");
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#define BENCH_RUNS 50
+
+/* median time per frame, alternating two frames (changed) or repeating one */
+static double bench_run(struct frame * f, int zebras, int use_lut, int changing, const uint8_t * fc)
+{
+    static double t[BENCH_RUNS];
+    static uint32_t * frames[2];
+
+    if (!frames[0])
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            frame_fill(f, 1 + i, i * 30);
+            frames[i] = malloc(f->pitch * f->height);
+            memcpy(frames[i], f->buf, f->pitch * f->height);
+        }
+    }
+
+    screen_init(&out);
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        memcpy(f->buf, frames[changing ? i & 1 : 0], f->pitch * f->height);
+        double t0 = now_ms();
+        if (zebras && use_lut)  lut_draw_zebras(&out, f, 38, 216, 0);
+        if (zebras && !use_lut) ref_draw_zebras(&out, f, 38, 216, 0);
+        if (!zebras && use_lut)  lut_draw_false(&out, f, fc);
+        if (!zebras && !use_lut) ref_draw_false(&out, f, fc);
+        t[i] = now_ms() - t0;
+    }
+
+    for (int i = 0; i < BENCH_RUNS; i++)
+        for (int j = i + 1; j < BENCH_RUNS; j++)
+            if (t[j] < t[i]) { double tmp = t[i]; t[i] = t[j]; t[j] = tmp; }
+
+    return t[BENCH_RUNS / 2];
+}
+
+static void bench(void)
+{
+    static struct frame f;
+    frame_init(&f, 1620, 1080, 0, 0, 960, 540, 0);
+
+    uint8_t palette[256];
+    for (int i = 0; i < 256; i++)
+    {
+        palette[i] = 0x20 + i / 8;
+    }
+
+    printf("960x540 BMP, ms per frame    per-pixel    LUT\n");
+    for (int zebras = 1; zebras >= 0; zebras--)
+    {
+        for (int changing = 1; changing >= 0; changing--)
+        {
+            printf("%-12s %-15s %8.3f %8.3f\n",
+                zebras ? "zebras" : "false colors",
+                changing ? "(new frame)" : "(same frame)",
+                bench_run(&f, zebras, 0, changing, palette),
+                bench_run(&f, zebras, 1, changing, palette)
+            );
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    precompute_yuv2rgb();
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    test_overlays();
+    return 0;
+}
@@ -0,0 +1,436 @@
+/*
+ * exactness test and frame-diff benchmark for the focus peaking tiles (peaking.c)
+ *
+ * the reference is what draw_zebra_and_focus() did in LiveView before:
+ * erase every dot from the previous frame, scan the whole area and draw
+ * the pixels above the threshold (focus_found_pixel).
+ *
+ * the test plays frames that either repeat exactly or change everywhere,
+ * with the threshold moving between frames; the BMP must match the
+ * reference after every frame. "peaking_test bench" plays synthetic sequences with
+ * sensor noise (tripod shot, focus pull, pan) and prints the time per frame,
+ * the tiles scanned and how many dots differ from the reference.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "peaking.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define LV_W        720
+#define LV_H        480
+#define LV_PITCH    (LV_W * 2)
+#define BMPPITCH    960
+#define BMP_H       540
+#define MAX_DOTS    5000
+
+/* draw_zebra_and_focus() on a 720x480 screen; with an odd os.x0 (HDMI 1080), xStart is odd */
+static int X_START = 8;
+#define X_END       (720 - 8)
+#define Y_START     8
+#define Y_END       (480 - 8)
+
+static uint8_t * lv;
+static int lv_rows[BMP_H];
+static uint16_t lv_cols[BMPPITCH];
+
+struct screen
+{
+    uint8_t bmp[BMPPITCH * BMP_H];
+    uint8_t mirror[BMPPITCH * BMP_H];
+};
+
+static struct screen ref_screen, tiles_screen, blank_screen;
+static uint8_t colors[256];
+
+static int focus_color(int e)
+{
+    /* focus_peaking_color == 7: by edge strength */
+    return e > 50 ? 12 : e > 40 ? 19 : e > 30 ? 15 : e > 20 ? 5 : 9;
+}
+
+/* reference: the per-pixel dirty list {{{ */
+
+static int dirty_pixels[MAX_DOTS];
+static uint32_t dirty_pixel_values[MAX_DOTS];
+static int dirty_pixels_num = 0;
+
+static void ref_found_pixel(struct screen * s, int x, int y, int e)
+{
+    int color = focus_color(e);
+    color = (color << 8) | color;
+
+    uint16_t * const b_row = (uint16_t*)( s->bmp + y * BMPPITCH );
+    uint16_t * const m_row = (uint16_t*)( s->mirror + y * BMPPITCH );
+
+    const int x_half = x >> 1;
+    uint32_t pixel = b_row[x_half];
+    uint32_t mirror = m_row[x_half];
+    const int pos = x_half + (BMPPITCH >> 1);
+    uint32_t pixel2 = b_row[pos];
+    uint32_t mirror2 = m_row[pos];
+    if (mirror  & 0x8080)
+        return;
+    if (mirror2 & 0x8080)
+        return;
+    if (pixel  != 0 && pixel  != mirror)
+        return;
+    if (pixel2 != 0 && pixel2 != mirror2)
+        return;
+
+    if (dirty_pixels_num < MAX_DOTS)
+    {
+        dirty_pixel_values[dirty_pixels_num] = pixel + (pixel2 << 16);
+        dirty_pixels[dirty_pixels_num++] = (uint8_t*)&b_row[x_half] - s->bmp;
+    }
+
+    b_row[x_half] = b_row[pos] =
+    m_row[x_half] = m_row[pos] = color;
+}
+
+static int ref_update(struct screen * s, int thr)
+{
+    for (int i = 0; i < dirty_pixels_num; i++)
+    {
+        #define B1 *(uint16_t*)(s->bmp + dirty_pixels[i])
+        #define B2 *(uint16_t*)(s->bmp + dirty_pixels[i] + BMPPITCH)
+        #define M1 *(uint16_t*)(s->mirror + dirty_pixels[i])
+        #define M2 *(uint16_t*)(s->mirror + dirty_pixels[i] + BMPPITCH)
+
+        if ((B1 == 0 || B1 == M1) && (B2 == 0 || B2 == M2))
+        {
+            B1 = M1 = dirty_pixel_values[i] & 0xFFFF;
+            B2 = M2 = dirty_pixel_values[i] >> 16;
+        }
+        #undef B1
+        #undef B2
+        #undef M1
+        #undef M2
+    }
+    dirty_pixels_num = 0;
+
+    int n_over = 0;
+    for (int y = Y_START; y < Y_END; y += 3)
+    {
+        const uint8_t * row = lv + lv_rows[y - Y_START];
+
+        for (int x = X_START; x < X_END; x += 2)
+        {
+            int e = peak_laplacian(row + lv_cols[x - X_START], LV_PITCH, 0);
+            if (e >= thr)
+            {
+                n_over++;
+                if (dirty_pixels_num >= MAX_DOTS) break;
+                ref_found_pixel(s, x, y, e);
+            }
+        }
+    }
+    return n_over;
+}
+
+/* }}} */
+
+static struct peak_tiles * tiles;
+
+static int tiles_update(struct screen * s, int thr)
+{
+    for (int e = 0; e < 256; e++)
+    {
+        colors[e] = focus_color(e);
+    }
+
+    struct peak_job job = {
+        .lv             = lv,
+        .lv_pitch       = LV_PITCH,
+        .lv_rows        = lv_rows,
+        .lv_cols        = lv_cols,
+        .bmp            = s->bmp,
+        .mirror         = s->mirror,
+        .bmp_pitch      = BMPPITCH,
+        .x0             = X_START,
+        .y0             = Y_START,
+        .x1             = X_END,
+        .y1             = Y_END,
+        .thr            = thr,
+        .filter_edges   = 0,
+        .colors         = colors,
+    };
+
+    return peak_tiles_update(tiles, &job);
+}
+
+/* the threshold follows the percentage of pixels in focus, as in draw_zebra_and_focus */
+struct thr_state
+{
+    int thr, thr_increment, prev_thr, thr_delta;
+};
+
+static void thr_update(struct thr_state * t, int n_over)
+{
+    int n_total = ((Y_END - Y_START) * (X_END - X_START)) / 6;
+
+    if (1000 * n_over / n_total > 5)
+    {
+        if (t->thr_delta > 0) t->thr_increment++; else t->thr_increment = 1;
+        t->thr += t->thr_increment;
+    }
+    else
+    {
+        if (t->thr_delta < 0) t->thr_increment++; else t->thr_increment = 1;
+        t->thr -= t->thr_increment;
+    }
+
+    t->thr_increment = t->thr_increment < -5 ? -5 : t->thr_increment > 5 ? 5 : t->thr_increment;
+    t->thr = t->thr < 15 ? 15 : t->thr > 255 ? 255 : t->thr;
+    t->thr_delta = t->thr - t->prev_thr;
+    t->prev_thr = t->thr;
+}
+
+/* frames {{{ */
+
+static uint8_t * scene;     /* luma, LV_W x LV_H */
+
+static unsigned rnd_state = 1;
+static unsigned rnd(void)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+/* blocks with sharp edges, gradients and fine texture; luma 10..200 */
+static void scene_synthesize(void)
+{
+    scene = malloc(LV_W * LV_H);
+
+    for (int y = 0; y < LV_H; y++)
+        for (int x = 0; x < LV_W; x++)
+            scene[y * LV_W + x] = 40 + (x + y) / 12;
+
+    for (int i = 0; i < 60; i++)
+    {
+        int w = 10 + rnd() % 80, h = 10 + rnd() % 60;
+        int x0 = rnd() % (LV_W - w), y0 = rnd() % (LV_H - h);
+        int level = 20 + rnd() % 180;
+        int texture = rnd() % 3 == 0;
+
+        for (int y = y0; y < y0 + h; y++)
+            for (int x = x0; x < x0 + w; x++)
+                scene[y * LV_W + x] = texture ? (((x / 3 + y / 2) & 1) ? level : level / 2) : level;
+    }
+}
+
+/* scene shifted by dx, box blurred by radius blur, brightened, plus noise */
+static void frame_render(int dx, int blur, int bright, int noise)
+{
+    for (int y = 0; y < LV_H; y++)
+    {
+        for (int x = 0; x < LV_W; x++)
+        {
+            int sum = 0, n = 0;
+            for (int by = -blur; by <= blur; by++)
+            {
+                for (int bx = -blur; bx <= blur; bx++)
+                {
+                    int sx = x + dx + bx, sy = y + by;
+                    sx = sx < 0 ? 0 : sx >= LV_W ? LV_W - 1 : sx;
+                    sy = sy < 0 ? 0 : sy >= LV_H ? LV_H - 1 : sy;
+                    sum += scene[sy * LV_W + sx];
+                    n++;
+                }
+            }
+
+            int Y = sum / n + bright;
+            if (noise) Y += (int)(rnd() % (2 * noise + 1)) - noise;
+            Y = Y < 0 ? 0 : Y > 255 ? 255 : Y;
+            lv[y * LV_PITCH + x * 2 + 1] = Y;
+            lv[y * LV_PITCH + x * 2] = 128;
+        }
+    }
+}
+
+/* bmp2lv identity on a 720x480 LCD, plus something drawn by ML and by Canon */
+static void screen_setup(void)
+{
+    if (!lv) lv = malloc(LV_PITCH * (LV_H + 2));
+
+    for (int y = Y_START; y < Y_END; y++)
+        lv_rows[y - Y_START] = y * LV_PITCH;
+    for (int x = X_START; x < X_END; x++)
+        lv_cols[x - X_START] = x * 2 + 1;
+
+    memset(&blank_screen, 0, sizeof(blank_screen));
+    for (int y = 100; y < 380; y++)
+    {
+        /* a cropmark drawn by ML */
+        blank_screen.bmp[y * BMPPITCH + 240] = blank_screen.mirror[y * BMPPITCH + 240] = 0x80 | 2;
+
+        /* a Canon info box */
+        if (y > 300)
+            for (int x = 500; x < 600; x++)
+                blank_screen.bmp[y * BMPPITCH + x] = 3;
+    }
+}
+
+/* }}} */
+
+static int screen_diff(void)
+{
+    int diff = 0;
+    for (int i = 0; i < BMPPITCH * BMP_H; i++)
+    {
+        diff += ref_screen.bmp[i] != tiles_screen.bmp[i];
+        diff += ref_screen.mirror[i] != tiles_screen.mirror[i];
+    }
+    return diff;
+}
+
+static void screens_reset(void)
+{
+    ref_screen = blank_screen;
+    tiles_screen = blank_screen;
+    dirty_pixels_num = 0;
+    peak_tiles_init(tiles, (struct peak_dot *)(tiles + 1), MAX_DOTS);
+}
+
+static bool test_exact(void)
+{
+    /* each new picture is also brighter, so every tile changes */
+    static const struct { int dx, bright, thr; } frames[] = {
+        { 0, 0, 50 }, { 0, 0, 50 }, { 0, 0, 48 }, { 0, 0, 44 }, { 0, 0, 52 },
+        { 0, 0, 60 }, { 0, 0, 30 },             /* below the floor: scan again */
+        { 8, 20, 31 }, { 8, 20, 33 }, { 8, 20, 31 },
+        { 8, 20, 45 }, { 8, 20, 45 }, { 8, 20, 28 }, { 8, 20, 30 },
+        { 24, 40, 30 }, { 24, 40, 40 }, { 24, 0, 40 },
+    };
+
+    screens_reset();
+
+    for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++)
+    {
+        frame_render(frames[f].dx, 0, frames[f].bright, 0);
+        int ref_over = ref_update(&ref_screen, frames[f].thr);
+        int tiles_over = tiles_update(&tiles_screen, frames[f].thr);
+
+        if (ref_over != tiles_over || screen_diff())
+        {
+            printf("frame %d: n_over %d/%d, %d BMP pixels differ\n", (int)f, ref_over, tiles_over, screen_diff());
+            return false;
+        }
+    }
+
+    /* gone: the BMP is back to what it was */
+    peak_tiles_erase(tiles);
+    TRY(memcmp(&tiles_screen, &blank_screen, sizeof(blank_screen)) == 0);
+
+    /* something else cleared the screen: the dots come back */
+    screens_reset();
+    frame_render(0, 0, 0, 0);
+    tiles_update(&tiles_screen, 40);
+    ref_update(&ref_screen, 40);
+    memset(tiles_screen.bmp, 0, sizeof(tiles_screen.bmp));
+    memset(ref_screen.bmp, 0, sizeof(ref_screen.bmp));
+    tiles_update(&tiles_screen, 40);
+    ref_update(&ref_screen, 40);
+    TRY(memcmp(tiles_screen.bmp, ref_screen.bmp, sizeof(ref_screen.bmp)) == 0);
+
+    return true;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_double(const void * a, const void * b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(void)
+{
+    static const struct { const char * name; int pan; int focus; } sequences[] = {
+        { "tripod",     0, 0 },
+        { "focus pull", 0, 1 },
+        { "pan",        1, 0 },
+    };
+    enum { frames = 128 };
+    const int noise = 2;
+    static double ref_ms[frames], tiles_ms[frames];
+
+    /* median, the host scheduler adds outliers */
+    printf("%-12s %12s %12s %10s %12s\n", "", "full ms", "tiles ms", "scanned", "dots differ");
+
+    for (size_t s = 0; s < sizeof(sequences) / sizeof(sequences[0]); s++)
+    {
+        struct thr_state ref_thr = { 50, 1, 50, 0 };
+        struct thr_state tiles_thr = { 50, 1, 50, 0 };
+        long scanned = 0, total = 0, differ = 0;
+
+        screens_reset();
+        rnd_state = 1234;
+
+        for (int f = 0; f < frames; f++)
+        {
+            frame_render(sequences[s].pan ? f * 2 : 0, sequences[s].focus ? (f / 16) % 3 : 0, 0, noise);
+
+            double t0 = now_ms();
+            thr_update(&ref_thr, ref_update(&ref_screen, ref_thr.thr));
+            double t1 = now_ms();
+            thr_update(&tiles_thr, tiles_update(&tiles_screen, tiles_thr.thr));
+            double t2 = now_ms();
+
+            ref_ms[f] = t1 - t0;
+            tiles_ms[f] = t2 - t1;
+            scanned += tiles->tiles_scanned;
+            total += tiles->tiles_total;
+            differ += screen_diff() / 8;
+        }
+
+        qsort(ref_ms, frames, sizeof(double), compare_double);
+        qsort(tiles_ms, frames, sizeof(double), compare_double);
+
+        printf("%-12s %12.3f %12.3f %9.1f%% %12.1f\n", sequences[s].name,
+            ref_ms[frames / 2], tiles_ms[frames / 2],
+            100.0 * scanned / total, (double)differ / frames);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    tiles = malloc(sizeof(struct peak_tiles) + 2 * MAX_DOTS * sizeof(struct peak_dot));
+    screen_setup();
+    scene_synthesize();
+
+    if(argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    TRY(test_exact());
+
+    X_START = 9;
+    screen_setup();
+    TRY(test_exact());
+
+    printf("peaking tiles: OK\n");
+    return 0;
+}
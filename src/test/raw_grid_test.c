@@ -0,0 +1,491 @@
+/*
+ * exactness test and benchmark for the decimated raw frame (raw_grid.c)
+ *
+ * the reference is raw_red_pixel & co and raw_get_gray_pixel from raw.c,
+ * reading the packed 14-bit buffer at the raw position of each cell.
+ *
+ * the test fills raw buffers with random pixels, builds grids over them
+ * (including cells outside the buffer) and checks every cell, for every
+ * gray projection, and the histograms used for percentiles against the
+ * ones sampled from BMP coordinates, as raw_hist_get_percentile_levels did.
+ * "raw_grid_test bench" prints the time per frame of the raw overlays
+ * (zebras, histogram, ETTR percentiles, overexposure), reading the raw
+ * buffer through the pixel functions and through the grid.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "raw_grid.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+/* raw buffer (raw_info.*) and the BMP overlay area (os.*) mapped to it */
+struct frame
+{
+    void * buffer;
+    int width;
+    int height;
+    int pitch;
+    int ax1, ay1, ax2, ay2; /* active area */
+    int x0, y0, x_max, y_max;
+};
+
+static struct frame * F;
+
+/* the active area covers the BMP overlay area, as with raw_set_preview_rect */
+static int BM2RAW_X(int x) { return F->ax1 + (x - F->x0) * (F->ax2 - F->ax1) / (F->x_max - F->x0); }
+static int BM2RAW_Y(int y) { return F->ay1 + (y - F->y0) * (F->ay2 - F->ay1) / (F->y_max - F->y0); }
+
+/* from raw.c */
+void raw_set_pixel(int x, int y, int value)
+{
+    struct raw_pixblock * p = (void*)F->buffer + y * F->pitch + (x/8)*14;
+    switch (x%8) {
+        case 0: p->a = value; break;
+        case 1: p->b_lo = value; p->b_hi = value >> 12; break;
+        case 2: p->c_lo = value; p->c_hi = value >> 10; break;
+        case 3: p->d_lo = value; p->d_hi = value >> 8; break;
+        case 4: p->e_lo = value; p->e_hi = value >> 6; break;
+        case 5: p->f_lo = value; p->f_hi = value >> 4; break;
+        case 6: p->g_lo = value; p->g_hi = value >> 2; break;
+        case 7: p->h = value; break;
+    }
+}
+
+/* not inlined: on the camera, they are called from other files */
+#define PIXEL_FUNC(name, y_adj, field, combine) \
+__attribute__((noinline)) int name(int x, int y) \
+{ \
+    struct raw_pixblock * buf = (void*)F->buffer; \
+    y = (y/2) * 2 y_adj; \
+    int i = ((y * F->width + x) / 8); \
+    return combine(buf[i].field, buf[i - F->width*2/8].field); \
+}
+
+#define FIRST(a, b) (a)
+
+PIXEL_FUNC(raw_red_pixel,           , a, FIRST)
+PIXEL_FUNC(raw_green_pixel,         , h, FIRST)
+PIXEL_FUNC(raw_blue_pixel,       - 1, h, FIRST)
+PIXEL_FUNC(raw_red_pixel_dark,      , a, MIN)
+PIXEL_FUNC(raw_green_pixel_dark,    , h, MIN)
+PIXEL_FUNC(raw_blue_pixel_dark,  - 1, h, MIN)
+PIXEL_FUNC(raw_red_pixel_bright,    , a, MAX)
+PIXEL_FUNC(raw_green_pixel_bright,  , h, MAX)
+PIXEL_FUNC(raw_blue_pixel_bright,- 1, h, MAX)
+
+__attribute__((noinline)) int raw_get_gray_pixel(int x, int y, int gray_projection)
+{
+    int (*red_pixel)(int x, int y) = raw_red_pixel;
+    int (*green_pixel)(int x, int y) = raw_green_pixel;
+    int (*blue_pixel)(int x, int y) = raw_blue_pixel;
+
+    switch (gray_projection & GRAY_PROJECTION_BRIGHT_DARK_MASK)
+    {
+        case GRAY_PROJECTION_DARK_ONLY:
+            red_pixel = raw_red_pixel_dark;
+            green_pixel = raw_green_pixel_dark;
+            blue_pixel = raw_blue_pixel_dark;
+            break;
+
+        case GRAY_PROJECTION_BRIGHT_ONLY:
+            red_pixel = raw_red_pixel_bright;
+            green_pixel = raw_green_pixel_bright;
+            blue_pixel = raw_blue_pixel_bright;
+            break;
+
+        default:
+            break;
+    }
+    switch (gray_projection & 0xFF)
+    {
+        case GRAY_PROJECTION_RED:
+            return red_pixel(x, y);
+        case GRAY_PROJECTION_GREEN:
+            return green_pixel(x, y);
+        case GRAY_PROJECTION_BLUE:
+            return blue_pixel(x, y);
+        case GRAY_PROJECTION_AVERAGE_RGB:
+            return (red_pixel(x, y) + green_pixel(x, y) + blue_pixel(x, y)) / 3;
+        case GRAY_PROJECTION_MAX_RGB:
+            return MAX(MAX(red_pixel(x, y), green_pixel(x, y)), blue_pixel(x, y));
+        case GRAY_PROJECTION_MAX_RB:
+            return MAX(red_pixel(x, y), blue_pixel(x, y));
+        case GRAY_PROJECTION_MEDIAN_RGB:
+        {
+            int r = red_pixel(x, y);
+            int g = green_pixel(x, y);
+            int b = blue_pixel(x, y);
+            int M = MAX(MAX(r,g),b);
+            int m = MIN(MIN(r,g),b);
+            if (r >= m && r <= M) return r;
+            if (g >= m && g <= M) return g;
+            return b;
+        }
+        default:
+            return -1;
+    }
+}
+
+static const int projections[] = {
+    GRAY_PROJECTION_RED, GRAY_PROJECTION_GREEN, GRAY_PROJECTION_BLUE,
+    GRAY_PROJECTION_AVERAGE_RGB, GRAY_PROJECTION_MAX_RGB,
+    GRAY_PROJECTION_MAX_RB, GRAY_PROJECTION_MEDIAN_RGB,
+};
+
+static const int modes[] = {
+    GRAY_PROJECTION_DARK_ONLY, GRAY_PROJECTION_BRIGHT_ONLY, GRAY_PROJECTION_DARK_AND_BRIGHT,
+};
+
+static void frame_init(struct frame * f, int width, int height, int x0, int y0, int x_max, int y_max, unsigned seed)
+{
+    f->width = width;
+    f->height = height;
+    f->pitch = width * 14 / 8;
+    f->buffer = malloc(f->pitch * height);
+    f->ax1 = 72;
+    f->ay1 = 28;
+    f->ax2 = width - 8;
+    f->ay2 = height - 4;
+    f->x0 = x0;
+    f->y0 = y0;
+    f->x_max = x_max;
+    f->y_max = y_max;
+
+    F = f;
+    srand(seed);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            /* some flat areas, so the min/max ties get tested too */
+            int v = (x / 64 + y / 64) % 5 ? rand() & 16383 : 2048 + (y & 2) * 1000;
+            raw_set_pixel(x, y, v);
+        }
+    }
+}
+
+/* as raw_hist_grid_take, with grid rows starting at y0 */
+static void grid_setup(struct raw_grid * grid, struct frame * f, int y0)
+{
+    F = f;
+    grid->x0 = f->x0;
+    grid->y0 = y0;
+    grid->cols = MIN((f->x_max - grid->x0 + RAW_GRID_DX - 1) / RAW_GRID_DX, RAW_GRID_MAX_COLS);
+    grid->rows = MIN((f->y_max - grid->y0 + RAW_GRID_DY - 1) / RAW_GRID_DY, RAW_GRID_MAX_ROWS);
+    grid->cells = malloc(grid->cols * grid->rows * sizeof(grid->cells[0]));
+
+    for (int c = 0; c < grid->cols; c++)
+        grid->raw_x[c] = BM2RAW_X(grid->x0 + c * RAW_GRID_DX);
+
+    for (int r = 0; r < grid->rows; r++)
+        grid->raw_y[r] = BM2RAW_Y(grid->y0 + r * RAW_GRID_DY);
+}
+
+static int inside(struct frame * f, int x, int y)
+{
+    return x >= 0 && x < f->width && (y/2)*2 >= 4 && y < f->height;
+}
+
+static void test_cells(struct frame * f, int y0)
+{
+    struct raw_grid grid;
+    grid_setup(&grid, f, y0);
+
+    /* a few cells outside the buffer */
+    grid.raw_x[0] = -3;
+    grid.raw_x[grid.cols - 1] = f->width + 5;
+    grid.raw_y[0] = 1;
+    grid.raw_y[1] = 3;
+    grid.raw_y[grid.rows - 1] = f->height;
+
+    raw_grid_build(&grid, f->buffer, f->width, f->height);
+
+    int checked = 0;
+    for (int r = 0; r < grid.rows; r++)
+    {
+        const struct raw_grid_cell * row = raw_grid_row(&grid, r);
+        for (int c = 0; c < grid.cols; c++)
+        {
+            const struct raw_grid_cell * cell = &row[c];
+            int x = grid.raw_x[c];
+            int y = grid.raw_y[r];
+
+            if (!inside(f, x, y))
+            {
+                TRY(!cell->r && !cell->g && !cell->b && !cell->r2 && !cell->g2 && !cell->b2);
+                continue;
+            }
+
+            TRY(cell->r == raw_red_pixel(x, y));
+            TRY(cell->g == raw_green_pixel(x, y));
+            TRY(cell->b == raw_blue_pixel(x, y));
+            TRY(raw_cell_red_dark(cell) == raw_red_pixel_dark(x, y));
+            TRY(raw_cell_green_dark(cell) == raw_green_pixel_dark(x, y));
+            TRY(raw_cell_blue_dark(cell) == raw_blue_pixel_dark(x, y));
+            TRY(raw_cell_red_bright(cell) == raw_red_pixel_bright(x, y));
+            TRY(raw_cell_green_bright(cell) == raw_green_pixel_bright(x, y));
+            TRY(raw_cell_blue_bright(cell) == raw_blue_pixel_bright(x, y));
+
+            for (unsigned p = 0; p < sizeof(projections) / sizeof(projections[0]); p++)
+            {
+                for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+                {
+                    int proj = projections[p] | modes[m];
+                    TRY(raw_cell_gray(cell, proj) == raw_get_gray_pixel(x, y, proj));
+                }
+            }
+            checked++;
+        }
+    }
+
+    TRY(checked > grid.cols * grid.rows / 2);
+    free(grid.cells);
+}
+
+/* the grid histogram must match the one sampled from BMP coordinates
+ * (as raw_hist_get_percentile_levels did) when the speed is a multiple
+ * of the grid spacing, and the grid starts on the same rows */
+static void test_histogram(struct frame * f, int off)
+{
+    static int hist_ref[16384];
+    static int hist[16384];
+
+    struct raw_grid grid;
+    grid_setup(&grid, f, f->y0 + (off & 1));
+    raw_grid_build(&grid, f->buffer, f->width, f->height);
+
+    for (int speed = 8; speed <= 16; speed += 8)
+    {
+        for (unsigned p = 0; p < sizeof(projections) / sizeof(projections[0]); p++)
+        {
+            for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            {
+                int proj = projections[p] | modes[m];
+                memset(hist_ref, 0, sizeof(hist_ref));
+                memset(hist, 0, sizeof(hist));
+
+                for (int i = f->y0 + off; i < f->y_max - off; i += speed)
+                {
+                    int y = BM2RAW_Y(i);
+                    for (int j = f->x0; j < f->x_max; j += speed)
+                    {
+                        int x = BM2RAW_X(j);
+                        int px = raw_get_gray_pixel(x, y, proj);
+                        hist_ref[px & 16383]++;
+                    }
+                }
+
+                /* same row range as raw_grid_row_index */
+                raw_grid_histogram(&grid, hist, proj,
+                    (f->y0 + off - grid.y0 + 1) / 2,
+                    (f->y_max - off - grid.y0 + 1) / 2,
+                    speed / RAW_GRID_DY, speed / RAW_GRID_DX
+                );
+
+                TRY(memcmp(hist, hist_ref, sizeof(hist)) == 0);
+            }
+        }
+    }
+
+    free(grid.cells);
+}
+
+static void test_raw_grid(void)
+{
+    /* LiveView 1x, 5x zoom (BMP area offset), width not a multiple of 8 */
+    static const int geometry[][6] = {
+        { 1736, 1160,   0,  0, 720, 480 },
+        { 1736, 1160,   0, 30, 720, 510 },
+        { 2520, 1080,  60, 16, 900, 524 },
+        { 1812,  906,   0,  0, 720, 480 },
+    };
+
+    for (unsigned i = 0; i < sizeof(geometry) / sizeof(geometry[0]); i++)
+    {
+        const int * g = geometry[i];
+        struct frame f;
+        frame_init(&f, g[0], g[1], g[2], g[3], g[4], g[5], i);
+
+        test_cells(&f, f.y0);
+        test_cells(&f, f.y0 + 1);
+        test_histogram(&f, 0);
+        test_histogram(&f, 25);
+        free(f.buffer);
+    }
+
+    printf("raw_grid: OK\n");
+}
+
+#define BENCH_RUNS 31
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static volatile int sink;
+
+/* the raw overlays on one frame, as before: every raw feature samples the
+ * raw buffer through the pixel functions */
+static void overlays_direct(struct frame * f, int * hist)
+{
+    int acc = 0;
+
+    /* raw zebras: every 8th pixel of every 2nd row */
+    for (int i = f->y0; i < f->y_max; i += 2)
+    {
+        int y = BM2RAW_Y(i);
+        for (int j = f->x0; j < f->x_max; j += 8)
+        {
+            int x = BM2RAW_X(j);
+            acc += (raw_green_pixel_bright(x, y) < 2100) + (raw_red_pixel_dark(x, y) > 15000) +
+                   (raw_green_pixel_dark(x, y) > 15000) + (raw_blue_pixel_dark(x, y) > 15000);
+        }
+    }
+
+    /* histogram: every 8th pixel of every 4th row */
+    for (int i = f->y0; i < f->y_max; i += 4)
+    {
+        int y = BM2RAW_Y(i);
+        for (int j = f->x0; j < f->x_max; j += 8)
+        {
+            int x = BM2RAW_X(j);
+            hist[raw_red_pixel_dark(x, y)]++;
+            hist[raw_green_pixel_dark(x, y)]++;
+            hist[raw_blue_pixel_dark(x, y)]++;
+        }
+    }
+
+    /* ETTR percentiles (speed 4) and overexposure */
+    for (int i = f->y0; i < f->y_max; i += 4)
+    {
+        int y = BM2RAW_Y(i);
+        for (int j = f->x0; j < f->x_max; j += 4)
+        {
+            int x = BM2RAW_X(j);
+            hist[raw_get_gray_pixel(x, y, GRAY_PROJECTION_MAX_RGB) & 16383]++;
+            acc += raw_get_gray_pixel(x, y, GRAY_PROJECTION_AVERAGE_RGB) >= 12000;
+        }
+    }
+
+    sink = acc;
+}
+
+/* same, from the grid */
+static void overlays_grid(struct frame * f, struct raw_grid * grid, int * hist)
+{
+    int acc = 0;
+
+    raw_grid_build(grid, f->buffer, f->width, f->height);
+
+    for (int i = 0; i < grid->rows; i++)
+    {
+        const struct raw_grid_cell * row = raw_grid_row(grid, i);
+        for (int j = 0; j < grid->cols; j++)
+        {
+            const struct raw_grid_cell * c = &row[j];
+            acc += (raw_cell_green_bright(c) < 2100) + (raw_cell_red_dark(c) > 15000) +
+                   (raw_cell_green_dark(c) > 15000) + (raw_cell_blue_dark(c) > 15000);
+        }
+    }
+
+    for (int i = 0; i < grid->rows; i += 2)
+    {
+        const struct raw_grid_cell * row = raw_grid_row(grid, i);
+        for (int j = 0; j < grid->cols; j++)
+        {
+            hist[raw_cell_red_dark(&row[j])]++;
+            hist[raw_cell_green_dark(&row[j])]++;
+            hist[raw_cell_blue_dark(&row[j])]++;
+        }
+    }
+
+    raw_grid_histogram(grid, hist, GRAY_PROJECTION_MAX_RGB, 0, grid->rows, 2, 1);
+
+    for (int i = 0; i < grid->rows; i += 2)
+    {
+        const struct raw_grid_cell * row = raw_grid_row(grid, i);
+        for (int j = 0; j < grid->cols; j++)
+        {
+            acc += raw_cell_gray(&row[j], GRAY_PROJECTION_AVERAGE_RGB) >= 12000;
+        }
+    }
+
+    sink = acc;
+}
+
+static double bench_run(struct frame * f, int use_grid)
+{
+    static int hist[16384];
+    double t[BENCH_RUNS];
+    struct raw_grid grid;
+    grid_setup(&grid, f, f->y0);
+
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        double t0 = now_ms();
+        if (use_grid) overlays_grid(f, &grid, hist);
+        else overlays_direct(f, hist);
+        t[i] = now_ms() - t0;
+    }
+
+    free(grid.cells);
+
+    for (int i = 0; i < BENCH_RUNS; i++)
+        for (int j = i + 1; j < BENCH_RUNS; j++)
+            if (t[j] < t[i]) { double tmp = t[i]; t[i] = t[j]; t[j] = tmp; }
+
+    return t[BENCH_RUNS / 2];
+}
+
+static void bench(void)
+{
+    static const int geometry[][6] = {
+        { 1736, 1160,   0,  0, 720, 480 },
+        { 1736, 1160,   0,  0, 960, 540 },
+    };
+
+    printf("raw overlays, ms per frame      pixel funcs    grid\n");
+    for (unsigned i = 0; i < sizeof(geometry) / sizeof(geometry[0]); i++)
+    {
+        const int * g = geometry[i];
+        struct frame f;
+        frame_init(&f, g[0], g[1], g[2], g[3], g[4], g[5], i);
+        printf("%dx%d raw, %dx%d BMP  %8.3f    %8.3f\n",
+            g[0], g[1], g[4] - g[2], g[5] - g[3],
+            bench_run(&f, 0), bench_run(&f, 1)
+        );
+        free(f.buffer);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    test_raw_grid();
+    return 0;
+}
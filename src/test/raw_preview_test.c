@@ -0,0 +1,579 @@
+/*
+ * exactness test and benchmark for the raw preview kernels (raw_preview.c)
+ *
+ * the reference is raw_preview_color_work and raw_preview_fast_work, as they
+ * were in raw.c, reading the packed 14-bit buffer through the bitfields of
+ * struct raw_pixblock and building the gamma curves on every call.
+ *
+ * the test fills raw buffers with random pixels and LiveView buffers with
+ * random garbage, and checks that both render the same bytes, for several
+ * geometries (odd borders, raw rows outside the preview area, partial
+ * updates); the low-res color mode is checked against the half-res one.
+ * "raw_preview_test bench" prints the time per frame of each mode.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "raw.h"
+#include "imgconv.h"
+#include "raw_preview.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+
+#define LV_GUARD_ROWS 2     /* the gray preview writes one row past y2 */
+
+/* raw buffer (raw_info.*), LiveView buffer (vram_lv.*) and the mapping between them */
+struct frame
+{
+    void * raw;
+    int raw_width, raw_height, raw_pitch;
+    int black, white;
+
+    uint8_t * lv;
+    int lv_width, lv_height, lv_pitch;
+    int lv_size;
+
+    struct { int sx, sy, tx, ty; } lv2raw;
+    int rect_x, rect_y, rect_w, rect_h;     /* raw_set_preview_rect */
+    int x1, x2;
+};
+
+static struct frame * F;
+
+/* from raw.c */
+float raw_to_ev(int raw)
+{
+    int raw_max = F->white - F->black;
+
+    if (F->white > 16383 && raw > 10000)
+    {
+        float k = COERCE((raw - 10000) / 5000.0, 0.0, 1.0);
+        int adjusted_white = F->white * (1-k) + 15000 * k;
+        raw_max = adjusted_white - F->black;
+    }
+
+    float raw_ev = -log2f(raw_max) + log2f(COERCE(raw - F->black, 1, raw_max));
+    return raw_ev;
+}
+
+/* from imgconv.c; rgb2yuv422 picks one of them with CONFIG_REC709 */
+static uint32_t rgb2yuv422_rec601(int R, int G, int B)
+{
+    int Y = COERCE(((306) * R + (601) * G + (116) * B) / 1024, 0, 255);
+    int U = COERCE(((-172) * R + (-337) * G + (509) * B) / 1024, -128, 127);
+    int V = COERCE(((509) * R + (-427) * G + (-82) * B) / 1024, -128, 127);
+    return UYVY_PACK(U,Y,V,Y);
+}
+
+static uint32_t rgb2yuv422_rec709(int R, int G, int B)
+{
+    int Y = COERCE(((217) * R + (732) * G + (73) * B) / 1024, 0, 255);
+    int U = COERCE(((-117) * R + (-394) * G + (512) * B) / 1024, -128, 127);
+    int V = COERCE(((512) * R + (-465) * G + (-46) * B) / 1024, -128, 127);
+    return UYVY_PACK(U,Y,V,Y);
+}
+
+static const int yuv_rec601[9] = { 306, 601, 116, -172, -337, 509, 509, -427, -82 };
+static const int yuv_rec709[9] = { 217, 732, 73, -117, -394, 512, 512, -465, -46 };
+
+static uint32_t (*rgb2yuv)(int R, int G, int B) = rgb2yuv422_rec601;
+
+#define LV(x,y) (((x) << 1) + (y) * F->lv_pitch)
+#define LV2RAW_X(x) ((((x) * F->lv2raw.sx) >> 10) + F->lv2raw.tx)
+#define LV2RAW_Y(y) ((((y) * F->lv2raw.sy) >> 10) + F->lv2raw.ty)
+#define RAW2LV_X(x) (((x) << 10) / F->lv2raw.sx - (F->lv2raw.tx << 10) / F->lv2raw.sx)
+
+/* from raw.c, before raw_preview.c */
+#define PA ((int)(p->a))
+#define PB ((int)(p->b_lo | (p->b_hi << 12)))
+#define PC ((int)(p->c_lo | (p->c_hi << 10)))
+#define PD ((int)(p->d_lo | (p->d_hi << 8)))
+#define PE ((int)(p->e_lo | (p->e_hi << 6)))
+#define PF ((int)(p->f_lo | (p->f_hi << 4)))
+#define PG ((int)(p->g_lo | (p->g_hi << 2)))
+#define PH ((int)(p->h))
+
+#define QA ((int)(q->a))
+#define QB ((int)(q->b_lo | (q->b_hi << 12)))
+#define QC ((int)(q->c_lo | (q->c_hi << 10)))
+#define QD ((int)(q->d_lo | (q->d_hi << 8)))
+#define QE ((int)(q->e_lo | (q->e_hi << 6)))
+#define QF ((int)(q->f_lo | (q->f_hi << 4)))
+#define QG ((int)(q->g_lo | (q->g_hi << 2)))
+#define QH ((int)(q->h))
+
+static void raw_preview_color_work(void* raw_buffer, void* lv_buffer, int y1, int y2)
+{
+    uint32_t* lv32 = lv_buffer;
+    struct raw_pixblock * raw = raw_buffer;
+
+    int black = F->black;
+    int white = F->white;
+    int div = 0;
+    while (((white-black) >> div) >= 1024)
+    {
+        div++;
+    }
+
+    uint8_t gamma_rb[1024];
+    uint8_t gamma_g[1024];
+
+    for (int i = 0; i < 1024; i++)
+    {
+        int g_rb = COERCE(raw_to_ev((i << div) + black) + 11, 0, 10) * 255 / 10;
+        int g_g  = COERCE(raw_to_ev((i << div) + black) + 10, 0, 10) * 255 / 10;
+        gamma_rb[i] = COERCE(g_rb * g_rb / 255, 0, 255);
+        gamma_g[i]  = COERCE(g_g  * g_g  / 255, 0, 255);
+    }
+
+    int x1 = COERCE(RAW2LV_X(F->rect_x), 0, F->lv_width);
+    int x2 = COERCE(RAW2LV_X(F->rect_x + F->rect_w), 0, F->lv_width);
+    if (x2 < x1) return;
+
+    int* lv2rx = malloc(x2 * 4);
+    if (!lv2rx) return;
+    for (int x = x1; x < x2; x++)
+        lv2rx[x] = LV2RAW_X(x) & ~1;
+
+    for (int y = y1; y < y2; y++)
+    {
+        int yr = LV2RAW_Y(y) & ~1;
+
+        if (yr <= F->rect_y || yr >= F->rect_y + F->rect_h)
+        {
+            memset(&lv32[LV(0,y)/4], 0, F->lv_pitch);
+            continue;
+        }
+
+        memset(&lv32[LV(0,y)/4],  0, LV(x1,y) - LV(0,y)/4*4);
+        memset(&lv32[LV(x2,y)/4], 0, LV(0,1) - LV(x2,0)/4*4);
+
+        struct raw_pixblock * row = (void*)raw + yr * F->raw_pitch;
+
+        for (int x = x1; x < x2; x += 2)
+        {
+            int xr = lv2rx[x];
+            struct raw_pixblock * p = row + (xr/8);
+            struct raw_pixblock * q = (void*) p + F->raw_pitch;
+            int r,g,b;
+
+            switch (xr%8)
+            {
+                case 0:
+                    r = PA;
+                    g = (PB + QA) >> 1;
+                    b = QB;
+                    break;
+                case 2:
+                    r = PC;
+                    g = (PD + QC) >> 1;
+                    b = QD;
+                    break;
+                case 4:
+                    r = PE;
+                    g = (PF + QE) >> 1;
+                    b = QF;
+                    break;
+                case 6:
+                    r = PG;
+                    g = (PH + QG) >> 1;
+                    b = QH;
+                    break;
+                default:
+                    r = g = b = 0;
+            }
+
+            r = gamma_rb[COERCE(r - black, 0, white-black) >> div];
+            g = gamma_g [COERCE(g - black, 0, white-black) >> div];
+            b = gamma_rb[COERCE(b - black, 0, white-black) >> div];
+
+            uint32_t yuv = rgb2yuv(r,g,b);
+            lv32[LV(x,y)/4] = yuv;
+        }
+    }
+    free(lv2rx);
+}
+
+static void raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1, int y2)
+{
+    uint64_t* lv64 = lv_buffer;
+    struct raw_pixblock * raw = raw_buffer;
+
+    int black = F->black;
+    int white = F->white;
+    int div = 0;
+    while (((white-black) >> div) >= 1024)
+    {
+        div++;
+    }
+
+    uint8_t gamma[1024];
+
+    for (int i = 0; i < 1024; i++)
+    {
+        int g = COERCE(raw_to_ev((i << div) + black) + 10, 0, 10) * 255 / 10;
+        gamma[i] = g * g / 255;
+    }
+
+    int x1 = COERCE(RAW2LV_X(F->rect_x), 0, F->lv_width);
+    int x2 = COERCE(RAW2LV_X(F->rect_x + F->rect_w), 0, F->lv_width);
+    if (x2 < x1) return;
+
+    int* lv2rx = malloc(x2 * 4);
+    if (!lv2rx) return;
+    for (int x = x1; x < x2; x++)
+        lv2rx[x] = LV2RAW_X(x) & ~1;
+
+    for (int y = y1; y < y2; y++)
+    {
+        int yr = LV2RAW_Y(y) | 1;
+
+        if (yr <= F->rect_y || yr >= F->rect_y + F->rect_h)
+        {
+            memset(&lv64[LV(0,y)/8], 0, F->lv_pitch);
+            continue;
+        }
+
+        memset(&lv64[LV(0,y)/8],  0, LV(x1,y) - LV(0,y)/8*8);
+        memset(&lv64[LV(x2,y)/8], 0, LV(0,1) - LV(x2,0)/8*8);
+
+        struct raw_pixblock * row = (void*)raw + yr * F->raw_pitch;
+
+        if (y%2) continue;
+
+        for (int x = x1; x < x2; x += 4)
+        {
+            int xr = lv2rx[x];
+            struct raw_pixblock * p = row + (xr/8);
+            int c = p->a;
+            uint64_t Y = gamma[COERCE(c - black, 0, white-black) >> div];
+            Y = (Y << 8) | (Y << 24) | (Y << 40) | (Y << 56);
+            int idx = LV(x,y)/8;
+            lv64[idx] = Y;
+            lv64[idx + F->lv_pitch/8] = Y;
+        }
+    }
+    free(lv2rx);
+}
+
+/* what raw_preview_fast_ex keeps between frames */
+struct tables
+{
+    uint8_t gamma_rb[RAW_PREVIEW_LEVELS];
+    uint8_t gamma_g[RAW_PREVIEW_LEVELS];
+    int div;
+    int * cols;
+};
+
+static void tables_init(struct tables * t)
+{
+    int black = F->black;
+    int white = F->white;
+    int div = 0;
+    while (((white-black) >> div) >= RAW_PREVIEW_LEVELS)
+    {
+        div++;
+    }
+
+    for (int i = 0; i < RAW_PREVIEW_LEVELS; i++)
+    {
+        int g_rb = COERCE(raw_to_ev((i << div) + black) + 11, 0, 10) * 255 / 10;
+        int g_g  = COERCE(raw_to_ev((i << div) + black) + 10, 0, 10) * 255 / 10;
+        t->gamma_rb[i] = COERCE(g_rb * g_rb / 255, 0, 255);
+        t->gamma_g[i]  = COERCE(g_g  * g_g  / 255, 0, 255);
+    }
+    t->div = div;
+
+    t->cols = malloc(F->lv_width * sizeof(t->cols[0]));
+    for (int x = 0; x < F->lv_width; x++)
+    {
+        t->cols[x] = LV2RAW_X(x) & ~1;
+    }
+}
+
+static void job_init(struct raw_preview_job * job, struct tables * t, void * lv, int y1, int y2, const int * yuv)
+{
+    *job = (struct raw_preview_job) {
+        .raw        = F->raw,
+        .raw_pitch  = F->raw_pitch,
+        .lv         = lv,
+        .lv_pitch   = F->lv_pitch,
+        .y1         = y1,
+        .y2         = y2,
+        .x1         = F->x1,
+        .x2         = F->x2,
+        .raw_sy     = F->lv2raw.sy,
+        .raw_ty     = F->lv2raw.ty,
+        .raw_top    = F->rect_y,
+        .raw_bottom = F->rect_y + F->rect_h,
+        .raw_x      = t->cols,
+        .gamma_rb   = t->gamma_rb,
+        .gamma_g    = t->gamma_g,
+        .black      = F->black,
+        .white      = F->white,
+        .div        = t->div,
+        .yuv        = yuv,
+    };
+}
+
+/* raw_w x raw_h buffer; the preview rect is mapped to lv_w x lv_h, shifted by (dx, dy) LiveView pixels */
+static void frame_init(struct frame * f, int raw_w, int raw_h, int rect_x, int rect_y, int rect_w, int rect_h,
+                       int lv_w, int lv_h, int dx, int dy, int black, int white, int seed)
+{
+    f->raw_width = raw_w;
+    f->raw_height = raw_h;
+    f->raw_pitch = raw_w * 14 / 8;
+    f->black = black;
+    f->white = white;
+
+    /* the color preview reads the line below the last one */
+    int raw_size = f->raw_pitch * (raw_h + 1);
+    f->raw = malloc(raw_size);
+    srand(seed);
+    for (int i = 0; i < raw_size; i++)
+    {
+        ((uint8_t *) f->raw)[i] = rand();
+    }
+
+    f->lv_width = lv_w;
+    f->lv_height = lv_h;
+    f->lv_pitch = lv_w * 2;
+    f->lv_size = f->lv_pitch * (lv_h + LV_GUARD_ROWS);
+    f->lv = malloc(f->lv_size);
+
+    f->rect_x = rect_x;
+    f->rect_y = rect_y;
+    f->rect_w = rect_w;
+    f->rect_h = rect_h;
+    f->lv2raw.sx = (rect_w << 10) / lv_w;
+    f->lv2raw.sy = (rect_h << 10) / lv_h;
+    f->lv2raw.tx = rect_x - ((dx * f->lv2raw.sx) >> 10);
+    f->lv2raw.ty = rect_y - ((dy * f->lv2raw.sy) >> 10);
+
+    F = f;
+    f->x1 = COERCE(RAW2LV_X(f->rect_x), 0, f->lv_width);
+    f->x2 = COERCE(RAW2LV_X(f->rect_x + f->rect_w), 0, f->lv_width);
+}
+
+static void lv_garbage(uint8_t * a, uint8_t * b, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        a[i] = b[i] = rand();
+    }
+}
+
+static void test_frame(struct frame * f, int y1, int y2)
+{
+    struct tables t;
+    struct raw_preview_job job;
+    uint8_t * ref = malloc(f->lv_size);
+    uint8_t * half = malloc(f->lv_size);
+    F = f;
+    tables_init(&t);
+
+    for (int k = 0; k < 2; k++)
+    {
+        rgb2yuv = k ? rgb2yuv422_rec709 : rgb2yuv422_rec601;
+        job_init(&job, &t, f->lv, y1, y2, k ? yuv_rec709 : yuv_rec601);
+
+        lv_garbage(ref, f->lv, f->lv_size);
+        raw_preview_color_work(f->raw, ref, y1, y2);
+        raw_preview_color(&job);
+        TRY(memcmp(ref, f->lv, f->lv_size) == 0);
+        memcpy(half, f->lv, f->lv_size);
+
+        /* one Bayer cell for every 4x2 pixels: the words of the
+         * half-res preview at every 4th pixel of the even rows */
+        lv_garbage(ref, f->lv, f->lv_size);
+        for (int y = y1; y < y2; y++)
+        {
+            int yr = LV2RAW_Y(y) & ~1;
+            uint8_t * row = ref + y * f->lv_pitch;
+
+            if (yr <= f->rect_y || yr >= f->rect_y + f->rect_h)
+            {
+                memset(row, 0, f->lv_pitch);
+                continue;
+            }
+
+            memset(row, 0, f->x1 * 2);
+            memset(row + f->x2 * 2 / 8 * 8, 0, f->lv_pitch - f->x2 * 2 / 8 * 8);
+
+            if (y % 2) continue;
+
+            for (int x = f->x1; x < f->x2; x += 4)
+            {
+                uint32_t yuv = ((uint32_t *)(half + y * f->lv_pitch))[x / 2];
+                uint32_t * out = (uint32_t *)(row + x * 2 / 8 * 8);
+                out[0] = out[1] = yuv;
+                if (y + 1 < y2)
+                {
+                    out[f->lv_pitch / 4] = out[f->lv_pitch / 4 + 1] = yuv;
+                }
+            }
+        }
+        raw_preview_color_lowres(&job);
+        TRY(memcmp(ref, f->lv, f->lv_size) == 0);
+
+        lv_garbage(ref, f->lv, f->lv_size);
+        raw_preview_fast_work(f->raw, ref, y1, y2);
+        raw_preview_gray(&job);
+        TRY(memcmp(ref, f->lv, f->lv_size) == 0);
+    }
+
+    free(t.cols);
+    free(ref);
+    free(half);
+}
+
+static void test_raw_preview(void)
+{
+    /* raw_w, raw_h, rect_x, rect_y, rect_w, rect_h, lv_w, lv_h, dx, dy, black, white */
+    static const int geometry[][12] = {
+        { 1736, 1160,  72,  28, 1656, 1120, 720, 480,  0,   0, 2048, 15000 },  /* 5D3 1080p */
+        { 1808,  727, 160,  26, 1640,  690, 720, 480,  0,   0, 2047, 13000 },  /* 5x3 */
+        { 1736, 1160,  72,  28, 1656, 1120, 720, 480,  3,  -5, 2048, 15000 },  /* odd borders */
+        { 1736, 1160,  72,  28, 1656, 1120, 720, 480, -7,  40, 1024, 16000 },  /* rows out of range */
+        { 2080, 1318, 146,  20, 1920, 1080, 960, 540, 17,  11,  128, 16383 },
+        { 1736, 1160,  72,  28, 1656, 1120, 720, 480,  0,   0, 2048, 16900 },  /* ExpSim hack in raw_to_ev */
+    };
+
+    for (unsigned i = 0; i < sizeof(geometry) / sizeof(geometry[0]); i++)
+    {
+        const int * g = geometry[i];
+        struct frame f;
+        frame_init(&f, g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], g[8], g[9], g[10], g[11], i);
+
+        test_frame(&f, 0, f.lv_height);
+        test_frame(&f, 33, 401);
+        test_frame(&f, 40, 41);
+        free(f.raw);
+        free(f.lv);
+    }
+
+    printf("raw_preview: OK\n");
+}
+
+#define BENCH_RUNS 31
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* from raw.c */
+void raw_set_pixel(int x, int y, int value)
+{
+    struct raw_pixblock * p = (void*)F->raw + y * F->raw_pitch + (x/8)*14;
+    switch (x%8) {
+        case 0: p->a = value; break;
+        case 1: p->b_lo = value; p->b_hi = value >> 12; break;
+        case 2: p->c_lo = value; p->c_hi = value >> 10; break;
+        case 3: p->d_lo = value; p->d_hi = value >> 8; break;
+        case 4: p->e_lo = value; p->e_hi = value >> 6; break;
+        case 5: p->f_lo = value; p->f_hi = value >> 4; break;
+        case 6: p->g_lo = value; p->g_hi = value >> 2; break;
+        case 7: p->h = value; break;
+    }
+}
+
+/* random pixels make every branch a coin toss; a real frame looks more like this */
+static void frame_smooth(struct frame * f)
+{
+    F = f;
+    for (int y = 0; y <= f->raw_height; y++)
+    {
+        for (int x = 0; x < f->raw_width; x++)
+        {
+            int v = f->black + (x * 7 + y * 3) % (f->white - f->black) + (rand() & 63);
+            raw_set_pixel(x, y, MIN(v, 16383));
+        }
+    }
+}
+
+static double bench_run(struct frame * f, struct tables * t, int mode)
+{
+    double tm[BENCH_RUNS];
+    struct raw_preview_job job;
+    job_init(&job, t, f->lv, 0, f->lv_height, yuv_rec601);
+
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        double t0 = now_ms();
+        switch (mode)
+        {
+            case 0: raw_preview_color_work(f->raw, f->lv, 0, f->lv_height); break;
+            case 1: raw_preview_color(&job); break;
+            case 2: raw_preview_color_lowres(&job); break;
+            case 3: raw_preview_fast_work(f->raw, f->lv, 0, f->lv_height); break;
+            case 4: raw_preview_gray(&job); break;
+        }
+        tm[i] = now_ms() - t0;
+    }
+
+    for (int i = 0; i < BENCH_RUNS; i++)
+        for (int j = i + 1; j < BENCH_RUNS; j++)
+            if (tm[j] < tm[i]) { double tmp = tm[i]; tm[i] = tm[j]; tm[j] = tmp; }
+
+    return tm[BENCH_RUNS / 2];
+}
+
+static void bench(void)
+{
+    static const int geometry[][8] = {
+        { 1736, 1160,  72,  28, 1656, 1120, 720, 480 },
+        { 2080, 1318, 146,  20, 1920, 1080, 960, 540 },
+    };
+
+    printf("raw preview, ms per frame    color: before   after  low-res    gray: before   after\n");
+    for (unsigned i = 0; i < sizeof(geometry) / sizeof(geometry[0]); i++)
+    {
+        const int * g = geometry[i];
+        struct frame f;
+        struct tables t;
+        frame_init(&f, g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], 0, 0, 2048, 15000, i);
+        frame_smooth(&f);
+        tables_init(&t);
+        printf("%dx%d raw, %dx%d LV          %8.3f %7.3f  %7.3f          %7.3f %7.3f\n",
+            g[0], g[1], g[6], g[7],
+            bench_run(&f, &t, 0), bench_run(&f, &t, 1), bench_run(&f, &t, 2),
+            bench_run(&f, &t, 3), bench_run(&f, &t, 4)
+        );
+        free(t.cols);
+        free(f.raw);
+        free(f.lv);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        bench();
+        return 0;
+    }
+
+    test_raw_preview();
+    return 0;
+}
@@ -0,0 +1,488 @@
+/*
+ * exactness test and benchmark for the fused scopes kernel (scopes.c)
+ *
+ * the reference is the per-pixel code hist_build() used before:
+ * hist_add_pixel, waveform_add_pixel and vectorscope_addpixel, walking
+ * the buffer through BM2LV for every pixel. The vectorscope gain dithers
+ * with a different random sequence, so it is compared at gain 0 only.
+ *
+ * "scopes_test bench [file.422 ...]" times both on LiveView frames saved
+ * by ML (LV-000.422, raw UYVY); without files, on a synthetic frame.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "scopes.h"
+
+#define TRY(v)   do { \
+  bool res = v;\
+  if (!res) {\
+    printf("assert failed: " #v "\n");\
+    abort();\
+  }\
+} while (0)
+
+#define COERCE(x,lo,hi) ((x) < (lo) ? (lo) : (x) > (hi) ? (hi) : (x))
+
+#define HIST_WIDTH      128
+#define WAVEFORM_WIDTH  180
+#define WAVEFORM_HEIGHT 120
+#define COLOR_RED       12
+
+#define MZ_WHITE 0xFE12FE34
+#define MZ_BLACK 0x00120034
+#define MZ_GREEN 0xB68DB69E
+
+/* BMP overlay area (os.*) and the LV buffer behind it */
+struct frame
+{
+    uint32_t * buf;
+    int width;              /* LV pixels */
+    int height;
+    int pitch;              /* bytes */
+    int x0, y0, x_max, y_max, off;
+    int sx, sy, tx, ty;     /* bm2lv, as in vram.c */
+    int bm2lv_x[1024];
+};
+
+static int BM2LV_X(struct frame * f, int x) { return f->bm2lv_x[x]; }
+static int BM2LV_Y(struct frame * f, int y) { return ((y * f->sy) >> 10) + f->ty; }
+
+struct scopes
+{
+    uint32_t hist[HIST_WIDTH];
+    uint32_t hist_r[HIST_WIDTH];
+    uint32_t hist_g[HIST_WIDTH];
+    uint32_t hist_b[HIST_WIDTH];
+    uint32_t max;
+    uint32_t total_px;
+    uint8_t waveform[WAVEFORM_WIDTH * WAVEFORM_HEIGHT];
+    uint8_t vectorscope[256 * 256];
+};
+
+static int yuv2rgb_RV[256];
+static int yuv2rgb_GU[256];
+static int yuv2rgb_GV[256];
+static int yuv2rgb_BU[256];
+
+/* REC 601, from imgconv.c */
+static void precompute_yuv2rgb(void)
+{
+    for (int u = 0; u < 256; u++)
+    {
+        int8_t U = u;
+        yuv2rgb_GU[u] = (-352 * U) >> 10;
+        yuv2rgb_BU[u] = (1812 * U) >> 10;
+    }
+
+    for (int v = 0; v < 256; v++)
+    {
+        int8_t V = v;
+        yuv2rgb_RV[v] = (1437 * V) >> 10;
+        yuv2rgb_GV[v] = (-731 * V) >> 10;
+    }
+}
+
+/* reference: hist_build() before the fused kernel {{{ */
+
+static void ref_hist_add_pixel(struct scopes * s, uint32_t pixel, int Y, int is_rgb)
+{
+    if (is_rgb)
+    {
+        const int gv = (pixel >> 16) & 0xFF;
+        const int gu = pixel & 0xFF;
+        int v = Y + yuv2rgb_RV[gv];
+        int R = COERCE(v, 0, 255);
+        v = Y + yuv2rgb_GU[gu] + yuv2rgb_GV[gv];
+        int G = COERCE(v, 0, 255);
+        v = Y + yuv2rgb_BU[gu];
+        int B = COERCE(v, 0, 255);
+        s->hist_r[((R * HIST_WIDTH) >> 8) & (HIST_WIDTH-1)]++;
+        s->hist_g[((G * HIST_WIDTH) >> 8) & (HIST_WIDTH-1)]++;
+        s->hist_b[((B * HIST_WIDTH) >> 8) & (HIST_WIDTH-1)]++;
+    }
+
+    s->total_px++;
+    uint32_t hist_level = (Y * HIST_WIDTH) >> 8;
+    unsigned count = ++(s->hist[hist_level & (HIST_WIDTH-1)]);
+    if (hist_level && count > s->max)
+        s->max = count;
+}
+
+static void ref_waveform_add_pixel(struct scopes * s, struct frame * f, int x, int Y)
+{
+    int x_ex = f->x_max - f->x0;
+    uint8_t * w = &s->waveform[COERCE(((x - f->x0) * WAVEFORM_WIDTH) / x_ex, 0, WAVEFORM_WIDTH-1) +
+                               COERCE((Y * WAVEFORM_HEIGHT) >> 8, 0, WAVEFORM_HEIGHT-1) * WAVEFORM_WIDTH];
+    if ((*w) < 250) (*w)++;
+}
+
+static void ref_vectorscope_addpixel(struct scopes * s, int gain, int8_t u, int8_t v)
+{
+    int V = -v << gain;
+    int U = u << gain;
+
+    int r = U*U + V*V;
+    const int r_sqrt = (int)sqrtf(r);
+    if (r > 124*124)
+    {
+        for (int R = 124; R < 128; R++)
+        {
+            int c = U * R / r_sqrt;
+            int sn = V * R / r_sqrt;
+            s->vectorscope[(c + 128) + (sn + 128) * 256] = 255 - COLOR_RED;
+        }
+    }
+    else
+    {
+        if (gain)
+        {
+            U += rand()%2;
+            V += rand()%2;
+        }
+
+        int pos = (U + 128) + (V + 128) * 256;
+        if (s->vectorscope[pos] < (0x2A << 2))
+        {
+            s->vectorscope[pos]++;
+        }
+    }
+}
+
+static void ref_hist_build(struct scopes * s, struct frame * f, int flags, int gain)
+{
+    memset(s, 0, sizeof(*s));
+
+    for (int y = f->y0 + f->off; y < f->y_max - f->off; y += 2)
+    {
+        for (int x = f->x0; x < f->x_max; x += 2)
+        {
+            uint32_t pixel = f->buf[(BM2LV_Y(f, y) * f->pitch + (BM2LV_X(f, x) << 1)) >> 2];
+
+            if ((flags & SCOPES_SKIP_MZ) && (pixel == MZ_WHITE || pixel == MZ_BLACK || pixel == MZ_GREEN))
+                continue;
+
+            int Y = (((pixel >> 24) & 0xFF) + ((pixel >> 8) & 0xFF)) >> 1;
+
+            if (flags & SCOPES_HIST)
+                ref_hist_add_pixel(s, pixel, Y, flags & SCOPES_HIST_RGB);
+
+            if (flags & SCOPES_WAVEFORM)
+                ref_waveform_add_pixel(s, f, x, Y);
+
+            if (flags & SCOPES_VECTORSCOPE)
+            {
+                int8_t U = (pixel >>  0) & 0xFF;
+                int8_t V = (pixel >> 16) & 0xFF;
+                ref_vectorscope_addpixel(s, gain, U, V);
+            }
+        }
+    }
+}
+
+/* }}} */
+
+/* the new hist_build(), minus the DryOS parts */
+static struct scopes_job job;
+
+static void fused_hist_build(struct scopes * s, struct frame * f, int flags, int gain, int stride)
+{
+    memset(s, 0, sizeof(*s));
+
+    job.flags = flags;
+    job.buf = f->buf;
+    job.weight = (stride / 2) * (stride / 2);
+    job.hist = s->hist;
+    job.hist_r = s->hist_r;
+    job.hist_g = s->hist_g;
+    job.hist_b = s->hist_b;
+    job.hist_max = 0;
+    job.total_px = 0;
+    job.yuv2rgb_rv = yuv2rgb_RV;
+    job.yuv2rgb_gu = yuv2rgb_GU;
+    job.yuv2rgb_gv = yuv2rgb_GV;
+    job.yuv2rgb_bu = yuv2rgb_BU;
+    job.waveform = s->waveform;
+    job.waveform_width = WAVEFORM_WIDTH;
+    job.waveform_height = WAVEFORM_HEIGHT;
+    job.vectorscope = s->vectorscope;
+    job.vectorscope_gain = gain;
+    job.vectorscope_rim = COLOR_RED;
+
+    job.row_count = 0;
+    job.col_count = 0;
+
+    for (int y = f->y0 + f->off; y < f->y_max - f->off && job.row_count < SCOPES_MAX_ROWS; y += stride)
+    {
+        job.rows[job.row_count++] = (BM2LV_Y(f, y) * f->pitch) >> 2;
+    }
+
+    for (int x = f->x0; x < f->x_max && job.col_count < SCOPES_MAX_COLS; x += stride)
+    {
+        job.cols[job.col_count] = BM2LV_X(f, x) >> 1;
+        job.waveform_cols[job.col_count] = COERCE(((x - f->x0) * WAVEFORM_WIDTH) / (f->x_max - f->x0), 0, WAVEFORM_WIDTH-1);
+        job.col_count++;
+    }
+
+    scopes_scan(&job);
+
+    s->max = job.hist_max;
+    s->total_px = job.total_px;
+}
+
+/* frames {{{ */
+
+/* maps the 720x480 overlay area on the whole LV buffer, like bm2lv on the LCD */
+static void frame_geometry(struct frame * f, int width, int height)
+{
+    f->width = width;
+    f->height = height;
+    f->pitch = width * 2;
+    f->x0 = 0;
+    f->y0 = 0;
+    f->x_max = 720;
+    f->y_max = 480;
+    f->off = 0;
+    f->sx = width * 1024 / 720;
+    f->sy = height * 1024 / 480;
+    f->tx = 0;
+    f->ty = 0;
+
+    for (int x = 0; x < 720; x++)
+    {
+        f->bm2lv_x[x] = ((x * f->sx) >> 10) + f->tx;
+    }
+}
+
+static uint32_t uyvy(int u, int y1, int v, int y2)
+{
+    return (u & 0xFF) | ((y1 & 0xFF) << 8) | ((v & 0xFF) << 16) | ((y2 & 0xFF) << 24);
+}
+
+/* gradients, saturated colors (vectorscope rim), noise and magic zoom borders */
+static void frame_synthesize(struct frame * f, int width, int height, unsigned seed)
+{
+    frame_geometry(f, width, height);
+    f->buf = malloc(f->pitch * height);
+    srand(seed);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width / 2; x++)
+        {
+            int Y = x * 2 * 255 / width;
+            int u = (y * 256 / height) - 128;
+            int v = ((x + y) % 256) - 128;
+
+            if (y < height / 4)
+            {
+                /* mild colors, noisy */
+                u /= 4; v /= 4;
+                Y += rand() % 16 - 8;
+            }
+            else if (y > height * 3 / 4)
+            {
+                /* random everything */
+                u = rand(); v = rand(); Y = rand();
+            }
+
+            f->buf[y * width / 2 + x] = uyvy(u, COERCE(Y, 0, 255), v, COERCE(Y + rand() % 3 - 1, 0, 255));
+        }
+    }
+
+    /* a magic zoom box */
+    for (int y = height / 3; y < height / 2; y++)
+    {
+        for (int x = width / 8; x < width / 4; x++)
+        {
+            bool border = (y < height / 3 + 4 || y >= height / 2 - 4 || x < width / 8 + 2 || x >= width / 4 - 2);
+            f->buf[y * width / 2 + x] = border ? (y & 1 ? MZ_WHITE : MZ_GREEN) : MZ_BLACK;
+        }
+    }
+}
+
+/* size -> dimensions of the usual LV buffers */
+static bool frame_load(struct frame * f, const char * filename)
+{
+    static const int sizes[][2] = {
+        { 720, 480 }, { 720, 576 }, { 960, 540 }, { 1024, 680 }, { 1056, 704 },
+        { 1280, 720 }, { 1620, 1080 }, { 1680, 945 }, { 1920, 1080 },
+    };
+
+    FILE * fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("cannot open %s\n", filename);
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    int width = 0, height = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        if (sizes[i][0] * sizes[i][1] * 2 == size)
+        {
+            width = sizes[i][0];
+            height = sizes[i][1];
+        }
+    }
+
+    if (!width)
+    {
+        printf("%s: unknown LV buffer size %ld\n", filename, size);
+        fclose(fp);
+        return false;
+    }
+
+    frame_geometry(f, width, height);
+    f->buf = malloc(size);
+    bool ok = fread(f->buf, 1, size, fp) == (size_t)size;
+    fclose(fp);
+    return ok;
+}
+
+/* }}} */
+
+static bool same_scopes(struct scopes * a, struct scopes * b, int flags)
+{
+    if (flags & SCOPES_HIST)
+    {
+        if (memcmp(a->hist, b->hist, sizeof(a->hist))) return false;
+        if (a->max != b->max || a->total_px != b->total_px) return false;
+    }
+
+    if (flags & SCOPES_HIST_RGB)
+    {
+        if (memcmp(a->hist_r, b->hist_r, sizeof(a->hist_r))) return false;
+        if (memcmp(a->hist_g, b->hist_g, sizeof(a->hist_g))) return false;
+        if (memcmp(a->hist_b, b->hist_b, sizeof(a->hist_b))) return false;
+    }
+
+    if ((flags & SCOPES_WAVEFORM) && memcmp(a->waveform, b->waveform, sizeof(a->waveform))) return false;
+    if ((flags & SCOPES_VECTORSCOPE) && memcmp(a->vectorscope, b->vectorscope, sizeof(a->vectorscope))) return false;
+
+    return true;
+}
+
+static struct scopes ref, out;
+
+static bool test_frame(struct frame * f)
+{
+    for (int flags = 0; flags < 32; flags++)
+    {
+        if ((flags & SCOPES_HIST_RGB) && !(flags & SCOPES_HIST))
+            continue;
+
+        ref_hist_build(&ref, f, flags, 0);
+        fused_hist_build(&out, f, flags, 0, 2);
+        if (!same_scopes(&ref, &out, flags))
+        {
+            printf("mismatch, flags %d\n", flags);
+            return false;
+        }
+    }
+
+    /* with gain, the dither differs, but not what is counted */
+    fused_hist_build(&out, f, SCOPES_HIST | SCOPES_VECTORSCOPE, 2, 2);
+    ref_hist_build(&ref, f, SCOPES_HIST | SCOPES_VECTORSCOPE, 2);
+    TRY(out.total_px == ref.total_px);
+
+    /* coarser stride: every 4th pixel counted, weighted 4x in the waveform */
+    fused_hist_build(&out, f, SCOPES_HIST | SCOPES_WAVEFORM, 0, 4);
+    TRY(out.total_px == (uint32_t)(((f->y_max - f->y0 - 2 * f->off + 3) / 4) * ((f->x_max - f->x0 + 3) / 4)));
+    for (int i = 0; i < WAVEFORM_WIDTH * WAVEFORM_HEIGHT; i++)
+    {
+        TRY(out.waveform[i] <= 250);
+    }
+
+    return true;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void bench_frame(struct frame * f, const char * name)
+{
+    static const struct { const char * name; int flags; } cases[] = {
+        { "luma hist",          SCOPES_HIST },
+        { "RGB hist",           SCOPES_HIST | SCOPES_HIST_RGB },
+        { "waveform",           SCOPES_WAVEFORM },
+        { "vectorscope",        SCOPES_VECTORSCOPE },
+        { "hist+wfm+vscope",    SCOPES_HIST | SCOPES_HIST_RGB | SCOPES_WAVEFORM | SCOPES_VECTORSCOPE },
+    };
+    const int runs = 50;
+
+    printf("%s (%dx%d), ms per frame:\n", name, f->width, f->height);
+    printf("%-16s %10s %10s %10s\n", "", "per-pixel", "fused", "fused/4px");
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        double t0 = now_ms();
+        for (int i = 0; i < runs; i++) ref_hist_build(&ref, f, cases[c].flags | SCOPES_SKIP_MZ, 0);
+        double t1 = now_ms();
+        for (int i = 0; i < runs; i++) fused_hist_build(&out, f, cases[c].flags | SCOPES_SKIP_MZ, 0, 2);
+        double t2 = now_ms();
+        for (int i = 0; i < runs; i++) fused_hist_build(&out, f, cases[c].flags | SCOPES_SKIP_MZ, 0, 4);
+        double t3 = now_ms();
+
+        printf("%-16s %10.3f %10.3f %10.3f\n", cases[c].name,
+            (t1 - t0) / runs, (t2 - t1) / runs, (t3 - t2) / runs);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct frame f;
+    precompute_yuv2rgb();
+
+    if(argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        if (argc == 2)
+        {
+            frame_synthesize(&f, 720, 480, 1);
+            bench_frame(&f, "synthetic");
+            free(f.buf);
+        }
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (!frame_load(&f, argv[i])) return 1;
+            bench_frame(&f, argv[i]);
+            free(f.buf);
+        }
+        return 0;
+    }
+
+    static const int sizes[][2] = { { 720, 480 }, { 1056, 704 }, { 1920, 1080 } };
+    for (int i = 0; i < 3; i++)
+    {
+        frame_synthesize(&f, sizes[i][0], sizes[i][1], i + 1);
+        TRY(test_frame(&f));
+        printf("scopes %dx%d: OK\n", f.width, f.height);
+        free(f.buf);
+    }
+
+    /* 16:9 bars skipped */
+    frame_synthesize(&f, 720, 480, 4);
+    f.off = 60;
+    TRY(test_frame(&f));
+    printf("scopes with y offset: OK\n");
+    free(f.buf);
+
+    return 0;
+}
@@ -98,62 +98,15 @@ vectorscope_init()
     }
 }
 
-static int vectorscope_coord_uv_to_pos(int U, int V)
+/* 256x256 bins, filled by hist_build (scopes.c), NULL until the first vectorscope_start */
+uint8_t * vectorscope_get_buffer()
 {
-    /* convert YUV to vectorscope position */
-    V *= vectorscope_height;
-    V >>= 8;
-    V += vectorscope_height >> 1;
-
-    U *= vectorscope_width;
-    U >>= 8;
-    U += vectorscope_width >> 1;
-
-    int pos = U + V * vectorscope_width;
-    
-    return pos;
+    return vectorscope;
 }
 
-void vectorscope_addpixel(uint8_t y, int8_t u, int8_t v)
+int vectorscope_get_gain()
 {
-    if(vectorscope == NULL)
-    {
-        return;
-    }
-    
-    int V = -v << vectorscope_gain;
-    int U = u << vectorscope_gain;
-    
-    int r = U*U + V*V;
-    const int r_sqrt = (int)sqrtf(r);
-    if (r > 124*124)
-    {
-        /* almost out of circle, mark it with red */
-        for (int R = 124; R < 128; R++)
-        {
-            int c = U * R / r_sqrt;
-            int s = V * R / r_sqrt;
-            int pos = vectorscope_coord_uv_to_pos(c, s);
-            vectorscope[pos] = 255 - COLOR_RED;
-        }
-    }
-    else
-    {
-        if (vectorscope_gain)
-        {
-            /* simulate better resolution */
-            U += rand()%2;
-            V += rand()%2;
-        }
-        
-        int pos = vectorscope_coord_uv_to_pos(U, V);
-        
-        /* increase luminance at this position. when reaching 4*0x2A, we are at maximum. */
-        if(vectorscope[pos] < (0x2A << 2))
-        {
-            vectorscope[pos]++;
-        }
-    }
+    return vectorscope_gain;
 }
 
 /* memcpy the second part of vectorscope buffer. uses only few resources */
@@ -44,6 +44,10 @@
 #include "imgconv.h"
 #include "falsecolor.h"
 #include "histogram.h"
+#include "scopes.h"
+#include "peaking.h"
+#include "overlay.h"
+#include "raw_grid.h"
 
 /* todo: move battery stuff in battery.c */
 #include "battery.h"
@@ -476,8 +480,9 @@ static uint8_t* waveform = 0;
 
 /** Generate the histogram data from the YUV frame buffer.
  *
- * Walk the frame buffer two pixels at a time, in 32-bit chunks,
- * to avoid err70 while recording.
+ * Walk the frame buffer in 32-bit chunks, to avoid err70 while recording,
+ * every 2 pixels (more while recording, or as configured). The histogram,
+ * waveform and vectorscope are updated in the same pass (scopes.c).
  *
  * Average two adjacent pixels to try to reduce noise slightly.
  *
@@ -487,44 +492,20 @@ static uint8_t* waveform = 0;
  */
 
 #if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM) || defined(FEATURE_VECTORSCOPE)
-#ifdef FEATURE_HISTOGRAM
-static void hist_add_pixel(uint32_t pixel, int Y)
+
+/* sampling step, in BMP pixels: 0 = auto, 1/2/3 = 2/4/8 pixels */
+static CONFIG_INT("scopes.stride", scopes_stride, 0);
+
+static int hist_get_stride()
 {
-    if (histogram.is_rgb)
-    {
-        int R, G, B;
-        //~ uyvy2yrgb(pixel, &Y, &R, &G, &B);
-        COMPUTE_UYVY2YRGB(pixel, Y, R, G, B);
-        // YRGB range: 0-255
-        uint32_t R_level = (R * HIST_WIDTH) >> 8;
-        uint32_t G_level = (G * HIST_WIDTH) >> 8;
-        uint32_t B_level = (B * HIST_WIDTH) >> 8;
-        
-        histogram.hist_r[R_level & (HIST_WIDTH-1)]++;
-        histogram.hist_g[G_level & (HIST_WIDTH-1)]++;
-        histogram.hist_b[B_level & (HIST_WIDTH-1)]++;
+    if (scopes_stride)
+    {
+        return 1 << scopes_stride;
     }
-    
-    /* luma component is always computed, since we need histogram.max */
-    /* and it's much less expensive than RGB anyway */
-    histogram.total_px++;
-    uint32_t hist_level = (Y * HIST_WIDTH) >> 8;
-
-    // Ignore the 0 bin.  It generates too much noise
-    unsigned count = ++ (histogram.hist[ hist_level & (HIST_WIDTH-1)]);
-    if( hist_level && count > histogram.max )
-        histogram.max = count;
-}
-#endif
 
-#ifdef FEATURE_WAVEFORM
-static inline void waveform_add_pixel(int x, int Y)
-{
-    if (!waveform) return;
-    uint8_t* w = &WAVEFORM(((x-os.x0) * WAVEFORM_WIDTH) / os.x_ex, (Y * WAVEFORM_HEIGHT) >> 8);
-    if ((*w) < 250) (*w)++;
+    /* leave more CPU time to the recorder */
+    return RECORDING ? 4 : 2;
 }
-#endif
 
 static void
 hist_build()
@@ -533,7 +514,9 @@ hist_build()
     uint32_t* buf = (uint32_t*)lv->vram;
     if (!buf) return;
 
-    int x,y;
+    /* large (row and column tables), keep it off the stack */
+    static struct scopes_job job;
+    job.flags = 0;
 
     #ifdef FEATURE_HISTOGRAM
     memset(&histogram, 0, sizeof(histogram));
@@ -574,45 +557,80 @@ hist_build()
          * => no need to scan the entire image */
         return;
     }
-    
-    int mz = nondigic_zoom_overlay_enabled();
+
+    #ifdef FEATURE_HISTOGRAM
+    if (hist_draw && !histogram.is_raw)
+    {
+        job.flags |= histogram.is_rgb ? SCOPES_HIST | SCOPES_HIST_RGB : SCOPES_HIST;
+        job.hist = histogram.hist;
+        job.hist_r = histogram.hist_r;
+        job.hist_g = histogram.hist_g;
+        job.hist_b = histogram.hist_b;
+        job.hist_max = 0;
+        job.total_px = 0;
+        job.yuv2rgb_rv = yuv2rgb_RV;
+        job.yuv2rgb_gu = yuv2rgb_GU;
+        job.yuv2rgb_gv = yuv2rgb_GV;
+        job.yuv2rgb_bu = yuv2rgb_BU;
+    }
+    #endif
+
+    #ifdef FEATURE_WAVEFORM
+    if (waveform_draw && waveform)
+    {
+        job.flags |= SCOPES_WAVEFORM;
+        job.waveform = waveform;
+        job.waveform_width = WAVEFORM_WIDTH;
+        job.waveform_height = WAVEFORM_HEIGHT;
+    }
+    #endif
+
+    #ifdef FEATURE_VECTORSCOPE
+    if (vectorscope_draw && vectorscope_get_buffer())
+    {
+        job.flags |= SCOPES_VECTORSCOPE;
+        job.vectorscope = vectorscope_get_buffer();
+        job.vectorscope_gain = vectorscope_get_gain();
+        job.vectorscope_rim = COLOR_RED;
+    }
+    #endif
+
+    if (nondigic_zoom_overlay_enabled())
+    {
+        /* ignore magic zoom borders */
+        job.flags |= SCOPES_SKIP_MZ;
+    }
+
+    /* sampled positions, as word offsets in the LV buffer */
+    int stride = hist_get_stride();
     int off = get_y_skip_offset_for_histogram();
-    for( y = os.y0 + off; y < os.y_max - off; y += 2 )
+
+    job.buf = buf;
+    job.weight = (stride / 2) * (stride / 2);
+    job.row_count = 0;
+    job.col_count = 0;
+
+    for (int y = os.y0 + off; y < os.y_max - off && job.row_count < SCOPES_MAX_ROWS; y += stride)
     {
-        for( x = os.x0 ; x < os.x_max ; x += 2 )
-        {
-            uint32_t pixel = buf[BM2LV(x,y) >> 2];
+        job.rows[job.row_count++] = (BM2LV_Y(y) * vram_lv.pitch) >> 2;
+    }
 
-            // ignore magic zoom borders
-            if (mz && (pixel == MZ_WHITE || pixel == MZ_BLACK || pixel == MZ_GREEN))
-                continue;
+    for (int x = os.x0; x < os.x_max && job.col_count < SCOPES_MAX_COLS; x += stride)
+    {
+        job.cols[job.col_count] = BM2LV_X(x) >> 1;
+        job.waveform_cols[job.col_count] = COERCE(((x - os.x0) * WAVEFORM_WIDTH) / os.x_ex, 0, WAVEFORM_WIDTH-1);
+        job.col_count++;
+    }
 
-            int Y = UYVY_GET_AVG_Y(pixel);
-            
-            #ifdef FEATURE_HISTOGRAM
-            if (hist_draw && !histogram.is_raw)
-            {
-                hist_add_pixel(pixel, Y);
-            }
-            #endif
-            
-            #ifdef FEATURE_WAVEFORM
-            if (waveform_draw) 
-            {
-                waveform_add_pixel(x, Y);
-            }
-            #endif
-            
-            #ifdef FEATURE_VECTORSCOPE
-            if (vectorscope_draw)
-            {
-                int8_t U = (pixel >>  0) & 0xFF;
-                int8_t V = (pixel >> 16) & 0xFF;
-                vectorscope_addpixel(Y, U, V);
-            }
-            #endif
-        }
+    scopes_scan(&job);
+
+    #ifdef FEATURE_HISTOGRAM
+    if (job.flags & SCOPES_HIST)
+    {
+        histogram.max = job.hist_max;
+        histogram.total_px = job.total_px;
     }
+    #endif
 }
 #endif
 
@@ -814,6 +832,10 @@ static void FAST draw_zebras_raw_lv()
     if (white > 16383) white = 15000;
     int underexposed = zebra_raw_underexposure ? ev_to_raw(- (raw_info.dynamic_range - (zebra_raw_underexposure - 1) * 100) / 100.0) : 0;
 
+    struct raw_grid * grid = raw_hist_grid_take();
+    if (!grid) return;
+
+    /* same rows and columns as the grid */
     int off = get_y_skip_offset_for_overlays();
     for(int i = os.y0 + off; i < os.y_max - off; i += 2 )
     {
@@ -823,10 +845,15 @@ static void FAST draw_zebras_raw_lv()
         uint64_t* bp;  // through bmp vram
         uint64_t* mp;  // through mirror
 
-        int y = BM2RAW_Y(i);
+        int gr = (i - grid->y0) / RAW_GRID_DY;
+        if (gr >= grid->rows) break;
+
+        int y = grid->raw_y[gr];
         if (y < raw_info.active_area.y1 || y > raw_info.active_area.y2) continue;
+
+        const struct raw_grid_cell * row = raw_grid_row(grid, gr);
         
-        for (int j = os.x0; j < os.x_max; j += 8)
+        for (int j = os.x0, gc = 0; j < os.x_max && gc < grid->cols; j += 8, gc++)
         {
             bp = b_row + j/8;
             mp = m_row + j/8;
@@ -837,15 +864,15 @@ static void FAST draw_zebras_raw_lv()
             if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
             if ((MP & 0x80808080)) continue;
             
-            int x = BM2RAW_X(j);
+            int x = grid->raw_x[gc];
             
             if (x < raw_info.active_area.x1 || x > raw_info.active_area.x2) continue;
             
             /* for dual ISO: use dark lines for overexposure and bright lines for underexposure */
-            int r = raw_red_pixel_dark(x, y);
-            int g = raw_green_pixel_dark(x, y);
-            int b = raw_blue_pixel_dark(x, y);
-            int u = raw_green_pixel_bright(x, y);
+            int r = raw_cell_red_dark(&row[gc]);
+            int g = raw_cell_green_dark(&row[gc]);
+            int b = raw_cell_blue_dark(&row[gc]);
+            int u = raw_cell_green_bright(&row[gc]);
 
             uint64_t c = zebra_rgb_solid_color(u <= underexposed, r > white, g > white, b > white);
             c = c | (c << 32);
@@ -856,6 +883,8 @@ static void FAST draw_zebras_raw_lv()
             #undef MP
         }
     }
+
+    raw_hist_grid_give();
 }
 
 static MENU_UPDATE_FUNC(raw_zebra_update)
@@ -1125,10 +1154,10 @@ static inline int zebra_color_word_row(int c, int y)
 
 #define MAX_DIRTY_PIXELS 5000
 
-
-static int* dirty_pixels = 0;
-static uint32_t* dirty_pixel_values = 0;
-static int dirty_pixels_num = 0;
+/* LiveView dots, see peaking.c */
+static struct peak_tiles * focus_tiles = 0;
+static int peak_lv_rows[BMP_H_PLUS - BMP_H_MINUS];
+static uint8_t peak_colors[256];
 //~ static unsigned int* bm_hd_r_cache = 0;
 static uint16_t bm_lv_x_cache[BMP_W_PLUS - BMP_W_MINUS];
 
@@ -1157,15 +1186,84 @@ static void zebra_update_lut()
 
 #endif
 
+#if defined(FEATURE_ZEBRA) || defined(FEATURE_FALSE_COLOR)
+/* LiveView positions sampled by zebras (cell_width 4) and false colors (2),
+ * every 2nd row, as in the old per-pixel loops; see overlay.c */
+int zebra_overlay_setup(struct overlay_job * job, int cell_width)
+{
+    uint8_t * lvram = get_yuv422_vram()->vram;
+    if (!lvram) return 0;
+
+    uint8_t * const bvram = bmp_vram_real();
+    if (!bvram || !bvram_mirror) return 0;
+
+    int off = get_y_skip_offset_for_overlays();
+
+    job->buf = (uint32_t *)lvram;
+    job->bmp = bvram;
+    job->mirror = bvram_mirror;
+    job->bmp_pitch = BMPPITCH;
+    job->cell_width = cell_width;
+    job->x0 = os.x0 & ~(cell_width - 1);
+    job->y0 = os.y0 + off;
+    job->rgb = 0;
+    job->row_count = 0;
+    job->col_count = 0;
+
+    for (int y = os.y0 + off; y < os.y_max - off && job->row_count < OVERLAY_MAX_ROWS; y += 2)
+    {
+        job->rows[job->row_count++] = BM2LV_R(y) >> 2;
+    }
+
+    for (int x = os.x0; x < os.x_max && job->col_count < OVERLAY_MAX_COLS; x += cell_width)
+    {
+        job->cols[job->col_count++] = BM2LV_X(x) >> 1;
+    }
+
+    return 1;
+}
+#endif
+
 #ifdef FEATURE_ZEBRA
 
 #ifdef FEATURE_ZEBRA_FAST
 static int zebra_digic_dirty = 0;
 #endif
 
+/* zebra colors for each luma, and for each RGB class, on rows with y % 4 == 0..3 */
+static uint32_t zebra_lut[4][256];
+static uint32_t zebra_rgb_lut[4][OVERLAY_RGB_CLASSES];
+
+static void zebra_update_colors(int zll, int zlh)
+{
+    static int prev_zll = -1;
+    static int prev_zlh = -1;
+
+    if (zll == prev_zll && zlh == prev_zlh)
+        return;
+
+    prev_zll = zll;
+    prev_zlh = zlh;
+
+    for (int y = 0; y < 4; y++)
+    {
+        for (int Y = 0; Y < 256; Y++)
+        {
+            zebra_lut[y][Y] =
+                Y > zlh ? zebra_color_word_row(COLOR_RED,  y) :
+                Y < zll ? zebra_color_word_row(COLOR_BLUE, y) : 0;
+        }
+
+        for (int clip = 0; clip < 8; clip++)
+        {
+            zebra_rgb_lut[y][clip] = zebra_rgb_color(0, clip & 4, clip & 2, clip & 1, y);
+        }
+        zebra_rgb_lut[y][OVERLAY_RGB_UNDER] = zebra_rgb_color(1, 0, 0, 0, y);
+    }
+}
+
 static void draw_zebras( int Z )
 {
-    uint8_t * const bvram = bmp_vram_real();
     int zd = Z && zebra_draw && (lv_luma_is_accurate() || PLAY_OR_QR_MODE) && (zebra_rec || NOT_RECORDING); // when to draw zebras
     if (zd)
     {
@@ -1220,6 +1318,7 @@ static void draw_zebras( int Z )
             if (s == last_s) return;
             last_s = s;
             
+            uint8_t * const bvram = bmp_vram_real();
             alter_bitmap_palette_entry(FAST_ZEBRA_GRID_COLOR, 0, 256, 256);
             int off = get_y_skip_offset_for_overlays();
             for(int y = os.y0 + off; y < os.y_max - off; y++)
@@ -1252,162 +1351,27 @@ static void draw_zebras( int Z )
         }
         #endif
         
-        uint8_t * lvram = get_yuv422_vram()->vram;
-        if (!lvram) return;
+        /* one sample per BMP word, colors precomputed (overlay.c) */
+        static struct overlay_job job;
+        if (!zebra_overlay_setup(&job, 4)) return;
 
-        int zlr = zlh;
-        int zlg = zlh;
-        int zlb = zlh;
+        zebra_update_colors(zll, zlh);
 
-        // draw zebra in 16:9 frame
-        // y is in BM coords
-        int off = get_y_skip_offset_for_overlays();
-        for(int y = os.y0 + off; y < os.y_max - off; y += 2 )
+        job.rgb = (zebra_colorspace == 1 && !EXT_MONITOR_RCA);
+        for (int i = 0; i < 4; i++)
         {
-            #define color_over           zebra_color_word_row(COLOR_RED,  y)
-            #define color_under          zebra_color_word_row(COLOR_BLUE, y)
-            #define color_over_2         zebra_color_word_row(COLOR_RED,  y+1)
-            #define color_under_2        zebra_color_word_row(COLOR_BLUE, y+1)
-            
-            #define color_rgb_under      zebra_rgb_color(1, 0, 0, 0, y)
-            #define color_rgb_under_2    zebra_rgb_color(1, 0, 0, 0, y+1)
-            
-            #define color_rgb_clipR      zebra_rgb_color(0, 1, 0, 0, y)
-            #define color_rgb_clipR_2    zebra_rgb_color(0, 1, 0, 0, y+1)
-            #define color_rgb_clipG      zebra_rgb_color(0, 0, 1, 0, y)
-            #define color_rgb_clipG_2    zebra_rgb_color(0, 0, 1, 0, y+1)
-            #define color_rgb_clipB      zebra_rgb_color(0, 0, 0, 1, y)
-            #define color_rgb_clipB_2    zebra_rgb_color(0, 0, 0, 1, y+1)
-            
-            #define color_rgb_clipRG     zebra_rgb_color(0, 1, 1, 0, y)
-            #define color_rgb_clipRG_2   zebra_rgb_color(0, 1, 1, 0, y+1)
-            #define color_rgb_clipGB     zebra_rgb_color(0, 0, 1, 1, y)
-            #define color_rgb_clipGB_2   zebra_rgb_color(0, 0, 1, 1, y+1)
-            #define color_rgb_clipRB     zebra_rgb_color(0, 1, 0, 1, y)
-            #define color_rgb_clipRB_2   zebra_rgb_color(0, 1, 0, 1, y+1)
-            
-            #define color_rgb_clipRGB    zebra_rgb_color(0, 1, 1, 1, y)
-            #define color_rgb_clipRGB_2  zebra_rgb_color(0, 1, 1, 1, y+1)
-
-            uint32_t * const v_row = (uint32_t*)( lvram        + BM2LV_R(y)    );  // 2 pixels
-            uint32_t * const b_row = (uint32_t*)( bvram        + BM_R(y)       );  // 4 pixels
-            uint32_t * const m_row = (uint32_t*)( bvram_mirror + BM_R(y)       );  // 4 pixels
-            
-            uint32_t* lvp; // that's a moving pointer through lv vram
-            uint32_t* bp;  // through bmp vram
-            uint32_t* mp;  // through mirror
-
-            for (int x = os.x0; x < os.x_max; x += 4)
-            {
-                lvp = v_row + (BM2LV_X(x) >> 1);
-                bp = b_row + (x >> 2);
-                mp = m_row + (x >> 2);
-                #define BP (*bp)
-                #define MP (*mp)
-                #define BN (*(bp + BMPPITCH/4))
-                #define MN (*(mp + BMPPITCH/4))
-                if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
-                if (BN != 0 && BN != MN) { little_cleanup(bp + (BMPPITCH >> 2), mp + (BMPPITCH >> 2)); continue; }
-                if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
-                
-                if (zebra_colorspace == 1 && !EXT_MONITOR_RCA) // rgb
-                {
-                    int Y, R, G, B;
-                    //~ uyvy2yrgb(*lvp, &Y, &R, &G, &B);
-                    COMPUTE_UYVY2YRGB(*lvp, Y, R, G, B);
-
-                    if(unlikely(Y < zll)) // underexposed
-                    {
-                        BP = MP = color_rgb_under;
-                        BN = MN = color_rgb_under_2;
-                    }
-                    else
-                    {
-                        //~ BP = MP = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y);
-                        //~ BN = MN = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y+1);
-
-                        if (unlikely(R > zlr)) // R clipped
-                        {
-                            if (unlikely(G > zlg)) // RG clipped
-                            {
-                                if (B > zlb) // RGB clipped (all of them)
-                                {
-                                    BP = MP = color_rgb_clipRGB;
-                                    BN = MN = color_rgb_clipRGB_2;
-                                }
-                                else // only R and G clipped
-                                {
-                                    BP = MP = color_rgb_clipRG;
-                                    BN = MN = color_rgb_clipRG_2;
-                                }
-                            }
-                            else // R clipped, G not clipped
-                            {
-                                if (unlikely(B > zlb)) // only R and B clipped
-                                {
-                                    BP = MP = color_rgb_clipRB;
-                                    BN = MN = color_rgb_clipRB_2;
-                                }
-                                else // only R clipped
-                                {
-                                    BP = MP = color_rgb_clipR;
-                                    BN = MN = color_rgb_clipR_2;
-                                }
-                            }
-                        }
-                        else // R not clipped
-                        {
-                            if (unlikely(G > zlg)) // R not clipped, G clipped
-                            {
-                                if (unlikely(B > zlb)) // only G and B clipped
-                                {
-                                    BP = MP = color_rgb_clipGB;
-                                    BN = MN = color_rgb_clipGB_2;
-                                }
-                                else // only G clipped
-                                {
-                                    BP = MP = color_rgb_clipG;
-                                    BN = MN = color_rgb_clipG_2;
-                                }
-                            }
-                            else // R not clipped, G not clipped
-                            {
-                                if (unlikely(B > zlb)) // only B clipped
-                                {
-                                    BP = MP = color_rgb_clipB;
-                                    BN = MN = color_rgb_clipB_2;
-                                }
-                                else // nothing clipped
-                                {
-                                    BN = MN = BP = MP = 0;
-                                }
-                            }
-                        }
-                    }
-                }
-                else // luma
-                {
-                    int p0 = (*lvp) >> 8 & 0xFF;
-                    if (unlikely(p0 > zlh))
-                    {
-                        BP = MP = color_over;
-                        BN = MN = color_over_2;
-                    }
-                    else if (unlikely(p0 < zll))
-                    {
-                        BP = MP = color_under;
-                        BN = MN = color_under_2;
-                    }
-                    else
-                        BN = MN = BP = MP = 0;
-                }
-                    
-                #undef MP
-                #undef BP
-                #undef BN
-                #undef MN
-            }
+            job.lut[i] = zebra_lut[i];
+            job.rgb_colors[i] = zebra_rgb_lut[i];
         }
+        job.level_lo = zll;
+        job.level_hi = zlh;
+        job.yuv2rgb_rv = yuv2rgb_RV;
+        job.yuv2rgb_gu = yuv2rgb_GU;
+        job.yuv2rgb_gv = yuv2rgb_GV;
+        job.yuv2rgb_bu = yuv2rgb_BU;
+
+        // draw zebra in 16:9 frame
+        overlay_draw(&job);
     }
 }
 #endif
@@ -1441,30 +1405,7 @@ static inline int peak_d2xy_sharpen(uint8_t* p8)
 
 static inline int FAST calc_peak(const uint8_t* p8, const int pitch)
 {
-    // approximate second derivative with a Laplacian kernel:
-    //     -1
-    //  -1  4 -1
-    //     -1
-    const int p8_xmin1 = (int)(*(p8 - 2));
-    const int p8_xplus1 = (int)(*(p8 + 2));
-    const int p8_ymin1 = (int)(*(p8 - pitch));
-    const int p8_yplus1 = (int)(*(p8 + pitch));
-
-    int result = ((int)(*p8) * 4);
-    result -= p8_xplus1 + p8_xmin1 + p8_yplus1 + p8_ymin1;
-
-    int e = ABS(result);
-
-    if (focus_peaking_filter_edges)
-    {
-        // filter out strong edges where first derivative is strong
-        // as these are usually false positives
-        int d1x = ABS(p8_xplus1 - p8_xmin1);
-        int d1y = ABS(p8_yplus1 - p8_ymin1);
-        int d1 = MAX(d1x, d1y);
-        e = MAX(e - ((d1 << focus_peaking_filter_edges) >> 2), 0) * 2;
-    }
-    return e;
+    return peak_laplacian(p8, pitch, focus_peaking_filter_edges);
 }
 
 static inline int FAST peak_d2xy(const uint8_t* p8)
@@ -1534,8 +1475,13 @@ void FAST peak_disp_filter()
     // the percentage selected in menu represents how many pixels are considered in focus
     // let's say above some FOCUSED_THR
     // so, let's scale edge value so that e=thr maps to e=FOCUSED_THR
-    for (int i = 0, i_fthr = 0; i < 255; i++, i_fthr += FOCUSED_THR)
-        peak_scaling[i] = MIN(i_fthr / thr, 255);
+    static int scaling_thr = 0;
+    if (thr != scaling_thr)
+    {
+        for (int i = 0, i_fthr = 0; i < 255; i++, i_fthr += FOCUSED_THR)
+            peak_scaling[i] = MIN(i_fthr / thr, 255);
+        scaling_thr = thr;
+    }
     
     int n_over = 0;
     int n_total = 720 * (os.y_max - os.y0) / 2;
@@ -1651,40 +1597,6 @@ void FAST peak_disp_filter()
 }
 #endif
 
-static void FAST focus_found_pixel(int x, int y, int e, int thr, uint8_t * const bvram)
-{    
-    int color = get_focus_color(thr, e);
-    //~ int color = COLOR_RED;
-    color = (color << 8) | color;
-    
-    uint16_t * const b_row = (uint16_t*)( bvram + BM_R(y) );   // 2 pixels
-    uint16_t * const m_row = (uint16_t*)( bvram_mirror + BM_R(y) );   // 2 pixels
-
-    const int x_half = x >> 1;
-    uint32_t pixel = b_row[x_half];
-    uint32_t mirror = m_row[x_half];
-    const int pos = x_half + (BMPPITCH >> 1);
-    uint32_t pixel2 = b_row[pos];
-    uint32_t mirror2 = m_row[pos];
-    if (mirror  & 0x8080) 
-        return;
-    if (mirror2 & 0x8080)
-        return;
-    if (pixel  != 0 && pixel  != mirror)
-        return;
-    if (pixel2 != 0 && pixel2 != mirror2)
-        return;
-
-    if (dirty_pixels_num < MAX_DIRTY_PIXELS)
-    {
-        dirty_pixel_values[dirty_pixels_num] = pixel + (pixel2 << 16);
-        dirty_pixels[dirty_pixels_num++] = (void*)&b_row[x_half] - (void*)bvram;
-    }
-
-    b_row[x_half] = b_row[pos] = 
-    m_row[x_half] = m_row[pos] = color;
-}
-
 static void focus_found_pixel_playback(int x, int y, int e, int thr, uint8_t * const bvram)
 {    
     int color = get_focus_color(thr, e);
@@ -1740,30 +1652,19 @@ draw_zebra_and_focus( int Z, int F )
 
     if (F && focus_peaking)
     {
-        // clear previously written pixels
-        if (unlikely(!dirty_pixels)) dirty_pixels = malloc(MAX_DIRTY_PIXELS * sizeof(int));
-        if (unlikely(!dirty_pixels)) return -1;
-        if (unlikely(!dirty_pixel_values)) dirty_pixel_values = malloc(MAX_DIRTY_PIXELS * sizeof(int));
-        if (unlikely(!dirty_pixel_values)) return -1;
-        int i;
-        for (i = 0; i < dirty_pixels_num; i++)
+        if (unlikely(!focus_tiles))
         {
-            #define B1 *(uint16_t*)(bvram + dirty_pixels[i])
-            #define B2 *(uint16_t*)(bvram + dirty_pixels[i] + BMPPITCH)
-            #define M1 *(uint16_t*)(bvram_mirror + dirty_pixels[i])
-            #define M2 *(uint16_t*)(bvram_mirror + dirty_pixels[i] + BMPPITCH)
+            /* tile grid, followed by two lists of dots */
+            focus_tiles = malloc(sizeof(struct peak_tiles) + 2 * MAX_DIRTY_PIXELS * sizeof(struct peak_dot));
+            if (unlikely(!focus_tiles)) return -1;
+            peak_tiles_init(focus_tiles, (struct peak_dot *)(focus_tiles + 1), MAX_DIRTY_PIXELS);
+        }
 
-            if (likely((B1 == 0 || B1 == M1)) && likely((B2 == 0 || B2 == M2)))
-            {
-                B1 = M1 = dirty_pixel_values[i] & 0xFFFF;
-                B2 = M2 = dirty_pixel_values[i] >> 16;
-            }
-            #undef B1
-            #undef B2
-            #undef M1
-            #undef M2
+        if (!lv)
+        {
+            // clear the dots left from LiveView
+            peak_tiles_erase(focus_tiles);
         }
-        dirty_pixels_num = 0;
         
         uint32_t vram = (uint32_t)CACHEABLE(YUV422_LV_BUFFER_DISPLAY_ADDR);
         if (!vram) return 0;
@@ -1799,25 +1700,43 @@ draw_zebra_and_focus( int Z, int F )
         if (lv) // fast, realtime
         {
             n_total = ((yEnd - yStart) * (xEnd - xStart)) / 6;
-            for(int y = yStart; y < yEnd; y += 3)
+
+            for (int y = yStart; y < yEnd; y++)
             {
-                uint32_t row = vram + BM2LV_R(y);
-                
-                for (int x = xStart; x < xEnd; x += 2)
+                peak_lv_rows[y - yStart] = BM2LV_R(y);
+            }
+
+            static int colors_thr = -1;
+            static int colors_mode = -1;
+            if (thr != colors_thr || (int)focus_peaking_color != colors_mode)
+            {
+                for (int e = 0; e < 256; e++)
                 {
-                    p8 = (uint8_t *)(row + bm_lv_x_cache[x - BMP_W_MINUS]);
-                     
-                    int e = peak_d2xy(p8);
-                    
-                    /* executed for 1% of pixels */
-                    if (unlikely(e >= thr))
-                    {
-                        n_over++;
-                        if (unlikely(dirty_pixels_num >= MAX_DIRTY_PIXELS)) break; // threshold too low, abort
-                        focus_found_pixel(x, y, e, thr, bvram);
-                    }
+                    peak_colors[e] = get_focus_color(thr, e);
                 }
+                colors_thr = thr;
+                colors_mode = focus_peaking_color;
             }
+
+            /* only the tiles that changed since the last frame are scanned */
+            struct peak_job job = {
+                .lv             = (const uint8_t *) vram,
+                .lv_pitch       = vram_lv.pitch,
+                .lv_rows        = peak_lv_rows,
+                .lv_cols        = &bm_lv_x_cache[xStart - BMP_W_MINUS],
+                .bmp            = bvram,
+                .mirror         = bvram_mirror,
+                .bmp_pitch      = BMPPITCH,
+                .x0             = xStart,
+                .y0             = yStart,
+                .x1             = xEnd,
+                .y1             = yEnd,
+                .thr            = thr,
+                .filter_edges   = focus_peaking_filter_edges,
+                .colors         = peak_colors,
+            };
+
+            n_over = peak_tiles_update(focus_tiles, &job);
         }
         else // playback - can be slower and more accurate
         {
@@ -1836,9 +1755,6 @@ draw_zebra_and_focus( int Z, int F )
                     {
                         n_over++;
 
-                        if (unlikely(dirty_pixels_num >= MAX_DIRTY_PIXELS)) // threshold too low, abort
-                            break;
-
                         if (F==1) focus_found_pixel_playback(x, y, e, thr, bvram);
                     }
                 }
@@ -2462,21 +2378,61 @@ static void spotmeter_step()
 
         raw_luma = 0;
         int raw_count = 0;
-        for( y = ycr - dxr ; y <= ycr + dxr ; y++ )
+
+        /* in LiveView, from the cells inside the box (or the nearest one) */
+        struct raw_grid * grid = 0;
+        #ifndef RAW_SPOTMETER_TEST
+        if (lv) grid = raw_hist_grid_take();
+        #endif
+
+        if (grid)
+        {
+            const int d = dxb;
+            int c0 = COERCE((xcb - d - grid->x0 + RAW_GRID_DX - 1) / RAW_GRID_DX, 0, grid->cols - 1);
+            int c1 = COERCE((xcb + d - grid->x0) / RAW_GRID_DX, 0, grid->cols - 1);
+            int r0 = COERCE((ycb - d - grid->y0 + RAW_GRID_DY - 1) / RAW_GRID_DY, 0, grid->rows - 1);
+            int r1 = COERCE((ycb + d - grid->y0) / RAW_GRID_DY, 0, grid->rows - 1);
+            if (c1 < c0) c0 = c1 = COERCE((xcb - grid->x0 + RAW_GRID_DX / 2) / RAW_GRID_DX, 0, grid->cols - 1);
+            if (r1 < r0) r0 = r1 = COERCE((ycb - grid->y0 + RAW_GRID_DY / 2) / RAW_GRID_DY, 0, grid->rows - 1);
+
+            for (int r = r0; r <= r1; r++)
+            {
+                y = grid->raw_y[r];
+                if (y < raw_info.active_area.y1 || y > raw_info.active_area.y2) continue;
+
+                const struct raw_grid_cell * row = raw_grid_row(grid, r);
+                for (int c = c0; c <= c1; c++)
+                {
+                    x = grid->raw_x[c];
+                    if (x < raw_info.active_area.x1 || x > raw_info.active_area.x2) continue;
+
+                    /* both Bayer blocks of the cell, with 2 greens for each red and blue */
+                    const struct raw_grid_cell * p = &row[c];
+                    raw_luma += (p->r + p->r2 + 2 * (p->g + p->g2) + p->b + p->b2) / 8;
+                    raw_count++;
+                }
+            }
+
+            raw_hist_grid_give();
+        }
+        else
         {
-            if (y < raw_info.active_area.y1 || y > raw_info.active_area.y2) continue;
-            for( x = xcr - dxr ; x <= xcr + dxr ; x++ )
+            for( y = ycr - dxr ; y <= ycr + dxr ; y++ )
             {
-                if (x < raw_info.active_area.x1 || x > raw_info.active_area.x2) continue;
+                if (y < raw_info.active_area.y1 || y > raw_info.active_area.y2) continue;
+                for( x = xcr - dxr ; x <= xcr + dxr ; x++ )
+                {
+                    if (x < raw_info.active_area.x1 || x > raw_info.active_area.x2) continue;
 
-                raw_luma += raw_get_pixel(x, y);
-                raw_count++;
+                    raw_luma += raw_get_pixel(x, y);
+                    raw_count++;
                 
-                /* define this to check if spotmeter reads from the right place;
-                 * you should see some gibberish on raw zebras, right inside the spotmeter box */
-                #ifdef RAW_SPOTMETER_TEST
-                raw_set_pixel(raw_buf, x, y, rand());
-                #endif
+                    /* define this to check if spotmeter reads from the right place;
+                     * you should see some gibberish on raw zebras, right inside the spotmeter box */
+                    #ifdef RAW_SPOTMETER_TEST
+                    raw_set_pixel(raw_buf, x, y, rand());
+                    #endif
+                }
             }
         }
         if (!raw_count) return;
@@ -3063,6 +3019,15 @@ struct menu_entry zebra_menus[] = {
                 .help = "Display warning dots when one color channel is clipped.",
                 .help2 = "Numbers represent the percentage of pixels clipped.",
             },
+            {
+                .name = "Sampling",
+                .priv = &scopes_stride,
+                .max = 3,
+                .choices = CHOICES("Auto", "Every 2px", "Every 4px", "Every 8px"),
+                .help = "Pixels analyzed for histogram, waveform and vectorscope.",
+                .help2 = "Auto: every 2 pixels, every 4 while recording.",
+                .icon_type = IT_DICE,
+            },
             MENU_EOL
         },
     },
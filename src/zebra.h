@@ -68,6 +68,10 @@ int get_last_time_active();
 
 int handle_livev_playback(struct event * event);
 
+/* sampled positions for zebras and false colors (overlay.c) */
+struct overlay_job;
+int zebra_overlay_setup(struct overlay_job * job, int cell_width);
+
 /* focus peaking */
 int is_focus_peaking_enabled();
 int focus_peaking_as_display_filter();
@@ -527,6 +527,13 @@ LIBTCCAPI void tcc_set_error_func(TCCState *s, void *error_opaque,
     s->error_func = error_func;
 }
 
+LIBTCCAPI void tcc_set_reloc_func(TCCState *s, void *reloc_opaque,
+                        void (*reloc_func)(void *opaque, int type, unsigned long addr, unsigned long val))
+{
+    s->reloc_opaque = reloc_opaque;
+    s->reloc_func = reloc_func;
+}
+
 /* error without aborting current compilation */
 PUB_FUNC void tcc_error_noabort(const char *fmt, ...)
 {
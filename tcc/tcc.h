@@ -581,6 +581,10 @@ struct TCCState {
     jmp_buf error_jmp_buf;
     int nb_errors;
 
+    /* called for each relocation applied by tcc_relocate */
+    void *reloc_opaque;
+    void (*reloc_func)(void *opaque, int type, unsigned long addr, unsigned long val);
+
     /* output file for preprocessing (-E) */
     FILE *ppfp;
 
@@ -502,6 +502,8 @@ static addr_t add_jmp_table(TCCState *s1, int val)
     /* ldr pc, [pc, #-4] */
     p[0] = 0xE51FF004;
     p[1] = val;
+    if (s1->reloc_func)
+        s1->reloc_func(s1->reloc_opaque, R_ARM_ABS32, (addr_t)&p[1], val);
     return (addr_t)p;
 }
 #endif
@@ -882,6 +884,8 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s)
 #error unsupported processor
 #endif
         }
+        if (s1->reloc_func)
+            s1->reloc_func(s1->reloc_opaque, type, addr, val);
     }
     /* if the relocation is allocated, we change its symbol table */
     if (sr->sh_flags & SHF_ALLOC)